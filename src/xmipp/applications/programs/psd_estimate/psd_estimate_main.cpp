@@ -26,19 +26,26 @@
 #include "core/xmipp_program.h"
 #include "core/xmipp_filename.h"
 #include "core/xmipp_image.h"
+#include "core/metadata_vec.h"
 #include "reconstruction/psd_estimator.h"
+#include <future>
+#include <memory>
 
 class PSDEstimatorProgram final : public XmippProgram
 {
 private:
     void defineParams() override
     {
-        addParamsLine("-i <input_file>             : Micrograph to be analyzed");
-        addParamsLine("-o <output_file>            : PSD to be stored");
+        addParamsLine("-i <input_file>             : Micrograph to be analyzed, or metadata with micrographs");
+        addParamsLine("-o <output_file>            : PSD to be stored. For metadata input, metadata with the PSDs");
+        addParamsLine("                            : (PSDs are stored next to it, as <micrograph>.psd)");
         addParamsLine("[--overlap <o=0.4>]         : overlap of the patches");
         addParamsLine("[--patches <x=384> <y=384>] :  size of the patches");
         addParamsLine("[--threads <t=4>]           : for FFT");
         addParamsLine("[--skipNormalization]       : if not present, FFT will be centered, and log_10 applied");
+        addParamsLine("[--batch <b=32>]            : number of patches transformed at once");
+        addExampleLine("Estimate the PSD of many micrographs, reusing the FFT plans:", false);
+        addExampleLine("xmipp_psd_estimate -i micrographs.xmd -o psds/psds.xmd");
     }
 
     void readParams() override
@@ -51,15 +58,75 @@ private:
         mDims = Dimensions(x, y);
         mThreads = getIntParam("--threads");
         mNormalize = !checkParam("--skipNormalization");
+        mBatch = getIntParam("--batch");
     }
 
     void run()
     {
-        auto micrograph = Image<float>();
+        if (mIn.isMetaData())
+            processMetadata();
+        else
+        {
+            auto micrograph = Image<float>();
+            auto PSD = Image<float>();
+            micrograph.read(mIn);
+            PSDEstimator<float> estimator(Dimensions(XSIZE(micrograph()), YSIZE(micrograph())),
+                    mDims, mOverlap, mThreads, mBatch);
+            estimator.estimate(micrograph(), PSD(), mNormalize);
+            PSD.write(mOut);
+        }
+    }
+
+    /** Estimate the PSD of all micrographs of the metadata.
+     * The next micrograph is read while the current one is processed,
+     * and the plans are reused as long as the micrographs have the same size.
+     */
+    void processMetadata()
+    {
+        MetaDataVec mdIn;
+        mdIn.read(mIn);
+        auto label = mdIn.containsLabel(MDL_MICROGRAPH) ? MDL_MICROGRAPH : MDL_IMAGE;
+        std::vector<FileName> micrographs;
+        FileName fnMicrograph;
+        for (size_t objId : mdIn.ids())
+        {
+            mdIn.getValue(label, fnMicrograph, objId);
+            micrographs.push_back(fnMicrograph);
+        }
+
+        auto read = [](const FileName &fn) {
+            auto img = std::unique_ptr<Image<float>>(new Image<float>());
+            img->read(fn);
+            return img;
+        };
+        FileName fnDir = mOut.getDir();
+        MetaDataVec mdOut;
+        std::unique_ptr<PSDEstimator<float>> estimator;
+        std::future<std::unique_ptr<Image<float>>> next;
+        if (!micrographs.empty())
+            next = std::async(std::launch::async, read, micrographs[0]);
         auto PSD = Image<float>();
-        micrograph.read(mIn);
-        PSDEstimator<float>::estimatePSD(micrograph(), mOverlap, mDims, PSD(), mThreads, mNormalize);
-        PSD.write(mOut);
+        if (verbose)
+            init_progress_bar(micrographs.size());
+        for (size_t n = 0; n < micrographs.size(); ++n)
+        {
+            auto micrograph = next.get();
+            if (n + 1 < micrographs.size())
+                next = std::async(std::launch::async, read, micrographs[n + 1]);
+            auto dim = Dimensions(XSIZE((*micrograph)()), YSIZE((*micrograph)()));
+            if (!estimator || estimator->getMicrographDim() != dim)
+                estimator.reset(new PSDEstimator<float>(dim, mDims, mOverlap, mThreads, mBatch));
+            estimator->estimate((*micrograph)(), PSD(), mNormalize);
+
+            FileName fnPSD = fnDir + micrographs[n].getBaseName() + ".psd";
+            PSD.write(fnPSD);
+            size_t objId = mdOut.addObject();
+            mdOut.setValue(MDL_MICROGRAPH, micrographs[n], objId);
+            mdOut.setValue(MDL_PSD, fnPSD, objId);
+            if (verbose)
+                progress_bar(n + 1);
+        }
+        mdOut.write(mOut);
     }
 
     unsigned mThreads;
@@ -68,6 +135,7 @@ private:
     FileName mIn;
     FileName mOut;
     bool mNormalize;
+    size_t mBatch;
 };
 
 RUN_XMIPP_PROGRAM(PSDEstimatorProgram)
\ No newline at end of file
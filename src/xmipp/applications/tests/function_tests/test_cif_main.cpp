@@ -108,4 +108,41 @@ TEST_F(CIFTest, writeFile)
 
     // Attempting to remove produced file
     remove(writePath.c_str());
-}
\ No newline at end of file
+}
+TEST_F(CIFTest, readCompactFile)
+{
+    // Reading compressed file (through PDBRichPhantom) and uncompressed file (streamed)
+    PDBRichPhantom pdb;
+    FileName fileName(readPath);
+    pdb.read(fileName);
+    pdb.write(writePath);
+
+    PDBCompactPhantom compactGz, compact;
+    compactGz.read(fileName);
+    compact.read(writePath);
+    remove(writePath.c_str());
+
+    // Both must have the same atoms as the rich phantom
+    ASSERT_EQ(compactGz.getNumberOfAtoms(), pdb.getNumberOfAtoms());
+    ASSERT_EQ(compact.getNumberOfAtoms(), pdb.getNumberOfAtoms());
+    for (size_t i = 0; i < pdb.getNumberOfAtoms(); i++)
+    {
+        const RichAtom &atom = pdb.atomList[i];
+        for (const PDBCompactPhantom *p : { &compactGz, &compact })
+        {
+            ASSERT_FLOAT_EQ(p->x[i], atom.x);
+            ASSERT_FLOAT_EQ(p->y[i], atom.y);
+            ASSERT_FLOAT_EQ(p->z[i], atom.z);
+            ASSERT_FLOAT_EQ(p->bfactor[i], atom.bfactor);
+            ASSERT_EQ(p->getName(i), atom.name);
+            ASSERT_EQ(p->getElement(i), atom.atomType);
+            ASSERT_EQ(p->residues[p->residueIdx[i]], atom.resname);
+            ASSERT_EQ(p->chains[p->chainIdx[i]], atom.altloc);
+            ASSERT_EQ(p->hetatm[i] != 0, atom.record == "HETATM");
+        }
+    }
+
+    // Strings are stored once
+    ASSERT_LT(compact.residues.size(), 30);
+    ASSERT_EQ(compact.chains.size(), compactGz.chains.size());
+}
@@ -5,6 +5,8 @@
 #include <data/transform_downsample.h>
 #include <gtest/gtest.h>
 #include <data/ctf.h>
+#include <data/ctf_image_cache.h>
+#include <data/fourier_filter.h>
 
 // MORE INFO HERE: http://code.google.com/p/googletest/wiki/AdvancedGuide
 // This test is named "Size", and belongs to the "MetadataTest"
@@ -148,3 +150,172 @@ TEST_F( CtfTest, phaseFlip)
     EXPECT_NEAR(devval,0.003906,0.0001);
     EXPECT_NEAR(maxval,0.017565,0.0001);
 }
+
+TEST_F( CtfTest, getValuesAt)
+{
+    CTFDescription ctf;
+    ctf.enable_CTFnoise=true;
+    ctf.Tm=1.5;
+    ctf.kV=300;
+    ctf.DeltafU=18000;
+    ctf.DeltafV=15000;
+    ctf.azimuthal_angle=30;
+    ctf.Cs=2;
+    ctf.Q0=0.1;
+    ctf.K=1;
+    ctf.base_line=0.1;
+    ctf.gaussian_K=2;
+    ctf.sigmaU=ctf.sigmaV=5000;
+    ctf.cU=0.05;
+    ctf.cV=0.07;
+    ctf.gaussian_angle=60;
+    ctf.sqrt_K=1;
+    ctf.sqU=4;
+    ctf.sqV=6;
+    ctf.sqrt_angle=10;
+    ctf.produceSideInfo();
+
+    // per pixel evaluation, including the origin
+    CTFFrequencyList freqs;
+    std::vector<double> bg, E, ctfNoDamping;
+    for (int i=-20; i<=20; i+=5)
+        for (int j=-20; j<=20; j+=5)
+        {
+            double X=j/100.0;
+            double Y=i/100.0;
+            freqs.add(X, Y);
+            ctf.precomputeValues(X, Y);
+            bg.push_back(ctf.getValueNoiseAt());
+            E.push_back(ctf.getValueDampingAt());
+            ctfNoDamping.push_back(ctf.getValuePureWithoutDampingAt());
+        }
+
+    std::vector<double> bgB(freqs.size()), EB(freqs.size()), ctfNoDampingB(freqs.size());
+    ctf.getValuesAt(freqs, bgB.data(), EB.data(), ctfNoDampingB.data());
+    for (size_t k=0; k<freqs.size(); ++k)
+    {
+        EXPECT_NEAR(bg[k], bgB[k], 1e-9);
+        EXPECT_NEAR(E[k], EB[k], 1e-9);
+        EXPECT_NEAR(ctfNoDamping[k], ctfNoDampingB[k], 1e-9);
+    }
+
+    // the image generated from the cached grid matches the pixel by pixel evaluation
+    MultidimArray<double> img;
+    ctf.generateCTF(64, 64, img);
+    for (int i=0; i<64; ++i)
+        for (int j=0; j<64; ++j)
+        {
+            double wx, wy;
+            FFT_IDX2DIGFREQ(i, 64, wy);
+            FFT_IDX2DIGFREQ(j, 64, wx);
+            ctf.precomputeValues(wx/ctf.Tm, wy/ctf.Tm);
+            EXPECT_NEAR(ctf.getValueAt(), A2D_ELEM(img, i, j), 1e-9);
+        }
+}
+
+TEST_F( CtfTest, imageCache)
+{
+    CTFDescription ctf;
+    ctf.enable_CTFnoise=false;
+    ctf.Tm=1.5;
+    ctf.kV=300;
+    ctf.DeltafU=18000;
+    ctf.DeltafV=15000;
+    ctf.azimuthal_angle=30;
+    ctf.Cs=2;
+    ctf.Q0=0.1;
+    ctf.K=1;
+    ctf.produceSideInfo();
+
+    CTFImageCache<double> cache;
+    auto img=cache.getImage(ctf, 64, 64);
+    MultidimArray<double> expected;
+    ctf.generateCTF(64, 64, expected);
+    ASSERT_EQ(MULTIDIM_SIZE(expected), MULTIDIM_SIZE(*img));
+    FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(expected)
+        EXPECT_NEAR(DIRECT_MULTIDIM_ELEM(expected,n), DIRECT_MULTIDIM_ELEM(*img,n), 1e-9);
+
+    // a defocus within the quantization step reuses the image
+    CTFDescription ctf2=ctf;
+    ctf2.DeltafU+=0.2;
+    ctf2.produceSideInfo();
+    EXPECT_EQ(img, cache.getImage(ctf2, 64, 64));
+    // other size, type or parameters do not
+    EXPECT_NE(img, cache.getImage(ctf, 32, 32));
+    EXPECT_NE(img, cache.getImage(ctf, 64, 64, -1, true));
+    ctf2.Cs=2.7;
+    ctf2.produceSideInfo();
+    EXPECT_NE(img, cache.getImage(ctf2, 64, 64));
+    EXPECT_EQ(1u, cache.getHits());
+    EXPECT_EQ(4u, cache.getMisses());
+    EXPECT_NEAR(0.2, cache.getHitRate(), 1e-9);
+
+    // the Fourier mask is the one of FourierFilter
+    MultidimArray<double> I(64, 64);
+    FourierFilter filter;
+    filter.FilterBand=filter.FilterShape=CTF;
+    filter.ctf=ctf;
+    filter.generateMask(I);
+    auto mask=cache.getFourierMask(ctf, 64, 64);
+    ASSERT_EQ(YSIZE(filter.maskFourierd), YSIZE(*mask));
+    ASSERT_EQ(XSIZE(filter.maskFourierd), XSIZE(*mask));
+    FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(*mask)
+        EXPECT_NEAR(DIRECT_MULTIDIM_ELEM(filter.maskFourierd,n), DIRECT_MULTIDIM_ELEM(*mask,n), 1e-9);
+
+    // float variant
+    CTFImageCache<float> cacheFloat;
+    auto imgFloat=cacheFloat.getImage(ctf, 64, 64);
+    FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(expected)
+        EXPECT_NEAR(DIRECT_MULTIDIM_ELEM(expected,n), DIRECT_MULTIDIM_ELEM(*imgFloat,n), 1e-5);
+
+    // the least recently used image is evicted, images in use remain valid
+    CTFImageCache<double> small(2*64*64*sizeof(double));
+    auto first=small.getImage(ctf, 64, 64);
+    small.getImage(ctf2, 64, 64);
+    small.getImage(ctf, 64, 64);
+    small.getImage(ctf, 64, 64, -1, true);
+    EXPECT_EQ(first, small.getImage(ctf, 64, 64));
+    EXPECT_EQ(2u, small.getHits());
+    small.getImage(ctf2, 64, 64);
+    small.getImage(ctf, 64, 64, -1, true);
+    EXPECT_EQ(2u, small.getHits());
+    EXPECT_NE(first, small.getImage(ctf, 64, 64));
+    EXPECT_EQ(64u, XSIZE(*first));
+}
+
+TEST_F( CtfTest, phaseFlipMask)
+{
+    CTFDescription ctf;
+    ctf.enable_CTFnoise=false;
+    ctf.Tm=1.5;
+    ctf.kV=300;
+    ctf.DeltafU=18000;
+    ctf.DeltafV=15000;
+    ctf.azimuthal_angle=30;
+    ctf.Cs=2;
+    ctf.Q0=0.1;
+    ctf.K=1;
+    ctf.produceSideInfo();
+
+    // the mask of the downsampled image uses its sampling rate
+    CTFImageCache<double> cache;
+    auto mask=cache.getPhaseFlipMask(ctf, 64, 48, 2*ctf.Tm);
+    ASSERT_EQ(64u, YSIZE(*mask));
+    ASSERT_EQ(25u, XSIZE(*mask));
+    size_t flipped=0;
+    for (size_t i=0; i<YSIZE(*mask); i++)
+        for (size_t j=0; j<XSIZE(*mask); j++)
+        {
+            double wx, wy;
+            FFT_IDX2DIGFREQ(j, 48, wx);
+            FFT_IDX2DIGFREQ(i, 64, wy);
+            ctf.precomputeValues(wx/(2*ctf.Tm), wy/(2*ctf.Tm));
+            double expected=ctf.getValuePureWithoutDampingAt()<0 ? -1 : 1;
+            EXPECT_EQ(expected, DIRECT_A2D_ELEM(*mask,i,j));
+            if (expected<0)
+                flipped++;
+        }
+    EXPECT_GT(flipped, 0u);
+    EXPECT_EQ(mask, cache.getPhaseFlipMask(ctf, 64, 48, 2*ctf.Tm));
+    EXPECT_NE(mask, cache.getPhaseFlipMask(ctf, 64, 48));
+}
@@ -0,0 +1,82 @@
+#include <core/multidim_array.h>
+#include <core/transformations.h>
+#include <data/fourier_projection.h>
+#include <iostream>
+#include <gtest/gtest.h>
+
+class FourierProjectionTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        // Off-centered blob so that projections depend on the direction
+        V.initZeros(32,32,32);
+        V.setXmippOrigin();
+        FOR_ALL_ELEMENTS_IN_ARRAY3D(V)
+        {
+            double r2=(k-3)*(k-3)+(i+2)*(i+2)+(j-5)*(j-5);
+            A3D_ELEM(V,k,i,j)=exp(-r2/20.0);
+        }
+        rot={0.0, 30.0, 75.0, 120.0, 200.0};
+        tilt={0.0, 45.0, 90.0, 10.0, 160.0};
+        psi={0.0, 15.0, 60.0, 270.0, 5.0};
+    }
+
+    void checkBatch(int degree)
+    {
+        MultidimArray<double> Vcopy=V;
+        FourierProjector projector(Vcopy,2,0.5,degree);
+        MultidimArray<double> stack;
+        // A block size smaller than the number of directions tests the last block
+        projector.projectBatch(rot,tilt,psi,stack,nullptr,2);
+        ASSERT_EQ(NSIZE(stack),rot.size());
+        for (size_t n=0; n<rot.size(); ++n)
+        {
+            projector.project(rot[n],tilt[n],psi[n]);
+            const MultidimArray<double> &P=projector.projection();
+            double maxP=P.computeMax();
+            FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(P)
+                EXPECT_NEAR(DIRECT_A2D_ELEM(P,i,j),DIRECT_NZYX_ELEM(stack,n,0,i,j),1e-4*maxP);
+        }
+    }
+
+    MultidimArray<double> V;
+    std::vector<double> rot, tilt, psi;
+};
+
+TEST_F(FourierProjectionTest, projectBatchNearest)
+{
+    checkBatch(xmipp_transformation::NEAREST);
+}
+
+TEST_F(FourierProjectionTest, projectBatchLinear)
+{
+    checkBatch(xmipp_transformation::LINEAR);
+}
+
+TEST_F(FourierProjectionTest, projectBatchBSpline)
+{
+    checkBatch(xmipp_transformation::BSPLINE3);
+}
+
+TEST_F(FourierProjectionTest, projectBatchCTF)
+{
+    MultidimArray<double> Vcopy=V;
+    FourierProjector projector(Vcopy,2,0.5,xmipp_transformation::BSPLINE3);
+    MultidimArray<double> ctf;
+    ctf.initZeros(projector.projectionFourier);
+    FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(ctf)
+        DIRECT_A2D_ELEM(ctf,i,j)=cos(0.1*(i+j));
+    std::vector<const MultidimArray<double>*> ctfs={&ctf, nullptr, &ctf, nullptr, &ctf};
+
+    MultidimArray<double> stack;
+    projector.projectBatch(rot,tilt,psi,stack,&ctfs);
+    for (size_t n=0; n<rot.size(); ++n)
+    {
+        projector.project(rot[n],tilt[n],psi[n],ctfs[n]);
+        const MultidimArray<double> &P=projector.projection();
+        double maxP=P.computeMax();
+        FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(P)
+            EXPECT_NEAR(DIRECT_A2D_ELEM(P,i,j),DIRECT_NZYX_ELEM(stack,n,0,i,j),1e-4*maxP);
+    }
+}
@@ -11,6 +11,7 @@
 #include <sys/time.h>
 #include "core/metadata_vec.h"
 #include "core/metadata_db.h"
+#include "data/metadata_serializer.h"
 
 #define N_ROWS_TEST 2
 #define N_ROWS_PERFORMANCE_TEST 8000
@@ -1345,3 +1346,37 @@ TEST_F(MetadataTest, selectPart)
         EXPECT_EQ(part.getColumnValues<double>(MDL_X), (std::vector<double>{0., 1.}));
     }
 }
+
+TEST_F(MetadataTest, serializeAndDeserialize)
+{
+    MetaDataVec orig;
+    for (size_t i = 0; i < 3; i++) {
+        MDRowVec row;
+        row.setValue(MDL_X, static_cast<double>(i));
+        row.setValue(MDL_REF, static_cast<int>(i));
+        row.setValue(MDL_ITEM_ID, i);
+        row.setValue(MDL_ENABLED, 1);
+        row.setValue(MDL_FLIP, i % 2 == 0);
+        row.setValue(MDL_IMAGE, formatString("%lu@particles.stk", i + 1));
+        row.setValue(MDL_CLASSIFICATION_DATA, std::vector<double>(i, 0.5));
+        orig.addRow(row);
+    }
+
+    std::vector<char> buffer;
+    MetaDataSerializer::serialize(orig, buffer);
+
+    MetaDataVec result;
+    MetaDataSerializer::deserialize(buffer.data(), buffer.size(), result);
+    EXPECT_EQ(orig, result);
+
+    // Rows are appended and Db metadatas can also be serialized
+    MetaDataDb origDb(mDsource);
+    MetaDataSerializer::serialize(origDb, buffer);
+    MetaDataVec appended(mDsource);
+    MetaDataSerializer::deserialize(buffer.data(), buffer.size(), appended);
+    EXPECT_EQ(appended.size(), 2 * mDsource.size());
+    EXPECT_EQ(appended.getColumnValues<double>(MDL_X), (std::vector<double>{1., 3., 1., 3.}));
+
+    // Truncated buffers are detected
+    EXPECT_THROW(MetaDataSerializer::deserialize(buffer.data(), buffer.size() - 1, result), XmippError);
+}
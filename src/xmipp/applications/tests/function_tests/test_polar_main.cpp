@@ -2,6 +2,7 @@
 #include <data/filters.h>
 #include <core/xmipp_fftw.h>
 #include <data/polar.h>
+#include <data/polar_fourier_bank.h>
 #include <iostream>
 #include <gtest/gtest.h>
 // MORE INFO HERE: http://code.google.com/p/googletest/wiki/AdvancedGuide
@@ -38,3 +39,46 @@ TEST_F( PolarTest, computeAverageAndStddev)
     EXPECT_NEAR(mean,1.886528450043468,XMIPP_EQUAL_ACCURACY);
     EXPECT_NEAR(stddev,0.49643800057938808,XMIPP_EQUAL_ACCURACY);
 }
+
+TEST_F( PolarTest, fourierBankCorrelation)
+{
+    MultidimArray<double> I(32,32), Iref(32,32), Maux;
+    I.initRandom(0,1);
+    Iref.initRandom(0,1);
+    I.setXmippOrigin();
+    Iref.setXmippOrigin();
+
+    Polar<double> P, Pref;
+    Polar<std::complex<double> > fP, fPref;
+    Polar_fftw_plans plans;
+    produceSplineCoefficients(xmipp_transformation::BSPLINE3,Maux,I);
+    P.getPolarFromCartesianBSpline(Maux,1,14);
+    P.calculateFftwPlans(plans);
+    fourierTransformRings(P,fP,plans,false);
+    produceSplineCoefficients(xmipp_transformation::BSPLINE3,Maux,Iref);
+    Pref.getPolarFromCartesianBSpline(Maux,1,14);
+    fourierTransformRings(Pref,fPref,plans,true);
+
+    MultidimArray<double> corr, angles;
+    RotationalCorrelationAux aux;
+    corr.resize(P.getSampleNoOuterRing());
+    aux.local_transformer.setReal(corr);
+    aux.local_transformer.FourierTransform();
+    rotationalCorrelation(fP,fPref,angles,aux);
+    const MultidimArray<double> &expected = aux.local_transformer.getReal();
+    size_t N = XSIZE(expected);
+
+    // The same reference twice, in a bank with more slots
+    PolarFourierBank bank;
+    bank.initialize(fP, N, 3);
+    bank.set(0, fP);
+    bank.set(2, fPref, 0.5);
+    size_t slots[2] = {2, 2};
+    std::vector<float> bankCorr(2 * N);
+    PolarFourierBankAux bankAux;
+    bank.correlate(fP, slots, 2, 2., &bankCorr[0], bankAux);
+
+    double tolerance = 1e-4 * expected.computeMax();
+    for (size_t i = 0; i < 2 * N; i++)
+        EXPECT_NEAR(bankCorr[i], DIRECT_A1D_ELEM(expected, i % N), tolerance);
+}
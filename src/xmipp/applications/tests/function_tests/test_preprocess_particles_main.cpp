@@ -0,0 +1,147 @@
+#include <core/metadata_vec.h>
+#include <core/multidim_array.h>
+#include <core/transformations.h>
+#include <data/ctf.h>
+#include <data/fourier_filter.h>
+#include <data/mask.h>
+#include <data/normalize.h>
+#include <reconstruction/ctf_phase_flip.h>
+#include <reconstruction/preprocess_particles.h>
+#include <iostream>
+#include <gtest/gtest.h>
+
+class PreprocessParticlesTest : public ::testing::Test
+{
+protected:
+    // Program with the default parameters of the command line
+    class Program: public ProgPreprocessParticles
+    {
+    public:
+        Program(size_t dim, const std::vector<Operation> &ops)
+        {
+            operations=ops;
+            inputDim=dim;
+            outputDim=-1;
+            w1=0;
+            w2=0.5;
+            raisedW=0.02;
+            sampling=-1;
+            normalization=OLDXMIPP;
+            backgroundRadius=-1;
+            maskRadius=-1;
+            maskValue=0;
+        }
+    };
+
+    virtual void SetUp()
+    {
+        init_random_generator(23);
+        I.initZeros(dim,dim);
+        I.initRandom(0,1,RND_GAUSSIAN);
+        I.setXmippOrigin();
+        // Off-centered blob on a non-zero background
+        FOR_ALL_ELEMENTS_IN_ARRAY2D(I)
+        {
+            double r2=(i-6)*(i-6)+(j+10)*(j+10);
+            A2D_ELEM(I,i,j)+=5*exp(-r2/18.0)+2;
+        }
+
+        ctf.enable_CTFnoise=false;
+        ctf.Tm=1.5;
+        ctf.kV=300;
+        ctf.DeltafU=18000;
+        ctf.DeltafV=15000;
+        ctf.azimuthal_angle=30;
+        ctf.Cs=2;
+        ctf.Q0=0.1;
+        ctf.K=1;
+        ctf.produceSideInfo();
+        ctf.setRow(row);
+    }
+
+    static const int dim=64;
+    MultidimArray<double> I;
+    CTFDescription ctf;
+    MDRowVec row;
+};
+
+TEST_F(PreprocessParticlesTest, fusedMatchesSeparateOperators)
+{
+    const int dimOut=32;
+    const double w1=0.02, w2=0.2, radius=12, outside=-0.5;
+    Program prm(dim, {ProgPreprocessParticles::BANDPASS, ProgPreprocessParticles::DOWNSAMPLE,
+                      ProgPreprocessParticles::PHASEFLIP, ProgPreprocessParticles::NORMALIZE,
+                      ProgPreprocessParticles::MASK});
+    prm.outputDim=dimOut;
+    prm.w1=w1;
+    prm.w2=w2;
+    prm.maskRadius=radius;
+    prm.maskValue=outside;
+    prm.prepareThreads(1);
+    const MultidimArray<double> &fused=prm.preprocessParticle(0,I,row);
+
+    // The same operations, one after another, as the separate programs do.
+    // The band-pass removes the frequencies close to the new Nyquist, so
+    // that any Fourier cropping gives the same downsampled image.
+    MultidimArray<double> expected=I;
+    FourierFilter filter;
+    filter.FilterShape=RAISED_COSINE;
+    filter.FilterBand=BANDPASS;
+    filter.w1=w1;
+    filter.w2=w2;
+    filter.raised_w=0.02;
+    filter.generateMask(expected);
+    filter.applyMaskSpace(expected);
+
+    selfScaleToSizeFourier(dimOut,dimOut,expected,1);
+
+    CTFDescription ctfDown=ctf;
+    ctfDown.Tm*=(double)dim/dimOut;
+    ctfDown.produceSideInfo();
+    actualPhaseFlip(expected,ctfDown);
+
+    normalize_OldXmipp(expected);
+
+    expected.setXmippOrigin();
+    Mask mask;
+    mask.type=BINARY_CIRCULAR_MASK;
+    mask.mode=INNER_MASK;
+    mask.R1=radius;
+    mask.generate_mask(expected);
+    mask.apply_mask(expected,expected,outside);
+
+    ASSERT_TRUE(fused.sameShape(expected));
+    FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(expected)
+        EXPECT_NEAR(DIRECT_MULTIDIM_ELEM(expected,n),DIRECT_MULTIDIM_ELEM(fused,n),1e-6);
+}
+
+TEST_F(PreprocessParticlesTest, parsevalStatisticsAfterEvenDownsample)
+{
+    // The noise reaches the Nyquist frequency, so the Nyquist row and column
+    // of the cropped spectrum contribute to the statistics
+    for (int dimOut : {32, 40})
+    {
+        Program down(dim, {ProgPreprocessParticles::DOWNSAMPLE});
+        down.outputDim=dimOut;
+        down.prepareThreads(1);
+        MultidimArray<double> expected=down.preprocessParticle(0,I,row);
+        double avg, stddev;
+        expected.computeAvgStdev(avg,stddev);
+        ASSERT_GT(stddev,0);
+        normalize_OldXmipp(expected);
+
+        // Normalized with the average and standard deviation of the spectrum
+        Program fused(dim, {ProgPreprocessParticles::DOWNSAMPLE, ProgPreprocessParticles::NORMALIZE});
+        fused.outputDim=dimOut;
+        fused.prepareThreads(1);
+        MultidimArray<double> result=fused.preprocessParticle(0,I,row);
+        double avgFused, stddevFused;
+        result.computeAvgStdev(avgFused,stddevFused);
+        EXPECT_NEAR(0,avgFused,1e-9);
+        EXPECT_NEAR(1,stddevFused,1e-9);
+
+        ASSERT_TRUE(result.sameShape(expected));
+        FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(expected)
+            EXPECT_NEAR(DIRECT_MULTIDIM_ELEM(expected,n),DIRECT_MULTIDIM_ELEM(result,n),1e-9);
+    }
+}
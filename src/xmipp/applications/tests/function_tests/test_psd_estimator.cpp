@@ -168,6 +168,31 @@ TYPED_TEST_P( PSD_Estimator_Test, windowCoords)
     }
 }
 
+TYPED_TEST_P( PSD_Estimator_Test, batchedEstimate)
+{
+    // patches do not fill the last batch
+    auto dim = Dimensions(300, 200);
+    auto patch = Dimensions(64, 64);
+    MultidimArray<TypeParam> micrograph(dim.y(), dim.x());
+    micrograph.initRandom(0, 1);
+
+    MultidimArray<TypeParam> expected;
+    PSDEstimator<TypeParam> single(dim, patch, 0.4f, 1, 1);
+    single.estimate(micrograph, expected, true);
+
+    PSDEstimator<TypeParam> batched(dim, patch, 0.4f, 1, 7);
+    MultidimArray<TypeParam> psd;
+    // the estimator is reused, so the second call must not see the first one
+    for (int run = 0; run < 2; ++run) {
+        batched.estimate(micrograph, psd, true);
+        ASSERT_EQ(XSIZE(expected), XSIZE(psd));
+        ASSERT_EQ(YSIZE(expected), YSIZE(psd));
+        FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(psd) {
+            EXPECT_NEAR(DIRECT_MULTIDIM_ELEM(expected, n), DIRECT_MULTIDIM_ELEM(psd, n), 1e-3);
+        }
+    }
+}
+
 TYPED_TEST_P( PSD_Estimator_Test, half2whole)
 {
     // even even (small)
@@ -196,6 +221,7 @@ TYPED_TEST_P( PSD_Estimator_Test, half2whole)
 
 REGISTER_TYPED_TEST_SUITE_P(PSD_Estimator_Test,
     windowCoords,
+    batchedEstimate,
     half2whole
 );
 
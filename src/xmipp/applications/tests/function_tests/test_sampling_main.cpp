@@ -1,4 +1,5 @@
 #include "data/sampling.h"
+#include "data/spherical_index.h"
 
 #include <iostream>
 #include <gtest/gtest.h>
@@ -177,3 +178,52 @@ TEST_F(SamplingTest, computeNeighborsC1)
     //    s2.saveSamplingFile(fn_root + "/tmp/ref_c1_computeNeighborsC1");
     EXPECT_EQ(s1, s2);
 }
+
+TEST_F(SamplingTest, computeNeighborsThreadsI3H)
+{
+    std::vector<std::vector<size_t> > neighbors;
+    for (bool only_winner : {false, true})
+    {
+        mysampling.numThreads = 1;
+        mysampling.computeNeighbors(only_winner);
+        neighbors = mysampling.my_neighbors;
+        mysampling.numThreads = 3;
+        mysampling.computeNeighbors(only_winner);
+        EXPECT_EQ(neighbors, mysampling.my_neighbors);
+    }
+}
+
+TEST_F(SamplingTest, sphericalIndex)
+{
+    const std::vector<Matrix1D<double> > &points = mysampling.no_redundant_sampling_points_vector;
+    SphericalIndex index(SphericalIndex::cellSizeFor(DEG2RAD(5.), DEG2RAD(3.)));
+    index.build(points);
+    ASSERT_EQ(points.size(), index.size());
+
+    std::vector<size_t> found, expected;
+    for (const auto &u : mysampling.exp_data_projection_direction_by_L_R)
+    {
+        for (double minDot : {cos(DEG2RAD(5.)), cos(DEG2RAD(40.)), -2.})
+        {
+            expected.clear();
+            for (size_t i = 0; i < points.size(); ++i)
+                if (dotProduct(points[i], u) > minDot)
+                    expected.push_back(i);
+            index.findWithin(u, minDot, found);
+            EXPECT_EQ(expected, found);
+            EXPECT_EQ(!expected.empty(), index.anyWithin(u, minDot));
+        }
+
+        int closest = -1;
+        double closestDot = -2;
+        for (size_t i = 0; i < points.size(); ++i)
+            if (dotProduct(points[i], u) > closestDot)
+            {
+                closestDot = dotProduct(points[i], u);
+                closest = i;
+            }
+        double dot;
+        EXPECT_EQ(closest, index.findClosest(u, &dot));
+        EXPECT_DOUBLE_EQ(closestDot, dot);
+    }
+}
@@ -80,10 +80,10 @@ PyMethodDef Image_methods[] =
         { "write", (PyCFunction) Image_write, METH_VARARGS,
           "Write image to disk" },
         { "getData", (PyCFunction) Image_getData, METH_VARARGS,
-          "Return NumPy array from image data" },
+          "Return NumPy array from image data. getData(False) returns a view of the image memory" },
 
         { "setData", (PyCFunction) Image_setData, METH_VARARGS,
-          "Copy NumPy array to image data" },
+          "Copy NumPy array to image data. setData(array, False) aliases the array memory" },
         { "getPixel", (PyCFunction) Image_getPixel, METH_VARARGS,
           "Return a pixel value" },
         { "initConstant", (PyCFunction) Image_initConstant, METH_VARARGS,
@@ -204,7 +204,10 @@ PyTypeObject ImageType = {
 /* Destructor */
 void Image_dealloc(ImageObject* self)
 {
+    // The image may alias the memory of this array, release it after the image
+    PyObject *dataOwner = self->dataOwner;
     self->~ImageObject(); // Call the destructor
+    Py_XDECREF(dataOwner);
     Py_TYPE(self)->tp_free((PyObject*)self);
 }//function Image_dealloc
 
@@ -604,11 +607,13 @@ PyObject *
 Image_getData(PyObject *obj, PyObject *args, PyObject *kwargs)
 {
     const auto *self = reinterpret_cast<ImageObject*>(obj);
+    PyObject *pyCopy = nullptr;
 
-    if (self != nullptr)
+    if (self != nullptr && PyArg_ParseTuple(args, "|O", &pyCopy))
     {
         try
         {
+            bool copy = (pyCopy == nullptr) || PyObject_IsTrue(pyCopy);
             ArrayDim adim;
             ImageGeneric & image = Image_Value(self);
             DataType dt = image.getDatatype();
@@ -623,9 +628,26 @@ Image_getData(PyObject *obj, PyObject *args, PyObject *kwargs)
             void *mymem = image().getArrayPointer();
             NPY_TYPES type = datatype2NpyType(dt);
             //dims pointer is shifted if ndim or zdim are 1
-            PyArrayObject * arr = (PyArrayObject*) PyArray_SimpleNew(nd, dims+4-nd, type);
-            void * data = PyArray_DATA(arr);
-            memcpy(data, mymem, adim.nzyxdim * gettypesize(dt));
+            PyArrayObject * arr;
+            if (copy)
+            {
+                arr = (PyArrayObject*) PyArray_SimpleNew(nd, dims+4-nd, type);
+                void * data = PyArray_DATA(arr);
+                memcpy(data, mymem, adim.nzyxdim * gettypesize(dt));
+            }
+            else
+            {
+                // View on the image memory, the image is kept alive as base
+                arr = (PyArrayObject*) PyArray_SimpleNewFromData(nd, dims+4-nd, type, mymem);
+                if (arr == nullptr)
+                    return nullptr;
+                Py_INCREF(obj);
+                if (PyArray_SetBaseObject(arr, obj) < 0)
+                {
+                    Py_DECREF(arr);
+                    return nullptr;
+                }
+            }
 
             return (PyObject*)arr;
         }
@@ -639,18 +661,50 @@ Image_getData(PyObject *obj, PyObject *args, PyObject *kwargs)
 
 
 
+/* Make a MultidimArray point to external memory without taking ownership */
+template<typename T>
+void aliasExternalData(MultidimArrayGeneric &mdag, void *data, const ArrayDim &adim)
+{
+    MultidimArray<T> *ptr = nullptr;
+    mdag.getMultidimArrayPointer(ptr);
+    ptr->clear();
+    ptr->data = static_cast<T*>(data);
+    ptr->destroyData = false;
+    ptr->setDimensions(adim.xdim, adim.ydim, adim.zdim, adim.ndim);
+    ptr->nzyxdimAlloc = ptr->nzyxdim;
+}
+
+/* Detach a MultidimArray from external memory set by aliasExternalData */
+template<typename T>
+void releaseExternalData(MultidimArrayGeneric &mdag)
+{
+    MultidimArray<T> *ptr = nullptr;
+    mdag.getMultidimArrayPointer(ptr);
+    ptr->clear();
+}
+
 /* setData */
 PyObject *
 Image_setData(PyObject *obj, PyObject *args, PyObject *kwargs)
 {
-    const auto *self = reinterpret_cast<ImageObject*>(obj);
+    auto *self = reinterpret_cast<ImageObject*>(obj);
     PyArrayObject * arr = nullptr;
+    PyObject *pyCopy = nullptr;
 
-    if (self != nullptr && PyArg_ParseTuple(args, "O", &arr))
+    if (self != nullptr && PyArg_ParseTuple(args, "O|O", &arr, &pyCopy))
     {
         try
         {
+            bool copy = (pyCopy == nullptr) || PyObject_IsTrue(pyCopy);
             ImageGeneric & image = Image_Value(self);
+            PyObject *oldOwner = self->dataOwner;
+            if (oldOwner != nullptr)
+            {
+                // Never write into (or keep) the previously aliased buffer
+#define RELEASEDATA(type) releaseExternalData<type>(MULTIDIM_ARRAY_GENERIC(image));
+                SWITCHDATATYPE(image.getDatatype(), RELEASEDATA);
+#undef RELEASEDATA
+            }
             DataType dt = npyType2Datatype(PyArray_TYPE(arr));
             int nd = PyArray_NDIM(arr);
             //Setup of image
@@ -660,11 +714,32 @@ Image_setData(PyObject *obj, PyObject *args, PyObject *kwargs)
             adim.zdim = (nd > 2 ) ? PyArray_DIM(arr, nd - 3) : 1;
             adim.ydim = PyArray_DIM(arr, nd - 2);
             adim.xdim = PyArray_DIM(arr, nd - 1);
-
-            MULTIDIM_ARRAY_GENERIC(image).resize(adim, false);
-            void *mymem = image().getArrayPointer();
-            void * data = PyArray_DATA(arr);
-            memcpy(mymem, data, adim.nzyxdim * gettypesize(dt));
+            adim.yxdim = adim.ydim * adim.xdim;
+            adim.zyxdim = adim.zdim * adim.yxdim;
+            adim.nzyxdim = adim.ndim * adim.zyxdim;
+
+            // Aliasing is only possible if the array memory has the image layout
+            bool alias = !copy && PyArray_IS_C_CONTIGUOUS(arr) &&
+                         PyArray_ISALIGNED(arr) && PyArray_ISWRITEABLE(arr) &&
+                         PyArray_ISNOTSWAPPED(arr);
+            if (alias)
+            {
+                void * data = PyArray_DATA(arr);
+#define ALIASDATA(type) aliasExternalData<type>(MULTIDIM_ARRAY_GENERIC(image), data, adim);
+                SWITCHDATATYPE(dt, ALIASDATA);
+#undef ALIASDATA
+                Py_INCREF((PyObject*)arr);
+                self->dataOwner = (PyObject*)arr;
+            }
+            else
+            {
+                MULTIDIM_ARRAY_GENERIC(image).resize(adim, false);
+                void *mymem = image().getArrayPointer();
+                void * data = PyArray_DATA(arr);
+                memcpy(mymem, data, adim.nzyxdim * gettypesize(dt));
+                self->dataOwner = nullptr;
+            }
+            Py_XDECREF(oldOwner);
             Py_RETURN_NONE;
         }
         catch (XmippError &xe)
@@ -48,6 +48,9 @@ typedef struct
 {
     PyObject_HEAD
     std::unique_ptr<ImageGeneric> image;
+    /* NumPy array whose buffer is aliased by image (setData with copy=False),
+     * nullptr when the image owns its data */
+    PyObject *dataOwner;
 }
 ImageObject;
 
@@ -103,7 +106,9 @@ NPY_TYPES datatype2NpyType(DataType dt);
 
 DataType npyType2Datatype(int npy);
 
-/* getData */
+/* getData: getData(copy=True). With copy=False the returned array is a
+ * view of the image memory that keeps the image alive. The view must not
+ * be used after the image is resized or read again. */
 PyObject *
 Image_getData(PyObject *obj, PyObject *args, PyObject *kwargs);
 
@@ -111,7 +116,9 @@ Image_getData(PyObject *obj, PyObject *args, PyObject *kwargs);
 PyObject *
 Image_projectVolumeDouble(PyObject *obj, PyObject *args, PyObject *kwargs);
 
-/* setData */
+/* setData: setData(array, copy=True). With copy=False the image aliases
+ * the array buffer (if it is C-contiguous, aligned and writeable) and
+ * keeps a reference to it; otherwise the data is copied. */
 PyObject *
 Image_setData(PyObject *obj, PyObject *args, PyObject *kwargs);
 
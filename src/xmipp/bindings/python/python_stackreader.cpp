@@ -0,0 +1,342 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#include "python_stackreader.h"
+#include "python_image.h"
+#include "core/xmipp_image.h"
+#include "core/xmipp_image_extension.h"
+#include "core/xmipp_image_generic.h"
+
+/***************************************************************/
+/*                         StackPrefetcher                     */
+/***************************************************************/
+
+StackPrefetcher::StackPrefetcher(const FileName &fnStack, size_t batchSize, size_t prefetch):
+    fnStack(fnStack), batchSize(std::max(batchSize, (size_t)1)), prefetch(std::max(prefetch, (size_t)1))
+{
+    size_t Zdim;
+    getImageSize(fnStack, Xdim, Ydim, Zdim, Ndim);
+    if (Zdim != 1)
+        REPORT_ERROR(ERR_MULTIDIM_DIM, "StackReader: only stacks of 2D images are supported");
+    reader = std::thread(&StackPrefetcher::readerLoop, this);
+}
+
+StackPrefetcher::~StackPrefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    reader.join();
+}
+
+/* Convert n consecutive values of a (mapped) array to float */
+template<typename T>
+void copyToFloat(const MultidimArrayGeneric &m, size_t offset, size_t n, float *out)
+{
+    const T *in = ((MultidimArray<T>*)m.im)->data + offset;
+    for (size_t i = 0; i < n; ++i)
+        out[i] = (float)in[i];
+}
+
+void StackPrefetcher::readerLoop()
+{
+    try
+    {
+        size_t imgSize = Xdim * Ydim;
+
+        // The stack is opened once and mapped, so that each block is a
+        // single contiguous copy. Files that cannot be mapped (other
+        // formats, byte-swapped data) are read image by image.
+        ImageGeneric Istack;
+        bool mapped = true;
+        try
+        {
+            Istack.read(fnStack, DATA, ALL_IMAGES, true);
+            ArrayDim adim;
+            Istack().getDimensions(adim);
+            mapped = adim.xdim == Xdim && adim.ydim == Ydim && adim.zdim == 1 &&
+                     adim.ndim == Ndim;
+        }
+        catch (XmippError &)
+        {
+            mapped = false;
+        }
+        const MultidimArrayGeneric &mStack = Istack();
+
+        Image<float> I;
+        FileName fnImg;
+        for (size_t first = 0; first < Ndim; first += batchSize)
+        {
+            StackBatch batch;
+            batch.n = std::min(batchSize, Ndim - first);
+            batch.data.reset(new float[batch.n * imgSize]);
+            if (mapped)
+            {
+#define COPYBATCH(type) copyToFloat<type>(mStack, first * imgSize, batch.n * imgSize, batch.data.get());
+                SWITCHDATATYPE(mStack.datatype, COPYBATCH);
+#undef COPYBATCH
+            }
+            else
+                for (size_t i = 0; i < batch.n; ++i)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (stop)
+                            return;
+                    }
+                    fnImg.compose(first + i + FIRST_IMAGE, fnStack);
+                    I.read(fnImg);
+                    if (XSIZE(I()) != Xdim || YSIZE(I()) != Ydim)
+                        REPORT_ERROR(ERR_MULTIDIM_SIZE, formatString("StackReader: unexpected size of %s", fnImg.c_str()));
+                    memcpy(batch.data.get() + i * imgSize, MULTIDIM_ARRAY(I), imgSize * sizeof(float));
+                }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]{ return stop || ready.size() < prefetch; });
+            if (stop)
+                return;
+            ready.push_back(std::move(batch));
+            cv.notify_all();
+        }
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    finished = true;
+    cv.notify_all();
+}
+
+bool StackPrefetcher::next(StackBatch &batch)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this]{ return !ready.empty() || finished; });
+    if (ready.empty())
+    {
+        // Blocks read before an error are delivered first
+        if (error)
+            std::rethrow_exception(error);
+        return false;
+    }
+    batch = std::move(ready.front());
+    ready.pop_front();
+    cv.notify_all();
+    return true;
+}
+
+/***************************************************************/
+/*                            StackReader                      */
+/***************************************************************/
+
+/* StackReader methods */
+PyMethodDef StackReader_methods[] =
+    {
+        { "getDimensions", (PyCFunction) StackReader_getDimensions, METH_VARARGS,
+          "Return stack dimensions as a tuple (Xdim, Ydim, Ndim)" },
+        { nullptr } /* Sentinel */
+    };//StackReader_methods
+
+/*StackReader Type */
+PyTypeObject StackReaderType =
+    {
+        PyObject_HEAD_INIT(nullptr)
+        "xmipp.StackReader", /*tp_name*/
+        sizeof(StackReaderObject), /*tp_basicsize*/
+        0, /*tp_itemsize*/
+        (destructor)StackReader_dealloc, /*tp_dealloc*/
+        0, /*tp_print*/
+        0, /*tp_getattr*/
+        0, /*tp_setattr*/
+        0, /*tp_compare*/
+        0, /*tp_repr*/
+        0, /*tp_as_number*/
+        0, /*tp_as_sequence*/
+        0, /*tp_as_mapping*/
+        0, /*tp_hash */
+        0, /*tp_call*/
+        0, /*tp_str*/
+        0, /*tp_getattro*/
+        0, /*tp_setattro*/
+        0, /*tp_as_buffer*/
+        Py_TPFLAGS_DEFAULT, /*tp_flags*/
+        "Iterate over a stack in float32 NumPy blocks of batchSize x Ydim x Xdim, "
+        "reading ahead on a background thread",/* tp_doc */
+        0, /* tp_traverse */
+        0, /* tp_clear */
+        0, /* tp_richcompare */
+        0, /* tp_weaklistoffset */
+        StackReader_iter, /* tp_iter */
+        StackReader_iternext, /* tp_iternext */
+        StackReader_methods, /* tp_methods */
+        0, /* tp_members */
+        0, /* tp_getset */
+        0, /* tp_base */
+        0, /* tp_dict */
+        0, /* tp_descr_get */
+        0, /* tp_descr_set */
+        0, /* tp_dictoffset */
+        0, /* tp_init */
+        0, /* tp_alloc */
+        StackReader_new, /* tp_new */
+    };//StackReaderType
+
+/* Constructor */
+PyObject *
+StackReader_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    if (PyArray_API == nullptr && _import_array() < 0)
+        return nullptr;
+
+    PyObject *input = nullptr;
+    size_t batchSize = 128;
+    size_t prefetch = 2;
+    if (!PyArg_ParseTuple(args, "O|kk", &input, &batchSize, &prefetch))
+        return nullptr;
+
+    PyObject *pyStr = PyObject_Str(input);
+    if (pyStr == nullptr)
+        return nullptr;
+    FileName fnStack(PyUnicode_AsUTF8(pyStr));
+    Py_DECREF(pyStr);
+
+    auto *self = (StackReaderObject*)type->tp_alloc(type, 0);
+    if (self != nullptr)
+    {
+        try
+        {
+            self->reader = std::make_unique<StackPrefetcher>(fnStack, batchSize, prefetch);
+        }
+        catch (XmippError &xe)
+        {
+            PyErr_SetString(PyXmippError, xe.what());
+            Py_DECREF(self);
+            return nullptr;
+        }
+    }
+    return (PyObject *)self;
+}//function StackReader_new
+
+/* Destructor */
+void StackReader_dealloc(StackReaderObject* self)
+{
+    // Joining the reader may wait for an image being read
+    Py_BEGIN_ALLOW_THREADS
+    self->reader.reset();
+    Py_END_ALLOW_THREADS
+    self->~StackReaderObject();
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}//function StackReader_dealloc
+
+/* Iterator */
+PyObject *
+StackReader_iter(PyObject *obj)
+{
+    Py_INCREF(obj);
+    return obj;
+}//function StackReader_iter
+
+/* Free the memory of a block handed to NumPy */
+static void StackBatch_free(PyObject *capsule)
+{
+    delete[] static_cast<float*>(PyCapsule_GetPointer(capsule, nullptr));
+}
+
+/* Next block */
+PyObject *
+StackReader_iternext(PyObject *obj)
+{
+    auto *self = reinterpret_cast<StackReaderObject*>(obj);
+    StackBatch batch;
+    bool available = false;
+    std::exception_ptr error;
+
+    // Wait for the background reader without holding the GIL
+    Py_BEGIN_ALLOW_THREADS
+    try
+    {
+        available = self->reader->next(batch);
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    Py_END_ALLOW_THREADS
+
+    if (error)
+    {
+        try
+        {
+            std::rethrow_exception(error);
+        }
+        catch (XmippError &xe)
+        {
+            PyErr_SetString(PyXmippError, xe.what());
+        }
+        catch (std::exception &e)
+        {
+            PyErr_SetString(PyXmippError, e.what());
+        }
+        return nullptr;
+    }
+    if (!available)
+        return nullptr; // StopIteration
+
+    // The NumPy array takes ownership of the block without copying it
+    npy_intp dims[3];
+    dims[0] = batch.n;
+    dims[1] = self->reader->Ydim;
+    dims[2] = self->reader->Xdim;
+    float *data = batch.data.release();
+    PyObject *capsule = PyCapsule_New(data, nullptr, StackBatch_free);
+    if (capsule == nullptr)
+    {
+        delete[] data;
+        return nullptr;
+    }
+    auto *arr = (PyArrayObject*) PyArray_SimpleNewFromData(3, dims, NPY_FLOAT, data);
+    if (arr == nullptr)
+    {
+        Py_DECREF(capsule);
+        return nullptr;
+    }
+    if (PyArray_SetBaseObject(arr, capsule) < 0)
+    {
+        Py_DECREF(arr);
+        return nullptr;
+    }
+    return (PyObject *)arr;
+}//function StackReader_iternext
+
+/* getDimensions */
+PyObject *
+StackReader_getDimensions(PyObject *obj, PyObject *args, PyObject *kwargs)
+{
+    const auto *self = reinterpret_cast<StackReaderObject*>(obj);
+    return Py_BuildValue("kkk", self->reader->Xdim, self->reader->Ydim, self->reader->Ndim);
+}//function StackReader_getDimensions
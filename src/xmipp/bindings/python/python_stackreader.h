@@ -0,0 +1,120 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#ifndef _PYTHON_STACKREADER_H
+#define _PYTHON_STACKREADER_H
+
+#include "Python.h"
+#include "core/xmipp_filename.h"
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/***************************************************************/
+/*                            StackReader                      */
+/***************************************************************/
+
+/** Block of consecutive images of a stack */
+struct StackBatch
+{
+    std::unique_ptr<float[]> data;
+    size_t n = 0;
+};
+
+/** Read a stack in blocks of images on a background thread.
+ * The reader keeps up to prefetch blocks ready so that the consumer
+ * does not wait for the disk. Images are converted to float.
+ * The stack is mapped once and each block is copied from consecutive
+ * images; stacks that cannot be mapped are read image by image.
+ */
+class StackPrefetcher
+{
+public:
+    size_t Xdim, Ydim, Ndim;
+
+    StackPrefetcher(const FileName &fnStack, size_t batchSize, size_t prefetch);
+
+    /** Stop the background reader */
+    ~StackPrefetcher();
+
+    /** Get the next block, waiting for it if needed.
+     * Returns false when the stack has been consumed. Errors of the
+     * background reader are rethrown here.
+     */
+    bool next(StackBatch &batch);
+
+private:
+    void readerLoop();
+
+    FileName fnStack;
+    size_t batchSize;
+    size_t prefetch;
+    std::deque<StackBatch> ready;
+    std::exception_ptr error;
+    bool finished = false;
+    bool stop = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread reader;
+};
+
+#define StackReader_Check(v) (((v)->ob_type == &StackReaderType))
+
+/*StackReader Object*/
+typedef struct
+{
+    PyObject_HEAD
+    std::unique_ptr<StackPrefetcher> reader;
+}
+StackReaderObject;
+
+/* Constructor: StackReader(filename, batchSize=128, prefetch=2) */
+PyObject *
+StackReader_new(PyTypeObject *type, PyObject *args, PyObject *kwargs);
+
+/* Destructor */
+void StackReader_dealloc(StackReaderObject* self);
+
+/* Iterator: returns itself */
+PyObject *
+StackReader_iter(PyObject *obj);
+
+/* Next block as a float32 NumPy array of N x Ydim x Xdim */
+PyObject *
+StackReader_iternext(PyObject *obj);
+
+/* getDimensions: (Xdim, Ydim, Ndim) of the stack */
+PyObject *
+StackReader_getDimensions(PyObject *obj, PyObject *args, PyObject *kwargs);
+
+/* StackReader methods */
+extern PyMethodDef StackReader_methods[];
+/*StackReader Type */
+extern PyTypeObject StackReaderType;
+
+#endif
@@ -39,6 +39,7 @@
 #include "python_filename.h"
 #include "python_image.h"
 #include "python_program.h"
+#include "python_stackreader.h"
 #include "python_metadata.h"
 #include "python_symmetry.h"
 #include "reconstruction/ctf_estimate_from_micrograph.h"
@@ -1426,6 +1427,7 @@ PyInit_xmippLib(void) {
     INIT_TYPE(Program);
     INIT_TYPE(SymList);
     INIT_TYPE(FourierProjector);
+    INIT_TYPE(StackReader);
 
 
     //Add PyXmippError
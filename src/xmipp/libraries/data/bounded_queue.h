@@ -0,0 +1,98 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#ifndef LIBRARIES_DATA_BOUNDED_QUEUE_H_
+#define LIBRARIES_DATA_BOUNDED_QUEUE_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/**@defgroup BoundedQueue Bounded queue
+   @ingroup DataLibrary */
+//@{
+/**
+ * Thread-safe FIFO queue with a maximal number of items, used to connect
+ * the stages of a pipeline. Producers block while the queue is full and
+ * consumers block while it is empty, so the memory held by the items in
+ * flight is limited by the capacity.
+ */
+template<typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) :
+        capacity(std::max(capacity, (size_t)1)) {}
+
+    /**
+     * Add an item, waiting while the queue is full.
+     * Returns false (and drops the item) if the queue has been closed
+     */
+    bool push(T &&item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this]{ return closed || items.size() < capacity; });
+        if (closed)
+            return false;
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /**
+     * Take the oldest item, waiting while the queue is empty.
+     * Returns false once the queue is closed and all items have been taken
+     */
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this]{ return closed || ! items.empty(); });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    /**
+     * No more items will be added. Waiting consumers get the remaining
+     * items and then false; waiting producers are released
+     */
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+    const size_t capacity;
+    std::deque<T> items;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+};
+//@}
+#endif /* LIBRARIES_DATA_BOUNDED_QUEUE_H_ */
@@ -38,6 +38,14 @@ void CPU::native_cpuid(unsigned int *eax, unsigned int *ebx,
     : "0" (*eax), "2" (*ecx));
 }
 
+bool CPU::hasAVX2() {
+#if defined(__x86_64__) && defined(__GNUC__)
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+    return false;
+#endif
+}
+
 void CPU::updateMemoryInfo() {
     size_t pages = sysconf(_SC_PHYS_PAGES);
     size_t page_size = sysconf(_SC_PAGE_SIZE);
@@ -42,6 +42,9 @@ public:
         return std::max(std::thread::hardware_concurrency(), 1u);
     }
 
+    /** True if the processor (and OS) support AVX2 and FMA instructions */
+    static bool hasAVX2();
+
     void synch() const {}; // nothing to do
     void synchAll() const {}; // nothing to do
 
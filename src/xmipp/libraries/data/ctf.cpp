@@ -696,6 +696,97 @@ void CTFDescription1D::precomputeValues(const MultidimArray<double> &cont_x_freq
 	    }
 }
 
+/* Frequency list ---------------------------------------------------------- */
+void CTFFrequencyList::clear()
+{
+    u.clear();
+    u2.clear();
+    cos2ang.clear();
+    sin2ang.clear();
+}
+
+void CTFFrequencyList::reserve(size_t n)
+{
+    u.reserve(n);
+    u2.reserve(n);
+    cos2ang.reserve(n);
+    sin2ang.reserve(n);
+}
+
+void CTFFrequencyList::add(double X, double Y)
+{
+    // same direction as precomputeValues, i.e. 0 for the origin
+    double ang2 = 2 * atan2(Y, X);
+    double w2 = X * X + Y * Y;
+    u.push_back(sqrt(w2));
+    u2.push_back(w2);
+    cos2ang.push_back(cos(ang2));
+    sin2ang.push_back(sin(ang2));
+}
+
+/* Evaluate at a list of frequencies --------------------------------------- */
+void CTFDescription1D::getDampingValuesAt(const CTFFrequencyList &freqs,
+        size_t first, size_t n, const double *deltaf, double *damping,
+        double *pureWithoutDamping) const
+{
+    const double *u = freqs.u.data() + first;
+    const double *u2 = freqs.u2.data() + first;
+    if (damping != nullptr)
+    {
+        for (size_t k = 0; k < n; ++k)
+        {
+            double u4 = u2[k] * u2[k];
+            double Eespr = exp(-K3 * u4);
+            double EdeltaF = bessj0(K5 * u2[k]);
+            double EdeltaR = SINC(u[k] * DeltaR);
+            double aux = K7 * u2[k] * u[k] + deltaf[k] * u[k];
+            double Ealpha = exp(-K6 * aux * aux);
+            double E = Eespr * EdeltaF * EdeltaR * Ealpha + envR0 + envR1 * u[k] + envR2 * u2[k];
+            damping[k] = -K * std::max(E, 0.0);
+        }
+    }
+    if (pureWithoutDamping != nullptr)
+    {
+        // no branches in the loop, so that sin, cos and exp can be vectorized
+        double iVPP = 0;
+        double VPPshift = 0;
+        if (round(VPP_radius * 1000) != 0)
+        {
+            iVPP = 1.0 / (2 * VPP_radius * VPP_radius);
+            VPPshift = -phase_shift;
+        }
+        for (size_t k = 0; k < n; ++k)
+        {
+            double VPP = VPPshift * (1 - exp(-u2[k] * iVPP));
+            double argument = VPP + K1 * deltaf[k] * u2[k] + K2 * u2[k] * u2[k];
+            pureWithoutDamping[k] = -(Ksin * sin(argument) - Kcos * cos(argument));
+        }
+    }
+}
+
+void CTFDescription1D::getValuesAt(const CTFFrequencyList &freqs, double *noise,
+        double *damping, double *pureWithoutDamping) const
+{
+    const size_t n = freqs.size();
+    std::vector<double> deltaf(n, Defocus);
+    getDampingValuesAt(freqs, 0, n, deltaf.data(), damping, pureWithoutDamping);
+    if (noise != nullptr)
+    {
+        const double *u = freqs.u.data();
+        const double *u2 = freqs.u2.data();
+        for (size_t k = 0; k < n; ++k)
+        {
+            double aux = u[k] - Gc1;
+            double aux2 = u[k] - Gc2;
+            noise[k] = base_line +
+                       gaussian_K * exp(-sigma1 * aux * aux) +
+                       sqrt_K * exp(-sq * sqrt(u[k])) -
+                       gaussian_K2 * exp(-sigma2 * aux2 * aux2) +
+                       bgR1 * u[k] + bgR2 * u2[k] + bgR3 * u2[k] * u[k];
+        }
+    }
+}
+
 /* Look for zeroes, maxima or minima ------------------------------------------------------------ */
 //#define DEBUG
 void CTFDescription1D::lookFor(int n, const Matrix1D<double> &u, Matrix1D<double> &freq, int iwhat)
@@ -1423,6 +1514,105 @@ void CTFDescription::precomputeValues(const MultidimArray<double> &cont_x_freq,
     }
 }
 
+/* Evaluate at a list of frequencies --------------------------------------- */
+void CTFDescription::getValuesAt(const CTFFrequencyList &freqs, size_t first,
+        size_t n, double *noise, double *damping, double *pureWithoutDamping) const
+{
+    const double *u = freqs.u.data() + first;
+    const double *u2 = freqs.u2.data() + first;
+    const double *cos2ang = freqs.cos2ang.data() + first;
+    const double *sin2ang = freqs.sin2ang.data() + first;
+    if (damping != nullptr || pureWithoutDamping != nullptr)
+    {
+        // cos(2*(ang-rad_azimuth)) expanded, so that no trigonometry is needed
+        std::vector<double> deltaf(n);
+        double cosAz = cos(2 * rad_azimuth);
+        double sinAz = sin(2 * rad_azimuth);
+        for (size_t k = 0; k < n; ++k)
+            deltaf[k] = defocus_average + defocus_deviation * (cos2ang[k] * cosAz + sin2ang[k] * sinAz);
+        getDampingValuesAt(freqs, first, n, deltaf.data(), damping, pureWithoutDamping);
+    }
+    if (noise != nullptr)
+    {
+        // cos^2(ang-rad) = (1 + cos(2*(ang-rad))) / 2
+        double cosG = cos(2 * rad_gaussian);
+        double sinG = sin(2 * rad_gaussian);
+        double cosG2 = cos(2 * rad_gaussian2);
+        double sinG2 = sin(2 * rad_gaussian2);
+        double cosSq = cos(2 * rad_sqrt);
+        double sinSq = sin(2 * rad_sqrt);
+        for (size_t k = 0; k < n; ++k)
+        {
+            double cos_sqrt_ang_2 = 0.5 * (1 + cos2ang[k] * cosSq + sin2ang[k] * sinSq);
+            double sq = sqrt(sqU * sqU * cos_sqrt_ang_2 + sqV * sqV * (1.0 - cos_sqrt_ang_2));
+
+            double cos_ang_2 = 0.5 * (1 + cos2ang[k] * cosG + sin2ang[k] * sinG);
+            double c = sqrt(cU * cU * cos_ang_2 + cV * cV * (1.0 - cos_ang_2));
+            double sigma = sqrt(sigmaU * sigmaU * cos_ang_2 + sigmaV * sigmaV * (1.0 - cos_ang_2));
+
+            double cos_ang2_2 = 0.5 * (1 + cos2ang[k] * cosG2 + sin2ang[k] * sinG2);
+            double c2 = sqrt(cU2 * cU2 * cos_ang2_2 + cV2 * cV2 * (1.0 - cos_ang2_2));
+            double sigma2 = sqrt(sigmaU2 * sigmaU2 * cos_ang2_2 + sigmaV2 * sigmaV2 * (1.0 - cos_ang2_2));
+
+            double aux = u[k] - c;
+            double aux2 = u[k] - c2;
+            noise[k] = base_line +
+                       gaussian_K * exp(-sigma * aux * aux) +
+                       sqrt_K * exp(-sq * sqrt(u[k])) -
+                       gaussian_K2 * exp(-sigma2 * aux2 * aux2) +
+                       bgR1 * u[k] + bgR2 * u2[k] + bgR3 * u2[k] * u[k];
+        }
+    }
+}
+
+void CTFDescription::getValuesAt(const CTFFrequencyList &freqs, size_t first,
+        size_t n, double *values) const
+{
+    std::vector<double> noise(enable_CTFnoise ? n : 0);
+    std::vector<double> damping(enable_CTF ? n : 0);
+    std::vector<double> pure(enable_CTF ? n : 0);
+    getValuesAt(freqs, first, n,
+                enable_CTFnoise ? noise.data() : nullptr,
+                enable_CTF ? damping.data() : nullptr,
+                enable_CTF ? pure.data() : nullptr);
+    for (size_t k = 0; k < n; ++k)
+    {
+        // getValuePureAt is the product of both, with the opposite sign
+        double pure_CTF = enable_CTF ? -damping[k] * pure[k] : 0;
+        values[k] = enable_CTFnoise ? sqrt(pure_CTF * pure_CTF + noise[k]) : pure_CTF;
+    }
+}
+
+const CTFFrequencyList* CTFDescription::getFrequencyGrid(int Ydim, int Xdim, double iTs)
+{
+    // do not keep grids bigger than 32 MB
+    const size_t maxGridSize = 1024 * 1024;
+    if ((size_t)Ydim * Xdim > maxGridSize)
+        return nullptr;
+    if (frequencyGrid == nullptr || frequencyGridYdim != Ydim
+        || frequencyGridXdim != Xdim || frequencyGridITs != iTs)
+    {
+        auto grid = std::make_shared<CTFFrequencyList>();
+        grid->reserve((size_t)Ydim * Xdim);
+        for (int i=0; i<Ydim; ++i)
+        {
+            double wy;
+            FFT_IDX2DIGFREQ(i, Ydim, wy);
+            for (int j=0; j<Xdim; ++j)
+            {
+                double wx;
+                FFT_IDX2DIGFREQ(j, Xdim, wx);
+                grid->add(wx * iTs, wy * iTs);
+            }
+        }
+        frequencyGrid = grid;
+        frequencyGridYdim = Ydim;
+        frequencyGridXdim = Xdim;
+        frequencyGridITs = iTs;
+    }
+    return frequencyGrid.get();
+}
+
 /* Look for zeroes, maxima or minima ------------------------------------------------------------ */
 //#define DEBUG
 void CTFDescription::lookFor(int n, const Matrix1D<double> &u, Matrix1D<double> &freq, int iwhat)
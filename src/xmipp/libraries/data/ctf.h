@@ -27,6 +27,8 @@
 #define _CORE_CTF_HH
 
 #include <complex>
+#include <memory>
+#include <vector>
 #include "core/metadata_db.h"
 #include "core/numerical_recipes.h"
 #include "core/xmipp_fft.h"
@@ -91,6 +93,37 @@ public:
     double deltaf;
 };
 
+/** List of frequencies at which a CTF model is evaluated many times.
+ * The values that do not depend on the CTF parameters are computed once and
+ * stored as structure of arrays, so that the evaluation of the whole list
+ * (see CTFDescription::getValuesAt) runs in plain loops over contiguous data.
+ * The direction of each frequency is kept as cos(2*ang) and sin(2*ang),
+ * which is all the astigmatic terms need.
+ */
+class CTFFrequencyList
+{
+public:
+    std::vector<double> u;
+    std::vector<double> u2;
+    std::vector<double> cos2ang;
+    std::vector<double> sin2ang;
+
+    /// Number of frequencies
+    size_t size() const
+    {
+        return u.size();
+    }
+
+    /// Remove all frequencies
+    void clear();
+
+    /// Reserve memory for n frequencies
+    void reserve(size_t n);
+
+    /// Add the continuous frequency (X,Y)
+    void add(double X, double Y=0);
+};
+
 /** CTF class.
     Here goes how to compute the radial average of a parametric CTF:
 
@@ -626,6 +659,14 @@ public:
 		return -K*(Ksin*sine_part - Kcos*cosine_part)*E;
 	}
 
+	/** Evaluate the model at all frequencies of the list.
+	 * noise, damping and pureWithoutDamping receive the same values as
+	 * getValueNoiseAt, getValueDampingAt and getValuePureWithoutDampingAt.
+	 * Each output must have room for freqs.size() values, or be nullptr
+	 * if it is not needed. The direction of the frequencies is ignored.
+	 */
+	void getValuesAt(const CTFFrequencyList &freqs, double *noise,
+			double *damping, double *pureWithoutDamping) const;
 
 	/** Returns the continuous frequency of the zero, maximum or minimum number n in the direction u.
 		u must be a unit vector, n=1,2,... Returns (-1,-1) if it is not found
@@ -746,6 +787,11 @@ public:
 	/** Force physical meaning.*/
 	void forcePhysicalMeaning();
 
+protected:
+	/** Damping and pure CTF without damping of the frequencies [first, first+n)
+	 * of the list, for the given defocus of each of them. See getValuesAt */
+	void getDampingValuesAt(const CTFFrequencyList &freqs, size_t first, size_t n,
+			const double *deltaf, double *damping, double *pureWithoutDamping) const;
 };
 
 /** Generate CTF 2D image with two CTFs.
@@ -1105,6 +1151,26 @@ public:
         return -(Ksin*sine_part - Kcos*cosine_part);
     }
 
+    /** Evaluate the model at all frequencies of the list.
+     * noise, damping and pureWithoutDamping receive the same values as
+     * getValueNoiseAt, getValueDampingAt and getValuePureWithoutDampingAt.
+     * Each output must have room for freqs.size() values, or be nullptr
+     * if it is not needed.
+     */
+    void getValuesAt(const CTFFrequencyList &freqs, double *noise,
+                     double *damping, double *pureWithoutDamping) const
+    {
+        getValuesAt(freqs, 0, freqs.size(), noise, damping, pureWithoutDamping);
+    }
+
+    /// Same as above, for the frequencies [first, first+n) of the list
+    void getValuesAt(const CTFFrequencyList &freqs, size_t first, size_t n,
+                     double *noise, double *damping, double *pureWithoutDamping) const;
+
+    /// getValueAt for the frequencies [first, first+n) of the list
+    void getValuesAt(const CTFFrequencyList &freqs, size_t first, size_t n,
+                     double *values) const;
+
     /// Deltaf at a given direction
     double getDeltafNoPrecomputed(double X, double Y) const
     {
@@ -1219,24 +1285,37 @@ public:
     void generateCTF(int Ydim, int Xdim, MultidimArray < T > &CTF, double Ts=-1)
     {
 	double iTs = initCTF(Ydim, Xdim, CTF, Ts);
+        // Frequencies are shared by all the CTFs of the same size,
+        // images too big to keep them are evaluated row by row
+        const CTFFrequencyList *grid = getFrequencyGrid(Ydim, Xdim, iTs);
+        CTFFrequencyList row;
+        std::vector<double> values(Xdim);
         for (int i=0; i<Ydim; ++i)
         {
-        	double wy;
-        	FFT_IDX2DIGFREQ(i, YSIZE(CTF), wy);
-            double fy=wy*iTs;
-        	for (int j=0; j<Xdim; ++j)
-        	{
-            	double wx;
-            	FFT_IDX2DIGFREQ(j, XSIZE(CTF), wx);
-                double fx=wx*iTs;
-				precomputeValues(fx, fy);
-				A2D_ELEM(CTF, i, j) = (T) getValueAt();
+            if (grid != nullptr)
+                getValuesAt(*grid, (size_t)i*Xdim, Xdim, values.data());
+            else
+            {
+                double wy;
+                FFT_IDX2DIGFREQ(i, YSIZE(CTF), wy);
+                double fy=wy*iTs;
+                row.clear();
+                for (int j=0; j<Xdim; ++j)
+                {
+                    double wx;
+                    FFT_IDX2DIGFREQ(j, XSIZE(CTF), wx);
+                    row.add(wx*iTs, fy);
+                }
+                getValuesAt(row, 0, Xdim, values.data());
+            }
+            for (int j=0; j<Xdim; ++j)
+            {
+				A2D_ELEM(CTF, i, j) = (T) values[j];
 				#ifdef DEBUG
 						if (i == 0)
-							std::cout << i << " " << j << " " << fy << " " << fx
-							<< " " << CTF(i, j) << std::endl;
+							std::cout << i << " " << j << " " << CTF(i, j) << std::endl;
 				#endif
-        	}
+            }
         }
     }
     #undef DEBUG
@@ -1299,6 +1378,18 @@ public:
 
     /** Force physical meaning.*/
     void forcePhysicalMeaning();
+
+private:
+    /** Frequencies of an image of Ydim x Xdim pixels sampled at 1/iTs, in the
+     * order of the pixels. The grid is kept (and shared by the copies of this
+     * object) until a different size is requested. Returns nullptr for images
+     * too big to keep their grid in memory. */
+    const CTFFrequencyList* getFrequencyGrid(int Ydim, int Xdim, double iTs);
+
+    std::shared_ptr<const CTFFrequencyList> frequencyGrid;
+    int frequencyGridYdim = 0;
+    int frequencyGridXdim = 0;
+    double frequencyGridITs = 0;
 };
 
 #endif
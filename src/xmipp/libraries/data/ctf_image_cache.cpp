@@ -0,0 +1,288 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#include "ctf_image_cache.h"
+#include <cmath>
+#include <functional>
+
+size_t CTFImageKeyHash::operator()(const CTFImageKey &key) const
+{
+    size_t seed = 0;
+    auto combine = [&seed](size_t h)
+    {
+        seed ^= h + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    };
+    combine(std::hash<int>()((int)key.type));
+    combine(std::hash<int>()(key.Ydim));
+    combine(std::hash<int>()(key.Xdim));
+    combine(std::hash<int64_t>()(key.defocusU));
+    combine(std::hash<int64_t>()(key.defocusV));
+    combine(std::hash<int64_t>()(key.angle));
+    for (double p : key.params)
+        combine(std::hash<double>()(p));
+    return seed;
+}
+
+template<typename T>
+CTFImageCache<T>::CTFImageCache(size_t maxBytes, double defocusStep, double angleStep) :
+    maxBytes(maxBytes), defocusStep(defocusStep), angleStep(angleStep)
+{
+    if (defocusStep <= 0 || angleStep <= 0)
+        REPORT_ERROR(ERR_ARG_INCORRECT, "CTFImageCache: the quantization steps must be positive");
+}
+
+template<typename T>
+typename CTFImageCache<T>::ImagePtr CTFImageCache<T>::getImage(const CTFDescription &ctf,
+        int Ydim, int Xdim, double Ts, bool absolute)
+{
+    return get(absolute ? CTFImageType::AbsImage : CTFImageType::Image, ctf, Ydim, Xdim, Ts);
+}
+
+template<typename T>
+typename CTFImageCache<T>::ImagePtr CTFImageCache<T>::getEnvelope(const CTFDescription &ctf,
+        int Ydim, int Xdim, double Ts)
+{
+    return get(CTFImageType::Envelope, ctf, Ydim, Xdim, Ts);
+}
+
+template<typename T>
+typename CTFImageCache<T>::ImagePtr CTFImageCache<T>::getFourierMask(const CTFDescription &ctf,
+        int Ydim, int Xdim, bool absolute)
+{
+    // FourierFilter evaluates the CTF at the sampling rate of the CTF
+    return get(absolute ? CTFImageType::AbsFourierMask : CTFImageType::FourierMask,
+               ctf, Ydim, Xdim, ctf.Tm);
+}
+
+template<typename T>
+typename CTFImageCache<T>::ImagePtr CTFImageCache<T>::getPhaseFlipMask(const CTFDescription &ctf,
+        int Ydim, int Xdim, double Ts)
+{
+    return get(CTFImageType::PhaseFlipMask, ctf, Ydim, Xdim, Ts);
+}
+
+template<typename T>
+typename CTFImageCache<T>::ImagePtr CTFImageCache<T>::get(CTFImageType type,
+        const CTFDescription &ctf, int Ydim, int Xdim, double Ts)
+{
+    if (Ts < 0)
+        Ts = ctf.Tm;
+    CTFImageKey key = makeKey(type, ctf, Ydim, Xdim, Ts);
+
+    if (ctf.enable_CTFnoise)
+    {
+        // The noise has too many parameters to be worth caching
+        auto image = std::make_shared<MultidimArray<T> >();
+        generate(key, ctf, Ts, *image);
+        std::lock_guard<std::mutex> lock(mutex);
+        ++misses;
+        return image;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            entries.splice(entries.begin(), entries, it->second);
+            ++hits;
+            return it->second->image;
+        }
+        ++misses;
+    }
+
+    // Other threads may use the cache while the image is generated
+    auto image = std::make_shared<MultidimArray<T> >();
+    generate(key, ctf, Ts, *image);
+    insert(key, image);
+    return image;
+}
+
+template<typename T>
+CTFImageKey CTFImageCache<T>::makeKey(CTFImageType type, const CTFDescription &ctf,
+                                      int Ydim, int Xdim, double Ts) const
+{
+    CTFImageKey key;
+    key.type = type;
+    key.Ydim = Ydim;
+    key.Xdim = Xdim;
+    key.defocusU = std::llround(ctf.DeltafU / defocusStep);
+    key.defocusV = std::llround(ctf.DeltafV / defocusStep);
+    key.angle = std::llround(ctf.azimuthal_angle / angleStep);
+    key.params = { Ts, ctf.kV, ctf.Cs, ctf.Ca, ctf.espr, ctf.ispr, ctf.alpha,
+                   ctf.DeltaF, ctf.DeltaR, ctf.K, ctf.Q0, ctf.phase_shift,
+                   ctf.VPP_radius, ctf.envR0, ctf.envR1, ctf.envR2,
+                   ctf.enable_CTF ? 1.0 : 0.0 };
+    return key;
+}
+
+template<typename T>
+void CTFImageCache<T>::generate(const CTFImageKey &key, const CTFDescription &ctf,
+                                double Ts, MultidimArray<T> &image) const
+{
+    CTFDescription aux = ctf;
+    if (!ctf.enable_CTFnoise)
+    {
+        aux.DeltafU = key.defocusU * defocusStep;
+        aux.DeltafV = key.defocusV * defocusStep;
+        aux.azimuthal_angle = key.angle * angleStep;
+        aux.produceSideInfo();
+    }
+
+    switch (key.type)
+    {
+    case CTFImageType::Image:
+    case CTFImageType::AbsImage:
+        aux.generateCTF(key.Ydim, key.Xdim, image, Ts);
+        break;
+    case CTFImageType::Envelope:
+        aux.generateEnvelope(key.Ydim, key.Xdim, image, Ts);
+        break;
+    case CTFImageType::FourierMask:
+    case CTFImageType::AbsFourierMask:
+        {
+            // Same layout as the FourierTransformer of a Ydim x Xdim image
+            int XdimFourier = key.Xdim / 2 + 1;
+            image.resizeNoCopy(key.Ydim, XdimFourier);
+            double iTs = 1.0 / Ts;
+            CTFFrequencyList row;
+            row.reserve(XdimFourier);
+            std::vector<double> values(XdimFourier);
+            for (int i = 0; i < key.Ydim; ++i)
+            {
+                double wy;
+                FFT_IDX2DIGFREQ(i, key.Ydim, wy);
+                row.clear();
+                for (int j = 0; j < XdimFourier; ++j)
+                {
+                    double wx;
+                    FFT_IDX2DIGFREQ(j, key.Xdim, wx);
+                    row.add(wx * iTs, wy * iTs);
+                }
+                aux.getValuesAt(row, 0, XdimFourier, values.data());
+                for (int j = 0; j < XdimFourier; ++j)
+                    DIRECT_A2D_ELEM(image, i, j) = (T) values[j];
+            }
+        }
+        break;
+    case CTFImageType::PhaseFlipMask:
+        {
+            int XdimFourier = key.Xdim / 2 + 1;
+            image.resizeNoCopy(key.Ydim, XdimFourier);
+            double iTs = 1.0 / Ts;
+            // Phase shift in degrees, as in actualPhaseFlip
+            aux.phase_shift = (aux.phase_shift * PI) / 180;
+            for (int i = 0; i < key.Ydim; ++i)
+            {
+                double wy;
+                FFT_IDX2DIGFREQ(i, key.Ydim, wy);
+                for (int j = 0; j < XdimFourier; ++j)
+                {
+                    double wx;
+                    FFT_IDX2DIGFREQ(j, key.Xdim, wx);
+                    aux.precomputeValues(wx * iTs, wy * iTs);
+                    DIRECT_A2D_ELEM(image, i, j) = aux.getValuePureWithoutDampingAt() < 0 ? -1 : 1;
+                }
+            }
+        }
+        break;
+    }
+
+    if (key.type == CTFImageType::AbsImage || key.type == CTFImageType::AbsFourierMask)
+        FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(image)
+            DIRECT_MULTIDIM_ELEM(image, n) = std::abs(DIRECT_MULTIDIM_ELEM(image, n));
+}
+
+template<typename T>
+void CTFImageCache<T>::insert(const CTFImageKey &key, const ImagePtr &image)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (index.find(key) != index.end())
+        return; // generated meanwhile by another thread
+    entries.push_front(Entry{key, image});
+    index[key] = entries.begin();
+    bytes += MULTIDIM_SIZE(*image) * sizeof(T);
+    // The newest image is kept even if it does not fit
+    while (bytes > maxBytes && entries.size() > 1)
+    {
+        const Entry &last = entries.back();
+        bytes -= MULTIDIM_SIZE(*last.image) * sizeof(T);
+        index.erase(last.key);
+        entries.pop_back();
+    }
+}
+
+template<typename T>
+void CTFImageCache<T>::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    index.clear();
+    bytes = 0;
+    hits = 0;
+    misses = 0;
+}
+
+template<typename T>
+size_t CTFImageCache<T>::getHits() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return hits;
+}
+
+template<typename T>
+size_t CTFImageCache<T>::getMisses() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return misses;
+}
+
+template<typename T>
+double CTFImageCache<T>::getHitRate() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t requests = hits + misses;
+    return requests == 0 ? 0 : (double)hits / requests;
+}
+
+template<typename T>
+void CTFImageCache<T>::printStatistics(std::ostream &out) const
+{
+    size_t h, m, n, b;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        h = hits;
+        m = misses;
+        n = entries.size();
+        b = bytes;
+    }
+    size_t requests = h + m;
+    out << "CTF image cache: " << h << " hits out of " << requests << " requests ("
+        << (requests == 0 ? 0.0 : 100.0 * h / requests) << "%), "
+        << n << " images in " << b / (1024 * 1024) << " MB" << std::endl;
+}
+
+template class CTFImageCache<float>;
+template class CTFImageCache<double>;
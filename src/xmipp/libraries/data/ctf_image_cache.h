@@ -0,0 +1,175 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#ifndef LIBRARIES_DATA_CTF_IMAGE_CACHE_H_
+#define LIBRARIES_DATA_CTF_IMAGE_CACHE_H_
+
+#include <cstdint>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "core/multidim_array.h"
+#include "ctf.h"
+
+/**@defgroup CTFImageCache CTF image cache
+   @ingroup DataLibrary */
+//@{
+/** Kind of image kept by the cache */
+enum class CTFImageType
+{
+    Image,          ///< CTFDescription::generateCTF
+    AbsImage,       ///< abs(CTFDescription::generateCTF)
+    Envelope,       ///< CTFDescription::generateEnvelope
+    FourierMask,    ///< CTF mask of FourierFilter (half of the spectrum)
+    AbsFourierMask, ///< Phase flipped CTF mask of FourierFilter
+    PhaseFlipMask   ///< Sign of the CTF without damping (half of the spectrum)
+};
+
+/** Key of a CTF image.
+ * Defoci and astigmatism angle are quantized, the rest of parameters of
+ * the pure CTF are compared exactly.
+ */
+struct CTFImageKey
+{
+    CTFImageType type;
+    int Ydim;
+    int Xdim;
+    int64_t defocusU;
+    int64_t defocusV;
+    int64_t angle;
+    std::vector<double> params;
+
+    bool operator==(const CTFImageKey &other) const
+    {
+        return type == other.type && Ydim == other.Ydim && Xdim == other.Xdim &&
+               defocusU == other.defocusU && defocusV == other.defocusV &&
+               angle == other.angle && params == other.params;
+    }
+};
+
+/// Hash of a CTFImageKey
+struct CTFImageKeyHash
+{
+    size_t operator()(const CTFImageKey &key) const;
+};
+
+/** Cache of CTF images.
+ * Particles of the same micrograph share (almost) the same CTF, so the
+ * images generated for a particle can be reused by the next ones. The
+ * cache keeps the most recently used images up to a maximum memory and can
+ * be shared by several threads. Images are generated with the defoci and
+ * angle rounded to defocusStep (A) and angleStep (degrees), so that the
+ * result does not depend on the order in which particles are processed.
+ * CTFs with noise are not cached.
+ *
+   @code
+   CTFImageCache<double> cache;
+   ...
+   ctf.readFromMdRow(row);
+   ctf.produceSideInfo();
+   auto mask = cache.getFourierMask(ctf, YSIZE(I), XSIZE(I));
+   FilterCTF.applyMaskSpace(I, *mask);
+   @endcode
+ */
+template<typename T>
+class CTFImageCache
+{
+public:
+    /// Pointer to a cached image, valid even if the image is evicted
+    typedef std::shared_ptr<const MultidimArray<T> > ImagePtr;
+
+    /** Constructor.
+     * maxBytes is the maximum memory taken by the cached images.
+     */
+    explicit CTFImageCache(size_t maxBytes = 128 * 1024 * 1024,
+                           double defocusStep = 1, double angleStep = 0.1);
+
+    /** CTF image as CTFDescription::generateCTF(Ydim, Xdim, CTF, Ts).
+     * If absolute, the absolute value of the CTF (phase flipped images).
+     */
+    ImagePtr getImage(const CTFDescription &ctf, int Ydim, int Xdim,
+                      double Ts = -1, bool absolute = false);
+
+    /// Envelope as CTFDescription::generateEnvelope(Ydim, Xdim, CTF, Ts)
+    ImagePtr getEnvelope(const CTFDescription &ctf, int Ydim, int Xdim, double Ts = -1);
+
+    /** CTF mask for the Fourier transform of an image of Ydim x Xdim.
+     * The mask is the one of a FourierFilter with FilterBand=CTF (CTFPOS if
+     * absolute) and can be applied with FourierFilter::applyMaskSpace.
+     */
+    ImagePtr getFourierMask(const CTFDescription &ctf, int Ydim, int Xdim,
+                            bool absolute = false);
+
+    /** Phase flipping mask for the Fourier transform of an image of Ydim x Xdim.
+     * It is -1 at the frequencies flipped by xmipp_ctf_phase_flip (negative
+     * CTF without damping) and 1 elsewhere. Ts is the sampling rate of the
+     * image (by default, the one of the CTF).
+     */
+    ImagePtr getPhaseFlipMask(const CTFDescription &ctf, int Ydim, int Xdim, double Ts = -1);
+
+    /// Remove all images and reset the statistics
+    void clear();
+
+    /// Number of requests served from the cache
+    size_t getHits() const;
+
+    /// Number of requests that generated the image
+    size_t getMisses() const;
+
+    /// Fraction of requests served from the cache
+    double getHitRate() const;
+
+    /// Show the statistics
+    void printStatistics(std::ostream &out) const;
+
+private:
+    struct Entry
+    {
+        CTFImageKey key;
+        ImagePtr image;
+    };
+
+    ImagePtr get(CTFImageType type, const CTFDescription &ctf, int Ydim, int Xdim, double Ts);
+    CTFImageKey makeKey(CTFImageType type, const CTFDescription &ctf, int Ydim, int Xdim, double Ts) const;
+    void generate(const CTFImageKey &key, const CTFDescription &ctf, double Ts,
+                  MultidimArray<T> &image) const;
+    void insert(const CTFImageKey &key, const ImagePtr &image);
+
+    const size_t maxBytes;
+    const double defocusStep;
+    const double angleStep;
+    // Most recently used first
+    std::list<Entry> entries;
+    std::unordered_map<CTFImageKey, typename std::list<Entry>::iterator, CTFImageKeyHash> index;
+    size_t bytes = 0;
+    size_t hits = 0;
+    size_t misses = 0;
+    mutable std::mutex mutex;
+};
+//@}
+#endif /* LIBRARIES_DATA_CTF_IMAGE_CACHE_H_ */
@@ -715,6 +715,17 @@ void FourierFilter::applyMaskSpace(MultidimArray<double> &v)
     transformer.inverseFourierTransform();
 }
 
+void FourierFilter::applyMaskSpace(MultidimArray<double> &v, const MultidimArray<double> &mask)
+{
+    MultidimArray< std::complex<double> > aux3D;
+    transformer.FourierTransform(v, aux3D, false);
+    if (MULTIDIM_SIZE(aux3D)!=MULTIDIM_SIZE(mask))
+        REPORT_ERROR(ERR_MULTIDIM_SIZE,"The mask does not have the size of the Fourier transform");
+    FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(aux3D)
+        DIRECT_MULTIDIM_ELEM(aux3D,n)*=DIRECT_MULTIDIM_ELEM(mask,n);
+    transformer.inverseFourierTransform();
+}
+
 void FourierFilter::applyMaskFourierSpace(const MultidimArray<double> &v, MultidimArray<std::complex<double> > &V)
 {
     if (XSIZE(maskFourier)!=0 && !FilterShape==WEDGE_RC)
@@ -176,6 +176,12 @@ public:
     /** Apply mask in real space. */
     void applyMaskSpace(MultidimArray<double> &v);
 
+    /** Apply an external mask in real space.
+     * The mask must have the size of the Fourier transform of v, as the
+     * masks of CTFImageCache::getFourierMask. maskFourierd is not used.
+     */
+    void applyMaskSpace(MultidimArray<double> &v, const MultidimArray<double> &mask);
+
     /** Apply mask in Fourier space.
      * The image remains in Fourier space.
      */
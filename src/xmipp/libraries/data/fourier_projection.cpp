@@ -28,6 +28,8 @@
 #include "core/geometry.h"
 #include "core/transformations.h"
 #include "core/xmipp_fftw.h"
+#include "data/cpu.h"
+#include "data/fftwT.h"
 
 /* Reset =================================================================== */
 void Projection::reset(int Ydim, int Xdim)
@@ -81,6 +83,27 @@ FourierProjector::FourierProjector(MultidimArray<double> &V, double paddFactor,
     updateVolume(V);
 }
 
+FourierProjector::FourierProjector(const FourierProjector &reference, bool shareCoefficients)
+{
+    paddingFactor = reference.paddingFactor;
+    maxFrequency = reference.maxFrequency;
+    BSplineDeg = reference.BSplineDeg;
+    volume = nullptr;
+    volumeSize = reference.volumeSize;
+    volumePaddedSize = reference.volumePaddedSize;
+    if (shareCoefficients)
+    {
+        VfourierRealCoefs.alias(reference.VfourierRealCoefs);
+        VfourierImagCoefs.alias(reference.VfourierImagCoefs);
+    }
+    else
+    {
+        VfourierRealCoefs = reference.VfourierRealCoefs;
+        VfourierImagCoefs = reference.VfourierImagCoefs;
+    }
+    produceSideInfoProjection();
+}
+
 void FourierProjector::updateVolume(MultidimArray<double> &V)
 {
     volume = &V;
@@ -244,6 +267,195 @@ void FourierProjector::project(double rot, double tilt, double psi, const Multid
     transformer2D.inverseFourierTransform();
 }
 
+/* Interpolate the interleaved coefficients at a logical position of the volume */
+static std::complex<float> interpolateCoefficient(const MultidimArray< std::complex<float> > &V,
+                                                  int BSplineDeg, double x, double y, double z)
+{
+    if (BSplineDeg==xmipp_transformation::NEAREST)
+        return A3D_ELEM(V,(int)round(z),(int)round(y),(int)round(x));
+
+    if (BSplineDeg==xmipp_transformation::LINEAR)
+    {
+        auto x0=(int)floor(x);
+        auto y0=(int)floor(y);
+        auto z0=(int)floor(z);
+        auto fx=(float)(x-x0);
+        auto fy=(float)(y-y0);
+        auto fz=(float)(z-z0);
+        std::complex<float> result=0.0f;
+        for (int k=0; k<2; ++k)
+        {
+            int kk=z0+k;
+            if (kk<STARTINGZ(V) || kk>FINISHINGZ(V))
+                continue;
+            float wz=k ? fz : 1.0f-fz;
+            for (int i=0; i<2; ++i)
+            {
+                int ii=y0+i;
+                if (ii<STARTINGY(V) || ii>FINISHINGY(V))
+                    continue;
+                float wzy=wz*(i ? fy : 1.0f-fy);
+                for (int j=0; j<2; ++j)
+                {
+                    int jj=x0+j;
+                    if (jj<STARTINGX(V) || jj>FINISHINGX(V))
+                        continue;
+                    result+=(wzy*(j ? fx : 1.0f-fx))*A3D_ELEM(V,kk,ii,jj);
+                }
+            }
+        }
+        return result;
+    }
+
+    // B-spline cubic interpolation, same mirroring as in project()
+    auto Xdim=(int)XSIZE(V);
+    auto Ydim=(int)YSIZE(V);
+    auto Zdim=(int)ZSIZE(V);
+    x -= STARTINGX(V);
+    y -= STARTINGY(V);
+    z -= STARTINGZ(V);
+    auto l1 = (int)ceil(x - 2);
+    auto m1 = (int)ceil(y - 2);
+    auto n1 = (int)ceil(z - 2);
+
+    // The weights only depend on the distance to the sample
+    float wx[4];
+    float wy[4];
+    float wz[4];
+    int idxl[4];
+    int idxm[4];
+    int idxn[4];
+    double aux;
+    for (int t=0; t<4; ++t)
+    {
+        BSPLINE03(aux,x-(double)(l1+t));
+        wx[t]=(float)aux;
+        BSPLINE03(aux,y-(double)(m1+t));
+        wy[t]=(float)aux;
+        BSPLINE03(aux,z-(double)(n1+t));
+        wz[t]=(float)aux;
+
+        int l=l1+t;
+        idxl[t]=(l<0) ? -l-1 : ((l>=Xdim) ? 2*Xdim-l-1 : l);
+        int m=m1+t;
+        idxm[t]=(m<0) ? -m-1 : ((m>=Ydim) ? 2*Ydim-m-1 : m);
+        int n=n1+t;
+        idxn[t]=(n<0) ? -n-1 : ((n>=Zdim) ? 2*Zdim-n-1 : n);
+    }
+
+    std::complex<float> result=0.0f;
+    for (int tn=0; tn<4; ++tn)
+    {
+        std::complex<float> yxsum=0.0f;
+        for (int tm=0; tm<4; ++tm)
+        {
+            const std::complex<float> *row=&DIRECT_A3D_ELEM(V,idxn[tn],idxm[tm],0);
+            std::complex<float> xsum=wx[0]*row[idxl[0]]+wx[1]*row[idxl[1]]+
+                                     wx[2]*row[idxl[2]]+wx[3]*row[idxl[3]];
+            yxsum+=wy[tm]*xsum;
+        }
+        result+=wz[tn]*yxsum;
+    }
+    return result;
+}
+
+void FourierProjector::projectBatch(const std::vector<double> &rot, const std::vector<double> &tilt,
+                                    const std::vector<double> &psi, MultidimArray<double> &stack,
+                                    const std::vector<const MultidimArray<double>*> *ctfs,
+                                    size_t blockSize)
+{
+    size_t N=rot.size();
+    if (tilt.size()!=N || psi.size()!=N || (ctfs!=nullptr && ctfs->size()!=N))
+        REPORT_ERROR(ERR_ARG_INCORRECT,"projectBatch: the number of angles and CTFs must be the same");
+    stack.resizeNoCopy(N,1,volumeSize,volumeSize);
+    if (N==0)
+        return;
+    if (MULTIDIM_SIZE(VfourierCoefs)==0)
+        produceSideInfoBatch();
+
+    blockSize=std::max(std::min(blockSize,N),(size_t)1);
+    size_t Ydim=YSIZE(projectionFourier);
+    size_t XdimF=XSIZE(projectionFourier);
+    size_t fourierSize=Ydim*XdimF;
+    size_t realSize=(size_t)volumeSize*volumeSize;
+    double maxFreq2=maxFrequency*maxFrequency;
+
+    // Fourier and real space of a whole block
+    auto settings=FFTSettings<float>(volumeSize,volumeSize,1,blockSize,blockSize,false,false);
+    auto *blockFourier=(std::complex<float>*)FFTwT<float>::allocateAligned(settings.fBytesBatch());
+    auto *blockReal=(float*)FFTwT<float>::allocateAligned(settings.sBytesBatch());
+    auto cpu=CPU();
+    auto plan=FFTwT<float>::createPlan(cpu,settings);
+    fftwf_plan planLast=nullptr;
+    size_t Nlast=N%blockSize;
+    if (Nlast>0)
+        planLast=FFTwT<float>::createPlan(cpu,settings.createSubset(Nlast));
+
+    std::vector< Matrix2D<double> > Eblock(blockSize);
+    for (size_t first=0; first<N; first+=blockSize)
+    {
+        size_t n=std::min(blockSize,N-first);
+        for (size_t k=0; k<n; ++k)
+            Euler_angles2matrix(rot[first+k],tilt[first+k],psi[first+k],Eblock[k]);
+        memset(blockFourier,0,n*fourierSize*sizeof(std::complex<float>));
+
+        // Row by row for all the directions of the block, so that the phase
+        // shifts and the low frequency coefficients are reused from cache
+        for (size_t i=0; i<Ydim; ++i)
+        {
+            double freqy;
+            FFT_IDX2DIGFREQ(i,volumeSize,freqy);
+            double freqy2=freqy*freqy;
+            for (size_t k=0; k<n; ++k)
+            {
+                const Matrix2D<double> &Eb=Eblock[k];
+                const MultidimArray<double> *ctf=(ctfs==nullptr) ? nullptr : (*ctfs)[first+k];
+                double freqYvol_X=MAT_ELEM(Eb,1,0)*freqy;
+                double freqYvol_Y=MAT_ELEM(Eb,1,1)*freqy;
+                double freqYvol_Z=MAT_ELEM(Eb,1,2)*freqy;
+                std::complex<float> *rowF=blockFourier+k*fourierSize+i*XdimF;
+                for (size_t j=0; j<XdimF; ++j)
+                {
+                    double freqx;
+                    FFT_IDX2DIGFREQ(j,volumeSize,freqx);
+                    if ((freqy2+freqx*freqx)>maxFreq2)
+                        continue;
+
+                    double freqvol_X=freqYvol_X+MAT_ELEM(Eb,0,0)*freqx;
+                    double freqvol_Y=freqYvol_Y+MAT_ELEM(Eb,0,1)*freqx;
+                    double freqvol_Z=freqYvol_Z+MAT_ELEM(Eb,0,2)*freqx;
+                    std::complex<float> coef=interpolateCoefficient(VfourierCoefs,(int)BSplineDeg,
+                                                                    freqvol_X*volumePaddedSize,
+                                                                    freqvol_Y*volumePaddedSize,
+                                                                    freqvol_Z*volumePaddedSize);
+
+                    // Phase shift to move the origin of the image to the corner
+                    double a=DIRECT_A2D_ELEM(phaseShiftImgA,i,j);
+                    double b=DIRECT_A2D_ELEM(phaseShiftImgB,i,j);
+                    if (ctf!=nullptr)
+                    {
+                        double ctfij=DIRECT_A2D_ELEM(*ctf,i,j);
+                        a*=ctfij;
+                        b*=ctfij;
+                    }
+                    rowF[j]=std::complex<float>((float)a,(float)b)*coef;
+                }
+            }
+        }
+
+        FFTwT<float>::ifft((n==blockSize) ? plan : planLast,blockFourier,blockReal);
+        double *ptrStack=&DIRECT_NZYX_ELEM(stack,first,0,0,0);
+        for (size_t idx=0; idx<n*realSize; ++idx)
+            ptrStack[idx]=blockReal[idx];
+    }
+
+    FFTwT<float>::release(plan);
+    if (planLast!=nullptr)
+        FFTwT<float>::release(planLast);
+    FFTwT<float>::release(blockFourier);
+    FFTwT<float>::release(blockReal);
+}
+
 void FourierProjector::produceSideInfo()
 {
     // Zero padding
@@ -265,6 +477,7 @@ void FourierProjector::produceSideInfo()
     FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Vfourier)
     DIRECT_MULTIDIM_ELEM(Vfourier,n)*=K;
     Vpadded.clear();
+    VfourierCoefs.clear();
     // Compute Bspline coefficients
     if (BSplineDeg==xmipp_transformation::BSPLINE3)
     {
@@ -322,6 +535,17 @@ void FourierProjector::produceSideInfoProjection()
     }
 }
 
+void FourierProjector::produceSideInfoBatch()
+{
+    VfourierCoefs.resizeNoCopy(ZSIZE(VfourierRealCoefs),YSIZE(VfourierRealCoefs),XSIZE(VfourierRealCoefs));
+    STARTINGZ(VfourierCoefs)=STARTINGZ(VfourierRealCoefs);
+    STARTINGY(VfourierCoefs)=STARTINGY(VfourierRealCoefs);
+    STARTINGX(VfourierCoefs)=STARTINGX(VfourierRealCoefs);
+    FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(VfourierCoefs)
+        DIRECT_MULTIDIM_ELEM(VfourierCoefs,n)=std::complex<float>((float)DIRECT_MULTIDIM_ELEM(VfourierRealCoefs,n),
+                                                                  (float)DIRECT_MULTIDIM_ELEM(VfourierImagCoefs,n));
+}
+
 void projectVolume(FourierProjector &projector, Projection &P, int Ydim, int Xdim,
                    double rot, double tilt, double psi, const MultidimArray<double> *ctf)
 {
@@ -28,6 +28,7 @@
 #include "core/matrix2d.h"
 #include "core/xmipp_fftw.h"
 #include "core/xmipp_image.h"
+#include <vector>
 
 /**@defgroup FourierProjection Fourier projection
    @ingroup ReconsLibrary */
@@ -129,6 +130,9 @@ public:
     MultidimArray< double > VfourierRealCoefs;
     MultidimArray< double > VfourierImagCoefs;
 
+    // Interleaved single precision coefficients, only used by projectBatch
+    MultidimArray< std::complex<float> > VfourierCoefs;
+
     // Projection in Fourier space
     MultidimArray< std::complex<double> > projectionFourier;
 
@@ -156,11 +160,33 @@ public:
      */
     FourierProjector(MultidimArray<double> &V, double paddFactor, double maxFreq, int BSplinedegree);
 
+    /** Constructor sharing the B-spline coefficients of another projector.
+     * The coefficients are not copied and must not be modified while this
+     * projector is in use. Only the projection space is allocated, so that
+     * several threads can project the same volume, each with its own projector.
+     */
+    FourierProjector(const FourierProjector &reference, bool shareCoefficients);
+
     /**
      * This method gets the volume's Fourier and the Euler's angles as the inputs and interpolates the related projection
      */
     void project(double rot, double tilt, double psi, const MultidimArray<double> *ctf=nullptr);
 
+    /** Project the volume along a list of directions.
+     * The projections are stored consecutively in stack, which is resized to
+     * N x 1 x volumeSize x volumeSize. If ctfs is given, it must have one entry
+     * per direction (nullptr for no CTF) of the size of projectionFourier.
+     *
+     * Directions are processed in blocks of blockSize: the central slices of a
+     * block are interpolated row by row from the interleaved single precision
+     * coefficients and then inverted with a single batched FFT. The result
+     * agrees with project() up to single precision accuracy.
+     */
+    void projectBatch(const std::vector<double> &rot, const std::vector<double> &tilt,
+                      const std::vector<double> &psi, MultidimArray<double> &stack,
+                      const std::vector<const MultidimArray<double>*> *ctfs=nullptr,
+                      size_t blockSize=32);
+
     /** Update volume */
     void updateVolume(MultidimArray<double> &V);
 public:
@@ -169,6 +195,9 @@ public:
 
     /// Prepare projection space
     void produceSideInfoProjection();
+
+    /// Prepare the interleaved coefficients for projectBatch (done on its first call)
+    void produceSideInfoBatch();
 };
 
 /*
@@ -0,0 +1,264 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#include <cstring>
+#include "metadata_serializer.h"
+#include "core/xmipp_error.h"
+
+namespace {
+
+/* Append the raw bytes of n elements */
+template<typename T>
+void put(std::vector<char> &buffer, const T *values, size_t n)
+{
+    size_t offset = buffer.size();
+    buffer.resize(offset + n * sizeof(T));
+    if (n > 0)
+        memcpy(buffer.data() + offset, values, n * sizeof(T));
+}
+
+template<typename T>
+void put(std::vector<char> &buffer, const T &value)
+{
+    put(buffer, &value, 1);
+}
+
+/* Sequential reader with bound checking */
+class BufferReader
+{
+public:
+    BufferReader(const char *buffer, size_t size): ptr(buffer), end(buffer + size) {}
+
+    template<typename T>
+    void get(T *values, size_t n)
+    {
+        size_t bytes = n * sizeof(T);
+        if (ptr + bytes > end)
+            REPORT_ERROR(ERR_MD, "MetaDataSerializer: truncated buffer");
+        if (n > 0)
+            memcpy(values, ptr, bytes);
+        ptr += bytes;
+    }
+
+    template<typename T>
+    T get()
+    {
+        T value;
+        get(&value, 1);
+        return value;
+    }
+
+    bool finished() const { return ptr == end; }
+
+private:
+    const char *ptr;
+    const char *end;
+};
+
+/* Deserialized values of a label */
+struct Column
+{
+    MDLabel label;
+    MDLabelType type;
+    std::vector<int> intValues;
+    std::vector<char> boolValues;
+    std::vector<double> doubleValues;
+    std::vector<size_t> sizetValues;
+    std::vector<String> stringValues;
+    std::vector< std::vector<double> > vectorDoubleValues;
+    std::vector< std::vector<size_t> > vectorSizetValues;
+};
+
+template<typename T>
+void putVectors(std::vector<char> &buffer, const std::vector< std::vector<T> > &values)
+{
+    for (const auto &v : values)
+    {
+        put(buffer, (uint64_t)v.size());
+        put(buffer, v.data(), v.size());
+    }
+}
+
+template<typename T>
+void getVectors(BufferReader &reader, std::vector< std::vector<T> > &values, size_t nRows)
+{
+    values.resize(nRows);
+    for (auto &v : values)
+    {
+        v.resize(reader.get<uint64_t>());
+        reader.get(v.data(), v.size());
+    }
+}
+
+} // namespace
+
+void MetaDataSerializer::serialize(const MetaData &md, std::vector<char> &buffer)
+{
+    buffer.clear();
+    std::vector<MDLabel> labels = md.getActiveLabels();
+    auto nRows = (uint64_t)md.size();
+    put(buffer, nRows);
+    put(buffer, (uint32_t)labels.size());
+    for (MDLabel label : labels)
+    {
+        auto type = MDL::labelType(label);
+        put(buffer, (int32_t)label);
+        switch (type)
+        {
+        case LABEL_INT:
+        {
+            auto values = md.getColumnValues<int>(label);
+            put(buffer, values.data(), values.size());
+            break;
+        }
+        case LABEL_BOOL:
+        {
+            auto values = md.getColumnValues<bool>(label);
+            for (bool v : values)
+                put(buffer, (char)v);
+            break;
+        }
+        case LABEL_DOUBLE:
+        {
+            auto values = md.getColumnValues<double>(label);
+            put(buffer, values.data(), values.size());
+            break;
+        }
+        case LABEL_SIZET:
+        {
+            auto values = md.getColumnValues<size_t>(label);
+            put(buffer, values.data(), values.size());
+            break;
+        }
+        case LABEL_STRING:
+        {
+            auto values = md.getColumnValues<String>(label);
+            for (const auto &v : values)
+            {
+                put(buffer, (uint64_t)v.size());
+                put(buffer, v.data(), v.size());
+            }
+            break;
+        }
+        case LABEL_VECTOR_DOUBLE:
+            putVectors(buffer, md.getColumnValues< std::vector<double> >(label));
+            break;
+        case LABEL_VECTOR_SIZET:
+            putVectors(buffer, md.getColumnValues< std::vector<size_t> >(label));
+            break;
+        default:
+            REPORT_ERROR(ERR_MD_BADLABEL, formatString("MetaDataSerializer: cannot serialize label %s",
+                         MDL::label2Str(label).c_str()));
+        }
+    }
+}
+
+void MetaDataSerializer::deserialize(const char *buffer, size_t size, MetaDataVec &md)
+{
+    if (size == 0)
+        return;
+    BufferReader reader(buffer, size);
+    auto nRows = (size_t)reader.get<uint64_t>();
+    auto nLabels = (size_t)reader.get<uint32_t>();
+
+    std::vector<Column> columns(nLabels);
+    for (auto &c : columns)
+    {
+        c.label = (MDLabel)reader.get<int32_t>();
+        c.type = MDL::labelType(c.label);
+        switch (c.type)
+        {
+        case LABEL_INT:
+            c.intValues.resize(nRows);
+            reader.get(c.intValues.data(), nRows);
+            break;
+        case LABEL_BOOL:
+            c.boolValues.resize(nRows);
+            reader.get(c.boolValues.data(), nRows);
+            break;
+        case LABEL_DOUBLE:
+            c.doubleValues.resize(nRows);
+            reader.get(c.doubleValues.data(), nRows);
+            break;
+        case LABEL_SIZET:
+            c.sizetValues.resize(nRows);
+            reader.get(c.sizetValues.data(), nRows);
+            break;
+        case LABEL_STRING:
+            c.stringValues.resize(nRows);
+            for (auto &v : c.stringValues)
+            {
+                v.resize(reader.get<uint64_t>());
+                reader.get(&v[0], v.size());
+            }
+            break;
+        case LABEL_VECTOR_DOUBLE:
+            getVectors(reader, c.vectorDoubleValues, nRows);
+            break;
+        case LABEL_VECTOR_SIZET:
+            getVectors(reader, c.vectorSizetValues, nRows);
+            break;
+        default:
+            REPORT_ERROR(ERR_MD_BADLABEL, "MetaDataSerializer: unknown label in buffer");
+        }
+    }
+    if (!reader.finished())
+        REPORT_ERROR(ERR_MD, "MetaDataSerializer: unexpected data at the end of the buffer");
+
+    for (size_t r = 0; r < nRows; r++)
+    {
+        MDRowVec row;
+        for (const auto &c : columns)
+        {
+            switch (c.type)
+            {
+            case LABEL_INT:
+                row.setValue(c.label, c.intValues[r]);
+                break;
+            case LABEL_BOOL:
+                row.setValue(c.label, c.boolValues[r] != 0);
+                break;
+            case LABEL_DOUBLE:
+                row.setValue(c.label, c.doubleValues[r]);
+                break;
+            case LABEL_SIZET:
+                row.setValue(c.label, c.sizetValues[r]);
+                break;
+            case LABEL_STRING:
+                row.setValue(c.label, c.stringValues[r]);
+                break;
+            case LABEL_VECTOR_DOUBLE:
+                row.setValue(c.label, c.vectorDoubleValues[r]);
+                break;
+            case LABEL_VECTOR_SIZET:
+                row.setValue(c.label, c.vectorSizetValues[r]);
+                break;
+            default:
+                break;
+            }
+        }
+        md.addRow(row);
+    }
+}
@@ -0,0 +1,56 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#ifndef LIBRARIES_DATA_METADATA_SERIALIZER_H_
+#define LIBRARIES_DATA_METADATA_SERIALIZER_H_
+
+#include <vector>
+#include "core/metadata_vec.h"
+
+/**@defgroup MetaDataSerializer Binary metadata serialization
+   @ingroup DataLibrary */
+//@{
+
+/** Binary serialization of the rows of a metadata.
+ * It is meant to exchange metadatas between processes (e.g., through MPI)
+ * without writing them to disk. The buffer stores the active labels
+ * and, for each of them, the values of all rows (column major), so it
+ * can be filled from any MetaData (MetaDataVec or MetaDataDb).
+ * The format is only valid between processes of the same machine type.
+ */
+class MetaDataSerializer
+{
+public:
+    /** Serialize all rows of md. The buffer is overwritten. */
+    static void serialize(const MetaData &md, std::vector<char> &buffer);
+
+    /** Append the rows stored in a serialized buffer to md.
+     * Labels not present in md are added.
+     */
+    static void deserialize(const char *buffer, size_t size, MetaDataVec &md);
+};
+
+//@}
+#endif
@@ -23,6 +23,7 @@
  *  e-mail address 'xmipp@cnb.csic.es'
  ***************************************************************************/
 
+#include <algorithm>
 #include <fstream>
 #include <string>
 #include <filesystem>
@@ -238,6 +239,20 @@ void computePDBgeometry(const std::string &fnPDB,
                         Matrix1D<double> &centerOfMass,
                         Matrix1D<double> &limit0, Matrix1D<double> &limitF,
                         const std::string &intensityColumn)
+{
+    // Initialize PDBRichPhantom and read atom struct file
+    PDBRichPhantom pdbFile;
+
+    // Read centered pdb
+    pdbFile.read(fnPDB);
+
+    computePDBgeometry(pdbFile, centerOfMass, limit0, limitF, intensityColumn);
+}
+
+void computePDBgeometry(const PDBRichPhantom &pdb,
+                        Matrix1D<double> &centerOfMass,
+                        Matrix1D<double> &limit0, Matrix1D<double> &limitF,
+                        const std::string &intensityColumn)
 {
     // Initialization
     centerOfMass.initZeros(3);
@@ -247,15 +262,9 @@ void computePDBgeometry(const std::string &fnPDB,
     limitF.initConstant(-1e30);
     double total_mass = 0;
 
-    // Initialize PDBRichPhantom and read atom struct file
-    PDBRichPhantom pdbFile;
-
-    // Read centered pdb
-    pdbFile.read(fnPDB);
-
     // For each atom, correct necessary info
     bool useBFactor = intensityColumn=="Bfactor";
-    for (auto& atom : pdbFile.atomList) {
+    for (const auto& atom : pdb.atomList) {
         // Update center of mass and limits
         XX(limit0) = std::min(XX(limit0), atom.x);
         YY(limit0) = std::min(YY(limit0), atom.y);
@@ -289,6 +298,70 @@ void computePDBgeometry(const std::string &fnPDB,
     centerOfMass /= total_mass;
 }
 
+void computePDBgeometry(const PDBCompactPhantom &pdb,
+                        Matrix1D<double> &centerOfMass,
+                        Matrix1D<double> &limit0, Matrix1D<double> &limitF,
+                        const std::string &intensityColumn)
+{
+    // Initialization
+    centerOfMass.initZeros(3);
+    limit0.resizeNoCopy(3);
+    limitF.resizeNoCopy(3);
+    limit0.initConstant(1e30);
+    limitF.initConstant(-1e30);
+    double total_mass = 0;
+
+    // The weight only depends on the atom name, compute it once per name
+    bool useBFactor = intensityColumn=="Bfactor";
+    size_t Nnames = pdb.names.size();
+    std::vector<double> nameCharge(Nnames);
+    std::vector<bool> pseudoatom(Nnames);
+    for (size_t n = 0; n < Nnames; n++)
+    {
+        pseudoatom[n] = pdb.names[n] == "EN";
+        if (!pseudoatom[n])
+            nameCharge[n] = atomCharge(pdb.names[n]);
+    }
+
+    size_t imax = pdb.getNumberOfAtoms();
+    for (size_t i = 0; i < imax; i++)
+    {
+        // Update center of mass and limits
+        double x = pdb.x[i];
+        double y = pdb.y[i];
+        double z = pdb.z[i];
+        XX(limit0) = std::min(XX(limit0), x);
+        YY(limit0) = std::min(YY(limit0), y);
+        ZZ(limit0) = std::min(ZZ(limit0), z);
+
+        XX(limitF) = std::max(XX(limitF), x);
+        YY(limitF) = std::max(YY(limitF), y);
+        ZZ(limitF) = std::max(ZZ(limitF), z);
+
+        double weight;
+        if (pseudoatom[pdb.nameIdx[i]])
+        {
+            if (useBFactor)
+                weight = pdb.bfactor[i];
+            else
+                weight = pdb.occupancy[i];
+        }
+        else
+        {
+            if (pdb.hetatm[i])
+                continue;
+            weight = nameCharge[pdb.nameIdx[i]];
+        }
+        total_mass += weight;
+        XX(centerOfMass) += weight * x;
+        YY(centerOfMass) += weight * y;
+        ZZ(centerOfMass) += weight * z;
+    }
+
+    // Finish calculations
+    centerOfMass /= total_mass;
+}
+
 /* Apply geometry ---------------------------------------------------------- */
 void applyGeometryToPDBFile(const std::string &fn_in, const std::string &fn_out,
                    const Matrix2D<double> &A, bool centerPDB,
@@ -872,6 +945,317 @@ void PDBRichPhantom::write(const FileName &fnPDB, const bool renumber)
     }
 }
 
+/* Compact phantom ---------------------------------------------------------- */
+uint32_t PDBStringTable::intern(const std::string &str)
+{
+    auto it = index.find(str);
+    if (it != index.end())
+        return it->second;
+    auto idx = (uint32_t)strings.size();
+    strings.push_back(str);
+    index.emplace(str, idx);
+    return idx;
+}
+
+void PDBStringTable::clear()
+{
+    strings.clear();
+    index.clear();
+}
+
+void PDBCompactPhantom::addAtom(const RichAtom &atom)
+{
+    addAtom(atom, std::string(1, atom.chainid));
+}
+
+void PDBCompactPhantom::addAtom(const RichAtom &atom, const std::string &chain)
+{
+    x.push_back(atom.x);
+    y.push_back(atom.y);
+    z.push_back(atom.z);
+    occupancy.push_back(atom.occupancy);
+    bfactor.push_back(atom.bfactor);
+    resseq.push_back(atom.resseq);
+    nameIdx.push_back(names.intern(atom.name));
+    elementIdx.push_back(elements.intern(atom.atomType));
+    residueIdx.push_back(residues.intern(atom.resname));
+    chainIdx.push_back(chains.intern(chain));
+    hetatm.push_back(atom.record == "HETATM");
+}
+
+void PDBCompactPhantom::reserve(size_t n)
+{
+    x.reserve(n);
+    y.reserve(n);
+    z.reserve(n);
+    occupancy.reserve(n);
+    bfactor.reserve(n);
+    resseq.reserve(n);
+    nameIdx.reserve(n);
+    elementIdx.reserve(n);
+    residueIdx.reserve(n);
+    chainIdx.reserve(n);
+    hetatm.reserve(n);
+}
+
+void PDBCompactPhantom::clear()
+{
+    remarks.clear();
+    x.clear();
+    y.clear();
+    z.clear();
+    occupancy.clear();
+    bfactor.clear();
+    resseq.clear();
+    nameIdx.clear();
+    elementIdx.clear();
+    residueIdx.clear();
+    chainIdx.clear();
+    hetatm.clear();
+    names.clear();
+    elements.clear();
+    residues.clear();
+    chains.clear();
+}
+
+void PDBCompactPhantom::fromRichPhantom(const PDBRichPhantom &pdb)
+{
+    clear();
+    remarks = pdb.remarks;
+    reserve(pdb.getNumberOfAtoms());
+    for (const auto &atom : pdb.atomList)
+        addAtom(atom);
+}
+
+/**
+ * @brief Split a line of a CIF file into its values.
+ *
+ * Values are separated by blanks and may be quoted with ' or ". A quote
+ * only closes the value if it is followed by a blank.
+ *
+ * @param line Line to split.
+ * @param tokens Values are appended to this list.
+*/
+void tokenizeCIFLine(const std::string &line, std::vector<std::string> &tokens)
+{
+    size_t i = 0;
+    size_t n = line.size();
+    while (i < n)
+    {
+        while (i < n && isspace(line[i]))
+            i++;
+        if (i >= n)
+            break;
+        char quote = line[i];
+        if (quote == '\'' || quote == '"')
+        {
+            size_t end = i + 1;
+            while (end < n && !(line[end] == quote && (end + 1 == n || isspace(line[end + 1]))))
+                end++;
+            tokens.emplace_back(line, i + 1, end - i - 1);
+            i = end + 1;
+        }
+        else
+        {
+            size_t end = i;
+            while (end < n && !isspace(line[end]))
+                end++;
+            tokens.emplace_back(line, i, end - i);
+            i = end;
+        }
+    }
+}
+
+/**
+ * @brief Read compact phantom from CIF.
+ *
+ * This function streams the atom_site loop of the given CIF file, without
+ * building the whole data block in memory. Values are interpreted as in
+ * readRichCIF ("?" and "." are empty strings or zeros).
+ *
+ * @param fnCIF CIF file path.
+ * @param pdb Phantom where the atoms are added.
+ * @param threshold Atoms with a smaller B factor are not added.
+ * @return false if the file does not have an atom_site loop.
+*/
+bool readCompactCIF(const std::string &fnCIF, PDBCompactPhantom &pdb, const double threshold)
+{
+    std::ifstream fh_in(fnCIF);
+    if (!fh_in)
+        REPORT_ERROR(ERR_IO_NOTEXIST, fnCIF);
+
+    enum { RECORD, ATOM_ID, COMP_ID, ASYM_ID, ENTITY_ID, X, Y, Z, OCCUPANCY, BFACTOR, NCOLUMNS };
+    const char *columnNames[NCOLUMNS] = { "group_PDB", "label_atom_id", "label_comp_id",
+        "label_asym_id", "label_entity_id", "Cartn_x", "Cartn_y", "Cartn_z", "occupancy",
+        "B_iso_or_equiv" };
+    int column[NCOLUMNS];
+
+    auto isNull = [](const std::string &value) { return value == "?" || value == "."; };
+    auto toFloat = [&isNull](const std::string &value) {
+        return isNull(value) ? 0.0f : strtof(value.c_str(), nullptr);
+    };
+
+    std::string line;
+    std::vector<std::string> header, tokens;
+    bool inHeader = false, inAtomSite = false, inText = false, found = false;
+    RichAtom atom;
+    while (getline(fh_in, line))
+    {
+        // Multi-line values are not used by atom_site
+        if (!line.empty() && line[0] == ';')
+        {
+            inText = !inText;
+            continue;
+        }
+        if (inText)
+            continue;
+
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos)
+            continue;
+        if (line.compare(first, 5, "loop_") == 0)
+        {
+            if (inAtomSite)
+                break;
+            inHeader = true;
+            header.clear();
+            continue;
+        }
+        if (line[first] == '_')
+        {
+            if (inAtomSite)
+                break;
+            if (inHeader)
+                header.push_back(line.substr(first, line.find_first_of(" \t\r", first) - first));
+            continue;
+        }
+        if (line[first] == '#' || line.compare(first, 5, "data_") == 0)
+        {
+            if (inAtomSite)
+                break;
+            inHeader = false;
+            continue;
+        }
+        if (inHeader)
+        {
+            // First row of a loop
+            inHeader = false;
+            if (!header.empty() && header[0].compare(0, 11, "_atom_site.") == 0)
+            {
+                inAtomSite = found = true;
+                tokens.clear();
+                for (int c = 0; c < NCOLUMNS; c++)
+                {
+                    auto it = std::find(header.begin(), header.end(), (std::string)"_atom_site." + columnNames[c]);
+                    column[c] = it == header.end() ? -1 : (int)(it - header.begin());
+                }
+                if (column[RECORD] < 0 || column[ATOM_ID] < 0 || column[X] < 0 || column[Y] < 0 || column[Z] < 0)
+                    REPORT_ERROR(ERR_IO_NOREAD, fnCIF + ": atom_site does not have atom names and positions");
+            }
+        }
+        if (!inAtomSite)
+            continue;
+
+        // Rows may span several lines
+        tokenizeCIFLine(line, tokens);
+        while (tokens.size() >= header.size())
+        {
+            auto value = [&](int c) -> std::string {
+                if (column[c] < 0 || isNull(tokens[column[c]]))
+                    return "";
+                return tokens[column[c]];
+            };
+            atom.record = value(RECORD);
+            if (atom.record == "ATOM" || atom.record == "HETATM")
+            {
+                atom.name = value(ATOM_ID);
+                atom.atomType = atom.name;
+                atom.resname = value(COMP_ID);
+                atom.altloc = value(ASYM_ID);
+                atom.resseq = column[ENTITY_ID] < 0 ? 0 : (int)toFloat(tokens[column[ENTITY_ID]]);
+                atom.x = toFloat(tokens[column[X]]);
+                atom.y = toFloat(tokens[column[Y]]);
+                atom.z = toFloat(tokens[column[Z]]);
+                atom.occupancy = column[OCCUPANCY] < 0 ? 0.0f : toFloat(tokens[column[OCCUPANCY]]);
+                atom.bfactor = column[BFACTOR] < 0 ? 0.0f : toFloat(tokens[column[BFACTOR]]);
+                if (atom.bfactor >= threshold)
+                    pdb.addAtom(atom, atom.altloc);
+            }
+            tokens.erase(tokens.begin(), tokens.begin() + header.size());
+        }
+    }
+    return found;
+}
+
+/**
+ * @brief Read compact phantom from PDB.
+ *
+ * Same fields and conventions as readRichPDB.
+ *
+ * @param fnPDB PDB file.
+ * @param pdb Phantom where the atoms and remarks are added.
+ * @param threshold Atoms with a smaller B factor are not added.
+*/
+void readCompactPDB(const FileName &fnPDB, PDBCompactPhantom &pdb, const double threshold)
+{
+    std::ifstream fh_in;
+    fh_in.open(fnPDB.c_str());
+    if (!fh_in)
+        REPORT_ERROR(ERR_IO_NOTEXIST, fnPDB);
+
+    std::string line;
+    std::string kind;
+    RichAtom atom;
+    while (getline(fh_in, line))
+    {
+        if (line == "")
+            continue;
+
+        kind = line.substr(0, 6);
+        kind.erase(kind.find_last_not_of(' ') + 1);
+        if (kind == "ATOM" || kind == "HETATM")
+        {
+            line.resize(80, ' ');
+            atom.record = kind;
+            atom.name = line.substr(13, 3);
+            atom.name.erase(atom.name.find_last_not_of(' ') + 1);
+            atom.resname = line.substr(17, 3);
+            atom.chainid = line[21];
+            hy36decodeSafe(4, line.substr(22, 4).c_str(), 4, &atom.resseq);
+            atom.x = textToFloat(line.substr(30, 8));
+            atom.y = textToFloat(line.substr(38, 8));
+            atom.z = textToFloat(line.substr(46, 8));
+            atom.occupancy = textToFloat(line.substr(54, 6));
+            atom.bfactor = textToFloat(line.substr(60, 6));
+            atom.atomType = line.substr(77, 1);
+            if (atom.bfactor >= threshold)
+                pdb.addAtom(atom);
+        }
+        else if (kind == "REMARK")
+            pdb.remarks.push_back(line);
+    }
+}
+
+void PDBCompactPhantom::read(const FileName &fnPDB, const double threshold)
+{
+    clear();
+    const std::filesystem::path path(fnPDB.getString());
+    if (checkExtension(path, {".cif"}, {})) {
+        if (readCompactCIF(fnPDB.getString(), *this, threshold))
+            return;
+        clear();
+    }
+    if (checkExtension(path, {".cif"}, {".gz"})) {
+        PDBRichPhantom rich;
+        rich.read(fnPDB, false, threshold);
+        reserve(rich.getNumberOfAtoms());
+        for (const auto &atom : rich.atomList)
+            addAtom(atom, atom.altloc);
+    } else {
+        readCompactPDB(fnPDB, *this, threshold);
+    }
+}
+
 /* Atom descriptors -------------------------------------------------------- */
 void atomDescriptors(const std::string &atom, Matrix1D<double> &descriptors)
 {
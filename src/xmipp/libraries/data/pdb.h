@@ -29,6 +29,8 @@
 #ifndef _XMIPP_PDB_HH
 #define _XMIPP_PDB_HH
 
+#include <cstdint>
+#include <unordered_map>
 #include <vector>
 #include "cif++.hpp"
 #include "core/xmipp_error.h"
@@ -42,6 +44,8 @@ class MultidimArray;
 class FileName;
 class Projection;
 class Histogram1D;
+class PDBRichPhantom;
+class PDBCompactPhantom;
 
 /**@defgroup PDBinterface PDB
    @ingroup InterfaceLibrary */
@@ -76,6 +80,20 @@ void computePDBgeometry(const std::string &fnPDB,
                         Matrix1D<double> &limit0, Matrix1D<double> &limitF,
                         const std::string &intensityColumn);
 
+/** Compute the center of mass and limits of a PDB already in memory.
+    Same as the previous function, but without reading the structure
+    from disk. */
+void computePDBgeometry(const PDBRichPhantom &pdb,
+                        Matrix1D<double> &centerOfMass,
+                        Matrix1D<double> &limit0, Matrix1D<double> &limitF,
+                        const std::string &intensityColumn);
+
+/** Compute the center of mass and limits of a compact PDB. */
+void computePDBgeometry(const PDBCompactPhantom &pdb,
+                        Matrix1D<double> &centerOfMass,
+                        Matrix1D<double> &limit0, Matrix1D<double> &limitF,
+                        const std::string &intensityColumn);
+
 /** Apply geometry transformation to an input PDB.
     The result is written in the output PDB. Set centerPDB if you
     want to compute the center of mass first and apply the transformation
@@ -298,6 +316,138 @@ public:
 
 };
 
+/** Table of strings.
+    Each distinct string is stored once and referred by its index. */
+class PDBStringTable
+{
+public:
+    /// Index of a string, it is added if it is not in the table
+    uint32_t intern(const std::string &str);
+
+    /// String with a given index
+    const std::string& operator[](uint32_t idx) const
+    {
+        return strings[idx];
+    }
+
+    /// Number of distinct strings
+    size_t size() const
+    {
+        return strings.size();
+    }
+
+    /// Remove all strings
+    void clear();
+private:
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, uint32_t> index;
+};
+
+/** Compact phantom description for large structures.
+    The atoms are stored as a structure of arrays with the fields needed to
+    convert a structure into a volume. Atom names, elements, residue names
+    and chains are stored in string tables, so that an atom takes a few tens
+    of bytes instead of the hundreds of a RichAtom. Coordinates,
+    occupancies and B factors are kept in single precision, as they are
+    read from the files.
+*/
+class PDBCompactPhantom
+{
+public:
+    /// List of remarks
+    std::vector<std::string> remarks;
+
+    /// Position X
+    std::vector<float> x;
+
+    /// Position Y
+    std::vector<float> y;
+
+    /// Position Z
+    std::vector<float> z;
+
+    /// Occupancy
+    std::vector<float> occupancy;
+
+    /// Bfactor
+    std::vector<float> bfactor;
+
+    /// Residue sequence
+    std::vector<int> resseq;
+
+    /// Index of the atom name in names
+    std::vector<uint32_t> nameIdx;
+
+    /// Index of the atom element type in elements
+    std::vector<uint32_t> elementIdx;
+
+    /// Index of the residue name in residues
+    std::vector<uint32_t> residueIdx;
+
+    /// Index of the chain in chains
+    std::vector<uint32_t> chainIdx;
+
+    /// 1 for HETATM records, 0 for ATOM
+    std::vector<uint8_t> hetatm;
+
+    /// Atom names
+    PDBStringTable names;
+
+    /// Atom element types
+    PDBStringTable elements;
+
+    /// Residue names
+    PDBStringTable residues;
+
+    /// Chains
+    PDBStringTable chains;
+
+    /// Add an atom with the fields of a rich atom, the chain is chainid
+    void addAtom(const RichAtom &atom);
+
+    /// Add an atom with the fields of a rich atom and the given chain
+    void addAtom(const RichAtom &atom, const std::string &chain);
+
+    /// Get number of atoms
+    size_t getNumberOfAtoms() const
+    {
+        return x.size();
+    }
+
+    /// Atom name of atom i
+    const std::string& getName(size_t i) const
+    {
+        return names[nameIdx[i]];
+    }
+
+    /// Element type of atom i
+    const std::string& getElement(size_t i) const
+    {
+        return elements[elementIdx[i]];
+    }
+
+    /// Reserve memory for a number of atoms
+    void reserve(size_t n);
+
+    /// Remove all atoms and remarks
+    void clear();
+
+    /** Copy the atoms and remarks of a rich phantom. */
+    void fromRichPhantom(const PDBRichPhantom &pdb);
+
+    /**
+     * @brief Read compact phantom from either a PDB of CIF file.
+     *
+     * The file is processed line by line and only the atoms are kept in
+     * memory. Atoms take the same values as in PDBRichPhantom::read.
+     * Compressed CIF files are read through PDBRichPhantom.
+     *
+     * @param fnPDB PDB/CIF file.
+     * @param threshold Atoms with a smaller B factor are not read.
+    */
+    void read(const FileName &fnPDB, const double threshold = 0.0);
+};
+
 /** Description of the electron scattering factors.
     The returned descriptor is descriptor(0)=Z (number of electrons of the
     atom), descriptor(1-5)=a1-5, descriptor(6-10)=b1-5.
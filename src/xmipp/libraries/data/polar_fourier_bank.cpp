@@ -0,0 +1,191 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#include "polar_fourier_bank.h"
+#include <algorithm>
+#include <cstring>
+#include "core/xmipp_error.h"
+#include "fftwT.h"
+
+PolarFourierBankAux::~PolarFourierBankAux()
+{
+    clear();
+}
+
+void PolarFourierBankAux::clear()
+{
+    for (auto &p : plans)
+        FFTwT<float>::release(p.second);
+    plans.clear();
+    FFTwT<float>::release(Fsum);
+    FFTwT<float>::release(corr);
+    Fsum = nullptr;
+    corr = nullptr;
+    blockSize = fourierSize = realSize = 0;
+}
+
+PolarFourierBank::~PolarFourierBank()
+{
+    clear();
+}
+
+void PolarFourierBank::clear()
+{
+    FFTwT<float>::release(data);
+    data = nullptr;
+    capacity = realSize = fourierSize = 0;
+    ringSamples.clear();
+    ringOffset.clear();
+    ringWeight.clear();
+}
+
+size_t PolarFourierBank::bytesPerReference(const Polar<std::complex<double> > &layout)
+{
+    size_t samples = 0;
+    for (int iring = 0; iring < layout.getRingNo(); iring++)
+        samples += layout.getSampleNo(iring);
+    return samples * sizeof(std::complex<float>);
+}
+
+void PolarFourierBank::initialize(const Polar<std::complex<double> > &layout,
+                                  size_t realSize, size_t capacity)
+{
+    clear();
+    this->capacity = capacity;
+    this->realSize = realSize;
+    fourierSize = realSize / 2 + 1;
+    size_t offset = 0;
+    for (int iring = 0; iring < layout.getRingNo(); iring++)
+    {
+        size_t samples = layout.getSampleNo(iring);
+        if (samples > fourierSize)
+            REPORT_ERROR(ERR_VALUE_INCORRECT,
+                         "PolarFourierBank: the rings are longer than the outer ring");
+        ringSamples.push_back(samples);
+        ringOffset.push_back(offset);
+        ringWeight.push_back((float)(2. * PI * layout.ring_radius[iring]));
+        offset += capacity * samples;
+    }
+    if (offset > 0)
+    {
+        data = (std::complex<float> *)FFTwT<float>::allocateAligned(offset * sizeof(std::complex<float>));
+        if (data == nullptr)
+            REPORT_ERROR(ERR_MEM_NOTENOUGH, "PolarFourierBank: cannot allocate the references");
+        memset((void *)data, 0, offset * sizeof(std::complex<float>));
+    }
+}
+
+void PolarFourierBank::checkLayout(const Polar<std::complex<double> > &fP) const
+{
+    bool ok = (size_t)fP.getRingNo() == ringSamples.size();
+    for (size_t iring = 0; ok && iring < ringSamples.size(); iring++)
+        ok = (size_t)fP.getSampleNo(iring) == ringSamples[iring];
+    if (!ok)
+        REPORT_ERROR(ERR_MULTIDIM_SIZE,
+                     "PolarFourierBank: the polar transform does not have the rings of the bank");
+}
+
+void PolarFourierBank::set(size_t slot, const Polar<std::complex<double> > &fP, double scale)
+{
+    if (slot >= capacity)
+        REPORT_ERROR(ERR_INDEX_OUTOFBOUNDS, "PolarFourierBank: slot out of range");
+    checkLayout(fP);
+    for (size_t iring = 0; iring < ringSamples.size(); iring++)
+    {
+        size_t samples = ringSamples[iring];
+        double w = ringWeight[iring] * scale;
+        const std::complex<double> *ptrIn = MULTIDIM_ARRAY(fP.rings[iring]);
+        std::complex<float> *ptrOut = data + ringOffset[iring] + slot * samples;
+        for (size_t i = 0; i < samples; i++)
+            ptrOut[i] = std::complex<float>((float)(w * ptrIn[i].real()), (float)(w * ptrIn[i].imag()));
+    }
+}
+
+void PolarFourierBank::prepareAux(PolarFourierBankAux &aux, size_t n) const
+{
+    if (aux.realSize != realSize || aux.blockSize < n)
+    {
+        size_t blockSize = std::max(n, aux.realSize == realSize ? aux.blockSize : 0);
+        aux.clear();
+        aux.blockSize = blockSize;
+        aux.realSize = realSize;
+        aux.fourierSize = fourierSize;
+        aux.Fsum = (std::complex<float> *)FFTwT<float>::allocateAligned(
+                       blockSize * fourierSize * sizeof(std::complex<float>));
+        aux.corr = (float *)FFTwT<float>::allocateAligned(blockSize * realSize * sizeof(float));
+        if (aux.Fsum == nullptr || aux.corr == nullptr)
+            REPORT_ERROR(ERR_MEM_NOTENOUGH, "PolarFourierBank: cannot allocate the correlations");
+    }
+    if (aux.plans.find(n) == aux.plans.end())
+    {
+        FFTSettings<float> settings(realSize, 1, 1, n, n, false, false);
+        aux.plans[n] = (void *)FFTwT<float>::createPlan(CPU(), settings, true);
+    }
+}
+
+void PolarFourierBank::correlate(const Polar<std::complex<double> > &fP,
+                                 const size_t *slots, size_t n, double scale, float *corr,
+                                 PolarFourierBankAux &aux) const
+{
+    if (n == 0)
+        return;
+    checkLayout(fP);
+    prepareAux(aux, n);
+    memset((void *)aux.Fsum, 0, n * fourierSize * sizeof(std::complex<float>));
+
+    // Multiply the image with all the references, one ring at a time
+    std::vector<float> image;
+    for (size_t iring = 0; iring < ringSamples.size(); iring++)
+    {
+        size_t samples = ringSamples[iring];
+        const std::complex<double> *ptrImg = MULTIDIM_ARRAY(fP.rings[iring]);
+        image.resize(2 * samples);
+        for (size_t i = 0; i < samples; i++)
+        {
+            image[2 * i] = (float)ptrImg[i].real();
+            image[2 * i + 1] = (float)ptrImg[i].imag();
+        }
+        const float *a = image.data();
+        const std::complex<float> *ring = data + ringOffset[iring];
+        for (size_t k = 0; k < n; k++)
+        {
+            if (slots[k] >= capacity)
+                REPORT_ERROR(ERR_INDEX_OUTOFBOUNDS, "PolarFourierBank: slot out of range");
+            const auto *c = (const float *)(ring + slots[k] * samples);
+            auto *sum = (float *)(aux.Fsum + k * fourierSize);
+            for (size_t i = 0; i < 2 * samples; i += 2)
+            {
+                sum[i] += a[i] * c[i] - a[i + 1] * c[i + 1];
+                sum[i + 1] += a[i + 1] * c[i] + a[i] * c[i + 1];
+            }
+        }
+    }
+
+    // Inverse transform of all the sums at once
+    FFTwT<float>::ifft(aux.plans[n], aux.Fsum, aux.corr);
+    auto fscale = (float)scale;
+    for (size_t i = 0; i < n * realSize; i++)
+        corr[i] = aux.corr[i] * fscale;
+}
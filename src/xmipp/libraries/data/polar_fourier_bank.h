@@ -0,0 +1,146 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#ifndef LIBRARIES_DATA_POLAR_FOURIER_BANK_H_
+#define LIBRARIES_DATA_POLAR_FOURIER_BANK_H_
+
+#include <complex>
+#include <map>
+#include <vector>
+#include "polar.h"
+
+/**@defgroup PolarFourierBank Bank of polar Fourier transforms
+   @ingroup DataLibrary */
+//@{
+/** Work space of PolarFourierBank::correlate.
+ * Each thread needs its own.
+ */
+class PolarFourierBankAux
+{
+public:
+    PolarFourierBankAux() = default;
+    PolarFourierBankAux(const PolarFourierBankAux &) = delete;
+    PolarFourierBankAux &operator=(const PolarFourierBankAux &) = delete;
+    ~PolarFourierBankAux();
+
+    /// Release the buffers and the plans
+    void clear();
+
+private:
+    friend class PolarFourierBank;
+    // Sum of the ring products of each reference of the block
+    std::complex<float> *Fsum = nullptr;
+    // Correlations of each reference of the block
+    float *corr = nullptr;
+    size_t blockSize = 0;
+    size_t fourierSize = 0;
+    size_t realSize = 0;
+    // Inverse transform of n references for each block size n
+    std::map<size_t, void *> plans;
+};
+
+/** Bank of polar Fourier transforms of references.
+ * The Fourier transforms of the rings of all references are stored in a
+ * single aligned buffer of floats, ring-major (all the references of the
+ * first ring, then all the references of the second ring, ...), weighted
+ * by the ring circumference. The rotational correlation of an image with a
+ * block of references is then a batched complex multiplication followed by
+ * a batched inverse Fourier transform, and takes half the memory of an
+ * array of Polar<std::complex<double> >.
+ *
+ * The result of correlate is the one of rotationalCorrelation with each
+ * reference (computed in single precision).
+ *
+   @code
+   PolarFourierBank bank;
+   bank.initialize(fP, P.getSampleNoOuterRing(), Nrefs);
+   for (size_t i = 0; i < Nrefs; i++)
+       bank.set(i, fPref[i], 1 / stddevRef[i]); // conjugated
+   PolarFourierBankAux aux;
+   bank.correlate(fPimg, slots, n, 1 / stddevImg, corr, aux);
+   @endcode
+ */
+class PolarFourierBank
+{
+public:
+    PolarFourierBank() = default;
+    PolarFourierBank(const PolarFourierBank &) = delete;
+    PolarFourierBank &operator=(const PolarFourierBank &) = delete;
+    ~PolarFourierBank();
+
+    /** Allocate the bank.
+     * The rings of layout (a polar Fourier transform) define the number of
+     * samples of the references. realSize is the number of samples of the
+     * outer ring in real space (the size of the correlations).
+     */
+    void initialize(const Polar<std::complex<double> > &layout, size_t realSize,
+                    size_t capacity);
+
+    /// Release the memory
+    void clear();
+
+    /// Bytes taken by each reference with this layout
+    static size_t bytesPerReference(const Polar<std::complex<double> > &layout);
+
+    /// Maximum number of references
+    size_t getCapacity() const
+    {
+        return capacity;
+    }
+
+    /// Size of the correlations
+    size_t getRealSize() const
+    {
+        return realSize;
+    }
+
+    /** Store a reference in a slot.
+     * The reference must already be complex conjugated (fourierTransformRings
+     * with conjugated=true). Its values are multiplied by scale.
+     */
+    void set(size_t slot, const Polar<std::complex<double> > &fP, double scale = 1);
+
+    /** Rotational correlation of an image with the references in n slots.
+     * The correlation with slots[k] is stored in corr[k*getRealSize()] and
+     * multiplied by scale. The angle of the sample i is i*360/getRealSize().
+     */
+    void correlate(const Polar<std::complex<double> > &fP, const size_t *slots, size_t n,
+                   double scale, float *corr, PolarFourierBankAux &aux) const;
+
+private:
+    void checkLayout(const Polar<std::complex<double> > &fP) const;
+    void prepareAux(PolarFourierBankAux &aux, size_t n) const;
+
+    std::complex<float> *data = nullptr;
+    size_t capacity = 0;
+    size_t realSize = 0;
+    size_t fourierSize = 0;
+    // Samples of each ring and position of the ring in data
+    std::vector<size_t> ringSamples;
+    std::vector<size_t> ringOffset;
+    std::vector<float> ringWeight;
+};
+//@}
+#endif /* LIBRARIES_DATA_POLAR_FOURIER_BANK_H_ */
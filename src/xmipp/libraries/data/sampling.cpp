@@ -27,6 +27,28 @@
 #include "core/geometry.h"
 #include "core/xmipp_image_macros.h"
 #include "core/metadata_vec.h"
+#include "spherical_index.h"
+#include <atomic>
+#include <thread>
+
+/* Run f(thrId, i) for i in [first, last) with several threads */
+template<typename F>
+static void parallelFor(size_t first, size_t last, int numThreads, const F &f)
+{
+    size_t nThreads = std::min((size_t)std::max(numThreads, 1), last - first);
+    std::atomic<size_t> next(first);
+    auto worker = [&](int thrId)
+    {
+        for (size_t i = next++; i < last; i = next++)
+            f(thrId, i);
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < nThreads; ++t)
+        threads.emplace_back(worker, (int)t);
+    worker(0);
+    for (auto &t : threads)
+        t.join();
+}
 
 /* Default Constructor */
 Sampling::Sampling()
@@ -93,6 +115,7 @@ Sampling::Sampling()
     exp_data_fileNames.clear();
 
     verbose=1;
+    numThreads=1;
     //#define DEBUG1
 #ifdef  DEBUG1
 
@@ -1257,14 +1280,10 @@ void Sampling::removeRedundantPointsExhaustive(const int symmetry,
 {
     // Maximum distance
     double cos_max_ang = cos(DEG2RAD(max_ang));
-    double my_dotProduct;
-    //int j_end=0;
     Matrix1D<double>  direction(3), direction1(3);
 
     // First call to conventional removeRedundantPoints
     removeRedundantPoints(symmetry, sym_order);
-    //    for (int isym = 0; isym < no_redundant_sampling_points_vector.size(); isym++)
-    //         std::cout << "sampling:" << no_redundant_sampling_points_vector[isym];
     std::vector <Matrix1D<double> > old_vector = no_redundant_sampling_points_vector;
     std::vector <Matrix1D<double> > old_angles = no_redundant_sampling_points_angles;
 
@@ -1273,37 +1292,33 @@ void Sampling::removeRedundantPointsExhaustive(const int symmetry,
     // Precalculate symmetry matrices
     fillLRRepository();
 
-    // Then check all points versus each other
+    // Then check all points versus the symmetric copies of the accepted
+    // ones. L*R^t*v.d1 = v.R*L^t*d1, so the symmetries are applied to the
+    // point being checked and the accepted points are looked up in an index
+    std::vector< Matrix2D<double> > RLt(R_repository.size());
+    for (size_t j = 0; j < R_repository.size(); j++)
+        RLt[j] = R_repository[j] * L_repository[j].transpose();
+    SphericalIndex accepted(SphericalIndex::cellSizeFor(DEG2RAD(max_ang), sampling_rate_rad));
     for (size_t i = 0; i < old_angles.size(); i++)
     {
-        //direction1=(old_vector[i]).transpose();
         direction1=old_vector[i];
         bool uniq = true;
-        for (size_t j = 0; j < R_repository.size(); j++)
+        for (size_t j = 0; uniq && j < RLt.size(); j++)
         {
-            for (size_t k = 0; k < no_redundant_sampling_points_vector.size(); k++)
+            direction = RLt[j] * direction1;
+            if (accepted.anyWithin(direction, cos_max_ang))
+                uniq = false;
+            else if (only_half_sphere)
             {
-                direction =  L_repository[j] *
-                             (no_redundant_sampling_points_vector[k].transpose() *
-                              R_repository[j]).transpose();
-                //Calculate distance
-                my_dotProduct = dotProduct(direction,direction1);
-                if (only_half_sphere)
-                    my_dotProduct = ABS(my_dotProduct);
-
-                if (my_dotProduct > cos_max_ang)
-                {
-                    uniq = false;
-                    break;
-                }
-            }// for k
-            if (!uniq)
-                break;
+                direction *= -1;
+                uniq = !accepted.anyWithin(direction, cos_max_ang);
+            }
         } // for j
         if (uniq)
         {
             no_redundant_sampling_points_vector.push_back(old_vector[i]);
             no_redundant_sampling_points_angles.push_back(old_angles[i]);
+            accepted.add(old_vector[i]);
         }
     } // for i
 
@@ -1714,144 +1729,107 @@ void Sampling::readSamplingFile(const FileName &fn_base,
 
 void Sampling::computeNeighbors(bool only_winner)
 {
-
-    double my_dotProduct;
-    double winner_dotProduct;
-    Matrix2D<double>  L(4, 4), R(4, 4);
-    std::vector<size_t>  aux_neighbors;
-    bool new_reference=true;
     my_neighbors.clear();
 #ifdef MYPSI
-    std::vector<double> aux_neighbors_psi;
     my_neighbors_psi.clear();
 #endif
 
     // calculate some sizes only once
     size_t exp_data_projection_direction_by_L_R_size = exp_data_projection_direction_by_L_R.size();
-    size_t no_redundant_sampling_points_vector_size = no_redundant_sampling_points_vector.size();
+    size_t symSize = R_repository.size();
+    size_t nExp = exp_data_projection_direction_by_L_R_size / symSize;
+    my_neighbors.resize(nExp);
+#ifdef MYPSI
+    my_neighbors_psi.resize(nExp);
+#endif
 
     if (verbose)
     {
         std::cout << "Find valid sampling points based on the neighborhood" <<std::endl;
         init_progress_bar(exp_data_projection_direction_by_L_R_size);
     }
-    size_t ratio = exp_data_projection_direction_by_L_R_size / 60;
-    ratio = XMIPP_MAX(ratio, 1);
 
-    for(size_t j = 0; j < exp_data_projection_direction_by_L_R_size;)
-    {
-        if ((j%ratio) == 0 && verbose)
-            progress_bar(j);
+    SphericalIndex index(SphericalIndex::cellSizeFor(acos(std::max(cos_neighborhood_radius, -1.)),
+                                                     sampling_rate_rad));
+    index.build(no_redundant_sampling_points_vector);
 
-#ifdef MYPSI
+    // Marks of the sampling points already added to the neighbours of an
+    // experimental image (one per thread)
+    size_t maxIndex = 0;
+    for (size_t idx : no_redundant_sampling_points_index)
+        maxIndex = std::max(maxIndex, idx);
+    std::vector< std::vector<size_t> > added(std::max(numThreads, 1));
 
-        aux_neighbors_psi.clear();
+    auto neighborsOf = [&](int thrId, size_t n)
+    {
+        std::vector<size_t> &aux_neighbors = my_neighbors[n];
+#ifdef MYPSI
+        std::vector<double> &aux_neighbors_psi = my_neighbors_psi[n];
 #endif
-
-        aux_neighbors.clear();
-    	if (cos_neighborhood_radius <= -1.0)
-    	{
-    		aux_neighbors=no_redundant_sampling_points_index;
-    		j+=R_repository.size();
-    	}
-    	else
-    	{
-			size_t * aux_neighborsArray = nullptr;
-			for (size_t k = 0; k < R_repository.size(); k++,j++)
-			{
-				winner_dotProduct = -1.;
-				for (size_t i = 0; i < no_redundant_sampling_points_vector_size; ++i)
-				{
-					my_dotProduct = dotProduct(no_redundant_sampling_points_vector[i],
-											   exp_data_projection_direction_by_L_R[j]);
-
-					if (my_dotProduct > cos_neighborhood_radius)
-					{
-						if(aux_neighbors.size()==0)
-						{
-							aux_neighbors.push_back(no_redundant_sampling_points_index[i]);
-							winner_dotProduct=my_dotProduct;
-
-	#ifdef MYPSI
-
-							aux_neighbors_psi.push_back(exp_data_projection_direction_by_L_R_psi[j]);
-	#endif
-
-						}
-						else
-						{
-							new_reference = true;
-							if(only_winner)
-							{
-								if(winner_dotProduct<my_dotProduct)
-								{
-									if(winner_dotProduct!=-1)
-										aux_neighbors.pop_back();
-	#ifdef MYPSI
-
-									if(winner_dotProduct!=-1)
-										aux_neighbors_psi.pop_back();
-	#endif
-
-									winner_dotProduct=my_dotProduct;
-								}
-								else
-								{
-									new_reference=false;
-								}
-							}
-							else
-							{
-								//precalculate size saves time here but
-								//not in the whole loop
-								aux_neighborsArray =  &aux_neighbors[0];
-								size_t _size = aux_neighbors.size();
-								//std::cerr << "DEBUG_JM: no_redundant_sampling_points_index[i]: " << no_redundant_sampling_points_index[i] << std::endl;
-								// for (size_t kkk = 0; kkk < aux_neighbors.size(); ++kkk)
-								//   std::cerr << aux_neighbors[kkk] << " ";
-								for( size_t l=0;l<  _size;l++)
-								{
-									//if (aux_neighbors[l]==i)
-									if (aux_neighborsArray[l]==no_redundant_sampling_points_index[i])
-									{
-										new_reference=false;
-										break;
-									}
-								}
-								//std::cerr << "DEBUG_JM: new_reference: " << new_reference << std::endl;
-							}
-							if (new_reference)
-							{
-								//std::cerr << formatString("DEBUG_JM: j %lu k %lu i %lu ", j, k, i) << std::endl;
-								aux_neighbors.push_back(no_redundant_sampling_points_index[i]);
-
-								//for (size_t kkk = 0; kkk < aux_neighbors.size(); ++kkk)
-								//  std::cerr << aux_neighbors[kkk] << " ";
-								// std::cerr << std::endl;
-
-	#ifdef MYPSI
-
-								aux_neighbors_psi.push_back(exp_data_projection_direction_by_L_R_psi[j]);
-	#endif
-
-							}
-						}
-						//same sampling point should appear only once
-						//note that psi recorded here may be different from psi
-						//recorded in _closest_sampling_points because
-						//may refer to a different sampling point
-						//in fact every point is degenerated
-					}
-				}//for i;
-			}//for k
-    	}
-        my_neighbors.push_back(aux_neighbors);
+        if (cos_neighborhood_radius <= -1.0)
+        {
+            aux_neighbors=no_redundant_sampling_points_index;
+            return;
+        }
+        std::vector<size_t> &mark = added[thrId];
+        if (mark.empty())
+            mark.resize(maxIndex + 1, 0);
+        std::vector<size_t> candidates;
+        for (size_t k = 0, j = n * symSize; k < symSize; k++,j++)
+        {
+            double winner_dotProduct = -1.;
+            index.findWithin(exp_data_projection_direction_by_L_R[j], cos_neighborhood_radius, candidates);
+            for (size_t i : candidates)
+            {
+                double my_dotProduct = dotProduct(no_redundant_sampling_points_vector[i],
+                                                  exp_data_projection_direction_by_L_R[j]);
+                size_t sampling_index = no_redundant_sampling_points_index[i];
+                bool new_reference = true;
+                if(aux_neighbors.size()==0)
+                    winner_dotProduct=my_dotProduct;
+                else if(only_winner)
+                {
+                    if(winner_dotProduct<my_dotProduct)
+                    {
+                        if(winner_dotProduct!=-1)
+                        {
+                            aux_neighbors.pop_back();
 #ifdef MYPSI
-
-        my_neighbors_psi.push_back(aux_neighbors_psi);
+                            aux_neighbors_psi.pop_back();
 #endif
+                        }
+                        winner_dotProduct=my_dotProduct;
+                    }
+                    else
+                        new_reference=false;
+                }
+                else
+                    // same sampling point should appear only once
+                    new_reference = mark[sampling_index] != n + 1;
+                if (new_reference)
+                {
+                    aux_neighbors.push_back(sampling_index);
+                    mark[sampling_index] = n + 1;
+#ifdef MYPSI
+                    aux_neighbors_psi.push_back(exp_data_projection_direction_by_L_R_psi[j]);
+#endif
+                }
+                //note that psi recorded here may be different from psi
+                //recorded in _closest_sampling_points because
+                //may refer to a different sampling point
+                //in fact every point is degenerated
+            }//for i
+        }//for k
+    };
 
-    }//for j
+    // Images are processed in blocks to show the progress
+    size_t blockSize = XMIPP_MAX(nExp / 60, 1);
+    for (size_t first = 0; first < nExp; first += blockSize)
+    {
+        if (verbose)
+            progress_bar(first * symSize);
+        parallelFor(first, std::min(first + blockSize, nExp), numThreads, neighborsOf);
+    }
     if (verbose)
         progress_bar(exp_data_projection_direction_by_L_R_size);
 
@@ -1991,11 +1969,8 @@ void Sampling::findClosestSamplingPoint(const FileName &FnexperimentalImages,
 void Sampling::findClosestSamplingPoint(const MetaData &DFi,
                                         const FileName &output_file_root)
 {
-    double my_dotProduct,my_dotProduct_aux;
-    Matrix1D<double>  row(3),direction(3);
     Matrix1D<double> docline;
     docline.initZeros(7);//three original angles, one winnir, new angles
-    Matrix2D<double>  L(4, 4), R(4, 4);
     int winner_sampling=-1;
 #if defined(CHIMERA) || defined(MYPSI)
 
@@ -2015,46 +1990,39 @@ void Sampling::findClosestSamplingPoint(const MetaData &DFi,
     int exp_image=1;
 #endif
 
-    auto idIter(DFi.ids().begin());
-    for (size_t i = 0; i <  exp_data_projection_direction_by_L_R.size(); )
+    // Closest sampling point of each experimental image
+    size_t symSize = R_repository.size();
+    size_t nExp = exp_data_projection_direction_by_L_R.size() / symSize;
+    std::vector<int> winners(nExp, -1);
+#if defined(CHIMERA) || defined(MYPSI)
+    std::vector<int> winners_exp_L_R(nExp, -1);
+#endif
+    SphericalIndex index(SphericalIndex::cellSizeFor(sampling_rate_rad, sampling_rate_rad));
+    index.build(no_redundant_sampling_points_vector);
+    parallelFor(0, nExp, numThreads, [&](int, size_t n)
     {
-        my_dotProduct=-2;
-        for (size_t k = 0; k < R_repository.size(); k++,i++)
+        double best_dotProduct=-2;
+        for (size_t k = 0, i = n * symSize; k < symSize; k++,i++)
         {
-#ifdef  DEBUG3
-            //experimental points plus symmetry
-            if( i>(exp_image*R_repository.size()-1) && i< ((exp_image+1)*R_repository.size()))
-            {
-                filestr    <<  ".color red" << std::endl
-                <<  ".sphere "   << exp_data_projection_direction_by_L_R[i]
-                <<  " .019"      << std::endl;
-            }
-#endif
-            for(size_t j=0;j< no_redundant_sampling_points_vector.size();j++)
+            double my_dotProduct;
+            int j = index.findClosest(exp_data_projection_direction_by_L_R[i], &my_dotProduct);
+            if (j >= 0 && my_dotProduct > best_dotProduct)
             {
-                my_dotProduct_aux =
-                    dotProduct(exp_data_projection_direction_by_L_R[i],
-                               no_redundant_sampling_points_vector[j]);
-
-                if ( my_dotProduct_aux > my_dotProduct)
-                {
-                    my_dotProduct = my_dotProduct_aux;
-                    winner_sampling = j;
+                best_dotProduct = my_dotProduct;
+                winners[n] = j;
 #if defined(CHIMERA) || defined(MYPSI)
-
-                    winner_exp_L_R  = i;
+                winners_exp_L_R[n] = i;
 #endif
-
-                }
-            }//for j
+            }
         }//for k
-#ifdef  DEBUG3
-        if( i==  ((exp_image+1)*R_repository.size()) )
-        {
-            filestr    <<  ".color yellow" << std::endl
-            <<  ".sphere "   << no_redundant_sampling_points_vector[winner_sampling]
-            <<  " .020"      << std::endl;
-        }
+    });
+
+    auto idIter(DFi.ids().begin());
+    for (size_t n = 0; n < nExp; n++)
+    {
+        winner_sampling = winners[n];
+#if defined(CHIMERA) || defined(MYPSI)
+        winner_exp_L_R = winners_exp_L_R[n];
 #endif
         //add winner to the DOC fILE
         std::string fnImg, comment;
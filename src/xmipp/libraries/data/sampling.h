@@ -125,6 +125,9 @@ public:
     /** Verbose */
     int verbose;
 
+    /** Number of threads for the searches over experimental directions */
+    int numThreads;
+
     /** Default constructor. sampling in degrees*/
     Sampling();
 
@@ -0,0 +1,200 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#include "spherical_index.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "core/xmipp_error.h"
+#include "core/xmipp_macros.h"
+
+// Margin for the rounding errors of vectors that are not exactly unitary
+constexpr double SPHERICAL_INDEX_MARGIN = 1e-6;
+
+SphericalIndex::SphericalIndex(double cellSize)
+{
+    if (cellSize <= 0)
+        REPORT_ERROR(ERR_ARG_INCORRECT, "SphericalIndex: the cell size must be positive");
+    this->cellSize = std::min(cellSize, 2.0);
+    cellsPerAxis = std::max((int)ceil(2.0 / this->cellSize), 1);
+}
+
+void SphericalIndex::build(const std::vector<Matrix1D<double> > &directions)
+{
+    clear();
+    xyz.reserve(3 * directions.size());
+    for (const auto &u : directions)
+        add(u);
+}
+
+void SphericalIndex::add(const Matrix1D<double> &u)
+{
+    size_t idx = size();
+    xyz.push_back(XX(u));
+    xyz.push_back(YY(u));
+    xyz.push_back(ZZ(u));
+    cells[cellOf(XX(u), YY(u), ZZ(u))].push_back(idx);
+}
+
+void SphericalIndex::clear()
+{
+    xyz.clear();
+    cells.clear();
+}
+
+int SphericalIndex::cellCoordinate(double x) const
+{
+    int c = (int)floor((x + 1) / cellSize);
+    return std::min(std::max(c, 0), cellsPerAxis - 1);
+}
+
+size_t SphericalIndex::cellOf(double x, double y, double z) const
+{
+    size_t n = cellsPerAxis;
+    return (cellCoordinate(z) * n + cellCoordinate(y)) * n + cellCoordinate(x);
+}
+
+double SphericalIndex::dot(size_t i, const double *u) const
+{
+    const double *p = &xyz[3 * i];
+    return p[0] * u[0] + p[1] * u[1] + p[2] * u[2];
+}
+
+template<typename F>
+bool SphericalIndex::visitCells(const double *u, double r, F f) const
+{
+    int from[3], to[3];
+    size_t nCells = 1;
+    for (int d = 0; d < 3; ++d)
+    {
+        from[d] = cellCoordinate(u[d] - r);
+        to[d] = cellCoordinate(u[d] + r);
+        nCells *= to[d] - from[d] + 1;
+    }
+    if (nCells > cells.size())
+        return false;
+    size_t n = cellsPerAxis;
+    for (int cz = from[2]; cz <= to[2]; ++cz)
+        for (int cy = from[1]; cy <= to[1]; ++cy)
+            for (int cx = from[0]; cx <= to[0]; ++cx)
+            {
+                auto it = cells.find((cz * n + cy) * n + cx);
+                if (it == cells.end())
+                    continue;
+                for (size_t i : it->second)
+                    if (f(i))
+                        return true;
+            }
+    return true;
+}
+
+void SphericalIndex::findWithin(const Matrix1D<double> &u, double minDot,
+                                std::vector<size_t> &result) const
+{
+    result.clear();
+    const double q[3] = { XX(u), YY(u), ZZ(u) };
+    // |p-u|^2 = 2 - 2 p.u for unit vectors
+    double r = sqrt(std::max(2 - 2 * minDot, 0.0)) + SPHERICAL_INDEX_MARGIN;
+    bool visited = visitCells(q, r, [&](size_t i)
+    {
+        if (dot(i, q) > minDot)
+            result.push_back(i);
+        return false;
+    });
+    if (visited)
+        std::sort(result.begin(), result.end());
+    else
+        for (size_t i = 0; i < size(); ++i)
+            if (dot(i, q) > minDot)
+                result.push_back(i);
+}
+
+bool SphericalIndex::anyWithin(const Matrix1D<double> &u, double minDot) const
+{
+    const double q[3] = { XX(u), YY(u), ZZ(u) };
+    double r = sqrt(std::max(2 - 2 * minDot, 0.0)) + SPHERICAL_INDEX_MARGIN;
+    bool found = false;
+    bool visited = visitCells(q, r, [&](size_t i)
+    {
+        found = dot(i, q) > minDot;
+        return found;
+    });
+    if (!visited)
+        for (size_t i = 0; i < size() && !found; ++i)
+            found = dot(i, q) > minDot;
+    return found;
+}
+
+int SphericalIndex::findClosest(const Matrix1D<double> &u, double *dotProduct) const
+{
+    const double q[3] = { XX(u), YY(u), ZZ(u) };
+    int best = -1;
+    double bestDot = -std::numeric_limits<double>::max();
+    // Grow the searched region until it contains the closest direction
+    for (double r = cellSize; ; r *= 2)
+    {
+        best = -1;
+        bestDot = -std::numeric_limits<double>::max();
+        bool visited = visitCells(q, r, [&](size_t i)
+        {
+            double d = dot(i, q);
+            if (d > bestDot || (d == bestDot && (int)i < best))
+            {
+                bestDot = d;
+                best = (int)i;
+            }
+            return false;
+        });
+        if (!visited)
+        {
+            best = -1;
+            for (size_t i = 0; i < size(); ++i)
+            {
+                double d = dot(i, q);
+                if (d > bestDot)
+                {
+                    bestDot = d;
+                    best = (int)i;
+                }
+            }
+            break;
+        }
+        // Directions closer than the best one are inside the region
+        if (best >= 0 && sqrt(std::max(2 - 2 * bestDot, 0.0)) + SPHERICAL_INDEX_MARGIN <= r)
+            break;
+    }
+    if (dotProduct != nullptr)
+        *dotProduct = bestDot;
+    return best;
+}
+
+double SphericalIndex::cellSizeFor(double queryDistance, double sampling)
+{
+    // Half the distance of the queries, but not much smaller than the
+    // distance between directions so that cells are not empty
+    double queryChord = 2 * sin(std::min(queryDistance, PI) / 2);
+    double samplingChord = 2 * sin(std::min(sampling, PI) / 2);
+    return std::min(std::max(std::max(queryChord / 2, samplingChord), 1e-3), 2.0);
+}
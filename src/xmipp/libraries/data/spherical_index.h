@@ -0,0 +1,108 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#ifndef LIBRARIES_DATA_SPHERICAL_INDEX_H_
+#define LIBRARIES_DATA_SPHERICAL_INDEX_H_
+
+#include <unordered_map>
+#include <vector>
+#include "core/matrix1d.h"
+
+/**@defgroup SphericalIndex Spatial index of directions
+   @ingroup DataLibrary */
+//@{
+/** Spatial index of unit vectors.
+ * The vectors are distributed in the cells of a regular grid covering the
+ * unit sphere. The directions within an angular distance of a query are
+ * found by visiting only the cells close to it, so the cost of a query
+ * depends on the number of directions around the query and not on the
+ * total number of directions. Queries are exact (the same directions are
+ * found as comparing with all of them) and can be done by several threads
+ * at the same time. Symmetry is handled by the caller, querying with the
+ * symmetric directions.
+ */
+class SphericalIndex
+{
+public:
+    /** Constructor.
+     * cellSize is the side of the cells, as a distance between unit vectors
+     * (approximately the angular distance in radians). Queries are the most
+     * efficient for distances between cellSize and twice cellSize.
+     */
+    explicit SphericalIndex(double cellSize = 0.05);
+
+    /** Index a set of directions (previous directions are removed).
+     * Directions are referred by their position in the vector.
+     */
+    void build(const std::vector<Matrix1D<double> > &directions);
+
+    /// Add a direction. Its index is the number of directions before it
+    void add(const Matrix1D<double> &u);
+
+    /// Remove all directions
+    void clear();
+
+    /// Number of directions
+    size_t size() const
+    {
+        return xyz.size() / 3;
+    }
+
+    /** Directions whose dot product with u is larger than minDot.
+     * The indexes are returned in increasing order.
+     */
+    void findWithin(const Matrix1D<double> &u, double minDot, std::vector<size_t> &result) const;
+
+    /// True if there is a direction whose dot product with u is larger than minDot
+    bool anyWithin(const Matrix1D<double> &u, double minDot) const;
+
+    /** Direction with the largest dot product with u.
+     * In case of ties the smallest index is returned. Returns -1 if there
+     * are no directions. If dot is given, it receives the dot product.
+     */
+    int findClosest(const Matrix1D<double> &u, double *dot = nullptr) const;
+
+    /** Cell size for queries of the given angular distance (radians),
+     * given the angular distance between directions */
+    static double cellSizeFor(double queryDistance, double sampling);
+
+private:
+    size_t cellOf(double x, double y, double z) const;
+    int cellCoordinate(double x) const;
+    double dot(size_t i, const double *u) const;
+
+    /** Visit the directions in the cells overlapping the cube of half side
+     * r around u. Returns false if there are so many cells that it is
+     * better to visit all directions. */
+    template<typename F>
+    bool visitCells(const double *u, double r, F f) const;
+
+    double cellSize;
+    int cellsPerAxis;
+    std::vector<double> xyz;
+    std::unordered_map<size_t, std::vector<size_t> > cells;
+};
+//@}
+#endif /* LIBRARIES_DATA_SPHERICAL_INDEX_H_ */
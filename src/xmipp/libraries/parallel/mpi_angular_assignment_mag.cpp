@@ -92,6 +92,7 @@ void MpiProgAngularAssignmentMag::finishProcessing()
 }
 void MpiProgAngularAssignmentMag::wait()
 {
+	ProgAngularAssignmentMag::wait();
 	distributor->wait();
 }
 
@@ -115,6 +115,7 @@ public:
     }
     void wait()
     {
+		ProgAngularContinuousAssign2::wait();
 		distributor->wait();
     }
 };
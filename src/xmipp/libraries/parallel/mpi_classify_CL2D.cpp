@@ -24,6 +24,7 @@
  ***************************************************************************/
 
 #include <algorithm>
+#include <cstring>
 #include "mpi_classify_CL2D.h"
 #include "xmipp_mpi.h"
 #include "core/transformations.h"
@@ -152,6 +153,9 @@ void CL2DClass::transferUpdate(bool centerReference)
         if (!DIRECT_A2D_ELEM(prm->mask,i,j))
             DIRECT_A2D_ELEM(P,i,j) = 0;
 
+        // Compute the Fourier transform, it is used to align all images
+        corrAux.transformer1.FourierTransform(P, FFTP, true);
+
         // Compute the polar Fourier transform of the full image
         polarFourierTransform<true>(P, polarFourierP, false, XSIZE(P) / 5,
                                         XSIZE(P) / 2-2, plans, 1);
@@ -218,7 +222,7 @@ constexpr float INITIAL_ROTATE_THRESHOLD = 	ROTATE_THRESHOLD + 1.0	;	// Rotate t
 //#define DEBUG
 //#define DEBUG_MORE
 void CL2DClass::fitBasic(MultidimArray<double> &I, CL2DAssignment &result,
-                         bool reverse)
+                         CL2DFitAux &aux, bool reverse)
 {
     if (reverse)
     {
@@ -230,10 +234,16 @@ void CL2DClass::fitBasic(MultidimArray<double> &I, CL2DAssignment &result,
     ARS.initIdentity(3);
     ASR = ARS;
     INV = ARS; // avoid creating a new transformation matrix per applyGeometry call
-    MultidimArray<double> IauxSR = I, IauxRS = I;
-//    Mcorr.resizeNoCopy(I);
-    Polar<std::complex<double> > polarFourierI;
-    corrAux.transformer1.FourierTransform(P, corrAux.FFT1, false);
+    MultidimArray<double> &IauxSR = aux.IauxSR;
+    MultidimArray<double> &IauxRS = aux.IauxRS;
+    IauxSR = I;
+    IauxRS = I;
+    size_t rotationalCorrSize = 2 * polarFourierP.getSampleNoOuterRing() - 1;
+    if (XSIZE(aux.rotationalCorr) != rotationalCorrSize)
+    {
+        aux.rotationalCorr.resize(rotationalCorrSize);
+        aux.rotAux.local_transformer.setReal(aux.rotationalCorr);
+    }
 #ifdef DEBUG_MORE
     Image<double> save2;
     save2()=P;
@@ -252,7 +262,7 @@ void CL2DClass::fitBasic(MultidimArray<double> &I, CL2DAssignment &result,
 			if (((shiftXSR > SHIFT_THRESHOLD) || (shiftXSR < (-SHIFT_THRESHOLD))) ||
 				((shiftYSR > SHIFT_THRESHOLD) || (shiftYSR < (-SHIFT_THRESHOLD))))
 			{
-				bestShift(P, corrAux.FFT1, IauxSR, shiftXSR, shiftYSR, corrAux);
+				bestShift(P, FFTP, IauxSR, shiftXSR, shiftYSR, aux.corrAux);
 				MAT_ELEM(ASR,0,2) += shiftXSR;
 				MAT_ELEM(ASR,1,2) += shiftYSR;
 				ASR.inv(INV);
@@ -268,10 +278,10 @@ void CL2DClass::fitBasic(MultidimArray<double> &I, CL2DAssignment &result,
 			SPEED_UP_tempsDouble;
 			if (bestRotSR > ROTATE_THRESHOLD)
 			{
-				polarFourierTransform<true>(IauxSR, fitBasic_aux, polarFourierI, true,
-												XSIZE(P) / 5, XSIZE(P) / 2-2, plans, 1);
+				polarFourierTransform<true>(IauxSR, aux.polarI, aux.polarFourierI, true,
+												XSIZE(P) / 5, XSIZE(P) / 2-2, aux.plans, 1);
 
-				bestRotSR = best_rotation(polarFourierP, polarFourierI, rotAux);
+				bestRotSR = best_rotation(polarFourierP, aux.polarFourierI, aux.rotAux);
 				rotation2DMatrix(bestRotSR, R);
 				M3x3_BY_M3x3(ASR,R,ASR);
 				ASR.inv(INV);
@@ -287,10 +297,10 @@ void CL2DClass::fitBasic(MultidimArray<double> &I, CL2DAssignment &result,
 			// Rotate then shift
 			if (bestRotRS > ROTATE_THRESHOLD)
 			{
-				polarFourierTransform<true>(IauxRS, fitBasic_aux, polarFourierI, true,
-												XSIZE(P) / 5, XSIZE(P) / 2-2, plans, 1);
+				polarFourierTransform<true>(IauxRS, aux.polarI, aux.polarFourierI, true,
+												XSIZE(P) / 5, XSIZE(P) / 2-2, aux.plans, 1);
 
-				bestRotRS = best_rotation(polarFourierP, polarFourierI, rotAux);
+				bestRotRS = best_rotation(polarFourierP, aux.polarFourierI, aux.rotAux);
 				rotation2DMatrix(bestRotRS, R);
 				M3x3_BY_M3x3(ARS,R,ARS);
 				ARS.inv(INV);
@@ -306,7 +316,7 @@ void CL2DClass::fitBasic(MultidimArray<double> &I, CL2DAssignment &result,
 			if (((shiftXRS > SHIFT_THRESHOLD) || (shiftXRS < (-SHIFT_THRESHOLD))) ||
 				((shiftYRS > SHIFT_THRESHOLD) || (shiftYRS < (-SHIFT_THRESHOLD))))
 			{
-				bestShift(P, corrAux.FFT1, IauxRS, shiftXRS, shiftYRS, corrAux);
+				bestShift(P, FFTP, IauxRS, shiftXRS, shiftYRS, aux.corrAux);
 				MAT_ELEM(ARS,0,2) += shiftXRS;
 				MAT_ELEM(ARS,1,2) += shiftYRS;
 				ARS.inv(INV);
@@ -327,16 +337,16 @@ void CL2DClass::fitBasic(MultidimArray<double> &I, CL2DAssignment &result,
 
     // Compute the correntropy
     double corrRS=0.0, corrSR=0.0;
-    MultidimArray<int> &imask = prm->mask;
+    const MultidimArray<int> &imask = prm->useThresholdMask ? aux.imask : prm->mask;
     if (prm->useThresholdMask)
     {
-    	imask.initZeros(IauxRS);
+    	aux.imask.initZeros(IauxRS);
     	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(IauxRS)
     	if (DIRECT_MULTIDIM_ELEM(IauxRS,n)>prm->threshold)
-    		DIRECT_MULTIDIM_ELEM(imask,n)=1;
+    		DIRECT_MULTIDIM_ELEM(aux.imask,n)=1;
     	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(IauxSR)
     	if (DIRECT_MULTIDIM_ELEM(IauxSR,n)>prm->threshold)
-    		DIRECT_MULTIDIM_ELEM(imask,n)=1;
+    		DIRECT_MULTIDIM_ELEM(aux.imask,n)=1;
     }
     if (prm->useCorrelation)
     {
@@ -428,23 +438,24 @@ void CL2DClass::fitBasic(MultidimArray<double> &I, CL2DAssignment &result,
 #undef DEBUG
 #undef DEBUG_MORE
 
-void CL2DClass::fit(MultidimArray<double> &I, CL2DAssignment &result)
+void CL2DClass::fit(MultidimArray<double> &I, CL2DAssignment &result, CL2DFitAux &aux)
 {
     if (currentListImg.size() == 0)
         return;
 
     // Try this image
-    MultidimArray<double> Idirect = I;
+    MultidimArray<double> &Idirect = aux.Idirect;
+    Idirect = I;
     CL2DAssignment resultDirect;
-    fitBasic(Idirect, resultDirect);
+    fitBasic(Idirect, resultDirect, aux);
 
     // Try its mirror
 	CL2DAssignment resultMirror;
-	MultidimArray<double> Imirror;
+	MultidimArray<double> &Imirror = aux.Imirror;
     if (prm->mirrorImages)
     {
     	Imirror=I;
-		fitBasic(Imirror, resultMirror, true);
+		fitBasic(Imirror, resultMirror, aux, true);
     }
     else
     	resultMirror.corr=-1e38;
@@ -532,6 +543,119 @@ void CL2DClass::lookForNeighbours(const std::vector<CL2DClass *> listP, int K)
 }
 #undef DEBUG
 
+/* Share class updates ------------------------------------------------- */
+void CL2D::shareClassUpdates(const std::vector<CL2DClass *> &nodes,
+                             bool shareNonCorr) const
+{
+    int Q = nodes.size();
+    int nodeRank = prm->node->rank;
+    int nodeSize = prm->node->size;
+
+    // Sum the updates of all classes with a single collective, that runs
+    // while the lists of images are exchanged
+    size_t updateSize = 0;
+    for (const auto *node : nodes)
+        updateSize += MULTIDIM_SIZE(node->Pupdate);
+    std::vector<double> updates(updateSize);
+    double *ptrUpdates = updates.data();
+    for (const auto *node : nodes)
+    {
+        memcpy(ptrUpdates, MULTIDIM_ARRAY(node->Pupdate), MULTIDIM_SIZE(node->Pupdate) * sizeof(double));
+        ptrUpdates += MULTIDIM_SIZE(node->Pupdate);
+    }
+    MPI_Request updatesRequest;
+    MPI_Iallreduce(MPI_IN_PLACE, updates.data(), updateSize, MPI_DOUBLE, MPI_SUM,
+                   MPI_COMM_WORLD, &updatesRequest);
+
+    // Number of images (and non class correlations) of each class in each node
+    std::vector<int> localCounts(2 * Q, 0);
+    for (int q = 0; q < Q; q++)
+    {
+        localCounts[q] = nodes[q]->nextListImg.size();
+        if (shareNonCorr)
+            localCounts[Q + q] = nodes[q]->nextNonClassCorr.size();
+    }
+    std::vector<int> counts(2 * Q * nodeSize);
+    MPI_Allgather(localCounts.data(), 2 * Q, MPI_INT, counts.data(), 2 * Q, MPI_INT,
+                  MPI_COMM_WORLD);
+
+    // All the lists of a node are sent in a single block: the images of
+    // all classes followed by the non class correlations of all classes
+    std::vector<int> blockBytes(nodeSize, 0), blockStart(nodeSize, 0);
+    for (int rank = 0; rank < nodeSize; rank++)
+    {
+        const int *rankCounts = &counts[2 * Q * rank];
+        size_t bytes = 0;
+        for (int q = 0; q < Q; q++)
+            bytes += rankCounts[q] * sizeof(CL2DAssignment) + rankCounts[Q + q] * sizeof(double);
+        blockBytes[rank] = bytes;
+        if (rank > 0)
+            blockStart[rank] = blockStart[rank - 1] + blockBytes[rank - 1];
+    }
+    std::vector<char> localBlock(blockBytes[nodeRank]);
+    char *ptrBlock = localBlock.data();
+    for (int q = 0; q < Q; q++)
+    {
+        size_t bytes = nodes[q]->nextListImg.size() * sizeof(CL2DAssignment);
+        memcpy(ptrBlock, nodes[q]->nextListImg.data(), bytes);
+        ptrBlock += bytes;
+    }
+    for (int q = 0; q < Q && shareNonCorr; q++)
+    {
+        size_t bytes = nodes[q]->nextNonClassCorr.size() * sizeof(double);
+        memcpy(ptrBlock, nodes[q]->nextNonClassCorr.data(), bytes);
+        ptrBlock += bytes;
+    }
+    std::vector<char> blocks(blockStart[nodeSize - 1] + blockBytes[nodeSize - 1]);
+    MPI_Allgatherv(localBlock.data(), blockBytes[nodeRank], MPI_CHAR, blocks.data(),
+                   blockBytes.data(), blockStart.data(), MPI_CHAR, MPI_COMM_WORLD);
+
+    // Append the lists of the other nodes
+    std::vector<CL2DAssignment> receivedNextListImage;
+    for (int q = 0; q < Q; q++)
+    {
+        receivedNextListImage.clear();
+        for (int rank = 0; rank < nodeSize; rank++)
+        {
+            if (rank == nodeRank)
+                continue;
+            const int *rankCounts = &counts[2 * Q * rank];
+            const char *ptr = &blocks[blockStart[rank]];
+            for (int qq = 0; qq < q; qq++)
+                ptr += rankCounts[qq] * sizeof(CL2DAssignment);
+            const auto *received = (const CL2DAssignment *) ptr;
+            receivedNextListImage.insert(receivedNextListImage.end(), received, received + rankCounts[q]);
+        }
+        // This is important to ensure that all nodes have all images in the same order
+        std::sort(receivedNextListImage.begin(),receivedNextListImage.end(),CL2DAssignmentComparator);
+        nodes[q]->nextListImg.insert(nodes[q]->nextListImg.end(),
+                                     receivedNextListImage.begin(), receivedNextListImage.end());
+
+        for (int rank = 0; rank < nodeSize && shareNonCorr; rank++)
+        {
+            if (rank == nodeRank)
+                continue;
+            const int *rankCounts = &counts[2 * Q * rank];
+            const char *ptr = &blocks[blockStart[rank]];
+            for (int qq = 0; qq < Q; qq++)
+                ptr += rankCounts[qq] * sizeof(CL2DAssignment);
+            for (int qq = 0; qq < q; qq++)
+                ptr += rankCounts[Q + qq] * sizeof(double);
+            const auto *received = (const double *) ptr;
+            nodes[q]->nextNonClassCorr.insert(nodes[q]->nextNonClassCorr.end(),
+                                              received, received + rankCounts[Q + q]);
+        }
+    }
+
+    MPI_Wait(&updatesRequest, MPI_STATUS_IGNORE);
+    ptrUpdates = updates.data();
+    for (auto *node : nodes)
+    {
+        memcpy(MULTIDIM_ARRAY(node->Pupdate), ptrUpdates, MULTIDIM_SIZE(node->Pupdate) * sizeof(double));
+        ptrUpdates += MULTIDIM_SIZE(node->Pupdate);
+    }
+}
+
 /* Share assignments and classes -------------------------------------- */
 void CL2D::shareAssignments(bool shareAssignment, bool shareUpdates,
                             bool shareNonCorr)
@@ -563,75 +687,7 @@ void CL2D::shareAssignments(bool shareAssignment, bool shareUpdates,
     // Share code updates
     if (shareUpdates)
     {
-        std::vector<CL2DAssignment> auxList;
-        std::vector<double> auxList2;
-        int Q = P.size();
-        for (int q = 0; q < Q; q++)
-        {
-            MPI_Allreduce(MPI_IN_PLACE, MULTIDIM_ARRAY(P[q]->Pupdate),
-                          MULTIDIM_SIZE(P[q]->Pupdate), MPI_DOUBLE, MPI_SUM,
-                          MPI_COMM_WORLD);
-
-            // Share nextClassCorr and nextNonClassCorr
-            std::vector<double> receivedNonClassCorr;
-            std::vector<CL2DAssignment> receivedNextListImage;
-            int listSize;
-            for (size_t rank = 0; rank < prm->node->size; rank++)
-            {
-                if (rank == prm->node->rank)
-                {
-                    listSize = P[q]->nextListImg.size();
-                    MPI_Bcast(&listSize, 1, MPI_INT, rank, MPI_COMM_WORLD);
-                    MPI_Bcast(&(P[q]->nextListImg[0]),
-                              P[q]->nextListImg.size() * sizeof(CL2DAssignment),
-                              MPI_CHAR, rank, MPI_COMM_WORLD);
-                    if (shareNonCorr)
-                    {
-                        listSize = P[q]->nextNonClassCorr.size();
-                        MPI_Bcast(&listSize, 1, MPI_INT, rank, MPI_COMM_WORLD);
-                        MPI_Bcast(&(P[q]->nextNonClassCorr[0]),
-                                  P[q]->nextNonClassCorr.size(), MPI_DOUBLE,
-                                  rank, MPI_COMM_WORLD);
-                    }
-                }
-                else
-                {
-                    MPI_Bcast(&listSize, 1, MPI_INT, rank, MPI_COMM_WORLD);
-                    auxList.resize(listSize);
-                    MPI_Bcast(&(auxList[0]), listSize * sizeof(CL2DAssignment),
-                              MPI_CHAR, rank, MPI_COMM_WORLD);
-                    receivedNextListImage.reserve(
-                        receivedNextListImage.size() + listSize);
-                    for (int j = 0; j < listSize; j++)
-                        receivedNextListImage.push_back(auxList[j]);
-                    if (shareNonCorr)
-                    {
-                        MPI_Bcast(&listSize, 1, MPI_INT, rank, MPI_COMM_WORLD);
-                        auxList2.resize(listSize);
-                        MPI_Bcast(&(auxList2[0]), listSize, MPI_DOUBLE, rank,
-                                  MPI_COMM_WORLD);
-                        receivedNonClassCorr.reserve(
-                            receivedNonClassCorr.size() + listSize);
-                        for (int j = 0; j < listSize; j++)
-                            receivedNonClassCorr.push_back(auxList2[j]);
-                    }
-                }
-            }
-            // This is important to ensure that all nodes have all images in the same order
-            std::sort(receivedNextListImage.begin(),receivedNextListImage.end(),CL2DAssignmentComparator);
-
-            // Copy the received elements
-            listSize = receivedNextListImage.size();
-            P[q]->nextListImg.reserve(P[q]->nextListImg.size() + listSize);
-            for (int j = 0; j < listSize; j++)
-                P[q]->nextListImg.push_back(receivedNextListImage[j]);
-            listSize = receivedNonClassCorr.size();
-            P[q]->nextNonClassCorr.reserve(
-                P[q]->nextNonClassCorr.size() + listSize);
-            for (int j = 0; j < listSize; j++)
-                P[q]->nextNonClassCorr.push_back(receivedNonClassCorr[j]);
-        }
-
+        shareClassUpdates(P, shareNonCorr);
         transferUpdates();
     }
 }
@@ -645,75 +701,7 @@ void CL2D::shareSplitAssignments(Matrix1D<int> &assignment, CL2DClass *node1,
                   MPI_MAX, MPI_COMM_WORLD);
 
     // Share code updates
-    std::vector<CL2DAssignment> auxList;
-    std::vector<double> auxList2;
-    CL2DClass *node = NULL;
-    for (int q = 0; q < 2; q++)
-    {
-        if (q == 0)
-            node = node1;
-        else
-            node = node2;
-        MPI_Allreduce(MPI_IN_PLACE, MULTIDIM_ARRAY(node->Pupdate),
-                      MULTIDIM_SIZE(node->Pupdate), MPI_DOUBLE, MPI_SUM,
-                      MPI_COMM_WORLD);
-
-        // Share nextClassCorr and nextNonClassCorr
-        std::vector<double> receivedNonClassCorr;
-        std::vector<CL2DAssignment> receivedNextListImage;
-        int listSize;
-        for (size_t rank = 0; rank < prm->node->size; rank++)
-        {
-            if (rank == prm->node->rank)
-            {
-                // Transmit node 1 next list of images
-                listSize = node->nextListImg.size();
-                MPI_Bcast(&listSize, 1, MPI_INT, rank, MPI_COMM_WORLD);
-                MPI_Bcast(&(node->nextListImg[0]),
-                          node->nextListImg.size() * sizeof(CL2DAssignment),
-                          MPI_CHAR, rank, MPI_COMM_WORLD);
-                // Transmit node 1 non class corr
-                listSize = node->nextNonClassCorr.size();
-                MPI_Bcast(&listSize, 1, MPI_INT, rank, MPI_COMM_WORLD);
-                MPI_Bcast(&(node->nextNonClassCorr[0]),
-                          node->nextNonClassCorr.size(), MPI_DOUBLE, rank,
-                          MPI_COMM_WORLD);
-            }
-            else
-            {
-                // Receive node 1 next list of images
-                MPI_Bcast(&listSize, 1, MPI_INT, rank, MPI_COMM_WORLD);
-                auxList.resize(listSize);
-                MPI_Bcast(&(auxList[0]), listSize * sizeof(CL2DAssignment),
-                          MPI_CHAR, rank, MPI_COMM_WORLD);
-                receivedNextListImage.reserve(
-                    receivedNextListImage.size() + listSize);
-                for (int j = 0; j < listSize; j++)
-                    receivedNextListImage.push_back(auxList[j]);
-                // Receive node 1 non class corr
-                MPI_Bcast(&listSize, 1, MPI_INT, rank, MPI_COMM_WORLD);
-                auxList2.resize(listSize);
-                MPI_Bcast(&(auxList2[0]), listSize, MPI_DOUBLE, rank,
-                          MPI_COMM_WORLD);
-                receivedNonClassCorr.reserve(
-                    receivedNonClassCorr.size() + listSize);
-                for (int j = 0; j < listSize; j++)
-                    receivedNonClassCorr.push_back(auxList2[j]);
-            }
-        }
-        // This is important to ensure that all nodes have all images in the same order
-        std::sort(receivedNextListImage.begin(),receivedNextListImage.end(),CL2DAssignmentComparator);
-
-        // Copy the received elements
-        listSize = receivedNextListImage.size();
-        node->nextListImg.reserve(node->nextListImg.size() + listSize);
-        for (int j = 0; j < listSize; j++)
-            node->nextListImg.push_back(receivedNextListImage[j]);
-        listSize = receivedNonClassCorr.size();
-        node->nextNonClassCorr.reserve(node->nextNonClassCorr.size() + listSize);
-        for (int j = 0; j < listSize; j++)
-            node->nextNonClassCorr.push_back(receivedNonClassCorr[j]);
-    }
+    shareClassUpdates({node1, node2}, true);
 
     node1->transferUpdate();
     node2->transferUpdate();
@@ -754,6 +742,11 @@ void CL2D::initialize(MetaDataDb &_SF,
     SF = &_SF;
     Nimgs = SF->size();
 
+    threadPool.resize(prm->numThreads);
+    threadFitAux.clear();
+    for (int t = 0; t < prm->numThreads; t++)
+        threadFitAux.emplace_back(new CL2DFitAux());
+
     // Start with _Ncodes0 codevectors
     CL2DAssignment assignment;
     assignment.corr = 1;
@@ -949,12 +942,14 @@ void CL2D::lookNode(MultidimArray<double> &I, int oldnode, int &newnode,
 #endif
 	int Q = P.size();
     int bestq = -1;
-    MultidimArray<double> bestImg, Iaux;
+    MultidimArray<double> bestImg;
     Matrix1D<double> corrList;
-    corrList.resizeNoCopy(Q);
-    CL2DAssignment assignment;
+    corrList.initZeros(Q);
     bestAssignment.likelihood = bestAssignment.corr = 0;
     size_t objId = bestAssignment.objId;
+
+    // Choose the nodes to try, in order because of the random numbers
+    std::vector<int> candidates;
     for (int q = 0; q < Q; q++)
     {
         // Check if q is neighbour of the oldnode
@@ -988,24 +983,51 @@ void CL2D::lookNode(MultidimArray<double> &I, int oldnode, int &newnode,
         }
         else
             proceed = true;
+        if (proceed)
+            candidates.push_back(q);
+    }
+
+    // Try this image with all candidates
+    size_t Ncandidates = candidates.size();
+    std::vector<MultidimArray<double> > Iaux(Ncandidates);
+    std::vector<CL2DAssignment> candidateAssignment(Ncandidates);
+    auto fitCandidate = [&](int thrId, size_t k)
+    {
+        Iaux[k] = I;
+        P[candidates[k]]->fit(Iaux[k], candidateAssignment[k], *threadFitAux[thrId]);
+    };
+    if (threadPool.size() > 1 && Ncandidates > 1)
+    {
+        std::vector<std::future<void> > futures;
+        futures.reserve(Ncandidates);
+        for (size_t k = 0; k < Ncandidates; k++)
+            futures.emplace_back(threadPool.push(fitCandidate, k));
+        for (auto &f : futures)
+            f.get();
+    }
+    else
+        for (size_t k = 0; k < Ncandidates; k++)
+            fitCandidate(0, k);
 
-		if (proceed) {
-			// Try this image
-			Iaux = I;
-			P[q]->fit(Iaux, assignment);
-			VEC_ELEM(corrList,q) = assignment.corr;
+    CL2DAssignment assignment;
+    for (size_t k = 0; k < Ncandidates; k++)
+    {
+        int q = candidates[k];
+        // Empty nodes do not change the assignment
+        if (P[q]->currentListImg.size() > 0)
+            assignment = candidateAssignment[k];
+        VEC_ELEM(corrList,q) = assignment.corr;
 #ifdef DEBUG
 	std::cout << "   Proceeding with node " << q << " corr=" << assignment.corr << std::endl;
 #endif
-			if ((!prm->classicalMultiref && assignment.likelihood > bestAssignment.likelihood) ||
-				(prm->classicalMultiref && assignment.corr > bestAssignment.corr) ||
-				 prm->classifyAllImages && bestAssignment.corr==0) {
-				bestq = q;
-				bestImg = Iaux;
-				bestAssignment = assignment;
-			}
-		}
-	}
+        if ((!prm->classicalMultiref && assignment.likelihood > bestAssignment.likelihood) ||
+            (prm->classicalMultiref && assignment.corr > bestAssignment.corr) ||
+             prm->classifyAllImages && bestAssignment.corr==0) {
+            bestq = q;
+            bestImg = Iaux[k];
+            bestAssignment = assignment;
+        }
+    }
 
     I = bestImg;
     newnode = bestq;
@@ -1074,8 +1096,22 @@ void CL2D::run(const FileName &fnODir, const FileName &fnOut, int level)
         size_t K = std::min((size_t)prm->Nneighbours+1,Q);
         if (K == 0)
             K = Q;
-        for (size_t q = 0; q < Q; q++)
-            P[q]->lookForNeighbours(P, K);
+        if (threadPool.size() > 1)
+        {
+            // Each node is only fitted by its own task
+            std::vector<std::future<void> > futures;
+            futures.reserve(Q);
+            for (size_t q = 0; q < Q; q++)
+                futures.emplace_back(threadPool.push([this, q, K](int)
+                {
+                    P[q]->lookForNeighbours(P, K);
+                }));
+            for (auto &f : futures)
+                f.get();
+        }
+        else
+            for (size_t q = 0; q < Q; q++)
+                P[q]->lookForNeighbours(P, K);
 
         int node;
         double corrSum = 0;
@@ -1683,6 +1719,9 @@ void ProgClassifyCL2D::readParams()
 	if (useThresholdMask)
 		threshold=getDoubleParam("--useThresholdMask");
 	alignImages = !checkParam("--dontAlign");
+	numThreads = getIntParam("--thr");
+	if (numThreads < 1)
+		numThreads = 1;
 
 	prm = this; // FIXME HACK because of the global variable. Solve it properly
 }
@@ -1708,6 +1747,7 @@ void ProgClassifyCL2D::show() const {
 			<< "Normalize images:        " << normalizeImages << std::endl
 			<< "Mirror images:           " << mirrorImages << std::endl
 			<< "Align images:            " << alignImages << std::endl
+			<< "Threads:                 " << numThreads << std::endl
 	;
 	if (useThresholdMask)
 		std::cout << "Threshold mask:          " << threshold << std::endl;
@@ -1753,6 +1793,7 @@ void ProgClassifyCL2D::defineParams()
 	addParamsLine("   [--dontMirrorImages]      : By default, input images are studied unmirrored and mirrored");
 	addParamsLine("   [--useThresholdMask <t>]  : Use a mask to compare images. Remove pixels whose value is smaller or equal t");
 	addParamsLine("   [--dontAlign]             : Do not center the class representatives");
+	addParamsLine("   [--thr <N=1>]             : Number of threads per MPI process");
     addExampleLine("mpirun -np 3 `which xmipp_mpi_classify_CL2D` -i images.stk --nref 256 --oroot class --odir CL2Dresults --iter 10");
 }
 
@@ -25,11 +25,13 @@
 #ifndef _PROG_VQ_PROJECTIONS
 #define _PROG_VQ_PROJECTIONS
 
+#include <memory>
 #include "core/metadata_db.h"
 #include "data/polar.h"
 #include "core/histogram.h"
 #include "data/numerical_tools.h"
 #include "core/xmipp_program.h"
+#include "CTPL/ctpl_stl.h"
 
 class MpiNode;
 template<typename T>
@@ -63,6 +65,50 @@ public:
 /// Show
 std::ostream & operator << (std::ostream &out, const CL2DAssignment& assigned);
 
+/** Image side buffers for fitting an image with a class.
+    The transforms of the class are computed once per iteration by
+    CL2DClass::transferUpdate, the ones of the image are computed in these
+    buffers. Several threads may fit images with the same classes if each
+    one uses its own workspace. */
+class CL2DFitAux
+{
+public:
+    // Correlation aux
+    CorrelationAux corrAux;
+
+    // Rotational correlation aux
+    RotationalCorrelationAux rotAux;
+
+    // Rotational correlation for best_rotation
+    MultidimArray<double> rotationalCorr;
+
+    // Plans for the polar Fourier transform of the images
+    Polar_fftw_plans *plans = nullptr;
+
+    // Polar transform of the image
+    Polar<double> polarI;
+
+    // Polar Fourier transform of the image
+    Polar<std::complex<double> > polarFourierI;
+
+    // Image aligned by shift-rotate and by rotate-shift
+    MultidimArray<double> IauxSR, IauxRS;
+
+    // Image and its mirror
+    MultidimArray<double> Idirect, Imirror;
+
+    // Threshold mask
+    MultidimArray<int> imask;
+
+    CL2DFitAux() {}
+    CL2DFitAux(const CL2DFitAux &)=delete;
+    CL2DFitAux & operator =(const CL2DFitAux &)=delete;
+    ~CL2DFitAux()
+    {
+        delete plans;
+    }
+};
+
 /** CL2DClass class */
 class CL2DClass {
 public:
@@ -72,6 +118,9 @@ public:
     // Update for next iteration
     MultidimArray<double> Pupdate;
 
+    // Fourier transform of the projection
+    MultidimArray<std::complex<double> > FFTP;
+
     // Polar Fourier transform of the projection at full size
     Polar<std::complex <double> > polarFourierP;
 
@@ -131,21 +180,29 @@ public:
     		nextNonClassCorr.push_back(corr);
     }
 
-    /** Transfer update */
+    /** Transfer update.
+        The projection and its transforms are updated. */
     void transferUpdate(bool centerReference=true);
 
     /** Compute the fit of the input image with this node.
         The input image is rotationally and traslationally aligned
         (2 iterations), to make it fit with the node. */
-    void fitBasic(MultidimArray<double> &I, CL2DAssignment &result,  bool reverse=false);
+    void fitBasic(MultidimArray<double> &I, CL2DAssignment &result, CL2DFitAux &aux,
+                  bool reverse=false);
 
     /** Compute the fit of the input image with this node (check mirrors). */
-    void fit(MultidimArray<double> &I, CL2DAssignment &result);
+    void fit(MultidimArray<double> &I, CL2DAssignment &result, CL2DFitAux &aux);
+
+    /** Compute the fit using the workspace of this node. */
+    void fit(MultidimArray<double> &I, CL2DAssignment &result)
+    {
+        fit(I, result, fitAux);
+    }
 
     /// Look for K-nearest neighbours
     void lookForNeighbours(const std::vector<CL2DClass *> listP, int K);
 private:
-    Polar<double> fitBasic_aux;
+    CL2DFitAux fitAux;
 };
 
 struct SDescendingClusterSort
@@ -168,6 +225,12 @@ public:
     /// List of nodes
     std::vector<CL2DClass *> P;
 
+    /// Thread pool for fitting an image with several nodes
+    ctpl::thread_pool threadPool;
+
+    /// Workspace of each thread
+    std::vector<std::unique_ptr<CL2DFitAux> > threadFitAux;
+
     /** Empty constructor */
     CL2D() {}
 
@@ -192,12 +255,18 @@ public:
     /// Share split assignment
     void shareSplitAssignments(Matrix1D<int> &assignment, CL2DClass *node1, CL2DClass *node2) const;
 
+    /** Share the updates of a set of classes among all nodes.
+        The Pupdate of all classes are summed with a single reduction and
+        the next lists of images (and non class correlations) of all
+        classes are exchanged in a single block per node. */
+    void shareClassUpdates(const std::vector<CL2DClass *> &nodes, bool shareNonCorr) const;
+
     /// Write the nodes
     void write(const FileName &fnODir, const FileName &fnRoot, int level) const;
 
     /** Look for a node suitable for this image.
         The image is rotationally and translationally aligned with
-        the best node. */
+        the best node. The candidate nodes are fitted in parallel. */
     void lookNode(MultidimArray<double> &I, int oldnode,
     			  int &newnode, CL2DAssignment &bestAssignment);
     
@@ -283,6 +352,9 @@ public:
     /// Don't align images
     bool alignImages;
 
+    /// Number of threads
+    int numThreads;
+
     /// MPI constructor
     ProgClassifyCL2D(int argc, char** argv);
 
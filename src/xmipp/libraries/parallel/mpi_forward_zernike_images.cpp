@@ -113,15 +113,16 @@ public:
         node->barrierWait();
     }
     //AJ new
-    void checkPoint()
+    void appendCheckPoint(const MDRow &row) override
     {
         fileMutex->lock();
-        ProgForwardZernikeImages::checkPoint();
+        ProgForwardZernikeImages::appendCheckPoint(row);
         fileMutex->unlock();
     }
     //END AJ
     void wait()
     {
+		ProgForwardZernikeImages::wait();
 		distributor->wait();
     }
 };
\ No newline at end of file
@@ -172,6 +172,8 @@ void ProgMPIReconsArt::run()
         else if (artPrm.parallel_mode == BasicARTParameters::SIRT)
             std::cout << "SIRT" << std::endl;
         std::cout << " Number of processors         : " << nProcs << std::endl;
+        if (artPrm.useTaskPool)
+            std::cout << " Threads per processor        : " << artPrm.threads << std::endl;
         std::cout << " ---------------------------------------------------------------------" << std::endl;
     }
 
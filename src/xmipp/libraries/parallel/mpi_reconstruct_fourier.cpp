@@ -61,6 +61,10 @@ void ProgMPIRecFourier::defineParams()
     addParamsLine("                                : 10 may be a good value");
     addParamsLine("                                : if  -1 the computer will put the maximum");
     addParamsLine("                                : posible value that may not be the best option");
+    addParamsLine("  [--reduction <mode=tree>]     : How the Fourier volumes of the workers are summed");
+    addParamsLine("     where <mode>");
+    addParamsLine("        tree                    : Binomial tree, log2(P) transfers per worker");
+    addParamsLine("        serial                  : All workers send their volume to the first one");
 }
 
 /* Read parameters --------------------------------------------------------- */
@@ -68,6 +72,7 @@ void ProgMPIRecFourier::readParams()
 {
     ProgRecFourier::readParams();
     mpi_job_size=getIntParam("--mpi_job_size");
+    treeReduction=(String)getParam("--reduction")=="tree";
 }
 
 /* Pre Run PreRun for all nodes but not for all works */
@@ -297,19 +302,7 @@ void ProgMPIRecFourier::run()
             sizeout = MULTIDIM_SIZE(FourierWeights);
 
             //First
-            barrier_init( &barrier, numThreads+1);
-            pthread_mutex_init( &workLoadMutex, nullptr );
-            statusArray = nullptr;
-            th_ids = (pthread_t *)malloc(numThreads * sizeof(pthread_t));
-            th_args = (ImageThreadParams *)malloc(numThreads * sizeof(ImageThreadParams));
-
-            for ( int nt = 0 ; nt < numThreads ; nt++ )
-            {
-                th_args[nt].parent=this;
-                th_args[nt].myThreadID = nt;
-                th_args[nt].selFile = new MetaDataVec(SF);
-                pthread_create((th_ids+nt),nullptr,processImageThread,(void*)(th_args+nt));
-            }
+            createThreads();
 
             while (1)
             {
@@ -332,6 +325,9 @@ void ProgMPIRecFourier::run()
                     //a posibility is a non-blocking send
                     MPI_Recv(nullptr, 0, MPI_INT, 0, TAG_COLLECT_FOR_FSC, MPI_COMM_WORLD, &status);
 
+                    if ( treeReduction )
+                        reduceFourierVolumeTree( fourierVolume, new_comm );
+
                     if( node->rank == 1 )
                     {
                         // Reserve memory for the receive buffer
@@ -341,7 +337,7 @@ void ProgMPIRecFourier::run()
                         pointer = fourierVolume;
                         int currentSource;
 
-                        if ( nProcs > 2 )
+                        if ( nProcs > 2 && !treeReduction )
                         {
                             // Receive from other workers
                             for ( size_t i = 2 ; i <= nProcs ; i++)
@@ -406,12 +402,14 @@ void ProgMPIRecFourier::run()
                     }
                     else
                     {
+                        if ( !treeReduction )
+                        {
+                            MPI_Send( nullptr,0,MPI_INT,1,TAG_FREEWORKER, MPI_COMM_WORLD );
 
-                        MPI_Send( nullptr,0,MPI_INT,1,TAG_FREEWORKER, MPI_COMM_WORLD );
-
-                        sendDataInChunks( fourierVolume, 1, 2*sizeout, BUFFSIZE, MPI_COMM_WORLD );
+                            sendDataInChunks( fourierVolume, 1, 2*sizeout, BUFFSIZE, MPI_COMM_WORLD );
 
-                        MPI_Send( nullptr,0,MPI_INT,1,TAG_FREEWORKER, MPI_COMM_WORLD );
+                            MPI_Send( nullptr,0,MPI_INT,1,TAG_FREEWORKER, MPI_COMM_WORLD );
+                        }
 
                         Vout().initZeros(volPadSizeZ, volPadSizeY, volPadSizeX);
                         transformerVol.setReal(Vout());
@@ -468,7 +466,16 @@ void ProgMPIRecFourier::run()
 
                         gettimeofday(&start_time,nullptr);
 
-                        if ( nProcs > 1 )
+                        if ( treeReduction )
+                        {
+                            reduceFourierVolumeTree( fourierVolume, new_comm );
+
+                            gettimeofday(&end_time,nullptr);
+                            total_usecs = (end_time.tv_sec-start_time.tv_sec) * 1000000 + (end_time.tv_usec-start_time.tv_usec);
+                            if (verbose > 0)
+                                std::cout << "Reduction time: " << ((double)total_usecs/(double)1000000) << " secs." << std::endl;
+                        }
+                        else if ( nProcs > 1 )
                         {
                             // Receive from other workers
 
@@ -609,11 +616,16 @@ void ProgMPIRecFourier::run()
                     }
                     else
                     {
-                        MPI_Send( nullptr,0,MPI_INT,1,TAG_FREEWORKER, MPI_COMM_WORLD );
+                        if ( treeReduction )
+                            reduceFourierVolumeTree( fourierVolume, new_comm );
+                        else
+                        {
+                            MPI_Send( nullptr,0,MPI_INT,1,TAG_FREEWORKER, MPI_COMM_WORLD );
 
-                        sendDataInChunks( fourierVolume, 1, 2 * sizeout, BUFFSIZE, MPI_COMM_WORLD);
+                            sendDataInChunks( fourierVolume, 1, 2 * sizeout, BUFFSIZE, MPI_COMM_WORLD);
 
-                        MPI_Send( nullptr,0,MPI_INT,1,TAG_FREEWORKER, MPI_COMM_WORLD );
+                            MPI_Send( nullptr,0,MPI_INT,1,TAG_FREEWORKER, MPI_COMM_WORLD );
+                        }
 
                         break;
                     }
@@ -649,14 +661,7 @@ void ProgMPIRecFourier::run()
         // Kill threads used on workers
         if ( node->active && !node->isMaster() )
         {
-            threadOpCode = EXIT_THREAD;
-            barrier_wait( &barrier );
-
-            for ( int nt=0; nt<numThreads; nt++)
-            {
-                pthread_join(*(th_ids+nt),nullptr);
-            }
-            barrier_destroy( &barrier );
+            destroyThreads();
         }
         iter++;
     }
@@ -691,3 +696,14 @@ int  ProgMPIRecFourier::sendDataInChunks( double * pointer, int dest, int totalS
 
     return err;
 }
+
+void ProgMPIRecFourier::reduceFourierVolumeTree( double * fourierVolume, MPI_Comm comm )
+{
+    // Real and imaginary parts are summed independently
+    xmipp_MPI_TreeReduceSum( fourierVolume, 2 * sizeout, 0, comm, BUFFSIZE, TAG_TRANSFER );
+
+    // The FSC collection is requested to each worker as soon as it asks for work.
+    // Workers must not ask again until all of them have contributed to the
+    // first half, otherwise they could receive the collection request twice
+    MPI_Barrier( comm );
+}
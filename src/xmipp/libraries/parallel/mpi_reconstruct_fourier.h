@@ -66,6 +66,10 @@ public:
     /** Dvide the job in this number block with this number of images */
     int mpi_job_size;
 
+    /** Reduce the Fourier volumes of the workers following a binomial tree
+     * instead of sending all of them to the first worker */
+    bool treeReduction;
+
     /** Empty constructor */
     ProgMPIRecFourier()
     {}
@@ -98,6 +102,11 @@ public:
 
     int  sendDataInChunks( double * pointer, int dest, int totalSize, int buffSize, MPI_Comm comm );
 
+    /** Sum the Fourier volumes of all workers into the first worker.
+     * comm must only contain the workers (first worker with rank 0).
+     */
+    void reduceFourierVolumeTree( double * fourierVolume, MPI_Comm comm );
+
 };
 //@}
 //end of class MPI reconstruct fourier
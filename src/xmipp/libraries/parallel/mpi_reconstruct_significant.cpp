@@ -44,6 +44,16 @@ void MpiProgReconstructSignificant::synchronize()
 	node->barrierWait();
 }
 
+void MpiProgReconstructSignificant::shareVolume(MultidimArray<double> &V, size_t root)
+{
+	size_t dims[3]={ZSIZE(V),YSIZE(V),XSIZE(V)};
+	MPI_Bcast(dims,3,XMIPP_MPI_SIZE_T,(int)root,MPI_COMM_WORLD);
+	if (rank!=root)
+		V.resizeNoCopy(dims[0],dims[1],dims[2]);
+	MPI_Bcast(MULTIDIM_ARRAY(V),(int)MULTIDIM_SIZE(V),MPI_DOUBLE,(int)root,MPI_COMM_WORLD);
+	V.setXmippOrigin();
+}
+
 void MpiProgReconstructSignificant::gatherAlignment()
 {
 	// Share weights and cc volumes
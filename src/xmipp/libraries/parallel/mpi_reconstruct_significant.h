@@ -57,6 +57,9 @@ public:
 
 	// Redefine how to gather the alignment
     void gatherAlignment();
+
+	// Redefine how to share volumes
+	void shareVolume(MultidimArray<double> &V, size_t root);
 };
 //@}
 #endif
@@ -125,5 +125,6 @@ void MpiProgSubtractProjection::finishProcessing()
 }
 void MpiProgSubtractProjection::wait()
 {
+    ProgSubtractProjection::wait();
     distributor->wait();
 }
@@ -24,11 +24,14 @@
  ***************************************************************************/
 
 #include <unistd.h>
+#include <limits>
+#include <vector>
 #include "xmipp_mpi.h"
 #include "core/xmipp_filename.h"
 #include "core/xmipp_error.h"
 #include "core/xmipp_macros.h"
 #include "core/metadata_db.h"
+#include "data/metadata_serializer.h"
 
 MpiTaskDistributor::MpiTaskDistributor(size_t nTasks, size_t bSize, const std::shared_ptr<MpiNode> &node) :
         ThreadTaskDistributor(nTasks, bSize)
@@ -199,38 +202,81 @@ size_t MpiNode::getActiveNodes()
 template <typename T>
 void MpiNode::gatherMetadatas(T &MD, const FileName &rootname)
 {
+    // rootname was used to name the temporary files of each node.
+    // The rows are now sent through MPI and no file is written.
     if (size == 1)
         return;
 
-    FileName fn;
+    std::vector<char> buffer;
+    if (!isMaster())
+        MetaDataSerializer::serialize(MD, buffer);
 
-    if (!isMaster()) //workers just write down partial results
+    size_t bufferSize = buffer.size();
+    std::vector<size_t> sizes(isMaster() ? size : 0);
+    MPI_Gather(&bufferSize, 1, XMIPP_MPI_SIZE_T, sizes.data(), 1, XMIPP_MPI_SIZE_T, 0, MPI_COMM_WORLD);
+
+    // MPI counts are int, use a single Gatherv only if everything fits
+    int fitsInt = 1;
+    std::vector<char> received;
+    std::vector<int> counts, displs;
+    if (isMaster())
     {
-        fn = formatString("%s_node%d.xmd", rootname.c_str(), rank);
-        MD.write(fn);
+        size_t total = 0;
+        for (size_t s : sizes)
+            total += s;
+        fitsInt = total < (size_t)std::numeric_limits<int>::max();
+        if (fitsInt)
+        {
+            counts.resize(size);
+            displs.resize(size);
+            for (size_t nodeRank = 0; nodeRank < size; nodeRank++)
+            {
+                counts[nodeRank] = (int)sizes[nodeRank];
+                displs[nodeRank] = nodeRank == 0 ? 0 : displs[nodeRank - 1] + counts[nodeRank - 1];
+            }
+            received.resize(total);
+        }
     }
-    ///Wait for all workers write results
-    barrierWait();
-    if (isMaster()) //master should collect and join workers results
+    MPI_Bcast(&fitsInt, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    if (fitsInt)
     {
-        MetaDataDb mdAll(MD), mdSlave;
-        for (size_t nodeRank = 1; nodeRank < size; nodeRank++)
+        MPI_Gatherv(buffer.data(), (int)bufferSize, MPI_CHAR,
+                    received.data(), counts.data(), displs.data(), MPI_CHAR, 0, MPI_COMM_WORLD);
+        if (isMaster())
         {
-            fn = formatString("%s_node%d.xmd", rootname.c_str(), nodeRank);
-            mdSlave.read(fn);
-            //make sure file is not empty
-            if (!mdSlave.isEmpty())
-                mdAll.unionAll(mdSlave);
-            //Remove blockname
-            fn = fn.removeBlockName();
-            remove(fn.c_str());
+            MetaDataVec mdAll(MD);
+            for (size_t nodeRank = 1; nodeRank < size; nodeRank++)
+                MetaDataSerializer::deserialize(received.data() + displs[nodeRank], sizes[nodeRank], mdAll);
+            MD = T(mdAll);
         }
-        //remove first metadata
-        fn = formatString("%s_node%d.xmd", rootname.c_str(), 1);
-        fn = fn.removeBlockName();
-        remove(fn.c_str());
-        MD = T(mdAll);
     }
+    else
+    {
+        // Too large for a single collective, receive the nodes one by one in chunks
+        const size_t chunkSize = 1 << 30;
+        if (isMaster())
+        {
+            MetaDataVec mdAll(MD);
+            MPI_Status status;
+            for (size_t nodeRank = 1; nodeRank < size; nodeRank++)
+            {
+                received.resize(sizes[nodeRank]);
+                for (size_t offset = 0; offset < sizes[nodeRank]; offset += chunkSize)
+                    MPI_Recv(received.data() + offset, (int)XMIPP_MIN(chunkSize, sizes[nodeRank] - offset),
+                             MPI_CHAR, nodeRank, TAG_WORK, MPI_COMM_WORLD, &status);
+                MetaDataSerializer::deserialize(received.data(), sizes[nodeRank], mdAll);
+            }
+            MD = T(mdAll);
+        }
+        else
+        {
+            for (size_t offset = 0; offset < bufferSize; offset += chunkSize)
+                MPI_Send(buffer.data() + offset, (int)XMIPP_MIN(chunkSize, bufferSize - offset),
+                         MPI_CHAR, 0, TAG_WORK, MPI_COMM_WORLD);
+        }
+    }
+    barrierWait();
 }
 
 template void MpiNode::gatherMetadatas<MetaDataVec>(MetaDataVec&, const FileName&);
@@ -354,3 +400,71 @@ void xmipp_MPI_Reduce(
 				   (unsigned char*)(recv_data)+quotient*blockSize*size_t(type_size),
 				   remainder,datatype,op,root,communicator);
 }
+
+void xmipp_MPI_TreeReduceSum(
+    double* data,
+    size_t count,
+    int root,
+    MPI_Comm communicator,
+    size_t blockSize,
+    int tag)
+{
+    int rank, size;
+    MPI_Comm_rank(communicator, &rank);
+    MPI_Comm_size(communicator, &size);
+    if (size < 2 || count == 0)
+        return;
+    blockSize = XMIPP_MIN(blockSize, count);
+    size_t numBlocks = (count + blockSize - 1) / blockSize;
+
+    // Ranks relative to the root so that the root is always the node 0 of the tree
+    int relRank = (rank - root + size) % size;
+    std::vector<double> recvBuffer[2];
+    for (int mask = 1; mask < size; mask <<= 1)
+    {
+        if (relRank & mask)
+        {
+            // Send the partial sum to the parent and leave the tree
+            int parent = (relRank - mask + root) % size;
+            for (size_t b = 0; b < numBlocks; b++)
+            {
+                size_t first = b * blockSize;
+                int n = (int)XMIPP_MIN(blockSize, count - first);
+                MPI_Send(data + first, n, MPI_DOUBLE, parent, tag, communicator);
+            }
+            break;
+        }
+        else if (relRank + mask < size)
+        {
+            // Receive the partial sum of the child. The next block is
+            // being received while the current one is accumulated
+            int child = (relRank + mask + root) % size;
+            if (recvBuffer[0].empty())
+            {
+                recvBuffer[0].resize(blockSize);
+                recvBuffer[1].resize(blockSize);
+            }
+            MPI_Request request[2];
+            MPI_Irecv(recvBuffer[0].data(), (int)XMIPP_MIN(blockSize, count),
+                      MPI_DOUBLE, child, tag, communicator, &request[0]);
+            for (size_t b = 0; b < numBlocks; b++)
+            {
+                int current = b % 2;
+                int next = 1 - current;
+                MPI_Wait(&request[current], MPI_STATUS_IGNORE);
+                if (b + 1 < numBlocks)
+                {
+                    size_t nextFirst = (b + 1) * blockSize;
+                    MPI_Irecv(recvBuffer[next].data(), (int)XMIPP_MIN(blockSize, count - nextFirst),
+                              MPI_DOUBLE, child, tag, communicator, &request[next]);
+                }
+                size_t first = b * blockSize;
+                size_t n = XMIPP_MIN(blockSize, count - first);
+                double *ptrData = data + first;
+                const double *ptrRecv = recvBuffer[current].data();
+                for (size_t i = 0; i < n; i++)
+                    ptrData[i] += ptrRecv[i];
+            }
+        }
+    }
+}
@@ -61,7 +61,11 @@ public:
     /** Wait on a barrier for the other MPI nodes */
     void barrierWait();
 
-    /** Gather metadatas */
+    /** Gather metadatas.
+     * The rows of the workers are serialized and sent to the master through
+     * MPI, where they are appended (in rank order) to its own metadata.
+     * rootName is not used anymore (it named the former temporary files).
+     */
     template <typename T> // T = MetaData*
     void gatherMetadatas(T &MD, const FileName &rootName);
 
@@ -268,7 +272,10 @@ protected:
       BASE_CLASS::finishProcessing();
   }
 
-  void wait() { distributor->wait(); }
+  void wait() {
+    BASE_CLASS::wait();
+    distributor->wait();
+  }
 };
 
 /** MPI Reduce with memory constraint.
@@ -284,5 +291,21 @@ void xmipp_MPI_Reduce(
     MPI_Comm communicator,
 	size_t blockSize=1048576);
 
+/** MPI sum reduction of a large double array following a binomial tree.
+ * After the call, the array at the root contains the sum of the arrays of
+ * all the processes in the communicator (the content at the rest of
+ * processes is undefined). Each process exchanges data with at most
+ * log2(P) partners, and the data is transferred in blocks of blockSize
+ * elements so that the reception of the next block overlaps with the
+ * addition of the current one.
+ */
+void xmipp_MPI_TreeReduceSum(
+    double* data,
+    size_t count,
+    int root,
+    MPI_Comm communicator,
+    size_t blockSize=1048576,
+    int tag=0);
+
 /** @} */
 #endif /* XMIPP_MPI_H_ */
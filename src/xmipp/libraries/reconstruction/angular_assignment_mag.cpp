@@ -46,7 +46,7 @@ ProgAngularAssignmentMag::ProgAngularAssignmentMag(){
 ProgAngularAssignmentMag::~ProgAngularAssignmentMag()  = default;
 
 void ProgAngularAssignmentMag::defineParams() {
-	XmippMetadataProgram::defineParams();
+	ThreadedMetadataProgram::defineParams();
 	//usage
 	addUsageLine( "Generates a list of candidates for angular assignment for each experimental image");
 	addParamsLine("   -ref <md_file>             : Metadata file with input reference projections");
@@ -58,12 +58,11 @@ void ProgAngularAssignmentMag::defineParams() {
 	addParamsLine("  [--Nsimultaneous <Nprocessors=1>]  : Nsimultaneous");
 	addParamsLine("  [--refVol <refVolFile=NULL>]  : reference volume to be reprojected when comparing with previous alignment");
 	addParamsLine("  [--useForValidation] : Use the program for validation");
-	addParamsLine("  [--thr <threads=4>]           : How many threads to use");
 }
 
 // Read arguments ==========================================================
 void ProgAngularAssignmentMag::readParams() {
-	XmippMetadataProgram::readParams();
+	ThreadedMetadataProgram::readParams();
 	fnRef = getParam("-ref");
 	fnDir = getParam("-odir");
 	sampling = getDoubleParam("-sampling");
@@ -73,11 +72,6 @@ void ProgAngularAssignmentMag::readParams() {
 	maxShift = getDoubleParam("--maxShift");
 	inputReference_volume = getParam("--refVol");
 	useForValidation=checkParam("--useForValidation");
-	threads = getIntParam("--thr");
-	threadPool.resize(threads);
-	transformersForImages.resize(threads);
-	ccMatrixBestCandidTransformers.resize(threads);
-	ccMatrixShifts.resize(threads);
 }
 
 // Show ====================================================================
@@ -88,7 +82,7 @@ void ProgAngularAssignmentMag::show() const {
 		std::cout << "Sampling: " << sampling << std::endl;
 		std::cout << "Angular step: " << angStep << std::endl;
 		std::cout << "Maximum shift: " << maxShift << std::endl;
-		std::cout << "threads: " << threads << std::endl;
+		std::cout << "threads: " << numThreads << std::endl;
 		if(useForValidation){
 			std::cout << "ref vol size: " << refXdim <<" x "<< refYdim <<" x "<< refZdim << std::endl;
 			std::cout << "useForValidation            : "  << useForValidation << std::endl;
@@ -368,8 +362,15 @@ void ProgAngularAssignmentMag::graphFourierFilter(const Matrix1D<double> &ccVecI
 	ccVecOut = eigenvectors*ccGFT;
 }
 
-void ProgAngularAssignmentMag::processImage(const FileName &fnImg,const FileName &fnImgOut,
+void ProgAngularAssignmentMag::prepareThreads(size_t nThreads) {
+	threadData.resize(nThreads);
+	for (auto &d : threadData)
+		d = std::make_unique<ThreadData>();
+}
+
+void ProgAngularAssignmentMag::processImageThread(size_t thrId, const FileName &fnImg,const FileName &fnImgOut,
 		const MDRow &rowIn, MDRow &rowOut) {
+	ThreadData &d = *threadData[thrId];
 
 	// experimental image related
 	Image<double> ImgIn;
@@ -385,12 +386,12 @@ void ProgAngularAssignmentMag::processImage(const FileName &fnImg,const FileName
 	ImgIn.read(fnImg);
 	MDaIn = ImgIn();
 	MDaIn.setXmippOrigin();
-	transformerImage.FourierTransform(MDaIn, MDaInF, true);
-	transformerImage.getCompleteFourier(MDaInF2);
+	d.transformerImage.FourierTransform(MDaIn, MDaInF, true);
+	d.transformerImage.getCompleteFourier(MDaInF2);
 	FFT_magnitude(MDaInF2, MDaInFM);
 	completeFourierShift(MDaInFM, MDaInFMs);
 	MDaInFMs_polarPart = imToPolar(MDaInFMs, startBand, finalBand);
-	transformerPolarImage.FourierTransform(MDaInFMs_polarPart, MDaInFMs_polarF, true);
+	d.transformerPolarImage.FourierTransform(MDaInFMs_polarPart, MDaInFMs_polarF, true);
 
 	// variables for an initial screening of possible "good" references
 	double psi;
@@ -414,12 +415,11 @@ void ProgAngularAssignmentMag::processImage(const FileName &fnImg,const FileName
 	// loop over all reference images. Screening of possible "good" references
 	for (int k = 0; k < sizeMdRef; ++k) {
 		// computing relative rotation and shift
-		ccMatrix(MDaInFMs_polarF, vecMDaRefFMs_polarF[k], ccMatrixRot, ccMatrixProcessImageTransformer);
+		ccMatrix(MDaInFMs_polarF, vecMDaRefFMs_polarF[k], ccMatrixRot, d.ccMatrixProcessImageTransformer);
 		maxByColumn(ccMatrixRot, ccVectorRot);
-		peaksFound = 0;
 		std::vector<double> cand(maxAccepted, 0.);
-		psiCandidates(ccVectorRot, cand, XSIZE(ccMatrixRot));
-		bestCand(MDaIn, MDaInF, vecMDaRef[k], cand, psi, Tx, Ty, cc_coeff);
+		psiCandidates(ccVectorRot, cand, XSIZE(ccMatrixRot), d.peaksFound);
+		bestCand(d, MDaIn, MDaInF, vecMDaRef[k], cand, psi, Tx, Ty, cc_coeff);
 		// all results are storage for posterior partial_sort
 		Idx[k] = k; // for sorting
 		VEC_ELEM(ccvec,k) = cc_coeff;
@@ -545,8 +545,11 @@ void ProgAngularAssignmentMag::validateAssignment(int &idx, int &idxfilt, double
 		MultidimArray<double> &MDaIn, Matrix1D<double> &dirjp) {
 	if (!useForValidation) {
 		// align & correlation between reference images located at idx and idxfilt
+		// alignImages modifies its second argument, and the gallery is shared
+		// by all threads, so the reference is aligned in a copy
 		Matrix2D<double> M2;
-		double graphCorr = alignImages(vecMDaRef[idx], vecMDaRef[idxfilt], M2,
+		MultidimArray<double> refFilt = vecMDaRef[idxfilt];
+		double graphCorr = alignImages(vecMDaRef[idx], refFilt, M2,
 				xmipp_transformation::DONT_WRAP);
 		rowOut.setValue(MDL_GRAPH_CC, graphCorr);
 	} else {
@@ -867,7 +870,7 @@ void ProgAngularAssignmentMag::circularWindow(MultidimArray<double> &in) const {
 /* Only for 180 angles
  * just two locations of maximum peaks in ccvRot */
 void ProgAngularAssignmentMag::psiCandidates(const MultidimArray<double> &in,
-		std::vector<double> &cand, const size_t &size) {
+		std::vector<double> &cand, const size_t &size, size_t &peaksFound) const {
 	double max1 = -1000.;
 	int idx1 = 0;
 	double max2 = -1000.;
@@ -922,7 +925,7 @@ void ProgAngularAssignmentMag::psiCandidates(const MultidimArray<double> &in,
  * shifts are computed as maximum of CrossCorr vector
  * vector<double> cand contains candidates to relative rotation between images
  */
-void ProgAngularAssignmentMag::bestCand(/*inputs*/
+void ProgAngularAssignmentMag::bestCand(ThreadData &d, /*inputs*/
 		const MultidimArray<double> &MDaIn,
 		const MultidimArray<std::complex<double> > &MDaInF,
 		const MultidimArray<double> &MDaRef, std::vector<double> &cand,
@@ -932,17 +935,17 @@ void ProgAngularAssignmentMag::bestCand(/*inputs*/
 	shift_x = 0.;
 	shift_y = 0.;
 	bestCoeff = 0.0;
-	std::mutex mutex;
 
-	auto workload = [&](int id, int i) {
+	// the peaks of this image are processed by its thread
+	for (size_t i = 0; i < d.peaksFound; ++i) {
 		auto rotVar = -1. * cand[i];  //negative, because is for reference rotation
 		MultidimArray<double> MDaRefRot;
 		MDaRefRot.setXmippOrigin();
 		applyRotation(MDaRef, rotVar, MDaRefRot); //rotation to reference image
 		MultidimArray<std::complex<double> > MDaRefRotF;
-		transformersForImages[id].FourierTransform(MDaRefRot, MDaRefRotF, true);
-		auto &ccMatrixShift = ccMatrixShifts.at(id);
-		ccMatrix(MDaInF, MDaRefRotF, ccMatrixShift, ccMatrixBestCandidTransformers.at(id)); // cross-correlation matrix
+		d.transformerRefRot.FourierTransform(MDaRefRot, MDaRefRotF, true);
+		auto &ccMatrixShift = d.ccMatrixShift;
+		ccMatrix(MDaInF, MDaRefRotF, ccMatrixShift, d.ccMatrixBestCandidTransformer); // cross-correlation matrix
 
 		MultidimArray<double> ccVectorTx;
 		maxByColumn(ccMatrixShift, ccVectorTx); // ccvMatrix to ccVector
@@ -954,7 +957,7 @@ void ProgAngularAssignmentMag::bestCand(/*inputs*/
 		getShift(ccVectorTy, ty, YSIZE(ccMatrixShift));
 
 		if (std::abs(tx) > maxShift || std::abs(ty) > maxShift)
-			return;
+			continue;
 
 		//apply transformation to experimental image
 		double expTx;
@@ -969,24 +972,13 @@ void ProgAngularAssignmentMag::bestCand(/*inputs*/
 		circularWindow(MDaInShiftRot); //circular masked MDaInRotShift
 
 		auto tempCoeff = correlationIndex(MDaRef, MDaInShiftRot);
-		std::lock_guard lock(mutex);
 		if (tempCoeff > bestCoeff) {
 			bestCoeff = tempCoeff;
 			shift_x = tx;
 			shift_y = ty;
 			psi = expPsi;
 		}
-	};
-
-	// process peaks in parallel
-	auto futures = std::vector<std::future<void>>();
-	for (size_t i = 0; i < peaksFound; ++i) {
-        futures.emplace_back(threadPool.push(workload, i));
-    }
-	// wait for processing to finish
-    for (auto &f : futures) {
-        f.get();
-    }
+	}
 }
 
 /* apply rotation */
@@ -27,7 +27,6 @@
 #ifndef __ANGULAR_ASSIGNMENT_MAG_H
 #define __ANGULAR_ASSIGNMENT_MAG_H
 
-#include "core/xmipp_metadata_program.h"
 #include "core/matrix1d.h"
 #include "core/metadata_vec.h"
 #include <core/xmipp_fftw.h>
@@ -36,9 +35,10 @@
 #include <core/xmipp_image.h>
 #include <data/mask.h>
 #include <data/filters.h>
-#include "CTPL/ctpl_stl.h"
+#include "threaded_metadata_program.h"
 
 
+#include <memory>
 #include <vector>
 
 /**@defgroup AngularAssignmentMag ***
@@ -46,14 +46,15 @@
 //@{
 
 /** Angular_Assignment_mag parameters. */
-class ProgAngularAssignmentMag: public XmippMetadataProgram
+class ProgAngularAssignmentMag: public ThreadedMetadataProgram
 {
 public:
 	void defineParams() override;
 	void readParams() override;
 	void show() const override;
 	void preProcess() override;
-	void processImage(const FileName &fnImg, const FileName &fnImgOut, const MDRow &rowIn, MDRow &rowOut) override;
+	void prepareThreads(size_t nThreads) override;
+	void processImageThread(size_t thrId, const FileName &fnImg, const FileName &fnImgOut, const MDRow &rowIn, MDRow &rowOut) override;
 	void postProcess() override;
     ProgAngularAssignmentMag();
     ~ProgAngularAssignmentMag();
@@ -67,8 +68,23 @@ public:
 	size_t Nprocessors;
 
 private:
+    /// Data modified while processing an image (one per thread)
+    struct ThreadData
+    {
+        // Transformers
+        FourierTransformer transformerImage;
+        FourierTransformer transformerPolarImage;
+        FourierTransformer ccMatrixProcessImageTransformer;
+        FourierTransformer transformerRefRot;
+        FourierTransformer ccMatrixBestCandidTransformer;
+
+        MultidimArray<double> ccMatrixShift;
+
+        size_t peaksFound = 0; // peaksFound in ccVectorRot
+    };
+
 	double angDistance(int &, int &, Matrix1D<double> &, Matrix1D<double> &);
-    void bestCand(const MultidimArray<double> &MDaIn, const MultidimArray<std::complex<double> > &MDaInF, const MultidimArray<double> &MDaRef, std::vector<double> &cand, double &bestCandRot, double &shift_x, double &shift_y, double &bestCoeff);
+    void bestCand(ThreadData &d, const MultidimArray<double> &MDaIn, const MultidimArray<std::complex<double> > &MDaInF, const MultidimArray<double> &MDaRef, std::vector<double> &cand, double &bestCandRot, double &shift_x, double &shift_y, double &bestCoeff);
     void completeFourierShift(const MultidimArray<double> &in, MultidimArray<double> &out) const;
     void ccMatrix(const MultidimArray<std::complex<double> > &F1, const MultidimArray<std::complex<double> > &F2, MultidimArray<double> &result, FourierTransformer &transformer);
     void checkStorageSpace();
@@ -85,10 +101,10 @@ private:
     void maxByRow(const MultidimArray<double> &in, MultidimArray<double> &out) const;
 
     void processGallery(FileName &);
-    void psiCandidates(const MultidimArray<double> &in, std::vector<double> &cand, const size_t &size);
+    void psiCandidates(const MultidimArray<double> &in, std::vector<double> &cand, const size_t &size, size_t &peaksFound) const;
     void validateAssignment(int &, int &, double &, double &, const MDRow &, MDRow &, MultidimArray<double> &, Matrix1D<double> &);
 
-    ctpl::thread_pool threadPool;
+    std::vector< std::unique_ptr<ThreadData> > threadData;
 
     /** Filenames */
     FileName fnIn;
@@ -102,15 +118,9 @@ private:
     MetaDataVec mdRef;
     MetaDataVec mdOut;
 
-    // Transformers
-    std::vector<FourierTransformer> transformersForImages;
+    // Transformers for the reference gallery
     FourierTransformer transformerPolarImage;
     FourierTransformer transformerImage;
-    FourierTransformer transformerPolarRealSpace;
-    std::vector<FourierTransformer> ccMatrixBestCandidTransformers;
-    FourierTransformer ccMatrixProcessImageTransformer;
-
-    std::vector<MultidimArray<double>> ccMatrixShifts;
 
     // vector of reference images
     std::vector< MultidimArray<double> > vecMDaRef;
@@ -134,8 +144,6 @@ private:
 	Matrix1D<double> eigenvalues;
 	Matrix2D<double> eigenvectors;
 
-	int      peaksFound = 0; // peaksFound in ccVectorRot
-
     // matrix for neighbors and angular distance
     std::vector< std::vector<int> > neighborsMatrix; // this should be global
     std::vector< std::vector<double> > neighboursDistance; // not sure if necessary this global
@@ -153,9 +161,6 @@ private:
     int refYdim;
     int refZdim;
 
-    // threads to use
-    int threads;
-
     int sizeMdRef;
     int sizeMdIn;
     size_t n_bands;
@@ -136,20 +136,25 @@ void ProgAngularContinuousAssign::preProcess()
     // Read the reference volume
     Image<double> V;
     V.read(fn_ref);
-    V().setXmippOrigin();
+    prepareVolume(V());
+}
+
+void ProgAngularContinuousAssign::prepareVolume(MultidimArray<double> &V)
+{
+    V.setXmippOrigin();
 
     // Prepare the masks in real space
     Mask mask_Real3D;
     mask_Real3D.type = mask_Real.type = GAUSSIAN_MASK;
     mask_Real3D.mode = mask_Real.mode = INNER_MASK;
 
-    mask_Real3D.sigma = mask_Real.sigma = gaussian_Real_sigma * ((double)XSIZE(V()));
+    mask_Real3D.sigma = mask_Real.sigma = gaussian_Real_sigma * ((double)XSIZE(V));
 
-    mask_Real3D.generate_mask(V());
-    mask_Real.generate_mask(YSIZE(V()), XSIZE(V()));
+    mask_Real3D.generate_mask(V);
+    mask_Real.generate_mask(YSIZE(V), XSIZE(V));
 
-    double gs2 = 2. * PI * gaussian_Real_sigma * gaussian_Real_sigma * ((double)XSIZE(V()) * (double) XSIZE(V()));
-    double gs3 = gs2 * sqrt(2. * PI) * gaussian_Real_sigma * ((double) XSIZE(V()));
+    double gs2 = 2. * PI * gaussian_Real_sigma * gaussian_Real_sigma * ((double)XSIZE(V) * (double) XSIZE(V));
+    double gs3 = gs2 * sqrt(2. * PI) * gaussian_Real_sigma * ((double) XSIZE(V));
 
     mask_Real3D.get_cont_mask() *= gs3;
     mask_Real.get_cont_mask() *= gs2;
@@ -165,23 +170,23 @@ void ProgAngularContinuousAssign::preProcess()
     mask_Fourier.type = GAUSSIAN_MASK;
     mask_Fourier.mode = INNER_MASK;
 
-    mask_Fourier.sigma = gaussian_DFT_sigma * ((double)XSIZE(V()));
-    mask_Fourier.generate_mask(YSIZE(V()), XSIZE(V()));
+    mask_Fourier.sigma = gaussian_DFT_sigma * ((double)XSIZE(V));
+    mask_Fourier.generate_mask(YSIZE(V), XSIZE(V));
 
-    double gsf2 = 2. * PI * gaussian_DFT_sigma * gaussian_DFT_sigma * ((double)XSIZE(V()) * (double)XSIZE(V()));
+    double gsf2 = 2. * PI * gaussian_DFT_sigma * gaussian_DFT_sigma * ((double)XSIZE(V) * (double)XSIZE(V));
     mask_Fourier.get_cont_mask() *= gsf2;
     mask_Fourier.get_cont_mask()(0, 0) *= weight_zero_freq;
 
     // Weight the input volume in real space
-    mask_Real3D.apply_mask(V(), V());
+    mask_Real3D.apply_mask(V, V);
 
     // Perform the DFT of the reference volume
     int Status;
-    reDFTVolume = V();
-    imDFTVolume.resize(V());
+    reDFTVolume = V;
+    imDFTVolume.resize(V);
     CenterFFT(reDFTVolume, false);
     VolumeDftRealToRealImaginary(MULTIDIM_ARRAY(reDFTVolume),
-                                 MULTIDIM_ARRAY(imDFTVolume), XSIZE(V()), YSIZE(V()), ZSIZE(V()),
+                                 MULTIDIM_ARRAY(imDFTVolume), XSIZE(V), YSIZE(V), ZSIZE(V),
                                  &Status);
     CenterFFT(reDFTVolume, true);
     CenterFFT(imDFTVolume, true);
@@ -197,57 +202,64 @@ void ProgAngularContinuousAssign::processImage(const FileName &fnImg, const File
     img.read(fnImg);
     img().setXmippOrigin();
 
-    double old_rot, old_tilt, old_psi, old_shiftX, old_shiftY;
-    rowIn.getValue(MDL_ANGLE_ROT,old_rot);
-    rowIn.getValue(MDL_ANGLE_TILT,old_tilt);
-    rowIn.getValue(MDL_ANGLE_PSI,old_psi);
-    rowIn.getValue(MDL_SHIFT_X,old_shiftX);
-    rowIn.getValue(MDL_SHIFT_Y,old_shiftY);
+    double rot, tilt, psi, shiftX, shiftY;
+    rowIn.getValue(MDL_ANGLE_ROT,rot);
+    rowIn.getValue(MDL_ANGLE_TILT,tilt);
+    rowIn.getValue(MDL_ANGLE_PSI,psi);
+    rowIn.getValue(MDL_SHIFT_X,shiftX);
+    rowIn.getValue(MDL_SHIFT_Y,shiftY);
+
+    double cost = assignPose(img(), rot, tilt, psi, shiftX, shiftY);
+
+    rowOut.setValue(MDL_ANGLE_ROT,  rot);
+    rowOut.setValue(MDL_ANGLE_TILT, tilt);
+    rowOut.setValue(MDL_ANGLE_PSI,  psi);
+    rowOut.setValue(MDL_SHIFT_X,    shiftX);
+    rowOut.setValue(MDL_SHIFT_Y,    shiftY);
+    rowOut.setValue(MDL_COST,      cost);
+}
+
+// Assign the pose of one image ============================================
+double ProgAngularContinuousAssign::assignPose(MultidimArray<double> &img,
+        double &rot, double &tilt, double &psi, double &shiftX, double &shiftY)
+{
+    const double old_rot = rot;
+    const double old_tilt = tilt;
+    const double old_psi = psi;
 
     Matrix1D<double> pose(5);
-    pose(0) = old_rot;
-    pose(1) = old_tilt;
-    pose(2) = old_psi;
-    pose(3) = -old_shiftX; // The convention of shifts is different
-    pose(4) = -old_shiftY; // for Slavica
+    pose(0) = rot;
+    pose(1) = tilt;
+    pose(2) = psi;
+    pose(3) = -shiftX; // The convention of shifts is different
+    pose(4) = -shiftY; // for Slavica
 
-    mask_Real.apply_mask(img(), img());
+    mask_Real.apply_mask(img, img);
 
     double cost = CSTSplineAssignment(reDFTVolume, imDFTVolume,
-                                      img(), mask_Fourier.get_cont_mask(), pose, max_no_iter);
+                                      img, mask_Fourier.get_cont_mask(), pose, max_no_iter);
 
     Matrix2D<double> Eold, Enew;
     Euler_angles2matrix(old_rot,old_tilt,old_psi,Eold);
     Euler_angles2matrix(pose(0),pose(1),pose(2),Enew);
     double angular_change=Euler_distanceBetweenMatrices(Eold,Enew);
     double shift=sqrt(pose(3)*pose(3)+pose(4)*pose(4));
-    double new_rot=old_rot;
-    double new_tilt=old_tilt;
-    double new_psi=old_psi;
-    double new_shiftX=old_shiftX;
-    double new_shiftY=old_shiftY;
     if (angular_change<max_angular_change || max_angular_change<0)
     {
-    	new_rot    =  pose(0);
-    	new_tilt   =  pose(1);
-    	new_psi    =  pose(2);
+    	rot    =  pose(0);
+    	tilt   =  pose(1);
+    	psi    =  pose(2);
     }
     else
         cost=-1;
     if (shift<max_shift || max_shift<0)
     {
-    	new_shiftX = -pose(3);
-    	new_shiftY = -pose(4);
+    	shiftX = -pose(3);
+    	shiftY = -pose(4);
     }
     else
         cost=-1;
-
-    rowOut.setValue(MDL_ANGLE_ROT,  new_rot);
-    rowOut.setValue(MDL_ANGLE_TILT, new_tilt);
-    rowOut.setValue(MDL_ANGLE_PSI,  new_psi);
-    rowOut.setValue(MDL_SHIFT_X,    new_shiftX);
-    rowOut.setValue(MDL_SHIFT_Y,    new_shiftY);
-    rowOut.setValue(MDL_COST,      cost);
+    return cost;
 }
 
 /* ------------------------------------------------------------------------- */
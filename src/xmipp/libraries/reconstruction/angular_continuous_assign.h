@@ -24,7 +24,7 @@
  *  e-mail address 'xmipp@cnb.csic.es'
  ***************************************************************************/
 
-#ifndef _PROG_ANGULAR_PREDICT_CONTINOUOS
+#ifndef _PROG_ANGULAR_PREDICT_CONTINUOUS
 #define _PROG_ANGULAR_PREDICT_CONTINUOUS
 
 #include <core/xmipp_program.h>
@@ -81,6 +81,21 @@ public:
         An exception is thrown if any of the files is not found*/
     void preProcess();
 
+    /** Prepare a reference volume that is already in memory.
+        The volume is weighted in real space (it is modified) and its
+        DFT is kept for the assignment. The masks are generated for the
+        size of this volume. */
+    void prepareVolume(MultidimArray<double> &V);
+
+    /** Assign the pose of one image in memory.
+        At the input the angles and shifts are the initial guess, with
+        the same convention as in the metadata. At the output they have
+        the estimated pose, or the initial one if the limits in angle or
+        shift are exceeded (the returned cost is then -1). The image is
+        weighted in real space (it is modified). */
+    double assignPose(MultidimArray<double> &img, double &rot, double &tilt,
+                      double &psi, double &shiftX, double &shiftY);
+
     /** Predict angles and shift.
         At the input the pose parameters must have an initial guess of the
         parameters. At the output they have the estimated pose.*/
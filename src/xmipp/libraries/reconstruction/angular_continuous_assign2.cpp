@@ -35,20 +35,18 @@ ProgAngularContinuousAssign2::ProgAngularContinuousAssign2()
     produces_a_metadata = true;
     each_image_produces_an_output = true;
     projector = nullptr;
-    ctfImage = nullptr;
     rank = 0;
 }
 
 ProgAngularContinuousAssign2::~ProgAngularContinuousAssign2()
 {
 	delete projector;
-	delete ctfImage;
 }
 
 // Read arguments ==========================================================
 void ProgAngularContinuousAssign2::readParams()
 {
-	XmippMetadataProgram::readParams();
+	ThreadedMetadataProgram::readParams();
     fnVol = getParam("--ref");
     maxShift = getDoubleParam("--max_shift");
     maxScale = getDoubleParam("--max_scale");
@@ -116,7 +114,7 @@ void ProgAngularContinuousAssign2::defineParams()
 	defaultComments["-i"].addComment("Metadata with initial alignment");
 	defaultComments["-o"].clear();
 	defaultComments["-o"].addComment("Stack of images prepared for 3D reconstruction");
-    XmippMetadataProgram::defineParams();
+    ThreadedMetadataProgram::defineParams();
     addParamsLine("   --ref <volume>              : Reference volume");
     addParamsLine("  [--max_shift <s=-1>]         : Maximum shift allowed in pixels");
     addParamsLine("  [--max_scale <s=0.02>]       : Maximum scale change");
@@ -170,11 +168,6 @@ void ProgAngularContinuousAssign2::preProcess()
 		getImageSize(fnVol, Xdim, ydim, zdim, ndim);
 	}
 
-    Ip().initZeros(Xdim,Xdim);
-    E().initZeros(Xdim,Xdim);
-    Ifilteredp().initZeros(Xdim,Xdim);
-    Ifilteredp().setXmippOrigin();
-
     // Construct mask
     if (Rmax<0)
     	Rmax=Xdim/2;
@@ -187,6 +180,8 @@ void ProgAngularContinuousAssign2::preProcess()
     iMask2Dsum=1.0/mask2D.sum();
 
     // Construct reference covariance
+    Image<double> E;
+    E().initZeros(Xdim,Xdim);
     FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(mask2D)
     if (DIRECT_MULTIDIM_ELEM(mask2D,n))
     	DIRECT_MULTIDIM_ELEM(E(),n)=rnd_gaus(0,1);
@@ -206,14 +201,6 @@ void ProgAngularContinuousAssign2::preProcess()
     else
     	projector = new FourierProjector(pad,Ts/maxResol,xmipp_transformation::BSPLINE3);
 
-    // Low pass filter
-    filter.FilterBand=LOWPASS;
-    filter.w1=Ts/maxResol;
-    filter.raised_w=0.02;
-
-    // Transformation matrix
-    A.initIdentity(3);
-
     // Continuous cost
     if (optimizeGrayValues)
     	contCost = CONTCOST_L1;
@@ -221,62 +208,73 @@ void ProgAngularContinuousAssign2::preProcess()
     	contCost = CONTCOST_CORR;
 }
 
+void ProgAngularContinuousAssign2::prepareThreads(size_t nThreads)
+{
+	threadData.resize(nThreads);
+	for (auto &d : threadData)
+	{
+		d = std::make_unique<ThreadData>();
+		d->prm = this;
+		d->projector = std::make_unique<FourierProjector>(*projector, true);
+		d->Ip().initZeros(Xdim,Xdim);
+		d->E().initZeros(Xdim,Xdim);
+		d->Ifilteredp().initZeros(Xdim,Xdim);
+		d->Ifilteredp().setXmippOrigin();
+
+		// Low pass filter
+		d->filter.FilterBand=LOWPASS;
+		d->filter.w1=Ts/maxResol;
+		d->filter.raised_w=0.02;
+
+		// Transformation matrix
+		d->A.initIdentity(3);
+	}
+}
+
 //#define DEBUG
-void ProgAngularContinuousAssign2::updateCTFImage(double defocusU, double defocusV, double angle)
+void ProgAngularContinuousAssign2::updateCTFImage(ThreadData &d, double defocusU, double defocusV, double angle)
 {
+	CTFDescription &ctf=d.ctf;
 	ctf.K=1; // get pure CTF with no envelope
-	currentDefocusU=ctf.DeltafU=defocusU;
-	currentDefocusV=ctf.DeltafV=defocusV;
-	currentAngle=ctf.azimuthal_angle=angle;
+	d.currentDefocusU=ctf.DeltafU=defocusU;
+	d.currentDefocusV=ctf.DeltafV=defocusV;
+	d.currentAngle=ctf.azimuthal_angle=angle;
 	ctf.produceSideInfo();
-	if (ctfImage==nullptr)
-	{
-		ctfImage = new MultidimArray<double>();
-		ctfImage->resizeNoCopy(I());
-		STARTINGY(*ctfImage)=STARTINGX(*ctfImage)=0;
-
-		ctfEnvelope = std::make_unique<MultidimArray<double>>();
-		ctfEnvelope->resizeNoCopy(I());
-		STARTINGY(*ctfEnvelope)=STARTINGX(*ctfEnvelope)=0;
-	}
-	ctf.generateCTF((int)YSIZE(I()),(int)XSIZE(I()),*ctfImage,Ts);
-	ctf.generateEnvelope((int)YSIZE(I()),(int)XSIZE(I()),*ctfEnvelope,Ts);
-	if (phaseFlipped)
-		FOR_ALL_ELEMENTS_IN_ARRAY2D(*ctfImage)
-			A2D_ELEM(*ctfImage,i,j)=fabs(A2D_ELEM(*ctfImage,i,j));
+	d.ctfImage=ctfCache.getImage(ctf,(int)YSIZE(d.I()),(int)XSIZE(d.I()),Ts,phaseFlipped);
 }
 
 //#define DEBUG
 //#define DEBUG2
-double tranformImage(ProgAngularContinuousAssign2 *prm, double rot, double tilt, double psi,
+double tranformImage(ProgAngularContinuousAssign2::ThreadData *d, double rot, double tilt, double psi,
 		double a, double b, const Matrix2D<double> &A, double deltaDefocusU, double deltaDefocusV, double deltaDefocusAngle, int degree)
 {
-    if (prm->hasCTF)
+	ProgAngularContinuousAssign2 *prm=d->prm;
+    if (d->hasCTF)
     {
-    	double defocusU=prm->old_defocusU+deltaDefocusU;
+    	double defocusU=d->old_defocusU+deltaDefocusU;
 		double defocusV;
 		if (prm->sameDefocus){
     		defocusV=defocusU;
 		}
 		else
-			defocusV=prm->old_defocusV+deltaDefocusV;
-    	double angle=prm->old_defocusAngle+deltaDefocusAngle;
-    	if (defocusU!=prm->currentDefocusU || defocusV!=prm->currentDefocusV || angle!=prm->currentAngle)
-    		prm->updateCTFImage(defocusU,defocusV,angle);
+			defocusV=d->old_defocusV+deltaDefocusV;
+    	double angle=d->old_defocusAngle+deltaDefocusAngle;
+    	if (defocusU!=d->currentDefocusU || defocusV!=d->currentDefocusV || angle!=d->currentAngle)
+    		prm->updateCTFImage(*d,defocusU,defocusV,angle);
     }
-	projectVolume(*(prm->projector), prm->P, (int)XSIZE(prm->I()), (int)XSIZE(prm->I()),  rot, tilt, psi, (const MultidimArray<double> *)prm->ctfImage);
-	if (prm->old_flip)
+	projectVolume(*(d->projector), d->P, (int)XSIZE(d->I()), (int)XSIZE(d->I()),  rot, tilt, psi, d->ctfImage.get());
+	if (d->old_flip)
 	{
 		MAT_ELEM(A,0,0)*=-1;
 		MAT_ELEM(A,0,1)*=-1;
 		MAT_ELEM(A,0,2)*=-1;
 	}
 
-	applyGeometry(degree,prm->Ifilteredp(),prm->Ifiltered(),A,xmipp_transformation::IS_NOT_INV,xmipp_transformation::DONT_WRAP,0.);
-	const MultidimArray<double> &mP=prm->P();
+	applyGeometry(degree,d->Ifilteredp(),d->Ifiltered(),A,xmipp_transformation::IS_NOT_INV,xmipp_transformation::DONT_WRAP,0.);
+	const MultidimArray<double> &mP=d->P();
 	const MultidimArray<int> &mMask2D=prm->mask2D;
-	MultidimArray<double> &mIfilteredp=prm->Ifilteredp();
-	MultidimArray<double> &mE=prm->E();
+	MultidimArray<double> &mIfilteredp=d->Ifilteredp();
+	MultidimArray<double> &mE=d->E();
 	mE.initZeros();
 	if (prm->contCost==CONTCOST_L1)
 	{
@@ -316,20 +314,20 @@ double tranformImage(ProgAngularContinuousAssign2 *prm, double rot, double tilt,
 	else
 		cost=-correlationIndex(mIfilteredp,mP,&mMask2D);
 
-	//covarianceMatrix(mE, prm->C);
-	//double div=computeCovarianceMatrixDivergence(prm->C0,prm->C)/MAT_XSIZE(prm->C);
+	//covarianceMatrix(mE, d->C);
+	//double div=computeCovarianceMatrixDivergence(prm->C0,d->C)/MAT_XSIZE(d->C);
 #ifdef DEBUG
 	std::cout << "A=" << A << std::endl;
 	Image<double> save;
-	save()=a*prm->P()+b;
+	save()=a*d->P()+b;
 	save.write("PPPtheo.xmp");
-	save()=prm->Ifilteredp();
+	save()=d->Ifilteredp();
 	save.write("PPPfilteredp.xmp");
-	save()=prm->Ifiltered();
+	save()=d->Ifiltered();
 	save.write("PPPfiltered.xmp");
-	save()=prm->E();
+	save()=d->E();
 	save.write("PPPe.xmp");
-	//save()=prm->C;
+	//save()=d->C;
 	//save.write("PPPc.xmp");
 	//save()=prm->C0;
 	//save.write("PPPc0.xmp");
@@ -345,7 +343,7 @@ double tranformImage(ProgAngularContinuousAssign2 *prm, double rot, double tilt,
 }
 
 
-double continuous2cost(double *x, void *_prm)
+double continuous2cost(double *x, void *_data)
 {
 	double a=x[1];
 	double b=x[2];
@@ -360,21 +358,22 @@ double continuous2cost(double *x, void *_prm)
 	double deltaDefocusU=x[11];
 	double deltaDefocusV=x[12];
 	double deltaDefocusAngle=x[13];
-	auto *prm=(ProgAngularContinuousAssign2 *)_prm;
+	auto *d=(ProgAngularContinuousAssign2::ThreadData *)_data;
+	const ProgAngularContinuousAssign2 *prm=d->prm;
 	if (prm->maxShift>0 && deltax*deltax+deltay*deltay>prm->maxShift*prm->maxShift)
 		return 1e38;
 	if (fabs(scalex)>prm->maxScale || fabs(scaley)>prm->maxScale)
 		return 1e38;
 	if (fabs(deltaRot)>prm->maxAngularChange || fabs(deltaTilt)>prm->maxAngularChange || fabs(deltaPsi)>prm->maxAngularChange)
 		return 1e38;
-	if (fabs(a-prm->old_grayA)>prm->maxA)
+	if (fabs(a-d->old_grayA)>prm->maxA)
 		return 1e38;
-	if (fabs(b)>prm->maxB*prm->Istddev)
+	if (fabs(b)>prm->maxB*d->Istddev)
 		return 1e38;
 	if (fabs(deltaDefocusU)>prm->maxDefocusChange || fabs(deltaDefocusV)>prm->maxDefocusChange)
 		return 1e38;
-//	MAT_ELEM(prm->A,0,0)=1+scalex;
-//	MAT_ELEM(prm->A,1,1)=1+scaley;
+//	MAT_ELEM(d->A,0,0)=1+scalex;
+//	MAT_ELEM(d->A,1,1)=1+scaley;
 // In Matlab
 //	syms sx sy t
 //	R=[cos(t) -sin(t); sin(t) cos(t)]
@@ -384,20 +383,23 @@ double continuous2cost(double *x, void *_prm)
 //	[            -sin(2*t)*(sx/2 - sy/2), sy + sx*sin(t)^2 - sy*sin(t)^2 + 1]
 	double sin2_t=sin(scaleAngle)*sin(scaleAngle);
 	double sin_2t=sin(2*scaleAngle);
-	MAT_ELEM(prm->A,0,0)=1+scalex+(scaley-scalex)*sin2_t;
-	MAT_ELEM(prm->A,0,1)=0.5*(scaley-scalex)*sin_2t;
-	MAT_ELEM(prm->A,1,0)=MAT_ELEM(prm->A,0,1);
-	MAT_ELEM(prm->A,1,1)=1+scaley-(scaley-scalex)*sin2_t;
-	MAT_ELEM(prm->A,0,2)=prm->old_shiftX+deltax;
-	MAT_ELEM(prm->A,1,2)=prm->old_shiftY+deltay;
-	return tranformImage(prm,prm->old_rot+deltaRot, prm->old_tilt+deltaTilt, prm->old_psi+deltaPsi,
-			a, b, prm->A, deltaDefocusU, deltaDefocusV, deltaDefocusAngle, xmipp_transformation::LINEAR);
+	MAT_ELEM(d->A,0,0)=1+scalex+(scaley-scalex)*sin2_t;
+	MAT_ELEM(d->A,0,1)=0.5*(scaley-scalex)*sin_2t;
+	MAT_ELEM(d->A,1,0)=MAT_ELEM(d->A,0,1);
+	MAT_ELEM(d->A,1,1)=1+scaley-(scaley-scalex)*sin2_t;
+	MAT_ELEM(d->A,0,2)=d->old_shiftX+deltax;
+	MAT_ELEM(d->A,1,2)=d->old_shiftY+deltay;
+	return tranformImage(d,d->old_rot+deltaRot, d->old_tilt+deltaTilt, d->old_psi+deltaPsi,
+			a, b, d->A, deltaDefocusU, deltaDefocusV, deltaDefocusAngle, xmipp_transformation::LINEAR);
 }
 
 // Predict =================================================================
 //#define DEBUG
-void ProgAngularContinuousAssign2::processImage(const FileName &fnImg, const FileName &fnImgOut, const MDRow &rowIn, MDRow &rowOut)
+void ProgAngularContinuousAssign2::processImageThread(size_t thrId, const FileName &fnImg, const FileName &fnImgOut,
+        const MDRow &rowIn, MDRow &rowOut)
 {
+	ThreadData &d=*threadData[thrId];
+
     // Read input image and initial parameters
 //  ApplyGeoParams geoParams;
 //	geoParams.only_apply_shifts=false;
@@ -411,62 +413,63 @@ void ProgAngularContinuousAssign2::processImage(const FileName &fnImg, const Fil
 
 	if (verbose>=2)
 		std::cout << "Processing " << fnImg << std::endl;
-	I.read(fnImg);
-	I().setXmippOrigin();
-	Istddev=I().computeStddev();
-
-    Ifiltered()=I();
-    filter.applyMaskSpace(Ifiltered());
-
-	old_rot = rowIn.getValueOrDefault(MDL_ANGLE_ROT, 0.);
-	old_tilt = rowIn.getValueOrDefault(MDL_ANGLE_TILT, 0.);
-	old_psi = rowIn.getValueOrDefault(MDL_ANGLE_PSI, 0.);
-	old_shiftX = rowIn.getValueOrDefault(MDL_SHIFT_X, 0.);
-	old_shiftY = rowIn.getValueOrDefault(MDL_SHIFT_Y, 0.);
-	old_flip = rowIn.getValueOrDefault(MDL_FLIP, false);
+	d.I.read(fnImg);
+	d.I().setXmippOrigin();
+	d.Istddev=d.I().computeStddev();
+
+    d.Ifiltered()=d.I();
+    d.filter.applyMaskSpace(d.Ifiltered());
+
+	d.old_rot = rowIn.getValueOrDefault(MDL_ANGLE_ROT, 0.);
+	d.old_tilt = rowIn.getValueOrDefault(MDL_ANGLE_TILT, 0.);
+	d.old_psi = rowIn.getValueOrDefault(MDL_ANGLE_PSI, 0.);
+	d.old_shiftX = rowIn.getValueOrDefault(MDL_SHIFT_X, 0.);
+	d.old_shiftY = rowIn.getValueOrDefault(MDL_SHIFT_Y, 0.);
+	d.old_flip = rowIn.getValueOrDefault(MDL_FLIP, false);
 	double old_scaleX=0, old_scaleY=0, old_scaleAngle=0;
-	old_grayA=1;
-	old_grayB=0;
+	d.old_grayA=1;
+	d.old_grayB=0;
 	if (rowIn.containsLabel(MDL_CONTINUOUS_SCALE_X))
 	{
 		old_scaleX = rowIn.getValue<double>(MDL_CONTINUOUS_SCALE_X);
 		old_scaleY = rowIn.getValue<double>(MDL_CONTINUOUS_SCALE_Y);
 		if (rowIn.containsLabel(MDL_CONTINUOUS_SCALE_ANGLE))
 			old_scaleAngle = rowIn.getValue<double>(MDL_CONTINUOUS_SCALE_ANGLE);
-		old_shiftX = rowIn.getValue<double>(MDL_CONTINUOUS_X);
-		old_shiftY = rowIn.getValue<double>(MDL_CONTINUOUS_Y);
-		old_flip = rowIn.getValue<bool>(MDL_CONTINUOUS_FLIP);
+		d.old_shiftX = rowIn.getValue<double>(MDL_CONTINUOUS_X);
+		d.old_shiftY = rowIn.getValue<double>(MDL_CONTINUOUS_Y);
+		d.old_flip = rowIn.getValue<bool>(MDL_CONTINUOUS_FLIP);
 	}
 
 	if (optimizeGrayValues && rowIn.containsLabel(MDL_CONTINUOUS_GRAY_A))
 	{
-		old_grayA = rowIn.getValue<double>(MDL_CONTINUOUS_GRAY_A);
-		old_grayB = rowIn.getValue<double>(MDL_CONTINUOUS_GRAY_B);
+		d.old_grayA = rowIn.getValue<double>(MDL_CONTINUOUS_GRAY_A);
+		d.old_grayB = rowIn.getValue<double>(MDL_CONTINUOUS_GRAY_B);
 	}
 
 	if ((rowIn.containsLabel(MDL_CTF_DEFOCUSU) || rowIn.containsLabel(MDL_CTF_MODEL)) && !ignoreCTF)
 	{
-		hasCTF=true;
-		ctf.readFromMdRow(rowIn);
-		ctf.produceSideInfo();
-		old_defocusU=ctf.DeltafU;
-		old_defocusV=ctf.DeltafV;
-		old_defocusAngle=ctf.azimuthal_angle;
-		updateCTFImage(old_defocusU,old_defocusV,old_defocusAngle);
-		fftTransformer.FourierTransform(Ifiltered(),fftE,false);
-		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(fftE)
-			DIRECT_A2D_ELEM(fftE,i,j)*=DIRECT_A2D_ELEM(*ctfEnvelope,i,j);
-		fftTransformer.inverseFourierTransform();
+		d.hasCTF=true;
+		d.ctf.readFromMdRow(rowIn);
+		d.ctf.produceSideInfo();
+		d.old_defocusU=d.ctf.DeltafU;
+		d.old_defocusV=d.ctf.DeltafV;
+		d.old_defocusAngle=d.ctf.azimuthal_angle;
+		updateCTFImage(d,d.old_defocusU,d.old_defocusV,d.old_defocusAngle);
+		d.ctfEnvelope=ctfCache.getEnvelope(d.ctf,(int)YSIZE(d.I()),(int)XSIZE(d.I()),Ts);
+		d.fftTransformer.FourierTransform(d.Ifiltered(),d.fftE,false);
+		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(d.fftE)
+			DIRECT_A2D_ELEM(d.fftE,i,j)*=DIRECT_A2D_ELEM(*d.ctfEnvelope,i,j);
+		d.fftTransformer.inverseFourierTransform();
 	}
 	else
-		hasCTF=false;
+		d.hasCTF=false;
 
     Matrix1D<double> p(13), steps(13);
     // COSS: Gray values are optimized in transform_image_adjust_gray_values
     if (optimizeGrayValues)
     {
-		p(0)=old_grayA; // a in I'=a*I+b
-		p(1)=old_grayB; // b in I'=a*I+b
+		p(0)=d.old_grayA; // a in I'=a*I+b
+		p(1)=d.old_grayB; // b in I'=a*I+b
     }
     else
     {
@@ -509,25 +512,25 @@ void ProgAngularContinuousAssign2::processImage(const FileName &fnImg, const Fil
 					steps(10)=steps(12)=1.; 
 				else {
 					steps(10)=steps(11)=steps(12)=1.;
-					if (hasCTF)
+					if (d.hasCTF)
 					{
-						currentDefocusU = old_defocusU;
-						currentDefocusV = old_defocusV;
-						currentAngle = old_defocusAngle;
+						d.currentDefocusU = d.old_defocusU;
+						d.currentDefocusV = d.old_defocusV;
+						d.currentAngle = d.old_defocusAngle;
 					}
 					else
-						currentDefocusU = currentDefocusV = currentAngle = 0;
+						d.currentDefocusU = d.currentDefocusV = d.currentAngle = 0;
 				}
 			}
-			powellOptimizer(p, 1, 13, &continuous2cost, this, 0.01, cost, iter, steps, verbose>=2);
+			powellOptimizer(p, 1, 13, &continuous2cost, &d, 0.01, cost, iter, steps, verbose>=2);
 			if (cost>1e30 || (cost>0 && contCost==CONTCOST_CORR))
 			{
 				rowOut.setValue(MDL_ENABLED,-1);
 				p.initZeros();
 				if (optimizeGrayValues)
 				{
-					p(0)=old_grayA; // a in I'=a*I+b
-					p(1)=old_grayB; // b in I'=a*I+b
+					p(0)=d.old_grayA; // a in I'=a*I+b
+					p(1)=d.old_grayB; // b in I'=a*I+b
 				}
 				else
 				{
@@ -541,23 +544,29 @@ void ProgAngularContinuousAssign2::processImage(const FileName &fnImg, const Fil
 			else
 			{
 				//Calculating several similarity measures between P and Ifilteredp (correlations and imed)
-				corrIdx = correlationIndex(P(), Ifilteredp());
-				corrMask = correlationMasked(P(), Ifilteredp());
-				corrWeight = correlationWeighted(P(), Ifilteredp());
-				imedDist = imedDistance(P(), Ifilteredp());
+				corrIdx = correlationIndex(d.P(), d.Ifilteredp());
+				corrMask = correlationMasked(d.P(), d.Ifilteredp());
+				corrWeight = correlationWeighted(d.P(), d.Ifilteredp());
+				imedDist = imedDistance(d.P(), d.Ifilteredp());
 
 				if (fnResiduals!="")
 				{
 					FileName fnResidual;
 					fnResidual.compose(fnImgOut.getPrefixNumber(),fnResiduals);
-					E.write(fnResidual);
+					{
+						std::lock_guard<std::mutex> lock(ioMutex);
+						d.E.write(fnResidual);
+					}
 					rowOut.setValue(MDL_IMAGE_RESIDUAL,fnResidual);
 				}
 				if (fnProjections!="")
 				{
 					FileName fnProjection;
 					fnProjection.compose(fnImgOut.getPrefixNumber(),fnProjections);
-					P.write(fnProjection);
+					{
+						std::lock_guard<std::mutex> lock(ioMutex);
+						d.P.write(fnProjection);
+					}
 					rowOut.setValue(MDL_IMAGE_REF,fnProjection);
 				}
 			}
@@ -570,36 +579,36 @@ void ProgAngularContinuousAssign2::processImage(const FileName &fnImg, const Fil
 			// Apply
 			FileName fnOrig;
 			rowIn.getValue(MDL::str2Label(originalImageLabel),fnOrig);
-			I.read(fnImg);
-			if (XSIZE(Ip())!=XSIZE(I()))
+			d.I.read(fnImg);
+			if (XSIZE(d.Ip())!=XSIZE(d.I()))
 			{
-				scaleToSize(xmipp_transformation::BSPLINE3,Ip(),I(),XSIZE(Ip()),YSIZE(Ip()));
-				I()=Ip();
+				scaleToSize(xmipp_transformation::BSPLINE3,d.Ip(),d.I(),XSIZE(d.Ip()),YSIZE(d.Ip()));
+				d.I()=d.Ip();
 			}
-			A(0,2)=p(2)+old_shiftX;
-			A(1,2)=p(3)+old_shiftY;
+			d.A(0,2)=p(2)+d.old_shiftX;
+			d.A(1,2)=p(3)+d.old_shiftY;
 			double scalex=p(4);
 			double scaley=p(5);
 			double scaleAngle=p(6);
 			double sin2_t=sin(scaleAngle)*sin(scaleAngle);
 			double sin_2t=sin(2*scaleAngle);
-			A(0,0)=1+scalex+(scaley-scalex)*sin2_t;
-			A(0,1)=0.5*(scaley-scalex)*sin_2t;
-			A(1,0)=A(0,1);
-			A(1,1)=1+scaley-(scaley-scalex)*sin2_t;
+			d.A(0,0)=1+scalex+(scaley-scalex)*sin2_t;
+			d.A(0,1)=0.5*(scaley-scalex)*sin_2t;
+			d.A(1,0)=d.A(0,1);
+			d.A(1,1)=1+scaley-(scaley-scalex)*sin2_t;
 //			A(0,0)=1+p(4);
 //			A(1,1)=1+p(5);
 
-			if (old_flip)
+			if (d.old_flip)
 			{
-				MAT_ELEM(A,0,0)*=-1;
-				MAT_ELEM(A,0,1)*=-1;
-				MAT_ELEM(A,0,2)*=-1;
+				MAT_ELEM(d.A,0,0)*=-1;
+				MAT_ELEM(d.A,0,1)*=-1;
+				MAT_ELEM(d.A,0,2)*=-1;
 			}
-			applyGeometry(xmipp_transformation::BSPLINE3,Ip(),I(),A,xmipp_transformation::IS_NOT_INV,xmipp_transformation::DONT_WRAP);
+			applyGeometry(xmipp_transformation::BSPLINE3,d.Ip(),d.I(),d.A,xmipp_transformation::IS_NOT_INV,xmipp_transformation::DONT_WRAP);
 			if (optimizeGrayValues)
 			{
-				MultidimArray<double> &mIp=Ip();
+				MultidimArray<double> &mIp=d.Ip();
 				double ia=1.0/p(0);
 				double b=p(1);
 				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(mIp)
@@ -610,7 +619,10 @@ void ProgAngularContinuousAssign2::processImage(const FileName &fnImg, const Fil
 						DIRECT_MULTIDIM_ELEM(mIp,n)=0.0;
 				}
 			}
-			Ip.write(fnImgOut);
+			{
+				std::lock_guard<std::mutex> lock(ioMutex);
+				d.Ip.write(fnImgOut);
+			}
 		}
 		catch (XmippError &XE)
 		{
@@ -621,9 +633,9 @@ void ProgAngularContinuousAssign2::processImage(const FileName &fnImg, const Fil
 	}
     rowOut.setValue(MDL_IMAGE_ORIGINAL, fnImg);
     rowOut.setValue(MDL_IMAGE, fnImgOut);
-    rowOut.setValue(MDL_ANGLE_ROT,  old_rot+p(7));
-    rowOut.setValue(MDL_ANGLE_TILT, old_tilt+p(8));
-    rowOut.setValue(MDL_ANGLE_PSI,  old_psi+p(9));
+    rowOut.setValue(MDL_ANGLE_ROT,  d.old_rot+p(7));
+    rowOut.setValue(MDL_ANGLE_TILT, d.old_tilt+p(8));
+    rowOut.setValue(MDL_ANGLE_PSI,  d.old_psi+p(9));
     rowOut.setValue(MDL_SHIFT_X,    0.);
     rowOut.setValue(MDL_SHIFT_Y,    0.);
     rowOut.setValue(MDL_FLIP,       false);
@@ -636,22 +648,22 @@ void ProgAngularContinuousAssign2::processImage(const FileName &fnImg, const Fil
     rowOut.setValue(MDL_CONTINUOUS_SCALE_X,p(4));
     rowOut.setValue(MDL_CONTINUOUS_SCALE_Y,p(5));
     rowOut.setValue(MDL_CONTINUOUS_SCALE_ANGLE,p(6));
-    rowOut.setValue(MDL_CONTINUOUS_X,p(2)+old_shiftX);
-    rowOut.setValue(MDL_CONTINUOUS_Y,p(3)+old_shiftY);
-    rowOut.setValue(MDL_CONTINUOUS_FLIP,old_flip);
-    if (hasCTF)
+    rowOut.setValue(MDL_CONTINUOUS_X,p(2)+d.old_shiftX);
+    rowOut.setValue(MDL_CONTINUOUS_Y,p(3)+d.old_shiftY);
+    rowOut.setValue(MDL_CONTINUOUS_FLIP,d.old_flip);
+    if (d.hasCTF)
     {
-    	rowOut.setValue(MDL_CTF_DEFOCUSU,old_defocusU+p(10));
+    	rowOut.setValue(MDL_CTF_DEFOCUSU,d.old_defocusU+p(10));
 		if (sameDefocus)
-    		rowOut.setValue(MDL_CTF_DEFOCUSV,old_defocusU+p(10)); 
+    		rowOut.setValue(MDL_CTF_DEFOCUSV,d.old_defocusU+p(10)); 
 		else
-			rowOut.setValue(MDL_CTF_DEFOCUSV,old_defocusV+p(11));
-    	rowOut.setValue(MDL_CTF_DEFOCUS_ANGLE,old_defocusAngle+p(12));
+			rowOut.setValue(MDL_CTF_DEFOCUSV,d.old_defocusV+p(11));
+    	rowOut.setValue(MDL_CTF_DEFOCUS_ANGLE,d.old_defocusAngle+p(12));
 		if (sameDefocus)
 			rowOut.setValue(MDL_CTF_DEFOCUS_CHANGE,0.5*(p(10)+p(10)));
 		else
 			rowOut.setValue(MDL_CTF_DEFOCUS_CHANGE,0.5*(p(10)+p(11)));
-    	if (old_defocusU+p(10)<0 || old_defocusU+p(11)<0)
+    	if (d.old_defocusU+p(10)<0 || d.old_defocusU+p(11)<0)
     		rowOut.setValue(MDL_ENABLED,-1);
     }
     //Saving correlation and imed values in the metadata
@@ -667,17 +679,17 @@ void ProgAngularContinuousAssign2::processImage(const FileName &fnImg, const Fil
     MDaux.addRow(rowOut);
     MDaux.write("PPPmd.xmd");
     Image<double> save;
-    save()=P();
+    save()=d.P();
     save.write("PPPprojection.xmp");
-    save()=I();
+    save()=d.I();
     save.write("PPPexperimental.xmp");
     //save()=C;
     //save.write("PPPC.xmp");
-    Ip.write("PPPexperimentalp.xmp");
-    Ifiltered.write("PPPexperimentalFiltered.xmp");
-    Ifilteredp.write("PPPexperimentalFilteredp.xmp");
-    E.write("PPPresidual.xmp");
-    std::cout << A << std::endl;
+    d.Ip.write("PPPexperimentalp.xmp");
+    d.Ifiltered.write("PPPexperimentalFiltered.xmp");
+    d.Ifilteredp.write("PPPexperimentalFilteredp.xmp");
+    d.E.write("PPPresidual.xmp");
+    std::cout << d.A << std::endl;
     std::cout << fnImgOut << " rewritten\n";
     std::cout << "Press any key" << std::endl;
     char c; std::cin >> c;
@@ -725,4 +737,6 @@ void ProgAngularContinuousAssign2::postProcess()
 	}
 
 	ptrMdOut.write(fn_out.replaceExtension("xmd"));
+	if (verbose && ctfCache.getHits()+ctfCache.getMisses()>0)
+		ctfCache.printStatistics(std::cout);
 }
@@ -26,11 +26,14 @@
 #ifndef _PROG_ANGULAR_PREDICT_CONTINOUOS2
 #define _PROG_ANGULAR_PREDICT_CONTINUOUS2
 
-#include "core/xmipp_metadata_program.h"
+#include <memory>
+#include <vector>
 #include "core/multidim_array.h"
 #include "core/xmipp_image.h"
+#include "data/ctf_image_cache.h"
 #include "data/fourier_filter.h"
 #include "data/fourier_projection.h"
+#include "threaded_metadata_program.h"
 
 class FourierProjector;
 
@@ -43,7 +46,7 @@ constexpr int  CONTCOST_L1 = 1;
 
 
 /** Predict Continuous Parameters. */
-class ProgAngularContinuousAssign2: public XmippMetadataProgram
+class ProgAngularContinuousAssign2: public ThreadedMetadataProgram
 {
 public:
     /** Filename of the reference volume */
@@ -106,43 +109,57 @@ public:
     FourierProjector *projector;
     // Volume size
     size_t Xdim;
-    // Input image
-	Image<double> I, Ip, E, Ifiltered, Ifilteredp;
-	// Theoretical projection
-	Projection P;
-	// Filter
-    FourierFilter filter;
-    // Transformation matrix
-    Matrix2D<double> A;
-    // Original angles
-    double old_rot, old_tilt, old_psi;
-    // Original shift
-	double old_shiftX, old_shiftY;
-	// Original flip
-	bool old_flip;
-	// Original gray scale
-	double old_grayA, old_grayB;
-	// Has CTF
-	bool hasCTF;
-	// Original defocus
-	double old_defocusU, old_defocusV, old_defocusAngle;
-	// CTF
-	CTFDescription ctf;
-	// Covariance matrices
-	Matrix2D<double> C0, C;
-	// Image stddev
-	double Istddev;
+	// Covariance matrix of the reference
+	Matrix2D<double> C0;
 	// Continuous cost function
 	int contCost;
-	// Current defoci
-	double currentDefocusU, currentDefocusV, currentAngle;
-	// CTF image
-	MultidimArray<double> *ctfImage;
-    std::unique_ptr<MultidimArray<double>> ctfEnvelope;
-	// Fourier Transformer
-	FourierTransformer fftTransformer;
-	// Fourier transforms
-	MultidimArray< std::complex<double> > fftE;
+	// CTF images already generated (particles of a micrograph share the defocus)
+	CTFImageCache<double> ctfCache;
+
+	/// Data modified while processing an image (one per thread)
+	struct ThreadData
+	{
+		// Program whose parameters are used by the cost function
+		ProgAngularContinuousAssign2 *prm;
+		// Input image
+		Image<double> I, Ip, E, Ifiltered, Ifilteredp;
+		// Theoretical projection
+		Projection P;
+		// Filter
+		FourierFilter filter;
+		// Transformation matrix
+		Matrix2D<double> A;
+		// Original angles
+		double old_rot, old_tilt, old_psi;
+		// Original shift
+		double old_shiftX, old_shiftY;
+		// Original flip
+		bool old_flip;
+		// Original gray scale
+		double old_grayA, old_grayB;
+		// Has CTF
+		bool hasCTF;
+		// Original defocus
+		double old_defocusU, old_defocusV, old_defocusAngle;
+		// CTF
+		CTFDescription ctf;
+		// Covariance matrix
+		Matrix2D<double> C;
+		// Image stddev
+		double Istddev;
+		// Current defoci
+		double currentDefocusU, currentDefocusV, currentAngle;
+		// CTF image
+		CTFImageCache<double>::ImagePtr ctfImage;
+		CTFImageCache<double>::ImagePtr ctfEnvelope;
+		// Fourier Transformer
+		FourierTransformer fftTransformer;
+		// Fourier transforms
+		MultidimArray< std::complex<double> > fftE;
+		// Projector sharing the coefficients of the program projector
+		std::unique_ptr<FourierProjector> projector;
+	};
+	std::vector< std::unique_ptr<ThreadData> > threadData;
 public:
     /// Empty constructor
     ProgAngularContinuousAssign2();
@@ -166,13 +183,17 @@ public:
         An exception is thrown if any of the files is not found*/
     void preProcess();
 
+    /// Allocate the data of each thread
+    void prepareThreads(size_t nThreads) override;
+
     /** Predict angles and shift.
         At the input the pose parameters must have an initial guess of the
         parameters. At the output they have the estimated pose.*/
-    void processImage(const FileName &fnImg, const FileName &fnImgOut, const MDRow &rowIn, MDRow &rowOut);
+    void processImageThread(size_t thrId, const FileName &fnImg, const FileName &fnImgOut,
+                            const MDRow &rowIn, MDRow &rowOut) override;
 
     /** Update CTF image */
-    void updateCTFImage(double defocusU, double defocusV, double angle);
+    void updateCTFImage(ThreadData &d, double defocusU, double defocusV, double angle);
 
     /** Post process */
     void postProcess();
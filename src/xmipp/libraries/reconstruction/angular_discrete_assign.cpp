@@ -141,14 +141,6 @@ void ProgAngularDiscreteAssign::preProcess()
     SF_ref.read(fn_ref);
     size_t refYdim, refXdim, refZdim, refNdim;
     getImageSize(SF_ref,refYdim, refXdim, refZdim, refNdim);
-    if (refYdim != NEXT_POWER_OF_2(refYdim) || refXdim != NEXT_POWER_OF_2(refXdim))
-        REPORT_ERROR(ERR_MULTIDIM_SIZE,
-                     "reference images must be of a size that is power of 2");
-
-    // Produce side info of the angular distance computer
-    distance_prm.fn_ang1 = distance_prm.fn_ang2 = "";
-    distance_prm.fn_sym = fn_sym;
-    distance_prm.produce_side_info();
 
     // Read the angle file
     rot.resize(SF_ref.size());
@@ -162,13 +154,61 @@ void ProgAngularDiscreteAssign::preProcess()
     }
 
     // Build mask for subbands
+    produceSubbands(refYdim, refXdim);
+
+    // Produce library
+    produce_library();
+
+    // Save a little space
+    SF_ref.clear();
+}
+
+// Set the references from memory ==========================================
+void ProgAngularDiscreteAssign::setReferences(
+    const std::vector<MultidimArray<double>> &refs,
+    const std::vector<double> &refRot, const std::vector<double> &refTilt)
+{
+    if (refs.empty())
+        REPORT_ERROR(ERR_ARG_MISSING, "There are no reference images");
+    if (refRot.size() != refs.size() || refTilt.size() != refs.size())
+        REPORT_ERROR(ERR_ARG_INCORRECT,
+                     "There must be one rot and tilt angle per reference image");
+    rot = refRot;
+    tilt = refTilt;
+    produceSubbands(YSIZE(refs[0]), XSIZE(refs[0]));
+
+    int number_of_imgs = refs.size();
+    initLibrary(number_of_imgs);
+    MultidimArray<double> I;
+    for (int n = 0; n < number_of_imgs; n++)
+    {
+        library_images.push_back(refs[n]);
+        library_images.back().setXmippOrigin();
+        I = refs[n];
+        I.resetOrigin();
+        addToLibrary(n, I);
+    }
+}
+
+// Subband masks -------------------------------------------------------------
+void ProgAngularDiscreteAssign::produceSubbands(size_t refYdim, size_t refXdim)
+{
+    if (refYdim != NEXT_POWER_OF_2(refYdim) || refXdim != NEXT_POWER_OF_2(refXdim))
+        REPORT_ERROR(ERR_MULTIDIM_SIZE,
+                     "reference images must be of a size that is power of 2");
+
+    // Produce side info of the angular distance computer
+    distance_prm.fn_ang1 = distance_prm.fn_ang2 = "";
+    distance_prm.fn_sym = fn_sym;
+    distance_prm.produce_side_info();
+
     Mask_no.resize(refYdim, refXdim);
     Mask_no.initConstant(-1);
 
     if (smax == -1)
         smax = Get_Max_Scale(refYdim) - 3;
     SBNo = (smax - smin + 1) * 3 + 1;
-    SBsize.resize(SBNo);
+    SBsize.initZeros(SBNo);
 
     Mask Mask(INT_MASK);
     Mask.type = BINARY_DWT_CIRCULAR_MASK;
@@ -198,12 +238,6 @@ void ProgAngularDiscreteAssign::preProcess()
             m++;
         }
     }
-
-    // Produce library
-    produce_library();
-
-    // Save a little space
-    SF_ref.clear();
 }
 
 // PostProcess ---------------------------------------------------------------
@@ -218,15 +252,7 @@ void ProgAngularDiscreteAssign::produce_library()
 {
     Image<double> I;
     int number_of_imgs = SF_ref.size();
-    set_DWT_type(DAUB12);
-
-    // Create space for all the DWT coefficients of the library
-    Matrix1D<int> SBidx(SBNo);
-    for (int m = 0; m < SBNo; m++)
-    {
-        library.emplace_back(number_of_imgs, SBsize(m));
-    }
-    library_power.initZeros(number_of_imgs, SBNo);
+    initLibrary(number_of_imgs);
 
     if (verbose)
     {
@@ -238,22 +264,7 @@ void ProgAngularDiscreteAssign::produce_library()
     {
         I.readApplyGeo(SF_ref, objId);
         library_name.push_back(I.name());
-
-        // Make and distribute its DWT coefficients in the different PCA bins
-        I().statisticsAdjust(0., 1.);
-        DWT(I(), I());
-        SBidx.initZeros();
-        FOR_ALL_ELEMENTS_IN_ARRAY2D(Mask_no)
-        {
-            int m = Mask_no(i, j);
-            if (m != -1)
-            {
-                double coef = I(i, j), coef2 = coef * coef;
-                library[m](n, SBidx(m)++) = coef;
-                for (int mp = m; mp < SBNo; mp++)
-                    library_power(n, mp) += coef2;
-            }
-        }
+        addToLibrary(n, I());
 
         // Prepare for next iteration
         if (++n % nstep == 0 && verbose)
@@ -263,6 +274,49 @@ void ProgAngularDiscreteAssign::produce_library()
         progress_bar(SF_ref.size());
 }
 
+void ProgAngularDiscreteAssign::initLibrary(int number_of_imgs)
+{
+    set_DWT_type(DAUB12);
+
+    // Create space for all the DWT coefficients of the library
+    library.clear();
+    library_name.clear();
+    library_images.clear();
+    for (int m = 0; m < SBNo; m++)
+    {
+        library.emplace_back(number_of_imgs, SBsize(m));
+    }
+    library_power.initZeros(number_of_imgs, SBNo);
+}
+
+void ProgAngularDiscreteAssign::addToLibrary(int n, MultidimArray<double> &I)
+{
+    // Make and distribute its DWT coefficients in the different PCA bins
+    Matrix1D<int> SBidx;
+    SBidx.initZeros(SBNo);
+    I.statisticsAdjust(0., 1.);
+    DWT(I, I);
+    FOR_ALL_ELEMENTS_IN_ARRAY2D(Mask_no)
+    {
+        int m = Mask_no(i, j);
+        if (m != -1)
+        {
+            double coef = A2D_ELEM(I, i, j), coef2 = coef * coef;
+            library[m](n, SBidx(m)++) = coef;
+            for (int mp = m; mp < SBNo; mp++)
+                library_power(n, mp) += coef2;
+        }
+    }
+}
+
+void ProgAngularDiscreteAssign::getLibraryImage(int idx, Image<double> &Iref) const
+{
+    if (library_images.empty())
+        Iref.read(library_name[idx]);
+    else
+        Iref() = library_images[idx];
+}
+
 // Build candidate list ------------------------------------------------------
 void ProgAngularDiscreteAssign::build_ref_candidate_list(const Image<double> &I,
         bool *candidate_list, std::vector<double> &cumulative_corr,
@@ -711,8 +765,24 @@ void ProgAngularDiscreteAssign::processImage(const FileName &fnImg, const FileNa
     if (rowIn.containsLabel(MDL_ANGLE_PSI))
         img.setPsi(-img.psi());
 
-    double best_rot, best_tilt, best_psi, best_shiftX, best_shiftY,
-    best_score = 0, best_rate;
+    double best_rot, best_tilt, best_psi, best_shiftX, best_shiftY;
+    double best_score = assignImage(img, best_rot, best_tilt, best_psi,
+                                    best_shiftX, best_shiftY);
+
+    // Save results
+    rowOut.setValue(MDL_ANGLE_ROT,  best_rot);
+    rowOut.setValue(MDL_ANGLE_TILT, best_tilt);
+    rowOut.setValue(MDL_ANGLE_PSI,  best_psi);
+    rowOut.setValue(MDL_SHIFT_X,    best_shiftX);
+    rowOut.setValue(MDL_SHIFT_Y,    best_shiftY);
+    rowOut.setValue(MDL_MAXCC,      best_score);
+}
+
+double ProgAngularDiscreteAssign::assignImage(Image<double> &img,
+        double &best_rot, double &best_tilt, double &best_psi,
+        double &best_shiftX, double &best_shiftY)
+{
+    double best_score = 0, best_rate;
 
     Image<double> Ip;
     Ip = img;
@@ -833,7 +903,7 @@ void ProgAngularDiscreteAssign::processImage(const FileName &fnImg, const FileNa
                         {
                             Ipsave.write("PPPafter_denoising.xmp");
                             Image<double> Iref;
-                            Iref.read(library_name[best_ref_idx]);
+                            getLibraryImage(best_ref_idx, Iref);
                             Iref.write("PPPref.xmp");
                             std::cerr << "This is index " << vcorr.size() - 1 << std::endl;
                             std::cerr << "corrp=" << corrp << "\nPress any key\n";
@@ -1042,7 +1112,7 @@ void ProgAngularDiscreteAssign::processImage(const FileName &fnImg, const FileNa
         Image<double> Iref;
         //Iref.readApplyGeo(library_name[vref_idx[ibest]]);
         //TODO: Check if this is correct
-        Iref.read(library_name[vref_idx[ibest]]);
+        getLibraryImage(vref_idx[ibest], Iref);
         Iref().setXmippOrigin();
         selfRotate(xmipp_transformation::LINEAR,Iref(),-vpsi[ibest]);
         if (Xoff == 0 && Yoff == 0)
@@ -1088,13 +1158,8 @@ void ProgAngularDiscreteAssign::processImage(const FileName &fnImg, const FileNa
         << " rate= " << best_rate << std::endl << std::endl;
     }
 
-    // Save results
-    rowOut.setValue(MDL_ANGLE_ROT,  best_rot);
-    rowOut.setValue(MDL_ANGLE_TILT, best_tilt);
-    rowOut.setValue(MDL_ANGLE_PSI,  -best_psi);
-    rowOut.setValue(MDL_SHIFT_X,    best_shiftX);
-    rowOut.setValue(MDL_SHIFT_Y,    best_shiftY);
-    rowOut.setValue(MDL_MAXCC,      best_score);
+    best_psi = -best_psi;
+    return best_score;
 }
 #undef DEBUG
 
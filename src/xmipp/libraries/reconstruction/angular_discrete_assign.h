@@ -95,6 +95,8 @@ public:
     std::vector<MultidimArray<double>> library;
     // Vector with all the names of the library images
     std::vector<FileName> library_name;
+    // Library images, only kept when the references are given in memory
+    std::vector<MultidimArray<double>> library_images;
     // Power of the library images at different
     // subbands
     MultidimArray<double> library_power;
@@ -123,9 +125,31 @@ public:
     /** Write output metadata */
     void postProcess();
 
+    /** Set the reference library from images in memory.
+        This is an alternative to preProcess for programs that compute
+        the references themselves. The images must have the same size
+        (a power of 2) and refRot/refTilt the angles of each image. */
+    void setReferences(const std::vector<MultidimArray<double>> &refs,
+                       const std::vector<double> &refRot,
+                       const std::vector<double> &refTilt);
+
+    /** Build the subband masks for references of the given size */
+    void produceSubbands(size_t refYdim, size_t refXdim);
+
     /** Produce library.*/
     void produce_library();
 
+    /** Allocate the library for a number of references */
+    void initLibrary(int number_of_imgs);
+
+    /** Add the DWT coefficients of the n-th reference to the library.
+        The image must have its origin at 0, and it is overwritten with
+        its DWT. */
+    void addToLibrary(int n, MultidimArray<double> &I);
+
+    /** Get a reference image, from memory or from its file */
+    void getLibraryImage(int idx, Image<double> &Iref) const;
+
     /** Build candidate list.
         Build a candidate list with all possible reference projections
         which are not further than the maximum allowed change from
@@ -186,6 +210,14 @@ public:
         it correlates with the whole reference set. */
     void processImage(const FileName &fnImg, const FileName &fnImgOut, const MDRow &rowIn, MDRow &rowOut);
 
+    /** Assign the angles and shift of one image in memory.
+        The initial pose is taken from the header of img (with psi in the
+        internal sign convention, as processImage sets it). The assigned
+        pose is returned with the same convention as in the output
+        metadata, and the function returns the score. */
+    double assignImage(Image<double> &img, double &best_rot, double &best_tilt,
+                       double &best_psi, double &best_shiftX, double &best_shiftY);
+
     /** Finish processing.
         Close all output files. */
 //    void postProcess();
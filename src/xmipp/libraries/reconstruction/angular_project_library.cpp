@@ -24,6 +24,7 @@
  *  e-mail address 'xmipp@cnb.csic.es'
  ***************************************************************************/
 
+#include <algorithm>
 #include "angular_project_library.h"
 #include "core/xmipp_image_generic.h"
 
@@ -94,6 +95,7 @@ void ProgAngularProjectLibrary::readParams()
         FnexperimentalImages = getParam("--experimental_images");
     fn_groups = getParam("--groups");
     only_winner = checkParam("--only_winner");
+    numThreads = getIntParam("--thr");
 }
 
 /* Usage ------------------------------------------------------------------- */
@@ -141,6 +143,7 @@ void ProgAngularProjectLibrary::defineParams()
     addParamsLine("  [--groups <selfile=\"\">]     : selfile with groups");
     addParamsLine("  [--only_winner]               : if set each experimental");
     addParamsLine("                                : point will have a unique neighbor");
+    addParamsLine("  [--thr <N=1>]                 : Number of threads for the neighbour and closest point searches");
 
     addExampleLine("Sample at 2 degrees and use c6 symmetry:", false);
     addExampleLine("xmipp_angular_project_library -i in.vol -o out.stk --sym c6 --sampling_rate 2");
@@ -222,8 +225,43 @@ void ProgAngularProjectLibrary::project_angle_vector (int my_init, int my_end, b
         		                      maxFrequency,
         		                      BSplineDeg);
 
+    // The Fourier projections are computed in blocks of directions
+    const int blockSize=32;
+    std::vector<double> blockRot, blockTilt, blockPsi;
+    MultidimArray<double> blockStack;
+
     for (double mypsi=0;mypsi<360;mypsi += psi_sampling)
     {
+        if (projType == FOURIER)
+        {
+            for (int first=my_init;first<=my_end;first+=blockSize)
+            {
+                int last=std::min(first+blockSize-1,my_end);
+                if (verbose)
+                    progress_bar(first-my_init);
+
+                blockRot.clear();
+                blockTilt.clear();
+                blockPsi.clear();
+                for (int i=first;i<=last;i++)
+                {
+                    blockPsi.push_back(mypsi+ZZ(mysampling.no_redundant_sampling_points_angles[i]));
+                    blockTilt.push_back(      YY(mysampling.no_redundant_sampling_points_angles[i]));
+                    blockRot.push_back(       XX(mysampling.no_redundant_sampling_points_angles[i]));
+                }
+                Vfourier->projectBatch(blockRot, blockTilt, blockPsi, blockStack, nullptr, blockSize);
+
+                for (int i=first;i<=last;i++)
+                {
+                    P().aliasImageInStack(blockStack,i-first);
+                    P.setEulerAngles(blockRot[i-first],blockTilt[i-first],blockPsi[i-first]);
+                    P.setDataMode(_DATA_ALL);
+                    P.write(output_file,(size_t) (numberStepsPsi * i + mypsi +1),true,WRITE_REPLACE);
+                }
+            }
+            continue;
+        }
+
         for (int i=my_init;i<=my_end;i++)
         {
             if (verbose)
@@ -239,8 +277,6 @@ void ProgAngularProjectLibrary::project_angle_vector (int my_init, int my_end, b
 //                projectVolume(inputVol(), P, Ydim, Xdim, rot,tilt,psi);
             if (projType == SHEARS)
                 projectVolume(*Vshears, P, Ydim, Xdim,   rot, tilt, psi);
-            else if (projType == FOURIER)
-                projectVolume(*Vfourier, P, Ydim, Xdim,  rot, tilt, psi);
             else if (projType == REALSPACE)
                 projectVolume(inputVol(), P, Ydim, Xdim, rot, tilt, psi);
 
@@ -262,6 +298,7 @@ void ProgAngularProjectLibrary::run()
     /////////////////////////////
     //only rank 0
 	mysampling.verbose=verbose;
+	mysampling.numThreads=numThreads;
     show();
     //all ranks
     mysampling.setSampling(sampling);
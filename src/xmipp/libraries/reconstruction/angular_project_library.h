@@ -138,6 +138,9 @@ public:
      *  point, the closest */
     bool only_winner;
 
+    /** Number of threads for the neighbour and closest point searches */
+    int numThreads;
+
     /* Volume for shear projection */
     RealShearsInfo *Vshears;
 
@@ -39,6 +39,9 @@
 pthread_mutex_t update_refs_in_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t debug_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Maximum number of references correlated at once by each thread
+constexpr int PAM_REFERENCE_BLOCK = 16;
+
 
 // Read arguments ==========================================================
 void ProgAngularProjectionMatching::readParams()
@@ -196,7 +199,7 @@ void ProgAngularProjectionMatching::run()
 
 void ProgAngularProjectionMatching::destroyAndClean()
 {
-    delete [] fP_ref;
+    refBank.clear();
     delete [] proj_ref;
     delete [] fP_img;
     delete [] fPm_img;
@@ -278,11 +281,7 @@ void ProgAngularProjectionMatching::produceSideInfo()
     P.getPolarFromCartesianBSpline(Maux,Ri,Ro);
     P.calculateFftwPlans(global_plans);
     fourierTransformRings(P,fP,global_plans,false);
-    double memory_per_ref = 0.;
-    for (int i = 0; i < fP.getRingNo(); i++)
-    {
-        memory_per_ref += (double) fP.getSampleNo(i) * 2 * sizeof(double);
-    }
+    double memory_per_ref = PolarFourierBank::bytesPerReference(fP);
     memory_per_ref += dim * dim * sizeof(double);
     max_nr_imgs_in_memory = ROUND( 1024 * 1024 * 1024 * avail_memory / memory_per_ref);
 
@@ -308,12 +307,17 @@ void ProgAngularProjectionMatching::produceSideInfo()
     for (size_t i = 0; i < mysampling.no_redundant_sampling_points_index.size(); i++)
         convert_refno_to_stack_position[mysampling.no_redundant_sampling_points_index[i]] = i;
 
-    // Don't reserve more memory than necessary
+    // Don't reserve more memory than necessary. However, each thread keeps
+    // in use the references of the block it is correlating (see
+    // threadRotationallyAlignOneImage), so that there must be at least two
+    // references per thread for the others to be replaced
     max_nr_refs_in_memory = XMIPP_MIN(max_nr_imgs_in_memory, total_nr_refs);
+    max_nr_refs_in_memory = XMIPP_MAX(max_nr_refs_in_memory, 2 * threads);
 
     // Initialize pointers for reference retrieval
     pointer_allrefs2refsinmem.resize(mysampling.numberSamplesAsymmetricUnit,-1);
     pointer_refsinmem2allrefs.resize(max_nr_refs_in_memory,-1);
+    refsinmem_in_use.resize(max_nr_refs_in_memory,0);
     counter_refs_in_memory = 0;
     loop_forward_refs=true;
 
@@ -349,7 +353,7 @@ void ProgAngularProjectionMatching::produceSideInfo()
     // Initialize all arrays
     try
     {
-        fP_ref = new Polar<std::complex<double> >[max_nr_refs_in_memory];
+        refBank.initialize(fP, P.getSampleNoOuterRing(), max_nr_refs_in_memory);
         proj_ref = new MultidimArray<double>[max_nr_refs_in_memory];
         fP_img = new Polar<std::complex<double> >[nr_trans];
         fPm_img = new Polar<std::complex<double> >[nr_trans];
@@ -405,8 +409,30 @@ void ProgAngularProjectionMatching::produceSideInfo()
     DFexp.findObjects(ids);
 }
 
-void ProgAngularProjectionMatching::getCurrentReference(int refno,
-        Polar_fftw_plans &local_plans)
+int ProgAngularProjectionMatching::pinReference(int refno, Polar_fftw_plans &local_plans)
+{
+    pthread_mutex_lock(  &update_refs_in_memory_mutex );
+    int slot = pointer_allrefs2refsinmem[refno];
+    if (slot != -1)
+        refsinmem_in_use[slot]++;
+    pthread_mutex_unlock(  &update_refs_in_memory_mutex );
+
+    // Reference is not stored in memory (anymore): (re-)read from disc
+    if (slot == -1)
+        slot = getCurrentReference(refno, local_plans, true);
+    return slot;
+}
+
+void ProgAngularProjectionMatching::releaseReferences(const std::vector<size_t> &slots)
+{
+    pthread_mutex_lock(  &update_refs_in_memory_mutex );
+    for (size_t slot : slots)
+        refsinmem_in_use[slot]--;
+    pthread_mutex_unlock(  &update_refs_in_memory_mutex );
+}
+
+int ProgAngularProjectionMatching::getCurrentReference(int refno,
+        Polar_fftw_plans &local_plans, bool pin)
 {
     FileName                      fnt;
     Image<double>                 img;
@@ -489,17 +515,33 @@ void ProgAngularProjectionMatching::getCurrentReference(int refno,
 
     pthread_mutex_lock(  &update_refs_in_memory_mutex );
 
-    int counter = counter_refs_in_memory % max_nr_refs_in_memory;
-    pointer_allrefs2refsinmem[refno] = counter;
-    if (pointer_refsinmem2allrefs[counter] != -1)
+    // Replace the next position that no thread is using
+    int counter = -1;
+    for (int n = 0; n < max_nr_refs_in_memory && counter == -1; n++, counter_refs_in_memory++)
+    {
+        int candidate = counter_refs_in_memory % max_nr_refs_in_memory;
+        if (refsinmem_in_use[candidate] == 0)
+            counter = candidate;
+    }
+    if (counter == -1)
+    {
+        pthread_mutex_unlock(  &update_refs_in_memory_mutex );
+        REPORT_ERROR(ERR_MEM_NOTENOUGH, "All the references in memory are in use");
+    }
+    if (pin)
+        refsinmem_in_use[counter]++;
+    if (pointer_refsinmem2allrefs[counter] != -1 &&
+        pointer_allrefs2refsinmem[pointer_refsinmem2allrefs[counter]] == counter)
     {
         // This position was in use already
         // Images will be overwritten, so reset the
         // pointer_allrefs2refsinmem of the old images to -1
+        // (unless another thread has read them in another position)
         pointer_allrefs2refsinmem[pointer_refsinmem2allrefs[counter]] = -1;
     }
+    pointer_allrefs2refsinmem[refno] = counter;
     pointer_refsinmem2allrefs[counter] = refno;
-    fP_ref[counter] = fP;
+    refBank.set(counter, fP, 1. / stddev); // for normalized ccf
     stddev_ref[counter] = stddev;
     proj_ref[counter] = img();
     //#define DEBUG
@@ -522,9 +564,9 @@ void ProgAngularProjectionMatching::getCurrentReference(int refno,
     std::cerr <<std::endl;
 #endif
 
-    counter_refs_in_memory++;
     pthread_mutex_unlock(  &update_refs_in_memory_mutex );
     //    local_transformer.cleanup();
+    return counter;
 }
 
 void * threadRotationallyAlignOneImage( void * data )
@@ -546,15 +588,12 @@ void * threadRotationallyAlignOneImage( void * data )
 
     // Local variables
     MultidimArray<double>       Maux;
-    MultidimArray<double>       ang, corr;
     MultidimArray<int>       	indxCorr;
     size_t                      myinit, myfinal, myincr;
-    int                         refno;
     bool                        done_once=false;
     double                      mean, stddev;
     Polar<double>               P;
     Polar<std::complex <double> > fP,fPm;
-    RotationalCorrelationAux    rotAux;
     Polar_fftw_plans            local_plans;
     size_t                         imgno = this_image - FIRST_IMAGE;
 
@@ -591,10 +630,9 @@ void * threadRotationallyAlignOneImage( void * data )
         P.getPolarFromCartesianBSpline(Maux,prm->Ri,prm->Ro);
         P.calculateFftwPlans(local_plans);
     }
-    // Prepare FFTW plan for rotational correlation
-    corr.resize(P.getSampleNoOuterRing());
-    rotAux.local_transformer.setReal(corr);
-    rotAux.local_transformer.FourierTransform();
+    // Work space for the correlation of blocks of references
+    size_t realSize = prm->refBank.getRealSize();
+    PolarFourierBankAux bankAux;
 
     // All threads have to wait until the itrans loop is done
     barrier_wait(&(prm->thread_barrier));
@@ -624,95 +662,81 @@ void * threadRotationallyAlignOneImage( void * data )
         myfinal = -1;
         myincr = -1;
     }
+    // The references of a thread are correlated in blocks. The references of
+    // a block are kept in use until it is processed, so that they are not
+    // replaced by the other threads. Blocks are small enough for the
+    // references in use by all threads to be at most half of those in memory
+    size_t blockSize = XMIPP_MAX(1, XMIPP_MIN(PAM_REFERENCE_BLOCK,
+                                              prm->max_nr_refs_in_memory / (2 * (int)thread_num)));
+    std::vector<size_t> block, blockSlots;
+    std::vector<float> blockCorr(2 * prm->nr_trans * blockSize * realSize);
+    MultidimArray<double> allCorr(2 * realSize), allAng(2 * realSize);
+    double Kaux = 360. / realSize;
+    for (size_t k = 0; k < realSize; k++)
+        DIRECT_A1D_ELEM(allAng, k) = DIRECT_A1D_ELEM(allAng, k + realSize) = (double) k * Kaux;
+
     // Loop over all relevant "neighbours" (i.e. directions within the search range)
-    //for (int i = myinit; i != myfinal; i+=myincr)
     for (size_t i = myinit; i != myfinal; i += myincr)
     {
         if (i%thread_num == thread_id)
-        {
+            block.push_back(i);
+        if (block.empty() || (block.size() < blockSize && i + myincr != myfinal))
+            continue;
 
 #ifdef DEBUG_THREADS
-            pthread_mutex_lock(  &debug_mutex );
-            std::cerr<<" thread_id= "<<thread_id<<" i= "<<i<<" "<<myinit<<" "<<myfinal<<" "<<myincr<<std::endl;
-            pthread_mutex_unlock(  &debug_mutex );
+        pthread_mutex_lock(  &debug_mutex );
+        std::cerr<<" thread_id= "<<thread_id<<" i= "<<i<<" "<<myinit<<" "<<myfinal<<" "<<myincr<<std::endl;
+        pthread_mutex_unlock(  &debug_mutex );
 #endif
 
 #ifdef TIMING
 
-            annotate_time(&t1);
+        annotate_time(&t1);
 #endif
-            // Get pointer to the current reference image
-#ifdef DEBUG
-
-            if(prm->mysampling.my_neighbors[imgno][i]==58)
-            {
-                std::cerr << "XXXXpointer_allrefs2refsinmemXXXXXX" <<std::endl;
-                for (std::vector<int>::iterator i = prm->
-                                                    pointer_allrefs2refsinmem.begin();
-                     i != prm->pointer_allrefs2refsinmem.end();
-                     ++i)
-                    std::cerr << *i << std::endl;
-                std::cerr << "XXXXpointer_refsinmem2allrefsXXXXXX" <<std::endl;
-                for (std::vector<int>
-                     ::iterator i = prm->pointer_refsinmem2allrefs.begin();
-                     i != prm->pointer_refsinmem2allrefs.end();
-                     ++i)
-                    std::cerr << *i << std::endl;
-                std::cerr <<std::endl;
-
-            }
-#endif
-
-            refno = prm->pointer_allrefs2refsinmem[prm->mysampling.my_neighbors[imgno][i]];
-            if (refno == -1)
-            {
-                // Reference is not stored in memory (anymore): (re-)read from disc
-                prm->getCurrentReference(prm->mysampling.my_neighbors[imgno][i],local_plans);
-                refno = prm->pointer_allrefs2refsinmem[prm->mysampling.my_neighbors[imgno][i]];
-            }
-
-
+        // Get the references of the block
+        blockSlots.clear();
+        for (size_t ineighbour : block)
+        {
+            size_t neighbour = prm->mysampling.my_neighbors[imgno][ineighbour];
+            blockSlots.push_back(prm->pinReference(neighbour,local_plans));
+        }
 #ifdef TIMING
-            get_refs += elapsed_time(t1);
+        get_refs += elapsed_time(t1);
 #endif
-            //#define DEBUG
-#ifdef DEBUG
 
-            std::cerr << "imgno " << imgno <<std::endl;
-            std::cerr<<"Got refno= "<<refno
-            <<" pointer= "<<prm->mysampling.my_neighbors[imgno][i]<<std::endl;
-#endif
+        // Correlate all 5D-search translations and their mirrors with the
+        // whole block. The polar transforms of the image are reused for all
+        // references, and the normalization of the ccf is done by the bank
+        size_t nblock = block.size();
+        for (size_t itrans = 0; itrans < prm->nr_trans; itrans++)
+        {
+            float *corrStraight = &blockCorr[2 * itrans * nblock * realSize];
+            float *corrMirror = corrStraight + nblock * realSize;
+            double scale = 1. / prm->stddev_img[itrans];
+            prm->refBank.correlate(prm->fP_img[itrans], &blockSlots[0], nblock, scale,
+                                   corrStraight, bankAux);
+            prm->refBank.correlate(prm->fPm_img[itrans], &blockSlots[0], nblock, scale,
+                                   corrMirror, bankAux);
+        }
+        prm->releaseReferences(blockSlots);
 
-            // Loop over all 5D-search translations
+        // Keep the best orientations visiting the references and translations
+        // in the same order as when they were correlated one by one
+        for (size_t iblock = 0; iblock < nblock; iblock++)
+        {
+            int neighbour = prm->mysampling.my_neighbors[imgno][block[iblock]];
             for (size_t itrans = 0; itrans < prm->nr_trans; itrans++)
             {
-#ifdef DEBUG
-
-                std::cerr<< "prm->stddev_ref[refno], prm->stddev_img[itrans]: " <<
-                prm->stddev_ref[refno] << " " <<
-                prm->stddev_img[itrans];
-#endif
-
-                MultidimArray<double>  allCorr, allAng;
-                allCorr.resizeNoCopy(XSIZE(corr)*2);
-                allAng.resizeNoCopy(XSIZE(corr)*2);
-
-                // A. Check straight image
-                rotationalCorrelation(prm->fP_img[itrans],
-                                      prm->fP_ref[refno],
-                                      ang,rotAux);
-                corr /= prm->stddev_ref[refno] * prm->stddev_img[itrans]; // for normalized ccf
-
-
-                memcpy(&dAi(allCorr,0),&dAi(corr,0),XSIZE(corr)*sizeof(double));
-                memcpy(&dAi(allAng,0),&dAi(ang,0),XSIZE(ang)*sizeof(double));
-
-                rotationalCorrelation(prm->fPm_img[itrans],prm->fP_ref[refno],ang,rotAux);
-                corr /= prm->stddev_ref[refno] * prm->stddev_img[itrans]; // for normalized ccf
-                memcpy(&dAi(allCorr,XSIZE(corr)),&dAi(corr,0),XSIZE(corr)*sizeof(double));
-                memcpy(&dAi(allAng,XSIZE(corr)),&dAi(ang,0),XSIZE(corr)*sizeof(double));
+                // A. Straight image, B. Mirrored image
+                const float *corrStraight = &blockCorr[(2 * itrans * nblock + iblock) * realSize];
+                const float *corrMirror = corrStraight + nblock * realSize;
+                for (size_t k = 0; k < realSize; k++)
+                {
+                    DIRECT_A1D_ELEM(allCorr, k) = corrStraight[k];
+                    DIRECT_A1D_ELEM(allCorr, k + realSize) = corrMirror[k];
+                }
 
-                size_t nIter = XMIPP_MIN(thread_data->numOrientations,corr.getSize());
+                size_t nIter = XMIPP_MIN(thread_data->numOrientations,realSize);
                 double bestLastCorr = 99e99;
                 for (size_t n = 0; n < nIter; n++)
                 {
@@ -723,8 +747,8 @@ void * threadRotationallyAlignOneImage( void * data )
                 			maxcorr[n] = DIRECT_A1D_ELEM(allCorr,k);
                 			opt_psi[n] = DIRECT_A1D_ELEM(allAng,k);
                 			//FIXME not sure about FIRST_IMAGE
-                			opt_refno[n] = prm->mysampling.my_neighbors[imgno][i];/*+FIRST_IMAGE;*/
-                			if ( k >= XSIZE(corr))
+                			opt_refno[n] = neighbour;/*+FIRST_IMAGE;*/
+                			if ( k >= realSize)
                 				opt_flip[n] = true;
                 			else
                 				opt_flip[n] = false;
@@ -733,30 +757,11 @@ void * threadRotationallyAlignOneImage( void * data )
 
                 	bestLastCorr = maxcorr[n];
                 }
-
-
-#ifdef DEBUG
-                std::cerr<<"mirror: corr "<<maxcorr;
-                if (opt_flip)
-                    std::cerr<<"**";
-                std::cerr<<std::endl;
-#endif
-#undef DEBUG
-
             }
-            //#define DEBUG
-#ifdef DEBUG
-            std::cerr << "DEBUG_ROB, imgno:" << imgno << std::endl;
-            std::cerr << "DEBUG_ROB, i:" << i << std::endl;
-            std::cerr << "DEBUG_ROB, prm->mysampling.my_neighbors[imgno][i]:" << prm->mysampling.my_neighbors[imgno][i] << std::endl;
-            std::cerr<<"straight: corr "<<maxcorr<<std::endl;
-#endif
-#undef DEBUG
-
         }
+        block.clear();
     }
 
-
 #ifdef TIMING
     float all_rot_align = elapsed_time(t0);
     float total_rot = elapsed_time(t2);
@@ -804,8 +809,7 @@ void ProgAngularProjectionMatching::translationallyAlignOneImage(MultidimArray<d
     if (refno == -1)
     {
         // Reference is not stored in memory (anymore): (re-)read from disc
-        getCurrentReference(opt_refno,global_plans);
-        refno = pointer_allrefs2refsinmem[opt_refno];
+        refno = getCurrentReference(opt_refno,global_plans);
     }
 
     // Rotate stored reference projection by phi degrees
@@ -927,8 +931,7 @@ void ProgAngularProjectionMatching::scaleAlignOneImage(MultidimArray<double> &im
     if (refno == -1)
     {
         // Reference is not stored in memory (anymore): (re-)read from disc
-        getCurrentReference(opt_refno,global_plans);
-        refno = pointer_allrefs2refsinmem[opt_refno];
+        refno = getCurrentReference(opt_refno,global_plans);
     }
     applyGeometry(xmipp_transformation::LINEAR, Mref, proj_ref[refno], A, xmipp_transformation::IS_NOT_INV, xmipp_transformation::DONT_WRAP);
 
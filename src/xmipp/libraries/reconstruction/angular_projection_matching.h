@@ -32,6 +32,7 @@
 #include "core/xmipp_program.h"
 #include "core/xmipp_threads.h"
 #include "data/polar.h"
+#include "data/polar_fourier_bank.h"
 #include "data/sampling.h"
 
 template<typename T>
@@ -96,12 +97,17 @@ public:
     /** Pointers for reference retrieval */
     std::vector<int> pointer_allrefs2refsinmem;   //order after removing redundant
     std::vector<int> pointer_refsinmem2allrefs;   //order in memory
+    /** Number of threads using each reference in memory.
+        A reference in use is not replaced by getCurrentReference */
+    std::vector<int> refsinmem_in_use;
     /** Vector to assign reference number to stack positions*/
     std::vector <size_t> convert_refno_to_stack_position;
     /** Array containing the images ids in metadata */
     std::vector<size_t> ids;
-    /** Array with Polars of references and of translated images and their mirrors */
-    Polar<std::complex<double> >   *fP_ref, *fP_img, *fPm_img;
+    /** FTs of the polar rings of the references in memory (conjugated) */
+    PolarFourierBank refBank;
+    /** Array with Polars of translated images and their mirrors */
+    Polar<std::complex<double> >   *fP_img, *fPm_img;
     /** Array with reference images */
     MultidimArray<double> *proj_ref;
     /** Global plans for fftw transformers of all polar rings */
@@ -179,8 +185,18 @@ public:
 
     /** Get pointer to the current reference image
       If this image wasn't stored in memory yet, read it from disc and
-      store FT of the polar transform as well as the original image */
-    void getCurrentReference(int refno, Polar_fftw_plans &local_plans);
+      store FT of the polar transform as well as the original image.
+      Returns its position in memory. If pin is true, the reference is
+      marked as in use, and it must be released with releaseReferences */
+    int getCurrentReference(int refno, Polar_fftw_plans &local_plans, bool pin=false);
+
+    /** Position in memory of a reference, marked as in use.
+      The reference is read if it is not in memory, and it is not replaced
+      until it is released with releaseReferences */
+    int pinReference(int refno, Polar_fftw_plans &local_plans);
+
+    /** Release the references in memory marked as in use by pinReference */
+    void releaseReferences(const std::vector<size_t> &slots);
 
     /** Get images to process.
      * This function will return the id's of images to process.
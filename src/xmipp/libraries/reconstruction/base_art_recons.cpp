@@ -23,7 +23,9 @@
  *  e-mail address 'xmipp@cnb.csic.es'
  ***************************************************************************/
 
+#include <exception>
 #include <fstream>
+#include <future>
 #include "base_art_recons.h"
 #include "core/xmipp_threads.h"
 #include "core/metadata_vec.h"
@@ -40,6 +42,36 @@ void ARTReconsBase::readParams(XmippProgram * program)
 void ARTReconsBase::preProcess(GridVolume &vol_basis0, int level, int rank)
 {
     artPrm.produceSideInfo(vol_basis0, level, rank);
+
+    if (artPrm.useTaskPool)
+    {
+        // All the projections of a block must correct the same volume
+        bool simultaneous = artPrm.parallel_mode == BasicARTParameters::SIRT ||
+                            artPrm.parallel_mode == BasicARTParameters::pSIRT ||
+                            artPrm.parallel_mode == BasicARTParameters::pfSIRT ||
+                            artPrm.parallel_mode == BasicARTParameters::pSART ||
+                            artPrm.parallel_mode == BasicARTParameters::pCAV ||
+                            artPrm.parallel_mode == BasicARTParameters::pBiCAV ||
+                            artPrm.eq_mode == CAV;
+        if (!simultaneous || !concurrentSingleSteps())
+            REPORT_ERROR(ERR_ARG_INCORRECT, "ARTReconsBase::preProcess: --taskPool is only available "
+                         "for single particles with SIRT, pSIRT, pfSIRT, pSART, pCAV, pBiCAV or CAV");
+        // and no step may depend on the previous ones
+        bool sparseEachStep = artPrm.sparseEps > 0 &&
+                              artPrm.parallel_mode != BasicARTParameters::SIRT &&
+                              artPrm.parallel_mode != BasicARTParameters::pSIRT &&
+                              artPrm.parallel_mode != BasicARTParameters::pfSIRT;
+        if (artPrm.WLS || artPrm.noisy_reconstruction || artPrm.variability_analysis ||
+            POCSClass::isActive(&artPrm) || artPrm.diffusionWeight > -1 || sparseEachStep ||
+            artPrm.refine || artPrm.print_system_matrix || artPrm.stop_at != 0 ||
+            (artPrm.tell & (TELL_MANUAL_ORDER | TELL_ONLY_SYM | TELL_SAVE_AT_EACH_STEP |
+                            TELL_SAVE_INTERMIDIATE | TELL_IV | TELL_STATS)))
+            REPORT_ERROR(ERR_ARG_INCORRECT, "ARTReconsBase::preProcess: --taskPool is not compatible with "
+                         "WLS, noisy reconstructions, variability analysis, POCS constraints, diffusion, "
+                         "sparsity, refinement, --stop_at and the debugging options");
+        if (artPrm.threads > 1)
+            threadPool = std::make_unique<ctpl::thread_pool>(artPrm.threads);
+    }
 }
 
 void ARTReconsBase::iterations(GridVolume &vol_basis, int rank)
@@ -165,7 +197,11 @@ void ARTReconsBase::iterations(GridVolume &vol_basis, int rank)
         }
 
         // For each projection -----------------------------------------------
-        for (int act_proj = 0; act_proj < artPrm.numIMG ; act_proj++)
+        // (with the task pool all of them are processed at once)
+        if (threadPool)
+            poolSingleSteps(vol_basis, ptr_vol_out, ART_numIMG, artPrm.lambda(it),
+                            images, global_mean_error);
+        for (int act_proj = 0; act_proj < artPrm.numIMG && !threadPool; act_proj++)
         {
             POCS.newProjection();
 
@@ -793,13 +829,154 @@ void ARTReconsBase::applySymmetry(GridVolume &vol_in, GridVolume *vol_out,int gr
 }
 
 
+void ARTReconsBase::poolSingleSteps(GridVolume &vol_in, GridVolume *vol_out, int numIMG,
+                                    double lambda, int &images, double &global_mean_error)
+{
+    // Empty correction volume for each thread
+    int nThreads = artPrm.threads;
+    poolWork.resize(nThreads);
+    for (auto &work : poolWork)
+    {
+        bool sameShape = work.correction.VolumesNo() == vol_out->VolumesNo();
+        for (size_t j = 0; sameShape && j < vol_out->VolumesNo(); j++)
+            sameShape = work.correction(j)().sameShape((*vol_out)(j)());
+        if (!sameShape)
+            work.correction = *vol_out;
+        work.correction.initZeros();
+    }
+
+    std::vector<double> mean_error(artPrm.numIMG, 0.);
+    std::vector<double> tilt(artPrm.numIMG, 0.);
+    std::vector<char> skipped(artPrm.numIMG, 0);
+    int firstImage = images;
+    auto step = [&](int thrId, int act_proj)
+    {
+        ARTThreadWork &work = poolWork[thrId];
+        ReconsInfo &imgInfo = artPrm.IMG_Inf[artPrm.ordered_list(act_proj)];
+        Projection &read_proj = work.read_proj;
+
+        read_proj.read(imgInfo.fn_proj, artPrm.apply_shifts, DATA, &imgInfo.row);
+        read_proj().setXmippOrigin();
+        read_proj.setEulerAngles(imgInfo.rot, imgInfo.tilt, imgInfo.psi);
+
+        //skipping if  tilt greater than max_tilt
+        //tilt is in between 0 and 360
+        double aux_tilt = tilt[act_proj] = read_proj.tilt();
+        if((aux_tilt > artPrm.max_tilt && aux_tilt < 180.-artPrm.max_tilt) ||
+           (aux_tilt > artPrm.max_tilt + 180 && aux_tilt < 360.-artPrm.max_tilt))
+        {
+            skipped[act_proj] = 1;
+            return;
+        }
+
+        // Projection extension? .........................................
+        if (artPrm.proj_ext!=0)
+            read_proj().selfWindow(
+                STARTINGY (read_proj())-artPrm.proj_ext,
+                STARTINGX (read_proj())-artPrm.proj_ext,
+                FINISHINGY(read_proj())+artPrm.proj_ext,
+                FINISHINGX(read_proj())+artPrm.proj_ext);
+
+        // Is there a mask ...............................................
+        const MultidimArray<int> *maskPtr=nullptr;
+        if (artPrm.goldmask<1e6 || artPrm.shiftedTomograms)
+        {
+            MultidimArray<int> &mask = work.mask;
+            mask.resize(read_proj());
+            FOR_ALL_ELEMENTS_IN_ARRAY2D(read_proj())
+            {
+                mask(i,j)=1;
+                if ((read_proj(i,j)<artPrm.goldmask && artPrm.goldmask<1e6) ||
+                    (ABS(read_proj(i,j))<1e-5 && artPrm.shiftedTomograms))
+                    mask(i,j)=0;
+            }
+            maskPtr=&mask;
+        }
+
+        singleStep(vol_in, &work.correction,
+                   work.theo_proj, read_proj, imgInfo.sym, work.diff_proj,
+                   work.corr_proj, work.alig_proj,
+                   mean_error[act_proj], numIMG, lambda,
+                   firstImage + act_proj, imgInfo.fn_ctf, maskPtr,
+                   false);
+    };
+
+    std::vector<std::future<void>> futures;
+    futures.reserve(artPrm.numIMG);
+    for (int act_proj = 0; act_proj < artPrm.numIMG; act_proj++)
+        futures.emplace_back(threadPool->push(step, act_proj));
+
+    // Report the projections in order as they are finished
+    std::exception_ptr error;
+    for (int act_proj = 0; act_proj < artPrm.numIMG; act_proj++)
+    {
+        try
+        {
+            futures[act_proj].get();
+        }
+        catch (...)
+        {
+            if (!error)
+                error = std::current_exception();
+        }
+        if (error)
+            continue;
+
+        int iact_proj = artPrm.ordered_list(act_proj);
+        const ReconsInfo &imgInfo = artPrm.IMG_Inf[iact_proj];
+        if (skipped[act_proj])
+        {
+            std::cout << "Skipping Proj no: " << iact_proj
+            << "tilt=" << tilt[act_proj]  << std::endl;
+            continue;
+        }
+        global_mean_error += mean_error[act_proj];
+        *artPrm.fh_hist << imgInfo.fn_proj << ", sym="
+        << imgInfo.sym << "\t\t" << mean_error[act_proj] << std::endl;
+        if (artPrm.tell&TELL_SHOW_ERROR)
+            std::cout << imgInfo.fn_proj << ", sym="
+            << imgInfo.sym << "\t\t" << mean_error[act_proj] << std::endl;
+        else if (act_proj%XMIPP_MAX(1,artPrm.numIMG/60)==0)
+            progress_bar(act_proj);
+        ++images;
+    }
+    // Wait for all the tasks before reporting an error, they use this frame
+    if (error)
+        std::rethrow_exception(error);
+
+    // Add the corrections of all threads to the output volume, each thread
+    // sums a range of voxels
+    for (size_t j = 0; j < vol_out->VolumesNo(); j++)
+    {
+        MultidimArray<double> &out = (*vol_out)(j)();
+        size_t size = MULTIDIM_SIZE(out);
+        std::vector<std::future<void>> sums;
+        for (int t = 0; t < nThreads; t++)
+            sums.emplace_back(threadPool->push([&, j, t](int)
+            {
+                size_t first = size * t / nThreads;
+                size_t last = size * (t + 1) / nThreads;
+                double *ptrOut = MULTIDIM_ARRAY(out);
+                for (auto &work : poolWork)
+                {
+                    const double *ptrIn = MULTIDIM_ARRAY(work.correction(j)());
+                    for (size_t n = first; n < last; n++)
+                        ptrOut[n] += ptrIn[n];
+                }
+            }));
+        for (auto &f : sums)
+            f.get();
+    }
+}
+
+
 void SinPartARTRecons::preProcess(GridVolume & vol_basis0, int level, int rank)
 {
     ARTReconsBase::preProcess(vol_basis0, level, rank);
 
     // As this is a threaded implementation, create structures for threads, and
-    // create threads
-    if( artPrm.threads > 1 )
+    // create threads (the task pool does not need them)
+    if( artPrm.threads > 1 && !artPrm.useTaskPool )
     {
         th_ids = (pthread_t *)malloc( artPrm.threads * sizeof( pthread_t));
 
@@ -901,7 +1078,7 @@ void SinPartARTRecons::singleStep(GridVolume &vol_in, GridVolume *vol_out,
     project_GridVolume(vol_in, artPrm.basis, theo_proj,
                        corr_proj, YSIZE(read_proj()), XSIZE(read_proj()),
                        read_proj.rot(), read_proj.tilt(), read_proj.psi(), FORWARD, artPrm.eq_mode,
-                       artPrm.GVNeq, A, maskPtr, artPrm.ray_length, artPrm.threads);
+                       artPrm.GVNeq, A, maskPtr, artPrm.ray_length, projectionThreads());
 
     if (fn_ctf != "" && artPrm.unmatched)
     {
@@ -1011,7 +1188,7 @@ void SinPartARTRecons::singleStep(GridVolume &vol_in, GridVolume *vol_out,
     project_GridVolume(*vol_out, artPrm.basis, theo_proj,
                        corr_proj, YSIZE(read_proj()), XSIZE(read_proj()),
                        read_proj.rot(), read_proj.tilt(), read_proj.psi(), BACKWARD, artPrm.eq_mode,
-                       artPrm.GVNeq, nullptr, maskPtr, artPrm.ray_length, artPrm.threads);
+                       artPrm.GVNeq, nullptr, maskPtr, artPrm.ray_length, projectionThreads());
 
     // Remove footprints if necessary
     if (remove_footprints)
@@ -1028,7 +1205,7 @@ void SinPartARTRecons::postProcess(GridVolume & vol_basis)
     // are "slept" waiting for a barrier to be reached by the master thread to continue
     // projecting/backprojecting a new projection. Here we set the flag destroy=true so
     // the threads won't process a projections but will return.
-    if( artPrm.threads > 1 )
+    if( artPrm.threads > 1 && !artPrm.useTaskPool )
     {
         for( int c = 0 ; c < artPrm.threads ; c++ )
         {
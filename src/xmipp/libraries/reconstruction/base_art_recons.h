@@ -27,7 +27,11 @@
 #ifndef BASE_ART_RECONS_H_
 #define BASE_ART_RECONS_H_
 
+#include <memory>
+#include <vector>
+#include "CTPL/ctpl_stl.h"
 #include "basic_art.h"
+#include "data/projection.h"
 
 /**@defgroup common ART Reconstruction stuff
    @ingroup ReconsLibrary
@@ -41,6 +45,19 @@
 */
 //@{
 
+/** Work space of a thread of the ART task pool.
+    Each thread backprojects the corrections of its projections into its
+    own volume, which is added to the output volume at the end of the block. */
+struct ARTThreadWork
+{
+    /// Sum of the corrections of the projections processed by this thread
+    GridVolume correction;
+    /// Projections used by singleStep
+    Projection read_proj, theo_proj, alig_proj, corr_proj, diff_proj;
+    /// Mask of the valid pixels of the projection
+    MultidimArray<int> mask;
+};
+
 /* ART Reconstruction  ------------------------------------------ */
 /** ART Base Reconstruction.
     This class contains all the basic routines needed about the ART reconstruction
@@ -139,6 +156,33 @@ public:
 
     friend std::ostream & operator<< (std::ostream &o, const ARTReconsBase& artRecons);
 
+protected:
+    /** True if singleStep may run concurrently for different projections.
+        The input volume is shared and each call has its own output volume
+        and projections. */
+    virtual bool concurrentSingleSteps() const
+    {
+        return false;
+    }
+
+    /// Threads for the projection of each image (1 with the task pool)
+    int projectionThreads() const
+    {
+        return artPrm.useTaskPool ? 1 : artPrm.threads;
+    }
+
+    /** Run singleStep for all the projections of a block with the task pool.
+        The projections are those of one pass of iterations (artPrm.numIMG
+        projections of artPrm.ordered_list). All of them are compared with
+        vol_in, and the sum of their corrections is added to vol_out. The
+        errors are reported in the order of the projections. */
+    void poolSingleSteps(GridVolume &vol_in, GridVolume *vol_out, int numIMG,
+                         double lambda, int &images, double &global_mean_error);
+
+    /// Task pool (only with artPrm.useTaskPool)
+    std::unique_ptr<ctpl::thread_pool> threadPool;
+    /// Work space of each thread of the pool
+    std::vector<ARTThreadWork> poolWork;
 };
 
 
@@ -165,6 +209,12 @@ public:
                             bool refine);
 
     void postProcess(GridVolume &vol_basis);
+
+protected:
+    bool concurrentSingleSteps() const override
+    {
+        return true;
+    }
 }
 ;
 
@@ -110,6 +110,7 @@ void BasicARTParameters::defaultValues()
     fn_control         = "";
 
     threads            = 1;
+    useTaskPool        = false;
 }
 
 void BasicARTParameters::defineParams(XmippProgram * program, bool mpiMode)
@@ -219,7 +220,9 @@ void BasicARTParameters::defineParams(XmippProgram * program, bool mpiMode)
 
     program->addParamsLine(" ==+ Parallel parameters == ");
     program->addParamsLine(" : by default, sequential ART is applied");
-    program->addParamsLine("   [--thr <N=1>]               : Number of threads to use. NOTE: Not available when using MPI.");
+    program->addParamsLine("   [--thr <N=1>]               : Number of threads to use. NOTE: With MPI, only with --taskPool.");
+    program->addParamsLine("   [--taskPool]                : Each thread processes whole projections of each block instead of");
+    program->addParamsLine("                               : sharing every projection. Only for SIRT, pSIRT, pfSIRT, pSART, pCAV, pBiCAV and CAV");
     program->addParamsLine("   [--parallel_mode <mode=ART>]: Parallelization algorithm to use with threads or MPI program version");
     program->addParamsLine("        where <mode>");
     program->addParamsLine("               ART             : Default");
@@ -379,6 +382,7 @@ void BasicARTParameters::readParams(XmippProgram * program)
 
     // Parallel parameters
     threads = program->getIntParam("--thr");
+    useTaskPool = program->checkParam("--taskPool");
 
     tempString = program->getParam("--parallel_mode");
 
@@ -263,9 +263,18 @@ public:
     /// Only for internal purposes, MUST be set when running MPI.
     bool using_MPI;
 
-    /// Number of threads to use. Can not be different than 1 when using MPI.
+    /** Number of threads to use.
+        By default the threads share the projection and backprojection of
+        each image. With the MPI version they require useTaskPool. */
     int threads;
 
+    /** The threads process different projections of each block.
+        Only for the simultaneous modes (SIRT, pSIRT, pfSIRT, pSART, pCAV,
+        pBiCAV and CAV), where all the projections of a block correct the
+        same volume. Each thread backprojects into its own correction volume
+        and the corrections are added at the end of the block. */
+    bool useTaskPool;
+
 #define TELL_IV                    0x100
 #define TELL_ONLY_SYM              0x80
 #define TELL_USE_INPUT_BASISVOLUME 0x40
@@ -315,6 +315,29 @@ void ProgCTFEstimateFromPSD::produceSideInfo()
 
     ProgCTFBasicParams::produceSideInfo();
     current_ctfmodel.precomputeValues(x_contfreq, y_contfreq);
+    evaluationReduction = 0;
+}
+
+/* Frequencies evaluated by the fitness ------------------------------------ */
+void ProgCTFEstimateFromPSD::buildEvaluationList()
+{
+    evaluationFreqs.clear();
+    evaluationIdx.clear();
+    int XdimW=XSIZE(w_digfreq);
+    int YdimW=YSIZE(w_digfreq);
+    for (int i = 0; i < YdimW; i += evaluation_reduction)
+        for (int j = 0; j < XdimW; j += evaluation_reduction)
+        {
+            if (DIRECT_A2D_ELEM(mask, i, j) <= 0)
+                continue;
+            evaluationFreqs.add(DIRECT_A2D_ELEM(x_contfreq, i, j),
+                                DIRECT_A2D_ELEM(y_contfreq, i, j));
+            evaluationIdx.push_back(i * XdimW + j);
+        }
+    evaluationBg.resize(evaluationIdx.size());
+    evaluationEnvelope.resize(evaluationIdx.size());
+    evaluationCtf.resize(evaluationIdx.size());
+    evaluationReduction = evaluation_reduction;
 }
 
 /* Generate model so far ---------------------------------------------------- */
@@ -327,6 +350,8 @@ void ProgCTFEstimateFromPSD::generateModelSoFar(Image<double> &I, bool apply_log
                             0, ALL_CTF_PARAMETERS, modelSimplification);
     current_ctfmodel.produceSideInfo();
     I().initZeros(*f);
+    CTFFrequencyList freqs;
+    std::vector<std::pair<int, int> > pixels;
     FOR_ALL_ELEMENTS_IN_ARRAY2D(I())
     {
         XX(idx) = j;
@@ -336,26 +361,26 @@ void ProgCTFEstimateFromPSD::generateModelSoFar(Image<double> &I, bool apply_log
         if (w>max_freq_psd)
         	continue;
         digfreq2contfreq(freq, freq, Tm);
+        freqs.add(XX(freq), YY(freq));
+        pixels.emplace_back(i, j);
+    }
 
+    std::vector<double> bg(freqs.size()), E(freqs.size()), ctfNoDamping(freqs.size());
+    current_ctfmodel.getValuesAt(freqs, bg.data(), E.data(), ctfNoDamping.data());
+    for (size_t k = 0; k < pixels.size(); ++k)
+    {
+        int i = pixels[k].first;
+        int j = pixels[k].second;
         // Decide what to save
-        current_ctfmodel.precomputeValues(XX(freq), YY(freq));
+        double ctf = -E[k] * ctfNoDamping[k]; // as getValuePureAt
         if (action <= 1)
-            I()(i, j) = current_ctfmodel.getValueNoiseAt();
+            I()(i, j) = bg[k];
         else if (action == 2)
-        {
-            double E = current_ctfmodel.getValueDampingAt();
-            I()(i, j) = current_ctfmodel.getValueNoiseAt() + E * E;
-        }
+            I()(i, j) = bg[k] + E[k] * E[k];
         else if (action >= 3 && action <= 6)
-        {
-            double ctf = current_ctfmodel.getValuePureAt();
-            I()(i, j) = current_ctfmodel.getValueNoiseAt() + ctf * ctf;
-        }
+            I()(i, j) = bg[k] + ctf * ctf;
         else
-        {
-            double ctf = current_ctfmodel.getValuePureAt();
             I()(i, j) = ctf;
-        }
         if (apply_log)
             I()(i, j) = 10 * log10(I()(i, j));
     }
@@ -745,18 +770,21 @@ double ProgCTFEstimateFromPSD::CTF_fitness_object(double *p)
     double upperLimit = 0.9 * max_freq_psd;
     const MultidimArray<double>& local_enhanced_ctf = enhanced_ctftomodel();
     int XdimW=XSIZE(w_digfreq);
-    int YdimW=YSIZE(w_digfreq);
     corr13=0;
 
-    for (int i = 0; i < YdimW; i += evaluation_reduction)
-        for (int j = 0; j < XdimW; j += evaluation_reduction)
-        {
-            if (DIRECT_A2D_ELEM(mask, i, j) <= 0)
-                continue;
+    // Compute each component at all frequencies of the mask at once
+    if (evaluationReduction != evaluation_reduction)
+        buildEvaluationList();
+    current_ctfmodel.getValuesAt(evaluationFreqs, evaluationBg.data(),
+                                 (action >= 2) ? evaluationEnvelope.data() : nullptr,
+                                 (action >= 3) ? evaluationCtf.data() : nullptr);
 
-            // Compute each component
-            current_ctfmodel.precomputeValues(i, j);
-            double bg = current_ctfmodel.getValueNoiseAt();
+    for (size_t k = 0; k < evaluationIdx.size(); ++k)
+        {
+            size_t n = evaluationIdx[k]; // w_digfreq and masks have the same size
+            int i = n / XdimW;
+            int j = n % XdimW;
+            double bg = evaluationBg[k];
             double envelope=0, ctf_without_damping, ctf_with_damping=0;
             double ctf2_th=0;
             double ctf2 = DIRECT_A2D_ELEM(*f, i, j);
@@ -769,16 +797,16 @@ double ProgCTFEstimateFromPSD::CTF_fitness_object(double *p)
                 ctf2_th = bg;
                 dist = fabs(ctf2 - bg);
 				if (penalize && bg > ctf2
-					&& DIRECT_A2D_ELEM(w_digfreq, i, j)
+					&& DIRECT_MULTIDIM_ELEM(w_digfreq, n)
 					> max_gauss_freq)
 					dist *= current_penalty;
                 break;
             case 2:
-                envelope = current_ctfmodel.getValueDampingAt();
+                envelope = evaluationEnvelope[k];
                 ctf2_th = bg + envelope * envelope;
                 dist = fabs(ctf2 - ctf2_th);
 				if (penalize && ctf2_th < ctf2
-					&& DIRECT_A2D_ELEM(w_digfreq, i, j)
+					&& DIRECT_MULTIDIM_ELEM(w_digfreq, n)
 					> max_gauss_freq)
 					dist *= current_penalty;
                 break;
@@ -787,21 +815,20 @@ double ProgCTFEstimateFromPSD::CTF_fitness_object(double *p)
             case 5:
             case 6:
             case 7:
-                envelope = current_ctfmodel.getValueDampingAt();
-                ctf_without_damping =
-                		current_ctfmodel.getValuePureWithoutDampingAt();
+                envelope = evaluationEnvelope[k];
+                ctf_without_damping = evaluationCtf[k];
                 ctf_with_damping = envelope * ctf_without_damping;
                 ctf2_th = bg + ctf_with_damping * ctf_with_damping;
 
-                if (DIRECT_A2D_ELEM(w_digfreq,i, j) < upperLimit
-                                    && DIRECT_A2D_ELEM(w_digfreq,i, j) > lowerLimit)
+                if (DIRECT_MULTIDIM_ELEM(w_digfreq, n) < upperLimit
+                                    && DIRECT_MULTIDIM_ELEM(w_digfreq, n) > lowerLimit)
 				{
 					if  (action == 3 ||
-						 (action == 4 && DIRECT_A2D_ELEM(mask_between_zeroes,i,j) == 1) ||
-						 (action == 7 && DIRECT_A2D_ELEM(mask_between_zeroes,i,j) == 1))
+						 (action == 4 && DIRECT_MULTIDIM_ELEM(mask_between_zeroes, n) == 1) ||
+						 (action == 7 && DIRECT_MULTIDIM_ELEM(mask_between_zeroes, n) == 1))
 					{
 						double enhanced_ctf =
-							DIRECT_A2D_ELEM(local_enhanced_ctf, i, j);
+							DIRECT_MULTIDIM_ELEM(local_enhanced_ctf, n);
 						ctf_with_damping2 = ctf_with_damping * ctf_with_damping;
 						enhanced_model += enhanced_ctf * ctf_with_damping2;
 						enhanced2 += enhanced_ctf * enhanced_ctf;
@@ -834,7 +861,7 @@ double ProgCTFEstimateFromPSD::CTF_fitness_object(double *p)
                 break;
             }
 
-            distsum += dist * DIRECT_A2D_ELEM(mask,i,j);
+            distsum += dist * DIRECT_MULTIDIM_ELEM(mask, n);
             N++;
         }
 
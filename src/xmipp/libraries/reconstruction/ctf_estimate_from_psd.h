@@ -120,6 +120,19 @@ public:
                                  double kV, double lambdaPhase, int sizeWindowPhase,
                                  double &defocusU, double &defocusV, double &ellipseAngle, int verbose);
     void estimate_defoci_Zernike();
+
+private:
+    /** Collect the frequencies of the mask evaluated by CTF_fitness_object
+        for the current evaluation_reduction */
+    void buildEvaluationList();
+
+    // Frequencies evaluated by the fitness and their index in w_digfreq
+    CTFFrequencyList evaluationFreqs;
+    std::vector<size_t> evaluationIdx;
+    // evaluation_reduction of the list, 0 if it has to be built
+    int evaluationReduction = 0;
+    // Model values at the evaluated frequencies
+    std::vector<double> evaluationBg, evaluationEnvelope, evaluationCtf;
 };
 
 double evaluateIceness(const MultidimArray<double> &enhanced_ctftomodel, double Tm);
@@ -198,6 +198,24 @@ void ProgCTFEstimateFromPSDFast::produceSideInfo()
 
     ProgCTFBasicParams::produceSideInfo();
     current_ctfmodel.precomputeValues(x_contfreq);
+    evaluationIdx.clear();
+}
+
+/* Frequencies evaluated by the fitness ------------------------------------ */
+void ProgCTFEstimateFromPSDFast::buildEvaluationList_fast()
+{
+    evaluationFreqs.clear();
+    evaluationIdx.clear();
+    FOR_ALL_ELEMENTS_IN_ARRAY1D(w_digfreq)
+    {
+        if (DIRECT_A1D_ELEM(mask, i) <= 0)
+            continue;
+        evaluationFreqs.add(DIRECT_A1D_ELEM(x_contfreq, i));
+        evaluationIdx.push_back(i);
+    }
+    evaluationBg.resize(evaluationIdx.size());
+    evaluationEnvelope.resize(evaluationIdx.size());
+    evaluationCtf.resize(evaluationIdx.size());
 }
 
 void ProgCTFEstimateFromPSDFast::generateModelSoFar_fast(MultidimArray<double> &I, bool apply_log = false)
@@ -422,14 +440,16 @@ double ProgCTFEstimateFromPSDFast::CTF_fitness_object_fast(double *p)
     const MultidimArray<double>& local_enhanced_ctf = psd_exp_enhanced_radial;
     int XdimW=XSIZE(w_digfreq);
     corr13=0;
-    FOR_ALL_ELEMENTS_IN_ARRAY1D(w_digfreq)
+    // Compute each component at all frequencies of the mask at once
+    if (evaluationIdx.empty())
+        buildEvaluationList_fast();
+    current_ctfmodel.getValuesAt(evaluationFreqs, evaluationBg.data(),
+                                 (action >= 2) ? evaluationEnvelope.data() : nullptr,
+                                 (action >= 3) ? evaluationCtf.data() : nullptr);
+    for (size_t k = 0; k < evaluationIdx.size(); ++k)
     {
-		if (DIRECT_A1D_ELEM(mask, i) <= 0)
-			continue;
-
-		// Compute each component
-		current_ctfmodel.precomputeValues(i);
-		double bg = current_ctfmodel.getValueNoiseAt();
+		int i = evaluationIdx[k];
+		double bg = evaluationBg[k];
 
 		double envelope=0, ctf_without_damping, ctf_with_damping=0, current_envelope = 0;
 		double ctf2_th=0;
@@ -446,7 +466,7 @@ double ProgCTFEstimateFromPSDFast::CTF_fitness_object_fast(double *p)
 				dist *= current_penalty;
 			break;
 		case 2:
-			envelope = current_ctfmodel.getValueDampingAt();
+			envelope = evaluationEnvelope[k];
 			ctf2_th = bg + envelope * envelope;
 			dist = fabs(ctf2 - ctf2_th);
 			if (penalize && ctf2_th < ctf2 && DIRECT_A1D_ELEM(w_digfreq, i)	> max_gauss_freq)
@@ -457,8 +477,8 @@ double ProgCTFEstimateFromPSDFast::CTF_fitness_object_fast(double *p)
 		case 5:
 		case 6:
 		case 7:
-			envelope = current_ctfmodel.getValueDampingAt();
-			ctf_without_damping = current_ctfmodel.getValuePureWithoutDampingAt();
+			envelope = evaluationEnvelope[k];
+			ctf_without_damping = evaluationCtf[k];
 
 			ctf_with_damping = envelope * ctf_without_damping;
 			ctf2_th = bg + ctf_with_damping * ctf_with_damping;
@@ -100,6 +100,15 @@ public:
 	void showFirstDefoci_fast();
 	void estimate_defoci_fast();
 
+private:
+	/** Collect the frequencies of the mask evaluated by CTF_fitness_object_fast */
+	void buildEvaluationList_fast();
+
+	// Frequencies evaluated by the fitness and their index in w_digfreq
+	CTFFrequencyList evaluationFreqs;
+	std::vector<size_t> evaluationIdx;
+	// Model values at the evaluated frequencies
+	std::vector<double> evaluationBg, evaluationEnvelope, evaluationCtf;
 };
 
 /** Core of the Adjust CTF routine.
@@ -156,6 +156,7 @@ void ProgFlexibleAlignment::preProcess() {
 	MetaDataVec SF(fnModeList);
 	numberOfModes = SF.size();
 	SF.getColumnValues(MDL_NMA_MODEFILE, modeList);
+	nmaDeformer.read(fnPDB, fnModeList);
 
 	// Get the size of the images in the selfile
 	imgSize = xdimOut;
@@ -172,18 +173,11 @@ void ProgFlexibleAlignment::finishProcessing() {
 
 // Create deformed PDB =====================================================
 FileName ProgFlexibleAlignment::createDeformedPDB() const {
-	String program;
-	String arguments;
 	FileName fnRandom;
 	fnRandom.initUniqueName(nameTemplate, fnOutDir);
-	const char *randStr = fnRandom.c_str();
-	program = "xmipp_pdb_nma_deform";
-	arguments = formatString(
-			"--pdb %s -o %s_deformedPDB.pdb --nma %s --deformations ",
-			fnPDB.c_str(), randStr, fnModeList.c_str());
-	for (size_t i = 5; i < VEC_XSIZE(trial); i++)
-		arguments += floatToString(trial(i)) + " ";
-	runSystem(program, arguments, false);
+	PDBRichPhantom deformedPDB;
+	nmaDeformer.deform(&VEC_ELEM(trial, 5), VEC_XSIZE(trial) - 5, deformedPDB);
+	deformedPDB.write(fnRandom + "_deformedPDB.pdb");
 
 	return fnRandom;
 }
@@ -210,23 +204,17 @@ void ProjectionRefencePoint(Matrix1D<double> &Parameters, int dim, double *R,
 		global_flexible_prog->trial(i) = Parameters(i);
 	}
 	std::string command;
-	String program;
-	String arguments;
 	FileName fnRandom;
 	fnRandom.initUniqueName(global_flexible_prog->nameTemplate,
 			global_flexible_prog->fnOutDir);
 	const char *randStr = fnRandom.c_str();
 
-	program = "xmipp_pdb_nma_deform";
-	arguments = formatString(
-			"--pdb %s -o %s_deformedPDB.pdb --nma %s --deformations ",
-			global_flexible_prog->fnPDB.c_str(), randStr,
-			global_flexible_prog->fnModeList.c_str());
-	for (size_t i = 5; i < VEC_XSIZE(global_flexible_prog->trial); i++) {
-		float aaa = global_flexible_prog->scdefamp * Parameters(i);
-		arguments += floatToString(aaa) + " ";
-	}
-	runSystem(program, arguments, false);
+	std::vector<double> amplitudes;
+	for (size_t i = 5; i < VEC_XSIZE(global_flexible_prog->trial); i++)
+		amplitudes.push_back(global_flexible_prog->scdefamp * Parameters(i));
+	PDBRichPhantom deformedPDB;
+	global_flexible_prog->nmaDeformer.deform(amplitudes.data(), amplitudes.size(), deformedPDB);
+	deformedPDB.write(fnRandom + "_deformedPDB.pdb");
 
 	String deformed_pdb = formatString("%s_deformedPDB.pdb", randStr);
 	centre_Xwidth = double(Xwidth - 1) / 2.0;
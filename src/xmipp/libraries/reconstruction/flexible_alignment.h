@@ -29,6 +29,7 @@
 #include "core/rerunable_program.h"
 #include "core/matrix1d.h"
 #include "core/metadata_vec.h"
+#include "pdb_nma_deform.h"
 
 /**@defgroup NMAAlignment Alignment with Normal modes
    @ingroup ReconsLibrary */
@@ -155,6 +156,9 @@ public:
     //File name of reduced image
     FileName fnDown;
 
+    // Reference structure and normal modes
+    NMADeformer nmaDeformer;
+
 public:
     /// Empty constructor
     ProgFlexibleAlignment();
@@ -37,7 +37,6 @@ ProgForwardZernikeImages::ProgForwardZernikeImages() : Rerunable("")
 	resume = false;
     produces_a_metadata = true;
     each_image_produces_an_output = false;
-    showOptimization = false;
 }
 
 ProgForwardZernikeImages::~ProgForwardZernikeImages() = default;
@@ -45,7 +44,7 @@ ProgForwardZernikeImages::~ProgForwardZernikeImages() = default;
 // Read arguments ==========================================================
 void ProgForwardZernikeImages::readParams()
 {
-	XmippMetadataProgram::readParams();
+	ThreadedMetadataProgram::readParams();
 	fnVolR = getParam("--ref");
 	fnMaskR = getParam("--mask");
 	fnOutDir = getParam("--odir");
@@ -109,7 +108,7 @@ void ProgForwardZernikeImages::defineParams()
 	defaultComments["-i"].addComment("Metadata with initial alignment");
 	defaultComments["-o"].clear();
 	defaultComments["-o"].addComment("Metadata with the angular alignment and deformation parameters");
-    XmippMetadataProgram::defineParams();
+    ThreadedMetadataProgram::defineParams();
     addParamsLine("   --ref <volume>              : Reference volume");
 	addParamsLine("  [--mask <m=\"\">]            : Reference volume");
 	addParamsLine("  [--odir <outputDir=\".\">]   : Output directory");
@@ -160,37 +159,9 @@ void ProgForwardZernikeImages::preProcess()
 		}
 	}
 
-	// Preallocate vectors (Size depends on image number)
-	fnImage.resize(num_images, "");
-	I.resize(num_images); Ifiltered.resize(num_images); Ifilteredp.resize(num_images);
-	P.resize(num_images);
-	old_rot.resize(num_images, 0.); old_tilt.resize(num_images, 0.); old_psi.resize(num_images, 0.);
-	deltaRot.resize(num_images, 0.); deltaTilt.resize(num_images, 0.); deltaPsi.resize(num_images, 0.);
-	old_shiftX.resize(num_images, 0.); old_shiftY.resize(num_images, 0.);
-	deltaX.resize(num_images, 0.); deltaY.resize(num_images, 0.);
-	old_defocusU.resize(num_images, 0.); old_defocusV.resize(num_images, 0.); old_defocusAngle.resize(num_images, 0.);
-	deltaDefocusU.resize(num_images, 0.); deltaDefocusV.resize(num_images, 0.); deltaDefocusAngle.resize(num_images, 0.);
-	currentDefocusU.resize(num_images, 0.); currentDefocusV.resize(num_images, 0.); currentAngle.resize(num_images, 0.);
-
-	switch (num_images)
-	{
-	case 2:
-		Ifilteredp[0]().initZeros(Xdim,Xdim); Ifilteredp[1]().initZeros(Xdim,Xdim);
-    	Ifilteredp[0]().setXmippOrigin(); Ifilteredp[1]().setXmippOrigin();
-		P[0]().initZeros(Xdim,Xdim); P[1]().initZeros(Xdim,Xdim);
-		break;
-	case 3:
-		Ifilteredp[0]().initZeros(Xdim,Xdim); Ifilteredp[1]().initZeros(Xdim,Xdim); Ifilteredp[2]().initZeros(Xdim,Xdim);
-    	Ifilteredp[0]().setXmippOrigin(); Ifilteredp[1]().setXmippOrigin(); Ifilteredp[2]().setXmippOrigin();
-		P[0]().initZeros(Xdim,Xdim); P[1]().initZeros(Xdim,Xdim); P[2]().initZeros(Xdim,Xdim);
-		break;
-	
-	default:
-		Ifilteredp[0]().initZeros(Xdim,Xdim);
-    	Ifilteredp[0]().setXmippOrigin();
-		P[0]().initZeros(Xdim,Xdim);
-		break;
-	}
+	// Number of parameters to minimize
+	algn_params = num_images * 5;
+	ctf_params = num_images * 3;
 
 	if (RmaxDef<0)
 		RmaxDef = Xdim/2;
@@ -245,30 +216,10 @@ void ProgForwardZernikeImages::preProcess()
     mask.generate_mask(Xdim,Xdim);
     mask2D=mask.get_binary_mask();
 
-    // Low pass filter
-    filter.FilterBand=LOWPASS;
-    filter.w1=Ts/maxResol;
-    filter.raised_w=0.02;
 	filterp.FilterBand=LOWPASS;
 	filterp.FilterShape=REALGAUSSIAN;
     filterp.w1=1;
 
-    // Transformation matrix
-    A1.initIdentity(3);
-	A2.initIdentity(3);
-	A3.initIdentity(3);
-
-	// CTF Filter
-	FilterCTF1.FilterBand = CTF;
-	FilterCTF1.ctf.enable_CTFnoise = false;
-	FilterCTF1.ctf.produceSideInfo();
-	FilterCTF2.FilterBand = CTF;
-	FilterCTF2.ctf.enable_CTFnoise = false;
-	FilterCTF2.ctf.produceSideInfo();
-	FilterCTF3.FilterBand = CTF;
-	FilterCTF3.ctf.enable_CTFnoise = false;
-	FilterCTF3.ctf.produceSideInfo();
-
 	vecSize = 0;
 	numCoefficients(L1,L2,vecSize);
     fillVectorTerms(L1,L2,vL1,vN,vL2,vM);
@@ -282,36 +233,87 @@ void ProgForwardZernikeImages::preProcess()
 
 }
 
+void ProgForwardZernikeImages::prepareThreads(size_t nThreads)
+{
+	threadData.resize(nThreads);
+	for (auto &d : threadData)
+	{
+		d = std::make_unique<ThreadData>();
+		d->prm = this;
+
+		// Preallocate vectors (Size depends on image number)
+		d->fnImage.resize(num_images, "");
+		d->I.resize(num_images); d->Ifiltered.resize(num_images); d->Ifilteredp.resize(num_images);
+		d->P.resize(num_images);
+		d->old_rot.resize(num_images, 0.); d->old_tilt.resize(num_images, 0.); d->old_psi.resize(num_images, 0.);
+		d->deltaRot.resize(num_images, 0.); d->deltaTilt.resize(num_images, 0.); d->deltaPsi.resize(num_images, 0.);
+		d->old_shiftX.resize(num_images, 0.); d->old_shiftY.resize(num_images, 0.);
+		d->deltaX.resize(num_images, 0.); d->deltaY.resize(num_images, 0.);
+		d->old_defocusU.resize(num_images, 0.); d->old_defocusV.resize(num_images, 0.); d->old_defocusAngle.resize(num_images, 0.);
+		d->deltaDefocusU.resize(num_images, 0.); d->deltaDefocusV.resize(num_images, 0.); d->deltaDefocusAngle.resize(num_images, 0.);
+		d->currentDefocusU.resize(num_images, 0.); d->currentDefocusV.resize(num_images, 0.); d->currentAngle.resize(num_images, 0.);
+		for (int n = 0; n < num_images; n++)
+		{
+			d->Ifilteredp[n]().initZeros(Xdim,Xdim);
+			d->Ifilteredp[n]().setXmippOrigin();
+			d->P[n]().initZeros(Xdim,Xdim);
+		}
+
+		// Low pass filter
+		d->filter.FilterBand=LOWPASS;
+		d->filter.w1=Ts/maxResol;
+		d->filter.raised_w=0.02;
+
+		// Transformation matrix
+		d->A1.initIdentity(3);
+		d->A2.initIdentity(3);
+		d->A3.initIdentity(3);
+
+		// CTF Filter
+		d->FilterCTF1.FilterBand = CTF;
+		d->FilterCTF1.ctf.enable_CTFnoise = false;
+		d->FilterCTF1.ctf.produceSideInfo();
+		d->FilterCTF2.FilterBand = CTF;
+		d->FilterCTF2.ctf.enable_CTFnoise = false;
+		d->FilterCTF2.ctf.produceSideInfo();
+		d->FilterCTF3.FilterBand = CTF;
+		d->FilterCTF3.ctf.enable_CTFnoise = false;
+		d->FilterCTF3.ctf.produceSideInfo();
+	}
+}
+
 void ProgForwardZernikeImages::finishProcessing() {
 	XmippMetadataProgram::finishProcessing();
+	if (verbose && ctfCache.getHits()+ctfCache.getMisses()>0)
+		ctfCache.printStatistics(std::cout);
 	rename(Rerunable::getFileName().c_str(), (fnOutDir + fn_out).c_str());
 }
 
 // #define DEBUG
-double ProgForwardZernikeImages::transformImageSph(double *pclnm)
+double ProgForwardZernikeImages::transformImageSph(ThreadData &d, double *pclnm)
 {
 	const MultidimArray<double> &mV=V();
-	idx_z_clnm.clear();
-	z_clnm_diff.clear();
-	FOR_ALL_ELEMENTS_IN_MATRIX1D(clnm)
+	d.idx_z_clnm.clear();
+	d.z_clnm_diff.clear();
+	FOR_ALL_ELEMENTS_IN_MATRIX1D(d.clnm)
 	{
-		VEC_ELEM(clnm,i)=pclnm[i+1];
-		if (VEC_ELEM(clnm,i) != VEC_ELEM(prev_clnm,i))
+		VEC_ELEM(d.clnm,i)=pclnm[i+1];
+		if (VEC_ELEM(d.clnm,i) != VEC_ELEM(d.prev_clnm,i))
 		{
-			idx_z_clnm.push_back(i);
-			z_clnm_diff.push_back(VEC_ELEM(clnm, i) - VEC_ELEM(prev_clnm, i));
+			d.idx_z_clnm.push_back(i);
+			d.z_clnm_diff.push_back(VEC_ELEM(d.clnm, i) - VEC_ELEM(d.prev_clnm, i));
 		}
 	}
 	// std::cout << std::endl;
 	double deformation=0.0;
-	totalDeformation=0.0;
+	d.totalDeformation=0.0;
 
-	P[0]().initZeros(Xdim,Xdim);
-	P[0]().setXmippOrigin();
-	double currentRot=old_rot[0] + deltaRot[0];
-	double currentTilt=old_tilt[0] + deltaTilt[0];
-	double currentPsi=old_psi[0] + deltaPsi[0];
-	deformVol(P[0](), mV, deformation, currentRot, currentTilt, currentPsi);
+	d.P[0]().initZeros(Xdim,Xdim);
+	d.P[0]().setXmippOrigin();
+	double currentRot=d.old_rot[0] + d.deltaRot[0];
+	double currentTilt=d.old_tilt[0] + d.deltaTilt[0];
+	double currentPsi=d.old_psi[0] + d.deltaPsi[0];
+	deformVol(d, d.P[0](), mV, deformation, currentRot, currentTilt, currentPsi);
 
 	double cost=0.0;
 	const MultidimArray<int> &mMask2D=mask2D;
@@ -322,110 +324,106 @@ double ProgForwardZernikeImages::transformImageSph(double *pclnm)
 	{
 	case 2:
 	{
-		P[1]().initZeros(Xdim,Xdim);
-		P[1]().setXmippOrigin();
-		currentRot = old_rot[1] + deltaRot[1];
-		currentTilt = old_tilt[1] + deltaTilt[1];
-		currentPsi = old_psi[1] + deltaPsi[1];
-		deformVol(P[1](), mV, deformation, currentRot, currentTilt, currentPsi);
-
-		if (old_flip)
+		d.P[1]().initZeros(Xdim,Xdim);
+		d.P[1]().setXmippOrigin();
+		currentRot = d.old_rot[1] + d.deltaRot[1];
+		currentTilt = d.old_tilt[1] + d.deltaTilt[1];
+		currentPsi = d.old_psi[1] + d.deltaPsi[1];
+		deformVol(d, d.P[1](), mV, deformation, currentRot, currentTilt, currentPsi);
+
+		if (d.old_flip)
 		{
-			MAT_ELEM(A1, 0, 0) *= -1;
-			MAT_ELEM(A1, 0, 1) *= -1;
-			MAT_ELEM(A1, 0, 2) *= -1;
-			MAT_ELEM(A2, 0, 0) *= -1;
-			MAT_ELEM(A2, 0, 1) *= -1;
-			MAT_ELEM(A2, 0, 2) *= -1;
+			MAT_ELEM(d.A1, 0, 0) *= -1;
+			MAT_ELEM(d.A1, 0, 1) *= -1;
+			MAT_ELEM(d.A1, 0, 2) *= -1;
+			MAT_ELEM(d.A2, 0, 0) *= -1;
+			MAT_ELEM(d.A2, 0, 1) *= -1;
+			MAT_ELEM(d.A2, 0, 2) *= -1;
 		}
-		applyGeometry(xmipp_transformation::LINEAR, Ifilteredp[0](), Ifiltered[0](), A1, 
+		applyGeometry(xmipp_transformation::LINEAR, d.Ifilteredp[0](), d.Ifiltered[0](), d.A1, 
 					  xmipp_transformation::IS_NOT_INV, xmipp_transformation::DONT_WRAP, 0.);
-		applyGeometry(xmipp_transformation::LINEAR, Ifilteredp[1](), Ifiltered[1](), A2, 
+		applyGeometry(xmipp_transformation::LINEAR, d.Ifilteredp[1](), d.Ifiltered[1](), d.A2, 
 					  xmipp_transformation::IS_NOT_INV, xmipp_transformation::DONT_WRAP, 0.);
 		// filter.applyMaskSpace(P[1]());
-		const MultidimArray<double> mP2 = P[1]();
-		MultidimArray<double> &mI2filteredp = Ifilteredp[1]();
+		const MultidimArray<double> mP2 = d.P[1]();
+		MultidimArray<double> &mI2filteredp = d.Ifilteredp[1]();
 		corr2 = correlationIndex(mI2filteredp, mP2, &mMask2D);
 	}
 		break;
 
 	case 3:
 	{
-		P[1]().initZeros(Xdim,Xdim);
-		P[1]().setXmippOrigin();
-		currentRot = old_rot[1] + deltaRot[1];
-		currentTilt = old_tilt[1] + deltaTilt[1];
-		currentPsi = old_psi[1] + deltaPsi[1];
-		deformVol(P[1](), mV, deformation, currentRot, currentTilt, currentPsi);
-
-		P[2]().initZeros(Xdim,Xdim);
-		P[2]().setXmippOrigin();
-		currentRot = old_rot[2] + deltaRot[2];
-		currentTilt = old_tilt[2] + deltaTilt[2];
-		currentPsi = old_psi[2] + deltaPsi[2];
-		deformVol(P[2](), mV, deformation, currentRot, currentTilt, currentPsi);
-
-		if (old_flip)
+		d.P[1]().initZeros(Xdim,Xdim);
+		d.P[1]().setXmippOrigin();
+		currentRot = d.old_rot[1] + d.deltaRot[1];
+		currentTilt = d.old_tilt[1] + d.deltaTilt[1];
+		currentPsi = d.old_psi[1] + d.deltaPsi[1];
+		deformVol(d, d.P[1](), mV, deformation, currentRot, currentTilt, currentPsi);
+
+		d.P[2]().initZeros(Xdim,Xdim);
+		d.P[2]().setXmippOrigin();
+		currentRot = d.old_rot[2] + d.deltaRot[2];
+		currentTilt = d.old_tilt[2] + d.deltaTilt[2];
+		currentPsi = d.old_psi[2] + d.deltaPsi[2];
+		deformVol(d, d.P[2](), mV, deformation, currentRot, currentTilt, currentPsi);
+
+		if (d.old_flip)
 		{
-			MAT_ELEM(A1, 0, 0) *= -1;
-			MAT_ELEM(A1, 0, 1) *= -1;
-			MAT_ELEM(A1, 0, 2) *= -1;
-			MAT_ELEM(A2, 0, 0) *= -1;
-			MAT_ELEM(A2, 0, 1) *= -1;
-			MAT_ELEM(A2, 0, 2) *= -1;
-			MAT_ELEM(A3, 0, 0) *= -1;
-			MAT_ELEM(A3, 0, 1) *= -1;
-			MAT_ELEM(A3, 0, 2) *= -1;
+			MAT_ELEM(d.A1, 0, 0) *= -1;
+			MAT_ELEM(d.A1, 0, 1) *= -1;
+			MAT_ELEM(d.A1, 0, 2) *= -1;
+			MAT_ELEM(d.A2, 0, 0) *= -1;
+			MAT_ELEM(d.A2, 0, 1) *= -1;
+			MAT_ELEM(d.A2, 0, 2) *= -1;
+			MAT_ELEM(d.A3, 0, 0) *= -1;
+			MAT_ELEM(d.A3, 0, 1) *= -1;
+			MAT_ELEM(d.A3, 0, 2) *= -1;
 		}
-		applyGeometry(xmipp_transformation::LINEAR, Ifilteredp[0](), Ifiltered[0](), A1, 
+		applyGeometry(xmipp_transformation::LINEAR, d.Ifilteredp[0](), d.Ifiltered[0](), d.A1, 
 					  xmipp_transformation::IS_NOT_INV, xmipp_transformation::DONT_WRAP, 0.);
-		applyGeometry(xmipp_transformation::LINEAR, Ifilteredp[1](), Ifiltered[1](), A2, 
+		applyGeometry(xmipp_transformation::LINEAR, d.Ifilteredp[1](), d.Ifiltered[1](), d.A2, 
 				      xmipp_transformation::IS_NOT_INV, xmipp_transformation::DONT_WRAP, 0.);
-		applyGeometry(xmipp_transformation::LINEAR, Ifilteredp[2](), Ifiltered[2](), A3, 
+		applyGeometry(xmipp_transformation::LINEAR, d.Ifilteredp[2](), d.Ifiltered[2](), d.A3, 
 					  xmipp_transformation::IS_NOT_INV, xmipp_transformation::DONT_WRAP, 0.);
 		// filter.applyMaskSpace(P[1]());
 		// filter.applyMaskSpace(P[2]());
-		const MultidimArray<double> mP2 = P[1]();
-		const MultidimArray<double> mP3 = P[2]();
-		MultidimArray<double> &mI2filteredp = Ifilteredp[1]();
-		MultidimArray<double> &mI3filteredp = Ifilteredp[2]();
+		const MultidimArray<double> mP2 = d.P[1]();
+		const MultidimArray<double> mP3 = d.P[2]();
+		MultidimArray<double> &mI2filteredp = d.Ifilteredp[1]();
+		MultidimArray<double> &mI3filteredp = d.Ifilteredp[2]();
 		corr2 = correlationIndex(mI2filteredp, mP2, &mMask2D);
 		corr3 = correlationIndex(mI3filteredp, mP3, &mMask2D);
 	}
 		break;
 	
 	default:
-		if (old_flip)
+		if (d.old_flip)
 		{
-			MAT_ELEM(A1, 0, 0) *= -1;
-			MAT_ELEM(A1, 0, 1) *= -1;
-			MAT_ELEM(A1, 0, 2) *= -1;
+			MAT_ELEM(d.A1, 0, 0) *= -1;
+			MAT_ELEM(d.A1, 0, 1) *= -1;
+			MAT_ELEM(d.A1, 0, 2) *= -1;
 		}
-		applyGeometry(xmipp_transformation::LINEAR,Ifilteredp[0](),Ifiltered[0](),A1,
+		applyGeometry(xmipp_transformation::LINEAR,d.Ifilteredp[0](),d.Ifiltered[0](),d.A1,
 					  xmipp_transformation::IS_NOT_INV,xmipp_transformation::DONT_WRAP,0.);
 		break;
 	}
 
-	filter.generateMask(P[0]());
-	filter.applyMaskSpace(P[0]());
-	if (hasCTF)
+	d.filter.generateMask(d.P[0]());
+	d.filter.applyMaskSpace(d.P[0]());
+	if (d.hasCTF)
     {
-    	double defocusU=old_defocusU[0]+deltaDefocusU[0];
-    	double defocusV=old_defocusV[0]+deltaDefocusV[0];
-    	double angle=old_defocusAngle[0]+deltaDefocusAngle[0];
-    	if (defocusU!=currentDefocusU[0] || defocusV!=currentDefocusV[0] || angle!=currentAngle[0]) {
-    		updateCTFImage(defocusU,defocusV,angle);
+    	double defocusU=d.old_defocusU[0]+d.deltaDefocusU[0];
+    	double defocusV=d.old_defocusV[0]+d.deltaDefocusV[0];
+    	double angle=d.old_defocusAngle[0]+d.deltaDefocusAngle[0];
+    	if (defocusU!=d.currentDefocusU[0] || defocusV!=d.currentDefocusV[0] || angle!=d.currentAngle[0] || d.ctfMask==nullptr) {
+    		updateCTFImage(d, defocusU,defocusV,angle);
 		}
-		// FilterCTF1.ctf = ctf;
-		FilterCTF1.generateMask(P[0]());
-		if (phaseFlipped)
-			FilterCTF1.correctPhase();
-		FilterCTF1.applyMaskSpace(P[0]());
+		d.FilterCTF1.applyMaskSpace(d.P[0](), *d.ctfMask);
 	}
 
 
-	const MultidimArray<double> mP1=P[0]();
-	MultidimArray<double> &mI1filteredp=Ifilteredp[0]();
+	const MultidimArray<double> mP1=d.P[0]();
+	MultidimArray<double> &mI1filteredp=d.Ifilteredp[0]();
 	double corr1=correlationIndex(mI1filteredp,mP1,&mMask2D);
 
 	switch (num_images)
@@ -444,11 +442,11 @@ double ProgForwardZernikeImages::transformImageSph(double *pclnm)
 #ifdef DEBUG
 	std::cout << "A=" << A << std::endl;
 	Image<double> save;
-	save()=P();
+	save()=d.P();
 	save.write("PPPtheo.xmp");
-	save()=Ifilteredp();
+	save()=d.Ifilteredp();
 	save.write("PPPfilteredp.xmp");
-	save()=Ifiltered();
+	save()=d.Ifiltered();
 	save.write("PPPfiltered.xmp");
 	// Vdeformed.write("PPPVdeformed.vol");
 	std::cout << "Cost=" << cost << " deformation=" << deformation << std::endl;
@@ -456,47 +454,47 @@ double ProgForwardZernikeImages::transformImageSph(double *pclnm)
 	char c; std::cin >> c;
 #endif
 
-   if (showOptimization)
+   if (d.showOptimization)
    {
-		std::cout << "A1=" << A1 << std::endl;
+		std::cout << "A1=" << d.A1 << std::endl;
 		Image<double> save;
-		save()=P[0]();
+		save()=d.P[0]();
 		save.write("PPPtheo1.xmp");
-		save()=Ifilteredp[0]();
+		save()=d.Ifilteredp[0]();
 		save.write("PPPfilteredp1.xmp");
-		save()=Ifiltered[0]();
+		save()=d.Ifiltered[0]();
 		save.write("PPPfiltered1.xmp");
 
 		switch (num_images)
 		{
 			case 2:
 			{
-				std::cout << "A2=" << A2 << std::endl;
-				save()=P[1]();
+				std::cout << "A2=" << d.A2 << std::endl;
+				save()=d.P[1]();
 				save.write("PPPtheo2.xmp");
-				save()=Ifilteredp[1]();
+				save()=d.Ifilteredp[1]();
 				save.write("PPPfilteredp2.xmp");
-				save()=Ifiltered[1]();
+				save()=d.Ifiltered[1]();
 				save.write("PPPfiltered2.xmp");
 			}
 				break;
 
 			case 3:
 			{
-				std::cout << "A2=" << A2 << std::endl;
-				save()=P[1]();
+				std::cout << "A2=" << d.A2 << std::endl;
+				save()=d.P[1]();
 				save.write("PPPtheo2.xmp");
-				save()=Ifilteredp[1]();
+				save()=d.Ifilteredp[1]();
 				save.write("PPPfilteredp2.xmp");
-				save()=Ifiltered[1]();
+				save()=d.Ifiltered[1]();
 				save.write("PPPfiltered2.xmp");
 
-				std::cout << "A3=" << A3 << std::endl;
-				save()=P[2]();
+				std::cout << "A3=" << d.A3 << std::endl;
+				save()=d.P[2]();
 				save.write("PPPtheo3.xmp");
-				save()=Ifilteredp[2]();
+				save()=d.Ifilteredp[2]();
 				save.write("PPPfilteredp3.xmp");
-				save()=Ifiltered[2]();
+				save()=d.Ifiltered[2]();
 				save.write("PPPfiltered3.xmp");
 			}
 				break;
@@ -505,254 +503,256 @@ double ProgForwardZernikeImages::transformImageSph(double *pclnm)
 				break;
 		}
 		Vdeformed.write("PPPVdeformed.vol");
-		std::cout << "Deformation=" << totalDeformation << std::endl;
+		std::cout << "Deformation=" << d.totalDeformation << std::endl;
 		std::cout << "Press any key" << std::endl;
 		char c; std::cin >> c;
     }
 
-	prev_clnm = clnm;
-    double retval=cost+lambda*abs(deformation - prior_deformation);
-	if (showOptimization)
+	d.prev_clnm = d.clnm;
+    double retval=cost+lambda*abs(deformation - d.prior_deformation);
+	if (d.showOptimization)
 		std::cout << cost << " " << deformation << " " << lambda*deformation << " " << sumV << " " << retval << std::endl;
 	return retval;
 }
 
-double continuousZernikeCost(double *x, void *_prm)
+double continuousZernikeCost(double *x, void *_data)
 {
-	ProgForwardZernikeImages *prm=(ProgForwardZernikeImages *)_prm;
+	auto *d=(ProgForwardZernikeImages::ThreadData *)_data;
+	ProgForwardZernikeImages *prm=d->prm;
     int idx = 3*(prm->vecSize);
 	// TODO: Optimize parameters for each image (not sharing)
-	// prm->deltaDefocusU[0]=x[idx+6]; prm->deltaDefocusU[1]=x[idx+6]; 
-	// prm->deltaDefocusV[0]=x[idx+7]; prm->deltaDefocusV[1]=x[idx+7]; 
-	// prm->deltaDefocusAngle[0]=x[idx+8]; prm->deltaDefocusAngle[1]=x[idx+8];
+	// deltaDefocusU[0]=x[idx+6]; deltaDefocusU[1]=x[idx+6]; 
+	// deltaDefocusV[0]=x[idx+7]; deltaDefocusV[1]=x[idx+7]; 
+	// deltaDefocusAngle[0]=x[idx+8]; deltaDefocusAngle[1]=x[idx+8];
 
 	switch (prm->num_images)
 	{
 	case 2:
-		prm->deltaX[0] = x[idx + 1];
-		prm->deltaY[0] = x[idx + 3];
-		prm->deltaRot[0] = x[idx + 5];
-		prm->deltaTilt[0] = x[idx + 7];
-		prm->deltaPsi[0] = x[idx + 9];
-		// prm->deltaDefocusU[0]=x[idx + 11];
-		// prm->deltaDefocusV[0]=x[idx + 13];
-		// prm->deltaDefocusAngle[0]=x[idx + 15];
-
-		prm->deltaX[1] = x[idx + 2];
-		prm->deltaY[1] = x[idx + 4];
-		prm->deltaRot[1] = x[idx + 6];
-		prm->deltaTilt[1] = x[idx + 8];
-		prm->deltaPsi[1] = x[idx + 10];
-		// prm->deltaDefocusU[1]=x[idx + 12];
-		// prm->deltaDefocusV[1]=x[idx + 14];
-		// prm->deltaDefocusAngle[1]=x[idx + 16];
-
-		MAT_ELEM(prm->A1, 0, 2) = prm->old_shiftX[0] + prm->deltaX[0];
-		MAT_ELEM(prm->A1, 1, 2) = prm->old_shiftY[0] + prm->deltaY[0];
-		MAT_ELEM(prm->A1, 0, 0) = 1;
-		MAT_ELEM(prm->A1, 0, 1) = 0;
-		MAT_ELEM(prm->A1, 1, 0) = 0;
-		MAT_ELEM(prm->A1, 1, 1) = 1;
-
-		MAT_ELEM(prm->A2, 0, 2) = prm->old_shiftX[1] + prm->deltaX[1];
-		MAT_ELEM(prm->A2, 1, 2) = prm->old_shiftY[1] + prm->deltaY[1];
-		MAT_ELEM(prm->A2, 0, 0) = 1;
-		MAT_ELEM(prm->A2, 0, 1) = 0;
-		MAT_ELEM(prm->A2, 1, 0) = 0;
-		MAT_ELEM(prm->A2, 1, 1) = 1;
+		d->deltaX[0] = x[idx + 1];
+		d->deltaY[0] = x[idx + 3];
+		d->deltaRot[0] = x[idx + 5];
+		d->deltaTilt[0] = x[idx + 7];
+		d->deltaPsi[0] = x[idx + 9];
+		// deltaDefocusU[0]=x[idx + 11];
+		// deltaDefocusV[0]=x[idx + 13];
+		// deltaDefocusAngle[0]=x[idx + 15];
+
+		d->deltaX[1] = x[idx + 2];
+		d->deltaY[1] = x[idx + 4];
+		d->deltaRot[1] = x[idx + 6];
+		d->deltaTilt[1] = x[idx + 8];
+		d->deltaPsi[1] = x[idx + 10];
+		// deltaDefocusU[1]=x[idx + 12];
+		// deltaDefocusV[1]=x[idx + 14];
+		// deltaDefocusAngle[1]=x[idx + 16];
+
+		MAT_ELEM(d->A1, 0, 2) = d->old_shiftX[0] + d->deltaX[0];
+		MAT_ELEM(d->A1, 1, 2) = d->old_shiftY[0] + d->deltaY[0];
+		MAT_ELEM(d->A1, 0, 0) = 1;
+		MAT_ELEM(d->A1, 0, 1) = 0;
+		MAT_ELEM(d->A1, 1, 0) = 0;
+		MAT_ELEM(d->A1, 1, 1) = 1;
+
+		MAT_ELEM(d->A2, 0, 2) = d->old_shiftX[1] + d->deltaX[1];
+		MAT_ELEM(d->A2, 1, 2) = d->old_shiftY[1] + d->deltaY[1];
+		MAT_ELEM(d->A2, 0, 0) = 1;
+		MAT_ELEM(d->A2, 0, 1) = 0;
+		MAT_ELEM(d->A2, 1, 0) = 0;
+		MAT_ELEM(d->A2, 1, 1) = 1;
 		break;
 
 	case 3:
-		prm->deltaX[0] = x[idx + 1];
-		prm->deltaY[0] = x[idx + 4];
-		prm->deltaRot[0] = x[idx + 7];
-		prm->deltaTilt[0] = x[idx + 10];
-		prm->deltaPsi[0] = x[idx + 13];
-		// prm->deltaDefocusU[0]=x[idx + 16];
-		// prm->deltaDefocusV[0]=x[idx + 19];
-		// prm->deltaDefocusAngle[0]=x[idx + 22];
-
-		prm->deltaX[1] = x[idx + 2];
-		prm->deltaY[1] = x[idx + 5];
-		prm->deltaRot[1] = x[idx + 8];
-		prm->deltaTilt[1] = x[idx + 11];
-		prm->deltaPsi[1] = x[idx + 14];
-		// prm->deltaDefocusU[1]=x[idx + 17];
-		// prm->deltaDefocusV[1]=x[idx + 20];
-		// prm->deltaDefocusAngle[1]=x[idx + 23];
-
-		prm->deltaX[2] = x[idx + 3];
-		prm->deltaY[2] = x[idx + 6];
-		prm->deltaRot[2] = x[idx + 9];
-		prm->deltaTilt[2] = x[idx + 12];
-		prm->deltaPsi[2] = x[idx + 15];
-		// prm->deltaDefocusU[2]=x[idx + 18];
-		// prm->deltaDefocusV[2]=x[idx + 21];
-		// prm->deltaDefocusAngle[2]=x[idx + 24];
-
-		MAT_ELEM(prm->A1, 0, 2) = prm->old_shiftX[0] + prm->deltaX[0];
-		MAT_ELEM(prm->A1, 1, 2) = prm->old_shiftY[0] + prm->deltaY[0];
-		MAT_ELEM(prm->A1, 0, 0) = 1;
-		MAT_ELEM(prm->A1, 0, 1) = 0;
-		MAT_ELEM(prm->A1, 1, 0) = 0;
-		MAT_ELEM(prm->A1, 1, 1) = 1;
-
-		MAT_ELEM(prm->A2, 0, 2) = prm->old_shiftX[1] + prm->deltaX[1];
-		MAT_ELEM(prm->A2, 1, 2) = prm->old_shiftY[1] + prm->deltaY[1];
-		MAT_ELEM(prm->A2, 0, 0) = 1;
-		MAT_ELEM(prm->A2, 0, 1) = 0;
-		MAT_ELEM(prm->A2, 1, 0) = 0;
-		MAT_ELEM(prm->A2, 1, 1) = 1;
-
-		MAT_ELEM(prm->A3, 0, 2) = prm->old_shiftX[2] + prm->deltaX[2];
-		MAT_ELEM(prm->A3, 1, 2) = prm->old_shiftY[2] + prm->deltaY[2];
-		MAT_ELEM(prm->A3, 0, 0) = 1;
-		MAT_ELEM(prm->A3, 0, 1) = 0;
-		MAT_ELEM(prm->A3, 1, 0) = 0;
-		MAT_ELEM(prm->A3, 1, 1) = 1;
+		d->deltaX[0] = x[idx + 1];
+		d->deltaY[0] = x[idx + 4];
+		d->deltaRot[0] = x[idx + 7];
+		d->deltaTilt[0] = x[idx + 10];
+		d->deltaPsi[0] = x[idx + 13];
+		// deltaDefocusU[0]=x[idx + 16];
+		// deltaDefocusV[0]=x[idx + 19];
+		// deltaDefocusAngle[0]=x[idx + 22];
+
+		d->deltaX[1] = x[idx + 2];
+		d->deltaY[1] = x[idx + 5];
+		d->deltaRot[1] = x[idx + 8];
+		d->deltaTilt[1] = x[idx + 11];
+		d->deltaPsi[1] = x[idx + 14];
+		// deltaDefocusU[1]=x[idx + 17];
+		// deltaDefocusV[1]=x[idx + 20];
+		// deltaDefocusAngle[1]=x[idx + 23];
+
+		d->deltaX[2] = x[idx + 3];
+		d->deltaY[2] = x[idx + 6];
+		d->deltaRot[2] = x[idx + 9];
+		d->deltaTilt[2] = x[idx + 12];
+		d->deltaPsi[2] = x[idx + 15];
+		// deltaDefocusU[2]=x[idx + 18];
+		// deltaDefocusV[2]=x[idx + 21];
+		// deltaDefocusAngle[2]=x[idx + 24];
+
+		MAT_ELEM(d->A1, 0, 2) = d->old_shiftX[0] + d->deltaX[0];
+		MAT_ELEM(d->A1, 1, 2) = d->old_shiftY[0] + d->deltaY[0];
+		MAT_ELEM(d->A1, 0, 0) = 1;
+		MAT_ELEM(d->A1, 0, 1) = 0;
+		MAT_ELEM(d->A1, 1, 0) = 0;
+		MAT_ELEM(d->A1, 1, 1) = 1;
+
+		MAT_ELEM(d->A2, 0, 2) = d->old_shiftX[1] + d->deltaX[1];
+		MAT_ELEM(d->A2, 1, 2) = d->old_shiftY[1] + d->deltaY[1];
+		MAT_ELEM(d->A2, 0, 0) = 1;
+		MAT_ELEM(d->A2, 0, 1) = 0;
+		MAT_ELEM(d->A2, 1, 0) = 0;
+		MAT_ELEM(d->A2, 1, 1) = 1;
+
+		MAT_ELEM(d->A3, 0, 2) = d->old_shiftX[2] + d->deltaX[2];
+		MAT_ELEM(d->A3, 1, 2) = d->old_shiftY[2] + d->deltaY[2];
+		MAT_ELEM(d->A3, 0, 0) = 1;
+		MAT_ELEM(d->A3, 0, 1) = 0;
+		MAT_ELEM(d->A3, 1, 0) = 0;
+		MAT_ELEM(d->A3, 1, 1) = 1;
 		break;
 
 	
 	default:
-		prm->deltaX[0] = x[idx + 1];
-		prm->deltaY[0] = x[idx + 2];
-		prm->deltaRot[0] = x[idx + 3];
-		prm->deltaTilt[0] = x[idx + 4];
-		prm->deltaPsi[0] = x[idx + 5];
-		prm->deltaDefocusU[0]=x[idx + 6];
-		prm->deltaDefocusV[0]=x[idx + 7];
-		prm->deltaDefocusAngle[0]=x[idx + 8];
-
-		MAT_ELEM(prm->A1, 0, 2) = prm->old_shiftX[0] + prm->deltaX[0];
-		MAT_ELEM(prm->A1, 1, 2) = prm->old_shiftY[0] + prm->deltaY[0];
-		MAT_ELEM(prm->A1, 0, 0) = 1;
-		MAT_ELEM(prm->A1, 0, 1) = 0;
-		MAT_ELEM(prm->A1, 1, 0) = 0;
-		MAT_ELEM(prm->A1, 1, 1) = 1;
+		d->deltaX[0] = x[idx + 1];
+		d->deltaY[0] = x[idx + 2];
+		d->deltaRot[0] = x[idx + 3];
+		d->deltaTilt[0] = x[idx + 4];
+		d->deltaPsi[0] = x[idx + 5];
+		d->deltaDefocusU[0]=x[idx + 6];
+		d->deltaDefocusV[0]=x[idx + 7];
+		d->deltaDefocusAngle[0]=x[idx + 8];
+
+		MAT_ELEM(d->A1, 0, 2) = d->old_shiftX[0] + d->deltaX[0];
+		MAT_ELEM(d->A1, 1, 2) = d->old_shiftY[0] + d->deltaY[0];
+		MAT_ELEM(d->A1, 0, 0) = 1;
+		MAT_ELEM(d->A1, 0, 1) = 0;
+		MAT_ELEM(d->A1, 1, 0) = 0;
+		MAT_ELEM(d->A1, 1, 1) = 1;
 		break;
 	}
 
-	return prm->transformImageSph(x);
+	return prm->transformImageSph(*d, x);
 
 }
 
 // Predict =================================================================
 //#define DEBUG
-void ProgForwardZernikeImages::processImage(const FileName &fnImg, const FileName &fnImgOut, const MDRow &rowIn, MDRow &rowOut)
+void ProgForwardZernikeImages::processImageThread(size_t thrId, const FileName &fnImg, const FileName &fnImgOut,
+        const MDRow &rowIn, MDRow &rowOut)
 {
+	ThreadData &d=*threadData[thrId];
     Matrix1D<double> steps;
 	// totalSize = 3*num_Z_coeff + num_images * 2 shifts + num_images * 3 angles + num_images * 3 CTF
-	algn_params = num_images * 5;
-	ctf_params = num_images * 3;
     int totalSize = 3*vecSize + algn_params + ctf_params;
-	p.initZeros(totalSize);
-	clnm.initZeros(totalSize);
-	prev_clnm.initZeros(totalSize);
+	d.p.initZeros(totalSize);
+	d.clnm.initZeros(totalSize);
+	d.prev_clnm.initZeros(totalSize);
 
 	// Init positions and deformation field
-	vpos.initZeros(sumV, 8);
-	df.initZeros(sumV, 3);
-
-	flagEnabled=1;
-
-	rowIn.getValueOrDefault(MDL_IMAGE,       fnImage[0], "");
-	rowIn.getValueOrDefault(MDL_ANGLE_ROT,   old_rot[0], 0.0);
-	rowIn.getValueOrDefault(MDL_ANGLE_TILT,  old_tilt[0], 0.0);
-	rowIn.getValueOrDefault(MDL_ANGLE_PSI,   old_psi[0], 0.0);
-	rowIn.getValueOrDefault(MDL_SHIFT_X,     old_shiftX[0], 0.0);
-	rowIn.getValueOrDefault(MDL_SHIFT_Y,     old_shiftY[0], 0.0);
-	I[0].read(fnImage[0]); 
-	I[0]().setXmippOrigin();
-	Ifiltered[0]() = I[0](); 
-	filter.applyMaskSpace(Ifiltered[0]());
-	rotatePositions(old_rot[0], old_tilt[0], old_psi[0]);
+	d.vpos.initZeros(sumV, 8);
+	d.df.initZeros(sumV, 3);
+
+	d.flagEnabled=1;
+
+	rowIn.getValueOrDefault(MDL_IMAGE,       d.fnImage[0], "");
+	rowIn.getValueOrDefault(MDL_ANGLE_ROT,   d.old_rot[0], 0.0);
+	rowIn.getValueOrDefault(MDL_ANGLE_TILT,  d.old_tilt[0], 0.0);
+	rowIn.getValueOrDefault(MDL_ANGLE_PSI,   d.old_psi[0], 0.0);
+	rowIn.getValueOrDefault(MDL_SHIFT_X,     d.old_shiftX[0], 0.0);
+	rowIn.getValueOrDefault(MDL_SHIFT_Y,     d.old_shiftY[0], 0.0);
+	d.I[0].read(d.fnImage[0]); 
+	d.I[0]().setXmippOrigin();
+	d.Ifiltered[0]() = d.I[0](); 
+	d.filter.applyMaskSpace(d.Ifiltered[0]());
+	rotatePositions(d, d.old_rot[0], d.old_tilt[0], d.old_psi[0]);
 	
 	switch (num_images)
 	{
 	case 2:
-		rowIn.getValueOrDefault(MDL_IMAGE1,      fnImage[1], "");
-		rowIn.getValueOrDefault(MDL_ANGLE_ROT2,  old_rot[1], 0.0);
-		rowIn.getValueOrDefault(MDL_ANGLE_TILT2, old_tilt[1], 0.0);
-		rowIn.getValueOrDefault(MDL_ANGLE_PSI2,  old_psi[1], 0.0);
-		rowIn.getValueOrDefault(MDL_SHIFT_X2,    old_shiftX[1], 0.0);
-		rowIn.getValueOrDefault(MDL_SHIFT_Y2,    old_shiftY[1], 0.0);
-		I[1].read(fnImage[1]);
-		I[1]().setXmippOrigin();
-		Ifiltered[1]() = I[1](); 
-		filter.applyMaskSpace(Ifiltered[1]());
+		rowIn.getValueOrDefault(MDL_IMAGE1,      d.fnImage[1], "");
+		rowIn.getValueOrDefault(MDL_ANGLE_ROT2,  d.old_rot[1], 0.0);
+		rowIn.getValueOrDefault(MDL_ANGLE_TILT2, d.old_tilt[1], 0.0);
+		rowIn.getValueOrDefault(MDL_ANGLE_PSI2,  d.old_psi[1], 0.0);
+		rowIn.getValueOrDefault(MDL_SHIFT_X2,    d.old_shiftX[1], 0.0);
+		rowIn.getValueOrDefault(MDL_SHIFT_Y2,    d.old_shiftY[1], 0.0);
+		d.I[1].read(d.fnImage[1]);
+		d.I[1]().setXmippOrigin();
+		d.Ifiltered[1]() = d.I[1](); 
+		d.filter.applyMaskSpace(d.Ifiltered[1]());
 
 		if (verbose >= 2)
-			std::cout << "Processing Pair (" << fnImage[0] << "," << fnImage[1] << ")" << std::endl;
+			std::cout << "Processing Pair (" << d.fnImage[0] << "," << d.fnImage[1] << ")" << std::endl;
 		break;
 
 	case 3:
-		rowIn.getValueOrDefault(MDL_IMAGE1,      fnImage[1], "");
-		rowIn.getValueOrDefault(MDL_ANGLE_ROT2,  old_rot[1], 0.0);
-		rowIn.getValueOrDefault(MDL_ANGLE_TILT2, old_tilt[1], 0.0);
-		rowIn.getValueOrDefault(MDL_ANGLE_PSI2,  old_psi[1], 0.0);
-		rowIn.getValueOrDefault(MDL_SHIFT_X2,    old_shiftX[1], 0.0);
-		rowIn.getValueOrDefault(MDL_SHIFT_Y2,    old_shiftY[1], 0.0);
-		I[1].read(fnImage[1]);
-		I[1]().setXmippOrigin();
-		Ifiltered[1]() = I[1](); 
-		filter.applyMaskSpace(Ifiltered[1]());
-
-		rowIn.getValueOrDefault(MDL_IMAGE2,      fnImage[2], "");
-		rowIn.getValueOrDefault(MDL_ANGLE_ROT3,  old_rot[2], 0.0);
-		rowIn.getValueOrDefault(MDL_ANGLE_TILT3, old_tilt[2], 0.0);
-		rowIn.getValueOrDefault(MDL_ANGLE_PSI3,  old_psi[2], 0.0);
-		rowIn.getValueOrDefault(MDL_SHIFT_X3,    old_shiftX[2], 0.0);
-		rowIn.getValueOrDefault(MDL_SHIFT_Y3,    old_shiftY[2], 0.0);
-		I[2].read(fnImage[2]);
-		I[2]().setXmippOrigin();
-		Ifiltered[2]() = I[2](); 
-		filter.applyMaskSpace(Ifiltered[2]());
+		rowIn.getValueOrDefault(MDL_IMAGE1,      d.fnImage[1], "");
+		rowIn.getValueOrDefault(MDL_ANGLE_ROT2,  d.old_rot[1], 0.0);
+		rowIn.getValueOrDefault(MDL_ANGLE_TILT2, d.old_tilt[1], 0.0);
+		rowIn.getValueOrDefault(MDL_ANGLE_PSI2,  d.old_psi[1], 0.0);
+		rowIn.getValueOrDefault(MDL_SHIFT_X2,    d.old_shiftX[1], 0.0);
+		rowIn.getValueOrDefault(MDL_SHIFT_Y2,    d.old_shiftY[1], 0.0);
+		d.I[1].read(d.fnImage[1]);
+		d.I[1]().setXmippOrigin();
+		d.Ifiltered[1]() = d.I[1](); 
+		d.filter.applyMaskSpace(d.Ifiltered[1]());
+
+		rowIn.getValueOrDefault(MDL_IMAGE2,      d.fnImage[2], "");
+		rowIn.getValueOrDefault(MDL_ANGLE_ROT3,  d.old_rot[2], 0.0);
+		rowIn.getValueOrDefault(MDL_ANGLE_TILT3, d.old_tilt[2], 0.0);
+		rowIn.getValueOrDefault(MDL_ANGLE_PSI3,  d.old_psi[2], 0.0);
+		rowIn.getValueOrDefault(MDL_SHIFT_X3,    d.old_shiftX[2], 0.0);
+		rowIn.getValueOrDefault(MDL_SHIFT_Y3,    d.old_shiftY[2], 0.0);
+		d.I[2].read(d.fnImage[2]);
+		d.I[2]().setXmippOrigin();
+		d.Ifiltered[2]() = d.I[2](); 
+		d.filter.applyMaskSpace(d.Ifiltered[2]());
 
 		if (verbose >= 2)
-			std::cout << "Processing Triplet (" << fnImage[0] << "," << fnImage[1] << "," << fnImage[2] << ")" << std::endl;
+			std::cout << "Processing Triplet (" << d.fnImage[0] << "," << d.fnImage[1] << "," << d.fnImage[2] << ")" << std::endl;
 		break;
 	
 	default:
 		if (verbose >= 2)
-			std::cout << "Processing Image (" << fnImage[0] << ")" << std::endl;
+			std::cout << "Processing Image (" << d.fnImage[0] << ")" << std::endl;
 		break;
 	}
 
 	if (rowIn.containsLabel(MDL_FLIP))
-    	rowIn.getValue(MDL_FLIP,old_flip);
+    	rowIn.getValue(MDL_FLIP,d.old_flip);
 	else
-		old_flip = false;
+		d.old_flip = false;
 
-	prior_deformation = 0.0;
+	d.prior_deformation = 0.0;
 	if (rowIn.containsLabel(MDL_SPH_COEFFICIENTS))
 	{
 		std::vector<double> vectortemp;
 		rowIn.getValue(MDL_SPH_COEFFICIENTS, vectortemp);
-		rowIn.getValueOrDefault(MDL_SPH_DEFORMATION, prior_deformation, 0.0);
+		rowIn.getValueOrDefault(MDL_SPH_DEFORMATION, d.prior_deformation, 0.0);
 		for (int i=0; i<3*vecSize; i++)
 		{
-			clnm[i] = vectortemp[i];
+			d.clnm[i] = vectortemp[i];
 		}
 		if (optimizeDeformation)
-			rotateCoefficients<Direction::ROTATE>();
-		p = clnm;
-		prev_clnm = clnm;
-		preComputeDF();
+			rotateCoefficients<Direction::ROTATE>(d);
+		d.p = d.clnm;
+		d.prev_clnm = d.clnm;
+		preComputeDF(d);
 	}	
 	
 	// FIXME: Add defocus per image and make CTF correction available
 	if ((rowIn.containsLabel(MDL_CTF_DEFOCUSU) || rowIn.containsLabel(MDL_CTF_MODEL)) && useCTF)
 	{
-		hasCTF=true;
-		FilterCTF1.ctf.readFromMdRow(rowIn);
-		FilterCTF1.ctf.Tm = Ts;
-		FilterCTF1.ctf.produceSideInfo();
-		old_defocusU[0]=FilterCTF1.ctf.DeltafU;
-		old_defocusV[0]=FilterCTF1.ctf.DeltafV;
-		old_defocusAngle[0]=FilterCTF1.ctf.azimuthal_angle;
+		d.hasCTF=true;
+		d.FilterCTF1.ctf.readFromMdRow(rowIn);
+		d.FilterCTF1.ctf.Tm = Ts;
+		d.FilterCTF1.ctf.produceSideInfo();
+		d.old_defocusU[0]=d.FilterCTF1.ctf.DeltafU;
+		d.old_defocusV[0]=d.FilterCTF1.ctf.DeltafV;
+		d.old_defocusAngle[0]=d.FilterCTF1.ctf.azimuthal_angle;
+		d.ctfMask.reset();
 	}
 	else
-		hasCTF=false;
+		d.hasCTF=false;
 
 	// If deformation is not optimized, do a single iteration
 	//? Si usamos priors es mejor ir poco a poco, ir poco a poco pero usar todos los coeffs cada vez (mas lento)
@@ -796,23 +796,23 @@ void ProgForwardZernikeImages::processImage(const FileName &fnImg, const FileNam
 			{
 		        minimizepos(L1,h,steps);
 			}
-			steps_cp = steps;
-			powellOptimizer(p, 1, totalSize, &continuousZernikeCost, this, 0.1, cost, iter, steps, verbose>=2);
+			d.steps_cp = steps;
+			powellOptimizer(d.p, 1, totalSize, &continuousZernikeCost, &d, 0.1, cost, iter, steps, verbose>=2);
 
 			if (verbose>=3)
 			{
-				showOptimization = true;
-				continuousZernikeCost(p.adaptForNumericalRecipes(),this);
-				showOptimization = false;
+				d.showOptimization = true;
+				continuousZernikeCost(d.p.adaptForNumericalRecipes(),&d);
+				d.showOptimization = false;
 			}
 
 			if (cost>0)
 			{
-				flagEnabled=-1;
-				p.initZeros();
+				d.flagEnabled=-1;
+				d.p.initZeros();
 			}
 			cost=-cost;
-			correlation=cost;
+			d.correlation=cost;
 			if (verbose>=2)
 			{
 				std::cout<<std::endl;
@@ -835,17 +835,17 @@ void ProgForwardZernikeImages::processImage(const FileName &fnImg, const FileNam
 					}
 					for (int i=(j-1)*vecSize;i<j*vecSize;i++)
 					{
-						std::cout << p(i);
+						std::cout << d.p(i);
 						if (i<j*vecSize-1)
 							std::cout << ",";
 					}
 					std::cout << ")" << std::endl;
 				}
                 std::cout << "Radius=" << RmaxDef << std::endl;
-				std::cout << " Dshift=(" << p(totalSize-5) << "," << p(totalSize-4) << ") "
-						  << "Drot=" << p(totalSize-3) << " Dtilt=" << p(totalSize-2) 
-                          << " Dpsi=" << p(totalSize-1) << std::endl;
-				std::cout << " Total deformation=" << totalDeformation << std::endl;
+				std::cout << " Dshift=(" << d.p(totalSize-5) << "," << d.p(totalSize-4) << ") "
+						  << "Drot=" << d.p(totalSize-3) << " Dtilt=" << d.p(totalSize-2) 
+                          << " Dpsi=" << d.p(totalSize-1) << std::endl;
+				std::cout << " Total deformation=" << d.totalDeformation << std::endl;
 				std::cout<<std::endl;
 			}
 		}
@@ -853,26 +853,27 @@ void ProgForwardZernikeImages::processImage(const FileName &fnImg, const FileNam
 		{
 			std::cerr << XE.what() << std::endl;
 			std::cerr << "Warning: Cannot refine " << fnImg << std::endl;
-			flagEnabled=-1;
+			d.flagEnabled=-1;
 		}
 	}
 
-	clnm = p;
+	d.clnm = d.p;
 	if (num_images == 1 && optimizeDeformation)
 	{
-		rotateCoefficients<Direction::UNROTATE>();
+		rotateCoefficients<Direction::UNROTATE>(d);
 	}
 
 	//AJ NEW
-	writeImageParameters(rowOut);
+	writeImageParameters(d, rowOut);
 	//END AJ
+	appendCheckPoint(rowOut);
 
 }
 #undef DEBUG
 
-void ProgForwardZernikeImages::writeImageParameters(MDRow &row) {
+void ProgForwardZernikeImages::writeImageParameters(ThreadData &d, MDRow &row) {
 	int pos = 3*vecSize;
-	if (flagEnabled==1) {
+	if (d.flagEnabled==1) {
 		row.setValue(MDL_ENABLED, 1);
 	}
 	else {
@@ -882,60 +883,59 @@ void ProgForwardZernikeImages::writeImageParameters(MDRow &row) {
 	switch (num_images)
 	{
 	case 2:
-		row.setValue(MDL_ANGLE_ROT,   old_rot[0]+p(pos+4));
-		row.setValue(MDL_ANGLE_ROT2,  old_rot[1]+p(pos+5));
-		row.setValue(MDL_ANGLE_TILT,  old_tilt[0]+p(pos+6));
-		row.setValue(MDL_ANGLE_TILT2, old_tilt[1]+p(pos+7));
-		row.setValue(MDL_ANGLE_PSI,   old_psi[0]+p(pos+8));
-		row.setValue(MDL_ANGLE_PSI2,  old_psi[1]+p(pos+9));
-		row.setValue(MDL_SHIFT_X,     old_shiftX[0]+p(pos));
-		row.setValue(MDL_SHIFT_X2,    old_shiftX[1]+p(pos+1));
-		row.setValue(MDL_SHIFT_Y,     old_shiftY[0]+p(pos+2));
-		row.setValue(MDL_SHIFT_Y2,    old_shiftY[1]+p(pos+3));
+		row.setValue(MDL_ANGLE_ROT,   d.old_rot[0]+d.p(pos+4));
+		row.setValue(MDL_ANGLE_ROT2,  d.old_rot[1]+d.p(pos+5));
+		row.setValue(MDL_ANGLE_TILT,  d.old_tilt[0]+d.p(pos+6));
+		row.setValue(MDL_ANGLE_TILT2, d.old_tilt[1]+d.p(pos+7));
+		row.setValue(MDL_ANGLE_PSI,   d.old_psi[0]+d.p(pos+8));
+		row.setValue(MDL_ANGLE_PSI2,  d.old_psi[1]+d.p(pos+9));
+		row.setValue(MDL_SHIFT_X,     d.old_shiftX[0]+d.p(pos));
+		row.setValue(MDL_SHIFT_X2,    d.old_shiftX[1]+d.p(pos+1));
+		row.setValue(MDL_SHIFT_Y,     d.old_shiftY[0]+d.p(pos+2));
+		row.setValue(MDL_SHIFT_Y2,    d.old_shiftY[1]+d.p(pos+3));
 		break;
 
 	case 3:
-		row.setValue(MDL_ANGLE_ROT,   old_rot[0]+p(pos+6));
-		row.setValue(MDL_ANGLE_ROT2,  old_rot[1]+p(pos+7));
-		row.setValue(MDL_ANGLE_ROT3,  old_rot[2]+p(pos+8));
-		row.setValue(MDL_ANGLE_TILT,  old_tilt[0]+p(pos+9));
-		row.setValue(MDL_ANGLE_TILT2, old_tilt[1]+p(pos+10));
-		row.setValue(MDL_ANGLE_TILT3, old_tilt[2]+p(pos+11));
-		row.setValue(MDL_ANGLE_PSI,   old_psi[0]+p(pos+12));
-		row.setValue(MDL_ANGLE_PSI2,  old_psi[1]+p(pos+13));
-		row.setValue(MDL_ANGLE_PSI3,  old_psi[2]+p(pos+14));
-		row.setValue(MDL_SHIFT_X,     old_shiftX[0]+p(pos));
-		row.setValue(MDL_SHIFT_X2,    old_shiftX[1]+p(pos+1));
-		row.setValue(MDL_SHIFT_X3,    old_shiftX[2]+p(pos+2));
-		row.setValue(MDL_SHIFT_Y,     old_shiftY[0]+p(pos+3));
-		row.setValue(MDL_SHIFT_Y2,    old_shiftY[1]+p(pos+4));
-		row.setValue(MDL_SHIFT_Y3,    old_shiftY[2]+p(pos+5));
+		row.setValue(MDL_ANGLE_ROT,   d.old_rot[0]+d.p(pos+6));
+		row.setValue(MDL_ANGLE_ROT2,  d.old_rot[1]+d.p(pos+7));
+		row.setValue(MDL_ANGLE_ROT3,  d.old_rot[2]+d.p(pos+8));
+		row.setValue(MDL_ANGLE_TILT,  d.old_tilt[0]+d.p(pos+9));
+		row.setValue(MDL_ANGLE_TILT2, d.old_tilt[1]+d.p(pos+10));
+		row.setValue(MDL_ANGLE_TILT3, d.old_tilt[2]+d.p(pos+11));
+		row.setValue(MDL_ANGLE_PSI,   d.old_psi[0]+d.p(pos+12));
+		row.setValue(MDL_ANGLE_PSI2,  d.old_psi[1]+d.p(pos+13));
+		row.setValue(MDL_ANGLE_PSI3,  d.old_psi[2]+d.p(pos+14));
+		row.setValue(MDL_SHIFT_X,     d.old_shiftX[0]+d.p(pos));
+		row.setValue(MDL_SHIFT_X2,    d.old_shiftX[1]+d.p(pos+1));
+		row.setValue(MDL_SHIFT_X3,    d.old_shiftX[2]+d.p(pos+2));
+		row.setValue(MDL_SHIFT_Y,     d.old_shiftY[0]+d.p(pos+3));
+		row.setValue(MDL_SHIFT_Y2,    d.old_shiftY[1]+d.p(pos+4));
+		row.setValue(MDL_SHIFT_Y3,    d.old_shiftY[2]+d.p(pos+5));
 		break;
 	
 	default:
-		row.setValue(MDL_ANGLE_ROT,   old_rot[0]+p(pos+2));
-		row.setValue(MDL_ANGLE_TILT,  old_tilt[0]+p(pos+3));
-		row.setValue(MDL_ANGLE_PSI,   old_psi[0]+p(pos+4));
-		row.setValue(MDL_SHIFT_X,     old_shiftX[0]+p(pos));
-		row.setValue(MDL_SHIFT_Y,     old_shiftY[0]+p(pos+1));
+		row.setValue(MDL_ANGLE_ROT,   d.old_rot[0]+d.p(pos+2));
+		row.setValue(MDL_ANGLE_TILT,  d.old_tilt[0]+d.p(pos+3));
+		row.setValue(MDL_ANGLE_PSI,   d.old_psi[0]+d.p(pos+4));
+		row.setValue(MDL_SHIFT_X,     d.old_shiftX[0]+d.p(pos));
+		row.setValue(MDL_SHIFT_Y,     d.old_shiftY[0]+d.p(pos+1));
 		break;
 	}
 
-	row.setValue(MDL_SPH_DEFORMATION, totalDeformation);
+	row.setValue(MDL_SPH_DEFORMATION, d.totalDeformation);
 	std::vector<double> vectortemp;
-	size_t end_clnm = VEC_XSIZE(clnm)-algn_params-ctf_params;
+	size_t end_clnm = VEC_XSIZE(d.clnm)-algn_params-ctf_params;
 	for (int j = 0; j < end_clnm; j++) {
-		vectortemp.push_back(clnm(j));
+		vectortemp.push_back(d.clnm(j));
 	}
 	row.setValue(MDL_SPH_COEFFICIENTS, vectortemp);
-	row.setValue(MDL_COST, correlation);
+	row.setValue(MDL_COST, d.correlation);
 }
 
-void ProgForwardZernikeImages::checkPoint() {
-	MDRowVec rowAppend;
+void ProgForwardZernikeImages::appendCheckPoint(const MDRow &row) {
+	std::lock_guard<std::mutex> lock(ioMutex);
 	MetaDataVec checkPoint;
-	getOutputMd().getRow(rowAppend, getOutputMd().lastRowId());
-	checkPoint.addRow(rowAppend);
+	checkPoint.addRow(row);
 	checkPoint.append(Rerunable::getFileName());
 }
 
@@ -1011,24 +1011,25 @@ void ProgForwardZernikeImages::fillVectorTerms(int l1, int l2, Matrix1D<int> &vL
     }
 }
 
-void ProgForwardZernikeImages::updateCTFImage(double defocusU, double defocusV, double angle)
+void ProgForwardZernikeImages::updateCTFImage(ThreadData &d, double defocusU, double defocusV, double angle)
 {
-	FilterCTF1.ctf.K=1; // get pure CTF with no envelope
-	currentDefocusU[0]=FilterCTF1.ctf.DeltafU=defocusU;
-	currentDefocusV[0]=FilterCTF1.ctf.DeltafV=defocusV;
-	currentAngle[0]=FilterCTF1.ctf.azimuthal_angle=angle;
-	FilterCTF1.ctf.produceSideInfo();
+	d.FilterCTF1.ctf.K=1; // get pure CTF with no envelope
+	d.currentDefocusU[0]=d.FilterCTF1.ctf.DeltafU=defocusU;
+	d.currentDefocusV[0]=d.FilterCTF1.ctf.DeltafV=defocusV;
+	d.currentAngle[0]=d.FilterCTF1.ctf.azimuthal_angle=angle;
+	d.FilterCTF1.ctf.produceSideInfo();
+	d.ctfMask=ctfCache.getFourierMask(d.FilterCTF1.ctf,(int)YSIZE(d.P[0]()),(int)XSIZE(d.P[0]()),phaseFlipped);
 }
 
 template<ProgForwardZernikeImages::Direction DIRECTION>
-void ProgForwardZernikeImages::rotateCoefficients() {
+void ProgForwardZernikeImages::rotateCoefficients(ThreadData &d) {
 	int pos = 3*vecSize;
-	size_t idxY0=(VEC_XSIZE(clnm)-algn_params-ctf_params)/3;
+	size_t idxY0=(VEC_XSIZE(d.clnm)-algn_params-ctf_params)/3;
 	size_t idxZ0=2*idxY0;
 
-	double rot = old_rot[0]+p(pos+2);
-	double tilt = old_tilt[0]+p(pos+3);
-	double psi = old_psi[0]+p(pos+4);
+	double rot = d.old_rot[0]+d.p(pos+2);
+	double tilt = d.old_tilt[0]+d.p(pos+3);
+	double psi = d.old_psi[0]+d.p(pos+4);
 
 	Matrix2D<double> R;
 	R.initIdentity(3);
@@ -1038,16 +1039,16 @@ void ProgForwardZernikeImages::rotateCoefficients() {
 	Matrix1D<double> c;
 	c.initZeros(3);
 	for (size_t idx=0; idx<idxY0; idx++) {
-		XX(c) = VEC_ELEM(clnm,idx); YY(c) = VEC_ELEM(clnm,idx+idxY0); ZZ(c) = VEC_ELEM(clnm,idx+idxZ0);
+		XX(c) = VEC_ELEM(d.clnm,idx); YY(c) = VEC_ELEM(d.clnm,idx+idxY0); ZZ(c) = VEC_ELEM(d.clnm,idx+idxZ0);
 		c = R * c;
-		VEC_ELEM(clnm,idx) = XX(c); VEC_ELEM(clnm,idx+idxY0) = YY(c); VEC_ELEM(clnm,idx+idxZ0) = ZZ(c);
+		VEC_ELEM(d.clnm,idx) = XX(c); VEC_ELEM(d.clnm,idx+idxY0) = YY(c); VEC_ELEM(d.clnm,idx+idxZ0) = ZZ(c);
 	}
 }
 
-void ProgForwardZernikeImages::deformVol(MultidimArray<double> &mP, const MultidimArray<double> &mV, double &def,
+void ProgForwardZernikeImages::deformVol(ThreadData &d, MultidimArray<double> &mP, const MultidimArray<double> &mV, double &def,
                                         double rot, double tilt, double psi)
 {
-	size_t idxY0=(VEC_XSIZE(clnm)-algn_params-ctf_params)/3;
+	size_t idxY0=(VEC_XSIZE(d.clnm)-algn_params-ctf_params)/3;
 	double Ncount=0.0;
     double modg=0.0;
 	double diff2=0.0;
@@ -1057,12 +1058,12 @@ void ProgForwardZernikeImages::deformVol(MultidimArray<double> &mP, const Multid
 	double RmaxF=RmaxDef;
 	double RmaxF2=RmaxF*RmaxF;
 	double iRmaxF=1.0/RmaxF;
-    Matrix2D<double> R_inv = R.inv();
+    Matrix2D<double> R_inv = d.R.inv();
 
-	auto sz = idx_z_clnm.size();
+	auto sz = d.idx_z_clnm.size();
 	Matrix1D<int> l1, l2, n, m, idx_v;
 
-	if (!idx_z_clnm.empty())
+	if (!d.idx_z_clnm.empty())
 	{
 		l1.initZeros(sz);
 		l2.initZeros(sz);
@@ -1071,7 +1072,7 @@ void ProgForwardZernikeImages::deformVol(MultidimArray<double> &mP, const Multid
 		idx_v.initZeros(sz);
 		for (auto j=0; j<sz; j++)
 		{
-			auto idx = idx_z_clnm[j];
+			auto idx = d.idx_z_clnm[j];
 			if (idx >= idxY0)
 				idx -= idxY0;
 
@@ -1083,13 +1084,13 @@ void ProgForwardZernikeImages::deformVol(MultidimArray<double> &mP, const Multid
 		}
 	}
 
-	const auto &mVpos = vpos;
+	const auto &mVpos = d.vpos;
 	const auto lastY = FINISHINGY(mVpos);
 	for (int i=STARTINGY(mVpos); i<=lastY; i++)
 	{
-		double &gx = A2D_ELEM(df, i, 0);
-		double &gy = A2D_ELEM(df, i, 1);
-		double &gz = A2D_ELEM(df, i, 2);
+		double &gx = A2D_ELEM(d.df, i, 0);
+		double &gy = A2D_ELEM(d.df, i, 1);
+		double &gz = A2D_ELEM(d.df, i, 2);
 		double r_x = A2D_ELEM(mVpos, i, 0);
 		double r_y = A2D_ELEM(mVpos, i, 1);
 		double r_z = A2D_ELEM(mVpos, i, 2);
@@ -1098,7 +1099,7 @@ void ProgForwardZernikeImages::deformVol(MultidimArray<double> &mP, const Multid
 		double zr = A2D_ELEM(mVpos, i, 5);
 		double rr = A2D_ELEM(mVpos, i, 6);
 
-		if (!idx_z_clnm.empty())
+		if (!d.idx_z_clnm.empty())
 		{
 			for (auto j = 0; j < sz; j++)
 			{	
@@ -1107,8 +1108,8 @@ void ProgForwardZernikeImages::deformVol(MultidimArray<double> &mP, const Multid
 				auto zsph = ZernikeSphericalHarmonics(VEC_ELEM(l1, j), VEC_ELEM(n, j),
 													  aux_l2, VEC_ELEM(m, j), xr, yr, zr, rr);
 
-				auto diff_c_x = VEC_ELEM(clnm, idx) - VEC_ELEM(prev_clnm, idx);
-				auto diff_c_y = VEC_ELEM(clnm, idx + idxY0) - VEC_ELEM(prev_clnm, idx + idxY0);
+				auto diff_c_x = VEC_ELEM(d.clnm, idx) - VEC_ELEM(d.prev_clnm, idx);
+				auto diff_c_y = VEC_ELEM(d.clnm, idx + idxY0) - VEC_ELEM(d.prev_clnm, idx + idxY0);
 				auto i_diff_c_x = R_inv.mdata[0] * diff_c_x + R_inv.mdata[1] * diff_c_y;
 				auto i_diff_c_y = R_inv.mdata[3] * diff_c_x + R_inv.mdata[4] * diff_c_y;
 				auto i_diff_c_z = R_inv.mdata[6] * diff_c_x + R_inv.mdata[7] * diff_c_y;
@@ -1121,8 +1122,8 @@ void ProgForwardZernikeImages::deformVol(MultidimArray<double> &mP, const Multid
 			}
 		}
 
-		auto r_gx = R.mdata[0] * gx + R.mdata[1] * gy + R.mdata[2] * gz;
-		auto r_gy = R.mdata[3] * gx + R.mdata[4] * gy + R.mdata[5] * gz;
+		auto r_gx = d.R.mdata[0] * gx + d.R.mdata[1] * gy + d.R.mdata[2] * gz;
+		auto r_gy = d.R.mdata[3] * gx + d.R.mdata[4] * gy + d.R.mdata[5] * gz;
 
 		auto pos = std::array<double, 3>{};
 		pos[0] = r_x + r_gx;
@@ -1137,7 +1138,7 @@ void ProgForwardZernikeImages::deformVol(MultidimArray<double> &mP, const Multid
 	}
 
 	def = sqrt(modg/Ncount);
-	totalDeformation = def;
+	d.totalDeformation = def;
 }
 
 Matrix1D<double> ProgForwardZernikeImages::weightsInterpolation3D(double x, double y, double z) {
@@ -1221,9 +1222,9 @@ double ProgForwardZernikeImages::bspline3(double x)
 		return 0.;
 }
 
-void ProgForwardZernikeImages::removePixels()
+void ProgForwardZernikeImages::removePixels(ThreadData &d)
 {
-	auto &mI = I[0]();
+	auto &mI = d.I[0]();
 	MultidimArray<double> aux;
 	aux.initZeros(mI);
 	aux.setXmippOrigin();
@@ -1254,10 +1255,10 @@ void ProgForwardZernikeImages::removePixels()
 	mI = aux;
 }
 
-void ProgForwardZernikeImages::rotatePositions(double rot, double tilt, double psi) 
+void ProgForwardZernikeImages::rotatePositions(ThreadData &d, double rot, double tilt, double psi)
 {
-    R.initIdentity(3);
-    Euler_angles2matrix(rot, tilt, psi, R, false);
+    d.R.initIdentity(3);
+    Euler_angles2matrix(rot, tilt, psi, d.R, false);
 
 	const MultidimArray<double> &mV=V();
 
@@ -1276,18 +1277,18 @@ void ProgForwardZernikeImages::rotatePositions(double rot, double tilt, double p
 					double x = j;
 					double y = i;
 					double z = k;
-					double r_x = R.mdata[0] * x + R.mdata[1] * y + R.mdata[2] * z;
-					double r_y = R.mdata[3] * x + R.mdata[4] * y + R.mdata[5] * z;
-					double r_z = R.mdata[6] * x + R.mdata[7] * y + R.mdata[8] * z;
-
-					A2D_ELEM(vpos, count, 0) = r_x;
-					A2D_ELEM(vpos, count, 1) = r_y;
-					A2D_ELEM(vpos, count, 2) = r_z;
-					A2D_ELEM(vpos, count, 3) = j * iRmaxF;
-					A2D_ELEM(vpos, count, 4) = i * iRmaxF;
-					A2D_ELEM(vpos, count, 5) = z * iRmaxF;
-					A2D_ELEM(vpos, count, 6) = sqrt(x*x + y*y + z*z) * iRmaxF;
-					A2D_ELEM(vpos, count, 7) = A3D_ELEM(mV, k, i, j);
+					double r_x = d.R.mdata[0] * x + d.R.mdata[1] * y + d.R.mdata[2] * z;
+					double r_y = d.R.mdata[3] * x + d.R.mdata[4] * y + d.R.mdata[5] * z;
+					double r_z = d.R.mdata[6] * x + d.R.mdata[7] * y + d.R.mdata[8] * z;
+
+					A2D_ELEM(d.vpos, count, 0) = r_x;
+					A2D_ELEM(d.vpos, count, 1) = r_y;
+					A2D_ELEM(d.vpos, count, 2) = r_z;
+					A2D_ELEM(d.vpos, count, 3) = j * iRmaxF;
+					A2D_ELEM(d.vpos, count, 4) = i * iRmaxF;
+					A2D_ELEM(d.vpos, count, 5) = z * iRmaxF;
+					A2D_ELEM(d.vpos, count, 6) = sqrt(x*x + y*y + z*z) * iRmaxF;
+					A2D_ELEM(d.vpos, count, 7) = A3D_ELEM(mV, k, i, j);
 
 					count++;
 				}
@@ -1297,18 +1298,18 @@ void ProgForwardZernikeImages::rotatePositions(double rot, double tilt, double p
 } 
 
 
-void ProgForwardZernikeImages::preComputeDF()
+void ProgForwardZernikeImages::preComputeDF(ThreadData &d)
 {	
-	size_t idxY0=(VEC_XSIZE(clnm)-algn_params-ctf_params)/3;
+	size_t idxY0=(VEC_XSIZE(d.clnm)-algn_params-ctf_params)/3;
 	size_t idxZ0=2*idxY0;
-	Matrix2D<double> R_inv = R.inv();
-	const auto &mVpos = vpos;
+	Matrix2D<double> R_inv = d.R.inv();
+	const auto &mVpos = d.vpos;
 	const auto lastY = FINISHINGY(mVpos);
 	for (int i=STARTINGY(mVpos); i<=lastY; i++)
 	{
-		double &gx = A2D_ELEM(df, i, 0);
-		double &gy = A2D_ELEM(df, i, 1);
-		double &gz = A2D_ELEM(df, i, 2);
+		double &gx = A2D_ELEM(d.df, i, 0);
+		double &gy = A2D_ELEM(d.df, i, 1);
+		double &gz = A2D_ELEM(d.df, i, 2);
 		double r_x = A2D_ELEM(mVpos, i, 0);
 		double r_y = A2D_ELEM(mVpos, i, 1);
 		double r_z = A2D_ELEM(mVpos, i, 2);
@@ -1317,16 +1318,16 @@ void ProgForwardZernikeImages::preComputeDF()
 		double zr = A2D_ELEM(mVpos, i, 5);
 		double rr = A2D_ELEM(mVpos, i, 6);
 
-		if (!idx_z_clnm.empty())
+		if (!d.idx_z_clnm.empty())
 		{
 			for (int idx = 0; idx < idxY0; idx++)
 			{
 				auto aux_l2 = VEC_ELEM(vL2, idx);
 				auto zsph = ZernikeSphericalHarmonics(VEC_ELEM(vL1, idx), VEC_ELEM(vN, idx),
 													  aux_l2, VEC_ELEM(vM, idx), xr, yr, zr, rr);
-				auto c_x = VEC_ELEM(clnm, idx);
-				auto c_y = VEC_ELEM(clnm, idx + idxY0);
-				auto c_z = VEC_ELEM(clnm, idx + idxZ0);
+				auto c_x = VEC_ELEM(d.clnm, idx);
+				auto c_y = VEC_ELEM(d.clnm, idx + idxY0);
+				auto c_z = VEC_ELEM(d.clnm, idx + idxZ0);
 				auto i_c_x = R_inv.mdata[0] * c_x + R_inv.mdata[1] * c_y + R_inv.mdata[2] * c_z;
 				auto i_c_y = R_inv.mdata[3] * c_x + R_inv.mdata[4] * c_y + R_inv.mdata[5] * c_z;
 				auto i_c_z = R_inv.mdata[6] * c_x + R_inv.mdata[7] * c_y + R_inv.mdata[8] * c_z;
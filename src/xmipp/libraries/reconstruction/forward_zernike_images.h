@@ -27,20 +27,23 @@
 #ifndef _PROG_FORWARD_ZERNIKE_IMAGES
 #define _PROG_FORWARD_ZERNIKE_IMAGES
 
-#include "core/xmipp_metadata_program.h"
+#include <memory>
+#include <vector>
 #include "core/rerunable_program.h"
 #include "core/matrix1d.h"
 #include <data/blobs.h>
 #include "core/xmipp_image.h"
+#include "data/ctf_image_cache.h"
 #include "data/fourier_filter.h"
 #include "data/fourier_projection.h"
+#include "threaded_metadata_program.h"
 
 /**@defgroup AngularPredictContinuous2 angular_continuous_assign2 (Continuous angular assignment)
    @ingroup ReconsLibrary */
 //@{
 
 /** Predict Continuous Parameters. */
-class ProgForwardZernikeImages: public XmippMetadataProgram, public Rerunable
+class ProgForwardZernikeImages: public ThreadedMetadataProgram, public Rerunable
 {
 public:
     /** Filename of the reference volume */
@@ -85,8 +88,6 @@ public:
     int algn_params;
     // Number CTF parameters to minimize
     int ctf_params;
-    Matrix1D<double> p;
-    int flagEnabled;
     int image_mode;
     bool useCTF;
 
@@ -97,59 +98,76 @@ public:
     MultidimArray<int> mask2D, V_mask;
     // Volume size
     size_t Xdim;
-    // Images Filename
-    std::vector<FileName> fnImage;
-    // Input image
+    // Reference volume and volume for debugging
 	Image<double> V, Vdeformed;
-    std::vector<Image<double>> I;
-    std::vector<Image<double>> Ifiltered;
-    std::vector<Image<double>> Ifilteredp;
-	// Theoretical projections
-    std::vector<Image<double>> P;
 	// Filter
-    FourierFilter filter, filterp;
-    // Transformation matrix
-    Matrix2D<double> A1, A2, A3;
-    // Original angles
-    std::vector<double> old_rot, old_tilt, old_psi, deltaRot, deltaTilt, deltaPsi;
-    // Original shift
-	std::vector<double> old_shiftX, old_shiftY, deltaX, deltaY;
-	// Original flip
-	bool old_flip;
-    // CTF Check
-    bool hasCTF;
-    // Original defocus
-	std::vector<double> old_defocusU, old_defocusV, old_defocusAngle, deltaDefocusU, deltaDefocusV, deltaDefocusAngle;
-    // Current defoci
-	std::vector<double> currentDefocusU, currentDefocusV, currentAngle;
-    // CTF filter
-    FourierFilter FilterCTF1;
-    FourierFilter FilterCTF2;
-    FourierFilter FilterCTF3;
+    FourierFilter filterp;
+	// CTF masks already generated
+    CTFImageCache<double> ctfCache;
 	// Vector Size
 	int vecSize;
-	// Vector containing the degree of the spherical harmonics
-	Matrix1D<double> clnm, prev_clnm;
-    //Copy of Optimizer steps
-    Matrix1D<double> steps_cp;
-	//Total Deformation, sumV, sumVd
-    double totalDeformation, prior_deformation;
 	int sumV;
-	// Show optimization
-	bool showOptimization;
-	// Correlation
-	double correlation;
     // Loop step
     int loop_step;
     // Blob
     struct blobtype blob;
     double blob_r;
 
-    // Deformation field and positions
-    MultidimArray<double> vpos, df;
-    std::vector<size_t> idx_z_clnm;
-    std::vector<double> z_clnm_diff;
-    Matrix2D<double> R;
+	/// Data modified while processing an image (one per thread)
+	struct ThreadData
+	{
+		// Program whose parameters are used by the cost function
+		ProgForwardZernikeImages *prm;
+		// Images Filename
+		std::vector<FileName> fnImage;
+		// Input image
+		std::vector<Image<double>> I;
+		std::vector<Image<double>> Ifiltered;
+		std::vector<Image<double>> Ifilteredp;
+		// Theoretical projections
+		std::vector<Image<double>> P;
+		// Filter
+		FourierFilter filter;
+		// Transformation matrix
+		Matrix2D<double> A1, A2, A3;
+		// Original angles
+		std::vector<double> old_rot, old_tilt, old_psi, deltaRot, deltaTilt, deltaPsi;
+		// Original shift
+		std::vector<double> old_shiftX, old_shiftY, deltaX, deltaY;
+		// Original flip
+		bool old_flip;
+		// CTF Check
+		bool hasCTF;
+		// Original defocus
+		std::vector<double> old_defocusU, old_defocusV, old_defocusAngle, deltaDefocusU, deltaDefocusV, deltaDefocusAngle;
+		// Current defoci
+		std::vector<double> currentDefocusU, currentDefocusV, currentAngle;
+		// CTF filter
+		FourierFilter FilterCTF1;
+		FourierFilter FilterCTF2;
+		FourierFilter FilterCTF3;
+		// CTF mask of the current defocus
+		CTFImageCache<double>::ImagePtr ctfMask;
+		// Optimized parameters
+		Matrix1D<double> p;
+		int flagEnabled;
+		// Vector containing the degree of the spherical harmonics
+		Matrix1D<double> clnm, prev_clnm;
+		//Copy of Optimizer steps
+		Matrix1D<double> steps_cp;
+		//Total Deformation
+		double totalDeformation, prior_deformation;
+		// Show optimization
+		bool showOptimization = false;
+		// Correlation
+		double correlation;
+		// Deformation field and positions
+		MultidimArray<double> vpos, df;
+		std::vector<size_t> idx_z_clnm;
+		std::vector<double> z_clnm_diff;
+		Matrix2D<double> R;
+	};
+	std::vector< std::unique_ptr<ThreadData> > threadData;
 
 public:
     enum class Direction { ROTATE, UNROTATE };
@@ -173,10 +191,14 @@ public:
         An exception is thrown if any of the files is not found*/
     void preProcess();
 
+    /// Allocate the data of each thread
+    void prepareThreads(size_t nThreads) override;
+
     /** Predict angles and shift.
         At the input the pose parameters must have an initial guess of the
         parameters. At the output they have the estimated pose.*/
-    void processImage(const FileName &fnImg, const FileName &fnImgOut, const MDRow &rowIn, MDRow &rowOut);
+    void processImageThread(size_t thrId, const FileName &fnImg, const FileName &fnImgOut,
+                            const MDRow &rowIn, MDRow &rowOut) override;
 
     /// Length of coefficients vector
     void numCoefficients(int l1, int l2, int &vecSize);
@@ -190,25 +212,32 @@ public:
                          Matrix1D<int> &vL2, Matrix1D<int> &vM);
 
     ///Deform a volumen using Zernike-Spherical harmonic basis
-    void deformVol(MultidimArray<double> &mVD, const MultidimArray<double> &mV, double &def,
+    void deformVol(ThreadData &d, MultidimArray<double> &mVD, const MultidimArray<double> &mV, double &def,
                    double rot, double tilt, double psi);
 
-    void updateCTFImage(double defocusU, double defocusV, double angle);
+    void updateCTFImage(ThreadData &d, double defocusU, double defocusV, double angle);
 
-    double transformImageSph(double *pclnm);
+    double transformImageSph(ThreadData &d, double *pclnm);
 
     template<Direction DIRECTION>
-    void rotateCoefficients();
+    void rotateCoefficients(ThreadData &d);
 
     //AJ new
     /** Write the final parameters. */
     virtual void finishProcessing();
 
     /** Write the parameters found for one image */
-    virtual void writeImageParameters(MDRow &row);
+    virtual void writeImageParameters(ThreadData &d, MDRow &row);
     //END AJ
 
-    virtual void checkPoint();
+    /** The rows are written to the checkpoint file when their image has
+     * been processed (see appendCheckPoint), since the threads may still be
+     * processing the last image of the output metadata.
+     */
+    void checkPoint() override {}
+
+    /// Append the row of a processed image to the checkpoint file
+    virtual void appendCheckPoint(const MDRow &row);
 
     // void removePixels();
 
@@ -220,11 +249,11 @@ public:
 
     double bspline3(double x);
 
-    void removePixels();
+    void removePixels(ThreadData &d);
 
-    void rotatePositions(double rot, double tilt, double psi);
+    void rotatePositions(ThreadData &d, double rot, double tilt, double psi);
 
-    void preComputeDF();
+    void preComputeDF(ThreadData &d);
 
 protected:
     void createWorkFiles() { return Rerunable::createWorkFiles(resume, getInputMd()); }
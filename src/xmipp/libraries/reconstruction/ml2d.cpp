@@ -24,6 +24,8 @@
  ***************************************************************************/
 
 #include <algorithm>
+#include <atomic>
+#include <exception>
 #include <iomanip>
 #include "ml2d.h"
 
@@ -38,6 +40,8 @@ ML2DBaseProgram::ML2DBaseProgram()
     defaultNiter = 100;
     blocks = 1;
     factor_nref = 1;
+    threads = 1;
+    thread_load = 1;
     outRefsMd = "";
 }
 
@@ -172,6 +176,16 @@ void ML2DBaseProgram::endIteration()
     writeOutputFiles(model, OUT_ITER);
 }
 
+void ML2DBaseProgram::createThreads()
+{
+    scheduler.setThreads(threads);
+}
+
+void ML2DBaseProgram::destroyThreads()
+{
+    scheduler.setThreads(1);
+}
+
 //Standard run function of ML2D family
 void ML2DBaseProgram::run()
 {
@@ -296,7 +310,7 @@ void ML2DBaseProgram::defineHiddenParams(XmippProgram *prog)
     prog->addParamsLine(" [--trymindiff_factor <float=0.9>]");
     prog->addParamsLine(" [--random_seed <int=-1>]");
     prog->addParamsLine(" [--search_rot <float=999.>]");
-    prog-> addParamsLine(" [--load <N=1>]");
+    prog->addParamsLine(" [--load <N=8>]                 : Images of each thread in a batch of the expectation");
 
     //fixme: only for debug
     prog->addParamsLine("[--no_iem] : bla bla bla");
@@ -313,6 +327,62 @@ FileName getIterExtraPath(const FileName &fn_root, int iter, bool makePath)
 
 
 
+///////////// ML2DTaskScheduler Implementation ////////////
+void ML2DTaskScheduler::setThreads(int threads)
+{
+    this->threads = XMIPP_MAX(1, threads);
+    if (this->threads > 1)
+        pool = std::make_unique<ctpl::thread_pool>(this->threads);
+    else
+        pool.reset();
+}
+
+void ML2DTaskScheduler::run(size_t nTasks, const std::function<void(int, size_t)> &task)
+{
+    if (threads == 1 || nTasks <= 1)
+    {
+        for (size_t i = 0; i < nTasks; ++i)
+            task(0, i);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&](int thread)
+    {
+        size_t i;
+        try
+        {
+            while ((i = next++) < nTasks)
+                task(thread, i);
+        }
+        catch (...)
+        {
+            // Do not start more tasks
+            next = nTasks;
+            throw;
+        }
+    };
+    size_t nWorkers = XMIPP_MIN((size_t)threads, nTasks);
+    std::vector<std::future<void> > futures;
+    futures.reserve(nWorkers);
+    for (size_t w = 0; w < nWorkers; ++w)
+        futures.emplace_back(pool->push(worker));
+    // Wait for all the workers before reporting an error, they use this frame
+    std::exception_ptr error;
+    for (auto &f : futures)
+        try
+        {
+            f.get();
+        }
+        catch (...)
+        {
+            if (!error)
+                error = std::current_exception();
+        }
+    if (error)
+        std::rethrow_exception(error);
+}
+
 ///////////// ModelML2D Implementation ////////////
 ModelML2D::ModelML2D()
 {
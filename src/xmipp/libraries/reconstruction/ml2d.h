@@ -28,8 +28,11 @@
 
 #include <sys/time.h>
 #include <pthread.h>
+#include <functional>
+#include <memory>
 #include <random>
 #include <vector>
+#include "CTPL/ctpl_stl.h"
 #include <core/xmipp_fftw.h>
 #include <core/xmipp_fft.h>
 #include <core/args.h>
@@ -70,8 +73,6 @@
 
 //For MPI
 #define IS_MASTER (rank == 0)
-//threads tasks
-typedef enum { TH_EXIT, TH_ESI_REFNO, TH_ESI_UPDATE_REFNO, TH_RR_REFNO, TH_RRR_REFNO, TH_PFS_REFNO } ThreadTask;
 //output types constants
 typedef enum { OUT_BLOCK, OUT_ITER, OUT_FINAL, OUT_REFS, OUT_IMGS } OutputType;
 
@@ -118,6 +119,35 @@ public:
 }
 ;//close class ModelML2D
 
+/** Parallel execution of the independent tasks of the ML2D programs.
+ * The threads are created once and reused for all the tasks of the
+ * program. Each thread takes the next task when it finishes the previous
+ * one, so tasks of different cost are balanced. Tasks receive the index
+ * of the thread that runs them (between 0 and getThreads()-1), to be
+ * used for the work space and the partial sums of that thread.
+ */
+class ML2DTaskScheduler
+{
+public:
+    /// Create the threads (no threads are created for one thread)
+    void setThreads(int threads);
+
+    /// Number of threads
+    int getThreads() const
+    {
+        return threads;
+    }
+
+    /** Run task(thread, i) for i in 0..nTasks-1 and wait for all of them.
+     * Exceptions thrown by the tasks are rethrown here.
+     */
+    void run(size_t nTasks, const std::function<void(int, size_t)> &task);
+
+private:
+    int threads = 1;
+    std::unique_ptr<ctpl::thread_pool> pool;
+};
+
 
 
 
@@ -242,6 +272,10 @@ public:
 
     /** Number of threads */
     int threads;
+    /** Images of each thread in a batch of the expectation (--load) */
+    int thread_load;
+    /** Threads executing the tasks */
+    ML2DTaskScheduler scheduler;
 
     /** This will be used for comunication from 2d and 3d.
      * in the mlf_align2d case, also will be produced
@@ -286,14 +320,10 @@ public:
     virtual void randomizeImagesOrder();
 
     /// Create working threads
-    virtual void createThreads()
-    {}
-    ;//by default do nothing
+    virtual void createThreads();
 
     /// Exit threads and free memory
-    virtual void destroyThreads()
-    {}
-    ;//by default do nothing
+    virtual void destroyThreads();
 
     ///Write output files
     virtual void writeOutputFiles(const ModelML2D &model, OutputType outputType = OUT_FINAL) = 0;
@@ -27,13 +27,6 @@
 #include "core/transformations.h"
 //#define DEBUG_JM
 
-//Mutex for each thread update sums
-pthread_mutex_t update_mutex =
-    PTHREAD_MUTEX_INITIALIZER;
-//Mutex for each thread get next refno
-pthread_mutex_t refno_mutex =
-    PTHREAD_MUTEX_INITIALIZER;
-
 // Constructor
 ProgML2D::ProgML2D()
 {
@@ -151,8 +144,8 @@ void ProgML2D::readParams()
 
     // Number of threads
     threads = getIntParam("--thr");
-    //testing the thread load in refno
-    refno_load_param = getIntParam("--load");
+    // Images of each thread in a batch
+    thread_load = getIntParam("--load");
     // Hidden arguments
     fn_scratch = getParameter(argc2, (const char **)argv2, "--scratch", "");
     debug = getIntParam("--debug");
@@ -408,28 +401,12 @@ void ProgML2D::produceSideInfo2()
     //Some vectors and matrixes initialization
     int num_output_refs = model.n_ref * factor_nref;
     //std::cerr << "DEBUG_JM: num_output_refs: " << num_output_refs << std::endl;
-    refw.resize(num_output_refs);
-    refw2.resize(num_output_refs);
-    refwsc2.resize(num_output_refs);
-    refw_mirror.resize(num_output_refs);
-    sumw_refpsi.resize(num_output_refs * nr_psi);
     A2.resize(num_output_refs);
     fref.resize(num_output_refs * nr_psi);
     mref.resize(num_output_refs * nr_psi);
     wsum_Mref.resize(num_output_refs);
-    mysumimgs.resize(num_output_refs * nr_psi);
     Iold.resize(num_output_refs);
 
-    if (fast_mode)
-    {
-        int mysize = num_output_refs * (do_mirror ? 2 : 1);
-        //if (do_mirror)
-        //    mysize *= 2;
-        ioptx_ref.resize(mysize);
-        iopty_ref.resize(mysize);
-        ioptflip_ref.resize(mysize);
-    }
-
     randomizeImagesOrder();
 
     // Initialize trymindiff for all images
@@ -606,7 +583,10 @@ void ProgML2D::rotateReference()
     std::cerr<<"entering rotateReference"<<std::endl;
 #endif
 
-    awakeThreads(TH_RR_REFNO, 0, refno_load_param);
+    scheduler.run(model.n_ref, [this](int thread, size_t refno)
+    {
+        rotateReferenceRefno(*threadWork[thread], refno);
+    });
 
 #ifdef DEBUG
 
@@ -614,6 +594,59 @@ void ProgML2D::rotateReference()
 #endif
 }
 
+void ProgML2D::rotateReferenceRefno(ML2DThreadWork &w, int refno)
+{
+    double AA, stdAA=0., psi, dum, avg;
+    MultidimArray<double> Maux(dim, dim);
+    int refnoipsi;
+
+    Maux.setXmippOrigin();
+
+    computeStats_within_binary_mask(omask, model.Iref[refno](), dum,
+                                    dum, avg, dum);
+    for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
+    {
+        refnoipsi = refno * nr_psi + ipsi;
+        // Add arbitrary number (small_angle) to avoid 0-degree rotation (lacking interpolation)
+        psi = (double) (ipsi * psi_max / nr_psi) + SMALLANGLE;
+        rotate(xmipp_transformation::BSPLINE3, Maux, model.Iref[refno](), -psi, 'Z', xmipp_transformation::WRAP);
+        apply_binary_mask(mask, Maux, Maux, avg);
+        // Normalize the magnitude of the rotated references to 1st rot of that ref
+        // This is necessary because interpolation due to rotation can lead to lower overall Fref
+        // This would result in lower probabilities for those rotations
+        AA = Maux.sum2();
+        if (ipsi == 0)
+        {
+            stdAA = AA;
+            A2[refno] = AA;
+        }
+
+        if (AA > 0)
+            Maux *= sqrt(stdAA / AA);
+
+        if (fast_mode)
+            mref[refnoipsi] = Maux;
+
+        // Do the forward FFT with the plans of the thread
+        // Takes the input from Maux and leaves it in Faux
+        w.Maux = Maux;
+        w.transformer.FourierTransform();
+
+        MultidimArray<std::complex<double> > &fref_aux = fref[refnoipsi];
+        fref_aux.resizeNoCopy(w.Faux);
+        FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(w.Faux)
+        {
+            DIRECT_MULTIDIM_ELEM(fref_aux, n) = conj(DIRECT_MULTIDIM_ELEM(w.Faux, n));
+        }
+    }
+
+    // If we don't use save_mem1 Iref[refno] is useless from here on
+    //FIXME: Segmentation fault with blocks
+    //if (!save_mem1)
+    //    model.Iref[refno]().resize(0, 0);
+
+}//close function rotateReferenceRefno
+
 // Collect all rotations and sum to update Iref() for all models ==========
 void ProgML2D::reverseRotateReference()
 {
@@ -622,7 +655,10 @@ void ProgML2D::reverseRotateReference()
     std::cerr<<"entering reverseRotateReference"<<std::endl;
 #endif
 
-    awakeThreads(TH_RRR_REFNO, 0, refno_load_param);
+    scheduler.run(model.n_ref, [this](int thread, size_t refno)
+    {
+        reverseRotateReferenceRefno(*threadWork[thread], refno);
+    });
 
 #ifdef DEBUG
 
@@ -631,7 +667,42 @@ void ProgML2D::reverseRotateReference()
 
 }
 
-void ProgML2D::preselectLimitedDirections(double &phi, double &theta)
+void ProgML2D::reverseRotateReferenceRefno(ML2DThreadWork &w, int refno)
+{
+    double psi, dum, avg;
+    MultidimArray<double> Maux2(dim, dim), Maux3(dim, dim);
+
+    Maux2.setXmippOrigin();
+    Maux3.setXmippOrigin();
+
+    wsum_Mref[refno].initZeros(dim, dim);
+    wsum_Mref[refno].setXmippOrigin();
+    for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
+    {
+        // Add arbitrary number to avoid 0-degree rotation without interpolation effects
+        psi = (double) (ipsi * psi_max / nr_psi) + SMALLANGLE;
+        int refnoipsi = refno * nr_psi + ipsi;
+        // Add the weighted sums of all threads, always in the same order,
+        // and do the backward FFT with the plans of the thread
+        // The input is copied to Faux because the backward FFT destroys it
+        w.Faux = threadWork[0]->wsumimgs[refnoipsi];
+        for (size_t thread = 1; thread < threadWork.size(); thread++)
+            w.Faux += threadWork[thread]->wsumimgs[refnoipsi];
+        // Takes the input from Faux and leaves the output in Maux
+        w.transformer.inverseFourierTransform();
+        Maux3 = w.Maux;
+        //CenterFFT(Maux3, true);
+        centerFFT2(Maux3);
+        computeStats_within_binary_mask(omask, Maux3, dum, dum, avg, dum);
+        rotate(xmipp_transformation::BSPLINE3, Maux2, Maux3, psi, 'Z', xmipp_transformation::WRAP);
+        apply_binary_mask(mask, Maux2, Maux2, avg);
+        wsum_Mref[refno] += Maux2;
+    }
+
+}//close function reverseRotateReferenceRefno
+
+void ProgML2D::preselectLimitedDirections(double &phi, double &theta,
+        std::vector<double> &pdf_directions)
 {
 
     double phi_ref, theta_ref, angle, angle2;
@@ -670,112 +741,206 @@ void ProgML2D::preselectLimitedDirections(double &phi, double &theta)
 
 // Pre-selection of significant refno and ipsi, based on current optimal translation =======
 
+///Some macro definitions for the following function
+#define IIFLIP (imirror * nr_nomirror_flips + iflip)
+#define IROT (IIFLIP * nr_psi + ipsi)
+#define WEIGHT (dAij(pfs_weight, refno, IROT))
+#define MAX_WEIGHT (dAij(pfs_maxweight, imirror, refno))
+#define MSIGNIFICANT (dAij(Msignificant, refno, IROT))
 
-void ProgML2D::preselectFastSignificant()
+void ProgML2D::preselectFastSignificant(ML2DThreadWork &w)
 {
 
 #ifdef DEBUG
     std::cerr<<"entering preselectFastSignificant"<<std::endl;
 #endif
 
+    MultidimArray<double> Mtrans, Mflip;
+    double ropt, aux, diff, pdf, fracpdf;
+    double A2_plus_Xi2;
+    int irefmir;
+    Matrix1D<double> trans(2);
+    double local_mindiff;
+    double sigma_noise2 = model.sigma_noise * model.sigma_noise;
+    int nr_mirror = (do_mirror) ? 2 : 1;
+    MultidimArray<int> &Msignificant = w.Msignificant;
+    MultidimArray<double> &pfs_weight = w.pfs_weight;
+    MultidimArray<double> &pfs_maxweight = w.pfs_maxweight;
+
     // Initialize Msignificant to all zeros
     // TODO: check whether this is strictly necessary? Probably not...
     Msignificant.initZeros();
-    pfs_mindiff = 99.e99;
-    pfs_maxweight.resizeNoCopy((do_mirror ? 2 : 1), model.n_ref);
+    pfs_maxweight.resizeNoCopy(nr_mirror, model.n_ref);
     pfs_maxweight.initConstant(-99.e99);
     pfs_weight.resizeNoCopy(model.n_ref, nr_psi * nr_flip);
     pfs_weight.initZeros();
-    pfs_count = threads;
-    awakeThreads(TH_PFS_REFNO, 0, refno_load_param);
+
+    Mtrans.resize(dim, dim);
+    Mtrans.setXmippOrigin();
+    Mflip.resize(dim, dim);
+    Mflip.setXmippOrigin();
+
+    local_mindiff = 99.e99;
+
+    // A. Translate image and calculate probabilities for every rotation
+    for (int refno = 0; refno < model.n_ref; refno++)
+    {
+        if (!limit_rot || w.pdf_directions[refno] > 0.)
+        {
+            A2_plus_Xi2 = 0.5 * (A2[refno] + w.Xi2);
+            for (int imirror = 0; imirror < nr_mirror; imirror++)
+            {
+                irefmir = imirror * model.n_ref + refno;
+                // Get optimal offsets
+                trans(0) = w.allref_offsets[2 * irefmir];
+                trans(1) = w.allref_offsets[2 * irefmir + 1];
+                ropt = sqrt(trans(0) * trans(0) + trans(1) * trans(1));
+                // Do not trust optimal offsets if they are larger than 3*sigma_offset:
+                if (ropt > 3 * model.sigma_offset)
+                {
+                    for (size_t iflip = 0; iflip < nr_nomirror_flips; iflip++)
+                        for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
+                            MSIGNIFICANT = 1;
+                }
+                else
+                {
+                    translate(xmipp_transformation::LINEAR, Mtrans, w.Mimg, trans, true);
+                    for (size_t iflip = 0; iflip < nr_nomirror_flips; iflip++)
+                    {
+                        applyGeometry(xmipp_transformation::LINEAR, Mflip, Mtrans, F[IIFLIP], xmipp_transformation::IS_INV, xmipp_transformation::WRAP);
+                        for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
+                        {
+                            diff = A2_plus_Xi2;
+                            MultidimArray<double> &mref_ref = mref[refno*nr_psi + ipsi];
+                            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Mflip)
+                            {
+                                diff -= DIRECT_MULTIDIM_ELEM(Mflip, n) * DIRECT_MULTIDIM_ELEM(mref_ref, n);
+                            }
+                            WEIGHT = diff;
+                            if (diff < local_mindiff)
+                                local_mindiff = diff;
+                        }
+                    }
+                }//close else if ropt > ...
+            }//close for imirror
+        }//close if !limit_rot ...
+    }//close for refno
+
+    // B. Now that we have local_mindiff, calculate the weights
+    for (int refno = 0; refno < model.n_ref; refno++)
+    {
+
+        if (!limit_rot || w.pdf_directions[refno] > 0.)
+        {
+            for (int imirror = 0; imirror < nr_mirror; imirror++)
+            {
+                irefmir = imirror * model.n_ref + refno;
+                // Get optimal offsets
+                trans(0) = w.allref_offsets[2 * irefmir];
+                trans(1) = w.allref_offsets[2 * irefmir + 1];
+                ///Calculate max_weight for this refno-mirror combination
+                for (size_t iflip = 0; iflip < nr_nomirror_flips; iflip++)
+                    for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
+                    {
+                        if (!MSIGNIFICANT)
+                        {
+                            fracpdf = model.alpha_k[refno] *
+                                      (imirror ? model.mirror_fraction[refno] : (1.- model.mirror_fraction[refno]));
+                            pdf = fracpdf * A2D_ELEM(P_phi, (int)trans(1), (int)trans(0));
+                            if (!model.do_student)
+                            {
+                                // normal distribution
+                                aux = (WEIGHT - local_mindiff) / sigma_noise2;
+                                // next line because of numerical precision of exp-function
+                                WEIGHT = (aux > 1000. ? 0. : exp(-aux) * pdf);
+                            }
+                            else
+                            {
+                                // t-student distribution
+                                aux = (dfsigma2 + 2. * WEIGHT) / (dfsigma2 + 2. * local_mindiff);
+                                WEIGHT = pow(aux, df2) * pdf;
+                            }
+                            if (WEIGHT > MAX_WEIGHT)
+                                MAX_WEIGHT = WEIGHT;
+                        }
+                    } // close ipsi
+                ///Now we have max_weight, set Msignificant values
+                for (size_t iflip = 0; iflip < nr_nomirror_flips; iflip++)
+                    for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
+                        if (!MSIGNIFICANT)
+                            MSIGNIFICANT = (WEIGHT >= C_fast * MAX_WEIGHT) ? 1 : 0;
+            }//close for imirror
+        } //endif limit_rot and pdf_directions
+    } //end for refno
 
 #ifdef DEBUG
 
     std::cerr<<"leaving preselectFastSignificant"<<std::endl;
 #endif
-}
+}//close function preselectFastSignificant
 
 // Maximum Likelihood calculation for one image ============================================
 // Integration over all translation, given  model and in-plane rotation
-void ProgML2D::expectationSingleImage(Matrix1D<double> &opt_offsets)
+void ProgML2D::expectationSingleImage(ML2DThreadWork &w, Matrix1D<double> &opt_offsets)
 {
-#ifdef TIMING
-    timer.tic(ESI_E1);
-#endif
-
-    MultidimArray<double> Maux, Mweight;
-    MultidimArray<std::complex<double> > Faux;
     double my_mindiff;
     bool is_ok_trymindiff = false;
     double sigma_noise2 = model.sigma_noise * model.sigma_noise;
-    FourierTransformer local_transformer;
-    ioptx = iopty = 0;
-
-    // Update sigdim, i.e. the number of pixels that will be considered in the translations
-    sigdim = 2 * CEIL(XMIPP_MAX(1,model.sigma_offset) * (save_mem2 ? 3 : 6));
-    sigdim++; // (to get uneven number)
-    sigdim = XMIPP_MIN(dim, sigdim);
-
-    // Setup matrices
-    Maux.resize(dim, dim);
-    Maux.setXmippOrigin();
-    Mweight.initZeros(sigdim, sigdim);
-    Mweight.setXmippOrigin();
+    w.ioptx = w.iopty = 0;
 
     if (!model.do_norm)
-        opt_scale = 1.;
+        w.opt_scale = 1.;
 
     // precalculate all flipped versions of the image
-    Fimg_flip.clear();
+    // Takes the input from Maux and leaves it in Faux
+    w.Fimg_flip.resize(nr_flip);
 
     for (size_t iflip = 0; iflip < nr_flip; iflip++)
     {
-        Maux.setXmippOrigin();
-        applyGeometry(xmipp_transformation::LINEAR, Maux, Mimg, F[iflip], xmipp_transformation::IS_INV, xmipp_transformation::WRAP);
-        local_transformer.FourierTransform(Maux, Faux, false);
+        applyGeometry(xmipp_transformation::LINEAR, w.Maux, w.Mimg, F[iflip], xmipp_transformation::IS_INV, xmipp_transformation::WRAP);
+        w.transformer.FourierTransform();
 
         if (model.do_norm)
-            dAij(Faux,0,0) -= bgmean;
+            dAij(w.Faux,0,0) -= w.bgmean;
 
-        Fimg_flip.push_back(Faux);
+        w.Fimg_flip[iflip] = w.Faux;
 
     }
 
     // The real stuff: loop over all references, rotations and translations
     int redo_counter = 0;
 
-#ifdef TIMING
-
-    timer.toc(ESI_E1);
-
-    //timer.tic("WHILE_");
-#endif
-
     while (!is_ok_trymindiff)
     {
         // Initialize mindiff, weighted sums and maxweights
-        mindiff = 99.e99;
-        wsum_corr = wsum_offset = wsum_sc = wsum_sc2 = 0.;
-        maxweight = maxweight2 = sum_refw = sum_refw2 = 0.;
-
-        awakeThreads(TH_ESI_REFNO, opt_refno, refno_load_param);
+        w.mindiff = 99.e99;
+        w.wsum_corr = w.wsum_offset = w.wsum_sc = w.wsum_sc2 = 0.;
+        w.maxweight = w.maxweight2 = w.sum_refw = 0.;
+
+        // Start the loop over all refno at old_optrefno (=opt_refno from the previous iteration).
+        // This will speed-up things because we will find Pmax probably right away,
+        // and this will make the if-statement that checks SIGNIFICANT_WEIGHT_LOW
+        // effective right from the start
+        int start_refno = w.opt_refno % model.n_ref;
+        for (int i = 0; i < model.n_ref; i++)
+            expectationSingleImageRefno(w, (start_refno + i) % model.n_ref);
 
         // Now check whether our trymindiff was OK.
         // The limit of the exp-function lies around
         // exp(700)=1.01423e+304, exp(800)=inf; exp(-700) = 9.85968e-305; exp(-88) = 0
         // Use 500 to be on the save side?
 
-        if (ABS((mindiff - trymindiff) / sigma_noise2) > 500.)
+        if (ABS((w.mindiff - w.trymindiff) / sigma_noise2) > 500.)
             //force always redo to use real mindiff for check about LL problem
             //if (redo_counter==0)
         {
             // Re-do whole calculation now with the real mindiff
-            trymindiff = mindiff;
+            w.trymindiff = w.mindiff;
             redo_counter++;
             // On iteration 0 images that will go to references other than first
             // will store optimus references but not yet expanded number of references
             if (iter == 0)
-                opt_refno = (opt_refno % model.n_ref);
+                w.opt_refno = (w.opt_refno % model.n_ref);
 
             // Never re-do more than once!
             if (redo_counter > 1)
@@ -784,919 +949,581 @@ void ProgML2D::expectationSingleImage(Matrix1D<double> &opt_offsets)
         else
         {
             is_ok_trymindiff = true;
-            my_mindiff = trymindiff;
-            trymindiff = mindiff;
+            my_mindiff = w.trymindiff;
+            w.trymindiff = w.mindiff;
         }
 
     }//close while
 
-    fracweight = maxweight / sum_refw;
+    w.fracweight = w.maxweight / w.sum_refw;
 
-    wsum_sc /= sum_refw;
+    w.wsum_sc /= w.sum_refw;
 
-    wsum_sc2 /= sum_refw;
+    w.wsum_sc2 /= w.sum_refw;
 
     // Calculate optimal transformation parameters
-    opt_psi = -psi_step * (iopt_flip * nr_psi + iopt_psi) - SMALLANGLE;
+    w.opt_psi = -psi_step * (w.iopt_flip * nr_psi + w.iopt_psi) - SMALLANGLE;
 
-    opt_offsets(0) = -(double) ioptx * MAT_ELEM(F[iopt_flip], 0, 0)
-                     - (double) iopty * MAT_ELEM(F[iopt_flip], 0, 1);
+    opt_offsets(0) = -(double) w.ioptx * MAT_ELEM(F[w.iopt_flip], 0, 0)
+                     - (double) w.iopty * MAT_ELEM(F[w.iopt_flip], 0, 1);
 
-    opt_offsets(1) = -(double) ioptx * MAT_ELEM(F[iopt_flip], 1, 0)
-                     - (double) iopty * MAT_ELEM(F[iopt_flip], 1, 1);
+    opt_offsets(1) = -(double) w.ioptx * MAT_ELEM(F[w.iopt_flip], 1, 0)
+                     - (double) w.iopty * MAT_ELEM(F[w.iopt_flip], 1, 1);
 
     // Update normalization parameters
     if (model.do_norm)
     {
         // 1. Calculate optimal setting of Mimg
-        MultidimArray<double> Maux2 = Mimg;
+        MultidimArray<double> Maux2 = w.Mimg;
         selfTranslate(xmipp_transformation::LINEAR, Maux2, opt_offsets, true);
-        selfApplyGeometry(xmipp_transformation::LINEAR, Maux2, F[iopt_flip], xmipp_transformation::IS_INV, xmipp_transformation::WRAP);
+        selfApplyGeometry(xmipp_transformation::LINEAR, Maux2, F[w.iopt_flip], xmipp_transformation::IS_INV, xmipp_transformation::WRAP);
         // 2. Calculate optimal setting of Mref
-        int refnoipsi = (opt_refno % model.n_ref) * nr_psi + iopt_psi;
-        FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(Faux)
+        int refnoipsi = (w.opt_refno % model.n_ref) * nr_psi + w.iopt_psi;
+        FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(w.Faux)
         {
-            dAij(Faux,i,j) = conj(dAij(fref[refnoipsi],i,j));
-            dAij(Faux,i,j) *= opt_scale;
+            dAij(w.Faux,i,j) = conj(dAij(fref[refnoipsi],i,j));
+            dAij(w.Faux,i,j) *= w.opt_scale;
         }
 
         // Still take input from Faux and leave output in Maux
-        local_transformer.inverseFourierTransform();
-        Maux2 = Maux2 - Maux;
+        w.transformer.inverseFourierTransform();
+        Maux2 = Maux2 - w.Maux;
 
         if (debug == 12)
         {
             std::cout << std::endl;
-            std::cout << "scale= " << opt_scale << " changes to " << wsum_sc
-            / wsum_sc2 << std::endl;
-            std::cout << "bgmean= " << bgmean << " changes to "
+            std::cout << "scale= " << w.opt_scale << " changes to " << w.wsum_sc
+            / w.wsum_sc2 << std::endl;
+            std::cout << "bgmean= " << w.bgmean << " changes to "
             << Maux2.computeAvg() << std::endl;
         }
 
         // non-ML update of bgmean (this is much cheaper than true-ML update...)
-        old_bgmean = bgmean;
+        w.old_bgmean = w.bgmean;
 
-        bgmean = Maux2.computeAvg();
+        w.bgmean = Maux2.computeAvg();
 
         // ML-update of opt_scale
-        opt_scale = wsum_sc / wsum_sc2;
+        w.opt_scale = w.wsum_sc / w.wsum_sc2;
     }
 
-#ifdef TIMING
-    timer.toc(ESI_E5);
-
-    timer.tic(ESI_E6TH);
-
-#endif
-    // Update all global weighted sums after division by sum_refw
-    wsum_sigma_noise += (2 * wsum_corr / sum_refw);
-
-    wsum_sigma_offset += (wsum_offset / sum_refw);
+    // Update all weighted sums of the thread after division by sum_refw
+    w.wsum_sigma_noise += (2 * w.wsum_corr / w.sum_refw);
 
-    sumfracweight += fracweight;
+    w.wsum_sigma_offset += (w.wsum_offset / w.sum_refw);
 
+    w.sumfracweight += w.fracweight;
 
-    //    std::cerr << "-------------------- wsum_corr: " << wsum_corr << std::endl;
-    //    std::cerr << "-------------------- sum_refw: " << sum_refw << std::endl;
-    //    std::cerr << std::endl << "-------------------- wsum_sigma_offset: " << wsum_sigma_offset << std::endl;
-    //    std::cerr << "-------------------- wsum_sigma_noise: " << wsum_sigma_noise << std::endl << std::endl;
-    //    if (wsum_sigma_noise < 0)
-    //    {
-    //      std::cerr << "Negative wsum_sigma_noise....exiting"  <<std::endl;
-    //      exit(1);
-    //    }
-
-    awakeThreads(TH_ESI_UPDATE_REFNO, 0, refno_load_param);
+    updateWeightedSums(w);
 
     if (!model.do_student)
         // 1st term: log(refw_i)
         // 2nd term: for subtracting mindiff
         // 3rd term: for (sqrt(2pi)*sigma_noise)^-1 term in formula (12) Sigworth (1998)
-        dLL = log(sum_refw) - my_mindiff / sigma_noise2 - ddim2 * log(sqrt(2.
+        w.dLL = log(w.sum_refw) - my_mindiff / sigma_noise2 - ddim2 * log(sqrt(2.
                 * PI * sigma_noise2));
     else
         // 1st term: log(refw_i)
         // 2nd term: for dividing by (1 + 2. * mindiff/dfsigma2)^df2
         // 3rd term: for sigma-dependent normalization term in t-student distribution
         // 4th&5th terms: gamma functions in t-distribution
-        dLL = log(sum_refw) + df2 * log(1. + (2. * my_mindiff / dfsigma2))
-              - ddim2 * log(sqrt(PI * df * sigma_noise2)) + gammln(-df2)
-              - gammln(df / 2.);
-
-    //#define DEBUG_JM1
-#ifdef DEBUG_JM1
-
-    //if (iter>1)
-    {
-        //static std::ios::openmode mode = std::ios::out|std::ios::trunc;
-        //std::ofstream log;
-        //FileName fn = fn_root + (current_image % 2 == 0 ? "_images.even" : "_images.odd");
-        //log.open(fn.c_str(), mode);
-        //std::cerr << "    IMAGE " << current_image << "----------------------------->>>" << std::endl;
-        std::cerr << "----------------------------->>>" << std::endl;
-        std::cerr << "                             dLL: " << dLL << std::endl;
-        std::cerr << "                        sum_refw: " << sum_refw << std::endl;
-        std::cerr << "                      my_mindiff: " << my_mindiff << std::endl;
-        std::cerr << "                    sigma_noise2: " << sigma_noise2 << std::endl;
-        std::cerr << "                           ddim2: " << ddim2 << std::endl;
-        //std::cerr << "                        dfsigma2: " << dfsigma2 << std::endl;
-        std::cerr << "                       wsum_corr: " << wsum_corr << std::endl;
-        std::cerr << "                     wsum_offset: " << wsum_offset << std::endl;
-        //        std::cerr << "                            refw: ";
-        //        for (int refno = 0; refno < model.n_ref; ++refno)
-        //            std::cerr << std::setw(15) << refw[refno];
-        //        std::cerr<< std::endl;
-        //        std::cerr << "                     refw_mirror: ";
-        //        for (int refno = 0; refno < model.n_ref; ++refno)
-        //            std::cerr << std::setw(15) << refw_mirror[refno];
-        //        std::cerr<< std::endl;
-        //        log.close();
-        //        mode = std::ios::out|std::ios::app;
-    }
-#endif
-#undef DEBUG_JM1
-
-    LL += dLL;
+        w.dLL = log(w.sum_refw) + df2 * log(1. + (2. * my_mindiff / dfsigma2))
+                - ddim2 * log(sqrt(PI * df * sigma_noise2)) + gammln(-df2)
+                - gammln(df / 2.);
 
-#ifdef TIMING
+    w.LL += w.dLL;
 
-    timer.toc(ESI_E6TH);
-
-#endif
 }//close function expectationSingleImage
 
-/** Function to create threads that will work later */
-void ProgML2D::createThreads()
+void ProgML2D::expectationSingleImageRefno(ML2DThreadWork &w, int refno)
 {
+    double diff;
+    double aux, pdf, fracpdf, A2_plus_Xi2;
+    double weight, stored_weight, weight2 = 0, my_maxweight;
+    double my_sumweight, my_sumstoredweight, ref_scale = 1.;
+    int irot, output_irefmir, refnoipsi, output_refnoipsi;
+    //Some local variables to store partial sums of the sums of the image
+    double local_mindiff, local_wsum_corr, local_wsum_offset, maxw_ref;
+    double local_wsum_sc, local_wsum_sc2, local_maxweight, local_maxweight2=0.0;
+    double sigma_noise2 = model.sigma_noise * model.sigma_noise;
+    int local_iopty=0, local_ioptx=0, local_iopt_psi=0, local_iopt_flip=0,
+    local_opt_refno=0;
 
-    //Initialize some variables for using for threads
+    MultidimArray<double> &Maux = w.Maux;
+    MultidimArray<double> &Mweight = w.Mweight;
+    MultidimArray<std::complex<double> > &Faux = w.Faux;
 
-    th_ids = new pthread_t[threads];
-    threads_d = new structThreadTasks[threads];
+    if (nr_nomirror_flips == 0)
+    {
+        std::ostringstream msg;
+        msg << "Division by zero: nr_nomirror_flips == 0";
+        throw std::runtime_error(msg.str());
+    }
 
-    barrier_init(&barrier, threads + 1);
-    barrier_init(&barrier2, threads + 1);
-    barrier_init(&barrier3, threads);//Main thread will not wait here
+    int output_refno = w.mygroup * model.n_ref + refno;
+    w.refw[output_refno] = w.refw2[output_refno] = w.refw_mirror[output_refno] = 0.;
+    local_maxweight = -99.e99;
+    local_mindiff = 99.e99;
+    local_wsum_sc = local_wsum_sc2 = local_wsum_corr = local_wsum_offset = 0;
+    // Initialize my weighted sums
+    for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
+    {
+        output_refnoipsi = output_refno * nr_psi + ipsi;
+        w.mysumimgs[output_refnoipsi].initZeros(dim, hdim + 1);
+        w.sumw_refpsi[output_refnoipsi] = 0.;
+    }
 
-    for (int i = 0; i < threads; i++)
+    // This if is for limited rotation options
+    if (!limit_rot || w.pdf_directions[refno] > 0.)
     {
-        threads_d[i].thread_id = i;
-        threads_d[i].prm = this;
+        if (model.do_norm)
+            ref_scale = w.opt_scale / model.scale[refno];
 
-        int result = pthread_create((th_ids + i), nullptr, doThreadsTasks,
-                                    (void *) (threads_d + i));
+        A2_plus_Xi2 = 0.5 * (ref_scale * ref_scale * A2[refno] + w.Xi2);
 
-        if (result != 0)
+        maxw_ref = -99.e99;
+        for (size_t iflip = 0; iflip < nr_flip; iflip++)
         {
-            REPORT_ERROR(ERR_THREADS_NOTINIT, "");
-        }
-    }
-
-}//close function createThreads
+            if (iflip == nr_nomirror_flips)
+                maxw_ref = -99.e99;
+            for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
+            {
+                refnoipsi = refno * nr_psi + ipsi;
+                output_refnoipsi = output_refno * nr_psi + ipsi;
+                irot = iflip * nr_psi + ipsi;
+                output_irefmir  = (int)floor(iflip / nr_nomirror_flips)
+                                  * factor_nref * model.n_ref + refno;
+
+                // This if is the speed-up caused by the -fast options
+                if (dAij(w.Msignificant, refno, irot))
+                {
+                    if (iflip < nr_nomirror_flips)
+                        fracpdf = model.alpha_k[refno] * (1. - model.mirror_fraction[refno]);
+                    else
+                        fracpdf = model.alpha_k[refno] * model.mirror_fraction[refno];
+
+                    // A. Backward FFT to calculate weights in real-space
+                    //Set this references to avoid indexing inside the heavy loop
+                    Faux = w.Fimg_flip[iflip];
+                    MultidimArray<std::complex<double> > & fref_aux = fref[refnoipsi];
+                    FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
+                    {
+                        DIRECT_MULTIDIM_ELEM(Faux, n) *= DIRECT_MULTIDIM_ELEM(fref_aux, n);
+                    }
+                    // Takes the input from Faux, and leaves the output in Maux
+                    w.transformer.inverseFourierTransform();
+                    //CenterFFT(Maux, true);
+                    centerFFT2(Maux);
 
-/** Free threads memory and exit */
-void ProgML2D::destroyThreads()
-{
-    threadTask = TH_EXIT;
-    barrier_wait(&barrier);
-    delete[] th_ids;
-    delete[] threads_d;
-}
+                    // B. Calculate weights for each pixel within sigdim (Mweight)
+                    my_sumweight = my_sumstoredweight = my_maxweight = 0.;
 
-/// Function for threads do different tasks
-void * doThreadsTasks(void * data)
-{
-    auto * thread_data = (structThreadTasks *) data;
+                    FOR_ALL_ELEMENTS_IN_ARRAY2D(Mweight)
+                    {
+                        diff = A2_plus_Xi2 - ref_scale * A2D_ELEM(Maux, i, j) * ddim2;
+                        pdf = fracpdf * A2D_ELEM(P_phi, i, j);
 
-    ProgML2D * prm = thread_data->prm;
+                        if (!model.do_student)
+                        {
+                            // Normal distribution
+                            aux = (diff - w.trymindiff) / sigma_noise2;
+                            // next line because of numerical precision of exp-function
+                            weight = (aux > 1000.) ? 0. : exp(-aux) * pdf;
+                            // store weight
+                            A2D_ELEM(Mweight, i, j) = stored_weight = weight;
+                            // calculate weighted sum of (X-A)^2 for sigma_noise update
+                            local_wsum_corr += weight * diff;
+                        }
+                        else
+                        {
+                            // t-student distribution
+                            // pdf = (1 + diff2/sigma2*df)^df2
+                            // Correcting for mindiff:
+                            // pdfc = (1 + diff2/sigma2*df)^df2 / (1 + mindiff/sigma2*df)^df2
+                            //      = ( (1 + diff2/sigma2*df)/(1 + mindiff/sigma2*df) )^df2
+                            //      = ( (sigma2*df + diff2) / (sigma2*df + mindiff) )^df2
+                            // Extra factor two because we saved 0.5*diff2!!
+                            aux = (dfsigma2 + 2. * diff)
+                                  / (dfsigma2 + 2. * w.trymindiff);
+                            weight = pow(aux, df2) * pdf;
+                            // Calculate extra weight acc. to Eq (10) Wang et al.
+                            // Patt. Recognition Lett. 25, 701-710 (2004)
+                            weight2 = (df + ddim2) / (df + (2. * diff / sigma_noise2));
+                            // Store probability weights
+                            stored_weight = weight * weight2;
+                            A2D_ELEM(Mweight, i, j) = stored_weight;
+                            // calculate weighted sum of (X-A)^2 for sigma_noise update
+                            local_wsum_corr += stored_weight * diff;
+                            w.refw2[output_refno] += stored_weight;
+                        }
 
-    barrier_t & barrier = prm->barrier;
-    barrier_t & barrier2 = prm->barrier2;
+                        local_mindiff = XMIPP_MIN(local_mindiff, diff);
 
-    //Loop until the threadTask become TH_EXIT
+                        // Accumulate sum weights for this (my) matrix
+                        my_sumweight += weight;
+                        my_sumstoredweight += stored_weight;
+                        // calculated weighted sum of offsets as well
+                        local_wsum_offset += weight * A2D_ELEM(Mr2, i, j);
 
-    do
-    {
-        //Wait until main threads order to start
-        //debug_print("Waiting on barrier, th ", thread_id);
-        barrier_wait(&barrier);
+                        if (model.do_norm)
+                        {
+                            // weighted sum of Sum_j ( X_ij*A_kj )
+                            local_wsum_sc += stored_weight * (A2_plus_Xi2 - diff) / ref_scale;
+                            // weighted sum of Sum_j ( A_kj*A_kj )
+                            local_wsum_sc2 += stored_weight * A2[refno];
+                        }
 
-        //Check task to do
+                        // keep track of optimal parameters
+                        my_maxweight = XMIPP_MAX(my_maxweight, weight);
 
-        switch (prm->threadTask)
-        {
+                        if (weight > local_maxweight)
+                        {
+                            if (model.do_student)
+                                local_maxweight2 = weight2;
+                            local_maxweight = weight;
+                            local_iopty = i;
+                            local_ioptx = j;
+                            local_iopt_psi = ipsi;
+                            local_iopt_flip = iflip;
+                            local_opt_refno = output_refno;
+                        }
 
-        case TH_PFS_REFNO:
-            prm->doThreadPreselectFastSignificantRefno();
-            break;
+                        if (fast_mode && weight > maxw_ref)
+                        {
+                            maxw_ref = weight;
+                            w.iopty_ref[output_irefmir] = i;
+                            w.ioptx_ref[output_irefmir] = j;
+                            w.ioptflip_ref[output_irefmir] = iflip;
+                        }
 
-        case TH_ESI_REFNO:
-            prm->doThreadExpectationSingleImageRefno();
-            break;
+                    } // close for over all elements in Mweight
 
-        case TH_ESI_UPDATE_REFNO:
-            prm->doThreadESIUpdateRefno();
-            break;
+                    // C. only for significant settings, store weighted sums
+                    if (my_maxweight > SIGNIFICANT_WEIGHT_LOW * w.maxweight)
+                    {
+                        w.sumw_refpsi[output_refno * nr_psi + ipsi] += my_sumstoredweight;
 
-        case TH_RR_REFNO:
-            prm->doThreadRotateReferenceRefno();
-            break;
+                        if (iflip < nr_nomirror_flips)
+                            w.refw[output_refno] += my_sumweight;
+                        else
+                            w.refw_mirror[output_refno] += my_sumweight;
 
-        case TH_RRR_REFNO:
-            prm->doThreadReverseRotateReferenceRefno();
-            break;
+                        // Back from smaller Mweight to original size of Maux
+                        Maux.initZeros();
 
-        case TH_EXIT:
-            pthread_exit(nullptr);
-            break;
+                        FOR_ALL_ELEMENTS_IN_ARRAY2D(Mweight)
+                        {
+                            A2D_ELEM(Maux, i, j) = A2D_ELEM(Mweight, i, j);
+                        }
 
-        }
+                        // Use forward FFT in convolution theorem again
+                        // Takes the input from Maux and leaves it in Faux
+                        w.transformer.FourierTransform();
 
-        barrier_wait(&barrier2);
+                        MultidimArray< std::complex<double> > &mysumimgs_ref = w.mysumimgs[output_refnoipsi];
+                        MultidimArray< std::complex<double> > &Fimg_flip_ref = w.Fimg_flip[iflip];
 
-    }
-    while (1);
+                        FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
+                        {
+                            DIRECT_MULTIDIM_ELEM(mysumimgs_ref, n) +=
+                                conj(DIRECT_MULTIDIM_ELEM(Faux,n)) * DIRECT_MULTIDIM_ELEM(Fimg_flip_ref,n);
+                        }
+                    }
+                } // close if Msignificant
+            } // close for ipsi
+        } // close for iflip
+    } // close if pdf_directions
 
-}//close function doThreadsTasks
+    //Update maxweight
+    if (local_maxweight > w.maxweight)
+    {
+        w.maxweight = local_maxweight;
 
+        if (model.do_student)
+            w.maxweight2 = local_maxweight2;
+        else
+            w.maxweight2 = 0.;
+        w.iopty = local_iopty;
+        w.ioptx = local_ioptx;
+        w.iopt_psi = local_iopt_psi;
+        w.iopt_flip = local_iopt_flip;
+        w.opt_refno = local_opt_refno;
+    }
 
-/// Function to assign refno jobs to threads
-/// the starting refno is passed through the out refno parameter
-/// and is returned the number of refno's to do, 0 if no more refno's.
-int ProgML2D::getThreadRefnoJob(int &refno)
-{
-    int load = 0;
+    //Update sums
+    w.sum_refw += w.refw[output_refno] + w.refw_mirror[output_refno];
+    w.wsum_offset += local_wsum_offset;
+    w.wsum_corr += local_wsum_corr;
 
-    pthread_mutex_lock(&refno_mutex);
+    w.mindiff = XMIPP_MIN(w.mindiff, local_mindiff);
 
-    if (refno_count < model.n_ref)
+    if (model.do_norm)
     {
-        load = XMIPP_MIN(refno_load, model.n_ref - refno_count);
-        refno = refno_index;
-        refno_index = (refno_index + load) % model.n_ref;
-        refno_count += load;
+        w.wsum_sc += local_wsum_sc;
+        w.wsum_sc2 += local_wsum_sc2;
     }
 
-    pthread_mutex_unlock(&refno_mutex);
-
-    return load;
-}//close function getThreadRefnoJob
-
-///Function for awake threads for different tasks
-void ProgML2D::awakeThreads(ThreadTask task, int start_refno, int load)
-{
-    threadTask = task;
-    refno_index = start_refno;
-    refno_count = 0;
-    refno_load = load;
-    barrier_wait(&barrier);
-    //Wait until done
-    barrier_wait(&barrier2);
-}//close function awakeThreads
-
+}//close function expectationSingleImageRefno
 
-void ProgML2D::doThreadRotateReferenceRefno()
+void ProgML2D::updateWeightedSums(ML2DThreadWork &w)
 {
-#ifdef DEBUG
-    std::cerr << "entering doThreadRotateReference " << std::endl;
-#endif
-
-    double AA, stdAA=0., psi, dum, avg;
-    MultidimArray<double> Maux(dim, dim);
-    MultidimArray<std::complex<double> > Faux;
-    FourierTransformer local_transformer;
-    int refnoipsi;
 
-    Maux.setXmippOrigin();
+    double scale_dim2_sumw = (w.opt_scale * ddim2) / w.sum_refw;
+    std::complex<double> cscale_dim2_sumw = scale_dim2_sumw;
+    int num_refs = model.n_ref * factor_nref;
 
-    FOR_ALL_THREAD_REFNO()
+    for (int refno = 0; refno < model.n_ref; refno++)
     {
-        computeStats_within_binary_mask(omask, model.Iref[refno](), dum,
-                                        dum, avg, dum);
-        for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
+        int output_refno = w.mygroup * model.n_ref + refno;
+
+        if (fast_mode)
         {
-            refnoipsi = refno * nr_psi + ipsi;
-            // Add arbitrary number (small_angle) to avoid 0-degree rotation (lacking interpolation)
-            psi = (double) (ipsi * psi_max / nr_psi) + SMALLANGLE;
-            rotate(xmipp_transformation::BSPLINE3, Maux, model.Iref[refno](), -psi, 'Z', xmipp_transformation::WRAP);
-            apply_binary_mask(mask, Maux, Maux, avg);
-            // Normalize the magnitude of the rotated references to 1st rot of that ref
-            // This is necessary because interpolation due to rotation can lead to lower overall Fref
-            // This would result in lower probabilities for those rotations
-            AA = Maux.sum2();
-            if (ipsi == 0)
+            const std::vector<int> &ioptx_ref = w.ioptx_ref;
+            const std::vector<int> &iopty_ref = w.iopty_ref;
+            const std::vector<int> &ioptflip_ref = w.ioptflip_ref;
+            for (int group = 0; group < factor_nref; group++)
             {
-                stdAA = AA;
-                A2[refno] = AA;
-            }
-
-            if (AA > 0)
-                Maux *= sqrt(stdAA / AA);
-
-            if (fast_mode)
-                mref[refnoipsi] = Maux;
+                int group_refno = group * model.n_ref + refno;
 
-            // Do the forward FFT
-            local_transformer.FourierTransform(Maux, Faux, false);
-
-            FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(Faux)
-            {
-                dAij(Faux, i, j) = conj(dAij(Faux, i, j));
+                // Update optimal offsets for refno (and its mirror)
+                w.allref_offsets[2 * group_refno] = -(double) ioptx_ref[output_refno]
+                                                    * MAT_ELEM(F[ioptflip_ref[output_refno]], 0, 0)
+                                                    - (double) iopty_ref[output_refno]
+                                                    * MAT_ELEM(F[ioptflip_ref[output_refno]], 0, 1);
+                w.allref_offsets[2 * group_refno + 1] = -(double) ioptx_ref[output_refno]
+                                                        * MAT_ELEM(F[ioptflip_ref[output_refno]], 1, 0)
+                                                        - (double) iopty_ref[output_refno]
+                                                        * MAT_ELEM(F[ioptflip_ref[output_refno]], 1, 1);
+                if (do_mirror)
+                {
+                    w.allref_offsets[2 * (num_refs + group_refno)]
+                    = -(double) ioptx_ref[num_refs + output_refno]
+                      * MAT_ELEM(F[ioptflip_ref[num_refs + output_refno]], 0, 0)
+                      - (double) iopty_ref[num_refs + output_refno]
+                      * MAT_ELEM(F[ioptflip_ref[num_refs + output_refno]], 0, 1);
+                    w.allref_offsets[2 * (num_refs + group_refno) + 1]
+                    = -(double) ioptx_ref[num_refs + output_refno]
+                      * MAT_ELEM(F[ioptflip_ref[num_refs + output_refno]], 1, 0)
+                      - (double) iopty_ref[num_refs + output_refno]
+                      * MAT_ELEM(F[ioptflip_ref[num_refs + output_refno]], 1, 1);
+                }
             }
-
-            fref[refnoipsi] = Faux;
         }
 
-        // If we don't use save_mem1 Iref[refno] is useless from here on
-        //FIXME: Segmentation fault with blocks
-        //if (!save_mem1)
-        //    model.Iref[refno]().resize(0, 0);
-
-    }//close while
-
-}//close function doThreadRotateReferenceRefno
-
-void ProgML2D::doThreadReverseRotateReferenceRefno()
-{
-    double psi, dum, avg;
-    MultidimArray<double> Maux(dim, dim), Maux2(dim, dim), Maux3(dim, dim);
-    MultidimArray<std::complex<double> > Faux;
-    FourierTransformer local_transformer;
-
-    Maux.setXmippOrigin();
-    Maux2.setXmippOrigin();
-    Maux3.setXmippOrigin();
-
-    FOR_ALL_THREAD_REFNO()
-    {
-        Maux.initZeros();
-        wsum_Mref[refno] = Maux;
-        for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
+        if (!limit_rot || w.pdf_directions[refno] > 0.)
         {
-            // Add arbitrary number to avoid 0-degree rotation without interpolation effects
-            psi = (double) (ipsi * psi_max / nr_psi) + SMALLANGLE;
-            int refnoipsi = refno * nr_psi + ipsi;
-            // Do the backward FFT
-            // The construction with Faux and Maux3 should perhaps not be necessary,
-            // but I am having irreproducible segmentation faults for the iFFT
-            Faux = wsumimgs[refnoipsi];
-
-            local_transformer.inverseFourierTransform(Faux, Maux);
-            Maux3 = Maux;
-            //CenterFFT(Maux3, true);
-            centerFFT2(Maux3);
-            computeStats_within_binary_mask(omask, Maux3, dum, dum, avg, dum);
-            rotate(xmipp_transformation::BSPLINE3, Maux2, Maux3, psi, 'Z', xmipp_transformation::WRAP);
-            apply_binary_mask(mask, Maux2, Maux2, avg);
-            wsum_Mref[refno] += Maux2;
-        }
-
-    }//close while refno
-
-}//close function doThreadReverseRotateReference
-
-///Some macro definitions for the following function
-#define IIFLIP (imirror * nr_nomirror_flips + iflip)
-#define IROT (IIFLIP * nr_psi + ipsi)
-#define IREFMIR ()
-#define WEIGHT (dAij(pfs_weight, refno, IROT))
-#define MAX_WEIGHT (dAij(pfs_maxweight, imirror, refno))
-#define MSIGNIFICANT (dAij(Msignificant, refno, IROT))
-
-void ProgML2D::doThreadPreselectFastSignificantRefno()
-{
-    MultidimArray<double> Mtrans, Mflip;
-    double ropt, aux, diff, pdf, fracpdf;
-    double A2_plus_Xi2;
-    int irefmir;
-    Matrix1D<double> trans(2);
-    double local_mindiff;
-    double sigma_noise2 = model.sigma_noise * model.sigma_noise;
-    int nr_mirror = (do_mirror) ? 2 : 1;
+            double refw_total = w.refw[output_refno] + w.refw_mirror[output_refno];
+            w.sumw[output_refno] += refw_total / w.sum_refw;
+            w.sumw2[output_refno] += w.refw2[output_refno] / w.sum_refw;
+            w.sumw_mirror[output_refno] += w.refw_mirror[output_refno] / w.sum_refw;
 
-    Mtrans.resize(dim, dim);
-    Mtrans.setXmippOrigin();
-    Mflip.resize(dim, dim);
-    Mflip.setXmippOrigin();
+            if (model.do_student)
+            {
+                w.sumwsc[output_refno] += w.refw2[output_refno] * w.opt_scale / w.sum_refw;
+                w.sumwsc2[output_refno] += w.refw2[output_refno] * (w.opt_scale * w.opt_scale)
+                                           / w.sum_refw;
+            }
+            else
+            {
+                w.sumwsc[output_refno] += refw_total * w.opt_scale / w.sum_refw;
+                w.sumwsc2[output_refno] += refw_total * (w.opt_scale * w.opt_scale)
+                                           / w.sum_refw;
+            }
 
-    local_mindiff = 99.e99;
+            // Correct weighted sum of images for new bgmean (only first element=origin in Fimg)
+            if (model.do_norm)
+                for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
+                {
+                    int refnoipsi = output_refno * nr_psi + ipsi;
+                    dAij(w.mysumimgs[refnoipsi],0,0) -= w.sumw_refpsi[refnoipsi] * (w.bgmean - w.old_bgmean) / ddim2;
+                }
 
-    // A. Translate image and calculate probabilities for every rotation
-    FOR_ALL_THREAD_REFNO()
-    {
-        if (!limit_rot || pdf_directions[refno] > 0.)
-        {
-            A2_plus_Xi2 = 0.5 * (A2[refno] + Xi2);
-            for (int imirror = 0; imirror < nr_mirror; imirror++)
+            // Sum mysumimgs to the weighted sum of the thread
+            for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
             {
-                irefmir = imirror * model.n_ref + refno;
-                // Get optimal offsets
-                trans(0) = allref_offsets[2 * irefmir];
-                trans(1) = allref_offsets[2 * irefmir + 1];
-                ropt = sqrt(trans(0) * trans(0) + trans(1) * trans(1));
-                // Do not trust optimal offsets if they are larger than 3*sigma_offset:
-                if (ropt > 3 * model.sigma_offset)
+                int refnoipsi = output_refno * nr_psi + ipsi;
+                MultidimArray<std::complex<double> > &wsumimgs_ref = w.wsumimgs[refnoipsi];
+                const MultidimArray<std::complex<double> > &mysumimgs_ref = w.mysumimgs[refnoipsi];
+                FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(wsumimgs_ref)
                 {
-                    for (size_t iflip = 0; iflip < nr_nomirror_flips; iflip++)
-                        for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
-                            MSIGNIFICANT = 1;
+                    DIRECT_MULTIDIM_ELEM(wsumimgs_ref, n) += cscale_dim2_sumw * DIRECT_MULTIDIM_ELEM(mysumimgs_ref, n);
                 }
-                else
-                {
-                    translate(xmipp_transformation::LINEAR, Mtrans, Mimg, trans, true);
-                    for (size_t iflip = 0; iflip < nr_nomirror_flips; iflip++)
-                    {
-                        applyGeometry(xmipp_transformation::LINEAR, Mflip, Mtrans, F[IIFLIP], xmipp_transformation::IS_INV, xmipp_transformation::WRAP);
-                        for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
-                        {
-                            diff = A2_plus_Xi2;
-                            MultidimArray<double> &mref_ref = mref[refno*nr_psi + ipsi];
-                            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Mflip)
-                            {
-                                diff -= DIRECT_MULTIDIM_ELEM(Mflip, n) * DIRECT_MULTIDIM_ELEM(mref_ref, n);
-                            }
-                            WEIGHT = diff;
-                            if (diff < local_mindiff)
-                                local_mindiff = diff;
-                        }
-                    }
-                }//close else if ropt > ...
-            }//close for imirror
-        }//close if !limit_rot ...
-    }//close for_all refno
-
-    ///Update the real mindiff
-    pthread_mutex_lock(&update_mutex);
-    pfs_mindiff = XMIPP_MIN(pfs_mindiff, local_mindiff);
-    refno_index = refno_count = 0;
-    pthread_mutex_unlock(&update_mutex);
+            }
+        }
 
-    ///Wait for all threads update mindiff
-    barrier_wait(&barrier3);
-    local_mindiff = pfs_mindiff;
+    }//close for refno
 
-    // B. Now that we have local_mindiff, calculate the weights
-    FOR_ALL_THREAD_REFNO_NODECL()
-    {
+}//close function updateWeightedSums
 
-        if (!limit_rot || pdf_directions[refno] > 0.)
-        {
-            for (int imirror = 0; imirror < nr_mirror; imirror++)
-            {
-                irefmir = imirror * model.n_ref + refno;
-                // Get optimal offsets
-                trans(0) = allref_offsets[2 * irefmir];
-                trans(1) = allref_offsets[2 * irefmir + 1];
-                ///Calculate max_weight for this refno-mirror combination
-                for (size_t iflip = 0; iflip < nr_nomirror_flips; iflip++)
-                    for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
-                    {
-                        if (!MSIGNIFICANT)
-                        {
-                            fracpdf = model.alpha_k[refno] *
-                                      (imirror ? model.mirror_fraction[refno] : (1.- model.mirror_fraction[refno]));
-                            pdf = fracpdf * A2D_ELEM(P_phi, (int)trans(1), (int)trans(0));
-                            if (!model.do_student)
-                            {
-                                // normal distribution
-                                aux = (WEIGHT - local_mindiff) / sigma_noise2;
-                                // next line because of numerical precision of exp-function
-                                WEIGHT = (aux > 1000. ? 0. : exp(-aux) * pdf);
-                            }
-                            else
-                            {
-                                // t-student distribution
-                                aux = (dfsigma2 + 2. * WEIGHT) / (dfsigma2 + 2. * local_mindiff);
-                                WEIGHT = pow(aux, df2) * pdf;
-                            }
-                            if (WEIGHT > MAX_WEIGHT)
-                                MAX_WEIGHT = WEIGHT;
-                        }
-                    } // close ipsi
-                ///Now we have max_weight, set Msignificant values
-                for (size_t iflip = 0; iflip < nr_nomirror_flips; iflip++)
-                    for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
-                        if (!MSIGNIFICANT)
-                            MSIGNIFICANT = (WEIGHT >= C_fast * MAX_WEIGHT) ? 1 : 0;
-            }//close for imirror
-        } //endif limit_rot and pdf_directions
-    } //end for_all refno
+void ProgML2D::expectationImage(ML2DThreadWork &w, size_t imgno, const MultidimArray<double> &img)
+{
+    Matrix1D<double> opt_offsets(2);
+    double old_phi = -999., old_theta = -999.;
+    double opt_flip;
 
-}//close function doThreadPreselectFastSignificantRefno
+    w.mygroup = (factor_nref > 1) ? divide_equally_group(nr_images_global, factor_nref, imgno) : 0;
 
-void ProgML2D::doThreadExpectationSingleImageRefno()
-{
-    double diff;
-    double aux, pdf, fracpdf, A2_plus_Xi2;
-    double weight, stored_weight, weight2 = 0, my_maxweight;
-    double my_sumweight, my_sumstoredweight, ref_scale = 1.;
-    int irot, output_irefmir, refnoipsi, output_refnoipsi;
-    //Some local variables to store partial sums of global sums variables
-    double local_mindiff, local_wsum_corr, local_wsum_offset, maxw_ref;
-    double local_wsum_sc, local_wsum_sc2, local_maxweight, local_maxweight2=0.0;
-    double sigma_noise2 = model.sigma_noise * model.sigma_noise;
-    int local_iopty=0, local_ioptx=0, local_iopt_psi=0, local_iopt_flip=0,
-    local_opt_refno=0;
+    w.Mimg = img;
+    w.Mimg.setXmippOrigin();
+    w.Xi2 = w.Mimg.sum2();
 
-    MultidimArray<double> Maux, Mweight;
-    MultidimArray<std::complex<double> > Faux, Fzero(dim, hdim + 1);
-    FourierTransformer local_transformer;
+    // These two parameters speed up expectationSingleImage
+    w.opt_refno = imgs_optrefno[IMG_LOCAL_INDEX];
+    w.trymindiff = imgs_trymindiff[IMG_LOCAL_INDEX];
 
-    // Setup matrices
-    Maux.resize(dim, dim);
-    Maux.setXmippOrigin();
-    Mweight.resize(sigdim, sigdim);
-    Mweight.setXmippOrigin();
-    Fzero.initZeros();
-    local_transformer.setReal(Maux);
-    local_transformer.getFourierAlias(Faux);
-
-    // Start the loop over all refno at old_optrefno (=opt_refno from the previous iteration).
-    // This will speed-up things because we will find Pmax probably right away,
-    // and this will make the if-statement that checks SIGNIFICANT_WEIGHT_LOW
-    // effective right from the start
-    //std::cerr << "DEBUG_JM: doThreadExpectationSingleImageRefno: " << std::endl;
+    if (w.trymindiff < 0.)
+        // 90% of Xi2 may be a good idea (factor half because 0.5*diff is calculated)
+        w.trymindiff = trymindiff_factor * 0.5 * w.Xi2;
 
-    if (nr_nomirror_flips == 0)
+    w.opt_scale = 1.;
+    w.bgmean = 0.;
+    if (model.do_norm)
     {
-        std::ostringstream msg;
-        msg << "Division by zero: nr_nomirror_flips == 0";
-        throw std::runtime_error(msg.str()); 
+        w.bgmean = imgs_bgmean[IMG_LOCAL_INDEX];
+        w.opt_scale = imgs_scale[IMG_LOCAL_INDEX];
     }
 
-    FOR_ALL_THREAD_REFNO()
+    // Get optimal offsets for all references
+    if (fast_mode)
     {
+        w.allref_offsets = imgs_offsets[IMG_LOCAL_INDEX];
+    }
 
-        int output_refno = mygroup * model.n_ref + refno;
-        //        std::cerr << "DEBUG_JM:           refno: " << refno << std::endl;
-        //        std::cerr << "DEBUG_JM:     model.n_ref: " <<    model.n_ref << std::endl;
-        //        std::cerr << "DEBUG_JM:    output_refno: " <<    output_refno << std::endl;
-        refw[output_refno] = refw2[output_refno] = refw_mirror[output_refno] = 0.;
-        local_maxweight = -99.e99;
-        local_mindiff = 99.e99;
-        local_wsum_sc = local_wsum_sc2 = local_wsum_corr = local_wsum_offset = 0;
-        // Initialize my weighted sums
-        for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
-        {
-            output_refnoipsi = output_refno * nr_psi + ipsi;
-            mysumimgs[output_refnoipsi] = Fzero;
-            sumw_refpsi[output_refnoipsi] = 0.;
-        }
-
-        // This if is for limited rotation options
-        if (!limit_rot || pdf_directions[refno] > 0.)
-        {
-            if (model.do_norm)
-                ref_scale = opt_scale / model.scale[refno];
-
-            A2_plus_Xi2 = 0.5 * (ref_scale * ref_scale * A2[refno] + Xi2);
-
-            maxw_ref = -99.e99;
-            for (size_t iflip = 0; iflip < nr_flip; iflip++)
-            {
-                if (iflip == nr_nomirror_flips)
-                    maxw_ref = -99.e99;
-                for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
-                {
-                    refnoipsi = refno * nr_psi + ipsi;
-                    output_refnoipsi = output_refno * nr_psi + ipsi;
-                    irot = iflip * nr_psi + ipsi;
-                    output_irefmir  = (int)floor(iflip / nr_nomirror_flips)
-                                      * factor_nref * model.n_ref + refno;
-
-                    //#define DEBUG_JM2
-#ifdef DEBUG_JM2
-
-                    if (iter > 1)
-                    {
-                        std::cerr << iter << " iflip, ipsi, refno, irot: " << iflip << " " << ipsi << " " << refno << " " << irot << std::endl;
-                        std::cerr << iter << " A2_plus_Xi2: " << A2_plus_Xi2 << std::endl;
-                        std::cerr << "dAij(Msignificant): " << dAij(Msignificant, refno, irot) << std::endl;
-                    }
-#endif
-                    // This if is the speed-up caused by the -fast options
-                    if (dAij(Msignificant, refno, irot))
-                    {
-                        if (iflip < nr_nomirror_flips)
-                            fracpdf = model.alpha_k[refno] * (1. - model.mirror_fraction[refno]);
-                        else
-                            fracpdf = model.alpha_k[refno] * model.mirror_fraction[refno];
-
-                        // A. Backward FFT to calculate weights in real-space
-                        //Set this references to avoid indexing inside the heavy loop
-                        //MultidimArray<std::complex<double> > & Fimg_flip_aux = Fimg_flip[iflip];
-                        Faux = Fimg_flip[iflip];
-                        MultidimArray<std::complex<double> > & fref_aux = fref[refnoipsi];
-                        FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
-                        {
-                            DIRECT_MULTIDIM_ELEM(Faux, n) *= DIRECT_MULTIDIM_ELEM(fref_aux, n);
-                        }
-                        // Takes the input from Faux, and leaves the output in Maux
-                        local_transformer.inverseFourierTransform();
-                        //CenterFFT(Maux, true);
-                        centerFFT2(Maux);
-
-
-#ifdef DEBUG_JM2
-
-                        if (iter > 1)
-                            std::cerr
-                            << "Maux: " <<  std::endl << Maux
-                            << "Fimg_flip[iflip]" <<  std::endl<< Fimg_flip[iflip]
-                            << "fref[refnoipsi]" <<  std::endl<< fref[refnoipsi] << std::endl;
-#endif
-
-                        // B. Calculate weights for each pixel within sigdim (Mweight)
-                        my_sumweight = my_sumstoredweight = my_maxweight = 0.;
-
-                        FOR_ALL_ELEMENTS_IN_ARRAY2D(Mweight)
-                        {
-                            diff = A2_plus_Xi2 - ref_scale * A2D_ELEM(Maux, i, j) * ddim2;
-                            pdf = fracpdf * A2D_ELEM(P_phi, i, j);
-
-#ifdef DEBUG_JM2
-
-                            if (iter >= 2 && current_image == myFirstImg)
-                                std::cerr << "---------------------------------------" << std::endl
-                                << "   pdf " << pdf << std::endl
-                                << "   A2_plus_Xi2 " << A2_plus_Xi2 << std::endl
-                                << "   A2D_ELEM(Maux, i, j) " << A2D_ELEM(Maux, i, j) << std::endl
-                                << "   ref_scale " << ref_scale << std::endl
-                                << "   ddim2 " << ddim2 << std::endl
-                                << "diff " << diff << std::endl
-                                << "trymindiff " << trymindiff << std::endl
-                                << "sigma_noise2 " << sigma_noise2 << std::endl;
-#endif
-
-                            if (!model.do_student)
-                            {
-                                // Normal distribution
-                                aux = (diff - trymindiff) / sigma_noise2;
-                                // next line because of numerical precision of exp-function
-                                weight = (aux > 1000.) ? 0. : exp(-aux) * pdf;
-                                //#define DEBUG_JM2
-#ifdef DEBUG_JM2
-
-                                if (iter >=2 && current_image == myFirstImg && pdf > 0)
-                                    std::cerr << "aux = (diff - trymindiff) / sigma_noise2: " << aux << std::endl
-                                    << "weight: " << weight << std::endl;
-#endif
-#undef DEBUG_JM2
-                                // store weight
-                                A2D_ELEM(Mweight, i, j) = stored_weight = weight;
-                                // calculate weighted sum of (X-A)^2 for sigma_noise update
-                                local_wsum_corr += weight * diff;
-                            }
-                            else
-                            {
-                                // t-student distribution
-                                // pdf = (1 + diff2/sigma2*df)^df2
-                                // Correcting for mindiff:
-                                // pdfc = (1 + diff2/sigma2*df)^df2 / (1 + mindiff/sigma2*df)^df2
-                                //      = ( (1 + diff2/sigma2*df)/(1 + mindiff/sigma2*df) )^df2
-                                //      = ( (sigma2*df + diff2) / (sigma2*df + mindiff) )^df2
-                                // Extra factor two because we saved 0.5*diff2!!
-                                aux = (dfsigma2 + 2. * diff)
-                                      / (dfsigma2 + 2. * trymindiff);
-                                weight = pow(aux, df2) * pdf;
-                                // Calculate extra weight acc. to Eq (10) Wang et al.
-                                // Patt. Recognition Lett. 25, 701-710 (2004)
-                                weight2 = (df + ddim2) / (df + (2. * diff / sigma_noise2));
-                                // Store probability weights
-                                stored_weight = weight * weight2;
-                                A2D_ELEM(Mweight, i, j) = stored_weight;
-                                // calculate weighted sum of (X-A)^2 for sigma_noise update
-                                local_wsum_corr += stored_weight * diff;
-                                refw2[output_refno] += stored_weight;
-                            }
-
-                            local_mindiff = XMIPP_MIN(local_mindiff, diff);
-
-                            // Accumulate sum weights for this (my) matrix
-                            my_sumweight += weight;
-                            my_sumstoredweight += stored_weight;
-                            // calculated weighted sum of offsets as well
-                            local_wsum_offset += weight * A2D_ELEM(Mr2, i, j);
-
-                            if (model.do_norm)
-                            {
-                                // weighted sum of Sum_j ( X_ij*A_kj )
-                                local_wsum_sc += stored_weight * (A2_plus_Xi2 - diff) / ref_scale;
-                                // weighted sum of Sum_j ( A_kj*A_kj )
-                                local_wsum_sc2 += stored_weight * A2[refno];
-                            }
-
-                            // keep track of optimal parameters
-                            my_maxweight = XMIPP_MAX(my_maxweight, weight);
-
-                            if (weight > local_maxweight)
-                            {
-                                if (model.do_student)
-                                    local_maxweight2 = weight2;
-                                local_maxweight = weight;
-                                local_iopty = i;
-                                local_ioptx = j;
-                                local_iopt_psi = ipsi;
-                                local_iopt_flip = iflip;
-                                local_opt_refno = output_refno;
-                            }
-
-                            if (fast_mode && weight > maxw_ref)
-                            {
-                                maxw_ref = weight;
-                                iopty_ref[output_irefmir] = i;
-                                ioptx_ref[output_irefmir] = j;
-                                ioptflip_ref[output_irefmir] = iflip;
-                            }
-
-                        } // close for over all elements in Mweight
-
-#ifdef DEBUG_JM3
-                        if (iter == 3 && refno==0)
-                        {
-                            std::cerr << Mweight << std::endl;
-                            std::cerr << "maxweight: " << my_maxweight << " " << my_sumstoredweight << " " << my_sumweight << std::endl;
-                            exit(1);
-                        }
-#endif
-                        // C. only for significant settings, store weighted sums
-                        if (my_maxweight > SIGNIFICANT_WEIGHT_LOW * maxweight)
-                        {
-                            sumw_refpsi[output_refno * nr_psi + ipsi] += my_sumstoredweight;
-
-                            if (iflip < nr_nomirror_flips)
-                                refw[output_refno] += my_sumweight;
-                            else
-                                refw_mirror[output_refno] += my_sumweight;
+    // Read optimal orientations from memory
+    if (limit_rot)
+    {
+        old_phi = imgs_oldphi[IMG_LOCAL_INDEX];
+        old_theta = imgs_oldtheta[IMG_LOCAL_INDEX];
+    }
+    // For limited orientational search: preselect relevant directions
+    preselectLimitedDirections(old_phi, old_theta, w.pdf_directions);
 
-                            // Back from smaller Mweight to original size of Maux
-                            Maux.initZeros();
+    // Use a maximum-likelihood target function in real space
+    // with complete or reduced-space translational searches (-fast)
+    if (fast_mode)
+        preselectFastSignificant(w);
+    else
+        w.Msignificant.initConstant(1);
 
-                            FOR_ALL_ELEMENTS_IN_ARRAY2D(Mweight)
-                            {
-                                A2D_ELEM(Maux, i, j) = A2D_ELEM(Mweight, i, j);
-                            }
+    expectationSingleImage(w, opt_offsets);
 
-                            // Use forward FFT in convolution theorem again
-                            // Takes the input from Maux and leaves it in Faux
-                            local_transformer.FourierTransform();
+    // Write optimal offsets for all references to disc
+    if (fast_mode)
+    {
+        imgs_offsets[IMG_LOCAL_INDEX] = w.allref_offsets;
+    }
 
-                            MultidimArray< std::complex<double> > &mysumimgs_ref = mysumimgs[output_refnoipsi];
-                            MultidimArray< std::complex<double> > &Fimg_flip_ref = Fimg_flip[iflip];
+    // Store mindiff for next iteration
+    imgs_trymindiff[IMG_LOCAL_INDEX] = w.trymindiff;
 
-                            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
-                            {
-                                DIRECT_MULTIDIM_ELEM(mysumimgs_ref, n) +=
-                                    conj(DIRECT_MULTIDIM_ELEM(Faux,n)) * DIRECT_MULTIDIM_ELEM(Fimg_flip_ref,n);
-                            }
-                        }
-                    } // close if Msignificant
-                } // close for ipsi
-            } // close for iflip
-        } // close if pdf_directions
-
-        pthread_mutex_lock(&update_mutex);
-        //Update maxweight
-        if (local_maxweight > maxweight)
-        {
-            maxweight = local_maxweight;
+    // Store opt_refno for next iteration
+    imgs_optrefno[IMG_LOCAL_INDEX] = w.opt_refno;
 
-            if (model.do_student)
-                maxweight2 = local_maxweight2;
-            else
-            	maxweight2=0.;
-            iopty = local_iopty;
-            ioptx = local_ioptx;
-            iopt_psi = local_iopt_psi;
-            iopt_flip = local_iopt_flip;
-            opt_refno = local_opt_refno;
-        }
+    // Store optimal phi and theta in memory
+    if (limit_rot)
+    {
+        imgs_oldphi[IMG_LOCAL_INDEX] = model.Iref[w.opt_refno % model.n_ref].rot();
+        imgs_oldtheta[IMG_LOCAL_INDEX] = model.Iref[w.opt_refno % model.n_ref].tilt();
+    }
 
-        //Update sums
-        sum_refw += refw[output_refno] + refw_mirror[output_refno];
-        wsum_offset += local_wsum_offset;
-        wsum_corr += local_wsum_corr;
+    // Store optimal normalization parameters in memory
+    if (model.do_norm)
+    {
+        imgs_scale[IMG_LOCAL_INDEX] = w.opt_scale;
+        imgs_bgmean[IMG_LOCAL_INDEX] = w.bgmean;
+    }
 
+    // Output docfile
+    opt_flip = 0.;
+    double opt_psi = w.opt_psi;
+    if (-opt_psi > 360.)
+    {
+        opt_psi += 360.;
+        opt_flip = 1.;
+    }
 
+    dAij(docfiledata,IMG_LOCAL_INDEX,0)
+    = model.Iref[w.opt_refno % model.n_ref].rot(); // rot
+    dAij(docfiledata,IMG_LOCAL_INDEX,1)
+    = model.Iref[w.opt_refno % model.n_ref].tilt(); // tilt
+    dAij(docfiledata,IMG_LOCAL_INDEX,2) = opt_psi + 360.; // psi
+    dAij(docfiledata,IMG_LOCAL_INDEX,3) = opt_offsets(0); // Xoff
+    dAij(docfiledata,IMG_LOCAL_INDEX,4) = opt_offsets(1); // Yoff
+    dAij(docfiledata,IMG_LOCAL_INDEX,5) = (double) (w.opt_refno + 1); // Ref
+    dAij(docfiledata,IMG_LOCAL_INDEX,6) = opt_flip; // Mirror
+    dAij(docfiledata,IMG_LOCAL_INDEX,7) = w.fracweight; // P_max/P_tot
+    dAij(docfiledata,IMG_LOCAL_INDEX,8) = w.dLL; // log-likelihood
+    if (model.do_norm)
+    {
+        dAij(docfiledata,IMG_LOCAL_INDEX,9) = w.bgmean; // background mean
+        dAij(docfiledata,IMG_LOCAL_INDEX,10) = w.opt_scale; // image scale
+    }
+    if (model.do_student)
+    {
+        dAij(docfiledata,IMG_LOCAL_INDEX,11) = w.maxweight2; // Robustness weight
+    }
 
-        mindiff = XMIPP_MIN(mindiff, local_mindiff);
+}//close function expectationImage
 
-        if (model.do_norm)
-        {
-            wsum_sc += local_wsum_sc;
-            wsum_sc2 += local_wsum_sc2;
-        }
-        pthread_mutex_unlock(&update_mutex);
+/** Free threads memory and exit */
+void ProgML2D::destroyThreads()
+{
+    ML2DBaseProgram::destroyThreads();
+    threadWork.clear();
+}
 
-        //Ask for next job
-    } // close while refno
+void ProgML2D::prepareThreadWork()
+{
+    int num_output_refs = factor_nref * model.n_ref;
+    int nr_threads = scheduler.getThreads();
 
-#define DP(x) << std::setw(15) << x
-    //#define DEBUG_JM
-#ifdef DEBUG_JM
-    if (iter > 1)
+    if ((int)threadWork.size() != nr_threads)
     {
-        std::cerr << "DEBUG_JM: ====== iter: " << iter << "======= block: " << current_block << std::endl;
-
-        std::cerr << formatString("====> img: %lu\n", current_image);
-        std::cerr << "Xi2: " << Xi2 << std::endl;
-        std::cerr << "sum_refw: " << sum_refw << std::endl;
-
-        std::cerr DP("A2") DP("refw") DP("refw_mirror") << std::endl;
-        for (int refno = 0; refno < model.n_ref; ++refno)
-            std::cerr DP(A2[refno]) DP(refw[refno]) DP(refw_mirror[refno]) << std::endl;
-        //                        std::cerr << "local_wsum_corr: " << local_wsum_corr << std::endl;
-        //                        std::cerr << "wsum_corr: " << wsum_corr << std::endl;
-        if (iter > 2)
+        threadWork.clear();
+        for (int thread = 0; thread < nr_threads; thread++)
         {
-            std::cerr << "DEBUG_JM: ..............EXITING....................: "  << std::endl;
-
-            exit(1);
+            threadWork.emplace_back(std::make_unique<ML2DThreadWork>());
+            ML2DThreadWork &w = *threadWork.back();
+            w.id = thread;
         }
     }
-#endif
-#undef DEBUG_JM
-
-
-
-}//close function doThreadExpectationSingleImage
 
-void ProgML2D::doThreadESIUpdateRefno()
-{
-
-    double scale_dim2_sumw = (opt_scale * ddim2) / sum_refw;
-    int num_refs = model.n_ref * factor_nref;
-
-    FOR_ALL_THREAD_REFNO()
+    for (auto &ptr : threadWork)
     {
-        int output_refno = mygroup * model.n_ref + refno;
-
-        if (fast_mode)
+        ML2DThreadWork &w = *ptr;
+        // The transformer keeps working on Maux and Faux
+        if (XSIZE(w.Maux) != dim || YSIZE(w.Maux) != dim)
         {
-            for (int group = 0; group < factor_nref; group++)
-            {
-                int group_refno = group * model.n_ref + refno;
-
-                // Update optimal offsets for refno (and its mirror)
-                allref_offsets[2 * group_refno] = -(double) ioptx_ref[output_refno]
-                                                  * MAT_ELEM(F[ioptflip_ref[output_refno]], 0, 0)
-                                                  - (double) iopty_ref[output_refno]
-                                                  * MAT_ELEM(F[ioptflip_ref[output_refno]], 0, 1);
-                allref_offsets[2 * group_refno + 1] = -(double) ioptx_ref[output_refno]
-                                                      * MAT_ELEM(F[ioptflip_ref[output_refno]], 1, 0)
-                                                      - (double) iopty_ref[output_refno]
-                                                      * MAT_ELEM(F[ioptflip_ref[output_refno]], 1, 1);
-                if (do_mirror)
-                {
-                    allref_offsets[2 * (num_refs + group_refno)]
-                    = -(double) ioptx_ref[num_refs + output_refno]
-                      * MAT_ELEM(F[ioptflip_ref[num_refs + output_refno]], 0, 0)
-                      - (double) iopty_ref[num_refs + output_refno]
-                      * MAT_ELEM(F[ioptflip_ref[num_refs + output_refno]], 0, 1);
-                    allref_offsets[2 * (num_refs + group_refno) + 1]
-                    = -(double) ioptx_ref[num_refs + output_refno]
-                      * MAT_ELEM(F[ioptflip_ref[num_refs + output_refno]], 1, 0)
-                      - (double) iopty_ref[num_refs + output_refno]
-                      * MAT_ELEM(F[ioptflip_ref[num_refs + output_refno]], 1, 1);
-                }
-            }
+            w.Maux.resizeNoCopy(dim, dim);
+            w.Maux.setXmippOrigin();
+            w.transformer.setReal(w.Maux);
+            w.transformer.getFourierAlias(w.Faux);
         }
-
-        if (!limit_rot || pdf_directions[refno] > 0.)
+        w.Mweight.initZeros(sigdim, sigdim);
+        w.Mweight.setXmippOrigin();
+        w.Msignificant.resizeNoCopy(model.n_ref, nr_psi * nr_flip);
+
+        w.refw.resize(num_output_refs);
+        w.refw2.resize(num_output_refs);
+        w.refw_mirror.resize(num_output_refs);
+        w.sumw_refpsi.resize(num_output_refs * nr_psi);
+        w.mysumimgs.resize(num_output_refs * nr_psi);
+        if (fast_mode)
         {
-            sumw[output_refno] += (refw[output_refno] + refw_mirror[output_refno]) / sum_refw;
-            sumw2[output_refno] += refw2[output_refno] / sum_refw;
-            sumw_mirror[output_refno] += refw_mirror[output_refno] / sum_refw;
-
-            if (model.do_student)
-            {
-                sumwsc[output_refno] += refw2[output_refno] * opt_scale / sum_refw;
-                sumwsc2[output_refno] += refw2[output_refno] * (opt_scale * opt_scale)
-                                         / sum_refw;
-            }
-            else
-            {
-                sumwsc[output_refno] += (refw[output_refno] + refw_mirror[output_refno])
-                                        * opt_scale / sum_refw;
-                sumwsc2[output_refno] += (refw[output_refno] + refw_mirror[output_refno])
-                                         * (opt_scale * opt_scale) / sum_refw;
-            }
-
-            std::complex<double> cscale_dim2_sumw=scale_dim2_sumw;
-            for (size_t ipsi = 0; ipsi < nr_psi; ipsi++)
-            {
-                int refnoipsi = output_refno * nr_psi + ipsi;
-                // Correct weighted sum of images for new bgmean (only first element=origin in Fimg)
-                if (model.do_norm)
-                    dAij(mysumimgs[refnoipsi],0,0) -= sumw_refpsi[refnoipsi] * (bgmean - old_bgmean) / ddim2;
-                // Sum mysumimgs to the global weighted sum
-                wsumimgs[refnoipsi] += (cscale_dim2_sumw * mysumimgs[refnoipsi]);
-            }
+            int mysize = num_output_refs * (do_mirror ? 2 : 1);
+            w.ioptx_ref.resize(mysize);
+            w.iopty_ref.resize(mysize);
+            w.ioptflip_ref.resize(mysize);
         }
 
-    }//close while refno
-
-}//close function doThreadESIUpdateRefno
+        w.LL = w.sumfracweight = w.wsum_sigma_noise = w.wsum_sigma_offset = 0.;
+        w.sumw.assign(num_output_refs, 0.);
+        w.sumw2.assign(num_output_refs, 0.);
+        w.sumwsc.assign(num_output_refs, 0.);
+        w.sumwsc2.assign(num_output_refs, 0.);
+        w.sumw_mirror.assign(num_output_refs, 0.);
+    }
+}
 
 void ProgML2D::iteration()
 {
@@ -1721,23 +1548,19 @@ void ProgML2D::expectation()
     std::cerr<<"entering expectation"<<std::endl;
 #endif
 
-#ifdef TIMING
+    // Update sigdim, i.e. the number of pixels that will be considered in the translations
+    sigdim = 2 * CEIL(XMIPP_MAX(1,model.sigma_offset) * (save_mem2 ? 3 : 6));
+    sigdim++; // (to get uneven number)
+    sigdim = XMIPP_MIN(dim, sigdim);
 
-    timer.tic(E_RR);
-#endif
+    prepareThreadWork();
 
     rotateReference();
-#ifdef TIMING
-
-    timer.toc(E_RR);
-    timer.tic(E_PRE);
-#endif
     // Pre-calculate pdf of all in-plane transformations
     calculatePdfInplane();
 
     // Initialize weighted sums
     LL = 0.;
-    wsumimgs.clear();
 
     sumw.assign(num_output_refs, 0.);
     sumw2.assign(num_output_refs, 0.);
@@ -1750,19 +1573,8 @@ void ProgML2D::expectation()
     sumfracweight = 0.;
 
     Fdzero.initZeros();
-    wsumimgs.assign(num_output_refs * nr_psi, Fdzero);
-
-    // Local variables of old threadExpectationSingleImage
-    Image<double> img;
-    FileName fn_img, fn_tkrans;
-    Matrix1D<double> opt_offsets(2);
-    double old_phi = -999., old_theta = -999.;
-    double opt_flip;
-
-    //Some initializations
-    opt_scale = 1., bgmean = 0.;
-
-    Msignificant.resizeNoCopy(model.n_ref, nr_psi * nr_flip);
+    for (auto &ptr : threadWork)
+        ptr->wsumimgs.assign(num_output_refs * nr_psi, Fdzero);
 
     static size_t img_done;
     if (current_block == 0) //when not iem current block is always 0
@@ -1773,145 +1585,58 @@ void ProgML2D::expectation()
 
     String _msg = formatString("Images: %lu, first: %lu, last: %lu", nr_images_local, myFirstImg, myLastImg);
     LOG(_msg.c_str());
-    //std::cerr << "-----xmipp_current: Expectation, iter " << iter << "-------" << std::endl;
-    //for (int imgno = 0, img_done = 0; imgno < nn; imgno++)
-    // Loop over all images
+
+    // Images of the current block
+    std::vector<size_t> block_imgs;
     FOR_ALL_LOCAL_IMAGES()
     {
-
         if (IMG_BLOCK(imgno) == current_block)
-        {
-            current_image = imgno;
-            //std::cerr << "\n ======>>> imgno: " << imgno << std::endl;
-            mygroup = (factor_nref > 1) ? divide_equally_group(nr_images_global, factor_nref, imgno) : 0;
+            block_imgs.push_back(imgno);
+    }
 
-            MDimg.getValue(MDL_IMAGE, fn_img, img_id[imgno]);
+    // Each image is a task; the images are read in batches of load images per thread
+    size_t batch_size = scheduler.getThreads() * XMIPP_MAX(1, thread_load);
+    std::vector<MultidimArray<double> > batch_imgs(batch_size);
+    Image<double> img;
+    FileName fn_img;
+    for (size_t first = 0; first < block_imgs.size(); first += batch_size)
+    {
+        size_t nr_batch = XMIPP_MIN(batch_size, block_imgs.size() - first);
+        // The metadata is not accessed by the threads
+        for (size_t i = 0; i < nr_batch; i++)
+        {
+            MDimg.getValue(MDL_IMAGE, fn_img, img_id[block_imgs[first + i]]);
             img.read(fn_img);
-            img().setXmippOrigin();
-            Xi2 = img().sum2();
-            Mimg = img();
-
-
-            //#define DEBUG_JM1
-#ifdef DEBUG_JM1
-
-            //if (iter >= 2 && current_image == myFirstImg)
-            printf("   ====================>>> Iter: %02d Image: %06lu: \n", iter, imgno);
-            printf("                                     fn_img: %s", fn_img.c_str());
-            //printf("                                    mygroup: %d", mygroup);
-#endif
-#undef DEBUG_JM1
-
-            // These two parameters speed up expectationSingleImage
-            opt_refno = imgs_optrefno[IMG_LOCAL_INDEX];
-            trymindiff = imgs_trymindiff[IMG_LOCAL_INDEX];
-
-            if (trymindiff < 0.)
-                // 90% of Xi2 may be a good idea (factor half because 0.5*diff is calculated)
-                trymindiff = trymindiff_factor * 0.5 * Xi2;
-
-            if (model.do_norm)
-            {
-                bgmean = imgs_bgmean[IMG_LOCAL_INDEX];
-                opt_scale = imgs_scale[IMG_LOCAL_INDEX];
-            }
-
-            // Get optimal offsets for all references
-            if (fast_mode)
-            {
-                allref_offsets = imgs_offsets[IMG_LOCAL_INDEX];
-            }
-
-            // Read optimal orientations from memory
-            if (limit_rot)
-            {
-                old_phi = imgs_oldphi[IMG_LOCAL_INDEX];
-                old_theta = imgs_oldtheta[IMG_LOCAL_INDEX];
-            }
-            // For limited orientational search: preselect relevant directions
-            preselectLimitedDirections(old_phi, old_theta);
-
-            // Use a maximum-likelihood target function in real space
-            // with complete or reduced-space translational searches (-fast)
-            if (fast_mode)
-                preselectFastSignificant();
-            else
-                Msignificant.initConstant(1);
-
-            expectationSingleImage(opt_offsets);
-
-            // Write optimal offsets for all references to disc
-            if (fast_mode)
-            {
-                imgs_offsets[IMG_LOCAL_INDEX] = allref_offsets;
-            }
-
-            // Store mindiff for next iteration
-            imgs_trymindiff[IMG_LOCAL_INDEX] = trymindiff;
-
-            // Store opt_refno for next iteration
-            imgs_optrefno[IMG_LOCAL_INDEX] = opt_refno;
-
-            // Store optimal phi and theta in memory
-            if (limit_rot)
-            {
-                imgs_oldphi[IMG_LOCAL_INDEX] = model.Iref[opt_refno % model.n_ref].rot();
-                imgs_oldtheta[IMG_LOCAL_INDEX] = model.Iref[opt_refno % model.n_ref].tilt();
-            }
-
-            // Store optimal normalization parameters in memory
-            if (model.do_norm)
-            {
-                imgs_scale[IMG_LOCAL_INDEX] = opt_scale;
-                imgs_bgmean[IMG_LOCAL_INDEX] = bgmean;
-            }
-
-            // Output docfile
-            opt_flip = 0.;
-            if (-opt_psi > 360.)
-            {
-                opt_psi += 360.;
-                opt_flip = 1.;
-            }
+            batch_imgs[i] = img();
+        }
 
-            dAij(docfiledata,IMG_LOCAL_INDEX,0)
-            = model.Iref[opt_refno % model.n_ref].rot(); // rot
-            dAij(docfiledata,IMG_LOCAL_INDEX,1)
-            = model.Iref[opt_refno % model.n_ref].tilt(); // tilt
-            dAij(docfiledata,IMG_LOCAL_INDEX,2) = opt_psi + 360.; // psi
-            dAij(docfiledata,IMG_LOCAL_INDEX,3) = opt_offsets(0); // Xoff
-            dAij(docfiledata,IMG_LOCAL_INDEX,4) = opt_offsets(1); // Yoff
-            dAij(docfiledata,IMG_LOCAL_INDEX,5) = (double) (opt_refno + 1); // Ref
-            dAij(docfiledata,IMG_LOCAL_INDEX,6) = opt_flip; // Mirror
-            dAij(docfiledata,IMG_LOCAL_INDEX,7) = fracweight; // P_max/P_tot
-            dAij(docfiledata,IMG_LOCAL_INDEX,8) = dLL; // log-likelihood
-            if (model.do_norm)
-            {
-                dAij(docfiledata,IMG_LOCAL_INDEX,9) = bgmean; // background mean
-                dAij(docfiledata,IMG_LOCAL_INDEX,10) = opt_scale; // image scale
-            }
-            if (model.do_student)
-            {
-                dAij(docfiledata,IMG_LOCAL_INDEX,11) = maxweight2; // Robustness weight
-            }
+        scheduler.run(nr_batch, [&](int thread, size_t i)
+        {
+            expectationImage(*threadWork[thread], block_imgs[first + i], batch_imgs[i]);
+        });
 
-            //Report progress and increment the images done
-            setProgress(++img_done);
-
-            //#define DEBUG_JM1
-#ifdef DEBUG_JM1
-            //            {
-            //              //std::cerr << "---------------------- DEBUG_JM: current_image: " << current_image << std::endl;
-            std::cerr << "                              LL: " << LL << std::endl;
-            std::cerr << "                wsum_sigma_noise: " << wsum_sigma_noise << std::endl;
-            std::cerr << "               wsum_sigma_offset: " << wsum_sigma_offset << std::endl;
-            std::cerr << "                   sumfracweight: " << sumfracweight << std::endl;
-            //            }
-#endif
-#undef DEBUG_JM1
+        //Report progress and increment the images done
+        img_done += nr_batch;
+        setProgress(img_done);
+    }
 
-        }//close if current_block, also close of for all images
-    }//close for all images
+    // Add the sums of all threads
+    for (auto &ptr : threadWork)
+    {
+        const ML2DThreadWork &w = *ptr;
+        LL += w.LL;
+        sumfracweight += w.sumfracweight;
+        wsum_sigma_noise += w.wsum_sigma_noise;
+        wsum_sigma_offset += w.wsum_sigma_offset;
+        for (int refno = 0; refno < num_output_refs; refno++)
+        {
+            sumw[refno] += w.sumw[refno];
+            sumw2[refno] += w.sumw2[refno];
+            sumwsc[refno] += w.sumwsc[refno];
+            sumwsc2[refno] += w.sumwsc2[refno];
+            sumw_mirror[refno] += w.sumw_mirror[refno];
+        }
+    }
 
     if (current_block == (blocks - 1))
         endProgress();
@@ -26,91 +26,90 @@
 #ifndef _MLALIGN2D_H
 #define _MLALIGN2D_H
 
+#include <memory>
 #include "ml2d.h"
 
-///******** Some macro definitions ****************
-///Useful macro for thread iteration and work over all refno
-#define FOR_ALL_THREAD_REFNO() \
-int refno, load; \
-while ((load = getThreadRefnoJob(refno)) > 0) \
-    for (int i = 0; i < load; i++, refno = (refno + 1) % model.n_ref)
-///Same macro as before, but without declaring refno and load
-#define FOR_ALL_THREAD_REFNO_NODECL() \
-while ((load = getThreadRefnoJob(refno)) > 0) \
-    for (int i = 0; i < load; i++, refno = (refno + 1) % model.n_ref)
-
-class ProgML2D;
-// This structure is needed to pass parameters to the threads
-typedef struct
-{
-    int thread_id;
-    ProgML2D * prm;
-}
-structThreadTasks;
-
 #define SPECIAL_ITER 0
 
-void * doThreadsTasks(void * data);
-
 /**@defgroup MLalign2D ml_align2d (Maximum likelihood in 2D)
    @ingroup ReconsLibrary */
 //@{
-/** MLalign2D parameters. */
-class ProgML2D: public ML2DBaseProgram
+/** Work space and partial sums of one thread of ProgML2D.
+ * Each thread processes whole images; the state of the image being
+ * processed is kept here, together with the sums over all the images
+ * processed by the thread, which are added to the global sums at the end
+ * of the expectation.
+ */
+class ML2DThreadWork
 {
-
 public:
-  bool no_iem;
+    /** Index of the thread */
+    int id;
 
-    MultidimArray<int> mask, omask;
-    /** Thread stuff */
-    int threadTask;
-    barrier_t barrier, barrier2, barrier3;
-    pthread_t * th_ids;
-    structThreadTasks * threads_d;
-
-    /** New class variables, taken from old MAIN */
-    double LL, sumfracweight;
-    double wsum_sigma_noise, wsum_sigma_offset, sumw_allrefs;
-    std::vector<double> sumw, sumw2, sumwsc, sumwsc2, sumw_mirror;
-    std::vector<MultidimArray<double > > wsum_Mref;
-    MultidimArray<int> Msignificant;
+    /** Image being processed */
     MultidimArray<double> Mimg;
+    /** Sum of squared amplitudes of the image */
+    double Xi2;
+    // Which group does this image belong to in iteration 0 (generation of K references)
+    int mygroup;
     std::vector<double> allref_offsets;
     std::vector<double> pdf_directions;
-    std::vector<MultidimArray<double> > mref;
-    std::vector<MultidimArray<std::complex<double> > > fref;
-    std::vector<MultidimArray<std::complex<double > > > wsumimgs;
+    MultidimArray<int> Msignificant;
     int opt_refno, iopt_psi, iopt_flip;
     double trymindiff, opt_scale, bgmean, opt_psi;
     double fracweight, maxweight2, dLL;
 
-    ///////// Some global variables just for thread visibility ////
     /** Taken from expectationSingleImage */
     std::vector<MultidimArray<std::complex<double> > > Fimg_flip, mysumimgs;
-    std::vector<double> refw, refw2, refwsc2, refw_mirror, sumw_refpsi;
-    double wsum_corr, sum_refw, sum_refw2, maxweight;
+    std::vector<double> refw, refw2, refw_mirror, sumw_refpsi;
+    double wsum_corr, sum_refw, maxweight;
     double wsum_sc, wsum_sc2, wsum_offset, old_bgmean;
     double mindiff;
-    size_t sigdim;
     int ioptx, iopty;
     std::vector<int> ioptx_ref, iopty_ref, ioptflip_ref;
     /** Taken from PreselectFastSignificant. */
-    double pfs_mindiff;
     MultidimArray<double> pfs_maxweight;
     MultidimArray<double> pfs_weight;
-    int pfs_count;
+
+    /** Fourier transforms of the thread.
+     * The transformer works on Maux and Faux, so its plans are created
+     * only once. */
+    MultidimArray<double> Maux, Mweight;
+    MultidimArray<std::complex<double> > Faux;
+    FourierTransformer transformer;
+
+    /** Partial sums of the images processed by this thread */
+    double LL, sumfracweight, wsum_sigma_noise, wsum_sigma_offset;
+    std::vector<double> sumw, sumw2, sumwsc, sumwsc2, sumw_mirror;
+    /** Weighted sums of the images processed by this thread (refno * nr_psi + ipsi) */
+    std::vector<MultidimArray<std::complex<double> > > wsumimgs;
+};
+
+/** MLalign2D parameters. */
+class ProgML2D: public ML2DBaseProgram
+{
+
+public:
+  bool no_iem;
+
+    MultidimArray<int> mask, omask;
+
+    /** New class variables, taken from old MAIN */
+    double LL, sumfracweight;
+    double wsum_sigma_noise, wsum_sigma_offset, sumw_allrefs;
+    std::vector<double> sumw, sumw2, sumwsc, sumwsc2, sumw_mirror;
+    std::vector<MultidimArray<double > > wsum_Mref;
+    std::vector<MultidimArray<double> > mref;
+    std::vector<MultidimArray<std::complex<double> > > fref;
+    /** Number of pixels considered in the translations */
+    size_t sigdim;
 
     /** Sum of squared amplitudes of the references */
     std::vector<double> A2;
-    /** Sum of squared amplitudes of the experimental image */
-    double Xi2;
 
-    //These are for refno work assigns to threads
-    size_t refno_index, refno_load_param;
-    int refno_load, refno_count;
-    // Which group does this image belong to in iteration 0 (generation of K references)
-    int mygroup;
+    /** Work space of each thread */
+    std::vector<std::unique_ptr<ML2DThreadWork> > threadWork;
+
     /// Read arguments from command line
     void readParams();
     /// Params definition
@@ -131,47 +130,41 @@ public:
     /// Fill vector of matrices with all rotations of reference
     void rotateReference();
 
+    /// Rotations of one reference
+    void rotateReferenceRefno(ML2DThreadWork &w, int refno);
+
     /// Apply reverse rotations to all matrices in vector and fill new matrix with their sum
     void reverseRotateReference();
 
+    /// Reverse rotations of one reference
+    void reverseRotateReferenceRefno(ML2DThreadWork &w, int refno);
+
     /** Calculate which references have projection directions close to
         phi and theta */
-    void preselectLimitedDirections(double &phi, double &theta);
+    void preselectLimitedDirections(double &phi, double &theta,
+                                    std::vector<double> &pdf_directions);
 
     /** Pre-calculate which model and phi have significant probabilities
        without taking translations into account! */
-    void preselectFastSignificant();
+    void preselectFastSignificant(ML2DThreadWork &w);
 
     /// ML-integration over all (or -fast) translations
-    void expectationSingleImage(Matrix1D<double> &opt_offsets);
-
-    /*** Threads functions */
-    /// Create working threads
-    void createThreads();
+    void expectationSingleImage(ML2DThreadWork &w, Matrix1D<double> &opt_offsets);
 
-    /// Exit threads and free memory
-    void destroyThreads();
-
-    /// Assign refno jobs to threads
-    int getThreadRefnoJob(int &refno);
-
-    /// Awake threads for different tasks
-    void awakeThreads(ThreadTask task, int start_refno, int load = 1);
+    /// ML-integration of the image of the thread over one reference
+    void expectationSingleImageRefno(ML2DThreadWork &w, int refno);
 
-    /// Thread code to parallelize refno loop in rotateReference
-    void doThreadRotateReferenceRefno();
+    /// Add the weighted sums of the image of the thread to the weighted sums
+    void updateWeightedSums(ML2DThreadWork &w);
 
-    ///Thread code to parallelize refno loop in reverseRotateReference
-    void doThreadReverseRotateReferenceRefno();
+    /// Process an image of the current block (called by the threads)
+    void expectationImage(ML2DThreadWork &w, size_t imgno, const MultidimArray<double> &img);
 
-    /// Thread code to parallelize refno loop in preselectFastSignificant
-    void doThreadPreselectFastSignificantRefno();
-
-    /// Thread code to parallelize refno loop in expectationSingleImage
-    void doThreadExpectationSingleImageRefno();
+    /// Exit threads and free memory
+    void destroyThreads();
 
-    /// Thread code to parallelize update loop in ESI
-    void doThreadESIUpdateRefno();
+    /// Size the work space of the threads for the current iteration
+    void prepareThreadWork();
 
     /// Perform an iteration
     virtual void iteration();
@@ -130,6 +130,8 @@ void ProgMLF2D::readParams()
     }
     // Number of threads
     threads = getIntParam("--thr");
+    // Images of each thread in a batch
+    thread_load = getIntParam("--load");
 
     // Main parameters
     model.n_ref = getIntParam("--nref");
@@ -1071,9 +1073,10 @@ void ProgMLF2D::updateWienerFilters(const MultidimArray<double> &spectral_signal
     }
 
     // Get the new pointers to all pixels in FourierTransformHalf
+    // (only the size of the transform is needed)
     Maux.initZeros(dim, dim);
     Maux.setXmippOrigin();
-    FourierTransformHalf(Maux, Faux);
+    Faux.initZeros(hdim + 1, dim);
     pointer_2d.clear();
     pointer_i.clear();
     pointer_j.clear();
@@ -1330,27 +1333,92 @@ void ProgMLF2D::getFTfromVector(const std::vector<double> &in,
 
 }
 
+void ProgMLF2D::prepareThreadWork()
+{
+    int nr_threads = scheduler.getThreads();
+    if ((int)threadWork.size() != nr_threads)
+    {
+        threadWork.clear();
+        for (int thread = 0; thread < nr_threads; thread++)
+            threadWork.emplace_back(std::make_unique<MLF2DThreadWork>());
+    }
+
+    for (auto &ptr : threadWork)
+    {
+        MLF2DThreadWork &w = *ptr;
+        // The transformer keeps working on Maux and Faux
+        if (XSIZE(w.Maux) != dim || YSIZE(w.Maux) != dim)
+        {
+            w.Maux.resizeNoCopy(dim, dim);
+            w.Maux.setXmippOrigin();
+            w.transformer.setReal(w.Maux);
+            w.transformer.getFourierAlias(w.Faux);
+        }
+    }
+}
+
+void ProgMLF2D::transformHalf(MLF2DThreadWork &w, const MultidimArray<double> &in,
+                              MultidimArray<std::complex<double> > &out) const
+{
+    // Takes the input from Maux and leaves columns 0..dim/2 in Faux
+    w.Maux = in;
+    w.transformer.FourierTransform();
+
+    // The half format has rows 0..hdim and all the columns,
+    // the other columns come from the hermitian symmetry
+    out.resizeNoCopy(hdim + 1, dim);
+    for (size_t i = 0; i <= hdim; i++)
+        for (size_t j = 0; j < dim; j++)
+        {
+            if (j < XSIZE(w.Faux))
+                dAij(out, i, j) = dAij(w.Faux, i, j);
+            else
+                dAij(out, i, j) = conj(dAij(w.Faux, (dim - i) % dim, dim - j));
+        }
+}
+
+void ProgMLF2D::inverseTransformHalf(MLF2DThreadWork &w,
+                                     const MultidimArray<std::complex<double> > &in,
+                                     MultidimArray<double> &out) const
+{
+    // The rows after hdim come from the hermitian symmetry
+    for (size_t i = 0; i < dim; i++)
+        for (size_t j = 0; j < XSIZE(w.Faux); j++)
+        {
+            if (i <= hdim)
+                dAij(w.Faux, i, j) = dAij(in, i, j);
+            else
+                dAij(w.Faux, i, j) = conj(dAij(in, dim - i, (dim - j) % dim));
+        }
+
+    // Takes the input from Faux and leaves the output in Maux
+    w.transformer.inverseFourierTransform();
+    out = w.Maux;
+}
+
 // Rotate reference for all models and rotations and fill Fref vectors =============
 void ProgMLF2D::rotateReference(std::vector<double> &out)
 {
-    out.clear();
+    out.resize(model.n_ref * nr_psi * dnr_points_2d);
 
-    double AA, stdAA, psi;
-    MultidimArray<double> Maux;
-    MultidimArray<std::complex<double> > Faux;
+    // Each reference is a task
+    scheduler.run(model.n_ref, [&](int thread, size_t refno)
+    {
+        double AA, stdAA = 0., psi;
+        MultidimArray<double> Maux;
+        MultidimArray<std::complex<double> > Faux;
+        std::vector<double> Fref_refno;
 
-    Maux.initZeros(dim, dim);
-    Maux.setXmippOrigin();
+        Maux.initZeros(dim, dim);
+        Maux.setXmippOrigin();
 
-    FOR_ALL_MODELS()
-    {
         FOR_ALL_ROTATIONS()
         {
             // Add arbitrary number (small_angle) to avoid 0-degree rotation (lacking interpolation)
             psi = (double)(ipsi * psi_max / nr_psi) + SMALLANGLE;
             //model.Iref[refno]().rotateBSpline(3, psi, Maux, WRAP);
             rotate(xmipp_transformation::BSPLINE3, Maux, model.Iref[refno](), -psi, 'Z', xmipp_transformation::WRAP);
-            FourierTransformHalf(Maux, Faux);
+            transformHalf(*threadWork[thread], Maux, Faux);
 
             // Normalize the magnitude of the rotated references to 1st rot of that ref
             // This is necessary because interpolation due to rotation can lead to lower overall Fref
@@ -1367,11 +1435,13 @@ void ProgMLF2D::rotateReference(std::vector<double> &out)
                 dAi(Faux, n) *= sqrtVal;
             }
             // Add all points as doubles to the vector
-            appendFTtoVector(Faux, out);
+            appendFTtoVector(Faux, Fref_refno);
         }
+        std::copy(Fref_refno.begin(), Fref_refno.end(),
+                  out.begin() + refno * nr_psi * dnr_points_2d);
         // Free memory
         model.Iref[refno]().resize(0,0);
-    }
+    });
 }
 
 
@@ -1379,31 +1449,30 @@ void ProgMLF2D::rotateReference(std::vector<double> &out)
 void ProgMLF2D::reverseRotateReference(const std::vector<double> &in,
                                        std::vector<MultidimArray<double > > &out)
 {
+    out.resize(model.n_ref);
 
-    double psi;
-    MultidimArray<double> Maux, Maux2;
-    MultidimArray<std::complex<double> > Faux;
-    Maux.resize(dim, dim);
-    Maux2.resize(dim, dim);
-    Maux.setXmippOrigin();
-    Maux2.setXmippOrigin();
-
-    out.clear();
-    FOR_ALL_MODELS()
+    // Each reference is a task
+    scheduler.run(model.n_ref, [&](int thread, size_t refno)
     {
-        Maux.initZeros();
-        out.push_back(Maux);
+        double psi;
+        MultidimArray<double> Maux, Maux2;
+        MultidimArray<std::complex<double> > Faux;
+        Maux2.resize(dim, dim);
+        Maux2.setXmippOrigin();
+
+        out[refno].initZeros(dim, dim);
+        out[refno].setXmippOrigin();
         FOR_ALL_ROTATIONS()
         {
             // Add arbitrary number to avoid 0-degree rotation without interpolation effects
             psi = (double)(ipsi * psi_max / nr_psi) + SMALLANGLE;
             getFTfromVector(in, refno*nr_psi*dnr_points_2d + ipsi*dnr_points_2d, Faux);
-            InverseFourierTransformHalf(Faux, Maux, dim);
+            inverseTransformHalf(*threadWork[thread], Faux, Maux);
             //Maux.rotateBSpline(3, -psi, Maux2, WRAP);
             rotate(xmipp_transformation::BSPLINE3, Maux2, Maux, psi, 'Z', xmipp_transformation::WRAP);
             out[refno] += Maux2;
         }
-    }
+    });
 
 }
 
@@ -1476,7 +1545,7 @@ void ProgMLF2D::fourierTranslate2D(const std::vector<double> &in,
 
 }
 
-void ProgMLF2D::calculateFourierOffsets(const MultidimArray<double> &Mimg,
+void ProgMLF2D::calculateFourierOffsets(MLF2DThreadWork &w, const MultidimArray<double> &Mimg,
                                         const std::vector<double > &offsets,
                                         std::vector<double>  &out,
                                         MultidimArray<int> &Moffsets,
@@ -1510,7 +1579,7 @@ void ProgMLF2D::calculateFourierOffsets(const MultidimArray<double> &Mimg,
         Maux.setXmippOrigin();
         applyGeometry(xmipp_transformation::LINEAR, Maux, Mimg, F[iflip], xmipp_transformation::IS_INV, xmipp_transformation::WRAP);
 
-        FourierTransformHalf(Maux, Fimg);
+        transformHalf(w, Maux, Fimg);
         appendFTtoVector(Fimg,Fimg_flip);
     }
 
@@ -1586,7 +1655,8 @@ double lcdf_tstudent_mlf30(double t)
 
 // Exclude translations from the MLF_integration
 // For significantly contributing refno+psi: re-calculate optimal shifts
-void ProgMLF2D::processOneImage(const MultidimArray<double> &Mimg,
+void ProgMLF2D::processOneImage(MLF2DThreadSums &thread_sums, MLF2DThreadWork &w,
+                                const MultidimArray<double> &Mimg,
                                 const size_t focus, bool apply_ctf,
                                 double &fracweight, double &maxweight2,
                                 double &sum_refw2, double &opt_scale,
@@ -1598,7 +1668,7 @@ void ProgMLF2D::processOneImage(const MultidimArray<double> &Mimg,
                                 bool do_kstest, bool write_histograms,
                                 FileName fn_img, double &KSprob)
 {
-    std::vector<double> &Mwsum_sigma2_local = Mwsum_sigma2[focus];
+    std::vector<double> &Mwsum_sigma2_local = thread_sums.Mwsum_sigma2[focus];
     MultidimArray<double>                             Mweight;
     MultidimArray<int>                                Moffsets, Moffsets_mirror;
     std::vector<double>                               Fimg_trans;
@@ -1623,9 +1693,6 @@ void ProgMLF2D::processOneImage(const MultidimArray<double> &Mimg,
     // Convert 1D Vsig vectors to the correct vector size for the 2D FTHalfs
     // Multiply by a factor of two because we consider both the real and the imaginary parts
     ldim = (double) 2 * nr_points_prob;
-    // For t-student: df2 changes with effective resolution!
-    if (do_student)
-        df2 = - ( df +  ldim ) / 2. ;
 
     sum_refw2 = 0.;
     //change std::vectors by arrays
@@ -1658,7 +1725,7 @@ void ProgMLF2D::processOneImage(const MultidimArray<double> &Mimg,
         logsigma2 += 2 * log( sqrt(factor * sigma2[ipoint]));
 
     // Precalculate Fimg_trans, on pruned and expanded offset list
-    calculateFourierOffsets(Mimg, opt_offsets_ref, Fimg_trans, Moffsets, Moffsets_mirror);
+    calculateFourierOffsets(w, Mimg, opt_offsets_ref, Fimg_trans, Moffsets, Moffsets_mirror);
 
     Mweight.initZeros(nr_trans, model.n_ref, nr_flip*nr_psi);
 
@@ -2088,18 +2155,22 @@ void ProgMLF2D::processOneImage(const MultidimArray<double> &Mimg,
             ksone(aux_array, 2*nr_points_prob, &cdf_gauss, &KSD, &KSprob);
         }
 
-        // Compute resolution-dependent histograms
-        for (size_t ires = 0; ires < hdim; ires++)
+        // The histograms are shared by all threads
         {
-            for (size_t j=0; j<res_diff[ires].size(); j++)
-                resolhist[ires].insert_value(res_diff[ires][j]);
-        }
+            std::lock_guard<std::mutex> lock(hist_mutex);
+            // Compute resolution-dependent histograms
+            for (size_t ires = 0; ires < hdim; ires++)
+            {
+                for (size_t j=0; j<res_diff[ires].size(); j++)
+                    resolhist[ires].insert_value(res_diff[ires][j]);
+            }
 
-        // Overall average histogram
-        if (sumhist.sampleNo()==0)
-            sumhist.init(HISTMIN, HISTMAX, HISTSTEPS);
-        FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(diff)
-        sumhist.insert_value(DIRECT_MULTIDIM_ELEM(diff, n));
+            // Overall average histogram
+            if (sumhist.sampleNo()==0)
+                sumhist.init(HISTMIN, HISTMAX, HISTSTEPS);
+            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(diff)
+            sumhist.insert_value(DIRECT_MULTIDIM_ELEM(diff, n));
+        }
 
         if (write_histograms)
         {
@@ -2147,19 +2218,19 @@ void ProgMLF2D::processOneImage(const MultidimArray<double> &Mimg,
     {
         if (!limit_rot || pdf_directions[refno] > 0.)
         {
-            sumw[refno] += (refw[refno] + refw_mirror[refno]) / sum_refw;
-            sumw2[refno] += refw2[refno] / sum_refw;
+            thread_sums.sumw[refno] += (refw[refno] + refw_mirror[refno]) / sum_refw;
+            thread_sums.sumw2[refno] += refw2[refno] / sum_refw;
             if (do_student)
             {
-                sumwsc[refno] += refw2[refno] * opt_scale / sum_refw;
-                sumwsc2[refno] += refw2[refno] * opt_scale * opt_scale / sum_refw;
+                thread_sums.sumwsc[refno] += refw2[refno] * opt_scale / sum_refw;
+                thread_sums.sumwsc2[refno] += refw2[refno] * opt_scale * opt_scale / sum_refw;
             }
             else
             {
-                sumwsc[refno] += (refw[refno] + refw_mirror[refno]) * opt_scale / sum_refw;
-                sumwsc2[refno] += (refw[refno] + refw_mirror[refno]) * (opt_scale * opt_scale) / sum_refw;
+                thread_sums.sumwsc[refno] += (refw[refno] + refw_mirror[refno]) * opt_scale / sum_refw;
+                thread_sums.sumwsc2[refno] += (refw[refno] + refw_mirror[refno]) * (opt_scale * opt_scale) / sum_refw;
             }
-            sumw_mirror[refno] += refw_mirror[refno] / sum_refw;
+            thread_sums.sumw_mirror[refno] += refw_mirror[refno] / sum_refw;
             FOR_ALL_FLIPS()
             {
                 irefmir = (int)floor(iflip / nr_nomirror_flips) * model.n_ref + refno;
@@ -2184,19 +2255,19 @@ void ProgMLF2D::processOneImage(const MultidimArray<double> &Mimg,
                             weight /= sum_refw;
                             // get the starting point in the Fimg_trans vector
                             img_start = point_trans*4*dnr_points_2d + (iflip%nr_nomirror_flips)*dnr_points_2d;
-                            wsum_sigma_offset += weight * (double)(ix * ix + iy * iy);
+                            thread_sums.wsum_sigma_offset += weight * (double)(ix * ix + iy * iy);
                             if (do_ctf_correction)
                             {
                                 for (size_t ii = 0; ii < nr_points_2d; ii++)
                                 {
-                                    Fwsum_imgs[wsum_start + 2*ii] += weight
-                                                                     * opt_scale * decctf[ii] * Fimg_trans[img_start + 2*ii];
-                                    Fwsum_imgs[wsum_start + 2*ii+1] += weight
-                                                                       * opt_scale * decctf[ii] * Fimg_trans[img_start + 2*ii+1];
-                                    Fwsum_ctfimgs[wsum_start + 2*ii] += weight
-                                                                        * opt_scale * Fimg_trans[img_start + 2*ii];
-                                    Fwsum_ctfimgs[wsum_start + 2*ii+1] += weight
-                                                                          * opt_scale * Fimg_trans[img_start + 2*ii+1];
+                                    thread_sums.Fwsum_imgs[wsum_start + 2*ii] += weight
+                                                                                 * opt_scale * decctf[ii] * Fimg_trans[img_start + 2*ii];
+                                    thread_sums.Fwsum_imgs[wsum_start + 2*ii+1] += weight
+                                                                                   * opt_scale * decctf[ii] * Fimg_trans[img_start + 2*ii+1];
+                                    thread_sums.Fwsum_ctfimgs[wsum_start + 2*ii] += weight
+                                                                                    * opt_scale * Fimg_trans[img_start + 2*ii];
+                                    thread_sums.Fwsum_ctfimgs[wsum_start + 2*ii+1] += weight
+                                                                                      * opt_scale * Fimg_trans[img_start + 2*ii+1];
                                     tmpr = Fimg_trans[img_start + 2*ii]
                                            - ctf[ii] * opt_scale * Fref[wsum_start + 2*ii];
                                     tmpi = Fimg_trans[img_start + 2*ii+1]
@@ -2208,10 +2279,10 @@ void ProgMLF2D::processOneImage(const MultidimArray<double> &Mimg,
                             {
                                 for (size_t ii = 0; ii < nr_points_2d; ii++)
                                 {
-                                    Fwsum_imgs[wsum_start + 2*ii] += weight
-                                                                     * opt_scale * Fimg_trans[img_start + 2*ii];
-                                    Fwsum_imgs[wsum_start + 2*ii+1] += weight
-                                                                       * opt_scale * Fimg_trans[img_start + 2*ii+1];
+                                    thread_sums.Fwsum_imgs[wsum_start + 2*ii] += weight
+                                                                                 * opt_scale * Fimg_trans[img_start + 2*ii];
+                                    thread_sums.Fwsum_imgs[wsum_start + 2*ii+1] += weight
+                                                                                   * opt_scale * Fimg_trans[img_start + 2*ii+1];
                                     tmpr = Fimg_trans[img_start + 2*ii]
                                            - opt_scale * Fref[wsum_start + 2*ii];
                                     tmpi = Fimg_trans[img_start + 2*ii+1]
@@ -2271,19 +2342,19 @@ void ProgMLF2D::processOneImage(const MultidimArray<double> &Mimg,
         // 1st term: log(refw_i)
         // 2nd term: for subtracting mindiff2
         // 3rd term: for missing normalization constant
-        LL += log(sum_refw)
-              - mindiff2
-              - logsigma2;
+        thread_sums.LL += log(sum_refw)
+                          - mindiff2
+                          - logsigma2;
     else
         // 1st term: log(refw_i)
         // 2nd term: for dividing by (1 + mindiff2/df)^df2
         // 3rd term: for sigma-dependent normalization term in t-student distribution
         // 4th&5th terms: gamma functions in t-distribution
         //LL += log(sum_refw) - log(1. + ( mindiff2 / df )) - log(sigma_noise * sigma_noise);
-        LL += log(sum_refw)
-              + df2 * log( 1. + ( mindiff2 / df ))
-              - logsigma2
-              + gammln(-df2) - gammln(df/2.);
+        thread_sums.LL += log(sum_refw)
+                          + df2 * log( 1. + ( mindiff2 / df ))
+                          - logsigma2
+                          + gammln(-df2) - gammln(df/2.);
 
     //    if (rank == 0)
     //    {
@@ -2305,32 +2376,124 @@ void ProgMLF2D::iteration()
     maximization();
 }
 
-void ProgMLF2D::expectation()
+void ProgMLF2D::expectationImage(MLF2DThreadSums &thread_sums, MLF2DThreadWork &w, size_t imgno,
+                                 const MultidimArray<double> &img, int focus,
+                                 const FileName &fn_img)
 {
-
-    Image<double> img;
-    FileName fn_img, fn_trans;
     std::vector<double> allref_offsets, pdf_directions(model.n_ref);
     MultidimArray<double> trans(2);
     MultidimArray<double> opt_offsets(2);
 
     float old_phi = -999., old_theta = -999.;
-    double opt_psi, opt_flip, opt_scale, maxcorr, maxweight2;
+    double opt_psi, opt_flip, opt_scale = 1., maxcorr, maxweight2;
     double w2, KSprob = 0.;
     size_t opt_refno, opt_ipsi, opt_iflip;
-    int focus = 0;
     bool apply_ctf;
 
+    trans.initZeros();
+
+    // Get optimal offsets for all references
+    allref_offsets = imgs_offsets[IMG_LOCAL_INDEX];
+
+    // Read optimal orientations from memory
+    if (limit_rot)
+    {
+        old_phi = imgs_oldphi[IMG_LOCAL_INDEX];
+        old_theta = imgs_oldtheta[IMG_LOCAL_INDEX];
+    }
+
+    if (do_norm)
+    {
+        opt_scale = imgs_scale[IMG_LOCAL_INDEX];
+    }
+
+    // For limited orientational search: preselect relevant directions
+    preselectDirections(old_phi, old_theta, pdf_directions);
+
+    // Perform the actual expectation step for this image
+    apply_ctf = !(iter == 1 && first_iter_noctf);
+
+    processOneImage(thread_sums, w, img, focus, apply_ctf, maxcorr, maxweight2, w2,
+                    opt_scale, opt_refno, opt_psi, opt_ipsi, opt_iflip, opt_offsets,
+                    allref_offsets, pdf_directions,
+                    do_kstest, iter==iter_write_histograms, fn_img, KSprob);
+
+    // for t-student, update sumw_defocus
+    if (do_student && do_student_sigma_trick)
+    {
+        if (debug==8)
+            std::cerr<<"sumw_defocus[focus]= "<<thread_sums.sumw_defocus[focus]<<" w2= "<<w2<<std::endl;
+        thread_sums.sumw_defocus[focus] += w2;
+    }
+
+    // Store optimal scale in memory
+    if (do_norm)
+    {
+        imgs_scale[IMG_LOCAL_INDEX] = opt_scale;
+    }
+
+    // Store optimal translations
+    imgs_offsets[IMG_LOCAL_INDEX] = allref_offsets;
+
+    // Store optimal phi and theta in memory
+    if (limit_rot)
+    {
+        imgs_oldphi[IMG_LOCAL_INDEX] = model.Iref[opt_refno].rot();
+        imgs_oldtheta[IMG_LOCAL_INDEX] = model.Iref[opt_refno].tilt();
+    }
+
+    // Output docfile
+    thread_sums.sumcorr += maxcorr;
+    opt_flip = 0.;
+    if (-opt_psi > 360.)
+    {
+        opt_psi += 360.;
+        opt_flip = 1.;
+    }
+
+    dAij(docfiledata,IMG_LOCAL_INDEX,0)
+    = model.Iref[opt_refno].rot(); // rot
+    dAij(docfiledata,IMG_LOCAL_INDEX,1)
+    = model.Iref[opt_refno].tilt(); // tilt
+    dAij(docfiledata,IMG_LOCAL_INDEX,2) = opt_psi + 360.; // psi
+    dAij(docfiledata,IMG_LOCAL_INDEX,3) = trans(0) + opt_offsets(0); // Xoff
+    dAij(docfiledata,IMG_LOCAL_INDEX,4) = trans(1) + opt_offsets(1); // Yoff
+    dAij(docfiledata,IMG_LOCAL_INDEX,5) = (double) (opt_refno + 1); // Ref
+    dAij(docfiledata,IMG_LOCAL_INDEX,6) = opt_flip; // Mirror
+    dAij(docfiledata,IMG_LOCAL_INDEX,7) = maxcorr; // P_max/P_tot
+
+    if (do_student)
+    {
+        dAij(docfiledata,IMG_LOCAL_INDEX,8) = maxweight2; // Robustness weight
+    }
+    if (do_norm)
+    {
+        dAij(docfiledata,IMG_LOCAL_INDEX,9) = opt_scale; // image scale
+    }
+    if (do_kstest)
+    {
+        dAij(docfiledata,IMG_LOCAL_INDEX,10) = KSprob;
+    }
+}
+
+void ProgMLF2D::expectation()
+{
+
+    Image<double> img;
+    FileName fn_img;
+
     // Pre-calculate pdfs
     calculatePdfInplane();
 
+    // Fourier transforms of the threads
+    prepareThreadWork();
+
     // Generate (FT of) each rotated version of all references
     rotateReference(Fref);
 
     // Initialize progress bar
     initProgress(nr_images_local);
 
-    trans.initZeros();
     int n = model.n_ref;
     // Set all weighted sums to zero
     sumw.assign(n, 0.);
@@ -2367,115 +2530,95 @@ void ProgMLF2D::expectation()
             Fwsum_ctfimgs.assign(nn, 0.);
     }
 
-    std::stringstream ss;
-    String s;
-    // Loop over all images
-    FOR_ALL_LOCAL_IMAGES()
-    {
-        size_t id = img_id[imgno];
-        current_image = imgno;
-
-        focus = 0;
-        // Get defocus-group
-        if (do_ctf_correction)
-            MDimg.getValue(MDL_DEFGROUP, focus, id);
-
-        //std::cerr << formatString("processing img: %lu with id: %lu\n", imgno, id);
-
-        MDimg.getValue(MDL_IMAGE, fn_img, id);
-        //std::cerr << formatString("   filename: %s\n", fn_img.c_str());
-        //img.read(fn_img, false, false, false, false);
-
-        img.read(fn_img);
-        img().setXmippOrigin();
-
-        // Get optimal offsets for all references
-        allref_offsets = imgs_offsets[IMG_LOCAL_INDEX];
-
-        // Read optimal orientations from memory
-        if (limit_rot)
-        {
-            old_phi = imgs_oldphi[IMG_LOCAL_INDEX];
-            old_theta = imgs_oldtheta[IMG_LOCAL_INDEX];
-        }
-
-        if (do_norm)
-        {
-            opt_scale = imgs_scale[IMG_LOCAL_INDEX];
-        }
-
-        // For limited orientational search: preselect relevant directions
-        preselectDirections(old_phi, old_theta, pdf_directions);
-
-        // Perform the actual expectation step for this image
-        apply_ctf = !(iter == 1 && first_iter_noctf);
-
-        processOneImage(img(), focus, apply_ctf, maxcorr, maxweight2, w2,
-                        opt_scale, opt_refno, opt_psi, opt_ipsi, opt_iflip, opt_offsets,
-                        allref_offsets, pdf_directions,
-                        do_kstest, iter==iter_write_histograms, fn_img, KSprob);
-
-        // for t-student, update sumw_defocus
-        if (do_student && do_student_sigma_trick)
-        {
-            if (debug==8)
-                std::cerr<<"sumw_defocus[focus]= "<<sumw_defocus[focus]<<" w2= "<<w2<<std::endl;
-            sumw_defocus[focus] += w2;
-        }
-
-        // Store optimal scale in memory
-        if (do_norm)
-        {
-            imgs_scale[IMG_LOCAL_INDEX] = opt_scale;
-        }
-
-        // Store optimal translations
-        imgs_offsets[IMG_LOCAL_INDEX] = allref_offsets;
-
-        // Store optimal phi and theta in memory
-        if (limit_rot)
-        {
-            imgs_oldphi[IMG_LOCAL_INDEX] = model.Iref[opt_refno].rot();
-            imgs_oldtheta[IMG_LOCAL_INDEX] = model.Iref[opt_refno].tilt();
+    // For t-student: df2 changes with effective resolution!
+    if (do_student)
+        df2 = - ( df +  2. * nr_points_prob ) / 2. ;
+
+    // Partial sums of the threads
+    MLF2DThreadSums zero_sums;
+    zero_sums.LL = zero_sums.sumcorr = zero_sums.wsum_sigma_offset = 0.;
+    zero_sums.Mwsum_sigma2.assign(nr_focus, dum);
+    zero_sums.sumw.assign(n, 0.);
+    zero_sums.sumw2.assign(n, 0.);
+    zero_sums.sumwsc.assign(n, 0.);
+    zero_sums.sumwsc2.assign(n, 0.);
+    zero_sums.sumw_mirror.assign(n, 0.);
+    zero_sums.sumw_defocus.assign(nr_focus, 0.);
+    zero_sums.Fwsum_imgs.assign(Fwsum_imgs.size(), 0.);
+    zero_sums.Fwsum_ctfimgs.assign(Fwsum_ctfimgs.size(), 0.);
+    threadSums.assign(scheduler.getThreads(), zero_sums);
+
+    // Each image is a task; the images are read in batches of load images per thread
+    size_t batch_size = scheduler.getThreads() * XMIPP_MAX(1, thread_load);
+    std::vector<MultidimArray<double> > batch_imgs(batch_size);
+    std::vector<FileName> batch_fn(batch_size);
+    std::vector<int> batch_focus(batch_size);
+    for (size_t first = myFirstImg; first <= myLastImg; first += batch_size)
+    {
+        size_t nr_batch = XMIPP_MIN(batch_size, myLastImg + 1 - first);
+        // The metadata is not accessed by the threads
+        for (size_t i = 0; i < nr_batch; i++)
+        {
+            size_t id = img_id[first + i];
+            batch_focus[i] = 0;
+            // Get defocus-group
+            if (do_ctf_correction)
+                MDimg.getValue(MDL_DEFGROUP, batch_focus[i], id);
+            MDimg.getValue(MDL_IMAGE, batch_fn[i], id);
+            img.read(batch_fn[i]);
+            batch_imgs[i] = img();
         }
 
-        // Output docfile
-        sumcorr += maxcorr;
-        opt_flip = 0.;
-        if (-opt_psi > 360.)
+        scheduler.run(nr_batch, [&](int thread, size_t i)
         {
-            opt_psi += 360.;
-            opt_flip = 1.;
-        }
+            batch_imgs[i].setXmippOrigin();
+            expectationImage(threadSums[thread], *threadWork[thread], first + i, batch_imgs[i],
+                             batch_focus[i], batch_fn[i]);
+        });
 
-        dAij(docfiledata,IMG_LOCAL_INDEX,0)
-        = model.Iref[opt_refno].rot(); // rot
-        dAij(docfiledata,IMG_LOCAL_INDEX,1)
-        = model.Iref[opt_refno].tilt(); // tilt
-        dAij(docfiledata,IMG_LOCAL_INDEX,2) = opt_psi + 360.; // psi
-        dAij(docfiledata,IMG_LOCAL_INDEX,3) = trans(0) + opt_offsets(0); // Xoff
-        dAij(docfiledata,IMG_LOCAL_INDEX,4) = trans(1) + opt_offsets(1); // Yoff
-        dAij(docfiledata,IMG_LOCAL_INDEX,5) = (double) (opt_refno + 1); // Ref
-        dAij(docfiledata,IMG_LOCAL_INDEX,6) = opt_flip; // Mirror
-        dAij(docfiledata,IMG_LOCAL_INDEX,7) = maxcorr; // P_max/P_tot
+        // Report progress bar
+        setProgress(first + nr_batch - myFirstImg);
+    }
 
-        if (do_student)
-        {
-            dAij(docfiledata,IMG_LOCAL_INDEX,8) = maxweight2; // Robustness weight
-        }
-        if (do_norm)
+    // Add the sums of all threads
+    for (const MLF2DThreadSums &thread_sums : threadSums)
+    {
+        LL += thread_sums.LL;
+        sumcorr += thread_sums.sumcorr;
+        wsum_sigma_offset += thread_sums.wsum_sigma_offset;
+        FOR_ALL_MODELS()
         {
-            dAij(docfiledata,IMG_LOCAL_INDEX,9) = opt_scale; // image scale
+            sumw[refno] += thread_sums.sumw[refno];
+            sumw2[refno] += thread_sums.sumw2[refno];
+            sumwsc[refno] += thread_sums.sumwsc[refno];
+            sumwsc2[refno] += thread_sums.sumwsc2[refno];
+            sumw_mirror[refno] += thread_sums.sumw_mirror[refno];
         }
-        if (do_kstest)
+        FOR_ALL_DEFOCUS_GROUPS()
         {
-            dAij(docfiledata,IMG_LOCAL_INDEX,10) = KSprob;
+            sumw_defocus[ifocus] += thread_sums.sumw_defocus[ifocus];
+            FOR_ALL_POINTS()
+            Mwsum_sigma2[ifocus][ipoint] += thread_sums.Mwsum_sigma2[ifocus][ipoint];
         }
-
-        // Report progress bar
-        setProgress();
     }
 
+    // Add the weighted sums of the images of all threads, always in the
+    // same order; each thread adds a slice of the vectors
+    size_t nr_chunks = scheduler.getThreads();
+    size_t chunk_size = (Fwsum_imgs.size() + nr_chunks - 1) / nr_chunks;
+    scheduler.run(nr_chunks, [&](int, size_t chunk)
+    {
+        size_t first = chunk * chunk_size;
+        size_t last = XMIPP_MIN(first + chunk_size, Fwsum_imgs.size());
+        for (const MLF2DThreadSums &thread_sums : threadSums)
+            for (size_t i = first; i < last; i++)
+            {
+                Fwsum_imgs[i] += thread_sums.Fwsum_imgs[i];
+                if (do_ctf_correction)
+                    Fwsum_ctfimgs[i] += thread_sums.Fwsum_ctfimgs[i];
+            }
+    });
+
     endProgress();
 
     if (do_ctf_correction)
@@ -27,6 +27,8 @@
 #define MLFALIGN2D_H
 
 #include "ml2d.h"
+#include <memory>
+#include <mutex>
 #include <numeric>
 
 /**@defgroup MLFalign2D mlf_align2d (Maximum likelihood in 2D in Fourier space)
@@ -66,6 +68,31 @@ constexpr int  HISTSTEPS = 120;
 #define FN_VSIG(base, ifocus, ext) ((nr_focus > 1) ? formatString("ctf%06d@%s%s", ((ifocus) + 1), (base).c_str(), (ext)) : ((base) + "_ctf" + (ext)))
 
 
+/** Partial sums of the images processed by one thread of ProgMLF2D.
+ * They are added to the sums of the program at the end of the expectation.
+ */
+class MLF2DThreadSums
+{
+public:
+    double LL, sumcorr, wsum_sigma_offset;
+    std::vector< std::vector<double> > Mwsum_sigma2;
+    std::vector<double> sumw, sumw2, sumwsc, sumwsc2, sumw_mirror, sumw_defocus;
+    /** Weighted sums of the images processed by this thread */
+    std::vector<double> Fwsum_imgs, Fwsum_ctfimgs;
+};
+
+/** Fourier transforms of one thread of ProgMLF2D.
+ * The transformer works on Maux and Faux, so its plans are created
+ * only once.
+ */
+class MLF2DThreadWork
+{
+public:
+    MultidimArray<double> Maux;
+    MultidimArray<std::complex<double> > Faux;
+    FourierTransformer transformer;
+};
+
 /** MLFalign2D parameters. */
 class ProgMLF2D: public ML2DBaseProgram
 {
@@ -155,6 +182,12 @@ public:
     std::vector< std::vector<double> > Mwsum_sigma2;
     std::vector<double> sumw, sumw2, sumwsc, sumwsc2, sumw_mirror, sumw_defocus;
     std::vector<double> Fref, Fwsum_imgs, Fwsum_ctfimgs;
+    /** Lock of the noise histograms */
+    std::mutex hist_mutex;
+    /** Partial sums of each thread */
+    std::vector<MLF2DThreadSums> threadSums;
+    /** Fourier transforms of each thread */
+    std::vector<std::unique_ptr<MLF2DThreadWork> > threadWork;
 
 
     /** Constructor
@@ -214,6 +247,17 @@ public:
                          MultidimArray<std::complex<double> > &out,
                          bool only_real = false);
 
+    /// Create the Fourier transforms of each thread
+    void prepareThreadWork();
+
+    /// Fourier transform in half format with the plans of the thread
+    void transformHalf(MLF2DThreadWork &w, const MultidimArray<double> &in,
+                       MultidimArray<std::complex<double> > &out) const;
+
+    /// Inverse Fourier transform from half format with the plans of the thread
+    void inverseTransformHalf(MLF2DThreadWork &w, const MultidimArray<std::complex<double> > &in,
+                              MultidimArray<double> &out) const;
+
     /// Fill vector of matrices with all rotations of reference
     void rotateReference(std::vector<double> &out);
 
@@ -243,14 +287,18 @@ public:
     // If not determined yet: search optimal offsets using maxCC
     // Then for all optimal translations, calculate all translated FTs
     // for each of the flipped variants
-    void calculateFourierOffsets(const MultidimArray<double> &Mimg,
+    void calculateFourierOffsets(MLF2DThreadWork &w, const MultidimArray<double> &Mimg,
                                  const std::vector<double > &offsets,
                                  std::vector<double>  &out,
                                  MultidimArray<int> &Moffsets,
                                  MultidimArray<int> &Moffsets_mirror);
 
-    /// Perform expectation step for a single image
-    void processOneImage(const MultidimArray<double> &Mimg,
+    /** Perform expectation step for a single image.
+     * The sums, including the weighted sums of the images, are
+     * accumulated in the sums of the thread.
+     */
+    void processOneImage(MLF2DThreadSums &thread_sums, MLF2DThreadWork &w,
+                         const MultidimArray<double> &Mimg,
                          size_t focus, bool apply_ctf,
                          double &fracweight,  double &maxweight2, double &sum_refw2,
                          double &opt_scale, size_t &opt_refno, double &opt_psi,
@@ -261,6 +309,10 @@ public:
                          bool do_kstest, bool write_histograms,
                          FileName fn_img, double &KSprob);
 
+    /// Expectation step for one image (called by the threads)
+    void expectationImage(MLF2DThreadSums &thread_sums, MLF2DThreadWork &w, size_t imgno,
+                          const MultidimArray<double> &img, int focus, const FileName &fn_img);
+
     /// Perform Kolmogorov-Smirnov test
     double performKSTest(MultidimArray<double> &Mimg,  const int focus, bool apply_ctf,
                          FileName &fn_img, bool write_histogram,
@@ -26,10 +26,21 @@
 
 #include "reconstruction/movie_alignment_correlation.h"
 #include "core/transformations.h"
+#include "data/cpu.h"
+#include "data/bounded_queue.h"
+#include <array>
+#include <exception>
+#include <thread>
 
 template<typename T>
 void ProgMovieAlignmentCorrelation<T>::defineParams() {
     AProgMovieAlignmentCorrelation<T>::defineParams();
+    this->addParamsLine(
+            "  [--thr <N=-1>]               : Maximal number of the processing CPU threads");
+    this->addParamsLine(
+            "  [--patchesAvg <avg=3>]       : Number of near frames used for averaging a single patch");
+    this->addParamsLine(
+            "  [--max_memory <GB=-1>]       : Maximal memory used for the frames and their spectra. -1 for 80% of the physical memory");
     this->addExampleLine(
                 "xmipp_movie_alignment_correlation -i movie.xmd --oaligned alignedMovie.stk --oavg alignedMicrograph.mrc");
     this->addSeeAlsoLine("xmipp_cuda_movie_alignment_correlation");
@@ -40,6 +51,145 @@ void ProgMovieAlignmentCorrelation<T>::readParams() {
     AProgMovieAlignmentCorrelation<T>::readParams();
     if (this->getBinning() != 1.0)
         REPORT_ERROR(ERR_ARG_INCORRECT, "Binning is not supported. Please contact developers if you really need it.");
+    int threads = this->getIntParam("--thr");
+    if (-1 == threads) {
+        threads = CPU::findCores();
+    }
+    threadPool.resize(std::max(threads, 1));
+    patchesAvg = this->getIntParam("--patchesAvg");
+    if (patchesAvg < 1)
+        REPORT_ERROR(ERR_ARG_INCORRECT, "Patch averaging has to be at least 1 (one).");
+    double maxMemoryGB = this->getDoubleParam("--max_memory");
+    if (maxMemoryGB <= 0) {
+        CPU cpu;
+        cpu.updateMemoryInfo();
+        maxMemory = cpu.totalBytes() * 0.8;
+    } else {
+        maxMemory = maxMemoryGB * 1024 * 1024 * 1024;
+    }
+}
+
+template<typename T>
+void ProgMovieAlignmentCorrelation<T>::planMemory(const Dimensions &movieDim,
+        size_t spectrumBytes) {
+    const size_t N = this->nlast - this->nfirst + 1;
+    const size_t frameBytes = movieDim.xy() * sizeof(T);
+    // a worker holds a frame, its downscaled copy and the FFT buffers
+    const size_t workerBytes = 3 * frameBytes;
+    // reader, corrector, one frame in each queue and a single worker
+    const size_t minStreamBytes = 4 * frameBytes + workerBytes;
+    const size_t spectraBytes = N * spectrumBytes;
+    const double GB = 1024. * 1024. * 1024.;
+    if (spectraBytes + minStreamBytes > maxMemory) {
+        REPORT_ERROR(ERR_MEM_NOTENOUGH, formatString(
+            "At least %.2f GB of memory is needed to align the movie, see --max_memory.",
+            (spectraBytes + minStreamBytes) / GB));
+    }
+    size_t available = maxMemory - spectraBytes - minStreamBytes;
+    const size_t framesBytes = N * movieDim.xy() * sizeof(float);
+    cacheFrames = framesBytes <= available;
+    if (cacheFrames) {
+        available -= framesBytes;
+    }
+    // use the rest for frames in flight
+    const size_t threads = threadPool.size();
+    streamWorkers = std::min(threads, 1 + available / workerBytes);
+    available -= (streamWorkers - 1) * workerBytes;
+    streamQueueCapacity = std::min(threads, 1 + available / (2 * frameBytes));
+    if (this->verbose > 1) {
+        std::cout << "Memory limit: " << maxMemory / GB << " GB, frames "
+                << (cacheFrames ? "kept in memory" : "read twice") << ", "
+                << streamWorkers << " worker(s), queues of "
+                << streamQueueCapacity << " frame(s)" << std::endl;
+    }
+}
+
+template<typename T>
+void ProgMovieAlignmentCorrelation<T>::streamFrames(const MetaData& movie,
+        const Image<T>& dark, const Image<T>& igain, size_t workers,
+        size_t queueCapacity,
+        const std::function<void(int, size_t, MultidimArray<T>&)> &processFrame) {
+    struct FrameItem {
+        size_t offset;
+        std::unique_ptr<Image<T>> img;
+    };
+    // metadata is accessed only from this thread
+    std::vector<std::pair<size_t, FileName>> toRead;
+    int n = -1;
+    for (size_t objId : movie.ids())
+    {
+        ++n;
+        if (n >= this->nfirst && n <= this->nlast) {
+            FileName fnFrame;
+            movie.getValue(MDL_IMAGE, fnFrame, objId);
+            toRead.emplace_back(n - this->nfirst, fnFrame);
+        }
+    }
+
+    BoundedQueue<FrameItem> loaded(queueCapacity);
+    BoundedQueue<FrameItem> corrected(queueCapacity);
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    // the first error stops all stages
+    auto fail = [&]() {
+        {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if ( ! error)
+                error = std::current_exception();
+        }
+        loaded.close();
+        corrected.close();
+    };
+
+    std::thread reader([&]() {
+        try {
+            for (const auto &r : toRead) {
+                FrameItem item { r.first, std::unique_ptr<Image<T>>(new Image<T>()) };
+                item.img->read(r.second);
+                if ( ! loaded.push(std::move(item)))
+                    break;
+            }
+        } catch (...) {
+            fail();
+        }
+        loaded.close();
+    });
+    std::thread corrector([&]() {
+        try {
+            FrameItem item;
+            while (loaded.pop(item)) {
+                this->correctFrame(dark, igain, (*item.img)());
+                if ( ! corrected.push(std::move(item)))
+                    break;
+            }
+        } catch (...) {
+            fail();
+        }
+        corrected.close();
+    });
+    auto worker = [&](int thrId) {
+        try {
+            FrameItem item;
+            while (corrected.pop(item)) {
+                processFrame(thrId, item.offset, (*item.img)());
+            }
+        } catch (...) {
+            fail();
+        }
+    };
+
+    std::vector<std::future<void>> futures;
+    for (size_t w = 0; w < std::max(workers, (size_t)1); ++w) {
+        futures.emplace_back(threadPool.push(worker));
+    }
+    for (auto &f : futures) {
+        f.get();
+    }
+    reader.join();
+    corrector.join();
+    if (error) {
+        std::rethrow_exception(error);
+    }
 }
 
 template<typename T>
@@ -54,6 +204,8 @@ AlignmentResult<T> ProgMovieAlignmentCorrelation<T>::computeGlobalAlignment(
         std::cout << "Computing shifts between frames ..." << std::endl;
     // Now compute all shifts
     computeShifts(N, bX, bY, A);
+    // spectra are not needed anymore
+    frameFourier.clear();
 
     // Choose reference image as the minimax of shifts
     auto ref = core::optional<size_t>();
@@ -61,85 +213,461 @@ AlignmentResult<T> ProgMovieAlignmentCorrelation<T>::computeGlobalAlignment(
 }
 
 template<typename T>
-void ProgMovieAlignmentCorrelation<T>::applyShiftsComputeAverage(
-            const MetaData& movie, const Image<T>& dark, const Image<T>& igain,
-            Image<T>& initialMic, size_t& Ninitial, Image<T>& averageMicrograph,
-            size_t& N, const LocalAlignmentResult<T> &alignment) {
-    throw std::logic_error("Not implemented");
+void ProgMovieAlignmentCorrelation<T>::loadFrames(const MetaData& movie,
+        const Image<T>& dark, const Image<T>& igain) {
+    const size_t N = this->nlast - this->nfirst + 1;
+    const auto movieDim = this->getMovieSize();
+    const size_t framesBytes = N * movieDim.xy() * sizeof(float);
+    if (framesBytes > maxMemory) {
+        REPORT_ERROR(ERR_MEM_NOTENOUGH, formatString(
+            "Local alignment needs all frames in memory (%.2f GB). Increase --max_memory "
+            "or use --skipLocalAlignment.", framesBytes / (1024. * 1024. * 1024.)));
+    }
+    frames.resize(N);
+    streamFrames(movie, dark, igain, streamWorkers, streamQueueCapacity,
+            [this](int, size_t offset, MultidimArray<T> &frame) {
+                typeCast(frame, frames.at(offset));
+            });
+}
+
+template<typename T>
+void ProgMovieAlignmentCorrelation<T>::getPatchData(const Rectangle<Point2D<T>> &patch,
+        const AlignmentResult<T> &globAlignment, size_t t,
+        MultidimArray<T> &result) const {
+    const auto patchSize = patch.getSize();
+    const int n = static_cast<int>(frames.size());
+    const int sizeX = patchSize.x;
+    const int sizeY = patchSize.y;
+    result.initZeros(sizeY, sizeX);
+    // while averaging odd num of frames, use equally previous and following frames
+    // otherwise prefer following frames
+    const int first = std::max(0, static_cast<int>(t) - ((patchesAvg - 1) / 2));
+    const int last = std::min(n - 1, static_cast<int>(t) + (patchesAvg / 2));
+    for (int f = first; f <= last; ++f) {
+        const auto &frame = frames.at(f);
+        const auto xShift = static_cast<int>(std::round(globAlignment.shifts[f].x));
+        const auto yShift = static_cast<int>(std::round(globAlignment.shifts[f].y));
+        // patches are placed so that they are always within the shifted frame,
+        // see getPatchesLocation and getMovieBorders
+        const int srcX = static_cast<int>(patch.tl.x) + xShift;
+        for (int y = 0; y < sizeY; ++y) {
+            const int srcY = static_cast<int>(patch.tl.y) + y + yShift;
+            const float *src = &DIRECT_A2D_ELEM(frame, srcY, srcX);
+            T *dest = &DIRECT_A2D_ELEM(result, y, 0);
+            for (int x = 0; x < sizeX; ++x) {
+                dest[x] += src[x];
+            }
+        }
+    }
 }
 
 template<typename T>
 LocalAlignmentResult<T> ProgMovieAlignmentCorrelation<T>::computeLocalAlignment(
         const MetaData &movie, const Image<T> &dark, const Image<T> &igain,
         const AlignmentResult<T> &globAlignment) {
-    throw std::logic_error("Not implemented");
+    const auto movieSize = this->getMovieSize();
+    const auto reqPatchSize = this->getRequestedPatchSize();
+    // even sizes, to make the FFT fast
+    const auto patchDim = Dimensions((reqPatchSize.first / 2) * 2,
+            (reqPatchSize.second / 2) * 2, 1, movieSize.n());
+    if ((movieSize.x() < patchDim.x())
+        || (movieSize.y() < patchDim.y())) {
+        REPORT_ERROR(ERR_PARAM_INCORRECT, "Movie is too small for local alignment.");
+    }
+
+    // size of the correlation, possibly bigger than requested, to get even size
+    const float requestedScale = this->getScaleFactor();
+    auto getNearestEven = [requestedScale] (size_t v) {
+        size_t size = 2;
+        while ((size / (float)v) < requestedScale) {
+            size += 2;
+        }
+        return size;
+    };
+    const int corrXdim = getNearestEven(patchDim.x());
+    const int corrYdim = getNearestEven(patchDim.y());
+    const T actualScale = corrXdim / (T)patchDim.x(); // assuming we use square patches
+    const auto filter = this->createLPF(this->getPixelResolution(actualScale),
+            Dimensions(corrXdim, corrYdim));
+
+    if (frames.empty()) {
+        if (this->verbose)
+            std::cout << "Loading frames for local alignment ..." << std::endl;
+        loadFrames(movie, dark, igain);
+    }
+
+    auto borders = this->getMovieBorders(globAlignment, this->verbose > 1);
+    auto patchesLocation = this->getPatchesLocation(borders, patchDim);
+    const size_t N = movieSize.n();
+
+    // prepare result
+    LocalAlignmentResult<T> result { .globalHint = globAlignment, .movieDim = movieSize };
+    result.shifts.reserve(patchesLocation.size() * N);
+
+    // auxiliary data of each thread
+    struct PatchAux {
+        MultidimArray<T> patch;
+        MultidimArray<T> reducedPatch;
+        FourierTransformer transformer;
+        std::vector<MultidimArray<std::complex<T>>> spectra;
+        CorrelationAux corrAux;
+        MultidimArray<T> Mcorr;
+    };
+    std::vector<PatchAux> aux(threadPool.size());
+    std::vector<std::future<void>> futures;
+    futures.reserve(patchesLocation.size());
+
+    if (this->verbose)
+        std::cout << "Computing local alignment of " << patchesLocation.size() << " patches ..." << std::endl;
+    for (auto &p : patchesLocation) {
+        // prefill some info about patch
+        const auto shiftsOffset = result.shifts.size();
+        for (size_t i = 0; i < N; ++i) {
+            // keep this consistent with data loading
+            T globShiftX = std::round(globAlignment.shifts.at(i).x);
+            T globShiftY = std::round(globAlignment.shifts.at(i).y);
+            p.id_t = i;
+            // total shift (i.e. global shift + local shift) will be computed later on
+            result.shifts.emplace_back(p, Point2D<T>(globShiftX, globShiftY));
+        }
+        auto routine = [&, p, shiftsOffset](int thrId) { // p and shiftsOffset by copy to avoid race condition
+            auto &a = aux.at(thrId);
+            // downscale and filter the patch in all frames, reusing the plans of the thread
+            a.spectra.resize(N);
+            for (size_t t = 0; t < N; ++t) {
+                getPatchData(p.rec, globAlignment, t, a.patch);
+                scaleToSizeFourier(1, corrYdim, corrXdim, a.patch, a.reducedPatch);
+                a.transformer.FourierTransform(a.reducedPatch, a.spectra[t], true);
+                for (size_t nn = 0; nn < filter.nzyxdim; ++nn) {
+                    DIRECT_MULTIDIM_ELEM(a.spectra[t], nn) *= DIRECT_MULTIDIM_ELEM(filter, nn);
+                }
+            }
+
+            // correlate all pairs of the patch
+            if (0 == a.Mcorr.nzyxdim) {
+                a.Mcorr.resizeNoCopy(corrYdim, corrXdim);
+                a.Mcorr.setXmippOrigin();
+            }
+            Matrix2D<T> A(N * (N - 1) / 2, N - 1);
+            Matrix1D<T> bX(N * (N - 1) / 2), bY(N * (N - 1) / 2);
+            int idx = 0;
+            for (size_t i = 0; i < N - 1; ++i) {
+                for (size_t j = i + 1; j < N; ++j) {
+                    bestShift(a.spectra[i], a.spectra[j], a.Mcorr, bX(idx), bY(idx),
+                            a.corrAux, nullptr, this->maxShift * actualScale);
+                    bX(idx) /= actualScale; // scale to expected size
+                    bY(idx) /= actualScale;
+                    for (int ij = i; ij < j; ij++)
+                        A(idx, ij) = 1;
+                    idx++;
+                }
+            }
+
+            // compute resulting shifts
+            auto res = this->computeAlignment(bX, bY, A, globAlignment.refFrame, N,
+                    (this->verbose > 1) ? this->verbose : 0);
+            for (size_t i = 0; i < N; ++i) {
+                // update total shift (i.e. global shift + local shift)
+                result.shifts[i + shiftsOffset].second += res.shifts[i];
+            }
+        };
+        futures.emplace_back(threadPool.push(routine));
+    }
+
+    // wait till everything is done
+    for (auto &f : futures) {
+        f.get();
+    }
+
+    // compute coefficients for BSpline
+    auto coeffs = BSplineHelper::computeBSplineCoeffs(movieSize, result,
+            this->localAlignmentControlPoints, this->localAlignPatches,
+            this->verbose, this->solverIterations);
+    result.bsplineRep = core::optional<BSplineGrid<T>>(
+            BSplineGrid<T>(this->localAlignmentControlPoints, coeffs.first, coeffs.second));
+
+    return result;
+}
+
+/* Cubic BSpline interpolation of the coefficients at (x, y), mirroring at the borders */
+template<typename T>
+static T interpolateBSpline3(const MultidimArray<double> &coeffs, T x, T y) {
+    const int xdim = XSIZE(coeffs);
+    const int ydim = YSIZE(coeffs);
+    const int l1 = static_cast<int>(ceil(x - 2));
+    const int m1 = static_cast<int>(ceil(y - 2));
+    T result = 0;
+    for (int m = m1; m < m1 + 4; ++m) {
+        int equivalentM = m;
+        if (m < 0)
+            equivalentM = -m - 1;
+        else if (m >= ydim)
+            equivalentM = 2 * ydim - m - 1;
+        const double *row = &DIRECT_A2D_ELEM(coeffs, equivalentM, 0);
+        T xsum = 0;
+        for (int l = l1; l < l1 + 4; ++l) {
+            int equivalentL = l;
+            if (l < 0)
+                equivalentL = -l - 1;
+            else if (l >= xdim)
+                equivalentL = 2 * xdim - l - 1;
+            xsum += row[equivalentL] * BSplineHelper::Bspline03(x - (T)l);
+        }
+        result += xsum * BSplineHelper::Bspline03(y - (T)m);
+    }
+    return result;
+}
+
+template<typename T>
+void ProgMovieAlignmentCorrelation<T>::applyLocalShifts(const MultidimArray<float> &frame,
+        const LocalAlignmentResult<T> &alignment, size_t frameOffset,
+        MultidimArray<T> &result) const {
+    const auto &grid = alignment.bsplineRep.value();
+    const int lX = grid.getDim().x();
+    const int lY = grid.getDim().y();
+    const int lN = grid.getDim().n();
+    const T *coeffsX = grid.getCoeffsX().vdata;
+    const T *coeffsY = grid.getCoeffsY().vdata;
+    const auto &dim = alignment.movieDim;
+    // take into account end points, see BSplineHelper::getShift
+    const T hX = (lX == 3) ? dim.x() : (dim.x() / (T) (lX - 3));
+    const T hY = (lY == 3) ? dim.y() : (dim.y() / (T) (lY - 3));
+    const T hT = (lN == 3) ? dim.n() : (dim.n() / (T) (lN - 3));
+    const T tPos = frameOffset / hT;
+
+    MultidimArray<T> tmp;
+    typeCast(frame, tmp);
+    MultidimArray<double> coeffs;
+    produceSplineCoefficients(xmipp_transformation::BSPLINE3, coeffs, tmp);
+    result.resizeNoCopy(frame);
+
+    // The shift is separable: for a given frame and row, the control points
+    // reduce to a single row of coefficients, so each pixel needs only
+    // the (at most) four X control points around it
+    std::vector<T> rowCoeffsX(lX);
+    std::vector<T> rowCoeffsY(lX);
+    for (size_t y = 0; y < YSIZE(frame); ++y) {
+        const T yPos = y / hY;
+        std::fill(rowCoeffsX.begin(), rowCoeffsX.end(), 0);
+        std::fill(rowCoeffsY.begin(), rowCoeffsY.end(), 0);
+        for (int idxT = std::max(-1, (int) (tPos) - 1); idxT <= std::min((int) (tPos) + 2, lN - 2); ++idxT) {
+            const T tmpT = BSplineHelper::Bspline03(tPos - idxT);
+            for (int idxY = std::max(-1, (int) (yPos) - 1); idxY <= std::min((int) (yPos) + 2, lY - 2); ++idxY) {
+                const T tmp = tmpT * BSplineHelper::Bspline03(yPos - idxY);
+                const size_t offset = (idxT + 1) * (lX * lY) + (idxY + 1) * lX;
+                for (int i = 0; i < lX; ++i) {
+                    rowCoeffsX[i] += tmp * coeffsX[offset + i];
+                    rowCoeffsY[i] += tmp * coeffsY[offset + i];
+                }
+            }
+        }
+        T *dest = &DIRECT_A2D_ELEM(result, y, 0);
+        for (size_t x = 0; x < XSIZE(frame); ++x) {
+            const T xPos = x / hX;
+            T shiftX = 0;
+            T shiftY = 0;
+            for (int idxX = std::max(-1, (int) (xPos) - 1); idxX <= std::min((int) (xPos) + 2, lX - 2); ++idxX) {
+                const T tmpX = BSplineHelper::Bspline03(xPos - idxX);
+                shiftX += tmpX * rowCoeffsX[idxX + 1];
+                shiftY += tmpX * rowCoeffsY[idxX + 1];
+            }
+            dest[x] = interpolateBSpline3(coeffs, x - shiftX, y - shiftY);
+        }
+    }
+}
+
+template<typename T>
+void ProgMovieAlignmentCorrelation<T>::applyShiftsComputeAverage(
+            const MetaData& movie, const Image<T>& dark, const Image<T>& igain,
+            Image<T>& initialMic, size_t& Ninitial, Image<T>& averageMicrograph,
+            size_t& N, const LocalAlignmentResult<T> &alignment) {
+    Ninitial = N = 0;
+    if ( ! alignment.bsplineRep) {
+        REPORT_ERROR(ERR_VALUE_INCORRECT,
+            "Missing BSpline representation. This should not happen. Please contact developers.");
+    }
+    if (frames.empty()) {
+        loadFrames(movie, dark, igain);
+    }
+
+    std::vector<MultidimArray<T>> shiftedFrames(threadPool.size());
+    std::vector<MultidimArray<T>> initialFrames(threadPool.size());
+    auto mutexes = std::array<std::mutex, 3>(); // protecting access to unique resources
+    auto routine = [&](int thrId, int frameIndex) {
+        // user might want to align frames 3..10, but sum only 4..6
+        // by deducting the first frame that was aligned, we get proper offset to the stored memory
+        const int frameOffset = frameIndex - this->nfirst;
+        const auto &frame = frames.at(frameOffset);
+
+        if ( ! this->fnInitialAvg.isEmpty()) {
+            auto &initialFrame = initialFrames.at(thrId);
+            typeCast(frame, initialFrame);
+            std::unique_lock<std::mutex> lock(mutexes[0]);
+            if (0 == initialMic().yxdim)
+                initialMic() = initialFrame;
+            else
+                initialMic() += initialFrame;
+            Ninitial++;
+        }
+
+        if ( ! this->fnAligned.isEmpty() || ! this->fnAvg.isEmpty()) {
+            auto &shiftedFrame = shiftedFrames.at(thrId);
+            applyLocalShifts(frame, alignment, frameOffset, shiftedFrame);
+            if ( ! this->fnAligned.isEmpty()) {
+                std::unique_lock<std::mutex> lock(mutexes[1]);
+                Image<T> tmp(shiftedFrame);
+                tmp.write(this->fnAligned, frameOffset + 1, true,
+                        WRITE_REPLACE);
+            }
+            if ( ! this->fnAvg.isEmpty()) {
+                std::unique_lock<std::mutex> lock(mutexes[2]);
+                if (0 == averageMicrograph().yxdim)
+                    averageMicrograph() = shiftedFrame;
+                else
+                    averageMicrograph() += shiftedFrame;
+                N++;
+            }
+        }
+        if (this->verbose > 1) {
+            std::cout << "Frame " << std::to_string(frameIndex) << " processed." << std::endl;
+        }
+    };
+
+    std::vector<std::future<void>> futures;
+    for (int frameIndex = this->nfirstSum; frameIndex <= this->nlastSum; ++frameIndex) {
+        futures.emplace_back(threadPool.push(routine, frameIndex));
+    }
+    for (auto &f : futures) {
+        f.get();
+    }
 }
 
 template<typename T>
 void ProgMovieAlignmentCorrelation<T>::loadData(const MetaData& movie,
         const Image<T>& dark, const Image<T>& igain) {
     sizeFactor = this->getScaleFactor();
-    MultidimArray<T> filter;
-    FourierTransformer transformer;
-    bool firstImage = true;
-    int n = -1;
-    FileName fnFrame;
-    Image<T> croppedFrame, reducedFrame;
+    const auto &movieDim = this->getMovieSize();
+    newXdim = movieDim.x() * sizeFactor;
+    newYdim = movieDim.y() * sizeFactor;
+    const auto filter = this->createLPF(this->getPixelResolution(sizeFactor),
+            Dimensions(newXdim, newYdim));
+
+    const size_t N = this->nlast - this->nfirst + 1;
+    planMemory(movieDim, newYdim * (newXdim / 2 + 1) * sizeof(std::complex<float>));
 
     if (this->verbose) {
         std::cout << "Computing Fourier transform of frames ..." << std::endl;
-        init_progress_bar(movie.size());
+        init_progress_bar(N);
     }
 
-    for (size_t objId : movie.ids())
-    {
-        ++n;
-        if (n >= this->nfirst && n <= this->nlast) {
-            this->loadFrame(movie, dark, igain, objId, croppedFrame);
-
-            if (firstImage) {
-                firstImage = false;
-                newXdim = croppedFrame().xdim * sizeFactor;
-                newYdim = croppedFrame().ydim * sizeFactor;
-                filter = this->createLPF(this->getPixelResolution(sizeFactor), Dimensions(newXdim,
-                    newYdim));
-            }
+    // each worker has its own transformer (and plans) and auxiliary images
+    const size_t threads = threadPool.size();
+    std::vector<FourierTransformer> transformers(threads);
+    std::vector<MultidimArray<T>> reducedFrames(threads);
+    std::vector<MultidimArray<std::complex<T>>> spectra(threads);
+    std::mutex progressMutex;
+    size_t processed = 0;
+    auto routine = [&](int thrId, size_t offset, MultidimArray<T> &frame) {
+        if (cacheFrames) {
+            // keep the frame for the averaging, to avoid reading the movie again
+            typeCast(frame, frames.at(offset));
+        }
+        auto &reducedFrame = reducedFrames.at(thrId);
+        auto &spectrum = spectra.at(thrId);
 
-            // Reduce the size of the input frame
-            scaleToSizeFourier(1, newYdim, newXdim, croppedFrame(),
-                    reducedFrame());
+        // Reduce the size of the input frame
+        scaleToSizeFourier(1, newYdim, newXdim, frame, reducedFrame);
 
-            // Now do the Fourier transform and filter
-            auto *reducedFrameFourier =
-                    new MultidimArray<std::complex<T> >;
-            transformer.FourierTransform(reducedFrame(), *reducedFrameFourier,
-                    true);
-            for (size_t nn = 0; nn < filter.nzyxdim; ++nn) {
-                T wlpf = DIRECT_MULTIDIM_ELEM(filter, nn);
-                DIRECT_MULTIDIM_ELEM(*reducedFrameFourier,nn) *= wlpf;
-            }
-            frameFourier.push_back(reducedFrameFourier);
+        // Now do the Fourier transform and filter
+        transformers.at(thrId).FourierTransform(reducedFrame, spectrum, false);
+        auto &reducedFrameFourier = frameFourier.at(offset);
+        reducedFrameFourier.resizeNoCopy(YSIZE(spectrum), XSIZE(spectrum));
+        for (size_t nn = 0; nn < filter.nzyxdim; ++nn) {
+            T wlpf = DIRECT_MULTIDIM_ELEM(filter, nn);
+            DIRECT_MULTIDIM_ELEM(reducedFrameFourier, nn) =
+                    std::complex<float>(DIRECT_MULTIDIM_ELEM(spectrum, nn) * wlpf);
         }
-        if (this->verbose)
-            progress_bar(n);
+        if (this->verbose) {
+            std::unique_lock<std::mutex> lock(progressMutex);
+            progress_bar(++processed);
+        }
+    };
+
+    frameFourier.resize(N);
+    frames.clear();
+    if (cacheFrames) {
+        frames.resize(N);
     }
+    streamFrames(movie, dark, igain, streamWorkers, streamQueueCapacity, routine);
     if (this->verbose)
-        progress_bar(movie.size());
+        progress_bar(N);
+}
+
+/* Copy of the single precision spectrum in the precision of the program */
+template<typename T>
+static void convertSpectrum(const MultidimArray<std::complex<float>> &in,
+        MultidimArray<std::complex<T>> &out) {
+    out.resizeNoCopy(YSIZE(in), XSIZE(in));
+    for (size_t nn = 0; nn < in.nzyxdim; ++nn) {
+        DIRECT_MULTIDIM_ELEM(out, nn) = std::complex<T>(DIRECT_MULTIDIM_ELEM(in, nn));
+    }
 }
 
 template<typename T>
 void ProgMovieAlignmentCorrelation<T>::computeShifts(size_t N,
         const Matrix1D<T>& bX, const Matrix1D<T>& bY, const Matrix2D<T>& A) {
-    int idx = 0;
     assert(frameFourier.size() > 0);
-    MultidimArray<T> Mcorr;
-    Mcorr.resizeNoCopy(newYdim, newXdim);
-    Mcorr.setXmippOrigin();
-    CorrelationAux aux;
+    // index of the pair (i, j), i < j, in the equation system
+    auto pairIndex = [N](size_t i, size_t j) {
+        return i * N - (i * (i + 1)) / 2 + (j - i - 1);
+    };
+
+    // correlation buffers are private to each thread
+    const size_t threads = threadPool.size();
+    std::vector<CorrelationAux> auxs(threads);
+    std::vector<MultidimArray<T>> Mcorrs(threads);
+    std::vector<std::vector<MultidimArray<std::complex<T>>>> tileSpectra(threads,
+            std::vector<MultidimArray<std::complex<T>>>(2 * pairTileSize));
+    auto routine = [&](int thrId, size_t firstI, size_t firstJ) {
+        auto &Mcorr = Mcorrs.at(thrId);
+        auto &spectra = tileSpectra.at(thrId);
+        if (Mcorr.nzyxdim == 0) {
+            Mcorr.resizeNoCopy(newYdim, newXdim);
+            Mcorr.setXmippOrigin();
+        }
+        size_t lastI = std::min(firstI + pairTileSize, N - 1);
+        size_t lastJ = std::min(firstJ + pairTileSize, N);
+        // spectra are cached in single precision, correlate in the program precision
+        for (size_t i = firstI; i < lastI; ++i) {
+            convertSpectrum(frameFourier[i], spectra[i - firstI]);
+        }
+        for (size_t j = firstJ; j < lastJ; ++j) {
+            convertSpectrum(frameFourier[j], spectra[pairTileSize + j - firstJ]);
+        }
+        for (size_t i = firstI; i < lastI; ++i) {
+            for (size_t j = std::max(firstJ, i + 1); j < lastJ; ++j) {
+                size_t idx = pairIndex(i, j);
+                bestShift(spectra[i - firstI], spectra[pairTileSize + j - firstJ], Mcorr, bX(idx),
+                        bY(idx), auxs.at(thrId), nullptr, this->maxShift * sizeFactor);
+            }
+        }
+    };
+
+    // Pairs are scheduled in tiles of pairTileSize x pairTileSize frames,
+    // so that a task reuses the spectra of a few frames only
+    std::vector<std::future<void>> futures;
+    for (size_t firstI = 0; firstI < N - 1; firstI += pairTileSize) {
+        for (size_t firstJ = firstI; firstJ < N; firstJ += pairTileSize) {
+            futures.emplace_back(threadPool.push(routine, firstI, firstJ));
+        }
+    }
+    for (auto &f : futures) {
+        f.get();
+    }
+
     for (size_t i = 0; i < N - 1; ++i) {
         for (size_t j = i + 1; j < N; ++j) {
-            bestShift(*frameFourier[i], *frameFourier[j], Mcorr, bX(idx),
-                    bY(idx), aux, nullptr, this->maxShift * sizeFactor);
+            size_t idx = pairIndex(i, j);
             bX(idx) /= sizeFactor; // scale to expected size
             bY(idx) /= sizeFactor;
             if (this->verbose)
@@ -149,8 +677,6 @@ void ProgMovieAlignmentCorrelation<T>::computeShifts(size_t N,
                         << bY(idx) << ")\n";
             for (int ij = i; ij < j; ij++)
                 A(idx, ij) = 1;
-
-            idx++;
         }
     }
 }
@@ -180,8 +706,12 @@ void ProgMovieAlignmentCorrelation<T>::applyShiftsComputeAverage(
             bool isZeroShift = (XX(shift) == YY(shift)) // if shift is the same in both dimensions
                     && (XX(shift) == (T)0); // and it's zero
 
-            // load frame
-            this->loadFrame(movie, dark, igain, objId, croppedFrame);
+            // load frame, unless it was kept in memory
+            if (cacheFrames) {
+                typeCast(frames.at(frameOffset), croppedFrame());
+            } else {
+                this->loadFrame(movie, dark, igain, objId, croppedFrame);
+            }
 
             if ( ! this->fnInitialAvg.isEmpty()) {
                 if (frameIndex == this->nfirstSum)
@@ -30,6 +30,8 @@
 #include "data/filters.h"
 #include "core/xmipp_fftw.h"
 #include "reconstruction/movie_alignment_correlation_base.h"
+#include <CTPL/ctpl_stl.h>
+#include <functional>
 
 /**@defgroup ProgMovieAlignmentCorrelation Movie alignment correlation
    @ingroup ReconsLibrary */
@@ -43,7 +45,9 @@ public:
 private:
     /**
      * After running this method, all relevant images from the movie are
-     * loaded in 'frameFourier' and ready for further processing
+     * loaded in 'frameFourier' and ready for further processing.
+     * If the memory limit allows it, the corrected frames are also kept
+     * in 'frames', so that the movie is read only once
      * @param movie input
      * @param dark correction to be used
      * @param igain correction to be used
@@ -53,7 +57,8 @@ private:
 
     /**
      * Computes shifts of all images in the 'frameFourier'
-     * Method uses one thread to calculate correlations.
+     * Pairs of frames are split into tiles processed by the thread pool,
+     * each thread with its own correlation buffers.
      * @param N number of images to process
      * @param bX pair-wise shifts in X dimension
      * @param bY pair-wise shifts in Y dimension
@@ -89,12 +94,68 @@ private:
      * Inherited, see parent
      */
     void releaseAll() {
-        for (auto f : frameFourier) {
-            delete f;
-        }
         frameFourier.clear();
+        frames.clear();
     };
 
+    /**
+     * Reads all frames to be aligned and processes them in a pipeline:
+     * a reader thread, a gain and dark correction thread, and 'workers'
+     * threads of the pool calling processFrame(threadId, frameOffset, frame).
+     * The stages are connected by queues of queueCapacity frames, so at most
+     * 2 * queueCapacity + workers + 2 frames are in memory at any time.
+     * @param movie input
+     * @param dark correction to be used
+     * @param igain correction to be used
+     * @param workers number of threads of the pool to use
+     * @param queueCapacity of each queue
+     * @param processFrame routine of the last stage
+     */
+    void streamFrames(const MetaData& movie, const Image<T>& dark,
+            const Image<T>& igain, size_t workers, size_t queueCapacity,
+            const std::function<void(int, size_t, MultidimArray<T>&)> &processFrame);
+
+    /**
+     * Decides, using the memory limit, whether the corrected frames can be
+     * kept in memory, and how many frames can be processed at the same time
+     * @param movieDim size of the (cropped) movie
+     * @param spectrumBytes memory needed by a single cached spectrum
+     */
+    void planMemory(const Dimensions &movieDim, size_t spectrumBytes);
+
+    /**
+     * Loads all frames to be aligned to 'frames', after gain and dark correction
+     * @param movie input
+     * @param dark correction to be used
+     * @param igain correction to be used
+     */
+    void loadFrames(const MetaData& movie, const Image<T>& dark,
+            const Image<T>& igain);
+
+    /**
+     * Cuts out a patch of a frame, compensating the (rounded) global shift.
+     * The patch is summed with the neighbouring frames (see patchesAvg)
+     * @param patch to cut out
+     * @param globAlignment to compensate
+     * @param t index of the frame
+     * @param result where the patch is stored
+     */
+    void getPatchData(const Rectangle<Point2D<T>> &patch,
+            const AlignmentResult<T> &globAlignment, size_t t,
+            MultidimArray<T> &result) const;
+
+    /**
+     * Applies the local shifts to a single frame, using cubic BSpline interpolation.
+     * The shift field is evaluated separably, one row at a time
+     * @param frame to shift
+     * @param alignment to apply
+     * @param frameOffset index of the frame within the aligned frames
+     * @param result shifted frame
+     */
+    void applyLocalShifts(const MultidimArray<float> &frame,
+            const LocalAlignmentResult<T> &alignment, size_t frameOffset,
+            MultidimArray<T> &result) const;
+
     /**
      * Inherited, see parent
      */
@@ -104,9 +165,10 @@ private:
 private:
     /**
      *  Fourier transforms of the input images, after cropping, gain and dark
-     *  correction
+     *  correction. They are downscaled to the size of the correlation and
+     *  stored in single precision to save memory
      */
-    std::vector<MultidimArray<std::complex<T> > *> frameFourier;
+    std::vector<MultidimArray<std::complex<float> > > frameFourier;
 
     /** Sizes of the correlation */
     int newXdim;
@@ -114,6 +176,28 @@ private:
 
     /** Scale factor of the correlation and original frame size */
     float sizeFactor;
+
+    /** Frames after gain and dark correction, in single precision (empty if they do not fit in memory) */
+    std::vector<MultidimArray<float>> frames;
+
+    /** Maximal memory to use, in bytes */
+    size_t maxMemory;
+
+    /** Whether the corrected frames fit in memory, see planMemory */
+    bool cacheFrames = false;
+
+    /** Number of pool threads and capacity of the queues used by streamFrames */
+    size_t streamWorkers = 1;
+    size_t streamQueueCapacity = 1;
+
+    /** Number of neighbouring frames summed to a patch of the local alignment */
+    int patchesAvg;
+
+    /** Threads used for loading the frames and correlating them */
+    ctpl::thread_pool threadPool;
+
+    /** Number of frames per side of a tile of frame pairs */
+    static constexpr size_t pairTileSize = 4;
 };
 //@}
 #endif
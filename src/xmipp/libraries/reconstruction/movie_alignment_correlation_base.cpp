@@ -158,21 +158,27 @@ void AProgMovieAlignmentCorrelation<T>::loadFrame(const MetaData &movie,
     FileName fnFrame;
     movie.getValue(MDL_IMAGE, fnFrame, objId);
     out.read(fnFrame);
+    correctFrame(dark, igain, out());
+}
+
+template<typename T>
+void AProgMovieAlignmentCorrelation<T>::correctFrame(const Image<T> &dark,
+        const Image<T> &igain, MultidimArray<T> &frame) const {
     if (XSIZE(dark()) > 0) {
-        if ((XSIZE(dark()) != XSIZE(out()))
-                || (YSIZE(dark()) != YSIZE(out()))) {
+        if ((XSIZE(dark()) != XSIZE(frame))
+                || (YSIZE(dark()) != YSIZE(frame))) {
             REPORT_ERROR(ERR_ARG_INCORRECT,
                             "The dark image size does not match the movie frame size.");
         }
-        out() -= dark();
+        frame -= dark();
     }
     if (XSIZE(igain()) > 0) {
-        if ((XSIZE(igain()) != XSIZE(out()))
-                || (YSIZE(igain()) != YSIZE(out()))) {
+        if ((XSIZE(igain()) != XSIZE(frame))
+                || (YSIZE(igain()) != YSIZE(frame))) {
             REPORT_ERROR(ERR_ARG_INCORRECT,
                             "The gain image size does not match the movie frame size.");
         }
-        out() *= igain();
+        frame *= igain();
     }
 }
 
@@ -512,6 +518,53 @@ void AProgMovieAlignmentCorrelation<T>::storeResults(
     mdIref.write("localAlignment@" + fnOut, MD_APPEND);
 }
 
+template<typename T>
+std::vector<FramePatchMeta<T>> AProgMovieAlignmentCorrelation<T>::getPatchesLocation(
+        const std::pair<T, T> &borders, const Dimensions &patch) {
+    size_t patchesX = this->localAlignPatches.first;
+    size_t patchesY = this->localAlignPatches.second;
+    T windowXSize = this->getMovieSize().x() - 2 * borders.first;
+    T windowYSize = this->getMovieSize().y() - 2 * borders.second;
+    T corrX = std::ceil(((patchesX * patch.x()) - windowXSize) / (T) (patchesX - 1));
+    T corrY = std::ceil(((patchesY * patch.y()) - windowYSize) / (T) (patchesY - 1));
+    T stepX = (T)patch.x() - corrX;
+    T stepY = (T)patch.y() - corrY;
+    std::vector<FramePatchMeta<T>> result;
+    for (size_t y = 0; y < patchesY; ++y) {
+        for (size_t x = 0; x < patchesX; ++x) {
+            T tlx = borders.first + x * stepX; // Top Left
+            T tly = borders.second + y * stepY;
+            T brx = tlx + patch.x() - 1; // Bottom Right
+            T bry = tly + patch.y() - 1; // -1 for indexing
+            Point2D<T> tl(tlx, tly);
+            Point2D<T> br(brx, bry);
+            Rectangle<Point2D<T>> r(tl, br);
+            result.emplace_back(FramePatchMeta<T> { .rec = r, .id_x = x, .id_y = y });
+        }
+    }
+    return result;
+}
+
+template<typename T>
+std::pair<T,T> AProgMovieAlignmentCorrelation<T>::getMovieBorders(
+        const AlignmentResult<T> &globAlignment, int verbose) {
+    T minX = std::numeric_limits<T>::max();
+    T maxX = std::numeric_limits<T>::min();
+    T minY = std::numeric_limits<T>::max();
+    T maxY = std::numeric_limits<T>::min();
+    for (const auto& s : globAlignment.shifts) {
+        minX = std::min(std::floor(s.x), minX);
+        maxX = std::max(std::ceil(s.x), maxX);
+        minY = std::min(std::floor(s.y), minY);
+        maxY = std::max(std::ceil(s.y), maxY);
+    }
+    auto res = std::make_pair(std::abs(maxX - minX), std::abs(maxY - minY));
+    if (verbose > 1) {
+        std::cout << "Movie borders: x=" << res.first << " y=" << res.second << std::endl;
+    }
+    return res;
+}
+
 template<typename T>
 void AProgMovieAlignmentCorrelation<T>::setNoOfPatches() {
         // set number of patches
@@ -137,6 +137,15 @@ protected:
             const Image<T> &igain, size_t objId,
             Image<T> &out) const;
 
+    /**
+     * Method applies gain and dark pixel correction to a loaded frame
+     * @param dark pixel correction
+     * @param igain inverse gain correction
+     * @param frame to correct
+     */
+    void correctFrame(const Image<T> &dark, const Image<T> &igain,
+            MultidimArray<T> &frame) const;
+
     /**
      * This method applies global shifts and can also produce 'average'
      * image (micrograph)
@@ -213,6 +222,23 @@ protected:
      */
     float getScaleFactor() const;
 
+    /**
+     * Returns position of all local alignment patches within a single frame
+     * @param borders that should be left intact
+     * @param patch size
+     */
+    std::vector<FramePatchMeta<T>> getPatchesLocation(const std::pair<T, T> &borders,
+            const Dimensions &patch);
+
+    /**
+     * Returns the X and Y offset such that if you read from any frame after applying its global
+     * shift, you will always read valid data
+     * @param globAlignment to use
+     * @param verbose level
+     * @return no of pixels in X (Y) dimension where there might NOT be data from each frame
+     */
+    std::pair<T,T> getMovieBorders(const AlignmentResult<T> &globAlignment, int verbose);
+
     /** Returns size of the patch as requested by user */
     std::pair<size_t, size_t> getRequestedPatchSize() const {
         return {minLocalRes / Ts, minLocalRes / Ts};
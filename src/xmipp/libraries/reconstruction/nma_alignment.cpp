@@ -25,6 +25,8 @@
 #include "nma_alignment.h"
 #include "volume_from_pdb.h"
 #include "core/transformations.h"
+#include "data/fourier_projection.h"
+#include "data/sampling.h"
 #include "program_extension.h"
 #include "condor/Solver.h"
 #include <sys/stat.h>
@@ -125,42 +127,25 @@ void ProgNmaAlignment::show() {
 // Produce side information ================================================
 ProgNmaAlignment *global_nma_prog;
 
+// Level of pyramid of the global matching in the first stage
+static const int pyramidLevelDisc = 1;
+
 void ProgNmaAlignment::preProcess() {
-	MetaDataVec SF(fnModeList);
-	SF.removeDisabled();
-	numberOfModes = SF.size();
+	nmaDeformer.read(fnPDB, fnModeList);
+	numberOfModes = nmaDeformer.getNumberOfModes();
 	// Get the size of the images in the selfile
 	imgSize = xdimOut;
+	prepareDeformedVolumes();
+	prepareAssignment();
 	// Set the pointer of the program to this object
 	global_nma_prog = this;
 	//create some neededs files
 	createWorkFiles();
 }
 
-void ProgNmaAlignment::finishProcessing() {
-	XmippMetadataProgram::finishProcessing();
-	rename(Rerunable::getFileName().c_str(), fn_out.c_str());
-}
-
-// Create deformed PDB =====================================================
-FileName ProgNmaAlignment::createDeformedPDB(int pyramidLevel) const {
-	String program;
-	String arguments;
-	FileName fnRandom;
-	fnRandom.initUniqueName(nameTemplate,fnOutDir);
-	const char * randStr = fnRandom.c_str();
-
-	program = "xmipp_pdb_nma_deform";
-	arguments = formatString(
-			"--pdb %s -o %s_deformedPDB.pdb --nma %s --deformations ",
-			fnPDB.c_str(), randStr, fnModeList.c_str());
-	for (size_t i = 0; i < VEC_XSIZE(trial) - 5; ++i)
-		arguments += floatToString(trial(i)) + " ";
-	runSystem(program, arguments, false);
-
-	program = "xmipp_volume_from_pdb";
-	arguments = formatString(
-			"-i %s_deformedPDB.pdb --size %i --sampling %f -v 0", randStr,
+void ProgNmaAlignment::prepareDeformedVolumes() {
+	String arguments = formatString(
+			"-i %s --size %i --sampling %f -v 0", fnPDB.c_str(),
 			imgSize, sampling_rate);
 
 	if (do_centerPDB)
@@ -173,44 +158,157 @@ FileName ProgNmaAlignment::createDeformedPDB(int pyramidLevel) const {
 	}
 	//else
 		//arguments +=" --poor_Gaussian"; // Otherwise, a detailed conversion of the atoms takes too long in this context
-		
+
 	progVolumeFromPDB->read(arguments);
-	progVolumeFromPDB->tryRun();
+	progVolumeFromPDB->produceSideInfo(nmaDeformer.pdb);
 
+	// Same filter as xmipp_transform_filter --fourier low_pass
 	if (do_FilterPDBVol) {
-		program = "xmipp_transform_filter";
-		arguments = formatString(
-						"-i %s_deformedPDB.vol --sampling %f --fourier low_pass %f  -v 0",
-						randStr, sampling_rate, cutoff_LPfilter);
-		runSystem(program, arguments, false);
+		filterDeformedVol.FilterShape = RAISED_COSINE;
+		filterDeformedVol.FilterBand = LOWPASS;
+		filterDeformedVol.w1 = sampling_rate / cutoff_LPfilter;
+		filterDeformedVol.raised_w = 0.02;
+		filterDeformedVol.do_generate_3dmask = true;
+		MultidimArray<double> mockVol(imgSize, imgSize, imgSize);
+		filterDeformedVol.generateMask(mockVol);
 	}
+}
+
+void ProgNmaAlignment::prepareAssignment() {
+	// Same arguments as the external programs used to be called with
+	continuousAssigner.gaussian_DFT_sigma = gaussian_DFT_sigma;
+	continuousAssigner.gaussian_Real_sigma = gaussian_Real_sigma;
+	continuousAssigner.weight_zero_freq = weight_zero_freq;
+	continuousAssigner.max_no_iter = 60;
+	continuousAssigner.max_shift = -1;
+	continuousAssigner.max_angular_change = -1;
+	continuousAssigner.verbose = 0;
 
-	if (pyramidLevel != 0) {
-		Image<double> I;
-		FileName fnDeformed = formatString("%s_deformedPDB.vol",randStr);
-		I.read(fnDeformed);
-		selfPyramidReduce(xmipp_transformation::BSPLINE3, I(), pyramidLevel);
-		I.write(fnDeformed);
+	if (projMatch)
+		return;
+
+	discreteAssigner.fn_sym = "";
+	discreteAssigner.max_proj_change = -1;
+	discreteAssigner.max_psi_change = -1;
+	discreteAssigner.psi_step = 5;
+	discreteAssigner.shift_step = 1;
+	discreteAssigner.th_discard = 50;
+	discreteAssigner.smin = 1;
+	discreteAssigner.smax = -1;
+	discreteAssigner.pick = 1;
+	discreteAssigner.tell = 0;
+	discreteAssigner.checkMirrors = 1;
+	discreteAssigner.search5D = true;
+	discreteAssigner.verbose = 0;
+
+	// Same directions as xmipp_angular_project_library
+	double angSampling=2*RAD2DEG(atan(1.0/((double) imgSize / pow(2.0, (double) pyramidLevelDisc+1))));
+	angSampling=std::max(angSampling,discrAngStep);
+	Sampling mysampling;
+	mysampling.verbose=0;
+	mysampling.setSampling(angSampling);
+	int symmetry, sym_order;
+	mysampling.SL.isSymmetryGroup("c1", symmetry, sym_order);
+	mysampling.computeSamplingPoints(false,180,0);
+	mysampling.SL.readSymmetryFile("c1");
+	mysampling.fillLRRepository();
+	mysampling.removeRedundantPoints(symmetry, sym_order);
+	size_t Ndirs=mysampling.no_redundant_sampling_points_angles.size();
+	galleryRot.resize(Ndirs);
+	galleryTilt.resize(Ndirs);
+	galleryPsi.resize(Ndirs);
+	for (size_t k=0; k<Ndirs; ++k)
+	{
+		const Matrix1D<double> &angles=mysampling.no_redundant_sampling_points_angles[k];
+		galleryRot[k]=XX(angles);
+		galleryTilt[k]=YY(angles);
+		galleryPsi[k]=ZZ(angles);
 	}
-	return fnRandom;
+
+	if (fnmask != "") {
+		projectionMask.type = READ_BINARY_MASK;
+		projectionMask.fn_mask = fnmask;
+		projectionMask.generate_mask();
+	}
+}
+
+void ProgNmaAlignment::finishProcessing() {
+	XmippMetadataProgram::finishProcessing();
+	rename(Rerunable::getFileName().c_str(), fn_out.c_str());
+}
+
+// Create deformed volume ==================================================
+MultidimArray<double> &ProgNmaAlignment::createDeformedVolume(int pyramidLevel) {
+	PDBRichPhantom deformedPDB;
+	nmaDeformer.deform(MATRIX1D_ARRAY(trial), numberOfModes, deformedPDB);
+	progVolumeFromPDB->convert(deformedPDB);
+
+	MultidimArray<double> &V = progVolumeFromPDB->Vlow();
+	if (do_FilterPDBVol)
+		filterDeformedVol.applyMaskSpace(V);
+	if (pyramidLevel != 0)
+		selfPyramidReduce(xmipp_transformation::BSPLINE3, V, pyramidLevel);
+	return V;
+}
+
+void ProgNmaAlignment::getReducedImage(int pyramidLevel,
+		MultidimArray<double> &I) const {
+	I = currentImg();
+	if (pyramidLevel != 0)
+		selfPyramidReduce(xmipp_transformation::BSPLINE3, I, pyramidLevel);
+	I.resetOrigin();
 }
 
 // Perform complete search =================================================
-void ProgNmaAlignment::performCompleteSearch(const FileName &fnRandom,
-		int pyramidLevel) const {
+void ProgNmaAlignment::performCompleteSearch(MultidimArray<double> &V,
+		int pyramidLevel) {
+	// Reference projections (same projector as xmipp_angular_project_library)
+	V.setXmippOrigin();
+	MultidimArray<double> gallery;
+	{
+		FourierProjector projector(V, 1, 0.25, xmipp_transformation::BSPLINE3);
+		projector.projectBatch(galleryRot, galleryTilt, galleryPsi, gallery);
+	}
+	size_t Ndirs = NSIZE(gallery);
+	std::vector<MultidimArray<double>> refs(Ndirs);
+	MultidimArray<double> P;
+	for (size_t k = 0; k < Ndirs; ++k) {
+		P.aliasImageInStack(gallery, k);
+		refs[k] = P;
+		refs[k].setXmippOrigin();
+		if (fnmask != "")
+			projectionMask.apply_mask(refs[k], refs[k]);
+	}
+	discreteAssigner.setReferences(refs, galleryRot, galleryTilt);
+
+	// Perform alignment
+	Image<double> I;
+	getReducedImage(pyramidLevel, I());
+	I.setEulerAngles(0, 0, 0);
+	I.setShifts(0, 0);
+	discreteAssigner.max_shift_change = (int)round((double) imgSize / (10.0 * pow(2.0, (double) pyramidLevel)));
+	size_t n = VEC_XSIZE(trial);
+	discreteAssigner.assignImage(I, trial(n - 5), trial(n - 4), trial(n - 3),
+			trial(n - 2), trial(n - 1));
+}
+
+void ProgNmaAlignment::performProjectionMatching(const MultidimArray<double> &V,
+		int pyramidLevel) {
 	String program;
 	String arguments;
+	FileName fnRandom;
+	fnRandom.initUniqueName(nameTemplate,fnOutDir);
 	const char * randStr = fnRandom.c_str();
 
+	Image<double> Vaux;
+	Vaux() = V;
+	Vaux.write(fnRandom + "_deformedPDB.vol");
+
 	// Reduce the image
 	FileName fnDown = formatString("%s_downimg.xmp", fnRandom.c_str());
-	if (pyramidLevel != 0) {
-		Image<double> I;
-		I.read(currentImgName);
-		selfPyramidReduce(xmipp_transformation::BSPLINE3, I(), pyramidLevel);
-		I.write(fnDown);
-	} else
-		copyImage(currentImgName.c_str(), fnDown.c_str());
+	Image<double> I;
+	getReducedImage(pyramidLevel, I());
+	I.write(fnDown);
 
 	mkdir((fnRandom+"_ref").c_str(), S_IRWXU);
 
@@ -220,9 +318,8 @@ void ProgNmaAlignment::performCompleteSearch(const FileName &fnRandom,
 	arguments = formatString(
 			"-i %s_deformedPDB.vol -o %s_ref/ref.stk --sampling_rate %f -v 0",
 			randStr, randStr, angSampling);
-	if (projMatch)
-		arguments +=formatString(
-						" --compute_neighbors --angular_distance -1 --experimental_images %s_downimg.xmp", randStr);
+	arguments +=formatString(
+					" --compute_neighbors --angular_distance -1 --experimental_images %s_downimg.xmp", randStr);
 
 	runSystem(program, arguments, false);
 
@@ -237,81 +334,60 @@ void ProgNmaAlignment::performCompleteSearch(const FileName &fnRandom,
 
 	// Perform alignment
 	String fnOut=formatString("%s_angledisc.xmd",randStr);
-	if (!projMatch) {
-		program = "xmipp_angular_discrete_assign";
-		arguments = formatString(
-						"-i %s_downimg.xmp --ref %s -o %s --psi_step 5 --max_shift_change %d --search5D -v 0",
-						randStr, refSelStr.c_str(), fnOut.c_str(), (int)round((double) imgSize / (10.0 * pow(2.0, (double) pyramidLevel))));
-	} else {
-		String refStkStr = formatString("%s_ref/ref.stk", randStr);
-		program = "xmipp_angular_projection_matching";
-		arguments =	formatString(
-				        "-i %s_downimg.xmp --ref %s -o %s --search5d_step 1  --search5d_shift %d -v 0",
-				        randStr, refStkStr.c_str(), fnOut.c_str(), (int)round((double) imgSize / (10.0 * pow(2.0, (double) pyramidLevel))));
-	}
+	String refStkStr = formatString("%s_ref/ref.stk", randStr);
+	program = "xmipp_angular_projection_matching";
+	arguments =	formatString(
+			        "-i %s_downimg.xmp --ref %s -o %s --search5d_step 1  --search5d_shift %d -v 0",
+			        randStr, refStkStr.c_str(), fnOut.c_str(), (int)round((double) imgSize / (10.0 * pow(2.0, (double) pyramidLevel))));
 	runSystem(program, arguments, false);
-	if (projMatch)
+
+	MetaDataVec MD;
+	MD.read(fnOut);
+	bool flip;
+	double rot, tilt, psi, shiftX, shiftY;
+	size_t id=MD.firstRowId();
+	MD.getValue(MDL_FLIP,flip,id);
+	MD.getValue(MDL_ANGLE_ROT,rot,id);
+	MD.getValue(MDL_ANGLE_TILT,tilt,id);
+	MD.getValue(MDL_ANGLE_PSI,psi,id);
+	MD.getValue(MDL_SHIFT_X,shiftX,id);
+	MD.getValue(MDL_SHIFT_Y,shiftY,id);
+	if (flip)
 	{
-		MetaDataVec MD;
-		MD.read(fnOut);
-		bool flip;
-		size_t id=MD.firstRowId();
-		MD.getValue(MDL_FLIP,flip,id);
-		if (flip)
-		{
-			// This is because continuous assignment does not understand flips
-
-			double shiftX, rot, tilt, psi, newrot, newtilt, newpsi;
-			// Change sign in shiftX
-			MD.getValue(MDL_SHIFT_X,shiftX,id);
-			MD.setValue(MDL_SHIFT_X,-shiftX,id);
-
-			// Change Euler angles
-			MD.getValue(MDL_ANGLE_ROT,rot,id);
-			MD.getValue(MDL_ANGLE_TILT,tilt,id);
-			MD.getValue(MDL_ANGLE_PSI,psi,id);
-			Euler_mirrorY(rot,tilt,psi,newrot,newtilt,newpsi);
-			MD.setValue(MDL_ANGLE_ROT,newrot,id);
-			MD.setValue(MDL_ANGLE_TILT,newtilt,id);
-			MD.setValue(MDL_ANGLE_PSI,newpsi,id);
-			MD.write(fnOut);
-		}
+		// This is because continuous assignment does not understand flips
+		double newrot, newtilt, newpsi;
+		shiftX = -shiftX;
+		Euler_mirrorY(rot,tilt,psi,newrot,newtilt,newpsi);
+		rot = newrot;
+		tilt = newtilt;
+		psi = newpsi;
 	}
+	size_t n = VEC_XSIZE(trial);
+	trial(n - 5) = rot;
+	trial(n - 4) = tilt;
+	trial(n - 3) = psi;
+	trial(n - 2) = shiftX;
+	trial(n - 1) = shiftY;
+
+	runSystem("rm", formatString("-rf %s* &", randStr));
 }
 
 // Continuous assignment ===================================================
-double ProgNmaAlignment::performContinuousAssignment(const FileName &fnRandom,
-		int pyramidLevel) const {
-	// Perform alignment
-	const char * randStr = fnRandom.c_str();
-	String fnResults=formatString("%s_anglecont.xmd", randStr);
-	bool costSource=true;
-	String program = "xmipp_angular_continuous_assign";
-	String arguments =
-			formatString(
-					"-i %s_angledisc.xmd --ref %s_deformedPDB.vol -o %s --gaussian_Fourier %f --gaussian_Real %f --zerofreq_weight %f -v 0",
-					randStr, randStr, fnResults.c_str(), gaussian_DFT_sigma,
-					gaussian_Real_sigma, weight_zero_freq);
-	runSystem(program, arguments, false);
+double ProgNmaAlignment::performContinuousAssignment(MultidimArray<double> &V,
+		int pyramidLevel) {
+	continuousAssigner.prepareVolume(V);
 
-	// Pick up results
-	MetaDataVec DF(fnResults);
-	MDRowVec row;
-	DF.getRow(row, DF.firstRowId());
-	row.getValue(MDL_ANGLE_ROT, trial(VEC_XSIZE(trial) - 5));
-	row.getValue(MDL_ANGLE_TILT, trial(VEC_XSIZE(trial) - 4));
-	row.getValue(MDL_ANGLE_PSI, trial(VEC_XSIZE(trial) - 3));
-	row.getValue(MDL_SHIFT_X, trial(VEC_XSIZE(trial) - 2));
-	trial(VEC_XSIZE(trial) - 2) *= pow(2.0, (double) pyramidLevel);
-	row.getValue(MDL_SHIFT_Y, trial(VEC_XSIZE(trial) - 1));
-	trial(VEC_XSIZE(trial) - 1) *= pow(2.0, (double) pyramidLevel);
-	double tempvar;
-	if (!costSource) {
-		row.getValue(MDL_MAXCC, tempvar);
-		tempvar = -tempvar;
-	} else
-		row.getValue(MDL_COST, tempvar);
-	return tempvar;
+	MultidimArray<double> I;
+	getReducedImage(pyramidLevel, I);
+	I.setXmippOrigin();
+
+	// Perform alignment
+	size_t n = VEC_XSIZE(trial);
+	double cost = continuousAssigner.assignPose(I, trial(n - 5), trial(n - 4),
+			trial(n - 3), trial(n - 2), trial(n - 1));
+	trial(n - 2) *= pow(2.0, (double) pyramidLevel);
+	trial(n - 1) *= pow(2.0, (double) pyramidLevel);
+	return cost;
 }
 
 void ProgNmaAlignment::updateBestFit(double fitness) {
@@ -329,47 +405,23 @@ double ObjFunc_nma_alignment::eval(Vector X, int *nerror) {
 		global_nma_prog->trial(i) = X[i];
 	}
 
-	int pyramidLevelDisc = 1;
 	int pyramidLevelCont = (global_nma_prog->currentStage == 1) ? 1 : 0;
 
-	FileName fnRandom = global_nma_prog->createDeformedPDB(pyramidLevelCont);
-	const char * randStr = fnRandom.c_str();
+	MultidimArray<double> &V = global_nma_prog->createDeformedVolume(pyramidLevelCont);
 
 	if (global_nma_prog->currentStage == 1) {
-		global_nma_prog->performCompleteSearch(fnRandom, pyramidLevelDisc);
+		if (global_nma_prog->projMatch)
+			global_nma_prog->performProjectionMatching(V, pyramidLevelDisc);
+		else
+			global_nma_prog->performCompleteSearch(V, pyramidLevelDisc);
 	} else {
-		double rot, tilt, psi, xshift, yshift;
-		MetaDataVec DF;
-
-		rot = global_nma_prog->bestStage1(
-				VEC_XSIZE(global_nma_prog->bestStage1) - 5);
-		tilt = global_nma_prog->bestStage1(
-				VEC_XSIZE(global_nma_prog->bestStage1) - 4);
-		psi = global_nma_prog->bestStage1(
-				VEC_XSIZE(global_nma_prog->bestStage1) - 3);
-		xshift = global_nma_prog->bestStage1(
-				VEC_XSIZE(global_nma_prog->bestStage1) - 2);
-		yshift = global_nma_prog->bestStage1(
-				VEC_XSIZE(global_nma_prog->bestStage1) - 1);
-
-		size_t objId = DF.addObject();
-		FileName fnDown = formatString("%s_downimg.xmp", randStr);
-		DF.setValue(MDL_IMAGE, fnDown, objId);
-		DF.setValue(MDL_ENABLED, 1, objId);
-		DF.setValue(MDL_ANGLE_ROT, rot, objId);
-		DF.setValue(MDL_ANGLE_TILT, tilt, objId);
-		DF.setValue(MDL_ANGLE_PSI, psi, objId);
-		DF.setValue(MDL_SHIFT_X, xshift, objId);
-		DF.setValue(MDL_SHIFT_Y, yshift, objId);
-
-		DF.write(formatString("%s_angledisc.xmd", randStr));
-		copyImage(global_nma_prog->currentImgName.c_str(), fnDown.c_str());
+		size_t n = VEC_XSIZE(global_nma_prog->trial);
+		for (size_t i = n - 5; i < n; i++)
+			global_nma_prog->trial(i) = global_nma_prog->bestStage1(i);
 	}
-	double fitness = global_nma_prog->performContinuousAssignment(fnRandom,
+	double fitness = global_nma_prog->performContinuousAssignment(V,
 			pyramidLevelCont);
 
-	runSystem("rm", formatString("-rf %s* &", randStr));
-
 	global_nma_prog->updateBestFit(fitness);
 	return fitness;
 }
@@ -393,6 +445,7 @@ void ProgNmaAlignment::processImage(const FileName &fnImg,
 
 	parameters.initZeros(dim + 5);
 	currentImgName = fnImg;
+	currentImg.read(fnImg);
 	sprintf(nameTemplate, "_node%d_img%lu_XXXXXX", rangen, (long unsigned int)imageCounter);
 
 	trial.initZeros(dim + 5);
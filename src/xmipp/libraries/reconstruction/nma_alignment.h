@@ -30,13 +30,28 @@
 #include "core/metadata_vec.h"
 #include "core/xmipp_metadata_program.h"
 #include "core/rerunable_program.h"
+#include "data/fourier_filter.h"
+#include "data/mask.h"
+#include "angular_continuous_assign.h"
+#include "angular_discrete_assign.h"
+#include "pdb_nma_deform.h"
 
 class ProgPdbConverter;
 
 /**@defgroup NMAAlignment Alignment with Normal modes
    @ingroup ReconsLibrary */
 //@{
-/** NMA Alignment Parameters. */
+/** NMA Alignment Parameters.
+ *
+ * Unlike other image alignment programs, this one is not a
+ * ThreadedMetadataProgram. Each image is optimized by CONDOR, and the
+ * fitness is evaluated from inside the optimizer, but CONDOR keeps its
+ * solver state in globals (mQ_QP, mR_QP, vi_QP and vLastLambda_QP in
+ * QPSolver.cpp, the static work vectors of findAlpha in UTRSSolver.cpp,
+ * FullLambda used by CNLSolver.cpp). Two images cannot be optimized at
+ * the same time in one process, so images are only processed in
+ * parallel by the MPI version (one image per rank).
+ */
 class ProgNmaAlignment: public XmippMetadataProgram, public Rerunable
 {
 public:
@@ -119,6 +134,9 @@ public:
     
     // Current image being considered
     FileName currentImgName;
+
+    // Current image, read once per image
+    Image<double> currentImg;
     
     // Current stage of optimization
     int currentStage;
@@ -135,6 +153,24 @@ public:
     // Volume from PDB
     ProgPdbConverter* progVolumeFromPDB;
 
+    // Reference structure and normal modes
+    NMADeformer nmaDeformer;
+
+    // Low-pass filter for the deformed volumes
+    FourierFilter filterDeformedVol;
+
+    // Directions of the reference projections of the global matching
+    std::vector<double> galleryRot, galleryTilt, galleryPsi;
+
+    // 2D mask of the reference projections
+    Mask projectionMask;
+
+    // Wavelet-based global matching with the reference projections
+    ProgAngularDiscreteAssign discreteAssigner;
+
+    // Local (Fourier central slice) refinement of the pose
+    ProgAngularContinuousAssign continuousAssigner;
+
 public:
     /// Empty constructor
     ProgNmaAlignment();
@@ -151,19 +187,40 @@ public:
     /// Show
     void show();
 
-   /** Create deformed PDB */
-    FileName createDeformedPDB(int pyramidLevel) const;
-
-    /** Perform a complete search with the given image and reference
-        volume at the given level of pyramid. Return the values
-    in the last five positions of trial. */
-    void performCompleteSearch(const FileName &fnRandom,
-        int pyramidLevel) const;
-
-    /** Perform a continuous search with the given image and reference
-        volume at the given pyramid level. Return the values
-    in the last five positions of trial. */
-    double performContinuousAssignment(const FileName &fnRandom, int pyramidLevel) const;
+   /** Create deformed volume.
+       The structure is deformed, converted to a volume, filtered and
+       reduced in memory. The returned volume is overwritten by the next
+       call. */
+    MultidimArray<double> &createDeformedVolume(int pyramidLevel);
+
+    /** Prepare the in-memory conversion of deformed structures to volumes */
+    void prepareDeformedVolumes();
+
+    /** Prepare the directions, the mask and the assignment programs
+        of the global and local matching. */
+    void prepareAssignment();
+
+    /** Current image reduced to the given level of pyramid */
+    void getReducedImage(int pyramidLevel, MultidimArray<double> &I) const;
+
+    /** Perform a complete search with the current image and the reference
+        volume V at the given level of pyramid. The reference projections
+        are computed and matched in memory. Return the values in the last
+        five positions of trial (shifts at that level of pyramid). */
+    void performCompleteSearch(MultidimArray<double> &V, int pyramidLevel);
+
+    /** Same as performCompleteSearch, with the real-space projection
+        matching (--projMatch). This one still goes through
+        xmipp_angular_project_library and xmipp_angular_projection_matching,
+        so the volume and the image are written to temporary files. */
+    void performProjectionMatching(const MultidimArray<double> &V,
+        int pyramidLevel);
+
+    /** Perform a continuous search with the current image and the reference
+        volume V at the given pyramid level, starting from the pose in the
+        last five positions of trial. Return the values
+    in the last five positions of trial. The volume is modified. */
+    double performContinuousAssignment(MultidimArray<double> &V, int pyramidLevel);
 
     /** Computes the fitness of a set of trial parameters */
     double computeFitness(Matrix1D<double> &trial) const;
@@ -128,11 +128,11 @@ void ProgNmaAlignmentVol::show() {
 ProgNmaAlignmentVol *global_nma_vol_prog;
 
 void ProgNmaAlignmentVol::preProcess() {
-	MetaDataVec SF(fnModeList);
-	SF.removeDisabled();
-	numberOfModes = SF.size();
+	nmaDeformer.read(fnPDB, fnModeList);
+	numberOfModes = nmaDeformer.getNumberOfModes();
 	// Get the size of the images in the selfile
 	imgSize = xdimOut;
+	prepareDeformedVolumes();
 	// Set the pointer of the program to this object
 	global_nma_vol_prog = this;
 	//create some neededs files
@@ -150,28 +150,9 @@ void ProgNmaAlignmentVol::finishProcessing() {
 	rename(Rerunable::getFileName().c_str(), fn_out.c_str());
 }
 
-// Create deformed PDB =====================================================
-void deformPDB(const FileName &PDBin, const FileName &PDBout, const FileName &fnModeList,
-		const Matrix1D<double> &trial)
-{
-	String program = "xmipp_pdb_nma_deform";
-	String arguments = formatString("--pdb %s -o %s --nma %s --deformations ",PDBin.c_str(), PDBout.c_str(), fnModeList.c_str());
-	for (size_t i = 0; i < VEC_XSIZE(trial); ++i)
-		arguments += floatToString(trial(i)) + " ";
-	runSystem(program, arguments, false);
-}
-
-FileName ProgNmaAlignmentVol::createDeformedPDB() const {
-	String program;
-	String arguments;
-	FileName fnRandom;
-	fnRandom.initUniqueName(nameTemplate,fnOutDir);
-	const char * randStr = fnRandom.c_str();
-
-	deformPDB(fnPDB,formatString("%s_deformedPDB.pdb",randStr),fnModeList,trial);
-	program = "xmipp_volume_from_pdb";
-	arguments = formatString(
-			"-i %s_deformedPDB.pdb --size %i --sampling %f -v 0", randStr,
+void ProgNmaAlignmentVol::prepareDeformedVolumes() {
+	String arguments = formatString(
+			"-i %s --size %i --sampling %f -v 0", fnPDB.c_str(),
 			imgSize, sampling_rate);
 
 	if (do_centerPDB)
@@ -182,17 +163,38 @@ FileName ProgNmaAlignmentVol::createDeformedPDB() const {
 		if (sigmaGaussian >= 0)
 			arguments += formatString("%f",sigmaGaussian);
 	}
-		
+
 	progVolumeFromPDB->read(arguments);
-	progVolumeFromPDB->tryRun();
+	progVolumeFromPDB->produceSideInfo(nmaDeformer.pdb);
 
+	// Same filter as xmipp_transform_filter --fourier low_pass
 	if (do_FilterPDBVol) {
-		program = "xmipp_transform_filter";
-		arguments = formatString(
-						"-i %s_deformedPDB.vol --sampling %f --fourier low_pass %f  -v 0",
-						randStr, sampling_rate, cutoff_LPfilter);
-		runSystem(program, arguments, false);
+		filterDeformedVol.FilterShape = RAISED_COSINE;
+		filterDeformedVol.FilterBand = LOWPASS;
+		filterDeformedVol.w1 = sampling_rate / cutoff_LPfilter;
+		filterDeformedVol.raised_w = 0.02;
+		filterDeformedVol.do_generate_3dmask = true;
+		MultidimArray<double> mockVol(imgSize, imgSize, imgSize);
+		filterDeformedVol.generateMask(mockVol);
 	}
+}
+
+// Create deformed PDB =====================================================
+FileName ProgNmaAlignmentVol::createDeformedPDB() {
+	FileName fnRandom;
+	fnRandom.initUniqueName(nameTemplate,fnOutDir);
+
+	PDBRichPhantom deformedPDB;
+	nmaDeformer.deform(MATRIX1D_ARRAY(trial), numberOfModes, deformedPDB);
+	progVolumeFromPDB->convert(deformedPDB);
+
+	Vdeformed() = progVolumeFromPDB->Vlow();
+	if (do_FilterPDBVol)
+		filterDeformedVol.applyMaskSpace(Vdeformed());
+
+	// Only the external volume alignment needs the volume on disk
+	if (alignVolumes)
+		Vdeformed.write(fnRandom + "_deformedPDB.vol");
 
 	return fnRandom;
 }
@@ -251,7 +253,6 @@ double ObjFunc_nma_alignment_vol::eval(Vector X, int *nerror) {
 	}
 
 	else{
-		global_nma_vol_prog->Vdeformed.read(formatString("%s_deformedPDB.vol",fnRandom.c_str()));
 		auto mask = (0 == XSIZE(global_nma_vol_prog->mask)) ? nullptr : &global_nma_vol_prog->mask;
 		retval = 1 - correlationIndex(global_nma_vol_prog->V(), global_nma_vol_prog->Vdeformed(), mask);
 		//global_nma_vol_prog->V().printStats();
@@ -314,7 +315,11 @@ void ProgNmaAlignmentVol::processImage(const FileName &fnImg,
 
 	writeVolumeParameters(fnImg);
 	if (fnOutPDB!="")
-		deformPDB(fnPDB,fnOutPDB,fnModeList,trial_best);
+	{
+		PDBRichPhantom deformedPDB;
+		nmaDeformer.deform(MATRIX1D_ARRAY(trial_best), numberOfModes, deformedPDB);
+		deformedPDB.write(fnOutPDB);
+	}
 	delete of;
 }
 
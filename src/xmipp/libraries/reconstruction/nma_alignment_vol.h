@@ -29,6 +29,8 @@
 #include "core/xmipp_image.h"
 #include "core/xmipp_metadata_program.h"
 #include "core/rerunable_program.h"
+#include "data/fourier_filter.h"
+#include "pdb_nma_deform.h"
 
 class ProgPdbConverter;
 
@@ -127,6 +129,12 @@ public:
     // Volume from PDB
     ProgPdbConverter* progVolumeFromPDB;
 
+    // Reference structure and normal modes
+    NMADeformer nmaDeformer;
+
+    // Low-pass filter for the deformed volumes
+    FourierFilter filterDeformedVol;
+
     // Volume that is being fitted
     Image<double> V, Vdeformed;
 
@@ -157,8 +165,14 @@ public:
     /// Show
     void show();
 
-   /** Create deformed PDB */
-    FileName createDeformedPDB() const;
+   /** Create deformed volume.
+       The structure is deformed and converted to a volume in memory
+       (left in Vdeformed). The volume is only written to disk when it
+       has to be aligned by an external program. */
+    FileName createDeformedPDB();
+
+    /** Prepare the in-memory conversion of deformed structures to volumes */
+    void prepareDeformedVolumes();
 
     /** Computes the fitness of a set of trial parameters */
     double computeFitness(Matrix1D<double> &trial) const;
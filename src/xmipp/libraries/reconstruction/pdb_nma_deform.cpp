@@ -69,37 +69,54 @@ void ProgPdbNmaDeform::show()
 
 void ProgPdbNmaDeform::run()
 {
+	NMADeformer deformer;
+	deformer.read(fn_pdb,fn_nma);
 	PDBRichPhantom pdb;
-	MetaDataVec modes;
-	pdb.read(fn_pdb);
-	modes.read(fn_nma);
-	modes.removeDisabled();
-	int j=0;
-	FileName fnMode;
-	MultidimArray<double> mode;
-	mode.resizeNoCopy(pdb.getNumberOfAtoms(),3);
+	deformer.deform(MULTIDIM_ARRAY(deformations),XSIZE(deformations),pdb);
+	pdb.write(fn_out);
+}
 
-	for (size_t objId : modes.ids())
+void NMADeformer::read(const FileName &fnPDB, const FileName &fnModeList)
+{
+	pdb.read(fnPDB);
+	MetaDataVec modeList;
+	modeList.read(fnModeList);
+	modeList.removeDisabled();
+	modes.clear();
+	modes.reserve(modeList.size());
+	FileName fnMode;
+	for (size_t objId : modeList.ids())
 	{
-		// Read mode
-		modes.getValue(MDL_NMA_MODEFILE,fnMode,objId);
+		modeList.getValue(MDL_NMA_MODEFILE,fnMode,objId);
 		std::ifstream fhMode;
 		fhMode.open(fnMode.c_str());
 		if (!fhMode)
 			REPORT_ERROR(ERR_IO_NOREAD,fnMode);
+		MultidimArray<double> mode;
+		mode.resizeNoCopy(pdb.getNumberOfAtoms(),3);
 		fhMode >> mode;
 		fhMode.close();
+		modes.push_back(mode);
+	}
+}
 
-		// Apply mode
-		double lambda=A1D_ELEM(deformations,j);
+void NMADeformer::deform(const double *amplitudes, size_t Namplitudes,
+                         PDBRichPhantom &deformed) const
+{
+	if (Namplitudes<modes.size())
+		REPORT_ERROR(ERR_ARG_INCORRECT,formatString("There are %lu modes but only %lu deformation amplitudes",
+		             modes.size(),Namplitudes));
+	deformed=pdb;
+	for (size_t j=0; j<modes.size(); ++j)
+	{
+		const MultidimArray<double> &mode=modes[j];
+		double lambda=amplitudes[j];
 		for (size_t i=0; i<YSIZE(mode); ++i)
 		{
-			RichAtom& atom_i=pdb.atomList[i];
+			RichAtom& atom_i=deformed.atomList[i];
 			atom_i.x+=lambda*DIRECT_A2D_ELEM(mode,i,0);
 			atom_i.y+=lambda*DIRECT_A2D_ELEM(mode,i,1);
 			atom_i.z+=lambda*DIRECT_A2D_ELEM(mode,i,2);
 		}
-		j++;
 	}
-	pdb.write(fn_out);
 }
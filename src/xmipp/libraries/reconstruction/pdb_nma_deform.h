@@ -28,10 +28,42 @@
 #include "core/xmipp_program.h"
 #include "core/multidim_array.h"
 #include "core/xmipp_filename.h"
+#include "data/pdb.h"
+#include <vector>
 
 /**@defgroup PDBNMADeform Deform PDB according to NMA
    @ingroup ReconsLibrary */
 //@{
+/** Normal mode deformation of a PDB kept in memory.
+    The reference structure and the enabled modes of a mode list are read
+    once, so that many deformations can be evaluated without going through
+    disk. Each mode is a Natoms x 3 array with the displacement of each atom.
+*/
+class NMADeformer
+{
+public:
+    /** Undeformed structure */
+    PDBRichPhantom pdb;
+
+    /** Enabled modes, in the order of the mode list */
+    std::vector< MultidimArray<double> > modes;
+public:
+    /** Read the PDB and the modes of a metadata with the label NMAModefile */
+    void read(const FileName &fnPDB, const FileName &fnModeList);
+
+    /** Number of modes */
+    size_t getNumberOfModes() const
+    {
+        return modes.size();
+    }
+
+    /** Deform the structure.
+        There must be at least one amplitude per mode. The deformed structure
+        is a copy of the reference one with the atoms displaced along the modes. */
+    void deform(const double *amplitudes, size_t Namplitudes,
+                PDBRichPhantom &deformed) const;
+};
+
 /* PDB NMA Deform Parameters ------------------------------------------ */
 /** Parameter class for the PDB Phantom program */
 class ProgPdbNmaDeform: public XmippProgram
@@ -0,0 +1,396 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#include "preprocess_particles.h"
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include "data/mask.h"
+#include "data/normalize.h"
+
+void ProgPreprocessParticles::defineParams()
+{
+    each_image_produces_an_output = true;
+    save_metadata_stack = true;
+    keep_input_columns = true;
+    addUsageLine("Preprocess particles with several operations in a single pass.");
+    addUsageLine("+The operations are applied in the given order while each particle is in memory,");
+    addUsageLine("+so that the stack is read and written only once. Consecutive Fourier operations");
+    addUsageLine("+(downsample, bandpass and phaseflip) share the Fourier transform of the particle,");
+    addUsageLine("+and so does an OldXmipp normalization right after them.");
+    addSeeAlsoLine("image_resize, transform_filter, ctf_phase_flip, transform_normalize, transform_mask");
+    ThreadedMetadataProgram::defineParams();
+    addParamsLine("  --ops <...>                  : Operations in the order they are applied:");
+    addParamsLine("                               : downsample: Fourier cropping to --dim (as image_resize --fourier)");
+    addParamsLine("                               : bandpass: raised cosine filter (as transform_filter --fourier band_pass)");
+    addParamsLine("                               : phaseflip: phase flipping with the CTF of each particle (as ctf_phase_flip)");
+    addParamsLine("                               : normalize: normalization with --method (as transform_normalize)");
+    addParamsLine("                               : mask: circular mask (as transform_mask --mask circular)");
+    addParamsLine("  [--dim <xdim=-1>]            : Size of the downsampled particles");
+    addParamsLine("  [--band <w1=0> <w2=0.5>]     : Band of the filter in digital frequencies (max. 0.5) of the particles at that point");
+    addParamsLine("  [--raised_w <w=0.02>]        : Width of the raised cosine of the filter");
+    addParamsLine("  [--sampling <Ts=-1>]         : Sampling rate of the input particles (A/pixel)");
+    addParamsLine("                               : By default, the sampling rate of the CTF");
+    addParamsLine("  [--method <mth=NewXmipp>]    : Normalization method");
+    addParamsLine("         where <mth>");
+    addParamsLine("           OldXmipp            : I=(I-m(I))/stddev(I)");
+    addParamsLine("           NewXmipp            : I=(I-m(bg))/stddev(bg)");
+    addParamsLine("  [--background_radius <r=-1>] : The background of NewXmipp is outside this radius (pixels, -1 for half the size)");
+    addParamsLine("  [--mask_radius <r=-1>]       : Radius of the circular mask (pixels, -1 for half the size)");
+    addParamsLine("  [--mask_value <v=0>]         : Value outside the mask");
+    addExampleLine("Downsample to 128 pixels, phase flip, low-pass filter and normalize in a single pass:", false);
+    addExampleLine("xmipp_preprocess_particles -i particles.xmd -o preprocessed.stk --save_metadata_stack --ops downsample phaseflip bandpass normalize --dim 128 --band 0 0.35 --thr 8");
+}
+
+void ProgPreprocessParticles::readParams()
+{
+    ThreadedMetadataProgram::readParams();
+    StringVector ops;
+    getListParam("--ops", ops);
+    operations.clear();
+    for (const auto &op : ops)
+    {
+        if (op == "downsample")
+            operations.push_back(DOWNSAMPLE);
+        else if (op == "bandpass")
+            operations.push_back(BANDPASS);
+        else if (op == "phaseflip")
+            operations.push_back(PHASEFLIP);
+        else if (op == "normalize")
+            operations.push_back(NORMALIZE);
+        else if (op == "mask")
+            operations.push_back(MASK);
+        else
+            REPORT_ERROR(ERR_ARG_INCORRECT, "Unknown operation: " + op);
+    }
+    if (std::count(operations.begin(), operations.end(), DOWNSAMPLE) > 1)
+        REPORT_ERROR(ERR_ARG_INCORRECT, "The particles can be downsampled only once");
+
+    outputDim = getIntParam("--dim");
+    if (std::count(operations.begin(), operations.end(), DOWNSAMPLE) > 0 && outputDim <= 0)
+        REPORT_ERROR(ERR_ARG_MISSING, "downsample requires --dim");
+    w1 = getDoubleParam("--band", 0);
+    w2 = getDoubleParam("--band", 1);
+    if (w1 < 0 || w2 > 0.5 || w1 >= w2)
+        REPORT_ERROR(ERR_ARG_INCORRECT, "The band must be within [0, 0.5]");
+    raisedW = getDoubleParam("--raised_w");
+    sampling = getDoubleParam("--sampling");
+    String method = getParam("--method");
+    if (method == "OldXmipp")
+        normalization = OLDXMIPP;
+    else if (method == "NewXmipp")
+        normalization = NEWXMIPP;
+    else
+        REPORT_ERROR(ERR_ARG_INCORRECT, "Unknown normalization method: " + method);
+    backgroundRadius = getDoubleParam("--background_radius");
+    maskRadius = getDoubleParam("--mask_radius");
+    maskValue = getDoubleParam("--mask_value");
+}
+
+void ProgPreprocessParticles::show() const
+{
+    if (!verbose)
+        return;
+    ThreadedMetadataProgram::show();
+    const char *names[] = { "downsample", "bandpass", "phaseflip", "normalize", "mask" };
+    std::cout << "Operations:             ";
+    for (auto op : operations)
+        std::cout << names[op] << " ";
+    std::cout << std::endl
+    << "Output size:            " << outputDim << std::endl
+    << "Band:                   " << w1 << " " << w2 << " (raised cosine " << raisedW << ")" << std::endl
+    << "Sampling rate:          " << sampling << std::endl
+    << "Normalization:          " << (normalization == OLDXMIPP ? "OldXmipp" : "NewXmipp") << std::endl
+    << "Background radius:      " << backgroundRadius << std::endl
+    << "Mask radius:            " << maskRadius << std::endl
+    << "Mask value:             " << maskValue << std::endl
+    << "Threads:                " << numThreads << std::endl;
+}
+
+void ProgPreprocessParticles::preProcess()
+{
+    show();
+    if (zdimOut != 1 || xdimOut != ydimOut)
+        REPORT_ERROR(ERR_MULTIDIM_DIM, "The particles must be square images");
+    inputDim = xdimOut;
+    if (std::count(operations.begin(), operations.end(), DOWNSAMPLE) > 0)
+    {
+        if ((size_t)outputDim > inputDim)
+            REPORT_ERROR(ERR_ARG_INCORRECT, "Downsampling cannot increase the size of the particles");
+        xdimOut = ydimOut = outputDim;
+    }
+}
+
+void ProgPreprocessParticles::postProcess()
+{
+    if (verbose && ctfCache.getHits() + ctfCache.getMisses() > 0)
+        ctfCache.printStatistics(std::cout);
+}
+
+void ProgPreprocessParticles::prepareThreads(size_t nThreads)
+{
+    threadData.resize(nThreads);
+    for (auto &d : threadData)
+    {
+        d = std::make_unique<ThreadData>();
+        FourierFilter &filter = d->filter;
+        filter.FilterShape = RAISED_COSINE;
+        if (w1 == 0)
+        {
+            filter.FilterBand = LOWPASS;
+            filter.w1 = w2;
+        }
+        else if (w2 == 0.5)
+        {
+            filter.FilterBand = HIGHPASS;
+            filter.w1 = w1;
+        }
+        else
+        {
+            filter.FilterBand = BANDPASS;
+            filter.w1 = w1;
+            filter.w2 = w2;
+        }
+        filter.raised_w = raisedW;
+        // The mask is needed even for large images
+        filter.do_generate_3dmask = true;
+    }
+}
+
+Image<double> &ProgPreprocessParticles::applyFourierOperations(ThreadData &d, Image<double> &img,
+        size_t first, size_t last, bool normalize, const MDRow &rowIn)
+{
+    // The Fourier transforms are aliases of the ones of the transformers
+    bool downsampled = &img == &d.Iout;
+    FourierTransformer &transformer = downsampled ? d.transformerOut : d.transformer;
+    MultidimArray< std::complex<double> > &F = downsampled ? d.Fout : d.F;
+    transformer.FourierTransform(img(), F, false);
+
+    for (size_t op = first; op < last; ++op)
+    {
+        const MultidimArray<double> &mCurrent = downsampled ? d.Iout() : img();
+        const MultidimArray< std::complex<double> > &G = downsampled ? d.Fout : F;
+        switch (operations[op])
+        {
+        case DOWNSAMPLE:
+            {
+                // Keep the frequencies of the smaller image. The forward
+                // transform is normalized, so the average is preserved.
+                int dimIn = XSIZE(mCurrent);
+                d.Iout().resizeNoCopy(outputDim, outputDim);
+                d.transformerOut.setReal(d.Iout());
+                d.transformerOut.getFourierAlias(d.Fout);
+                for (int i = 0; i < outputDim; ++i)
+                {
+                    int ky = i <= outputDim / 2 ? i : i - outputDim;
+                    int iIn = ky >= 0 ? ky : ky + dimIn;
+                    memcpy(&DIRECT_A2D_ELEM(d.Fout, i, 0), &DIRECT_A2D_ELEM(G, iIn, 0),
+                           XSIZE(d.Fout) * sizeof(std::complex<double>));
+                }
+                // The first column, and the last one for an even size, must be
+                // Hermitian (F(-ky)=conj(F(ky))). The Nyquist row and column
+                // of the crop come from frequencies of the larger image that
+                // are not, so they are symmetrized. Otherwise the inverse
+                // transform would not be defined, and its statistics would
+                // not match the ones of the spectrum.
+                size_t jNyquist = outputDim % 2 == 0 ? XSIZE(d.Fout) - 1 : 0;
+                for (size_t j : { (size_t)0, jNyquist })
+                {
+                    for (int i = 0; i <= outputDim / 2; ++i)
+                    {
+                        int iConj = (outputDim - i) % outputDim;
+                        std::complex<double> &f = DIRECT_A2D_ELEM(d.Fout, i, j);
+                        std::complex<double> &fConj = DIRECT_A2D_ELEM(d.Fout, iConj, j);
+                        std::complex<double> h = 0.5 * (f + conj(fConj));
+                        f = h;
+                        fConj = conj(h);
+                    }
+                }
+                downsampled = true;
+            }
+            break;
+        case BANDPASS:
+            {
+                MultidimArray< std::complex<double> > &H = downsampled ? d.Fout : F;
+                if (!d.filter.maskFourierd.sameShape(H))
+                {
+                    MultidimArray<double> aux(YSIZE(mCurrent), XSIZE(mCurrent));
+                    d.filter.generateMask(aux);
+                }
+                d.filter.applyMaskFourierSpace(mCurrent, H);
+            }
+            break;
+        case PHASEFLIP:
+            {
+                MultidimArray< std::complex<double> > &H = downsampled ? d.Fout : F;
+                d.ctf.readFromMdRow(rowIn);
+                d.ctf.produceSideInfo();
+                // Sampling rate of the (possibly downsampled) particle
+                double Ts = (sampling > 0 ? sampling : d.ctf.Tm) * inputDim / XSIZE(mCurrent);
+                auto mask = ctfCache.getPhaseFlipMask(d.ctf, YSIZE(mCurrent), XSIZE(mCurrent), Ts);
+                FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(H)
+                    DIRECT_MULTIDIM_ELEM(H, n) *= DIRECT_MULTIDIM_ELEM(*mask, n);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    Image<double> &result = downsampled ? d.Iout : img;
+    MultidimArray< std::complex<double> > &H = downsampled ? d.Fout : F;
+    if (normalize)
+    {
+        // Average and variance from the spectrum (Parseval), as computeAvgStdev
+        size_t xdim = XSIZE(result());
+        double avg = real(DIRECT_A2D_ELEM(H, 0, 0));
+        double sum2 = 0;
+        for (size_t i = 0; i < YSIZE(H); ++i)
+            for (size_t j = 0; j < XSIZE(H); ++j)
+            {
+                // The rest of columns of the half spectrum appear twice in the whole one
+                double w = (j == 0 || 2 * j == xdim) ? 1 : 2;
+                sum2 += w * norm(DIRECT_A2D_ELEM(H, i, j));
+            }
+        auto N = (double)(xdim * YSIZE(result()));
+        double stddev = sqrt(fabs((sum2 - avg * avg) * N / (N - 1)));
+        DIRECT_A2D_ELEM(H, 0, 0) = 0;
+        if (stddev > 0)
+        {
+            double istddev = 1 / stddev;
+            FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(H)
+                DIRECT_MULTIDIM_ELEM(H, n) *= istddev;
+        }
+    }
+
+    if (downsampled)
+        d.transformerOut.inverseFourierTransform();
+    else
+        transformer.inverseFourierTransform();
+    result().setXmippOrigin();
+    return result;
+}
+
+void ProgPreprocessParticles::normalizeImage(ThreadData &d, MultidimArray<double> &I) const
+{
+    if (normalization == OLDXMIPP)
+    {
+        normalize_OldXmipp(I);
+        return;
+    }
+    if (!d.bgMask.sameShape(I))
+    {
+        double r = backgroundRadius > 0 ? backgroundRadius : XSIZE(I) / 2;
+        d.bgMask.resizeNoCopy(I);
+        d.bgMask.setXmippOrigin();
+        BinaryCircularMask(d.bgMask, r, OUTSIDE_MASK);
+    }
+    normalize_NewXmipp(I, d.bgMask);
+}
+
+void ProgPreprocessParticles::maskImage(ThreadData &d, MultidimArray<double> &I) const
+{
+    if (!d.mask.sameShape(I))
+    {
+        double r = maskRadius > 0 ? maskRadius : XSIZE(I) / 2;
+        d.mask.resizeNoCopy(I);
+        d.mask.setXmippOrigin();
+        BinaryCircularMask(d.mask, r, INNER_MASK);
+    }
+    FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(I)
+        if (!DIRECT_MULTIDIM_ELEM(d.mask, n))
+            DIRECT_MULTIDIM_ELEM(I, n) = maskValue;
+}
+
+Image<double> &ProgPreprocessParticles::applyOperations(ThreadData &d, const MDRow &rowIn)
+{
+    Image<double> *img = &d.I;
+    size_t op = 0;
+    while (op < operations.size())
+    {
+        if (isFourier(operations[op]))
+        {
+            size_t last = op;
+            while (last < operations.size() && isFourier(operations[last]))
+                ++last;
+            bool normalize = last < operations.size() && operations[last] == NORMALIZE &&
+                             normalization == OLDXMIPP;
+            img = &applyFourierOperations(d, *img, op, last, normalize, rowIn);
+            op = normalize ? last + 1 : last;
+        }
+        else
+        {
+            if (operations[op] == NORMALIZE)
+                normalizeImage(d, (*img)());
+            else
+                maskImage(d, (*img)());
+            ++op;
+        }
+    }
+    return *img;
+}
+
+const MultidimArray<double> &ProgPreprocessParticles::preprocessParticle(size_t thrId,
+        const MultidimArray<double> &I, const MDRow &rowIn)
+{
+    ThreadData &d = *threadData[thrId];
+    d.I() = I;
+    d.I().setXmippOrigin();
+    return applyOperations(d, rowIn)();
+}
+
+void ProgPreprocessParticles::processImageThread(size_t thrId, const FileName &fnImg,
+        const FileName &fnImgOut, const MDRow &rowIn, MDRow &rowOut)
+{
+    ThreadData &d = *threadData[thrId];
+    d.I.read(fnImg);
+    d.I().setXmippOrigin();
+    if (XSIZE(d.I()) != inputDim || YSIZE(d.I()) != inputDim)
+        REPORT_ERROR(ERR_MULTIDIM_SIZE, "All the particles must have the same size");
+
+    Image<double> *img = &applyOperations(d, rowIn);
+
+    if (img == &d.Iout)
+    {
+        // Shifts in pixels of the downsampled particle
+        double factor = (double)outputDim / inputDim;
+        double shift;
+        if (rowOut.containsLabel(MDL_SHIFT_X))
+        {
+            rowOut.getValue(MDL_SHIFT_X, shift);
+            rowOut.setValue(MDL_SHIFT_X, shift * factor);
+        }
+        if (rowOut.containsLabel(MDL_SHIFT_Y))
+        {
+            rowOut.getValue(MDL_SHIFT_Y, shift);
+            rowOut.setValue(MDL_SHIFT_Y, shift * factor);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(ioMutex);
+        img->write(fnImgOut);
+    }
+    rowOut.setValue(MDL_IMAGE, fnImgOut);
+}
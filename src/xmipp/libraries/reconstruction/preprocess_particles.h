@@ -0,0 +1,157 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#ifndef _PROG_PREPROCESS_PARTICLES
+#define _PROG_PREPROCESS_PARTICLES
+
+#include <memory>
+#include <vector>
+#include "core/xmipp_fftw.h"
+#include "core/xmipp_image.h"
+#include "data/ctf.h"
+#include "data/ctf_image_cache.h"
+#include "data/fourier_filter.h"
+#include "threaded_metadata_program.h"
+
+/**@defgroup ProgPreprocessParticles Fused particle preprocessing
+   @ingroup ReconsLibrary */
+//@{
+/** Apply a list of preprocessing operations to each particle.
+ *
+ * The operations are those of xmipp_image_resize --fourier,
+ * xmipp_transform_filter --fourier band_pass, xmipp_ctf_phase_flip,
+ * xmipp_transform_normalize and xmipp_transform_mask, applied in the given
+ * order while the particle is in memory. Consecutive Fourier operations
+ * (downsample, bandpass and phaseflip) share a single pair of Fourier
+ * transforms, and an OldXmipp normalization right after them is computed
+ * from the spectrum. Each particle is read and written once.
+ */
+class ProgPreprocessParticles: public ThreadedMetadataProgram
+{
+public:
+    /// Operations
+    enum Operation
+    {
+        DOWNSAMPLE, ///< Fourier cropping to outputDim
+        BANDPASS,   ///< Raised cosine band-pass filter
+        PHASEFLIP,  ///< Phase flipping with the CTF of the particle
+        NORMALIZE,  ///< OldXmipp or NewXmipp normalization
+        MASK        ///< Circular mask
+    };
+
+    /// Normalization methods
+    enum NormalizationMethod
+    {
+        OLDXMIPP,
+        NEWXMIPP
+    };
+
+    /// Operations in the order they are applied
+    std::vector<Operation> operations;
+    /// Size of the downsampled images
+    int outputDim;
+    /// Band of the filter (digital frequencies)
+    double w1, w2;
+    /// Width of the raised cosine of the filter
+    double raisedW;
+    /// Sampling rate of the input images (-1 for the one of the CTF)
+    double sampling;
+    /// Normalization method
+    NormalizationMethod normalization;
+    /// Radius of the particle for NewXmipp (-1 for half the size)
+    double backgroundRadius;
+    /// Radius of the mask (-1 for half the size)
+    double maskRadius;
+    /// Value outside the mask
+    double maskValue;
+
+public:
+    void defineParams() override;
+    void readParams() override;
+    void show() const override;
+    void preProcess() override;
+    void postProcess() override;
+
+    void prepareThreads(size_t nThreads) override;
+    void processImageThread(size_t thrId, const FileName &fnImg, const FileName &fnImgOut,
+                            const MDRow &rowIn, MDRow &rowOut) override;
+
+    /** Apply the operations to a particle in memory.
+     * I must have the input size. The result belongs to the scratch data of
+     * thread thrId and is overwritten by its next particle.
+     */
+    const MultidimArray<double> &preprocessParticle(size_t thrId, const MultidimArray<double> &I,
+                                                    const MDRow &rowIn);
+
+protected:
+    /// Scratch data of each thread
+    struct ThreadData
+    {
+        Image<double> I;                 // input particle
+        Image<double> Iout;              // downsampled particle
+        FourierTransformer transformer;    // Fourier transformer of I
+        FourierTransformer transformerOut; // Fourier transformer of Iout
+        MultidimArray< std::complex<double> > F;    // FT(I), alias
+        MultidimArray< std::complex<double> > Fout; // FT(Iout), alias
+        FourierFilter filter;            // band-pass filter
+        MultidimArray<int> bgMask;       // background of NewXmipp
+        MultidimArray<int> mask;         // circular mask
+        CTFDescription ctf;
+    };
+    std::vector< std::unique_ptr<ThreadData> > threadData;
+
+    /// Phase flipping masks shared by the particles of a micrograph
+    CTFImageCache<double> ctfCache;
+
+    /// Size of the input images
+    size_t inputDim;
+
+    /** Apply the Fourier operations in [first, last) to img (d.I or d.Iout).
+     * If normalize, the image is also normalized (OldXmipp) with the
+     * statistics of the spectrum. Returns the processed image, which is
+     * d.Iout if it has been downsampled.
+     */
+    Image<double> &applyFourierOperations(ThreadData &d, Image<double> &img, size_t first,
+                                          size_t last, bool normalize, const MDRow &rowIn);
+
+    /** Apply all the operations to d.I.
+     * Returns the processed image, d.I or d.Iout if it has been downsampled.
+     */
+    Image<double> &applyOperations(ThreadData &d, const MDRow &rowIn);
+
+    /// Normalize in real space
+    void normalizeImage(ThreadData &d, MultidimArray<double> &I) const;
+
+    /// Apply the circular mask
+    void maskImage(ThreadData &d, MultidimArray<double> &I) const;
+
+    /// Whether an operation is applied in Fourier space
+    static bool isFourier(Operation op)
+    {
+        return op == DOWNSAMPLE || op == BANDPASS || op == PHASEFLIP;
+    }
+};
+//@}
+#endif
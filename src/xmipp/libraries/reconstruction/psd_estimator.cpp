@@ -71,80 +71,115 @@ std::vector<Rectangle<Point2D<size_t>>> PSDEstimator<T>::getPatchesLocation(
 }
 
 template<typename T>
-void PSDEstimator<T>::estimatePSD(const MultidimArray<T> &micrograph,
-        float overlap, const Dimensions &patchDim, MultidimArray<T> &psd,
-        unsigned fftThreads, bool normalize) {
+PSDEstimator<T>::PSDEstimator(const Dimensions &micrograph,
+        const Dimensions &patch, float overlap, unsigned fftThreads,
+        size_t batch) :
+        m_micrograph(micrograph.x(), micrograph.y()),
+        m_patch(patch.x(), patch.y()),
+        m_patches(getPatchesLocation({0, 0}, m_micrograph, m_patch, overlap)),
+        m_settings(patch.x(), patch.y(), 1,
+                std::min(std::max(batch, (size_t)1), m_patches.size()),
+                std::min(std::max(batch, (size_t)1), m_patches.size())) {
     using transformer = FFTwT<T>;
-    // get patch positions
-    auto patches = getPatchesLocation({0, 0},
-            Dimensions(micrograph.xdim, micrograph.ydim),
-            patchDim,
-            overlap);
-
-    auto settings = FFTSettings<T>(patchDim);
+    // prepare data for FT - allocate aligned data for faster execution
+    m_patchData = reinterpret_cast<T*>(transformer::allocateAligned(m_settings.sBytesBatch()));
+    m_spectra = reinterpret_cast<std::complex<T>*>(transformer::allocateAligned(m_settings.fBytesBatch()));
+    m_magnitudes.resize(m_settings.fDim().xyzPadded());
 
-    // prepare data for FT - set proper sizes and allocate aligned dat for faster execution
-    auto *data = reinterpret_cast<T*>(transformer::allocateAligned(settings.sBytesSingle()));
-    auto patchData = MultidimArray<T>(1, 1, patchDim.y(), patchDim.x(), data);
+    auto patchData = MultidimArray<T>(1, 1, m_patch.y(), m_patch.x(), m_patchData);
+    ProgCTFEstimateFromMicrograph::constructPieceSmoother(patchData, m_smoother);
+    m_smoother.resetOrigin();
 
-    MultidimArray<T> smoother;
-    ProgCTFEstimateFromMicrograph::constructPieceSmoother(patchData, smoother);
-    smoother.resetOrigin();
+    auto hw = CPU(fftThreads);
+    m_plan = transformer::createPlan(hw, m_settings, true);
+}
 
-    auto patchFS = (std::complex<T>*)transformer::allocateAligned(settings.fBytesBatch());
-    auto magnitudes = new T[settings.fElemsBatch()](); // initialize to zero
+template<typename T>
+PSDEstimator<T>::~PSDEstimator() {
+    using transformer = FFTwT<T>;
+    transformer::release(m_plan);
+    transformer::release(m_spectra);
+    transformer::release(m_patchData);
+}
 
-    auto hw = CPU(fftThreads);
-    auto plan = transformer::createPlan(hw, settings, true);
-
-    for (auto &p : patches) {
-        // get patch data
-        window2D(micrograph, patchData,
-                p.tl.y, p.tl.x, p.br.y, p.br.x);
-        // normalize, otherwise we would get 'white cross'
-        patchData.statisticsAdjust((T)0, (T)1);
-        patchData.resetOrigin();
-        // apply edge attenuation
-        patchData *= smoother;
-        // perform FFT
-        transformer::fft(plan, patchData.data, patchFS);
-        // get average of amplitudes
-        for (size_t n = 0; n < settings.fElemsBatch(); ++n) {
-            auto v = patchFS[n]; // / (T)settings.sDim().xyz();
-            auto mag = sqrt((v.real() * v.real()) + (v.imag() * v.imag()));
-            magnitudes[n] += mag;
-        }
+template<typename T>
+void PSDEstimator<T>::estimate(const MultidimArray<T> &micrograph,
+        MultidimArray<T> &psd, bool normalize) {
+    using transformer = FFTwT<T>;
+    if ((micrograph.xdim != m_micrograph.x()) || (micrograph.ydim != m_micrograph.y())) {
+        REPORT_ERROR(ERR_MULTIDIM_SIZE, formatString(
+                "PSDEstimator: expected micrograph of %lu x %lu pixels, got %lu x %lu",
+                m_micrograph.x(), m_micrograph.y(), micrograph.xdim, micrograph.ydim));
     }
-
-    // create other half
-    psd.resizeNoCopy(patchData);
-    half2whole(magnitudes, psd.data, settings, [&](bool mirror, T val){return val;});
-
-    if (normalize) {
-        auto min_val = std::numeric_limits<T>::max();
-        FOR_ALL_ELEMENTS_IN_ARRAY2D(psd)
-        {
-            auto pixval=A2D_ELEM(psd,i,j);
-            if (pixval > 0 && pixval < min_val)
-                min_val = pixval;
+    std::fill(m_magnitudes.begin(), m_magnitudes.end(), (T)0);
+    const size_t batch = m_settings.batch();
+    const size_t patchElems = m_settings.sDim().xyzPadded();
+    const size_t freqElems = m_settings.fDim().xyzPadded();
+
+    for (size_t first = 0; first < m_patches.size(); first += batch) {
+        const size_t n = std::min(batch, m_patches.size() - first);
+        for (size_t i = 0; i < n; ++i) {
+            const auto &p = m_patches[first + i];
+            auto patchData = MultidimArray<T>(1, 1, m_patch.y(), m_patch.x(),
+                    m_patchData + i * patchElems);
+            // get patch data
+            window2D(micrograph, patchData,
+                    p.tl.y, p.tl.x, p.br.y, p.br.x);
+            // normalize, otherwise we would get 'white cross'
+            patchData.statisticsAdjust((T)0, (T)1);
+            patchData.resetOrigin();
+            // apply edge attenuation
+            patchData *= m_smoother;
         }
-        min_val = 10 * log10(min_val);
-        FOR_ALL_ELEMENTS_IN_ARRAY2D(psd)
-        {
-            auto pixval=A2D_ELEM(psd,i,j);
-            if (pixval > 0)
-                A2D_ELEM(psd,i,j) = 10 * log10(pixval);
-            else
-                A2D_ELEM(psd,i,j) = min_val;
+        // perform FFT of the whole batch. If the last batch is not full,
+        // the spectra of the unused slots are ignored
+        transformer::fft(m_plan, m_patchData, m_spectra);
+        // get sum of amplitudes
+        for (size_t i = 0; i < n; ++i) {
+            const std::complex<T> *patchFS = m_spectra + i * freqElems;
+            for (size_t nn = 0; nn < freqElems; ++nn) {
+                auto v = patchFS[nn];
+                m_magnitudes[nn] += sqrt((v.real() * v.real()) + (v.imag() * v.imag()));
+            }
         }
-        reject_outliers(psd);
     }
 
-    delete[] magnitudes;
-    transformer::release(patchFS);
-    transformer::release(plan);
-    transformer::release(data);
+    // create other half
+    psd.resizeNoCopy(m_patch.y(), m_patch.x());
+    half2whole(m_magnitudes.data(), psd.data, m_settings, [&](bool mirror, T val){return val;});
+
+    if (normalize)
+        normalizePSD(psd);
+}
 
+template<typename T>
+void PSDEstimator<T>::normalizePSD(MultidimArray<T> &psd) {
+    auto min_val = std::numeric_limits<T>::max();
+    FOR_ALL_ELEMENTS_IN_ARRAY2D(psd)
+    {
+        auto pixval=A2D_ELEM(psd,i,j);
+        if (pixval > 0 && pixval < min_val)
+            min_val = pixval;
+    }
+    min_val = 10 * log10(min_val);
+    FOR_ALL_ELEMENTS_IN_ARRAY2D(psd)
+    {
+        auto pixval=A2D_ELEM(psd,i,j);
+        if (pixval > 0)
+            A2D_ELEM(psd,i,j) = 10 * log10(pixval);
+        else
+            A2D_ELEM(psd,i,j) = min_val;
+    }
+    reject_outliers(psd);
+}
+
+template<typename T>
+void PSDEstimator<T>::estimatePSD(const MultidimArray<T> &micrograph,
+        float overlap, const Dimensions &patchDim, MultidimArray<T> &psd,
+        unsigned fftThreads, bool normalize) {
+    PSDEstimator<T> estimator(Dimensions(micrograph.xdim, micrograph.ydim),
+            patchDim, overlap, fftThreads);
+    estimator.estimate(micrograph, psd, normalize);
 }
 
 // explicit instantiation
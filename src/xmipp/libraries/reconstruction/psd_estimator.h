@@ -29,8 +29,8 @@
 #include "core/multidim_array.h"
 #include "data/fft_settings.h"
 #include "data/rectangle.h"
-
-class Dimensions;
+#include "data/dimensions.h"
+#include <vector>
 
 
 /**@defgroup PSDEstimator PSD Estimator
@@ -39,6 +39,30 @@ class Dimensions;
 template<typename T>
 class PSDEstimator {
 public:
+    /**
+     * Estimator of the PSD of many micrographs of the same size.
+     * The FFT plan and the buffers are created once and reused by each
+     * call of estimate(). Patches are transformed in batches of 'batch' patches.
+     */
+    PSDEstimator(const Dimensions &micrograph, const Dimensions &patch,
+            float overlap, unsigned fftThreads, size_t batch = 32);
+
+    ~PSDEstimator();
+
+    PSDEstimator(const PSDEstimator&) = delete;
+    PSDEstimator& operator=(const PSDEstimator&) = delete;
+
+    /**
+     * Estimate the PSD of a micrograph of the size given in the constructor.
+     * Result has the size of the patch
+     */
+    void estimate(const MultidimArray<T> &micrograph, MultidimArray<T> &psd,
+            bool normalize);
+
+    const Dimensions &getMicrographDim() const {
+        return m_micrograph;
+    }
+
     static std::vector<Rectangle<Point2D<size_t>>> getPatchesLocation(
             const std::pair<size_t, size_t> &borders,
             const Dimensions &micrograph,
@@ -69,7 +93,19 @@ public:
         }
     }
 
+private:
+    /** Apply log10 and reject outliers */
+    static void normalizePSD(MultidimArray<T> &psd);
 
+    Dimensions m_micrograph;
+    Dimensions m_patch;
+    std::vector<Rectangle<Point2D<size_t>>> m_patches;
+    FFTSettings<T> m_settings;
+    void *m_plan;
+    T *m_patchData; // batch of patches
+    std::complex<T> *m_spectra; // their spectra
+    std::vector<T> m_magnitudes; // sum of amplitudes, half of the spectrum
+    MultidimArray<T> m_smoother;
 };
 //@}
 #endif /* LIBRARIES_RECONSTRUCTION_PSD_ESTIMATOR_H_ */
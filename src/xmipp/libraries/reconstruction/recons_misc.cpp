@@ -711,9 +711,14 @@ POCSClass::POCSClass(BasicARTParameters *_prm,
     Zoutput_volume_size = _Zoutput_volume_size;
     Youtput_volume_size = _Youtput_volume_size;
     Xoutput_volume_size = _Xoutput_volume_size;
-    apply_POCS = (prm->surface_mask != nullptr ||
-                  prm->positivity || (prm->force_sym != 0 && !prm->is_crystal) ||
-                  prm->known_volume != -1);
+    apply_POCS = isActive(prm);
+}
+
+bool POCSClass::isActive(const BasicARTParameters *prm)
+{
+    return prm->surface_mask != nullptr ||
+           prm->positivity || (prm->force_sym != 0 && !prm->is_crystal) ||
+           prm->known_volume != -1;
 }
 
 void POCSClass::newIteration()
@@ -138,6 +138,9 @@ public:
               int _Zoutput_volume_size, int _Youtput_volume_size,
               int _Xoutput_volume_size);
 
+    /// True if the parameters impose any POCS constraint
+    static bool isActive(const BasicARTParameters *prm);
+
     /// Start New ART iteration
     void newIteration();
 
@@ -119,10 +119,11 @@ void ProgReconsART::readParams()
 
     artRecons->readParams(this);
 
-    if (artRecons->artPrm.threads > 1 && isMpi)
-        REPORT_ERROR(ERR_ARG_BADCMDLINE, "Threads not compatible in mpi version.");
-    if (!isMpi && artRecons->artPrm.parallel_mode != BasicARTParameters::ART)
-        REPORT_ERROR(ERR_ARG_BADCMDLINE, "If --parallel_mode is passed, then mpi version must be used.");
+    if (artRecons->artPrm.threads > 1 && isMpi && !artRecons->artPrm.useTaskPool)
+        REPORT_ERROR(ERR_ARG_BADCMDLINE, "Threads in the mpi version need --taskPool.");
+    if (!isMpi && artRecons->artPrm.parallel_mode != BasicARTParameters::ART &&
+        artRecons->artPrm.parallel_mode != BasicARTParameters::SIRT)
+        REPORT_ERROR(ERR_ARG_BADCMDLINE, "If --parallel_mode is passed (other than SIRT), then mpi version must be used.");
 
 }
 
@@ -26,6 +26,8 @@
  *  e-mail address 'xmipp@cnb.csic.es'
  ***************************************************************************/
 
+#include <algorithm>
+#include <functional>
 #include "reconstruct_fourier.h"
 #include "core/bilib/kernel.h"
 #include "core/matrix2d.h"
@@ -48,6 +50,9 @@ void ProgRecFourier::defineParams()
     addParamsLine("  [--max_resolution <p=0.5>]     : Max resolution (Nyquist=0.5)");
     addParamsLine("  [--weight]                     : Use weights stored in the image metadata");
     addParamsLine("  [--thr <threads=1> <rows=1>]   : Number of concurrent threads and rows processed at time by a thread");
+    addParamsLine("  [--taskPool]                   : Threads read whole images and grid them in slabs of Z planes of the volume");
+    addParamsLine("                                 : (rows are ignored) instead of splitting every image among the threads.");
+    addParamsLine("                                 : Scales better with many threads");
     addParamsLine("  [--blob <radius=1.9> <order=0> <alpha=15>] : Blob parameters");
     addParamsLine("                                 : radius in pixels, order of Bessel function in blob and parameter alpha");
     addParamsLine("  [--useCTF]                     : Use CTF information if present");
@@ -77,6 +82,7 @@ void ProgRecFourier::readParams()
     maxResolution = getDoubleParam("--max_resolution");
     numThreads = getIntParam("--thr");
     thrWidth = getIntParam("--thr", 1);
+    useTaskPool = checkParam("--taskPool");
     NiterWeight = getIntParam("--iter");
     useCTF = checkParam("--useCTF");
     phaseFlipped = checkParam("--phaseFlipped");
@@ -133,6 +139,28 @@ void ProgRecFourier::run()
         else
             init_progress_bar(SF.size());
     }
+    createThreads();
+
+    //Computing interpolated volume
+    processImages(0, SF.size() - 1, !fn_fsc.empty(), false);
+
+    // Correcting the weights
+    correctWeight();
+
+    //Saving the volume
+    finishComputations(fn_out);
+
+    destroyThreads();
+}
+
+void ProgRecFourier::createThreads()
+{
+    if (useTaskPool)
+    {
+        threadPool = std::make_unique<ctpl::thread_pool>(numThreads);
+        return;
+    }
+
     // Create threads stuff
     barrier_init( &barrier, numThreads+1 );
     pthread_mutex_init( &workLoadMutex, nullptr);
@@ -149,15 +177,16 @@ void ProgRecFourier::run()
         th_args[nt].selFile = new MetaDataVec(SF);
         pthread_create( (th_ids+nt) , nullptr, processImageThread, (void *)(th_args+nt) );
     }
+}
 
-    //Computing interpolated volume
-    processImages(0, SF.size() - 1, !fn_fsc.empty(), false);
-
-    // Correcting the weights
-    correctWeight();
-
-    //Saving the volume
-    finishComputations(fn_out);
+void ProgRecFourier::destroyThreads()
+{
+    if (threadPool)
+    {
+        threadPool.reset();
+        poolWorkers.clear();
+        return;
+    }
 
     threadOpCode = EXIT_THREAD;
 
@@ -187,8 +216,9 @@ void ProgRecFourier::produceSideinfo()
     // maxResolution=sampling_rate/maxResolution;
     maxResolution2=maxResolution*maxResolution;
 
-    // Read the input images
-    SF.read(fn_sel);
+    // Read the input images (unless they have been given in memory)
+    if (!fn_sel.empty())
+        SF.read(fn_sel);
     SF.removeDisabled();
 
     // Ask for memory for the output volume and its Fourier transform
@@ -286,6 +316,427 @@ void ProgRecFourier::produceSideinfo()
     }
 }
 
+void FourierGriddingTables::initialize(int volPadSizeX, int volPadSizeY, int volPadSizeZ)
+{
+    zWrapped.initZeros(3*volPadSizeZ);
+    yWrapped.initZeros(3*volPadSizeY);
+    xWrapped.initZeros(3*volPadSizeX);
+    zWrapped.initConstant(-1);
+    yWrapped.initConstant(-1);
+    xWrapped.initConstant(-1);
+    zWrapped.setXmippOrigin();
+    yWrapped.setXmippOrigin();
+    xWrapped.setXmippOrigin();
+    zNegWrapped=zWrapped;
+    yNegWrapped=yWrapped;
+    xNegWrapped=xWrapped;
+
+    x2precalculated.initZeros(XSIZE(xWrapped));
+    y2precalculated.initZeros(XSIZE(yWrapped));
+    z2precalculated.initZeros(XSIZE(zWrapped));
+    x2precalculated.initConstant(-1);
+    y2precalculated.initConstant(-1);
+    z2precalculated.initConstant(-1);
+    x2precalculated.setXmippOrigin();
+    y2precalculated.setXmippOrigin();
+    z2precalculated.setXmippOrigin();
+}
+
+bool ProgRecFourier::hasCTFInfo(const MetaData &md) const
+{
+    return (md.containsLabel(MDL_CTF_MODEL) || md.containsLabel(MDL_CTF_DEFOCUSU)) && useCTF;
+}
+
+void ProgRecFourier::loadImage(ImageThreadParams * threadParams, const std::vector<size_t> &objId, bool hasCTF,
+                               MultidimArray<double> &localPaddedImg,
+                               MultidimArray< std::complex<double> > &localPaddedFourier,
+                               FourierTransformer &localTransformerImg,
+                               Matrix2D<double> &localA, Matrix2D<double> &localAinv)
+{
+    ProgRecFourier * parent = threadParams->parent;
+    threadParams->read = 0;
+
+    // Read input image
+    double rot, tilt, psi, weight;
+    Projection proj;
+
+    //Read projection from selfile, read also angles and shifts if present
+    //but only apply shifts
+    ApplyGeoParams params;
+    params.only_apply_shifts = true;
+    proj.readApplyGeo(*(threadParams->selFile), objId[threadParams->imageIndex], params);
+    rot  = proj.rot();
+    tilt = proj.tilt();
+    psi  = proj.psi();
+    weight = proj.weight();
+    if (hasCTF)
+    {
+        threadParams->ctf.readFromMetadataRow(*(threadParams->selFile),objId[threadParams->imageIndex]);
+        // threadParams->ctf.Tm=threadParams->parent->Ts;
+        threadParams->ctf.produceSideInfo();
+    }
+
+    threadParams->weight = 1.;
+
+    if(parent->do_weights)
+        threadParams->weight = weight;
+    else if (!parent->do_weights)
+    {
+        weight=1.0;
+    }
+    else if (weight==0.0)
+    {
+        threadParams->read = 2;
+        return;
+    }
+
+    // Copy the projection to the center of the padded image
+    // and compute its Fourier transform
+    proj().setXmippOrigin();
+    auto localPaddedImgSize=(size_t)(parent->imgSize*parent->padding_factor_proj);
+    if (threadParams->reprocessFlag)
+        localPaddedFourier.initZeros(localPaddedImgSize,localPaddedImgSize/2+1);
+    else
+    {
+        localPaddedImg.initZeros(localPaddedImgSize,localPaddedImgSize);
+        localPaddedImg.setXmippOrigin();
+        const MultidimArray<double> &mProj=proj();
+        FOR_ALL_ELEMENTS_IN_ARRAY2D(mProj)
+        A2D_ELEM(localPaddedImg,i,j)=A2D_ELEM(mProj,i,j);
+        // COSS A2D_ELEM(localPaddedImg,i,j)=weight*A2D_ELEM(mProj,i,j);
+        CenterFFT(localPaddedImg,true);
+
+        // Fourier transformer for the images
+        localTransformerImg.setReal(localPaddedImg);
+        localTransformerImg.FourierTransform();
+        localTransformerImg.getFourierAlias(localPaddedFourier);
+    }
+
+    // Compute the coordinate axes associated to this image
+    Euler_angles2matrix(rot, tilt, psi, localA);
+    localAinv=localA.transpose();
+
+    threadParams->localweight = weight;
+    threadParams->localAInv = &localAinv;
+    threadParams->localPaddedFourier = &localPaddedFourier;
+    //#define DEBUG22
+#ifdef DEBUG22
+
+    {//CORRECTO
+
+        if(threadParams->myThreadID%1==0)
+        {
+            proj.write((std::string) integerToString(threadParams->myThreadID)  + "_" +\
+                       integerToString(threadParams->imageIndex) + "proj.spi");
+
+            ImageXmipp save44;
+            save44()=localPaddedImg;
+            save44.write((std::string) integerToString(threadParams->myThreadID)  + "_" +\
+                         integerToString(threadParams->imageIndex) + "local_padded_img.spi");
+
+            FourierImage save33;
+            save33()=localPaddedFourier;
+            save33.write((std::string) integerToString(threadParams->myThreadID)  + "_" +\
+                         integerToString(threadParams->imageIndex) + "local_padded_fourier.spi");
+            FourierImage save22;
+            //save22()=*paddedFourier;
+            save22().alias(*(threadParams->localPaddedFourier));
+            save22.write((std::string) integerToString(threadParams->myThreadID)  + "_" +\
+                         integerToString(threadParams->imageIndex) + "_padded_fourier.spi");
+        }
+
+    }
+#endif
+    #undef DEBUG22
+
+    threadParams->read = 1;
+}
+
+void ProgRecFourier::applyFourierWeights(int firstZ, int stepZ)
+{
+    // Get a first approximation of the reconstruction
+    double corr2D_3D=pow(padding_factor_proj,2.)/
+                     (imgSize* pow(padding_factor_vol,3.));
+    // Divide by Zdim because of the
+    // the extra dimension added
+    // and padding differences
+    MultidimArray<double> &mFourierWeights=FourierWeights;
+    for (int k=firstZ; k<=FINISHINGZ(mFourierWeights); k+=stepZ)
+        for (int i=STARTINGY(mFourierWeights); i<=FINISHINGY(mFourierWeights); i++)
+            for (int j=STARTINGX(mFourierWeights); j<=FINISHINGX(mFourierWeights); j++)
+            {
+            	if (NiterWeight==0)
+            		A3D_ELEM(VoutFourier,k,i,j)*=corr2D_3D;
+            	else
+            	{
+            		double weight_kij=A3D_ELEM(mFourierWeights,k,i,j);
+            		if (1.0/weight_kij>ACCURACY)
+            			A3D_ELEM(VoutFourier,k,i,j)*=corr2D_3D*A3D_ELEM(mFourierWeights,k,i,j);
+            		else
+            			A3D_ELEM(VoutFourier,k,i,j)=0;
+            	}
+            }
+}
+
+bool ProgRecFourier::computeCoefficient(ImageThreadParams * threadParams, bool hasCTF, int i, int j,
+                                        GriddingCoefficient &c)
+{
+    ProgRecFourier * parent = threadParams->parent;
+    const Matrix2D<double> &A_SL = *(threadParams->symmetry);
+
+    // Compute the frequency of this coefficient in the
+    // universal coordinate system
+    double freqX, freqY;
+    FFT_IDX2DIGFREQ(j,XSIZE(parent->paddedImg),freqX);
+    FFT_IDX2DIGFREQ(i,YSIZE(parent->paddedImg),freqY);
+    if (freqX*freqX+freqY*freqY>parent->maxResolution2)
+        return false;
+
+    // Look for the corresponding index in the volume Fourier transform
+    // (the Z frequency of the image is 0)
+    double volFreqX = MAT_ELEM(A_SL,0,0)*freqX + MAT_ELEM(A_SL,0,1)*freqY;
+    double volFreqY = MAT_ELEM(A_SL,1,0)*freqX + MAT_ELEM(A_SL,1,1)*freqY;
+    double volFreqZ = MAT_ELEM(A_SL,2,0)*freqX + MAT_ELEM(A_SL,2,1)*freqY;
+    DIGFREQ2FFT_IDX_DOUBLE(volFreqX,parent->volPadSizeX,c.x);
+    DIGFREQ2FFT_IDX_DOUBLE(volFreqY,parent->volPadSizeY,c.y);
+    DIGFREQ2FFT_IDX_DOUBLE(volFreqZ,parent->volPadSizeZ,c.z);
+    c.i = i;
+    c.j = j;
+
+    c.wCTF = 1;
+    c.wModulator = 1;
+    if (hasCTF && !threadParams->reprocessFlag)
+    {
+        // Get the inverse of the sampling rate
+        // double iTs=parent->padding_factor_proj/parent->Ts;
+        double iTs=1.0/parent->Ts; // The padding factor is not considered here, but later when the indexes
+        //                         // are converted to digital frequencies
+        threadParams->ctf.precomputeValues(freqX*iTs,freqY*iTs);
+        //wCTF=threadParams->ctf.getValueAt();
+        double wCTF=threadParams->ctf.getValuePureNoKAt();
+        //wCTF=threadParams->ctf.getValuePureWithoutDampingAt();
+        double wModulator=1.0;
+
+        if (std::isnan(wCTF))
+        {
+            if (i==0 && j==0)
+                wModulator=wCTF=1.0;
+            else
+                wModulator=wCTF=0.0;
+        }
+        if (fabs(wCTF)<parent->minCTF)
+        {
+            wModulator=fabs(wCTF);
+            wCTF=SGN(wCTF);
+        }
+        else
+            wCTF=1.0/wCTF;
+        if (parent->phaseFlipped)
+            wCTF=fabs(wCTF);
+        c.wCTF = wCTF;
+        c.wModulator = wModulator;
+    }
+    return true;
+}
+
+void ProgRecFourier::gridCoefficient(const ImageThreadParams * threadParams, FourierGriddingTables &tables,
+                                     const GriddingCoefficient &c, int minZ, int maxZ)
+{
+    ProgRecFourier * parent = threadParams->parent;
+    bool reprocessFlag = threadParams->reprocessFlag;
+
+    MultidimArray<int> &zWrapped=tables.zWrapped, &yWrapped=tables.yWrapped, &xWrapped=tables.xWrapped;
+    MultidimArray<int> &zNegWrapped=tables.zNegWrapped, &yNegWrapped=tables.yNegWrapped, &xNegWrapped=tables.xNegWrapped;
+    MultidimArray<double> &x2precalculated=tables.x2precalculated;
+    MultidimArray<double> &y2precalculated=tables.y2precalculated;
+    MultidimArray<double> &z2precalculated=tables.z2precalculated;
+
+    // Some alias and calculations moved from heavy loops
+    double blobRadiusSquared = parent->blob.radius * parent->blob.radius;
+    double iDeltaSqrt = parent->iDeltaSqrt;
+    Matrix1D<double> & blobTableSqrt = parent->blobTableSqrt;
+    int xsize_1 = XSIZE(parent->VoutFourier) - 1;
+    int zsize_1 = ZSIZE(parent->VoutFourier) - 1;
+    MultidimArray< std::complex<double> > &VoutFourier=parent->VoutFourier;
+    MultidimArray<double> &fourierWeights = parent->FourierWeights;
+
+    // Put a box around that coefficient
+    int corner1X=CEIL (c.x-parent->blob.radius);
+    int corner1Y=CEIL (c.y-parent->blob.radius);
+    int corner1Z=CEIL (c.z-parent->blob.radius);
+    int corner2X=FLOOR(c.x+parent->blob.radius);
+    int corner2Y=FLOOR(c.y+parent->blob.radius);
+    int corner2Z=FLOOR(c.z+parent->blob.radius);
+
+#ifdef DEBUG
+
+    std::cout << "Idx Img=(0," << c.i << "," << c.j << ") ->\n    Idx Vol=("
+    << c.x << " " << c.y << " " << c.z << ")\n"
+    << "   Corner1=" << corner1X << " " << corner1Y << " " << corner1Z << std::endl
+    << "   Corner2=" << corner2X << " " << corner2Y << " " << corner2Z << std::endl;
+#endif
+    // Loop within the box
+    auto *ptrIn=(double *)&(A2D_ELEM(*(threadParams->paddedFourier), c.i, c.j));
+
+    // Some precalculations
+    for (int intz = corner1Z; intz <= corner2Z; ++intz)
+    {
+        double z = intz - c.z;
+        A1D_ELEM(z2precalculated,intz)=z*z;
+        if (A1D_ELEM(zWrapped,intz)<0)
+        {
+            int iz, izneg;
+            fastIntWRAP(iz, intz, 0, zsize_1);
+            A1D_ELEM(zWrapped,intz)=iz;
+            int miz=-iz;
+            fastIntWRAP(izneg, miz,0,zsize_1);
+            A1D_ELEM(zNegWrapped,intz)=izneg;
+        }
+    }
+    for (int inty = corner1Y; inty <= corner2Y; ++inty)
+    {
+        double y = inty - c.y;
+        A1D_ELEM(y2precalculated,inty)=y*y;
+        if (A1D_ELEM(yWrapped,inty)<0)
+        {
+            int iy, iyneg;
+            fastIntWRAP(iy, inty, 0, zsize_1);
+            A1D_ELEM(yWrapped,inty)=iy;
+            int miy=-iy;
+            fastIntWRAP(iyneg, miy,0,zsize_1);
+            A1D_ELEM(yNegWrapped,inty)=iyneg;
+        }
+    }
+    for (int intx = corner1X; intx <= corner2X; ++intx)
+    {
+        double x = intx - c.x;
+        A1D_ELEM(x2precalculated,intx)=x*x;
+        if (A1D_ELEM(xWrapped,intx)<0)
+        {
+            int ix, ixneg;
+            fastIntWRAP(ix, intx, 0, zsize_1);
+            A1D_ELEM(xWrapped,intx)=ix;
+            int mix=-ix;
+            fastIntWRAP(ixneg, mix,0,zsize_1);
+            A1D_ELEM(xNegWrapped,intx)=ixneg;
+        }
+    }
+
+    // Actually compute
+    for (int intz = corner1Z; intz <= corner2Z; ++intz)
+    {
+        double z2 = A1D_ELEM(z2precalculated,intz);
+        int iz=A1D_ELEM(zWrapped,intz);
+        int izneg=A1D_ELEM(zNegWrapped,intz);
+
+        // Only the planes minZ..maxZ are modified
+        bool izInside = iz >= minZ && iz <= maxZ;
+        bool iznegInside = izneg >= minZ && izneg <= maxZ;
+        if (!izInside && !iznegInside)
+            continue;
+
+        for (int inty = corner1Y; inty <= corner2Y; ++inty)
+        {
+            double y2z2 = A1D_ELEM(y2precalculated,inty) + z2;
+            if (y2z2 > blobRadiusSquared)
+                continue;
+            int iy=A1D_ELEM(yWrapped,inty);
+            int iyneg=A1D_ELEM(yNegWrapped,inty);
+
+            int	size1=YXSIZE(VoutFourier)*izneg+(iyneg*XSIZE(VoutFourier));
+            int	size2=YXSIZE(VoutFourier)*iz+(iy*XSIZE(VoutFourier));
+            int	fixSize=0;
+
+            for (int intx = corner1X; intx <= corner2X; ++intx)
+            {
+                // Compute distance to the center of the blob
+                // Compute blob value at that distance
+                double d2 = A1D_ELEM(x2precalculated,intx) + y2z2;
+
+                if (d2 > blobRadiusSquared)
+                    continue;
+                auto aux = (int)(d2 * iDeltaSqrt + 0.5);//Same as ROUND but avoid comparison
+                double w = VEC_ELEM(blobTableSqrt, aux)*threadParams->weight*c.wModulator;
+
+                // Look for the location of this logical index
+                // in the physical layout
+                int ix=A1D_ELEM(xWrapped,intx);
+#ifdef DEBUG
+
+                std::cout << "   2: ix=" << ix << " iy=" << iy
+                << " iz=" << iz << std::endl;
+#endif
+
+                bool conjugate=false;
+                int izp, iyp, ixp;
+                if (ix > xsize_1)
+                {
+                    if (!iznegInside)
+                        continue;
+                    izp = izneg;
+                    iyp = iyneg;
+                    ixp = A1D_ELEM(xNegWrapped,intx);
+                    conjugate=true;
+                    fixSize = size1;
+                }
+                else
+                {
+                    if (!izInside)
+                        continue;
+                    izp=iz;
+                    iyp=iy;
+                    ixp=ix;
+                    fixSize = size2;
+                }
+#ifdef DEBUG
+                std::cout << "   3: ix=" << ix << " iy=" << iy
+                << " iz=" << iz << " conj="
+                << conjugate << std::endl;
+#endif
+
+                // Add the weighted coefficient
+                if (reprocessFlag)
+                {
+                    // Use VoutFourier as temporary to save the memory
+                    auto *ptrOut=(double *)&(DIRECT_A3D_ELEM(VoutFourier, izp,iyp,ixp));
+                    DIRECT_A3D_ELEM(fourierWeights, izp,iyp,ixp) += (w * ptrOut[0]);
+                }
+                else
+                {
+                    double wEffective=w*c.wCTF;
+                    size_t memIdx=fixSize + ixp;//YXSIZE(VoutFourier)*(izp)+((iyp)*XSIZE(VoutFourier))+(ixp);
+                    auto *ptrOut=(double *)&(DIRECT_A1D_ELEM(VoutFourier, memIdx));
+                    ptrOut[0] += wEffective * ptrIn[0];
+                    DIRECT_A1D_ELEM(fourierWeights, memIdx) += w;
+
+                    if (conjugate)
+                        ptrOut[1]-=wEffective*ptrIn[1];
+                    else
+                        ptrOut[1]+=wEffective*ptrIn[1];
+                }
+            }
+        }
+    }
+}
+
+void ProgRecFourier::processRows(ImageThreadParams * threadParams, FourierGriddingTables &tables, bool hasCTF,
+                                 int minRow, int maxRow, const int * statusArray)
+{
+    MultidimArray< std::complex<double> > *paddedFourier = threadParams->paddedFourier;
+    int zsize_1 = ZSIZE(threadParams->parent->VoutFourier) - 1;
+
+    // Loop over all Fourier coefficients in the padded image
+    GriddingCoefficient c;
+    for (int i = minRow; i <= maxRow ; i ++ )
+    {
+        // Discarded rows can be between minRow and maxRow, check
+        if ( statusArray == nullptr || statusArray[i] == -1 )
+            for (int j=STARTINGX(*paddedFourier); j<=FINISHINGX(*paddedFourier); j++)
+                if (computeCoefficient(threadParams, hasCTF, i, j, c))
+                    gridCoefficient(threadParams, tables, c, 0, zsize_1);
+    }
+}
+
 void * ProgRecFourier::processImageThread( void * threadArgs )
 {
 
@@ -310,30 +761,10 @@ void * ProgRecFourier::processImageThread( void * threadArgs )
     std::vector<size_t> objId;
 
     threadParams->selFile->findObjects(objId);
-    ApplyGeoParams params;
-    params.only_apply_shifts = true;
-    MultidimArray<int> zWrapped(3*parent->volPadSizeZ),yWrapped(3*parent->volPadSizeY),xWrapped(3*parent->volPadSizeX),
-    zNegWrapped, yNegWrapped, xNegWrapped;
-    zWrapped.initConstant(-1);
-    yWrapped.initConstant(-1);
-    xWrapped.initConstant(-1);
-    zWrapped.setXmippOrigin();
-    yWrapped.setXmippOrigin();
-    xWrapped.setXmippOrigin();
-    zNegWrapped=zWrapped;
-    yNegWrapped=yWrapped;
-    xNegWrapped=xWrapped;
-
-    MultidimArray<double> x2precalculated(XSIZE(xWrapped)), y2precalculated(XSIZE(yWrapped)), z2precalculated(XSIZE(zWrapped));
-    x2precalculated.initConstant(-1);
-    y2precalculated.initConstant(-1);
-    z2precalculated.initConstant(-1);
-    x2precalculated.setXmippOrigin();
-    y2precalculated.setXmippOrigin();
-    z2precalculated.setXmippOrigin();
+    FourierGriddingTables tables;
+    tables.initialize(parent->volPadSizeX, parent->volPadSizeY, parent->volPadSizeZ);
 
-    bool hasCTF=(threadParams->selFile->containsLabel(MDL_CTF_MODEL) || threadParams->selFile->containsLabel(MDL_CTF_DEFOCUSU)) &&
-                parent->useCTF;
+    bool hasCTF=parent->hasCTFInfo(*(threadParams->selFile));
     if (hasCTF)
     {
         threadParams->ctf.enable_CTF=true;
@@ -347,134 +778,17 @@ void * ProgRecFourier::processImageThread( void * threadArgs )
         {
         case PRELOAD_IMAGE:
             {
-
                 threadParams->read = 0;
-
                 if ( threadParams->imageIndex >= 0 )
-                {
-                    // Read input image
-                    double rot, tilt, psi, weight;
-                    Projection proj;
-
-                    //Read projection from selfile, read also angles and shifts if present
-                    //but only apply shifts
-
-                    proj.readApplyGeo(*(threadParams->selFile), objId[threadParams->imageIndex], params);
-                    rot  = proj.rot();
-                    tilt = proj.tilt();
-                    psi  = proj.psi();
-                    weight = proj.weight();
-                    if (hasCTF)
-                    {
-                        threadParams->ctf.readFromMetadataRow(*(threadParams->selFile),objId[threadParams->imageIndex]);
-                        // threadParams->ctf.Tm=threadParams->parent->Ts;
-                        threadParams->ctf.produceSideInfo();
-                    }
-
-                    threadParams->weight = 1.;
-
-                    if(parent->do_weights)
-                        threadParams->weight = weight;
-                    else if (!parent->do_weights)
-                    {
-                        weight=1.0;
-                    }
-                    else if (weight==0.0)
-                    {
-                        threadParams->read = 2;
-                        break;
-                    }
-
-                    // Copy the projection to the center of the padded image
-                    // and compute its Fourier transform
-                    proj().setXmippOrigin();
-                    auto localPaddedImgSize=(size_t)(parent->imgSize*parent->padding_factor_proj);
-                    if (threadParams->reprocessFlag)
-                        localPaddedFourier.initZeros(localPaddedImgSize,localPaddedImgSize/2+1);
-                    else
-                    {
-                        localPaddedImg.initZeros(localPaddedImgSize,localPaddedImgSize);
-                        localPaddedImg.setXmippOrigin();
-                        const MultidimArray<double> &mProj=proj();
-                        FOR_ALL_ELEMENTS_IN_ARRAY2D(mProj)
-                        A2D_ELEM(localPaddedImg,i,j)=A2D_ELEM(mProj,i,j);
-                        // COSS A2D_ELEM(localPaddedImg,i,j)=weight*A2D_ELEM(mProj,i,j);
-                        CenterFFT(localPaddedImg,true);
-
-                        // Fourier transformer for the images
-                        localTransformerImg.setReal(localPaddedImg);
-                        localTransformerImg.FourierTransform();
-                        localTransformerImg.getFourierAlias(localPaddedFourier);
-                    }
-
-                    // Compute the coordinate axes associated to this image
-                    Euler_angles2matrix(rot, tilt, psi, localA);
-                    localAinv=localA.transpose();
-
-                    threadParams->localweight = weight;
-                    threadParams->localAInv = &localAinv;
-                    threadParams->localPaddedFourier = &localPaddedFourier;
-                    //#define DEBUG22
-#ifdef DEBUG22
-
-                    {//CORRECTO
-
-                        if(threadParams->myThreadID%1==0)
-                        {
-                            proj.write((std::string) integerToString(threadParams->myThreadID)  + "_" +\
-                                       integerToString(threadParams->imageIndex) + "proj.spi");
-
-                            ImageXmipp save44;
-                            save44()=localPaddedImg;
-                            save44.write((std::string) integerToString(threadParams->myThreadID)  + "_" +\
-                                         integerToString(threadParams->imageIndex) + "local_padded_img.spi");
-
-                            FourierImage save33;
-                            save33()=localPaddedFourier;
-                            save33.write((std::string) integerToString(threadParams->myThreadID)  + "_" +\
-                                         integerToString(threadParams->imageIndex) + "local_padded_fourier.spi");
-                            FourierImage save22;
-                            //save22()=*paddedFourier;
-                            save22().alias(*(threadParams->localPaddedFourier));
-                            save22.write((std::string) integerToString(threadParams->myThreadID)  + "_" +\
-                                         integerToString(threadParams->imageIndex) + "_padded_fourier.spi");
-                        }
-
-                    }
-#endif
-                    #undef DEBUG22
-
-                    threadParams->read = 1;
-                }
+                    loadImage(threadParams, objId, hasCTF, localPaddedImg, localPaddedFourier,
+                              localTransformerImg, localA, localAinv);
                 break;
             }
         case EXIT_THREAD:
             return nullptr;
         case PROCESS_WEIGHTS:
             {
-
-                // Get a first approximation of the reconstruction
-                double corr2D_3D=pow(parent->padding_factor_proj,2.)/
-                                 (parent->imgSize* pow(parent->padding_factor_vol,3.));
-                // Divide by Zdim because of the
-                // the extra dimension added
-                // and padding differences
-                MultidimArray<double> &mFourierWeights=parent->FourierWeights;
-                for (int k=threadParams->myThreadID; k<=FINISHINGZ(mFourierWeights); k+=parent->numThreads)
-                    for (int i=STARTINGY(mFourierWeights); i<=FINISHINGY(mFourierWeights); i++)
-                        for (int j=STARTINGX(mFourierWeights); j<=FINISHINGX(mFourierWeights); j++)
-                        {
-                        	if (parent->NiterWeight==0)
-                        		A3D_ELEM(parent->VoutFourier,k,i,j)*=corr2D_3D;
-                        	else
-                        	{
-                        		double weight_kij=A3D_ELEM(mFourierWeights,k,i,j);
-                        		if (1.0/weight_kij>ACCURACY)
-                        			A3D_ELEM(parent->VoutFourier,k,i,j)*=corr2D_3D*A3D_ELEM(mFourierWeights,k,i,j);
-                        		else
-                        			A3D_ELEM(parent->VoutFourier,k,i,j)=0;
-                        	}
-                        }
+                parent->applyFourierWeights(threadParams->myThreadID, parent->numThreads);
                 break;
             }
         case PROCESS_IMAGE:
@@ -482,7 +796,6 @@ void * ProgRecFourier::processImageThread( void * threadArgs )
                 MultidimArray< std::complex<double> > *paddedFourier = threadParams->paddedFourier;
                 if (threadParams->weight==0.0)
                     break;
-                bool reprocessFlag = threadParams->reprocessFlag;
                 int * statusArray = parent->statusArray;
 
                 int minAssignedRow;
@@ -490,10 +803,6 @@ void * ProgRecFourier::processImageThread( void * threadArgs )
                 bool breakCase;
                 bool assigned;
 
-                // Get the inverse of the sampling rate
-                // double iTs=parent->padding_factor_proj/parent->Ts;
-                double iTs=1.0/parent->Ts; // The padding factor is not considered here, but later when the indexes
-                //                         // are converted to digital frequencies
                 do
                 {
                     minAssignedRow = -1;
@@ -566,231 +875,8 @@ void * ProgRecFourier::processImageThread( void * threadArgs )
                         break;
                     }
 
-                    Matrix2D<double> * A_SL = threadParams->symmetry;
-
-                    // Loop over all Fourier coefficients in the padded image
-                    Matrix1D<double> freq(3), gcurrent(3), real_position(3), contFreq(3);
-                    Matrix1D<int> corner1(3), corner2(3);
-
-                    // Some alias and calculations moved from heavy loops
-                    double wCTF=1, wModulator=1.0;
-                    double blobRadiusSquared = parent->blob.radius * parent->blob.radius;
-                    double iDeltaSqrt = parent->iDeltaSqrt;
-                    Matrix1D<double> & blobTableSqrt = parent->blobTableSqrt;
-                    int xsize_1 = XSIZE(parent->VoutFourier) - 1;
-                    int zsize_1 = ZSIZE(parent->VoutFourier) - 1;
-                    MultidimArray< std::complex<double> > &VoutFourier=parent->VoutFourier;
-                    MultidimArray<double> &fourierWeights = parent->FourierWeights;
-                    //                    MultidimArray<double> &prefourierWeights = parent->preFourierWeights;
-                    // Get i value for the thread
-                    for (int i = minAssignedRow; i <= maxAssignedRow ; i ++ )
-                    {
-                        // Discarded rows can be between minAssignedRow and maxAssignedRow, check
-                        if ( statusArray[i] == -1 )
-                            for (int j=STARTINGX(*paddedFourier); j<=FINISHINGX(*paddedFourier); j++)
-                            {
-                                // Compute the frequency of this coefficient in the
-                                // universal coordinate system
-                                FFT_IDX2DIGFREQ(j,XSIZE(parent->paddedImg),XX(freq));
-                                FFT_IDX2DIGFREQ(i,YSIZE(parent->paddedImg),YY(freq));
-                                ZZ(freq)=0;
-                                if (XX(freq)*XX(freq)+YY(freq)*YY(freq)>parent->maxResolution2)
-                                    continue;
-                                wModulator=1.0;
-                                if (hasCTF && !reprocessFlag)
-                                {
-                                    XX(contFreq)=XX(freq)*iTs;
-                                    YY(contFreq)=YY(freq)*iTs;
-                                    threadParams->ctf.precomputeValues(XX(contFreq),YY(contFreq));
-                                    //wCTF=threadParams->ctf.getValueAt();
-                                    wCTF=threadParams->ctf.getValuePureNoKAt();
-                                    //wCTF=threadParams->ctf.getValuePureWithoutDampingAt();
-
-                                    if (std::isnan(wCTF))
-                                    {
-                                    	if (i==0 && j==0)
-                                    		wModulator=wCTF=1.0;
-                                    	else
-                                    		wModulator=wCTF=0.0;
-                                    }
-                                    if (fabs(wCTF)<parent->minCTF)
-                                    {
-                                        wModulator=fabs(wCTF);
-                                        wCTF=SGN(wCTF);
-                                    }
-                                    else
-                                        wCTF=1.0/wCTF;
-                                    if (parent->phaseFlipped)
-                                        wCTF=fabs(wCTF);
-                                }
-
-                                SPEED_UP_temps012;
-                                M3x3_BY_V3x1(freq,*A_SL,freq);
-
-                                // Look for the corresponding index in the volume Fourier transform
-                                DIGFREQ2FFT_IDX_DOUBLE(XX(freq),parent->volPadSizeX,XX(real_position));
-                                DIGFREQ2FFT_IDX_DOUBLE(YY(freq),parent->volPadSizeY,YY(real_position));
-                                DIGFREQ2FFT_IDX_DOUBLE(ZZ(freq),parent->volPadSizeZ,ZZ(real_position));
-
-                                // Put a box around that coefficient
-                                XX(corner1)=CEIL (XX(real_position)-parent->blob.radius);
-                                YY(corner1)=CEIL (YY(real_position)-parent->blob.radius);
-                                ZZ(corner1)=CEIL (ZZ(real_position)-parent->blob.radius);
-                                XX(corner2)=FLOOR(XX(real_position)+parent->blob.radius);
-                                YY(corner2)=FLOOR(YY(real_position)+parent->blob.radius);
-                                ZZ(corner2)=FLOOR(ZZ(real_position)+parent->blob.radius);
-
-#ifdef DEBUG
-
-                                std::cout << "Idx Img=(0," << i << "," << j << ") -> Freq Img=("
-                                << freq.transpose() << ") ->\n    Idx Vol=("
-                                << real_position.transpose() << ")\n"
-                                << "   Corner1=" << corner1.transpose() << std::endl
-                                << "   Corner2=" << corner2.transpose() << std::endl;
-#endif
-                                // Loop within the box
-                                auto *ptrIn=(double *)&(A2D_ELEM(*paddedFourier, i,j));
-
-                                // Some precalculations
-                                for (int intz = ZZ(corner1); intz <= ZZ(corner2); ++intz)
-                                {
-                                    double z = intz - ZZ(real_position);
-                                    A1D_ELEM(z2precalculated,intz)=z*z;
-                                    if (A1D_ELEM(zWrapped,intz)<0)
-                                    {
-                                        int iz, izneg;
-                                        fastIntWRAP(iz, intz, 0, zsize_1);
-                                        A1D_ELEM(zWrapped,intz)=iz;
-                                        int miz=-iz;
-                                        fastIntWRAP(izneg, miz,0,zsize_1);
-                                        A1D_ELEM(zNegWrapped,intz)=izneg;
-                                    }
-                                }
-                                for (int inty = YY(corner1); inty <= YY(corner2); ++inty)
-                                {
-                                    double y = inty - YY(real_position);
-                                    A1D_ELEM(y2precalculated,inty)=y*y;
-                                    if (A1D_ELEM(yWrapped,inty)<0)
-                                    {
-                                        int iy, iyneg;
-                                        fastIntWRAP(iy, inty, 0, zsize_1);
-                                        A1D_ELEM(yWrapped,inty)=iy;
-                                        int miy=-iy;
-                                        fastIntWRAP(iyneg, miy,0,zsize_1);
-                                        A1D_ELEM(yNegWrapped,inty)=iyneg;
-                                    }
-                                }
-                                for (int intx = XX(corner1); intx <= XX(corner2); ++intx)
-                                {
-                                    double x = intx - XX(real_position);
-                                    A1D_ELEM(x2precalculated,intx)=x*x;
-                                    if (A1D_ELEM(xWrapped,intx)<0)
-                                    {
-                                        int ix, ixneg;
-                                        fastIntWRAP(ix, intx, 0, zsize_1);
-                                        A1D_ELEM(xWrapped,intx)=ix;
-                                        int mix=-ix;
-                                        fastIntWRAP(ixneg, mix,0,zsize_1);
-                                        A1D_ELEM(xNegWrapped,intx)=ixneg;
-                                    }
-                                }
-
-                                // Actually compute
-                                for (int intz = ZZ(corner1); intz <= ZZ(corner2); ++intz)
-                                {
-                                    double z2 = A1D_ELEM(z2precalculated,intz);
-                                    int iz=A1D_ELEM(zWrapped,intz);
-                                    int izneg=A1D_ELEM(zNegWrapped,intz);
-
-                                    for (int inty = YY(corner1); inty <= YY(corner2); ++inty)
-                                    {
-                                        double y2z2 = A1D_ELEM(y2precalculated,inty) + z2;
-                                        if (y2z2 > blobRadiusSquared)
-                                            continue;
-                                        int iy=A1D_ELEM(yWrapped,inty);
-                                        int iyneg=A1D_ELEM(yNegWrapped,inty);
-
-                                        int	size1=YXSIZE(VoutFourier)*izneg+(iyneg*XSIZE(VoutFourier));
-                                        int	size2=YXSIZE(VoutFourier)*iz+(iy*XSIZE(VoutFourier));
-                                        int	fixSize=0;
-
-                                        for (int intx = XX(corner1); intx <= XX(corner2); ++intx)
-                                        {
-                                            // Compute distance to the center of the blob
-                                            // Compute blob value at that distance
-                                            double d2 = A1D_ELEM(x2precalculated,intx) + y2z2;
-
-                                            if (d2 > blobRadiusSquared)
-                                                continue;
-                                            auto aux = (int)(d2 * iDeltaSqrt + 0.5);//Same as ROUND but avoid comparison
-                                            double w = VEC_ELEM(blobTableSqrt, aux)*threadParams->weight *wModulator;
-
-                                            // Look for the location of this logical index
-                                            // in the physical layout
-#ifdef DEBUG
-
-                                            std::cout << "   gcurrent=" << gcurrent.transpose()
-                                            << " d=" << d << std::endl;
-                                            std::cout << "   1: intx=" << intx
-                                            << " inty=" << inty
-                                            << " intz=" << intz << std::endl;
-#endif
-
-                                            int ix=A1D_ELEM(xWrapped,intx);
-#ifdef DEBUG
-
-                                            std::cout << "   2: ix=" << ix << " iy=" << iy
-                                            << " iz=" << iz << std::endl;
-#endif
-
-                                            bool conjugate=false;
-                                            int izp, iyp, ixp;
-                                            if (ix > xsize_1)
-                                            {
-                                                izp = izneg;
-                                                iyp = iyneg;
-                                                ixp = A1D_ELEM(xNegWrapped,intx);
-                                                conjugate=true;
-                                                fixSize = size1;
-                                            }
-                                            else
-                                            {
-                                                izp=iz;
-                                                iyp=iy;
-                                                ixp=ix;
-                                                fixSize = size2;
-                                            }
-#ifdef DEBUG
-                                            std::cout << "   3: ix=" << ix << " iy=" << iy
-                                            << " iz=" << iz << " conj="
-                                            << conjugate << std::endl;
-#endif
-
-                                            // Add the weighted coefficient
-                                            if (reprocessFlag)
-                                            {
-                                                // Use VoutFourier as temporary to save the memory
-                                            	auto *ptrOut=(double *)&(DIRECT_A3D_ELEM(VoutFourier, izp,iyp,ixp));
-                                                DIRECT_A3D_ELEM(fourierWeights, izp,iyp,ixp) += (w * ptrOut[0]);
-                                            }
-                                            else
-                                            {
-                                                double wEffective=w*wCTF;
-                                                size_t memIdx=fixSize + ixp;//YXSIZE(VoutFourier)*(izp)+((iyp)*XSIZE(VoutFourier))+(ixp);
-                                                auto *ptrOut=(double *)&(DIRECT_A1D_ELEM(VoutFourier, memIdx));
-                                                ptrOut[0] += wEffective * ptrIn[0];
-                                                DIRECT_A1D_ELEM(fourierWeights, memIdx) += w;
-
-                                                if (conjugate)
-                                                    ptrOut[1]-=wEffective*ptrIn[1];
-                                                else
-                                                    ptrOut[1]+=wEffective*ptrIn[1];
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                    }
+                    processRows(threadParams, tables, hasCTF, minAssignedRow, maxAssignedRow,
+                                statusArray);
 
                     pthread_mutex_lock( &(parent->workLoadMutex) );
 
@@ -831,9 +917,270 @@ void * ProgRecFourier::processImageThread( void * threadArgs )
     while ( 1 );
 }
 
+void ProgRecFourier::processImagesPool(int firstImageIndex, int lastImageIndex, bool reprocessFlag, int &imgno)
+{
+    if (lastImageIndex < firstImageIndex)
+        return;
+
+    if (poolWorkers.empty())
+    {
+        poolWorkers.resize(numThreads);
+        for (int nt = 0; nt < numThreads; nt++)
+        {
+            auto &worker = poolWorkers[nt];
+            worker = std::make_unique<FourierPoolWorker>();
+            worker->params.parent = this;
+            worker->params.myThreadID = nt;
+            worker->selFile = SF;
+            worker->params.selFile = &worker->selFile;
+            worker->selFile.findObjects(worker->objId);
+            worker->localA.initZeros(3, 3);
+            worker->localAinv.initZeros(3, 3);
+            worker->tables.initialize(volPadSizeX, volPadSizeY, volPadSizeZ);
+            worker->hasCTF = hasCTFInfo(SF);
+            if (worker->hasCTF)
+            {
+                worker->params.ctf.enable_CTF=true;
+                worker->params.ctf.enable_CTFnoise=false;
+            }
+        }
+    }
+
+    auto repaint = (int)ceil((double)SF.size()/60);
+    std::mutex progressMutex;
+
+    // Read an image in the scratch data of a slot
+    auto loadSlot = [&](int, int slot, int imgIndex)
+    {
+        auto &worker = *poolWorkers[slot];
+        ImageThreadParams *threadParams = &worker.params;
+        threadParams->imageIndex = imgIndex;
+        threadParams->reprocessFlag = reprocessFlag;
+        loadImage(threadParams, worker.objId, worker.hasCTF, worker.localPaddedImg,
+                  worker.localPaddedFourier, worker.localTransformerImg, worker.localA, worker.localAinv);
+        if (threadParams->read != 1)
+            return;
+        if (verbose)
+        {
+            std::lock_guard<std::mutex> lock(progressMutex);
+            if (imgno % repaint == 0)
+                progress_bar(imgno);
+            imgno++;
+        }
+
+        threadParams->paddedFourier = threadParams->localPaddedFourier;
+        threadParams->weight = threadParams->localweight;
+        worker.A_SL.resize(R_repository.size());
+        for (size_t isym = 0; isym < R_repository.size(); isym++)
+            worker.A_SL[isym]=R_repository[isym]*(*(threadParams->localAInv));
+    };
+
+    // The volume is split in slabs of Z planes. Each slab is modified by a
+    // single task, so no locks are needed, and the coefficients are always
+    // added in the same order (image, symmetry, row, column)
+    auto zdim = (int)ZSIZE(VoutFourier);
+    int nSlabs = std::min(4 * numThreads, zdim);
+    std::vector<int> slabOfPlane(zdim);
+    for (int slab = 0; slab < nSlabs; slab++)
+    {
+        int minZ = (int)((size_t)slab * zdim / nSlabs);
+        int maxZ = (int)((size_t)(slab + 1) * zdim / nSlabs) - 1;
+        for (int z = minZ; z <= maxZ; z++)
+            slabOfPlane[z] = slab;
+    }
+
+    // An image under a symmetry
+    struct GriddingJob
+    {
+        int slot;
+        size_t isym;
+    };
+    // Coefficients of each job of a round, in the slabs their blob box reaches
+    auto nSlots = (int)poolWorkers.size();
+    std::vector< std::vector< std::vector<GriddingCoefficient> > > jobCoefficients(nSlots,
+        std::vector< std::vector<GriddingCoefficient> >(nSlabs));
+
+    // Place the coefficients of an image under a symmetry in the volume,
+    // and keep each one in the slabs of the planes it modifies (iz, or
+    // izneg if conjugated)
+    auto transformJob = [&](int, int job, const GriddingJob &gj)
+    {
+        auto &worker = *poolWorkers[gj.slot];
+        auto &buckets = jobCoefficients[job];
+        for (auto &bucket : buckets)
+            bucket.clear();
+        // computeCoefficient modifies the CTF, so each task needs its copy
+        ImageThreadParams threadParams = worker.params;
+        threadParams.symmetry = &worker.A_SL[gj.isym];
+        const auto &paddedFourier = *(threadParams.paddedFourier);
+
+        // Same rows as in the status array of processImages
+        auto ydim = (int)YSIZE(paddedFourier);
+        auto conserveRows=(int)ceil((double)ydim * maxResolution * 2.0);
+        conserveRows=(int)ceil((double)conserveRows/2.0);
+        int zsize_1 = zdim - 1;
+        std::vector<int> slabs;
+        GriddingCoefficient c;
+        for (int i = 0; i < ydim; i++)
+        {
+            if (i >= conserveRows && i < ydim - conserveRows)
+                continue;
+            for (int j=STARTINGX(paddedFourier); j<=FINISHINGX(paddedFourier); j++)
+            {
+                if (!computeCoefficient(&threadParams, worker.hasCTF, i, j, c))
+                    continue;
+                slabs.clear();
+                for (int intz = CEIL(c.z-blob.radius); intz <= FLOOR(c.z+blob.radius); ++intz)
+                {
+                    int iz, izneg;
+                    fastIntWRAP(iz, intz, 0, zsize_1);
+                    int miz=-iz;
+                    fastIntWRAP(izneg, miz,0,zsize_1);
+                    for (int slab : {slabOfPlane[iz], slabOfPlane[izneg]})
+                        if (std::find(slabs.begin(), slabs.end(), slab) == slabs.end())
+                            slabs.push_back(slab);
+                }
+                for (int slab : slabs)
+                    buckets[slab].push_back(c);
+            }
+        }
+    };
+
+    // Grid the coefficients of the jobs of a round in the planes of a slab
+    auto gridSlab = [&](int thrId, int slab, const std::vector<GriddingJob> &round)
+    {
+        int minZ = (int)((size_t)slab * zdim / nSlabs);
+        int maxZ = (int)((size_t)(slab + 1) * zdim / nSlabs) - 1;
+        auto &tables = poolWorkers[thrId]->tables;
+        for (size_t job = 0; job < round.size(); job++)
+        {
+            const ImageThreadParams *threadParams = &poolWorkers[round[job].slot]->params;
+            for (const auto &c : jobCoefficients[job][slab])
+                gridCoefficient(threadParams, tables, c, minZ, maxZ);
+        }
+    };
+
+    // The images are read in batches of one image per thread (slot). The
+    // images of a batch under each symmetry are transformed and gridded in
+    // rounds of as many jobs as threads
+    std::vector<std::future<void>> futures;
+    std::vector<GriddingJob> jobs, round;
+    for (int first = firstImageIndex; first <= lastImageIndex; first += nSlots)
+    {
+        int nBatch = std::min(nSlots, lastImageIndex - first + 1);
+        futures.clear();
+        for (int slot = 0; slot < nBatch; slot++)
+            futures.emplace_back(threadPool->push(loadSlot, slot, first + slot));
+        for (auto &f : futures)
+            f.get();
+
+        jobs.clear();
+        for (int slot = 0; slot < nBatch; slot++)
+        {
+            auto &worker = *poolWorkers[slot];
+            if (worker.params.read != 1 || worker.params.weight==0.0)
+                continue;
+            for (size_t isym = 0; isym < worker.A_SL.size(); isym++)
+                jobs.push_back({slot, isym});
+        }
+
+        for (size_t firstJob = 0; firstJob < jobs.size(); firstJob += nSlots)
+        {
+            round.assign(jobs.begin() + firstJob, jobs.begin() + std::min(jobs.size(), firstJob + nSlots));
+            futures.clear();
+            for (size_t job = 0; job < round.size(); job++)
+                futures.emplace_back(threadPool->push(transformJob, (int)job, round[job]));
+            for (auto &f : futures)
+                f.get();
+
+            futures.clear();
+            for (int slab = 0; slab < nSlabs; slab++)
+                futures.emplace_back(threadPool->push(gridSlab, slab, std::cref(round)));
+            for (auto &f : futures)
+                f.get();
+        }
+    }
+}
+
+void ProgRecFourier::saveFSCFirstHalf()
+{
+    // Save Current Fourier, Reconstruction and Weights
+    Image<double> save;
+    save().alias( FourierWeights );
+    save.write((std::string)fn_fsc + "_1_Weights.vol");
+
+    Image< std::complex<double> > save2;
+    save2().alias( VoutFourier );
+    save2.write((std::string) fn_fsc + "_1_Fourier.vol");
+
+    finishComputations(FileName((std::string) fn_fsc + "_1_recons.vol"));
+    Vout().initZeros(volPadSizeZ, volPadSizeY, volPadSizeX);
+    transformerVol.setReal(Vout());
+    Vout().clear();
+    transformerVol.getFourierAlias(VoutFourier);
+    FourierWeights.initZeros(VoutFourier);
+    VoutFourier.initZeros();
+}
+
+void ProgRecFourier::saveFSCSecondHalf()
+{
+    // Save Current Fourier, Reconstruction and Weights
+    Image<double> auxVolume;
+    auxVolume().alias( FourierWeights );
+    auxVolume.write((std::string)fn_fsc + "_2_Weights.vol");
+
+    Image< std::complex<double> > auxFourierVolume;
+    auxFourierVolume().alias( VoutFourier );
+    auxFourierVolume.write((std::string) fn_fsc + "_2_Fourier.vol");
+
+    finishComputations(FileName((std::string) fn_fsc + "_2_recons.vol"));
+
+    Vout().initZeros(volPadSizeZ, volPadSizeY, volPadSizeX);
+    transformerVol.setReal(Vout());
+    Vout().clear();
+    transformerVol.getFourierAlias(VoutFourier);
+    FourierWeights.initZeros(VoutFourier);
+    VoutFourier.initZeros();
+
+    auxVolume.sumWithFile(fn_fsc + "_1_Weights.vol");
+    auxVolume.sumWithFile(fn_fsc + "_2_Weights.vol");
+    auxFourierVolume.sumWithFile(fn_fsc + "_1_Fourier.vol");
+    auxFourierVolume.sumWithFile(fn_fsc + "_2_Fourier.vol");
+    remove((fn_fsc + "_1_Weights.vol").c_str());
+    remove((fn_fsc + "_2_Weights.vol").c_str());
+    remove((fn_fsc + "_1_Fourier.vol").c_str());
+    remove((fn_fsc + "_2_Fourier.vol").c_str());
+
+    /*
+    //Save SUM
+                                //this is an image but not an xmipp image
+                                auxFourierVolume.write((std::string)fn_fsc + "_all_Fourier.vol",
+                                        false,VDOUBLE);
+                                auxVolume.write((std::string)fn_fsc + "_all_Weight.vol",
+                                        false,VDOUBLE);
+    //
+    */
+}
+
 //#define DEBUG
 void ProgRecFourier::processImages( int firstImageIndex, int lastImageIndex, bool saveFSC, bool reprocessFlag)
 {
+    if (threadPool)
+    {
+        int imgno = 0;
+        if (saveFSC)
+        {
+            int FSCIndex = (firstImageIndex + lastImageIndex)/2;
+            processImagesPool(firstImageIndex, FSCIndex, reprocessFlag, imgno);
+            saveFSCFirstHalf();
+            processImagesPool(FSCIndex + 1, lastImageIndex, reprocessFlag, imgno);
+            saveFSCSecondHalf();
+        }
+        else
+            processImagesPool(firstImageIndex, lastImageIndex, reprocessFlag, imgno);
+        return;
+    }
+
     MultidimArray< std::complex<double> > *paddedFourier;
 
     auto repaint = (int)ceil((double)SF.size()/60);
@@ -990,22 +1337,7 @@ void ProgRecFourier::processImages( int firstImageIndex, int lastImageIndex, boo
 
                 if ( current_index == FSCIndex && saveFSC )
                 {
-                    // Save Current Fourier, Reconstruction and Weights
-                    Image<double> save;
-                    save().alias( FourierWeights );
-                    save.write((std::string)fn_fsc + "_1_Weights.vol");
-
-                    Image< std::complex<double> > save2;
-                    save2().alias( VoutFourier );
-                    save2.write((std::string) fn_fsc + "_1_Fourier.vol");
-
-                    finishComputations(FileName((std::string) fn_fsc + "_1_recons.vol"));
-                    Vout().initZeros(volPadSizeZ, volPadSizeY, volPadSizeX);
-                    transformerVol.setReal(Vout());
-                    Vout().clear();
-                    transformerVol.getFourierAlias(VoutFourier);
-                    FourierWeights.initZeros(VoutFourier);
-                    VoutFourier.initZeros();
+                    saveFSCFirstHalf();
                 }
             }
         }
@@ -1014,42 +1346,7 @@ void ProgRecFourier::processImages( int firstImageIndex, int lastImageIndex, boo
 
     if( saveFSC )
     {
-        // Save Current Fourier, Reconstruction and Weights
-        Image<double> auxVolume;
-        auxVolume().alias( FourierWeights );
-        auxVolume.write((std::string)fn_fsc + "_2_Weights.vol");
-
-        Image< std::complex<double> > auxFourierVolume;
-        auxFourierVolume().alias( VoutFourier );
-        auxFourierVolume.write((std::string) fn_fsc + "_2_Fourier.vol");
-
-        finishComputations(FileName((std::string) fn_fsc + "_2_recons.vol"));
-
-        Vout().initZeros(volPadSizeZ, volPadSizeY, volPadSizeX);
-        transformerVol.setReal(Vout());
-        Vout().clear();
-        transformerVol.getFourierAlias(VoutFourier);
-        FourierWeights.initZeros(VoutFourier);
-        VoutFourier.initZeros();
-
-        auxVolume.sumWithFile(fn_fsc + "_1_Weights.vol");
-        auxVolume.sumWithFile(fn_fsc + "_2_Weights.vol");
-        auxFourierVolume.sumWithFile(fn_fsc + "_1_Fourier.vol");
-        auxFourierVolume.sumWithFile(fn_fsc + "_2_Fourier.vol");
-        remove((fn_fsc + "_1_Weights.vol").c_str());
-        remove((fn_fsc + "_2_Weights.vol").c_str());
-        remove((fn_fsc + "_1_Fourier.vol").c_str());
-        remove((fn_fsc + "_2_Fourier.vol").c_str());
-
-        /*
-        //Save SUM
-                                    //this is an image but not an xmipp image
-                                    auxFourierVolume.write((std::string)fn_fsc + "_all_Fourier.vol",
-                                            false,VDOUBLE);
-                                    auxVolume.write((std::string)fn_fsc + "_all_Weight.vol",
-                                            false,VDOUBLE);
-        //
-        */
+        saveFSCSecondHalf();
     }
 }
 
@@ -1136,11 +1433,22 @@ void ProgRecFourier::finishComputations( const FileName &out_name )
         save2.write((std::string) fn_out + "hermiticFourierVol.vol");
     }
 #endif
-    threadOpCode = PROCESS_WEIGHTS;
-    // Awake threads
-    barrier_wait( &barrier );
-    // Threads are working now, wait for them to finish
-    barrier_wait( &barrier );
+    if (threadPool)
+    {
+        std::vector<std::future<void>> futures;
+        for (int nt = 0; nt < numThreads; nt++)
+            futures.emplace_back(threadPool->push([this, nt](int){ applyFourierWeights(nt, numThreads); }));
+        for (auto &f : futures)
+            f.get();
+    }
+    else
+    {
+        threadOpCode = PROCESS_WEIGHTS;
+        // Awake threads
+        barrier_wait( &barrier );
+        // Threads are working now, wait for them to finish
+        barrier_wait( &barrier );
+    }
 
     transformerVol.inverseFourierTransform();
     CenterFFT(Vout(),false);
@@ -1176,7 +1484,8 @@ void ProgRecFourier::finishComputations( const FileName &out_name )
         FOR_ALL_ELEMENTS_IN_ARRAY3D(mVout)
         A3D_ELEM(mVout,k,i,j) *= meanFactor2;
     }
-    Vout.write(out_name);
+    if (!out_name.empty())
+        Vout.write(out_name);
 }
 
 void ProgRecFourier::setIO(const FileName &fn_in, const FileName &fn_out)
@@ -29,6 +29,10 @@
 #ifndef __RECONSTRUCT_FOURIER_H
 #define __RECONSTRUCT_FOURIER_H
 
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "CTPL/ctpl_stl.h"
 #include "core/metadata_vec.h"
 #include "core/xmipp_fftw.h"
 #include "core/xmipp_image.h"
@@ -72,6 +76,47 @@ struct ImageThreadParams
     MetaData * selFile;
 };
 
+/** Scratch arrays used to grid the Fourier coefficients of an image.
+ * Each thread needs its own. */
+struct FourierGriddingTables
+{
+    MultidimArray<int> zWrapped, yWrapped, xWrapped, zNegWrapped, yNegWrapped, xNegWrapped;
+    MultidimArray<double> x2precalculated, y2precalculated, z2precalculated;
+
+    /// Allocate the tables for a padded volume of the given size
+    void initialize(int volPadSizeX, int volPadSizeY, int volPadSizeZ);
+};
+
+/** A Fourier coefficient of an image placed in the volume.
+ * The value is that of the row i and column j of the padded image. */
+struct GriddingCoefficient
+{
+    /// Position in the padded volume (logical Fourier index)
+    double x, y, z;
+    /// Row and column in the padded image
+    int i, j;
+    /// CTF correction of the coefficient and of its weight
+    double wCTF, wModulator;
+};
+
+/** Scratch data of a thread of the task pool (see --taskPool).
+ * The image data belongs to the image read in slot nt of the current
+ * batch, the gridding tables to the pool thread nt. */
+struct FourierPoolWorker
+{
+    ImageThreadParams params;
+    MetaDataVec selFile;
+    std::vector<size_t> objId;
+    FourierGriddingTables tables;
+    Matrix2D<double> localA, localAinv;
+    /// Projection matrix of the image for each symmetry
+    std::vector< Matrix2D<double> > A_SL;
+    MultidimArray< std::complex<double> > localPaddedFourier;
+    MultidimArray<double> localPaddedImg;
+    FourierTransformer localTransformerImg;
+    bool hasCTF;
+};
+
 /** Fourier reconstruction parameters. */
 class ProgRecFourier : public ProgReconsBase
 {
@@ -79,7 +124,9 @@ public:
     /** Filenames */
     FileName fn_out, fn_sym, fn_sel, fn_doc, fn_fsc;
 
-    /** SelFile containing all projections */
+    /** SelFile containing all projections.
+        If fn_sel is empty, it is not read from disk and the images
+        already in SF are reconstructed. */
     MetaDataVec SF;
 
     /** Flag whether to use the weights in the image metadata */
@@ -144,6 +191,16 @@ public:
     /// How many image rows are processed at a time by a single thread.
     int thrWidth;
 
+    /** Process whole images in parallel with a task pool (instead of the threads above).
+     * The images are read in batches. Each image of a batch is placed in the
+     * volume once per symmetry, and its coefficients are grouped by the slabs
+     * of Z planes they modify. Then each slab is gridded by a single task */
+    bool useTaskPool = false;
+    /// Task pool (only with useTaskPool)
+    std::unique_ptr<ctpl::thread_pool> threadPool;
+    /// Scratch data of each thread of the pool
+    std::vector< std::unique_ptr<FourierPoolWorker> > poolWorkers;
+
 public: // Internal members
     // Size of the original images
     int imgSize;
@@ -206,11 +263,59 @@ public:
     /// Produce side info: fill arrays with relevant transformation matrices
     void produceSideinfo();
 
+    /// Compute the final volume in Vout and write it to out_name (if not empty)
     void finishComputations( const FileName &out_name );
 
+    /// Start the threads (or the task pool) processing the images
+    void createThreads();
+
+    /// Stop the threads (or the task pool) and release their resources
+    void destroyThreads();
+
     /// Process one image
     void processImages( int firstImageIndex, int lastImageIndex, bool saveFSC=false, bool reprocessFlag=false);
 
+    /// Process images with the task pool. imgno counts the images for the progress bar
+    void processImagesPool(int firstImageIndex, int lastImageIndex, bool reprocessFlag, int &imgno);
+
+    /// Write the volumes of the first half of the images for the FSC and start from scratch
+    void saveFSCFirstHalf();
+
+    /// Write the volumes of the second half of the images for the FSC and add both halves
+    void saveFSCSecondHalf();
+
+    /// True if the metadata has CTF information and it must be used
+    bool hasCTFInfo(const MetaData &md) const;
+
+    /// Read the image imageIndex of threadParams and compute its Fourier transform
+    static void loadImage(ImageThreadParams * threadParams, const std::vector<size_t> &objId, bool hasCTF,
+                          MultidimArray<double> &localPaddedImg,
+                          MultidimArray< std::complex<double> > &localPaddedFourier,
+                          FourierTransformer &localTransformerImg,
+                          Matrix2D<double> &localA, Matrix2D<double> &localAinv);
+
+    /** Place the coefficient (i,j) of the Fourier transform in threadParams
+     * in the volume, with the symmetry of threadParams.
+     * Returns false if it is beyond the maximum resolution.
+     */
+    static bool computeCoefficient(ImageThreadParams * threadParams, bool hasCTF, int i, int j,
+                                   GriddingCoefficient &c);
+
+    /** Add the blob of a coefficient of the image in threadParams to the volume.
+     * Only the Z planes minZ..maxZ of the volume are modified.
+     */
+    static void gridCoefficient(const ImageThreadParams * threadParams, FourierGriddingTables &tables,
+                                const GriddingCoefficient &c, int minZ, int maxZ);
+
+    /** Grid the rows minRow..maxRow of the Fourier transform in threadParams.
+     * If statusArray is given, only rows marked as being processed (-1) are gridded.
+     */
+    static void processRows(ImageThreadParams * threadParams, FourierGriddingTables &tables, bool hasCTF,
+                            int minRow, int maxRow, const int * statusArray);
+
+    /// Apply the Fourier weights to the planes firstZ, firstZ+stepZ, ... of VoutFourier
+    void applyFourierWeights(int firstZ, int stepZ);
+
     /// Method for the correction of the fourier coefficients
     void correctWeight();
 
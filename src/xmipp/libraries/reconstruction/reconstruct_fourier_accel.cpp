@@ -35,6 +35,8 @@
 #include "data/array_2D.h"
 #include "data/ctf.h"
 #include "data/fourier_projection.h"
+#include "data/cpu.h"
+#include "reconstruct_fourier_blob_avx2.h"
 
 void ProjectionData::clean() {
     delete img;
@@ -68,6 +70,7 @@ void ProgRecFourierAccel::defineParams()
     addParamsLine("                                 : radius in pixels, order of Bessel function in blob and parameter alpha");
     addParamsLine("  [--fast]                       : Do the blobing at the end of the computation.");
     addParamsLine("                                 : Gives slightly different results, but is faster.");
+    addParamsLine("  [--noSIMD]                     : Do not use the AVX2 blob gridding even if the CPU supports it");
     addParamsLine("  [--useCTF]                     : Use CTF information if present");
     addParamsLine("  [--sampling <Ts=1>]            : sampling rate of the input images in Angstroms/pixel");
     addParamsLine("                                 : It is only used when correcting for the CTF");
@@ -94,6 +97,7 @@ void ProgRecFourierAccel::readParams()
     blob.order    = getIntParam("--blob", 1);
     blob.alpha    = getDoubleParam("--blob", 2);
     useFast		  = checkParam("--fast");
+    useSIMD       = !checkParam("--noSIMD") && CPU::hasAVX2();
     maxResolution = getDoubleParam("--max_resolution");
     useCTF = checkParam("--useCTF");
     isPhaseFlipped = checkParam("--phaseFlipped");
@@ -131,6 +135,7 @@ void ProgRecFourierAccel::show()
         << "\n   blord                 : "  << blob.order
         << "\n   blalpha               : "  << blob.alpha
         << "\n max_resolution          : "  << maxResolution
+        << "\n AVX2 blob gridding      : "  << (useSIMD && !useFast ? "yes" : "no")
         << "\n -----------------------------------------------------------------" << std::endl;
     }
 }
@@ -699,6 +704,48 @@ inline void ProgRecFourierAccel::processVoxelBlob(int x, int y, int z, const flo
 
 }
 
+void ProgRecFourierAccel::packProjection(const ProjectionData* data) {
+	int sizeX = data->img->getXSize();
+	int sizeY = data->img->getYSize();
+	packedProjection.resize(4 * (size_t)sizeX * sizeY);
+	float* dest = packedProjection.data();
+	for (int i = 0; i < sizeY; i++) {
+		for (int j = 0; j < sizeX; j++) {
+			const std::complex<float>& val = (*data->img)(j, i);
+			*dest++ = val.real();
+			*dest++ = val.imag();
+			*dest++ = (0 != data->CTF) ? (*data->CTF)(j, i) : 1.f;
+			*dest++ = (0 != data->modulator) ? (*data->modulator)(j, i) : 1.f;
+		}
+	}
+}
+
+#ifdef RECFOURIER_AVX2
+void ProgRecFourierAccel::processVoxelBlobRunAVX2(int xFrom, int xTo, int y, int z,
+		const float transform[3][3], float maxDistanceSqr,
+		ProjectionData* const data) {
+	RecFourierBlobRun run;
+	run.pixels = packedProjection.data();
+	run.pixelStride = 4;
+	run.hasCTF = (0 != data->CTF);
+	run.sizeX = data->img->getXSize();
+	run.sizeY = data->img->getYSize();
+	run.radius = blob.radius;
+	run.blobTableSqrt = blobTableSqrt;
+	run.iDeltaSqrt = iDeltaSqrt;
+	run.centerX = maxVolumeIndexX/2;
+	run.centerYZ = maxVolumeIndexYZ/2;
+	run.weight = data->weight;
+	run.maxDistanceSqr = maxDistanceSqr;
+	run.transform = transform;
+	recFourierBlobRunAVX2(run, xFrom, xTo, y, z,
+			[this, y, z](int x, float weight, float re, float im) {
+				tempWeights[z][y][x] += weight;
+				tempVolume[z][y][x] += std::complex<float>(re, im);
+			});
+}
+#endif
+
 inline void ProgRecFourierAccel::convert(Matrix2D<double>& in, float out[3][3]) {
 	for (int i = 0; i < 3; i++) {
 		for (int j = 0; j < 3; j++) {
@@ -753,6 +800,13 @@ void ProgRecFourierAccel::processProjection(
 					x2 = clamp(x2, 0, maxVolumeIndexX);
 					float lower = std::min(x1, x2);
 					float upper = std::max(x1, x2);
+#ifdef RECFOURIER_AVX2
+					if (useSIMD) {
+						processVoxelBlobRunAVX2(std::floor(lower), std::ceil(upper), y, z,
+								transformInv, maxDistanceSqr, projectionData);
+						continue;
+					}
+#endif
 					for (int x = std::floor(lower); x <= std::ceil(upper); x++) {
 						processVoxelBlob(x, y, z, transformInv, maxDistanceSqr, projectionData);
 					}
@@ -948,6 +1002,9 @@ void ProgRecFourierAccel::processBuffer(ProjectionData* buffer)
 			progress_bar(projData->imgIndex);
 		}
 
+		if (useSIMD && !useFast) {
+			packProjection(projData);
+		}
 		Matrix2D<double> *Ainv = &projData->localAInv;
 		// Loop over all symmetries
 		for (size_t isym = 0; isym < R_repository.size(); isym++)
@@ -218,6 +218,13 @@ private:
     /** If true, blobing is done at the end of the computation */
     bool useFast;
 
+    /** If true, the blob gridding uses the AVX2 kernel (decided at runtime) */
+    bool useSIMD;
+
+    /** Projection being processed, stored per pixel as (re, im, CTF, modulator).
+     * Continuous copy used by the AVX2 kernel */
+    std::vector<float> packedProjection;
+
     /** Use CTF */
     bool useCTF;
 
@@ -462,6 +469,19 @@ private:
     void processVoxelBlob(int x, int y, int z, const float transform[3][3], float maxDistanceSqr,
     		ProjectionData* const data);
 
+    /** Copy the projection (and its CTF) to packedProjection */
+    void packProjection(const ProjectionData* data);
+
+    /**
+     * Same as processVoxelBlob, for the voxels xFrom..xTo (included) of the row (y, z).
+     * Uses recFourierBlobRunAVX2 (reconstruct_fourier_blob_avx2.h), shared with the
+     * CPU codelet of the StarPU reconstruction.
+     * Requires packProjection to be called before.
+     */
+    void processVoxelBlobRunAVX2(int xFrom, int xTo, int y, int z,
+    		const float transform[3][3], float maxDistanceSqr,
+    		ProjectionData* const data);
+
 
 };
 //@}
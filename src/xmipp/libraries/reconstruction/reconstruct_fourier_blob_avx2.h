@@ -0,0 +1,183 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#ifndef RECONSTRUCT_FOURIER_BLOB_AVX2_H_
+#define RECONSTRUCT_FOURIER_BLOB_AVX2_H_
+
+/**@defgroup RecFourierBlobAVX2 AVX2 blob gridding of Fourier reconstructions
+   @ingroup ReconsLibrary */
+//@{
+/** Defined when the AVX2 kernel can be compiled (x86-64 host code with GCC or clang).
+ * The kernel is compiled with a target attribute, so it does not need AVX2
+ * flags; check CPU::hasAVX2 before calling it.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__CUDA_ARCH__)
+#define RECFOURIER_AVX2
+#include <immintrin.h>
+#include <cmath>
+
+/** Projection and geometry used by recFourierBlobRunAVX2 */
+struct RecFourierBlobRun
+{
+    /// Pixels of the projection (row-major), pixelStride floats per pixel: re, im[, CTF, modulator]
+    const float *pixels;
+    /// Floats per pixel, 2 or 4
+    int pixelStride;
+    /// If true, the third and fourth float of each pixel are the CTF and the modulator
+    bool hasCTF;
+    /// Size of the projection
+    int sizeX, sizeY;
+    /// Blob radius
+    float radius;
+    /// Blob values at the squared distances, step 1/iDeltaSqrt
+    const float *blobTableSqrt;
+    float iDeltaSqrt;
+    /// Center of the volume (maxVolumeIndexX/2, maxVolumeIndexYZ/2)
+    int centerX, centerYZ;
+    /// Weight of the projection
+    float weight;
+    /// Max squared distance from the center of the volume that is processed
+    float maxDistanceSqr;
+    /// Rotation from the volume to the projection
+    const float (*transform)[3];
+};
+
+/** Blob gridding of the voxels xFrom..xTo (included) of the row (y, z).
+ * Same as the scalar processVoxelBlob of reconstruct_fourier_accel and of the
+ * StarPU CPU codelet, with the blob values taken from the lookup table.
+ * Eight consecutive voxels are processed at once, one per vector lane.
+ * store(x, weight, re, im) is called for each voxel that collected some
+ * pixel, in increasing x.
+ */
+template<typename Store>
+__attribute__((target("avx2,fma")))
+void recFourierBlobRunAVX2(const RecFourierBlobRun &p, int xFrom, int xTo, int y, int z, Store store)
+{
+    const float radiusSqr = p.radius * p.radius;
+    // max. number of pixels of the blob in each direction
+    const int window = (int)std::floor(2 * p.radius) + 1;
+
+    // voxel coordinates with respect to center, X varies along the lanes
+    const float cy = y - p.centerYZ;
+    const float cz = z - p.centerYZ;
+    const __m256 vYZSqr = _mm256_set1_ps(cy*cy + cz*cz);
+    const __m256 vMaxDistanceSqr = _mm256_set1_ps(p.maxDistanceSqr);
+    const __m256 vRadius = _mm256_set1_ps(p.radius);
+    const __m256 vRadiusSqr = _mm256_set1_ps(radiusSqr);
+    const __m256 vIDeltaSqrt = _mm256_set1_ps(p.iDeltaSqrt);
+    const __m256 vHalf = _mm256_set1_ps(0.5f);
+    const __m256 vWeight = _mm256_set1_ps(p.weight);
+    const __m256 vZero = _mm256_setzero_ps();
+    const __m256i vZeroI = _mm256_setzero_si256();
+    const __m256i vMaxX = _mm256_set1_epi32(p.sizeX - 1);
+    const __m256i vMaxY = _mm256_set1_epi32(p.sizeY - 1);
+    const __m256i vSizeX = _mm256_set1_epi32(p.sizeX);
+    const __m256i vStride = _mm256_set1_epi32(p.pixelStride);
+    const __m256i vLane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    // rotation of the constant part (y, z) of the coordinates
+    const __m256 vT0 = _mm256_set1_ps(p.transform[0][1] * cy + p.transform[0][2] * cz);
+    const __m256 vT1 = _mm256_set1_ps(p.transform[1][1] * cy + p.transform[1][2] * cz + p.centerYZ);
+    const __m256 vT2 = _mm256_set1_ps(p.transform[2][1] * cy + p.transform[2][2] * cz);
+
+    for (int x0 = xFrom; x0 <= xTo; x0 += 8) {
+        __m256i vx = _mm256_add_epi32(_mm256_set1_epi32(x0), vLane);
+        __m256 vcx = _mm256_cvtepi32_ps(_mm256_sub_epi32(vx, _mm256_set1_epi32(p.centerX)));
+        // lanes within the run and not exceeding max frequency
+        __m256 active = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(xTo + 1), vx));
+        active = _mm256_and_ps(active,
+                _mm256_cmp_ps(_mm256_fmadd_ps(vcx, vcx, vYZSqr), vMaxDistanceSqr, _CMP_LE_OQ));
+        // rotate around center, Y is moved back
+        __m256 px = _mm256_fmadd_ps(_mm256_set1_ps(p.transform[0][0]), vcx, vT0);
+        __m256 py = _mm256_fmadd_ps(_mm256_set1_ps(p.transform[1][0]), vcx, vT1);
+        __m256 pz = _mm256_fmadd_ps(_mm256_set1_ps(p.transform[2][0]), vcx, vT2);
+        __m256 zSqr = _mm256_mul_ps(pz, pz);
+        active = _mm256_and_ps(active, _mm256_cmp_ps(zSqr, vRadiusSqr, _CMP_LE_OQ));
+        if (0 == _mm256_movemask_ps(active)) continue;
+
+        // blob bounding box of each lane
+        __m256i minX = _mm256_max_epi32(_mm256_cvttps_epi32(_mm256_ceil_ps(_mm256_sub_ps(px, vRadius))), vZeroI);
+        __m256i maxX = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(px, vRadius))), vMaxX);
+        __m256i minY = _mm256_max_epi32(_mm256_cvttps_epi32(_mm256_ceil_ps(_mm256_sub_ps(py, vRadius))), vZeroI);
+        __m256i maxY = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(py, vRadius))), vMaxY);
+
+        __m256 accWeight = vZero;
+        __m256 accRe = vZero;
+        __m256 accIm = vZero;
+        __m256 touched = vZero;
+        for (int di = 0; di < window; di++) {
+            __m256i vi = _mm256_add_epi32(minY, _mm256_set1_epi32(di));
+            __m256 rowMask = _mm256_andnot_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(vi, maxY)), active);
+            __m256 dy = _mm256_sub_ps(py, _mm256_cvtepi32_ps(vi));
+            __m256 yzSqr = _mm256_fmadd_ps(dy, dy, zSqr);
+            rowMask = _mm256_and_ps(rowMask, _mm256_cmp_ps(yzSqr, vRadiusSqr, _CMP_LE_OQ));
+            if (0 == _mm256_movemask_ps(rowMask)) continue;
+            __m256i rowOffset = _mm256_mullo_epi32(vi, vSizeX);
+            for (int dj = 0; dj < window; dj++) {
+                __m256i vj = _mm256_add_epi32(minX, _mm256_set1_epi32(dj));
+                __m256 mask = _mm256_andnot_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(vj, maxX)), rowMask);
+                __m256 dx = _mm256_sub_ps(px, _mm256_cvtepi32_ps(vj));
+                __m256 distanceSqr = _mm256_fmadd_ps(dx, dx, yzSqr);
+                mask = _mm256_and_ps(mask, _mm256_cmp_ps(distanceSqr, vRadiusSqr, _CMP_LE_OQ));
+                if (0 == _mm256_movemask_ps(mask)) continue;
+                touched = _mm256_or_ps(touched, mask);
+
+                // masked lanes are not read and contribute with zero weight
+                __m256i aux = _mm256_cvttps_epi32(_mm256_fmadd_ps(distanceSqr, vIDeltaSqrt, vHalf));
+                __m256 wBlob = _mm256_mask_i32gather_ps(vZero, p.blobTableSqrt, aux, mask, 4);
+                __m256i pixel = _mm256_mullo_epi32(_mm256_add_epi32(rowOffset, vj), vStride);
+                __m256 re = _mm256_mask_i32gather_ps(vZero, p.pixels, pixel, mask, 4);
+                __m256 im = _mm256_mask_i32gather_ps(vZero, p.pixels + 1, pixel, mask, 4);
+                __m256 weight = _mm256_mul_ps(wBlob, vWeight);
+                __m256 valWeight = weight;
+                if (p.hasCTF) {
+                    __m256 wCTF = _mm256_mask_i32gather_ps(vZero, p.pixels + 2, pixel, mask, 4);
+                    __m256 wModulator = _mm256_mask_i32gather_ps(vZero, p.pixels + 3, pixel, mask, 4);
+                    weight = _mm256_mul_ps(weight, wModulator);
+                    valWeight = _mm256_mul_ps(weight, wCTF);
+                }
+                accWeight = _mm256_add_ps(accWeight, weight);
+                accRe = _mm256_fmadd_ps(re, valWeight, accRe);
+                accIm = _mm256_fmadd_ps(im, valWeight, accIm);
+            }
+        }
+
+        int touchedLanes = _mm256_movemask_ps(touched);
+        if (0 == touchedLanes) continue;
+        alignas(32) float resWeight[8];
+        alignas(32) float resRe[8];
+        alignas(32) float resIm[8];
+        _mm256_store_ps(resWeight, accWeight);
+        _mm256_store_ps(resRe, accRe);
+        _mm256_store_ps(resIm, accIm);
+        for (int l = 0; l < 8; l++) {
+            if (touchedLanes & (1 << l)) {
+                store(x0 + l, resWeight[l], resRe[l], resIm[l]);
+            }
+        }
+    }
+}
+#endif
+//@}
+#endif /* RECONSTRUCT_FOURIER_BLOB_AVX2_H_ */
@@ -26,6 +26,9 @@
 #include "reconstruct_significant.h"
 #include <algorithm>
 #include "core/metadata_sql.h"
+#include "core/transformations.h"
+#include "data/mask.h"
+#include "symmetrize.h"
 
 // Define params
 ProgReconstructSignificant::ProgReconstructSignificant()
@@ -518,6 +521,7 @@ void ProgReconstructSignificant::run()
 					mdAux.importObjects(mdReconstruction,MDValueGT(MDL_WEIGHT,0.0));
 
 				String fnAngles=formatString("%s/angles_iter%03d_%02d.xmd",fnDir.c_str(),iter,nVolume);
+				mdAngles[nVolume]=mdAux;
 				if (mdAux.size()>0)
 					mdAux.write(fnAngles);
 				else
@@ -526,37 +530,22 @@ void ProgReconstructSignificant::run()
 					emptyVolumes=true;
 				}
 
-				MetaData &mdPM=mdReconstructionProjectionMatching[nVolume];
-				if (mdPM.size()>0 && fileExists(fnAngles.c_str()))
+				MetaDataDb &mdPM=mdReconstructionProjectionMatching[nVolume];
+				if (mdPM.size()>0 && mdAux.size()>0)
 				{
 					String fnImages=formatString("%s/images_iter%03d_%02d.xmd",fnDir.c_str(),iter,nVolume);
 					mdPM.write(fnImages);
 
 					// Remove from mdPM those images that do not participate in angles
-					String fnAux=formatString("%s/aux_iter%03d_%02d.xmd",fnDir.c_str(),iter,nVolume);
-					// Take only the image name from angles.xmd
-					String cmd=(String)"xmipp_metadata_utilities -i "+fnAngles+" --operate keep_column image -o "+fnAux;
-					if (system(cmd.c_str())!=0)
-						REPORT_ERROR(ERR_MD,(String)"Cannot execute "+cmd);
-					// Remove duplicated images
-					cmd=(String)"xmipp_metadata_utilities -i "+fnAux+" --operate remove_duplicates image";
-					if (system(cmd.c_str())!=0)
-						REPORT_ERROR(ERR_MD,(String)"Cannot execute "+cmd);
-					// Intersect with images.xmd
+					MetaDataDb mdImagesSignificant(mdPM);
+					mdImagesSignificant.intersection(MetaDataDb(mdAux),MDL_IMAGE);
 					String fnImagesSignificant=formatString("%s/images_significant_iter%03d_%02d.xmd",fnDir.c_str(),iter,nVolume);
-					cmd=(String)"xmipp_metadata_utilities -i "+fnImages+" --set intersection "+fnAux+" image image -o "+fnImagesSignificant;
-					if (system(cmd.c_str())!=0)
-						REPORT_ERROR(ERR_MD,(String)"Cannot execute "+cmd);
-					deleteFile(fnAux);
+					mdImagesSignificant.write(fnImagesSignificant);
 				}
 				else
 					std::cout << formatString("%s/images_iter%03d_%02d.xmd empty. Not written.",fnDir.c_str(),iter,nVolume) << std::endl;
-				deleteFile(formatString("%s/gallery_iter%03d_%02d_sampling.xmd",fnDir.c_str(),iter,nVolume));
-				deleteFile(formatString("%s/gallery_iter%03d_%02d.doc",fnDir.c_str(),iter,nVolume));
-				deleteFile(formatString("%s/gallery_iter%03d_%02d.stk",fnDir.c_str(),iter,nVolume));
 				if (iter>=1 && !keepIntermediateVolumes)
 				{
-					deleteFile(formatString("%s/volume_iter%03d_%02d.vol",fnDir.c_str(),iter-1,nVolume));
 					deleteFile(formatString("%s/images_iter%03d_%02d.xmd",fnDir.c_str(),iter-1,nVolume));
 					deleteFile(formatString("%s/angles_iter%03d_%02d.xmd",fnDir.c_str(),iter-1,nVolume));
 					deleteFile(formatString("%s/images_significant_iter%03d_%02d.xmd",fnDir.c_str(),iter-1,nVolume));
@@ -579,6 +568,10 @@ void ProgReconstructSignificant::run()
     	else
     		break;
 
+    	// Volumes are kept in memory, only the last ones are written unless asked
+    	if (rank==0 && (keepIntermediateVolumes || iter==Niter || emptyVolumes))
+    		writeCurrentVolumes();
+
     	currentAlpha+=deltaAlpha;
 
     	if (emptyVolumes)
@@ -590,67 +583,87 @@ void ProgReconstructSignificant::reconstructCurrent()
 {
 	if (rank==0)
 		std::cerr << "Reconstructing volumes ..." << std::endl;
-	MetaDataVec MD;
+	MultidimArray<int> mask;
 	for (size_t nVolume=0; nVolume<(size_t)Nvolumes; ++nVolume)
 	{
 		if ((nVolume+1)%Nprocessors!=rank)
 			continue;
 
-		FileName fnAngles=formatString("%s/angles_iter%03d_%02d.xmd",fnDir.c_str(),iter,nVolume);
-		if (!fnAngles.exists())
+		// The master has the angles in memory, the rest of nodes read them
+		MetaDataVec &MD=mdAngles[nVolume];
+		if (rank!=0)
+		{
+			FileName fnAngles=formatString("%s/angles_iter%03d_%02d.xmd",fnDir.c_str(),iter,nVolume);
+			MD.clear();
+			if (fnAngles.exists())
+				MD.read(fnAngles);
+		}
+		if (MD.size()==0)
 			continue;
-		MD.read(fnAngles);
 		std::cout << "Volume " << nVolume << ": number of images=" << MD.size() << std::endl;
-		FileName fnVolume=formatString("%s/volume_iter%03d_%02d.vol",fnDir.c_str(),iter,nVolume);
-		String args=formatString("-i %s -o %s --sym %s --weight -v 0",fnAngles.c_str(),fnVolume.c_str(),fnSym.c_str());
-		String cmd=(String)"xmipp_reconstruct_fourier "+args;
-		std::cout << cmd << std::endl;
-		if (system(cmd.c_str())==-1)
-			REPORT_ERROR(ERR_UNCLASSIFIED,"Cannot open shell");
 
+		Image<double> &V=currentVolumes[nVolume];
+		reconstructVolume(MD,true,V);
 		if (fnSym!="c1")
-		{
-			args=formatString("-i %s --sym %s -v 0",fnVolume.c_str(),fnSym.c_str());
-			cmd=(String)"xmipp_transform_symmetrize "+args;
-			std::cout << cmd << std::endl;
-			if (system(cmd.c_str())==-1)
-				REPORT_ERROR(ERR_UNCLASSIFIED,"Cannot open shell");
-		}
+			applySymmetry(fnSym,xmipp_transformation::BSPLINE3,V);
 
-		args=formatString("-i %s --mask circular %d -v 0",fnVolume.c_str(),-Xdim/2);
-		cmd=(String)"xmipp_transform_mask "+args;
-		std::cout << cmd << std::endl;
-		if (system(cmd.c_str())==-1)
-			REPORT_ERROR(ERR_UNCLASSIFIED,"Cannot open shell");
+		// Same as xmipp_transform_mask --mask circular -Xdim/2
+		mask.resizeNoCopy(V());
+		mask.setXmippOrigin();
+		BinaryCircularMask(mask,Xdim/2,INNER_MASK);
+		apply_binary_mask(mask,V(),V(),0.0);
 	}
+
+	// All nodes need all volumes to generate the galleries
+	for (size_t nVolume=0; nVolume<(size_t)Nvolumes; ++nVolume)
+		shareVolume(currentVolumes[nVolume](),(nVolume+1)%Nprocessors);
 }
 
-void ProgReconstructSignificant::generateProjections()
+void ProgReconstructSignificant::reconstructVolume(const MetaDataVec &mdAngles, bool useWeights, Image<double> &V)
 {
-	FileName fnGallery, fnGalleryMetaData;
-	if (iter>1 || fnFirstGallery=="")
-	{
-		FileName fnVol, fnAngles;
-		// Generate projections
-		for (int n=0; n<Nvolumes; n++)
-		{
-			if ((n+1)%Nprocessors!=rank)
-				continue;
-			fnVol=formatString("%s/volume_iter%03d_%02d.vol",fnDir.c_str(),iter-1,n);
-			fnGallery=formatString("%s/gallery_iter%03d_%02d.stk",fnDir.c_str(),iter,n);
-			fnAngles=formatString("%s/angles_iter%03d_%02d.xmd",fnDir.c_str(),iter-1,n);
-			fnGalleryMetaData=formatString("%s/gallery_iter%03d_%02d.doc",fnDir.c_str(),iter,n);
-			String args=formatString("-i %s -o %s --sampling_rate %f --sym %s --compute_neighbors --angular_distance -1 --experimental_images %s --min_tilt_angle %f --max_tilt_angle %f -v 0",
-					fnVol.c_str(),fnGallery.c_str(),angularSampling,fnSym.c_str(),fnAngles.c_str(),tilt0,tiltF);
-
-			String cmd=(String)"xmipp_angular_project_library "+args;
-			if (system(cmd.c_str())==-1)
-				REPORT_ERROR(ERR_UNCLASSIFIED,"Cannot open shell");
-		}
-		synchronize();
-	}
+	ProgRecFourier progRec;
+	String args=formatString("-i angles.xmd --sym %s -v 0",fnSym.c_str());
+	if (useWeights)
+		args+=" --weight";
+	progRec.read(args);
+	progRec.setIO("","");
+	progRec.SF=mdAngles;
+	progRec.run();
+	V()=progRec.Vout();
+	V().setXmippOrigin();
+}
+
+void ProgReconstructSignificant::applySymmetry(const FileName &fnSymmetry, int splineOrder, Image<double> &V)
+{
+	SymList SL;
+	SL.readSymmetryFile(fnSymmetry);
+	MultidimArray<double> Vsym;
+	Vsym.resizeNoCopy(V());
+	symmetrizeVolume(SL,V(),Vsym,splineOrder);
+	V()=Vsym;
+}
+
+void ProgReconstructSignificant::computeGalleryDirections()
+{
+	// Same directions as xmipp_angular_project_library
+	Sampling mysampling;
+	mysampling.verbose=0;
+	mysampling.setSampling(angularSampling);
+	int symmetry, sym_order;
+	if (!mysampling.SL.isSymmetryGroup(fnSym, symmetry, sym_order))
+		REPORT_ERROR(ERR_VALUE_INCORRECT,(String)"Invalid symmetry "+fnSym);
+	mysampling.computeSamplingPoints(false,tiltF,tilt0);
+	mysampling.SL.readSymmetryFile(fnSym);
+	mysampling.fillLRRepository();
+	mysampling.removeRedundantPoints(symmetry, sym_order);
+	galleryDirections=mysampling.no_redundant_sampling_points_angles;
+	if (galleryDirections.empty())
+		REPORT_ERROR(ERR_VALUE_INCORRECT,"There are no projections within the specified angular range and sampling");
+}
 
-	// Read projection galleries
+void ProgReconstructSignificant::generateProjections()
+{
+	// Read or project galleries
 	std::vector<GalleryImage> galleryNames;
 	mdGallery.clear();
 
@@ -662,25 +675,45 @@ void ProgReconstructSignificant::generateProjections()
 		mdGallery.push_back(galleryNames);
 		if (iter>1 || fnFirstGallery=="")
 		{
-			fnGalleryMetaData=formatString("%s/gallery_iter%03d_%02d.doc",fnDir.c_str(),iter,n);
-			fnGallery=formatString("%s/gallery_iter%03d_%02d.stk",fnDir.c_str(),iter,n);
+			// Project the current volume in memory (Fourier, no padding, maxfreq=0.25, B-splines)
+			MultidimArray<double> &mV=currentVolumes[n]();
+			mV.setXmippOrigin();
+			FourierProjector projector(mV,1,0.25,xmipp_transformation::BSPLINE3);
+			size_t Ndirs=galleryDirections.size();
+			MultidimArray<double> &mGallery=gallery[n]();
+			FileName fnGallery=formatString("%s/gallery_iter%03d_%02d.stk",fnDir.c_str(),iter,n);
+			std::vector<double> rot(Ndirs), tilt(Ndirs), psi(Ndirs);
+			for (size_t k=0; k<Ndirs; ++k)
+			{
+				const Matrix1D<double> &angles=galleryDirections[k];
+				rot[k]=XX(angles);
+				tilt[k]=YY(angles);
+				psi[k]=ZZ(angles);
+			}
+			projector.projectBatch(rot,tilt,psi,mGallery);
+			for (size_t k=0; k<Ndirs; ++k)
+			{
+				const Matrix1D<double> &angles=galleryDirections[k];
+				GalleryImage I;
+				I.fnImg.compose(k+1,fnGallery);
+				I.rot=XX(angles);
+				I.tilt=YY(angles);
+				mdGallery[n].push_back(I);
+			}
 		}
 		else
 		{
-			fnGalleryMetaData=fnFirstGallery;
-			fnGallery=fnFirstGallery.replaceExtension("stk");
-		}
-		MetaDataVec mdAux(fnGalleryMetaData);
-		galleryNames.clear();
-		for (size_t objId : mdAux.ids())
-		{
-			GalleryImage I;
-			mdAux.getValue(MDL_IMAGE,I.fnImg,objId);
-			mdAux.getValue(MDL_ANGLE_ROT,I.rot,objId);
-			mdAux.getValue(MDL_ANGLE_TILT,I.tilt,objId);
-			mdGallery[n].push_back(I);
+			MetaDataVec mdAux(fnFirstGallery);
+			for (size_t objId : mdAux.ids())
+			{
+				GalleryImage I;
+				mdAux.getValue(MDL_IMAGE,I.fnImg,objId);
+				mdAux.getValue(MDL_ANGLE_ROT,I.rot,objId);
+				mdAux.getValue(MDL_ANGLE_TILT,I.tilt,objId);
+				mdGallery[n].push_back(I);
+			}
+			gallery[n].read(fnFirstGallery.replaceExtension("stk"));
 		}
-		gallery[n].read(fnGallery);
 
 		// Calculate transforms of this gallery
 		size_t kmax=NSIZE(gallery[n]());
@@ -701,6 +734,13 @@ void ProgReconstructSignificant::generateProjections()
 	}
 }
 
+void ProgReconstructSignificant::writeCurrentVolumes()
+{
+	for (size_t nVolume=0; nVolume<(size_t)Nvolumes; ++nVolume)
+		if (iter==0 || mdAngles[nVolume].size()>0)
+			currentVolumes[nVolume].write(formatString("%s/volume_iter%03d_%02d.vol",fnDir.c_str(),iter,nVolume));
+}
+
 void ProgReconstructSignificant::numberOfProjections()
 {
 
@@ -764,17 +804,15 @@ void ProgReconstructSignificant::produceSideinfo()
 		if (alpha0>1)
 			REPORT_ERROR(ERR_ARG_INCORRECT,"Alpha values are too large: reduce the error such that the error times the symmetry number is smaller than 1");
 	}
-	// If there is not any input volume, create a random one
+	// Initial volumes are kept in memory
+	Image<double> V;
 	if (fnFirstGallery=="")
 	{
-		bool deleteInit=false;
 		if (fnInit=="")
 		{
-			deleteInit=true;
-			MetaDataVec mdAux;
+			// If there is not any input volume, create a random one
 			for (int n=0; n<Nvolumes; ++n)
 			{
-				fnInit=fnDir+"/volume_random.xmd";
 				if (rank==0)
 				{
 					MetaDataVec mdRandom;
@@ -787,74 +825,51 @@ void ProgReconstructSignificant::produceSideinfo()
 						mdRandom.setValue(MDL_SHIFT_X,0.0,objId);
 						mdRandom.setValue(MDL_SHIFT_Y,0.0,objId);
 					}
-					FileName fnAngles=fnDir+formatString("/angles_random_%02d.xmd",n);
-					FileName fnVolume=fnDir+formatString("/volume_random_%02d.vol",n);
-					mdRandom.write(fnAngles);
-					String args=formatString("-i %s -o %s --sym %s -v 0",fnAngles.c_str(),fnVolume.c_str(),fnSym.c_str());
-					String cmd=(String)"xmipp_reconstruct_fourier "+args;
-					if (system(cmd.c_str())==-1)
-						REPORT_ERROR(ERR_UNCLASSIFIED,"Cannot open shell");
-					if (!keepIntermediateVolumes)
-						deleteFile(fnAngles);
+					reconstructVolume(mdRandom,false,V);
 
 					// Symmetrize with many different possibilities to have a spherical volume
-					args=formatString("-i %s --sym i1 --spline 1 -v 0",fnVolume.c_str());
-					cmd=(String)"xmipp_transform_symmetrize "+args;
-					if (system(cmd.c_str())==-1)
-						REPORT_ERROR(ERR_UNCLASSIFIED,"Cannot open shell");
-
-					args=formatString("-i %s --sym i3 --spline 1 -v 0",fnVolume.c_str());
-					if (system(cmd.c_str())==-1)
-						REPORT_ERROR(ERR_UNCLASSIFIED,"Cannot open shell");
-
-					args=formatString("-i %s --sym i2 --spline 1 -v 0",fnVolume.c_str());
-					if (system(cmd.c_str())==-1)
-						REPORT_ERROR(ERR_UNCLASSIFIED,"Cannot open shell");
-					deleteFile(fnAngles);
-					mdAux.setValue(MDL_IMAGE,fnVolume,mdAux.addObject());
+					applySymmetry("i1",xmipp_transformation::LINEAR,V);
+					applySymmetry("i3",xmipp_transformation::LINEAR,V);
+					applySymmetry("i2",xmipp_transformation::LINEAR,V);
+					if (keepIntermediateVolumes)
+						V.write(fnDir+formatString("/volume_random_%02d.vol",n));
 				}
+				currentVolumes.push_back(V);
+				shareVolume(currentVolumes[n](),0);
 			}
-			if (rank==0)
-				mdAux.write(fnInit);
-			synchronize();
 		}
-
-		// Copy all input values as iteration 0 volumes
-		MetaDataVec mdInit;
-		mdInit.read(fnInit);
-		FileName fnVol;
-		Image<double> V;
-		int idx=0;
-		for (size_t objId : mdInit.ids())
+		else
 		{
-			if (rank==0)
+			// Take all input volumes as iteration 0 volumes
+			MetaDataVec mdInit;
+			mdInit.read(fnInit);
+			FileName fnVol;
+			for (size_t objId : mdInit.ids())
 			{
 				mdInit.getValue(MDL_IMAGE,fnVol,objId);
 				V.read(fnVol);
-				fnVol=formatString("%s/volume_iter000_%02d.vol",fnDir.c_str(),idx);
-				V.write(fnVol);
-				mdInit.setValue(MDL_IMAGE,fnVol,objId);
+				V().setXmippOrigin();
+				currentVolumes.push_back(V);
 			}
-			idx++;
+			Nvolumes=(int)mdInit.size();
 		}
-		Nvolumes=(int)mdInit.size();
-
-		iter=0;
-		synchronize();
-		if (deleteInit && rank==0)
-			deleteFile(fnInit);
 	}
 	else
 		Nvolumes=1;
+	currentVolumes.resize(Nvolumes);
+	computeGalleryDirections();
+	iter=0;
+	if (rank==0 && keepIntermediateVolumes && fnFirstGallery=="")
+		writeCurrentVolumes();
 	synchronize();
 
-	// Copy all input values as iteration 0 volumes
+	// Copy all input values as iteration 0 angles
 	FileName fnAngles;
 	Image<double> galleryDummy;
 	MetaDataDb mdPartial, mdProjMatch;
 	for (int idx=0; idx<Nvolumes; ++idx)
 	{
-		if (rank==0)
+		if (rank==0 && keepIntermediateVolumes)
 		{
 			fnAngles=formatString("%s/angles_iter000_%02d.xmd",fnDir.c_str(),idx);
 			mdIn.write(fnAngles);
@@ -863,6 +878,7 @@ void ProgReconstructSignificant::produceSideinfo()
 		galleryTransforms.push_back(nullptr);
 		mdReconstructionPartial.push_back(mdPartial);
 		mdReconstructionProjectionMatching.push_back(mdProjMatch);
+		mdAngles.push_back(MetaDataVec());
 	}
 
 	iter=0;
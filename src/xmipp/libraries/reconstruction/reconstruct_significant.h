@@ -127,6 +127,15 @@ public: // Internal members
     std::vector< Image<double> > gallery;
     std::vector< AlignmentTransforms* > galleryTransforms;
 
+    // Projection directions (rot, tilt, psi) of the galleries
+    std::vector< Matrix1D<double> > galleryDirections;
+
+    // Current volumes
+    std::vector< Image<double> > currentVolumes;
+
+    // Angular assignment of each volume in the current iteration
+    std::vector< MetaDataVec > mdAngles;
+
 	// Current iteration
 	int iter;
 
@@ -154,9 +163,22 @@ public:
     /// Reconstruct current volume
     void reconstructCurrent();
 
+    /** Reconstruct a volume from a set of angles.
+        The reconstruction is done in memory, nothing is written to disk. */
+    void reconstructVolume(const MetaDataVec &mdAngles, bool useWeights, Image<double> &V);
+
+    /// Symmetrize a volume in memory
+    void applySymmetry(const FileName &fnSymmetry, int splineOrder, Image<double> &V);
+
+    /// Compute the projection directions of the galleries
+    void computeGalleryDirections();
+
     /// Generate projections from the current volume
     void generateProjections();
 
+    /// Write the current volumes of this iteration
+    void writeCurrentVolumes();
+
     ///
     void numberOfProjections();
 
@@ -168,6 +190,9 @@ public:
 
     /// Synchronize with other processors
     virtual void synchronize() {}
+
+    /// Send a volume from the processor that computed it to all the others
+    virtual void shareVolume(MultidimArray<double> &V, size_t root) {}
 };
 //@}
 #endif
@@ -23,11 +23,16 @@
  *  e-mail address 'xmipp@cnb.csic.es'
  ***************************************************************************/
 
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <future>
 #include "reconstruct_wbp.h"
 #include "core/geometry.h"
 #include "core/metadata_extension.h"
 #include "core/metadata_sql.h"
 #include "core/xmipp_fft.h"
+#include "data/fftwT.h"
 #include "data/fourier_projection.h"
 #include "data/mask.h"
 #include "directions.h"
@@ -46,6 +51,8 @@ void ProgRecWbp::readParams()
     sampling = getDoubleParam("--filsam");
     do_all_matrices = checkParam("--use_each_image");
     do_weights = checkParam("--weight");
+    groupFilters = checkParam("--group_filters");
+    nThreads = XMIPP_MAX(1, getIntParam("--thr"));
 }
 
 // Show ====================================================================
@@ -77,9 +84,13 @@ void ProgRecWbp::show()
         else
             std::cerr << " --> Use sampled directions for filter, sampling = "
             << sampling << std::endl;
+        if (groupFilters)
+            std::cerr << " --> Share the filter among the images of each sampled direction"
+            << std::endl;
         if (do_weights)
             std::cerr << " --> Use weights stored in the image headers"
             << std::endl;
+        std::cerr << " Threads                   : " << nThreads << std::endl;
         std::cerr
         << " -----------------------------------------------------------------"
         << std::endl;
@@ -154,8 +165,20 @@ void ProgRecWbp::defineParams()
         "                               :+large datasets this may be considerably slower than the default ");
     addParamsLine(
         "                               :+option of using representative projection directions");
+    addParamsLine(
+        " [ --group_filters+]           : Share the filter among the images of similar orientation ");
+    addParamsLine(
+        "                               :+The filter is computed once for each direction sampled every filsam degrees ");
+    addParamsLine(
+        "                               :+without its in-plane angle, and it is rotated with bilinear interpolation for ");
+    addParamsLine(
+        "                               :+each image. This is faster for large datasets, but approximate. By default, ");
+    addParamsLine(
+        "                               :+the exact filter of each image orientation is used.");
     addParamsLine(
         " [ --weight]                   : Use weights stored in image headers or the input metadata");
+    addParamsLine(
+        " [ --thr <N=1>]                : Number of threads");
     addExampleLine("xmipp_reconstruct_wbp -i images.sel -o reconstruction.vol");
 }
 
@@ -208,6 +231,8 @@ void ProgRecWbp::produceSideInfo()
         getAllMatrices(SF);
     else
         getSampledMatrices(SF);
+    if (groupFilters)
+        groupImagesByFilter();
 
     time_bar_size = SF.size();
     time_bar_step = CEIL((double)time_bar_size / 60.0);
@@ -304,6 +329,45 @@ void ProgRecWbp::getSampledMatrices(MetaData &SF)
     threshold *= totimgs;
 }
 
+void ProgRecWbp::groupImagesByFilter()
+{
+    // The groups do not use the symmetry, so that the shared filter is
+    // exact for the images in the sampled directions
+    SymList noSymmetry;
+    Matrix2D<double> L(4, 4), R(4, 4);
+    double rot, tilt, psi, dum, weight;
+    bool dumB;
+    make_even_distribution(groupPsi, groupTilt, sampling, noSymmetry, true);
+    for (size_t objId : SF.ids())
+    {
+        getAnglesForImage(objId, rot, tilt, psi, dum, dum, dumB, weight);
+        int group = find_nearest_direction(psi, tilt, groupPsi, groupTilt, noSymmetry, L, R);
+        SF.setValue(MDL_REF, group, objId);
+    }
+    MetaDataVec SFsorted;
+    SFsorted.sort(SF, MDL_REF);
+    SF = SFsorted;
+}
+
+void ProgRecWbp::getFilterDirections(double rot, double tilt, double psi,
+                                     std::vector<WBPInfo> &matf) const
+{
+    Matrix2D<double> A(3, 3);
+    Euler_angles2matrix(-rot, tilt, -psi, A);
+    double a00 = MAT_ELEM(A,0,0);
+    double a01 = MAT_ELEM(A,0,1);
+    double a10 = MAT_ELEM(A,1,0);
+    double a11 = MAT_ELEM(A,1,1);
+    double a20 = MAT_ELEM(A,2,0);
+    double a21 = MAT_ELEM(A,2,1);
+    matf.resize(no_mats);
+    for (int k = 0; k < no_mats; k++)
+    {
+        matf[k].x = a00 * mat_g[k].x + a10 * mat_g[k].y + a20 * mat_g[k].z;
+        matf[k].y = a01 * mat_g[k].x + a11 * mat_g[k].y + a21 * mat_g[k].z;
+    }
+}
+
 // Fill array with transformation matrices needed for arbitrary geometry filter
 void ProgRecWbp::getAllMatrices(MetaData &SF)
 {
@@ -360,7 +424,8 @@ void ProgRecWbp::getAllMatrices(MetaData &SF)
 
 // Simple backprojection of a single image
 void ProgRecWbp::simpleBackprojection(Projection &img,
-                                      MultidimArray<double> &vol, int diameter)
+                                      MultidimArray<double> &vol, int diameter,
+                                      int zFirst, int zLast)
 {
 	//this should be int not size_t ROB
     int i, j, k, l, m;
@@ -384,10 +449,12 @@ void ProgRecWbp::simpleBackprojection(Projection &img,
     double a21 = MAT_ELEM(A,2,1);
 
     double dim1 = dim - 1;
-    const MultidimArray<double> mImg = img();
+    const MultidimArray<double> &mImg = img();
     int idim;
     idim = dim;//cast to int from size_t
-    for (i = 0; i < idim; i++)
+    if (zLast < 0 || zLast >= idim)
+        zLast = idim - 1;
+    for (i = zFirst; i <= zLast; i++)
     {
         z = -i + dim2; /*** Z points upwards ***/
         z2 = z * z;
@@ -509,17 +576,278 @@ bool ProgRecWbp::getImageToProcess(size_t &objId)
 
 void ProgRecWbp::showProgress()
 {
-    if (verbose > 0 && time_bar_done % time_bar_step == 0)
+    // Called once per batch of nThreads images
+    if (verbose > 0 && time_bar_done % time_bar_step < (size_t)nThreads)
         progress_bar(time_bar_done);
 }
 
+// Wait for all the tasks and rethrow the first error
+static void waitTasks(std::vector<std::future<void> > &futures)
+{
+    std::exception_ptr error;
+    for (auto &f : futures)
+        try
+        {
+            f.get();
+        }
+        catch (...)
+        {
+            if (!error)
+                error = std::current_exception();
+        }
+    futures.clear();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+// Filter a batch of images ==================================================
+void ProgRecWbp::filterBatch(std::vector<Projection> &batch, size_t n, Tabsinc &TSINC,
+                             ctpl::thread_pool &pool)
+{
+    size_t imgSize = dim * dim;
+    std::vector<std::future<void> > futures;
+
+    // Apply the geometry and weight of each image and copy it to the batch
+    for (size_t b = 0; b < n; b++)
+        futures.emplace_back(pool.push([&, b](int)
+        {
+            Projection &proj = batch[b];
+            Matrix2D<double> A;
+            proj.getTransformationMatrix(A, true);
+            if (!A.isIdentity())
+                selfApplyGeometry(xmipp_transformation::BSPLINE3, proj(), A, xmipp_transformation::IS_INV, xmipp_transformation::WRAP);
+            if (do_weights)
+                proj() *= proj.weight();
+            proj().setXmippOrigin();
+            if (MULTIDIM_SIZE(proj()) != imgSize)
+                REPORT_ERROR(ERR_MULTIDIM_SIZE, "ProgRecWbp: all the images must have the same size");
+            memcpy(batchImages + b * imgSize, MULTIDIM_ARRAY(proj()), imgSize * sizeof(double));
+        }));
+    waitTasks(futures);
+    FFTwT<double>::fft(forwardPlan, batchImages, batchFourier);
+
+    if (groupFilters)
+        applyGroupFilters(batch, n, TSINC, pool);
+    else
+        applyExactFilters(batch, n, TSINC, pool);
+
+    // Back to real space
+    FFTwT<double>::ifft(backwardPlan, batchFourier, batchImages);
+    for (size_t b = 0; b < n; b++)
+        memcpy(MULTIDIM_ARRAY(batch[b]()), batchImages + b * imgSize, imgSize * sizeof(double));
+}
+
+// Apply the exact filter of each image =====================================
+void ProgRecWbp::applyExactFilters(std::vector<Projection> &batch, size_t n, Tabsinc &TSINC,
+                                   ctpl::thread_pool &pool)
+{
+    int idim = dim;
+    size_t imgSize = dim * dim;
+    size_t xdimF = dim / 2 + 1;
+    size_t fourierSize = dim * xdimF;
+    std::vector<std::future<void> > futures;
+
+    // Projections with the same orientation share the filter
+    std::vector<size_t> group(n);
+    std::vector<size_t> leaders;
+    for (size_t b = 0; b < n; b++)
+    {
+        group[b] = b;
+        for (size_t l : leaders)
+            if (batch[l].rot() == batch[b].rot() && batch[l].tilt() == batch[b].tilt() &&
+                batch[l].psi() == batch[b].psi())
+            {
+                group[b] = l;
+                break;
+            }
+        if (group[b] == b)
+            leaders.push_back(b);
+    }
+
+    // Compute the filters by blocks of rows and apply them to the half
+    // transforms. As the filter is symmetric, this is the same as filtering
+    // the whole transform. FFTW transforms are not normalized.
+    double factor = diameter;
+    double K = ((double) diameter) / dim;
+    double norm = 1. / imgSize;
+    int rowsPerTask = XMIPP_MAX(1, idim / (4 * nThreads));
+    int tasksPerFilter = (idim + rowsPerTask - 1) / rowsPerTask;
+    std::vector<size_t> counts(leaders.size() * tasksPerFilter, 0);
+    for (size_t il = 0; il < leaders.size(); il++)
+        for (int t = 0; t < tasksPerFilter; t++)
+            futures.emplace_back(pool.push([&, il, t](int)
+            {
+                size_t l = leaders[il];
+                std::vector<WBPInfo> matf;
+                getFilterDirections(batch[l].rot(), batch[l].tilt(), batch[l].psi(), matf);
+                std::vector<std::complex<double> *> members;
+                for (size_t b = 0; b < n; b++)
+                    if (group[b] == l)
+                        members.push_back(batchFourier + b * fourierSize);
+
+                size_t count = 0;
+                int rFirst = t * rowsPerTask;
+                int rLast = XMIPP_MIN(idim, rFirst + rowsPerTask);
+                for (int r = rFirst; r < rLast; r++)
+                {
+                    double y = K * ((r <= (idim - 1) / 2) ? r : r - idim);
+                    for (int c = 0; c < (int)xdimF; c++)
+                    {
+                        double x = K * ((c <= (idim - 1) / 2) ? c : c - idim);
+                        double weight = 0.;
+                        for (int k = 0; k < no_mats; k++)
+                        {
+                            double argum = x * matf[k].x + y * matf[k].y;
+                            double daux;
+                            TSINCVALUE(TSINC, argum, daux);
+                            weight += mat_g[k].count * daux;
+                        }
+
+                        double scale;
+                        if (fabs(weight) < threshold)
+                        {
+                            // Pixels of the whole transform represented by this one
+                            count += (c == 0 || 2 * c == idim) ? 1 : 2;
+                            scale = norm / (SGN(weight) * (threshold * factor));
+                        }
+                        else
+                            scale = norm / (weight * factor);
+                        for (auto *ptr : members)
+                            ptr[r * xdimF + c] *= scale;
+                    }
+                }
+                counts[il * tasksPerFilter + t] = count * members.size();
+            }));
+    waitTasks(futures);
+    for (size_t count : counts)
+        count_thr += count;
+}
+
+// Apply the shared filters of the groups ====================================
+void ProgRecWbp::applyGroupFilters(std::vector<Projection> &batch, size_t n, Tabsinc &TSINC,
+                                   ctpl::thread_pool &pool)
+{
+    int idim = dim;
+    size_t xdimF = dim / 2 + 1;
+    size_t fourierSize = dim * xdimF;
+    std::vector<std::future<void> > futures;
+    auto batchEnd = batchGroup.begin() + n;
+
+    // The images are sorted by group, so the filters that are not used by
+    // this batch are not needed any more
+    for (auto it = groupWeights.begin(); it != groupWeights.end();)
+        if (std::find(batchGroup.begin(), batchEnd, it->first) == batchEnd)
+            it = groupWeights.erase(it);
+        else
+            ++it;
+
+    // Compute the missing filters without the in-plane angle. The grid
+    // covers the frequencies of the corners of the transform rotated
+    int H = (int)ceil(idim / sqrt(2.)) + 1;
+    std::vector<int> missing;
+    for (size_t b = 0; b < n; b++)
+        if (groupWeights.find(batchGroup[b]) == groupWeights.end())
+        {
+            MultidimArray<double> &W = groupWeights[batchGroup[b]];
+            W.initZeros(2 * H + 1, 2 * H + 1);
+            W.setXmippOrigin();
+            missing.push_back(batchGroup[b]);
+        }
+    double K = ((double) diameter) / dim;
+    int rowsPerTask = XMIPP_MAX(1, (2 * H + 1) / (4 * nThreads));
+    for (int group : missing)
+        for (int rFirst = -H; rFirst <= H; rFirst += rowsPerTask)
+            futures.emplace_back(pool.push([&, group, rFirst](int)
+            {
+                MultidimArray<double> &W = groupWeights.at(group);
+                std::vector<WBPInfo> matf;
+                getFilterDirections(0., groupTilt[group], groupPsi[group], matf);
+                int rLast = XMIPP_MIN(H, rFirst + rowsPerTask - 1);
+                for (int i = rFirst; i <= rLast; i++)
+                    for (int j = -H; j <= H; j++)
+                    {
+                        double weight = 0.;
+                        for (int k = 0; k < no_mats; k++)
+                        {
+                            double argum = K * (j * matf[k].x + i * matf[k].y);
+                            double daux;
+                            TSINCVALUE(TSINC, argum, daux);
+                            weight += mat_g[k].count * daux;
+                        }
+                        A2D_ELEM(W, i, j) = weight;
+                    }
+            }));
+    waitTasks(futures);
+
+    // Apply the filters by blocks of rows, rotating the frequencies of each
+    // image by its in-plane angle. FFTW transforms are not normalized.
+    double factor = diameter;
+    double norm = 1. / (dim * dim);
+    rowsPerTask = XMIPP_MAX(1, idim / (4 * nThreads));
+    int tasksPerImage = (idim + rowsPerTask - 1) / rowsPerTask;
+    std::vector<size_t> counts(n * tasksPerImage, 0);
+    for (size_t b = 0; b < n; b++)
+        for (int t = 0; t < tasksPerImage; t++)
+            futures.emplace_back(pool.push([&, b, t](int)
+            {
+                const MultidimArray<double> &W = groupWeights.at(batchGroup[b]);
+                std::complex<double> *ptr = batchFourier + b * fourierSize;
+                double cosRot = cos(DEG2RAD(batch[b].rot()));
+                double sinRot = sin(DEG2RAD(batch[b].rot()));
+                size_t count = 0;
+                int rFirst = t * rowsPerTask;
+                int rLast = XMIPP_MIN(idim, rFirst + rowsPerTask);
+                for (int r = rFirst; r < rLast; r++)
+                {
+                    double y = (r <= (idim - 1) / 2) ? r : r - idim;
+                    for (int c = 0; c < (int)xdimF; c++)
+                    {
+                        double x = (c <= (idim - 1) / 2) ? c : c - idim;
+                        double weight = W.interpolatedElement2D(cosRot * x - sinRot * y,
+                                                                sinRot * x + cosRot * y);
+                        double scale;
+                        if (fabs(weight) < threshold)
+                        {
+                            // Pixels of the whole transform represented by this one
+                            count += (c == 0 || 2 * c == idim) ? 1 : 2;
+                            scale = norm / (SGN(weight) * (threshold * factor));
+                        }
+                        else
+                            scale = norm / (weight * factor);
+                        ptr[r * xdimF + c] *= scale;
+                    }
+                }
+                counts[b * tasksPerImage + t] = count;
+            }));
+    waitTasks(futures);
+    for (size_t count : counts)
+        count_thr += count;
+}
+
+// Back-project a batch of images ============================================
+void ProgRecWbp::backprojectBatch(std::vector<Projection> &batch, size_t n,
+                                  MultidimArray<double> &vol, ctpl::thread_pool &pool)
+{
+    // More slabs than threads, the central ones have more voxels inside the sphere
+    int idim = dim;
+    int nSlabs = XMIPP_MIN(idim, 4 * nThreads);
+    std::vector<std::future<void> > futures;
+    for (int s = 0; s < nSlabs; s++)
+        futures.emplace_back(pool.push([&, s](int)
+        {
+            int zFirst = s * idim / nSlabs;
+            int zLast = (s + 1) * idim / nSlabs - 1;
+            for (size_t b = 0; b < n; b++)
+                simpleBackprojection(batch[b], vol, diameter, zFirst, zLast);
+        }));
+    waitTasks(futures);
+}
+
 // Calculate the filter in 2D and apply ======================================
 void ProgRecWbp::apply2DFilterArbitraryGeometry()
 {
     double rot, tilt, psi, xoff, yoff, weight;
     bool flip;
-    Projection proj;
-    Matrix2D<double> L(4, 4), R(4, 4), A;
     FileName fn_img;
 
     MultidimArray<double> &mReconstructedVolume = reconstructedVolume();
@@ -537,32 +865,61 @@ void ProgRecWbp::apply2DFilterArbitraryGeometry()
     mat_f = (WBPInfo*) malloc(no_mats * sizeof(WBPInfo));
     Tabsinc TSINC(0.0001, dim);
 
+    // Batched Fourier transforms of one image per thread
+    FFTSettings<double> forward(dim, dim, 1, nThreads, nThreads, false, true);
+    FFTSettings<double> backward(dim, dim, 1, nThreads, nThreads, false, false);
+    batchImages = (double *)FFTwT<double>::allocateAligned(forward.sBytesBatch());
+    batchFourier = (std::complex<double> *)FFTwT<double>::allocateAligned(forward.fBytesBatch());
+    if (batchImages == nullptr || batchFourier == nullptr)
+        REPORT_ERROR(ERR_MEM_NOTENOUGH, "ProgRecWbp: cannot allocate the batch of images");
+    memset(batchImages, 0, forward.sBytesBatch());
+    forwardPlan = (void *)FFTwT<double>::createPlan(CPU(nThreads), forward, true);
+    backwardPlan = (void *)FFTwT<double>::createPlan(CPU(nThreads), backward, true);
+
+    ctpl::thread_pool pool(nThreads);
+    std::vector<Projection> batch(nThreads);
+    batchGroup.resize(nThreads);
     size_t objId;
-    while (getImageToProcess(objId))
+    bool more = true;
+    while (more)
     {
-        SF.getValue(MDL_IMAGE, fn_img, objId);
-        proj.read(fn_img, false);
-        getAnglesForImage(objId, rot, tilt, psi, xoff, yoff, flip, weight);
-        proj.setRot(rot);
-        proj.setTilt(tilt);
-        proj.setPsi(psi);
-        proj.setShifts(xoff, yoff);
-        proj.setFlip(flip);
-        proj.setWeight(weight);
-        proj.getTransformationMatrix(A, true);
-        if (!A.isIdentity())
-            selfApplyGeometry(xmipp_transformation::BSPLINE3, proj(), A, xmipp_transformation::IS_INV, xmipp_transformation::WRAP);
-        if (do_weights)
-            proj() *= proj.weight();
-        proj().setXmippOrigin();
-        filterOneImage(proj, TSINC);
-        simpleBackprojection(proj, mReconstructedVolume, diameter);
+        // Read the images of the batch
+        size_t n = 0;
+        while (n < batch.size() && (more = getImageToProcess(objId)))
+        {
+            Projection &proj = batch[n++];
+            SF.getValue(MDL_IMAGE, fn_img, objId);
+            proj.read(fn_img, false);
+            getAnglesForImage(objId, rot, tilt, psi, xoff, yoff, flip, weight);
+            proj.setRot(rot);
+            proj.setTilt(tilt);
+            proj.setPsi(psi);
+            proj.setShifts(xoff, yoff);
+            proj.setFlip(flip);
+            proj.setWeight(weight);
+            if (groupFilters)
+                SF.getValue(MDL_REF, batchGroup[n - 1], objId);
+        }
+        if (n == 0)
+            break;
+
+        filterBatch(batch, n, TSINC, pool);
+        backprojectBatch(batch, n, mReconstructedVolume, pool);
 
         showProgress();
     }
     if (verbose > 0)
         progress_bar(time_bar_size);
 
+    FFTwT<double>::release(forwardPlan);
+    FFTwT<double>::release(backwardPlan);
+    FFTwT<double>::release(batchImages);
+    FFTwT<double>::release(batchFourier);
+    forwardPlan = backwardPlan = nullptr;
+    batchImages = nullptr;
+    batchFourier = nullptr;
+    groupWeights.clear();
+
     // Symmetrize if necessary
     if (fn_sym != "")
     {
@@ -578,4 +935,3 @@ void ProgRecWbp::apply2DFilterArbitraryGeometry()
         mask_prm.apply_mask(mReconstructedVolume, mReconstructedVolume, 0.);
     }
 }
-
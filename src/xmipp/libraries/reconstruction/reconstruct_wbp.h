@@ -23,7 +23,11 @@
  *  e-mail address 'xmipp@cnb.csic.es'
  ***************************************************************************/
 
+#include <complex>
+#include <map>
 #include <memory>
+#include <vector>
+#include "CTPL/ctpl_stl.h"
 #include "core/symmetries.h"
 #include "core/xmipp_image.h"
 #include "core/metadata_vec.h"
@@ -72,6 +76,16 @@ public:
     bool do_all_matrices;
     /** Flag whether to use the weights in the image headers */
     bool do_weights;
+    /** Flag whether to share the filter among the images with similar orientation.
+        The filter is computed once for each sampled direction without its
+        in-plane angle and rotated for each image (see groupImagesByFilter) */
+    bool groupFilters = false;
+    /// Sampled directions of the shared filters (psi and tilt of the filter)
+    std::vector<double> groupPsi, groupTilt;
+    /// Shared filters (weights before the threshold) used by the current batch
+    std::map<int, MultidimArray<double> > groupWeights;
+    /// Group of each image of the batch
+    std::vector<int> batchGroup;
     /** Symmetry list for symmetric volumes */
     SymList SL;
     /// Time bar variables
@@ -80,6 +94,16 @@ public:
     std::unique_ptr<MetaDataVec::id_iterator> iter;
     /// Reconstructed volume
     Image<double> reconstructedVolume;
+    /** Number of threads.
+        Each batch has one image per thread. */
+    int nThreads = 1;
+    /// Images of the batch in real space (contiguous, for the batched FFTs)
+    double *batchImages = nullptr;
+    /// Fourier transforms of the images of the batch
+    std::complex<double> *batchFourier = nullptr;
+    /// Batched FFTW plans
+    void *forwardPlan = nullptr;
+    void *backwardPlan = nullptr;
 public:
 
     /// Read arguments from command line
@@ -120,14 +144,54 @@ public:
     /// evenly sampled projection directions
     void getSampledMatrices(MetaData &SF) ;
 
-    // Simple (i.e. unfiltered) backprojection of a single image
+    /** Assign each image to the sampled direction of its shared filter.
+        The filter applies Euler_angles2matrix(-rot, tilt, -psi) to the
+        frequencies of the image, so its in-plane angle is rot and its
+        orientation is given by psi and tilt. The images are sorted by
+        group, so that only a few shared filters are in memory at a time. */
+    void groupImagesByFilter();
+
+    /// Directions of the filter matrices in the frame of an image with these angles
+    void getFilterDirections(double rot, double tilt, double psi,
+                             std::vector<WBPInfo> &matf) const;
+
+    /** Simple (i.e. unfiltered) backprojection of a single image.
+        Only the slices from zFirst to zLast (physical indexes, -1 for the
+        last one) are modified. */
     void simpleBackprojection(Projection &img, MultidimArray<double> &vol,
-                               int diameter) ;
+                               int diameter, int zFirst = 0, int zLast = -1) ;
 
     // Calculate the filter and apply it to a projection
     void filterOneImage(Projection &proj, Tabsinc &TSINC);
 
-    // Calculate the filter for arbitrary tilt geometry in 2D and apply
+    /** Calculate the filter for arbitrary tilt geometry in 2D and apply.
+        The images are processed in batches of nThreads images, filtered
+        with filterBatch and back-projected with backprojectBatch. */
     void apply2DFilterArbitraryGeometry() ;
+
+    /** Filter the first n projections of a batch.
+        All of them are Fourier transformed at once and filtered with
+        applyExactFilters or applyGroupFilters. */
+    void filterBatch(std::vector<Projection> &batch, size_t n, Tabsinc &TSINC,
+                     ctpl::thread_pool &pool);
+
+    /** Apply the exact filter of each projection to the batch transforms.
+        The filter of projections with the same orientation is computed
+        only once, and the threads work on different rows of the filters. */
+    void applyExactFilters(std::vector<Projection> &batch, size_t n, Tabsinc &TSINC,
+                           ctpl::thread_pool &pool);
+
+    /** Apply the shared filters of the groups to the batch transforms.
+        The missing filters are computed on a grid that covers the rotated
+        frequencies, and are interpolated (bilinear) at the frequencies of
+        each projection rotated by its in-plane angle. */
+    void applyGroupFilters(std::vector<Projection> &batch, size_t n, Tabsinc &TSINC,
+                           ctpl::thread_pool &pool);
+
+    /** Back-project the first n (filtered) projections of a batch.
+        Each task adds all the projections to a different range of slices
+        of the volume, so no synchronization is needed. */
+    void backprojectBatch(std::vector<Projection> &batch, size_t n,
+                          MultidimArray<double> &vol, ctpl::thread_pool &pool);
 };
 //@}
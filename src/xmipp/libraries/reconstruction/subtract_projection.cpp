@@ -69,7 +69,7 @@ ProgSubtractProjection::~ProgSubtractProjection()
  // Read arguments ==========================================================
  void ProgSubtractProjection::readParams()
  {
-	XmippMetadataProgram::readParams();
+	ThreadedMetadataProgram::readParams();
  	fnVolR = getParam("--ref");
 	fnMask=getParam("--mask");
 	sigma=getIntParam("--sigma");
@@ -109,7 +109,7 @@ ProgSubtractProjection::~ProgSubtractProjection()
 	 addUsageLine(" Then, each particle and the correspondent projection of the reference volume are numerically");
 	 addUsageLine(" adjusted and subtracted using a mask which denotes the region to keep or subtract.");
      //Parameters
-	 XmippMetadataProgram::defineParams();
+	 ThreadedMetadataProgram::defineParams();
      addParamsLine("--ref <volume>\t: Reference volume to subtract");
      addParamsLine("[--mask <mask=\"\">]\t: 3D mask for region to keep, no mask implies subtraction of whole images");
 	 addParamsLine("[--sampling <sampling=1>]\t: Sampling rate (A/pixel)");
@@ -128,19 +128,22 @@ ProgSubtractProjection::~ProgSubtractProjection()
     		 "-o output_particles --sampling 1 --fmask_width 40 --max_resolution 4");
  }
 
- void ProgSubtractProjection::readParticle(const MDRow &r) {
-	r.getValueOrDefault(MDL_IMAGE, fnImgI, "no_filename");
-	I.read(fnImgI);
-	I().setXmippOrigin();
+ void ProgSubtractProjection::readParticle(ThreadData &d, const MDRow &r) const {
+	r.getValueOrDefault(MDL_IMAGE, d.fnImgI, "no_filename");
+	d.I.read(d.fnImgI);
+	d.I().setXmippOrigin();
  }
 
- void ProgSubtractProjection::writeParticle(MDRow &rowOut, FileName fnImgOut, Image<double> &img, double R2a, double b0save, double b1save) {
-	img.write(fnImgOut);
+ void ProgSubtractProjection::writeParticle(ThreadData &d, MDRow &rowOut, FileName fnImgOut, Image<double> &img, double R2a, double b0save, double b1save) {
+	{
+		std::lock_guard<std::mutex> lock(ioMutex);
+		img.write(fnImgOut);
+	}
 	rowOut.setValue(MDL_IMAGE, fnImgOut);
 	rowOut.setValue(MDL_SUBTRACTION_R2, R2a); 
 	rowOut.setValue(MDL_SUBTRACTION_BETA0, b0save); 
 	rowOut.setValue(MDL_SUBTRACTION_BETA1, b1save); 
-	if (nonNegative && (disable || R2a < 0)) 
+	if (nonNegative && (d.disable || R2a < 0)) 
 	{
 		rowOut.setValue(MDL_ENABLED, -1);
 	}
@@ -177,63 +180,63 @@ ProgSubtractProjection::~ProgSubtractProjection()
  	return m;
  }
 
- Image<double> ProgSubtractProjection::invertMask(const Image<double> &m) {
-	PmaskI = m;
-	MultidimArray<double> &mPmaskI=PmaskI();
+ Image<double> ProgSubtractProjection::invertMask(ThreadData &d, const Image<double> &m) const {
+	d.PmaskI = m;
+	MultidimArray<double> &mPmaskI=d.PmaskI();
 	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(mPmaskI)
 		DIRECT_MULTIDIM_ELEM(mPmaskI,n) = (DIRECT_MULTIDIM_ELEM(mPmaskI,n)*(-1))+1;
-	return PmaskI;
+	return d.PmaskI;
  }
 
- Image<double> ProgSubtractProjection::applyCTF(const MDRow &r, Projection &proj) {
+ Image<double> ProgSubtractProjection::applyCTF(ThreadData &d, const MDRow &r, Projection &proj) const {
 	if (r.containsLabel(MDL_CTF_DEFOCUSU) || r.containsLabel(MDL_CTF_MODEL)){
+		CTFDescription &ctf = d.ctf;
+		FourierFilter &FilterCTF = d.FilterCTF;
 		ctf.readFromMdRow(r);
 		ctf.Tm = sampling;
 		ctf.produceSideInfo();
-	 	FilterCTF.FilterBand = CTF;
-	 	FilterCTF.ctf.enable_CTFnoise = false;
-		FilterCTF.ctf = ctf;
 		// Padding before apply CTF
-		MultidimArray <double> &mpad = padp();
+		MultidimArray <double> &mpad = d.padp();
 		mpad.setXmippOrigin();
 		MultidimArray<double> &mproj = proj();
 		mproj.setXmippOrigin();
 		mproj.window(mpad,STARTINGY(mproj)*(int)padFourier, STARTINGX(mproj)*(int)padFourier, FINISHINGY(mproj)*(int)padFourier, FINISHINGX(mproj)*(int)padFourier);
-		FilterCTF.generateMask(mpad);
-		FilterCTF.applyMaskSpace(mpad); 
+		auto ctfMask = ctfCache.getFourierMask(ctf, (int)YSIZE(mpad), (int)XSIZE(mpad));
+		FilterCTF.applyMaskSpace(mpad, *ctfMask);
 		//Crop to restore original size
 		mpad.window(mproj,STARTINGY(mproj), STARTINGX(mproj), FINISHINGY(mproj), FINISHINGX(mproj));
 	}
 	return proj;
  }
 
-void ProgSubtractProjection::processParticle(const MDRow &rowprocess, int sizeImg, FourierTransformer &transformerPf, FourierTransformer &transformerIf) {
-	readParticle(rowprocess);
-	rowprocess.getValueOrDefault(MDL_ANGLE_ROT, part_angles.rot, 0);
-	rowprocess.getValueOrDefault(MDL_ANGLE_TILT, part_angles.tilt, 0);
-	rowprocess.getValueOrDefault(MDL_ANGLE_PSI, part_angles.psi, 0);
-	roffset.initZeros(2);
-	rowprocess.getValueOrDefault(MDL_SHIFT_X, roffset(0), 0);
-	rowprocess.getValueOrDefault(MDL_SHIFT_Y, roffset(1), 0);
-	roffset *= -1;
-	projectVolume(*projector, P, sizeImg, sizeImg, part_angles.rot, part_angles.tilt, part_angles.psi, ctfImage);
-	selfTranslate(xmipp_transformation::LINEAR, P(), roffset, xmipp_transformation::WRAP);
-	Pctf = applyCTF(rowprocess, P);
-	MultidimArray<double> &mPctf = Pctf();
+void ProgSubtractProjection::processParticle(ThreadData &d, const MDRow &rowprocess, int sizeImg) const {
+	readParticle(d, rowprocess);
+	rowprocess.getValueOrDefault(MDL_ANGLE_ROT, d.part_angles.rot, 0);
+	rowprocess.getValueOrDefault(MDL_ANGLE_TILT, d.part_angles.tilt, 0);
+	rowprocess.getValueOrDefault(MDL_ANGLE_PSI, d.part_angles.psi, 0);
+	d.roffset.initZeros(2);
+	rowprocess.getValueOrDefault(MDL_SHIFT_X, d.roffset(0), 0);
+	rowprocess.getValueOrDefault(MDL_SHIFT_Y, d.roffset(1), 0);
+	d.roffset *= -1;
+	projectVolume(*d.projector, d.P, sizeImg, sizeImg, d.part_angles.rot, d.part_angles.tilt, d.part_angles.psi, ctfImage);
+	selfTranslate(xmipp_transformation::LINEAR, d.P(), d.roffset, xmipp_transformation::WRAP);
+	d.Pctf = applyCTF(d, rowprocess, d.P);
+	MultidimArray<double> &mPctf = d.Pctf();
 	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(mPctf)
 		DIRECT_MULTIDIM_ELEM(mPctf,n) = DIRECT_MULTIDIM_ELEM(mPctf,n) * DIRECT_MULTIDIM_ELEM(cirmask(),n);
-	transformerPf.FourierTransform(Pctf(), PFourier, false);
-	transformerIf.FourierTransform(I(), IFourier, false);
+	d.transformerP.FourierTransform(d.Pctf(), d.PFourier, false);
+	d.transformerI.FourierTransform(d.I(), d.IFourier, false);
 }
 
-MultidimArray< std::complex<double> > ProgSubtractProjection::computeEstimationImage(const MultidimArray<double> &Img, 
-const MultidimArray<double> &InvM, FourierTransformer &transformerImgiM) {
-	ImgiM().initZeros(Img);
-	ImgiM().setXmippOrigin();
+MultidimArray< std::complex<double> > ProgSubtractProjection::computeEstimationImage(ThreadData &d, const MultidimArray<double> &Img, 
+const MultidimArray<double> &InvM, FourierTransformer &transformerImgiM) const {
+	MultidimArray<double> &mImgiM = d.ImgiM();
+	mImgiM.initZeros(Img);
+	mImgiM.setXmippOrigin();
 	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Img)
-		DIRECT_MULTIDIM_ELEM(ImgiM(),n) = DIRECT_MULTIDIM_ELEM(Img,n) * DIRECT_MULTIDIM_ELEM(InvM,n);
-	transformerImgiM.FourierTransform(ImgiM(),ImgiMFourier,false);
-	return ImgiMFourier;
+		DIRECT_MULTIDIM_ELEM(mImgiM,n) = DIRECT_MULTIDIM_ELEM(Img,n) * DIRECT_MULTIDIM_ELEM(InvM,n);
+	transformerImgiM.FourierTransform(mImgiM,d.ImgiMFourier,false);
+	return d.ImgiMFourier;
 }
 
  double ProgSubtractProjection::evaluateFitting(const MultidimArray< std::complex<double> > &y,
@@ -298,14 +301,13 @@ Matrix1D<double> ProgSubtractProjection::checkBestModel(MultidimArray< std::comp
 	cirmask.write(formatString("%s/cirmask.mrc", fnProj.c_str()));
 	
 	// Create mock image of same size as particles (and referencce volume) to get
-	I().initZeros((int)Ydim, (int)Xdim);
-	I().initConstant(1);
-	transformerI.FourierTransform(I(), IFourier, false);
-
-	// Initialize Gaussian LPF to smooth mask
-	FilterG.FilterShape=REALGAUSSIAN;
-	FilterG.FilterBand=LOWPASS;
-	FilterG.w1=sigma;
+	// the size of their Fourier transform
+	MultidimArray<double> I;
+	I.initZeros((int)Ydim, (int)Xdim);
+	I.initConstant(1);
+	FourierTransformer transformerI;
+	MultidimArray< std::complex<double> > IFourier;
+	transformerI.FourierTransform(I, IFourier, false);
 
 	// Construct frequencies image
 	wi.initZeros(IFourier);
@@ -342,34 +344,61 @@ Matrix1D<double> ProgSubtractProjection::checkBestModel(MultidimArray< std::comp
 	}
  }
 
-void ProgSubtractProjection::processImage(const FileName &fnImg, const FileName &fnImgOut, const MDRow &rowIn, MDRow &rowOut)
+void ProgSubtractProjection::prepareThreads(size_t nThreads)
+{
+	threadData.resize(nThreads);
+	for (auto &d : threadData)
+	{
+		d = std::make_unique<ThreadData>();
+		d->projector = std::make_unique<FourierProjector>(*projector, true);
+		d->projectorMask = std::make_unique<FourierProjector>(*projectorMask, true);
+		// Initialize Gaussian LPF to smooth mask
+		d->FilterG.FilterShape=REALGAUSSIAN;
+		d->FilterG.FilterBand=LOWPASS;
+		d->FilterG.w1=sigma;
+	}
+}
+
+void ProgSubtractProjection::processImageThread(size_t thrId, const FileName &fnImg, const FileName &fnImgOut, const MDRow &rowIn, MDRow &rowOut)
  { 
+	ThreadData &d = *threadData[thrId];
+	Image<double> &I = d.I;
+	Image<double> &M = d.M;
+	Image<double> &iM = d.iM;
+	Image<double> &Idiff = d.Idiff;
+	Projection &P = d.P;
+	MultidimArray< std::complex<double> > &IFourier = d.IFourier;
+	MultidimArray< std::complex<double> > &PFourier = d.PFourier;
+	MultidimArray< std::complex<double> > &PFourier0 = d.PFourier0;
+	MultidimArray< std::complex<double> > &PFourier1 = d.PFourier1;
+	MultidimArray< std::complex<double> > &IiMFourier = d.IiMFourier;
+	MultidimArray< std::complex<double> > &PiMFourier = d.PiMFourier;
 	// Initialize aux variable
-	disable = false;
+	d.disable = false;
 	// Project volume and process projections 
-	const auto sizeI = (int)XSIZE(I());
-	processParticle(rowIn, sizeI, transformerP, transformerI);
+	const auto sizeI = (int)XSIZE(cirmask());
+	processParticle(d, rowIn, sizeI);
 	// Build projected and final masks
 	if (fnMask.isEmpty()) { // If there is no provided mask
 		M().initZeros(P());
 		// inverse mask (iM) is all 1s
-		iM = invertMask(M);
+		iM = invertMask(d, M);
 	}
 	else { // If a mask has been provided
-		projectVolume(*projectorMask, Pmask, sizeI, sizeI, part_angles.rot, part_angles.tilt, part_angles.psi, ctfImage);	
+		projectVolume(*d.projectorMask, d.Pmask, sizeI, sizeI, d.part_angles.rot, d.part_angles.tilt, d.part_angles.psi, ctfImage);	
 		// Apply binarization, shift and gaussian filter to the projected mask
-		M = binarizeMask(Pmask);
-		selfTranslate(xmipp_transformation::LINEAR, M(), roffset, xmipp_transformation::DONT_WRAP);
-		FilterG.applyMaskSpace(M());
+		M = binarizeMask(d.Pmask);
+		selfTranslate(xmipp_transformation::LINEAR, M(), d.roffset, xmipp_transformation::DONT_WRAP);
+		d.FilterG.applyMaskSpace(M());
 		if (subtract) // If the mask contains the part to SUBTRACT: iM = input mask
 			iM = M;
 		else // If the mask contains the part to KEEP: iM = INVERSE of original mask
-			iM = invertMask(M);
+			iM = invertMask(d, M);
 	}
 	
 	// Compute estimation images: IiM = I*iM and PiM = P*iM	
-	IiMFourier = computeEstimationImage(I(), iM(), transformerIiM);
-	PiMFourier = computeEstimationImage(Pctf(), iM(), transformerPiM);	
+	IiMFourier = computeEstimationImage(d, I(), iM(), d.transformerIiM);
+	PiMFourier = computeEstimationImage(d, d.Pctf(), iM(), d.transformerPiM);	
 
 	// Estimate transformation with model of order 0: T(w) = beta00 and model of order 1: T(w) = beta01 + beta1*w
 	MultidimArray<double> num0;
@@ -402,7 +431,7 @@ void ProgSubtractProjection::processImage(const FileName &fnImg, const FileName
 	double beta00 = num0.sum()/den0.sum();
 	if (nonNegative && beta00 < 0) 
 	{
-		disable = true;
+		d.disable = true;
 	}
 	// Apply adjustment order 0: PFourier0 = T(w) * PFourier = beta00 * PFourier
 	PFourier0 = PFourier;
@@ -457,21 +486,23 @@ void ProgSubtractProjection::processImage(const FileName &fnImg, const FileName
 			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(IFourier)
 				DIRECT_MULTIDIM_ELEM(IFourier,n) /= (beta01+beta1*DIRECT_MULTIDIM_ELEM(wi,n)); 
 		}
-		transformerI.inverseFourierTransform(IFourier, Idiff());
+		d.transformerI.inverseFourierTransform(IFourier, Idiff());
 	} 
 	else  // Subtraction
 	{
 		// Recover adjusted projection (P) in real space
-		transformerP.inverseFourierTransform(PFourier, P());
+		d.transformerP.inverseFourierTransform(PFourier, P());
 		mIdiff.initZeros(I());
 		mIdiff.setXmippOrigin();
 		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(mIdiff)
 			DIRECT_MULTIDIM_ELEM(mIdiff,n) = DIRECT_MULTIDIM_ELEM(I(),n)-DIRECT_MULTIDIM_ELEM(P(),n);
 	}
-	writeParticle(rowOut, fnImgOut, Idiff, R2adj(0), beta0save, beta1save); 
+	writeParticle(d, rowOut, fnImgOut, Idiff, R2adj(0), beta0save, beta1save); 
 }
 
 void ProgSubtractProjection::postProcess()
 {
 	getOutputMd().write(fn_out);
+	if (verbose && ctfCache.getHits()+ctfCache.getMisses()>0)
+		ctfCache.printStatistics(std::cout);
 }
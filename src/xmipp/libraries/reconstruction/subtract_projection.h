@@ -26,25 +26,27 @@
  #ifndef _PROG_SUBTRACT_PROJECTION
  #define _PROG_SUBTRACT_PROJECTION
 
+ #include <memory>
+ #include <vector>
  #include "core/metadata_vec.h"
  #include "core/xmipp_program.h"
  #include "core/xmipp_image.h"
+ #include "data/ctf_image_cache.h"
  #include "data/fourier_filter.h"
  #include "data/fourier_projection.h"
- #include "core/xmipp_metadata_program.h"
+ #include "threaded_metadata_program.h"
 
 /**@defgroup ProgSubtractProjection Subtract projections
    @ingroup ReconsLibrary */
 //@{
 /** Subtract projections from particles */
 
-class ProgSubtractProjection: public XmippMetadataProgram
+class ProgSubtractProjection: public ThreadedMetadataProgram
  {
  public:
     // Input params
     FileName fnVolR; // Input reference volume
     FileName fnParticles; // Input metadata
-	FileName fnImgI; // Particle filename
     FileName fnOut; // Output metadata
     FileName fnMaskVol; // Input 3D mask of the reference volume
     FileName fnMask; // Input 3D mask for region to keep
@@ -61,70 +63,74 @@ class ProgSubtractProjection: public XmippMetadataProgram
     bool subtract;
 	MultidimArray<int> wi;
 
-    // Data variables
+    // Data variables (shared by all threads)
  	Image<double> V; // volume
  	Image<double> vM; // mask 3D
     Image<double> ivM; // invert mask 3D
-
- 	Image<double> M; // mask projected and smooth
- 	Image<double> I; // particle
-    Image<double> Pctf; // projection with CTF applied
-    Image<double> iM; // inverse mask of the region to keep
-    Image<double> Mfinal; // final dilated mask
-    Image<double> Idiff; // final subtracted image
 	Image<double> cirmask; // circular mask to avoid edge artifacts	
 
- 	Projection P; // projection
- 	Projection Pmask; // mask projection for region to keep
-    Projection PmaskVol; // reference volume mask projection
-	FourierFilter FilterG; // Gaussian LPF to smooth mask
-
     const MultidimArray<double> *ctfImage = nullptr; // needed for FourierProjector
-	FourierTransformer transformerP; // Fourier transformer for projection
-    FourierTransformer transformerI; // Fourier transformer for particle
-    
-    MultidimArray< std::complex<double> > IFourier; // FT(particle)
-	MultidimArray< std::complex<double> > PFourier; // FT(projection)
-    MultidimArray< std::complex<double> > PFourier0; // FT(projection) estimation of order 0
-	MultidimArray< std::complex<double> > PFourier1; // FT(projection) estimation of order 1
-    MultidimArray< std::complex<double> > IiMFourier;
-	MultidimArray< std::complex<double> > PiMFourier;
-
+    mutable CTFImageCache<double> ctfCache; // CTF masks shared by the particles of a micrograph
 
-    FourierTransformer transformerIiM;
-	FourierTransformer transformerPiM;
-
-    CTFDescription ctf;
-	FourierFilter FilterCTF;
-	Image<double> padp; // padded image when applying CTF
-	Image<double> PmaskI; // inverted projected mask
-	Image<double> ImgiM; // auxiliary image for computing estimation images
-	MultidimArray< std::complex<double> > ImgiMFourier; // FT(ImgiM)
-
-    // Particle metadata
-    MetaDataVec mdParticles;
-    MDRowVec row;
-    Matrix1D<double> roffset; // particle shifts
     struct Angles // particle angles for projection
     {
     	double rot;
     	double tilt;
     	double psi;
     };
-    struct Angles part_angles; 
 
-    bool disable;
+    /// Data modified while processing a particle (one per thread)
+    struct ThreadData
+    {
+        FileName fnImgI; // Particle filename
+     	Image<double> M; // mask projected and smooth
+     	Image<double> I; // particle
+        Image<double> Pctf; // projection with CTF applied
+        Image<double> iM; // inverse mask of the region to keep
+        Image<double> Idiff; // final subtracted image
+     	Projection P; // projection
+     	Projection Pmask; // mask projection for region to keep
+    	FourierFilter FilterG; // Gaussian LPF to smooth mask
+
+    	FourierTransformer transformerP; // Fourier transformer for projection
+        FourierTransformer transformerI; // Fourier transformer for particle
+        MultidimArray< std::complex<double> > IFourier; // FT(particle)
+    	MultidimArray< std::complex<double> > PFourier; // FT(projection)
+        MultidimArray< std::complex<double> > PFourier0; // FT(projection) estimation of order 0
+    	MultidimArray< std::complex<double> > PFourier1; // FT(projection) estimation of order 1
+        MultidimArray< std::complex<double> > IiMFourier;
+    	MultidimArray< std::complex<double> > PiMFourier;
+        FourierTransformer transformerIiM;
+    	FourierTransformer transformerPiM;
+
+        CTFDescription ctf;
+    	FourierFilter FilterCTF; // applies the CTF masks of ctfCache
+    	Image<double> padp; // padded image when applying CTF
+    	Image<double> PmaskI; // inverted projected mask
+    	Image<double> ImgiM; // auxiliary image for computing estimation images
+    	MultidimArray< std::complex<double> > ImgiMFourier; // FT(ImgiM)
+
+        Matrix1D<double> roffset; // particle shifts
+        struct Angles part_angles;
+        bool disable;
+
+        // Projectors sharing the coefficients of the program projectors
+        std::unique_ptr<FourierProjector> projector;
+        std::unique_ptr<FourierProjector> projectorMask;
+    };
+    std::vector< std::unique_ptr<ThreadData> > threadData;
+
     /// Read and write methods
-    void readParticle(const MDRow &rowIn);
-    void writeParticle(MDRow &rowOut, FileName, Image<double> &, double, double, double);
+    void readParticle(ThreadData &d, const MDRow &rowIn) const;
+    void writeParticle(ThreadData &d, MDRow &rowOut, FileName, Image<double> &, double, double, double);
     /// Processing methods
     void createMask(const FileName &, Image<double> &, Image<double> &);
     Image<double> binarizeMask(Projection &) const;
-    Image<double> invertMask(const Image<double> &);
-    Image<double> applyCTF(const MDRow &, Projection &);
-    void processParticle(const MDRow &rowIn, int, FourierTransformer &, FourierTransformer &);
-    MultidimArray< std::complex<double> > computeEstimationImage(const MultidimArray<double> &, 
-        const MultidimArray<double> &, FourierTransformer &);
+    Image<double> invertMask(ThreadData &d, const Image<double> &) const;
+    Image<double> applyCTF(ThreadData &d, const MDRow &, Projection &) const;
+    void processParticle(ThreadData &d, const MDRow &rowIn, int) const;
+    MultidimArray< std::complex<double> > computeEstimationImage(ThreadData &d, const MultidimArray<double> &, 
+        const MultidimArray<double> &, FourierTransformer &) const;
     double evaluateFitting(const MultidimArray< std::complex<double> > &, const MultidimArray< std::complex<double> > &) const;
     Matrix1D<double> checkBestModel(MultidimArray< std::complex<double> > &, const MultidimArray< std::complex<double> > &, 
         const MultidimArray< std::complex<double> > &, const MultidimArray< std::complex<double> > &) const;
@@ -143,7 +149,8 @@ class ProgSubtractProjection: public XmippMetadataProgram
     /// Define parameters
     void defineParams() override;
     void preProcess() override;
-    void processImage(const FileName &fnImg, const FileName &fnImgOut, const MDRow &rowIn, MDRow &rowOut) override;
+    void prepareThreads(size_t nThreads) override;
+    void processImageThread(size_t thrId, const FileName &fnImg, const FileName &fnImgOut, const MDRow &rowIn, MDRow &rowOut) override;
     void postProcess() override;
  };
  //@}
@@ -0,0 +1,116 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#include "threaded_metadata_program.h"
+#include "data/cpu.h"
+
+void ThreadedMetadataProgram::defineParams()
+{
+    XmippMetadataProgram::defineParams();
+    addParamsLine("  [--thr <N=1>]                : Number of images processed simultaneously (0 for all cores)");
+}
+
+void ThreadedMetadataProgram::readParams()
+{
+    XmippMetadataProgram::readParams();
+    numThreads = getIntParam("--thr");
+    if (numThreads <= 0)
+        numThreads = (int)CPU::findCores();
+}
+
+void ThreadedMetadataProgram::copyRow(const MDRow &from, MDRowVec &to)
+{
+    for (const MDObject *obj : from)
+        to.setValue(*obj);
+}
+
+void ThreadedMetadataProgram::processImage(const FileName &fnImg, const FileName &fnImgOut,
+        const MDRow &rowIn, MDRow &rowOut)
+{
+    if (!threadsPrepared)
+    {
+        prepareThreads(numThreads);
+        if (numThreads > 1)
+            threadPool = std::make_unique<ctpl::thread_pool>(numThreads);
+        threadsPrepared = true;
+    }
+
+    if (numThreads == 1)
+    {
+        processImageThread(0, fnImg, fnImgOut, rowIn, rowOut);
+        return;
+    }
+
+    // Keep a bounded number of images in flight
+    while (queue.size() >= 2 * (size_t)numThreads)
+        waitOldest();
+
+    queue.emplace_back();
+    QueuedImage &image = queue.back();
+    image.fnImg = fnImg;
+    image.fnImgOut = fnImgOut;
+    copyRow(rowIn, image.rowIn);
+    image.rowOut = std::make_unique<MDRowVec>();
+    copyRow(rowOut, *image.rowOut);
+    // Elements of a deque are not moved when pushing at the back
+    QueuedImage *ptrImage = &image;
+    image.done = threadPool->push([this, ptrImage](int thrId)
+    {
+        processImageThread(thrId, ptrImage->fnImg, ptrImage->fnImgOut, ptrImage->rowIn, *ptrImage->rowOut);
+    });
+}
+
+void ThreadedMetadataProgram::waitOldest()
+{
+    QueuedImage &image = queue.front();
+    image.done.get(); // rethrows the errors of the thread
+    processedRows.emplace_back(std::move(image.rowOut));
+    queue.pop_front();
+}
+
+void ThreadedMetadataProgram::wait()
+{
+    while (!queue.empty())
+        waitOldest();
+    if (processedRows.empty())
+        return;
+    if (!each_image_produces_an_output && !produces_a_metadata)
+    {
+        // No output metadata is written
+        processedRows.clear();
+        return;
+    }
+
+    // The output metadata has a row per processed image, in the same order,
+    // with the values the row had before processing
+    MetaData &mdOut = getOutputMd();
+    if (mdOut.size() != processedRows.size())
+        REPORT_ERROR(ERR_LOGIC_ERROR, formatString("ThreadedMetadataProgram: %lu rows were processed but the output "
+                     "metadata has %lu rows", processedRows.size(), mdOut.size()));
+    size_t i = 0;
+    for (size_t objId : mdOut.ids())
+        mdOut.setRow(*processedRows[i++], objId);
+    processedRows.clear();
+}
@@ -0,0 +1,112 @@
+/***************************************************************************
+ *
+ * Authors:     Xmipp developers (xmipp@cnb.csic.es)
+ *
+ * Unidad de  Bioinformatica of Centro Nacional de Biotecnologia , CSIC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ * 02111-1307  USA
+ *
+ *  All comments concerning this program package may be sent to the
+ *  e-mail address 'xmipp@cnb.csic.es'
+ ***************************************************************************/
+
+#ifndef LIBRARIES_RECONSTRUCTION_THREADED_METADATA_PROGRAM_H_
+#define LIBRARIES_RECONSTRUCTION_THREADED_METADATA_PROGRAM_H_
+
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "CTPL/ctpl_stl.h"
+#include "core/xmipp_metadata_program.h"
+#include "core/metadata_vec.h"
+
+/**@defgroup ThreadedMetadataProgram Multithreaded metadata program
+   @ingroup ReconsLibrary */
+//@{
+
+/** XmippMetadataProgram processing several images at the same time.
+ *
+ * Programs deriving from this class implement processImageThread instead of
+ * processImage. Everything that is modified while processing an image must be
+ * kept in per-thread scratch data (indexed by thrId, see prepareThreads), while
+ * the rest of members (e.g., the reference volume) are shared and must only be read.
+ *
+ * With --thr 1 images are processed sequentially, as in XmippMetadataProgram.
+ * Otherwise processImage only queues the image in a thread pool, and the rows
+ * produced by the threads are stored in the output metadata, in the order of the
+ * input images, when the program waits for the processing to finish (see wait).
+ * It can be combined with BasicMpiMetadataProgram.
+ */
+class ThreadedMetadataProgram: public XmippMetadataProgram
+{
+protected:
+    /// Number of threads processing images
+    int numThreads = 1;
+
+    /// Protect operations that cannot be done concurrently (e.g., writing into a stack)
+    std::mutex ioMutex;
+
+public:
+    /// Define --thr. Call it from the defineParams of the derived program
+    void defineParams() override;
+
+    /// Read --thr. Call it from the readParams of the derived program
+    void readParams() override;
+
+    /** Allocate the scratch data of nThreads threads.
+     * It is called once, before processing the first image. Thread ids are
+     * in the range [0, nThreads).
+     */
+    virtual void prepareThreads(size_t nThreads) = 0;
+
+    /** Process one image with the scratch data of thread thrId.
+     * Same semantics as XmippMetadataProgram::processImage.
+     */
+    virtual void processImageThread(size_t thrId, const FileName &fnImg, const FileName &fnImgOut,
+                                    const MDRow &rowIn, MDRow &rowOut) = 0;
+
+    /// Process the image or queue it in the thread pool
+    void processImage(const FileName &fnImg, const FileName &fnImgOut, const MDRow &rowIn, MDRow &rowOut) override;
+
+    /// Wait for the queued images and set their rows in the output metadata
+    void wait() override;
+
+private:
+    struct QueuedImage
+    {
+        FileName fnImg;
+        FileName fnImgOut;
+        MDRowVec rowIn;
+        std::unique_ptr<MDRowVec> rowOut;
+        std::future<void> done;
+    };
+
+    /// Wait for the oldest queued image
+    void waitOldest();
+
+    /// Copy all values of a row (rows of a metadata may be views)
+    static void copyRow(const MDRow &from, MDRowVec &to);
+
+    std::unique_ptr<ctpl::thread_pool> threadPool;
+    std::deque<QueuedImage> queue;
+    std::vector<std::unique_ptr<MDRowVec>> processedRows;
+    bool threadsPrepared = false;
+};
+
+//@}
+#endif
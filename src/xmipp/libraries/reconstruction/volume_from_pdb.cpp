@@ -28,8 +28,10 @@
 #include "core/transformations.h"
 #include <core/args.h>
 #include "data/pdb.h"
+#include "CTPL/ctpl_stl.h"
 
 #include <fstream>
+#include <limits>
 
 /* Empty constructor ------------------------------------------------------- */
 ProgPdbConverter::ProgPdbConverter()
@@ -49,6 +51,9 @@ ProgPdbConverter::ProgPdbConverter()
     useFixedGaussian=false;
     doCenter=false;
     noHet=false;
+    origGiven=false;
+    orig_x=orig_y=orig_z=0;
+    numThreads=1;
 
     // Periodic table for the blobs
     periodicTable.resize(12, 2);
@@ -86,25 +91,18 @@ ProgPdbConverter::ProgPdbConverter()
 }
 
 /* Produce Side Info ------------------------------------------------------- */
-void ProgPdbConverter::produceSideInfo()
+void ProgPdbConverter::produceSideInfo(const PDBRichPhantom &pdb)
+{
+    produceSideInfo(pdb.remarks);
+}
+
+void ProgPdbConverter::produceSideInfo(const std::vector<std::string> &remarks)
 {
     if (useFixedGaussian && sigmaGaussian<0)
     {
         // Check if it is a pseudodensity volume
-        std::ifstream fh_pdb;
-        fh_pdb.open(fn_pdb.c_str());
-        if (!fh_pdb)
-            REPORT_ERROR(ERR_IO_NOTEXIST, fn_pdb);
-        while (!fh_pdb.eof())
+        for (const auto &line : remarks)
         {
-            // Read an ATOM line
-            std::string line;
-            getline(fh_pdb, line);
-            if (line == "")
-                continue;
-            std::string kind = line.substr(0,6);
-            if (kind!="REMARK")
-                continue;
             std::vector< std::string > results;
             splitString(line," ",results);
             if (useFixedGaussian && results[1]=="fixedGaussian")
@@ -112,7 +110,6 @@ void ProgPdbConverter::produceSideInfo()
             if (useFixedGaussian && results[1]=="intensityColumn")
                 intensityColumn=results[2];
         }
-        fh_pdb.close();
     }
 
     if (!useBlobs && !usePoorGaussian && !useFixedGaussian)
@@ -202,6 +199,7 @@ void ProgPdbConverter::defineParams()
     addParamsLine("                                     :  If not given, the standard deviation is taken from the PDB file");
     addParamsLine("  [--intensityColumn <intensity_type=occupancy>]   : Where to write the intensity in the PDB file");
     addParamsLine("     where <intensity_type> occupancy Bfactor     : Valid values: occupancy, Bfactor");
+    addParamsLine("  [--thr <N=1>]                       : Number of threads");
 }
 /* Read parameters --------------------------------------------------------- */
 void ProgPdbConverter::readParams()
@@ -234,6 +232,7 @@ void ProgPdbConverter::readParams()
     fn_outPDB = checkParam("--oPDB") ? (fn_out + "_centered.pdb") : FileName();
     noHet = checkParam("--noHet");
     intensityColumn = getParam("--intensityColumn");
+    numThreads = std::max(getIntParam("--thr"), 1);
 }
 
 /* Show -------------------------------------------------------------------- */
@@ -251,6 +250,7 @@ void ProgPdbConverter::show()
     << "Use blobs:          " << useBlobs         << std::endl
     << "Use poor Gaussian:  " << usePoorGaussian  << std::endl
     << "Use fixed Gaussian: " << useFixedGaussian << std::endl
+    << "Threads:            " << numThreads       << std::endl
     ;
     if (useFixedGaussian)
         std::cout << "Intensity Col:      " << intensityColumn  << std::endl
@@ -258,10 +258,10 @@ void ProgPdbConverter::show()
 }
 
 /* Compute protein geometry ------------------------------------------------ */
-void ProgPdbConverter::computeProteinGeometry()
+void ProgPdbConverter::computeProteinGeometry(const PDBCompactPhantom &pdb)
 {
     Matrix1D<double> limit0(3), limitF(3);
-    computePDBgeometry(fn_pdb, centerOfMass, limit0, limitF, intensityColumn);
+    computePDBgeometry(pdb, centerOfMass, limit0, limitF, intensityColumn);
     if (doCenter)
     {
         limit0-=centerOfMass;
@@ -300,8 +300,75 @@ void ProgPdbConverter::computeProteinGeometry()
     }
 }
 
+/* Shift of the atoms ------------------------------------------------------ */
+void ProgPdbConverter::atomShift(double &shiftX, double &shiftY, double &shiftZ) const
+{
+    shiftX = shiftY = shiftZ = 0;
+    if (doCenter)
+    {
+        shiftX = -XX(centerOfMass);
+        shiftY = -YY(centerOfMass);
+        shiftZ = -ZZ(centerOfMass);
+    }
+}
+
+/* Rasterize atoms --------------------------------------------------------- */
+void ProgPdbConverter::rasterizeAtoms(const MultidimArray<double> &V, size_t Natoms,
+    const std::function<bool(size_t, double &, double &)> &footprint,
+    const std::function<void(size_t, int, int)> &addAtom) const
+{
+    int z0 = STARTINGZ(V);
+    int zF = FINISHINGZ(V);
+    int Nz = zF - z0 + 1;
+    if (Nz <= 0 || Natoms == 0)
+        return;
+    if (Natoms > std::numeric_limits<uint32_t>::max())
+        REPORT_ERROR(ERR_VALUE_INCORRECT, "Too many atoms");
+
+    // Several slabs per thread to balance the load
+    int Nslabs = numThreads == 1 ? 1 : std::min(Nz, 4 * numThreads);
+    int slabSize = (Nz + Nslabs - 1) / Nslabs;
+    Nslabs = (Nz + slabSize - 1) / slabSize;
+
+    // Bin the atoms into the slabs they overlap
+    std::vector< std::vector<uint32_t> > bins(Nslabs);
+    double zMin, zMax;
+    for (size_t n = 0; n < Natoms; n++)
+    {
+        if (!footprint(n, zMin, zMax))
+            continue;
+        int k0 = XMIPP_MAX(FLOOR(zMin), z0);
+        int kF = XMIPP_MIN(CEIL(zMax), zF);
+        if (k0 > kF)
+            continue;
+        for (int s = (k0 - z0) / slabSize; s <= (kF - z0) / slabSize; s++)
+            bins[s].push_back((uint32_t)n);
+    }
+
+    auto fillSlab = [&](int, int s)
+    {
+        int kS0 = z0 + s * slabSize;
+        int kSF = XMIPP_MIN(kS0 + slabSize - 1, zF);
+        for (uint32_t n : bins[s])
+            addAtom(n, kS0, kSF);
+        std::vector<uint32_t>().swap(bins[s]);
+    };
+    if (Nslabs == 1)
+        fillSlab(0, 0);
+    else
+    {
+        ctpl::thread_pool threadPool(XMIPP_MIN(numThreads, Nslabs));
+        std::vector<std::future<void>> futures;
+        futures.reserve(Nslabs);
+        for (int s = 0; s < Nslabs; s++)
+            futures.emplace_back(threadPool.push(fillSlab, s));
+        for (auto &f : futures)
+            f.get();
+    }
+}
+
 /* Create protein at a high sampling rate ---------------------------------- */
-void ProgPdbConverter::createProteinAtHighSamplingRate()
+void ProgPdbConverter::createProteinAtHighSamplingRate(const PDBCompactPhantom &pdb)
 {
     // Create an empty volume to hold the protein
     int finalDim_x, finalDim_y, finalDim_z;
@@ -329,45 +396,66 @@ void ProgPdbConverter::createProteinAtHighSamplingRate()
     if (verbose)
     	std::cout << "The highly sampled volume is of size " << XSIZE(Vhigh())
     	<< std::endl;
-    std::cout << "Size: "; Vhigh().printShape(); std::cout << std::endl;
-
-    // Declare centered PDB
-    PDBRichPhantom centered_pdb;
+    if (verbose)
+    {
+        std::cout << "Size: "; Vhigh().printShape(); std::cout << std::endl;
+    }
 
-    // Read centered pdb
-    centered_pdb.read(fn_pdb.c_str());
+    // Weight and radius of each element
+    size_t Nelements = pdb.elements.size();
+    std::vector<double> elementWeight(Nelements), elementRadius(Nelements);
+    if (!useFixedGaussian)
+        for (size_t e = 0; e < Nelements; e++)
+            atomBlobDescription(pdb.elements[e], elementWeight[e], elementRadius[e]);
 
-    Matrix1D<double> r(3);
+    double shiftX, shiftY, shiftZ;
+    atomShift(shiftX, shiftY, shiftZ);
     bool useBFactor = intensityColumn=="Bfactor";
-    // Iterate the list of atoms modifying data if needed
-    for (auto& atom : centered_pdb.atomList) {
-        if (doCenter) {
-            atom.x -= XX(centerOfMass);
-            atom.y -= YY(centerOfMass);
-            atom.z -= ZZ(centerOfMass);
-        }
-        VECTOR_R3(r, atom.x, atom.y, atom.z);
-        r /= highTs;
+    MultidimArray<double> &mVhigh = Vhigh();
 
-        // Characterize atom
-        double weight, radius;
+    // Characterize atom
+    auto characterize = [&](size_t n, Matrix1D<double> &r, double &weight, double &radius,
+                            double &blobRadius)
+    {
+        VECTOR_R3(r, pdb.x[n] + shiftX, pdb.y[n] + shiftY, pdb.z[n] + shiftZ);
+        r /= highTs;
         if (!useFixedGaussian)
         {
-            if (noHet && atom.record == "HETATM")
-                continue;
-            atomBlobDescription(atom.atomType, weight, radius);
+            weight = elementWeight[pdb.elementIdx[n]];
+            radius = elementRadius[pdb.elementIdx[n]];
         }
         else
         {
             radius=4.5*sigmaGaussian;
             if (useBFactor)
-                weight=atom.bfactor;
+                weight=pdb.bfactor[n];
             else
-                weight=atom.occupancy;
+                weight=pdb.occupancy[n];
         }
-        blob.radius = radius;
+        blobRadius = radius;
         if (usePoorGaussian)
             radius=XMIPP_MAX(radius/Ts,4.5);
+    };
+
+    auto footprint = [&](size_t n, double &zMin, double &zMax)
+    {
+        if (!useFixedGaussian && noHet && pdb.hetatm[n])
+            return false;
+        Matrix1D<double> r(3);
+        double weight, radius, blobRadius;
+        characterize(n, r, weight, radius, blobRadius);
+        zMin = ZZ(r) - radius;
+        zMax = ZZ(r) + radius;
+        return true;
+    };
+
+    auto addAtom = [&](size_t n, int kMin, int kMax)
+    {
+        Matrix1D<double> r(3);
+        double weight, radius, blobRadius;
+        characterize(n, r, weight, radius, blobRadius);
+        blobtype atomBlob = blob;
+        atomBlob.radius = blobRadius;
         double GaussianSigma2=(radius/(3*sqrt(2.0)));
         if (useFixedGaussian)
             GaussianSigma2=sigmaGaussian;
@@ -375,12 +463,12 @@ void ProgPdbConverter::createProteinAtHighSamplingRate()
         double GaussianNormalization = 1.0/pow(2*PI*GaussianSigma2,1.5);
 
         // Find the part of the volume that must be updated
-        int k0 = XMIPP_MAX(FLOOR(ZZ(r) - radius), STARTINGZ(Vhigh()));
-        int kF = XMIPP_MIN(CEIL(ZZ(r) + radius), FINISHINGZ(Vhigh()));
-        int i0 = XMIPP_MAX(FLOOR(YY(r) - radius), STARTINGY(Vhigh()));
-        int iF = XMIPP_MIN(CEIL(YY(r) + radius), FINISHINGY(Vhigh()));
-        int j0 = XMIPP_MAX(FLOOR(XX(r) - radius), STARTINGX(Vhigh()));
-        int jF = XMIPP_MIN(CEIL(XX(r) + radius), FINISHINGX(Vhigh()));
+        int k0 = XMIPP_MAX(FLOOR(ZZ(r) - radius), kMin);
+        int kF = XMIPP_MIN(CEIL(ZZ(r) + radius), kMax);
+        int i0 = XMIPP_MAX(FLOOR(YY(r) - radius), STARTINGY(mVhigh));
+        int iF = XMIPP_MIN(CEIL(YY(r) + radius), FINISHINGY(mVhigh));
+        int j0 = XMIPP_MAX(FLOOR(XX(r) - radius), STARTINGX(mVhigh));
+        int jF = XMIPP_MIN(CEIL(XX(r) + radius), FINISHINGX(mVhigh));
 
         // Fill the volume with this atom
         Matrix1D<double> rdiff(3);
@@ -391,19 +479,15 @@ void ProgPdbConverter::createProteinAtHighSamplingRate()
                     VECTOR_R3(rdiff, XX(r) - j, YY(r) - i, ZZ(r) - k);
                     rdiff*=highTs;
                     if (useBlobs)
-                        Vhigh(k, i, j) += weight * blob_val(rdiff.module(), blob);
+                        A3D_ELEM(mVhigh, k, i, j) += weight * blob_val(rdiff.module(), atomBlob);
                     else if (usePoorGaussian || useFixedGaussian)
-                        Vhigh(k, i, j) += weight *
+                        A3D_ELEM(mVhigh, k, i, j) += weight *
                                           exp(-rdiff.module()*rdiff.module()/(2*GaussianSigma2))*
                                           GaussianNormalization;
                 }
-    }
-    
-    // Save centered PDB
-    if (doCenter && !fn_outPDB.empty())
-    {
-        centered_pdb.write(fn_outPDB);
-    }
+    };
+
+    rasterizeAtoms(mVhigh, pdb.getNumberOfAtoms(), footprint, addAtom);
 }
 
 /* Create protein at a low sampling rate ----------------------------------- */
@@ -453,7 +537,7 @@ void ProgPdbConverter::blobProperties() const
 }
 
 /* Create protein using scattering profiles -------------------------------- */
-void ProgPdbConverter::createProteinUsingScatteringProfiles()
+void ProgPdbConverter::createProteinUsingScatteringProfiles(const PDBCompactPhantom &pdb)
 {
     // Create an empty volume to hold the protein
     Vlow().initZeros(output_dim_x,output_dim_y,output_dim_z);
@@ -467,103 +551,148 @@ void ProgPdbConverter::createProteinUsingScatteringProfiles()
 		STARTINGZ(Vlow()) = orig_z;
     }
 
-    //Save centered PDB
-    PDBRichPhantom centered_pdb;
+    double shiftX, shiftY, shiftZ;
+    atomShift(shiftX, shiftY, shiftZ);
+    MultidimArray<double> &mVlow=Vlow();
 
-    // Read centered pdb
-    centered_pdb.read(fn_pdb.c_str());
+    auto atomPosition = [&](size_t n, Matrix1D<double> &r)
+    {
+        VECTOR_R3(r, pdb.x[n] + shiftX, pdb.y[n] + shiftY, pdb.z[n] + shiftZ);
+        r /= Ts;
+    };
 
-    Matrix1D<double> r(3);
-    bool useBFactor = intensityColumn=="Bfactor";
-    // Iterate the list of atoms modifying data if needed
-    for (auto& atom : centered_pdb.atomList) {
+    auto footprint = [&](size_t n, double &zMin, double &zMax)
+    {
         // Check if heteroatoms are allowed and current atom is one of them
-        if (noHet && atom.record == "HETATM")
-            continue;
-
-        if (doCenter) {
-            atom.x -= XX(centerOfMass);
-            atom.y -= YY(centerOfMass);
-            atom.z -= ZZ(centerOfMass);
-        }
-        VECTOR_R3(r, atom.x, atom.y, atom.z);
-        r /= Ts;
+        if (noHet && pdb.hetatm[n])
+            return false;
 
         // Characterize atom
+        const std::string &atomType = pdb.getElement(n);
         try
         {
-            double radius=atomProfiles.atomRadius(atom.atomType[0]);
-            double radius2=radius*radius;
-
-            // Find the part of the volume that must be updated
-            const MultidimArray<double> &mVlow=Vlow();
-            int k0 = XMIPP_MAX(FLOOR(ZZ(r) - radius), STARTINGZ(mVlow));
-            int kF = XMIPP_MIN(CEIL(ZZ(r) + radius), FINISHINGZ(mVlow));
-            int i0 = XMIPP_MAX(FLOOR(YY(r) - radius), STARTINGY(mVlow));
-            int iF = XMIPP_MIN(CEIL(YY(r) + radius), FINISHINGY(mVlow));
-            int j0 = XMIPP_MAX(FLOOR(XX(r) - radius), STARTINGX(mVlow));
-            int jF = XMIPP_MIN(CEIL(XX(r) + radius), FINISHINGX(mVlow));
-
-            // Fill the volume with this atom
-            for (int k = k0; k <= kF; k++)
+            double radius=atomProfiles.atomRadius(atomType[0]);
+            Matrix1D<double> r(3);
+            atomPosition(n, r);
+            zMin = ZZ(r) - radius;
+            zMax = ZZ(r) + radius;
+            return true;
+        }
+        catch (const XmippError &)
+        {
+        	if (verbose)
+        		std::cerr << "Ignoring atom of type *" << atomType << "*" << std::endl;
+        	return false;
+        }
+    };
+
+    auto addAtom = [&](size_t n, int kMin, int kMax)
+    {
+        char atomType = pdb.getElement(n)[0];
+        double radius=atomProfiles.atomRadius(atomType);
+        double radius2=radius*radius;
+        Matrix1D<double> r(3);
+        atomPosition(n, r);
+
+        // Find the part of the volume that must be updated
+        int k0 = XMIPP_MAX(FLOOR(ZZ(r) - radius), kMin);
+        int kF = XMIPP_MIN(CEIL(ZZ(r) + radius), kMax);
+        int i0 = XMIPP_MAX(FLOOR(YY(r) - radius), STARTINGY(mVlow));
+        int iF = XMIPP_MIN(CEIL(YY(r) + radius), FINISHINGY(mVlow));
+        int j0 = XMIPP_MAX(FLOOR(XX(r) - radius), STARTINGX(mVlow));
+        int jF = XMIPP_MIN(CEIL(XX(r) + radius), FINISHINGX(mVlow));
+
+        // Fill the volume with this atom
+        for (int k = k0; k <= kF; k++)
+        {
+            double zdiff=ZZ(r) - k;
+            double zdiff2=zdiff*zdiff;
+            for (int i = i0; i <= iF; i++)
             {
-                double zdiff=ZZ(r) - k;
-                double zdiff2=zdiff*zdiff;
-                for (int i = i0; i <= iF; i++)
+                double ydiff=YY(r) - i;
+                double zydiff2=zdiff2+ydiff*ydiff;
+                for (int j = j0; j <= jF; j++)
                 {
-                    double ydiff=YY(r) - i;
-                    double zydiff2=zdiff2+ydiff*ydiff;
-                    for (int j = j0; j <= jF; j++)
+                    double xdiff=XX(r) - j;
+                    double rdiffModule2=zydiff2+xdiff*xdiff;
+                    if (rdiffModule2<radius2)
                     {
-                        double xdiff=XX(r) - j;
-                        double rdiffModule2=zydiff2+xdiff*xdiff;
-                        if (rdiffModule2<radius2)
-                        {
-                            double rdiffModule=sqrt(rdiffModule2);
-                            A3D_ELEM(mVlow,k, i, j) += atomProfiles.volumeAtDistance(
-                                                 atom.atomType[0],rdiffModule);
-                        }
+                        double rdiffModule=sqrt(rdiffModule2);
+                        A3D_ELEM(mVlow,k, i, j) += atomProfiles.volumeAtDistance(
+                                             atomType,rdiffModule);
                     }
                 }
             }
         }
-        catch (XmippError XE)
-        {
-        	if (verbose)
-        		std::cerr << "Ignoring atom of type *" << atom.atomType << "*" << std::endl;
-        }
-    }
+    };
+
+    rasterizeAtoms(mVlow, pdb.getNumberOfAtoms(), footprint, addAtom);
+}
 
-    // Save centered PDB
+/* Run --------------------------------------------------------------------- */
+void ProgPdbConverter::run()
+{
     if (doCenter && !fn_outPDB.empty())
     {
-        centered_pdb.write(fn_outPDB);
+        // All the fields are needed to write the centered PDB
+        PDBRichPhantom pdb;
+        pdb.read(fn_pdb);
+        produceSideInfo(pdb);
+        show();
+        convert(pdb);
+    }
+    else
+    {
+        PDBCompactPhantom pdb;
+        pdb.read(fn_pdb);
+        produceSideInfo(pdb.remarks);
+        show();
+        convert(pdb);
     }
+    if (useBlobs)
+        blobProperties();
+    if (fn_out!="")
+        Vlow.write(fn_out + ".vol");
 }
 
-/* Run --------------------------------------------------------------------- */
-void ProgPdbConverter::run()
+/* Convert ----------------------------------------------------------------- */
+void ProgPdbConverter::convert(PDBRichPhantom &pdb)
 {
-    produceSideInfo();
-    show();
-    computeProteinGeometry();
+    PDBCompactPhantom compactPDB;
+    compactPDB.fromRichPhantom(pdb);
+    convert(compactPDB);
+
+    if (doCenter)
+    {
+        for (auto& atom : pdb.atomList) {
+            atom.x -= XX(centerOfMass);
+            atom.y -= YY(centerOfMass);
+            atom.z -= ZZ(centerOfMass);
+        }
+
+        // Save centered PDB
+        if (!fn_outPDB.empty())
+            pdb.write(fn_outPDB);
+    }
+}
+
+void ProgPdbConverter::convert(const PDBCompactPhantom &pdb)
+{
+    computeProteinGeometry(pdb);
     if (useBlobs)
     {
-        createProteinAtHighSamplingRate();
+        createProteinAtHighSamplingRate(pdb);
         createProteinAtLowSamplingRate();
-        blobProperties();
     }
     else if (usePoorGaussian || useFixedGaussian)
     {
         highTs=Ts;
-        createProteinAtHighSamplingRate();
+        createProteinAtHighSamplingRate(pdb);
         Vlow=Vhigh;
         Vhigh.clear();
     }
     else
     {
-        createProteinUsingScatteringProfiles();
+        createProteinUsingScatteringProfiles(pdb);
     }
-    if (fn_out!="")
-        Vlow.write(fn_out + ".vol");
 }
@@ -25,6 +25,7 @@
 #ifndef _PROG_VOLUME_FROM_PDB_HH
 #  define _PROG_VOLUME_FROM_PDB_HH
 
+#include <functional>
 #include <data/blobs.h>
 #include <data/pdb.h>
 #include <core/xmipp_program.h>
@@ -78,6 +79,9 @@ public:
 
     /// Column for the intensity (if any). Only valid for fixed_gaussians
     std::string intensityColumn;
+
+    /// Number of threads
+    int numThreads;
 public:
     /** Empty constructor */
     ProgPdbConverter();
@@ -91,14 +95,29 @@ public:
     void readParams();
 
     /** Produce side information.
-        Produce the atomic profiles. */
-    void produceSideInfo();
+        Produce the atomic profiles. The remarks of the PDB are inspected
+        to find the Gaussian width of pseudoatoms. */
+    void produceSideInfo(const PDBRichPhantom &pdb);
+
+    /** Produce side information from the remarks of the PDB. */
+    void produceSideInfo(const std::vector<std::string> &remarks);
 
     /** Show parameters. */
     void show();
 
     /** Run. */
     void run();
+
+    /** Convert a structure already in memory.
+        produceSideInfo must have been called before. The volume is left
+        in Vlow and nothing is written to disk. If the PDB has to be
+        centered, the atoms are moved in place. */
+    void convert(PDBRichPhantom &pdb);
+
+    /** Convert a compact structure already in memory.
+        Same as the previous function, the atoms are not moved if the PDB
+        has to be centered. */
+    void convert(const PDBCompactPhantom &pdb);
 public:
     /* Downsampling factor */
     int M;
@@ -131,16 +150,30 @@ public:
         double &weight, double &radius) const;
 
     /* Protein geometry */
-    void computeProteinGeometry();
+    void computeProteinGeometry(const PDBCompactPhantom &pdb);
+
+    /* Shift applied to the atoms, minus the center of mass if centering */
+    void atomShift(double &shiftX, double &shiftY, double &shiftZ) const;
+
+    /* Add the atoms to a volume in parallel.
+       The volume is split in slabs along Z, and the atoms are binned into
+       the slabs they overlap. Each thread fills whole slabs adding the atoms
+       in their order in the PDB, so the result does not depend on the number
+       of threads. footprint(n, zMin, zMax) gives the first and last Z
+       (pixels) touched by atom n or returns false if it is not added.
+       addAtom(n, k0, kF) adds atom n to the planes k0 to kF. */
+    void rasterizeAtoms(const MultidimArray<double> &V, size_t Natoms,
+                        const std::function<bool(size_t, double &, double &)> &footprint,
+                        const std::function<void(size_t, int, int)> &addAtom) const;
 
     /* Create protein at a high sampling rate */
-    void createProteinAtHighSamplingRate();
+    void createProteinAtHighSamplingRate(const PDBCompactPhantom &pdb);
 
     /* Create protein at a low sampling rate */
     void createProteinAtLowSamplingRate();
 
     /* Create protein using scattering profiles */
-    void createProteinUsingScatteringProfiles();
+    void createProteinUsingScatteringProfiles(const PDBCompactPhantom &pdb);
 };
 //@}
 #endif
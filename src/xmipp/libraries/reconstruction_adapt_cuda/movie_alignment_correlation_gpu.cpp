@@ -136,33 +136,6 @@ auto ProgMovieAlignmentCorrelationGPU<T>::getCorrelationHint(const Dimensions &d
     return hint;
 }
 
-template<typename T>
-std::vector<FramePatchMeta<T>> ProgMovieAlignmentCorrelationGPU<T>::getPatchesLocation(
-        const std::pair<T, T> &borders, const Dimensions &patch) {
-    size_t patchesX = this->localAlignPatches.first;
-    size_t patchesY = this->localAlignPatches.second;
-    T windowXSize = this->getMovieSize().x() - 2 * borders.first;
-    T windowYSize = this->getMovieSize().y() - 2 * borders.second;
-    T corrX = std::ceil(((patchesX * patch.x()) - windowXSize) / (T) (patchesX - 1));
-    T corrY = std::ceil(((patchesY * patch.y()) - windowYSize) / (T) (patchesY - 1));
-    T stepX = (T)patch.x() - corrX;
-    T stepY = (T)patch.y() - corrY;
-    std::vector<FramePatchMeta<T>> result;
-    for (size_t y = 0; y < patchesY; ++y) {
-        for (size_t x = 0; x < patchesX; ++x) {
-            T tlx = borders.first + x * stepX; // Top Left
-            T tly = borders.second + y * stepY;
-            T brx = tlx + patch.x() - 1; // Bottom Right
-            T bry = tly + patch.y() - 1; // -1 for indexing
-            Point2D<T> tl(tlx, tly);
-            Point2D<T> br(brx, bry);
-            Rectangle<Point2D<T>> r(tl, br);
-            result.emplace_back(FramePatchMeta<T> { .rec = r, .id_x = x, .id_y = y });
-        }
-    }
-    return result;
-}
-
 template<typename T>
 void ProgMovieAlignmentCorrelationGPU<T>::getPatchData(const Rectangle<Point2D<T>> &patch, 
         const AlignmentResult<T> &globAlignment, T *result) {
@@ -201,26 +174,6 @@ void ProgMovieAlignmentCorrelationGPU<T>::getPatchData(const Rectangle<Point2D<T
     }
 }
 
-template<typename T>
-std::pair<T,T> ProgMovieAlignmentCorrelationGPU<T>::getMovieBorders(
-        const AlignmentResult<T> &globAlignment, int verbose) {
-    T minX = std::numeric_limits<T>::max();
-    T maxX = std::numeric_limits<T>::min();
-    T minY = std::numeric_limits<T>::max();
-    T maxY = std::numeric_limits<T>::min();
-    for (const auto& s : globAlignment.shifts) {
-        minX = std::min(std::floor(s.x), minX);
-        maxX = std::max(std::ceil(s.x), maxX);
-        minY = std::min(std::floor(s.y), minY);
-        maxY = std::max(std::ceil(s.y), maxY);
-    }
-    auto res = std::make_pair(std::abs(maxX - minX), std::abs(maxY - minY));
-    if (verbose > 1) {
-        std::cout << "Movie borders: x=" << res.first << " y=" << res.second << std::endl;
-    }
-    return res;
-}
-
 template<typename T>
 void ProgMovieAlignmentCorrelationGPU<T>::LAOptimize() {
     const auto pSize = findGoodPatchSize();
@@ -296,7 +249,7 @@ LocalAlignmentResult<T> ProgMovieAlignmentCorrelationGPU<T>::computeLocalAlignme
         REPORT_ERROR(ERR_PARAM_INCORRECT, "Movie is too small for local alignment.");
     }
 
-    auto borders = getMovieBorders(globAlignment, this->verbose > 1);
+    auto borders = this->getMovieBorders(globAlignment, this->verbose > 1);
     auto patchesLocation = this->getPatchesLocation(borders, LASP.movie);
     const auto actualScale = static_cast<float>(LASP.out.x()) / static_cast<float>(LASP.movie.x()); // assuming we use square patches
 
@@ -435,7 +388,7 @@ LocalAlignmentResult<T> ProgMovieAlignmentCorrelationGPU<T>::localFromGlobal(
     // we use the value of global shift for all patches instead
     LAOptimize();
     const auto movieSize = this->getMovieSize();
-    const auto borders = getMovieBorders(globAlignment, this->verbose > 1);
+    const auto borders = this->getMovieBorders(globAlignment, this->verbose > 1);
     auto patchesLocation = this->getPatchesLocation(borders, LASP.movie);
     LocalAlignmentResult<T> result { globalHint:globAlignment, movieDim:movieSize };
     // get alignment for all patches
@@ -70,14 +70,6 @@ private:
      */
     auto getCorrelationHint(const Dimensions &d);
 
-    /**
-     * Returns position of all local alignment patches within a single frame
-     * @param borders that should be left intact
-     * @param patch size
-     */
-    std::vector<FramePatchMeta<T>> getPatchesLocation(const std::pair<T, T> &borders,
-            const Dimensions &patch);
-
     /**
      * Returns a 'window' of all frames at specific position, taking into account the 
      * global shift and summing of frames
@@ -89,15 +81,6 @@ private:
             const AlignmentResult<T> &globAlignment,
             T *result);
 
-    /**
-     * Returns the X and Y offset such that if you read from any frame after applying its global
-     * shift, you will always read valid data
-     * @param globAlignment to use
-     * @param verbose level
-     * @return no of pixels in X (Y) dimension where there might NOT be data from each frame
-     */
-    std::pair<T,T> getMovieBorders(const AlignmentResult<T> &globAlignment, int verbose);
-
     /**
      * This method optimizes and sets sizes and additional parameters for the local alignment
     */
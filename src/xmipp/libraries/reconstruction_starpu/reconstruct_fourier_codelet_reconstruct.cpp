@@ -29,6 +29,8 @@
 #include <core/xmipp_fft.h>
 #include <core/xmipp_fftw.h>
 #include <reconstruction/reconstruct_fourier_projection_traverse_space.h>
+#include <reconstruction/reconstruct_fourier_blob_avx2.h>
+#include <data/cpu.h>
 
 #include <reconstruction_cuda/cuda_basic_math.h>
 #include <reconstruction_cuda/cuda_xmipp_utils.h>
@@ -1101,6 +1103,119 @@ void processProjectionCPU(
 	}
 }
 
+#ifdef RECFOURIER_AVX2
+/** Interval [from, to] of X in [minX, maxX] where the voxels of the row with
+ * coordinate 'c' can lie between the two (parallel) planes of the projection.
+ * The coordinate of the planes is linear in X; b0, t0 are its values at minX and
+ * b1, t1 at maxX. One voxel of margin is kept on each side.
+ * Returns false if the row does not cross the slab.
+ */
+bool slabRunCPU(int c, int minX, int maxX, float b0, float b1, float t0, float t1, int &from, int &to)
+{
+	const float lo = fminf(b0, t0) - 1.f;
+	const float hi = fmaxf(b0, t0) + 1.f;
+	const float slope = (maxX > minX) ? (b1 - b0) / (maxX - minX) : 0.f;
+	if (0.f == slope) {
+		from = minX;
+		to = maxX;
+		return (c >= lo) && (c <= hi);
+	}
+	float xa = minX + (c - hi) / slope;
+	float xb = minX + (c - lo) / slope;
+	if (xa > xb) std::swap(xa, xb);
+	from = std::max(minX, (int)floorf(xa));
+	to = std::min(maxX, (int)ceilf(xb));
+	return from <= to;
+}
+
+/** Blob gridding of the projection with the lookup table, using the AVX2 kernel
+ * shared with reconstruct_fourier_accel.
+ * The voxels are visited in runs along X. In the XY and XZ directions, the runs are
+ * the parts of the rows that can cross the slab around the projection plane;
+ * the kernel discards the voxels that are farther than the blob radius from the
+ * plane, so the result is the same as processProjectionCPU<false, ...>.
+ */
+void processProjectionCPUAVX2(
+		float2* tempVolumeGPU, float *tempWeightsGPU,
+		const int xSize, const int ySize,
+		const float2* __restrict__ FFT,
+		const RecFourierProjectionTraverseSpace* const tSpace,
+		const float* blobTableSqrt) {
+	RecFourierBlobRun run;
+	run.pixels = reinterpret_cast<const float*>(FFT);
+	run.pixelStride = 2;
+	run.hasCTF = false;
+	run.sizeX = xSize;
+	run.sizeY = ySize;
+	run.radius = cpuC.cBlobRadius;
+	run.blobTableSqrt = blobTableSqrt;
+	run.iDeltaSqrt = cpuC.cIDeltaSqrt;
+	run.centerX = cpuC.cMaxVolumeIndexX / 2;
+	run.centerYZ = cpuC.cMaxVolumeIndexYZ / 2;
+	run.weight = tSpace->weight;
+	run.maxDistanceSqr = tSpace->maxDistanceSqr;
+	run.transform = tSpace->transformInv;
+
+	const int sizeVolX = cpuC.cMaxVolumeIndexX + 1;
+	const int sizeVolXY = sizeVolX * (cpuC.cMaxVolumeIndexYZ + 1);
+	auto processRun = [&](int from, int to, int y, int z) {
+		float2 *volRow = tempVolumeGPU + z * sizeVolXY + y * sizeVolX;
+		float *weightsRow = tempWeightsGPU + z * sizeVolXY + y * sizeVolX;
+		// use atomic as two workers can write to same voxel
+		recFourierBlobRunAVX2(run, from, to, y, z, [volRow, weightsRow](int x, float w, float re, float im) {
+			atomicAddFloat(&volRow[x].x, re);
+			atomicAddFloat(&volRow[x].y, im);
+			atomicAddFloat(&weightsRow[x], w);
+		});
+	};
+
+	const int minX = tSpace->minX;
+	const int maxX = tSpace->maxX;
+	int from, to;
+	if (tSpace->XY == tSpace->dir) { // rows of XZ planes
+		for (int y = tSpace->minY; y <= tSpace->maxY; y++) {
+			float b0 = getZ(minX, y, tSpace->unitNormal, tSpace->bottomOrigin);
+			float b1 = getZ(maxX, y, tSpace->unitNormal, tSpace->bottomOrigin);
+			float t0 = getZ(minX, y, tSpace->unitNormal, tSpace->topOrigin);
+			float t1 = getZ(maxX, y, tSpace->unitNormal, tSpace->topOrigin);
+			int lower = static_cast<int>(floorf(clamp(fminf(fminf(b0, b1), fminf(t0, t1)), 0, cpuC.cMaxVolumeIndexYZ)));
+			int upper = static_cast<int>(ceilf(clamp(fmaxf(fmaxf(b0, b1), fmaxf(t0, t1)), 0, cpuC.cMaxVolumeIndexYZ)));
+			for (int z = lower; z <= upper; z++) {
+				if (slabRunCPU(z, minX, maxX, b0, b1, t0, t1, from, to)) {
+					processRun(from, to, y, z);
+				}
+			}
+		}
+	} else if (tSpace->XZ == tSpace->dir) { // rows of XY planes
+		for (int z = tSpace->minZ; z <= tSpace->maxZ; z++) {
+			float b0 = getY(minX, z, tSpace->unitNormal, tSpace->bottomOrigin);
+			float b1 = getY(maxX, z, tSpace->unitNormal, tSpace->bottomOrigin);
+			float t0 = getY(minX, z, tSpace->unitNormal, tSpace->topOrigin);
+			float t1 = getY(maxX, z, tSpace->unitNormal, tSpace->topOrigin);
+			int lower = static_cast<int>(floorf(clamp(fminf(fminf(b0, b1), fminf(t0, t1)), 0, cpuC.cMaxVolumeIndexYZ)));
+			int upper = static_cast<int>(ceilf(clamp(fmaxf(fmaxf(b0, b1), fmaxf(t0, t1)), 0, cpuC.cMaxVolumeIndexYZ)));
+			for (int y = lower; y <= upper; y++) {
+				if (slabRunCPU(y, minX, maxX, b0, b1, t0, t1, from, to)) {
+					processRun(from, to, y, z);
+				}
+			}
+		}
+	} else { // the slab is crossed along X, same runs as processProjectionCPU
+		for (int z = tSpace->minZ; z <= tSpace->maxZ; z++) {
+			for (int y = tSpace->minY; y <= tSpace->maxY; y++) {
+				float x1 = getX(y, z, tSpace->unitNormal, tSpace->bottomOrigin); // lower plane
+				float x2 = getX(y, z, tSpace->unitNormal, tSpace->topOrigin); // upper plane
+				x1 = clamp(x1, 0, cpuC.cMaxVolumeIndexX);
+				x2 = clamp(x2, 0, cpuC.cMaxVolumeIndexX);
+				int lower = static_cast<int>(floorf(fminf(x1, x2)));
+				int upper = static_cast<int>(ceilf(fmaxf(x1, x2)));
+				processRun(lower, upper, y, z);
+			}
+		}
+	}
+}
+#endif
+
 template<int blobOrder, bool useFastKaiser, bool usePrecomputedInterpolation>
 void processBufferCPU(
 		float2 *outVolumeBuffer, float *outWeightsBuffer,
@@ -1112,12 +1227,26 @@ void processBufferCPU(
 
 	const int groupSize = starpu_combined_worker_get_size();
 	const int groupRank = starpu_combined_worker_get_rank();
+#ifdef RECFOURIER_AVX2
+	const bool useAVX2 = usePrecomputedInterpolation && !fastLateBlobbing && CPU::hasAVX2();
+#endif
 
 	for (int i = groupRank; i < traverseSpaceCount; i += groupSize) {
 		const RecFourierProjectionTraverseSpace &space = traverseSpaces[i];
 
 		const float2* spaceFFT = inFFTs + fftSizeX * fftSizeY * space.projectionIndex;
 
+#ifdef RECFOURIER_AVX2
+		if (useAVX2) {
+			processProjectionCPUAVX2(
+					outVolumeBuffer, outWeightsBuffer,
+					fftSizeX, fftSizeY,
+					spaceFFT,
+					&space,
+					blobTableSqrt);
+			continue;
+		}
+#endif
 		// by using templates, we can save some registers, especially for 'fast' version
 		if (fastLateBlobbing) {
 			processProjectionCPU<true, blobOrder, useFastKaiser, usePrecomputedInterpolation>(
@@ -349,6 +349,41 @@ class PythonBindingTest(unittest.TestCase):
                       [ 0.90717429, 0.6812411, -0.09380955]])
         self.assertEqual(Z.all(), Zref.all())
 
+    def test_Image_getDataView(self):
+        img1 = Image(self.createTmpFile("singleImage.spi"))
+        Z = img1.getData(False)
+        Z[0, 0] = 5.
+        self.assertAlmostEqual(img1.getPixel(0, 0, 0, 0), 5.)
+        del img1 # the view keeps the image alive
+        self.assertAlmostEqual(Z[0, 0], 5.)
+
+    def test_Image_setDataNoCopy(self):
+        from numpy import zeros, float32
+        data = zeros((3, 4), dtype=float32)
+        img = Image()
+        img.setData(data, False)
+        data[1, 2] = 7.
+        self.assertAlmostEqual(img.getPixel(0, 0, 1, 2), 7.)
+        self.assertEqual(img.getDimensions(), (4, 3, 1, 1))
+        img.setData(zeros((2, 2), dtype=float32))
+        data[1, 2] = 1.
+        self.assertEqual(img.getDimensions(), (2, 2, 1, 1))
+
+    def test_StackReader(self):
+        from numpy import allclose
+        stackPath = self.createTmpFile("proj_ctf_1.stk")
+        reader = StackReader(stackPath, 2)
+        xdim, ydim, ndim = reader.getDimensions()
+        n = 0
+        for block in reader:
+            self.assertEqual(block.shape[1:], (ydim, xdim))
+            for i in range(block.shape[0]):
+                n += 1
+                img = Image("%d@%s" % (n, stackPath))
+                img.convert2DataType(DT_FLOAT)
+                self.assertTrue(allclose(block[i], img.getData()))
+        self.assertEqual(n, ndim)
+
     def test_Image_initConstant(self):
         imgPath = self.createTmpFile("singleImage.spi")
         img = Image(imgPath)
@@ -50,6 +50,27 @@ class XmippProgramTest(ProgramTest):
         ProgramTest.runCase(self, *args, **kwargs)
 
 
+class AngularAssignmentMag(XmippProgramTest):
+    _owner = COSS
+    @classmethod
+    def getProgram(cls):
+        return 'xmipp_angular_assignment_mag'
+
+    def test_case1(self):
+        # The assignment of an image must not depend on the number of threads
+        self.runCase("-i input/aFewProjections.sel -o %o/assigned_thr2.xmd -ref %o/reference.doc -odir %o -angleStep 10 --thr 2",
+                preruns=["xmipp_angular_project_library -i input/phantomBacteriorhodopsin.vol -o %o/reference.stk --sampling_rate 10",
+                         "xmipp_angular_assignment_mag -i input/aFewProjections.sel -o %o/assigned_thr1.xmd -ref %o/reference.doc -odir %o -angleStep 10 --thr 1"],
+                validate=self.validate_case1)
+
+    def validate_case1(self):
+        import xmippLib
+        fnThr1 = os.path.join(self.outputDir, "assigned_thr1.xmd")
+        fnThr2 = os.path.join(self.outputDir, "assigned_thr2.xmd")
+        msg = "Assignments with 1 and 2 threads are not equal:\n  %s\n  %s" % (fnThr1, fnThr2)
+        self.assertTrue(xmippLib.compareTwoMetadataFiles(fnThr1, fnThr2), red(msg))
+
+
 class AngularDiscreteAssign(XmippProgramTest):
     _owner = COSS
     @classmethod